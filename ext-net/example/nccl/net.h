@@ -25,6 +25,8 @@ typedef enum {NCCL_INIT=1, NCCL_COLL=2, NCCL_P2P=4, NCCL_SHM=8, NCCL_NET=16, NCC
 typedef void (*ncclDebugLogger_t)(ncclDebugLogLevel level, unsigned long flags, const char *file, int line, const char *fmt, ...);
 
 #include "net_v6.h"
+#include "net_sochin_v1.h"
+#include "net_sochin_v2.h"
 #include "net_v5.h"
 #include "net_v4.h"
 #include "net_v3.h"
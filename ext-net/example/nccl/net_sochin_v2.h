@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2017-2023, NVIDIA CORPORATION. All rights reserved.
+ */
+
+#ifndef NCCL_NET_SOCHIN_V2_H_
+#define NCCL_NET_SOCHIN_V2_H_
+
+// sochin v2 keeps the v6 properties
+typedef struct {
+  // Name of the network (mainly for logs)
+  const char* name;
+  // Initialize the network.
+  ncclResult_t (*init)(ncclDebugLogger_t logFunction);
+  // Return the number of adapters.
+  ncclResult_t (*devices)(int* ndev);
+  // Get various device properties.
+  ncclResult_t (*getProperties)(int dev, ncclNetProperties_v6_t* props);
+  // Create a receiving object and provide a handle to connect to it. The
+  // handle can be up to NCCL_NET_HANDLE_MAXSIZE bytes and will be exchanged
+  // between ranks to create a connection.
+  ncclResult_t (*listen)(int dev, void* handle, void** listenComm);
+  // Connect to a handle and return a sending comm object for that peer.
+  // This call must not block for the connection to be established, and instead
+  // should return successfully with sendComm == NULL with the expectation that
+  // it will be called again until sendComm != NULL.
+  ncclResult_t (*connect)(int dev, void* handle, void** sendComm);
+  // Finalize connection establishment after remote peer has called connect.
+  // This call must not block for the connection to be established, and instead
+  // should return successfully with recvComm == NULL with the expectation that
+  // it will be called again until recvComm != NULL.
+  ncclResult_t (*accept)(void* listenComm, void** recvComm);
+  // Register/Deregister memory. Comm can be either a sendComm or a recvComm.
+  // Type is either NCCL_PTR_HOST or NCCL_PTR_CUDA. Size can go beyond 2GB.
+  ncclResult_t (*regMr)(void* comm, void* data, size_t size, int type, void** mhandle);
+  /* DMA-BUF support */
+  ncclResult_t (*regMrDmaBuf)(void* comm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle);
+  ncclResult_t (*deregMr)(void* comm, void* mhandle);
+  // Asynchronous send to a peer.
+  // May return request == NULL if the call cannot be performed (or would block)
+  ncclResult_t (*isend)(void* sendComm, void* data, int size, int tag, void* mhandle, void** request);
+  // Asynchronous recv from a peer.
+  // May return request == NULL if the call cannot be performed (or would block)
+  ncclResult_t (*irecv)(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** request);
+  // Perform a flush/fence to make sure all data received with NCCL_PTR_CUDA is
+  // visible to the GPU
+  ncclResult_t (*iflush)(void* recvComm, int n, void** data, int* sizes, void** mhandles, void** request);
+  // Test whether a request is complete. If size is not NULL, it returns the
+  // number of bytes sent/received.
+  ncclResult_t (*test)(void* request, int* done, int* sizes);
+  // Close and free send/recv comm objects
+  ncclResult_t (*closeSend)(void* sendComm);
+  ncclResult_t (*closeRecv)(void* recvComm);
+  ncclResult_t (*closeListen)(void* listenComm);
+  // Post n sends to the same peer at once, in order, as n calls to isend would.
+  // The first *nPosted of them are posted and get their request; the others
+  // could not be performed and will be given again later.
+  // Optional, may be NULL.
+  ncclResult_t (*isendv)(void* sendComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted);
+  // Test n requests of the same comm at once, in order, stopping at the first
+  // one which is not complete. The first *nDone requests are complete, as if
+  // test had returned done for each of them. If sizes is not NULL, it returns
+  // the number of bytes sent/received by each of them.
+  // Optional, may be NULL.
+  ncclResult_t (*testBatch)(int n, void** requests, int* nDone, int* sizes);
+  // Same as irecv, and in addition once the data of receive i is visible in
+  // memory, the network itself writes values[i] to the 64-bit signals[i], which
+  // lies in host memory registered with regMr as signalMhandles[i]. NCCL uses this
+  // to let the NIC update the tail counter the GPU waits on, without waiting for
+  // the proxy to see the completion. The request still needs to be tested.
+  // Optional, may be NULL.
+  ncclResult_t (*irecvSignal)(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles,
+      uint64_t** signals, uint64_t* values, void** signalMhandles, void** request);
+  // Post the receives of several steps at once, in order, as nRecvs calls to
+  // irecv would. Receive r has n[r] buffers, taken in turn from data, sizes,
+  // tags and mhandles. The first *nPosted receives are posted and get their
+  // request; the others will be given again later. Lets the network post one
+  // descriptor for several steps, e.g. with hardware tag matching or
+  // multi-packet receive buffers.
+  // Optional, may be NULL.
+  ncclResult_t (*irecvv)(void* recvComm, int nRecvs, int* n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted);
+} ncclNet_sochin_v2_t;
+
+#endif // end include guard
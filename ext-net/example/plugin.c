@@ -23,7 +23,7 @@ __hidden ncclResult_t pluginGetProperties(int dev, ncclNetProperties_v6_t* props
 __hidden ncclResult_t pluginListen(int dev, void* handle, void** listenComm) { return ncclInternalError; }
 __hidden ncclResult_t pluginConnect(int dev, void* handle, void** sendComm) { return ncclInternalError; }
 __hidden ncclResult_t pluginAccept(void* listenComm, void** recvComm) { return ncclInternalError; }
-__hidden ncclResult_t pluginRegMr(void* collComm, void* data, int size, int type, void** mhandle) { return ncclInternalError; }
+__hidden ncclResult_t pluginRegMr(void* collComm, void* data, size_t size, int type, void** mhandle) { return ncclInternalError; }
 __hidden ncclResult_t pluginRegMrDmaBuf(void* collComm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle) { return ncclInternalError; }
 __hidden ncclResult_t pluginDeregMr(void* collComm, void* mhandle) { return ncclInternalError;}
 __hidden ncclResult_t pluginIsend(void* sendComm, void* data, int size, int tag, void* mhandle, void** request) { return ncclInternalError; }
@@ -33,10 +33,15 @@ __hidden ncclResult_t pluginTest(void* request, int* done, int* size) { return n
 __hidden ncclResult_t pluginCloseSend(void* sendComm) { return ncclInternalError; }
 __hidden ncclResult_t pluginCloseRecv(void* recvComm) { return ncclInternalError; }
 __hidden ncclResult_t pluginCloseListen(void* listenComm) { return ncclInternalError; }
+__hidden ncclResult_t pluginIsendv(void* sendComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted) { return ncclInternalError; }
+__hidden ncclResult_t pluginTestBatch(int n, void** requests, int* nDone, int* sizes) { return ncclInternalError; }
+__hidden ncclResult_t pluginIrecvSignal(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles,
+    uint64_t** signals, uint64_t* values, void** signalMhandles, void** request) { return ncclInternalError; }
+__hidden ncclResult_t pluginIrecvv(void* recvComm, int nRecvs, int* n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted) { return ncclInternalError; }
 
 #define PLUGIN_NAME "Plugin"
 
-const ncclNet_v6_t ncclNetPlugin_v6 = {
+const ncclNet_sochin_v2_t ncclNetPlugin_sochin_v2 = {
   .name = PLUGIN_NAME,
   .init = pluginInit,
   .devices = pluginDevices,
@@ -54,6 +59,57 @@ const ncclNet_v6_t ncclNetPlugin_v6 = {
   .closeSend = pluginCloseSend,
   .closeRecv = pluginCloseRecv,
   .closeListen = pluginCloseListen,
+  .isendv = pluginIsendv,
+  .testBatch = pluginTestBatch,
+  .irecvSignal = pluginIrecvSignal,
+  .irecvv = pluginIrecvv,
+};
+
+/* sochin v1 Compat */
+static ncclResult_t pluginRegMr_sochin_v1(void* collComm, void* data, int size, int type, void** mhandle) {
+  return pluginRegMr(collComm, data, (size_t)size, type, mhandle);
+}
+const ncclNet_sochin_v1_t ncclNetPlugin_sochin_v1 = {
+  .name = PLUGIN_NAME,
+  .init = pluginInit,
+  .devices = pluginDevices,
+  .getProperties = pluginGetProperties,
+  .listen = pluginListen,
+  .connect = pluginConnect,
+  .accept = pluginAccept,
+  .regMr = pluginRegMr_sochin_v1,
+  .regMrDmaBuf = pluginRegMrDmaBuf,
+  .deregMr = pluginDeregMr,
+  .isend = pluginIsend,
+  .irecv = pluginIrecv,
+  .iflush = pluginIflush,
+  .test = pluginTest,
+  .closeSend = pluginCloseSend,
+  .closeRecv = pluginCloseRecv,
+  .closeListen = pluginCloseListen,
+  .isendv = pluginIsendv,
+  .testBatch = pluginTestBatch,
+};
+
+/* v6 Compat */
+const ncclNet_v6_t ncclNetPlugin_v6 = {
+  .name = PLUGIN_NAME,
+  .init = pluginInit,
+  .devices = pluginDevices,
+  .getProperties = pluginGetProperties,
+  .listen = pluginListen,
+  .connect = pluginConnect,
+  .accept = pluginAccept,
+  .regMr = pluginRegMr_sochin_v1,
+  .regMrDmaBuf = pluginRegMrDmaBuf,
+  .deregMr = pluginDeregMr,
+  .isend = pluginIsend,
+  .irecv = pluginIrecv,
+  .iflush = pluginIflush,
+  .test = pluginTest,
+  .closeSend = pluginCloseSend,
+  .closeRecv = pluginCloseRecv,
+  .closeListen = pluginCloseListen,
 };
 
 /* v5 Compat */
@@ -65,7 +121,7 @@ const ncclNet_v5_t ncclNetPlugin_v5 = {
   .listen = pluginListen,
   .connect = pluginConnect,
   .accept = pluginAccept,
-  .regMr = pluginRegMr,
+  .regMr = pluginRegMr_sochin_v1,
   .deregMr = pluginDeregMr,
   .isend = pluginIsend,
   .irecv = pluginIrecv,
@@ -122,7 +178,7 @@ const ncclNet_v4_t ncclNetPlugin_v4 = {
   .listen = pluginListen,
   .connect = pluginConnect_v4,
   .accept = pluginAccept_v4,
-  .regMr = pluginRegMr,
+  .regMr = pluginRegMr_sochin_v1,
   .deregMr = pluginDeregMr,
   .isend = pluginIsend_v4,
   .irecv = pluginIrecv_v4,
@@ -167,7 +223,7 @@ const ncclNet_v3_t ncclNetPlugin_v3 = {
   .listen = pluginListen_v3,
   .connect = pluginConnect_v3,
   .accept = pluginAccept_v4,
-  .regMr = pluginRegMr,
+  .regMr = pluginRegMr_sochin_v1,
   .deregMr = pluginDeregMr,
   .isend = pluginIsend_v4,
   .irecv = pluginIrecv_v4,
@@ -188,7 +244,7 @@ const ncclNet_v2_t ncclNetPlugin_v2 = {
   .listen = pluginListen,
   .connect = pluginConnect_v4,
   .accept = pluginAccept_v4,
-  .regMr = pluginRegMr,
+  .regMr = pluginRegMr_sochin_v1,
   .deregMr = pluginDeregMr,
   .isend = pluginIsend_v4,
   .irecv = pluginIrecv_v4,
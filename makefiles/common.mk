@@ -13,6 +13,8 @@ TRACE ?= 0
 PROFAPI ?= 1
 NVTX ?= 1
 RDMA_CORE ?= 0
+MLX5DV ?= 0
+SLIM_KERNELS ?= 0
 
 NVCC = $(CUDA_HOME)/bin/nvcc
 
@@ -43,6 +45,14 @@ CUDA11_PTX    = -gencode=arch=compute_80,code=compute_80
 CUDA12_PTX    = -gencode=arch=compute_90,code=compute_90
 
 
+# NCCL_ARCHS="80 90" is a shorthand for a lean build with SASS for those
+# archs only, plus PTX for the last one.
+NCCL_ARCHS ?=
+ifneq ($(strip $(NCCL_ARCHS)),)
+  NVCC_GENCODE := $(foreach arch,$(NCCL_ARCHS),-gencode=arch=compute_$(arch),code=sm_$(arch)) \
+                  -gencode=arch=compute_$(lastword $(NCCL_ARCHS)),code=compute_$(lastword $(NCCL_ARCHS))
+endif
+
 ifeq ($(shell test "0$(CUDA_MAJOR)" -eq 11 -a "0$(CUDA_MINOR)" -ge 8 -o "0$(CUDA_MAJOR)" -gt 11; echo $$?),0)
 # Include Hopper support if we're using CUDA11.8 or above
   NVCC_GENCODE ?= $(CUDA8_GENCODE) $(CUDA9_GENCODE) $(CUDA11_GENCODE) $(CUDA12_GENCODE) $(CUDA12_PTX)
@@ -55,6 +65,9 @@ else
   NVCC_GENCODE ?= $(CUDA8_GENCODE) $(CUDA8_PTX)
 endif
 $(info NVCC_GENCODE is ${NVCC_GENCODE})
+# Device objects of each arch set go to their own directory, so that switching
+# between lean builds does not recompile every kernel.
+DEVICE_BUILD_TAG := $(shell echo "$(NVCC_GENCODE) $(SLIM_KERNELS)" | cksum | cut -d " " -f 1)
 
 CXXFLAGS   := -DCUDA_MAJOR=$(CUDA_MAJOR) -DCUDA_MINOR=$(CUDA_MINOR) -fPIC -fvisibility=hidden \
               -Wall -Wno-unused-function -Wno-sign-compare -std=c++11 -Wvla \
@@ -111,3 +124,13 @@ endif
 ifneq ($(RDMA_CORE), 0)
 CXXFLAGS += -DNCCL_BUILD_RDMA_CORE=1
 endif
+
+ifneq ($(MLX5DV), 0)
+CXXFLAGS += -DNCCL_BUILD_MLX5DV=1
+endif
+
+# Build rare reduction op/datatype pairs as one generic kernel per datatype, see collectives.h
+ifneq ($(SLIM_KERNELS), 0)
+CXXFLAGS  += -DNCCL_SLIM_KERNELS=1
+NVCUFLAGS += -DNCCL_SLIM_KERNELS=1
+endif
@@ -94,72 +94,144 @@ static ncclResult_t setFilesLimit() {
   return ncclSuccess;
 }
 
-static void *bootstrapRoot(void* rargs) {
-  struct bootstrapRootArgs* args = (struct bootstrapRootArgs*)rargs;
-  struct ncclSocket* listenSock = args->listenSock;
-  uint64_t magic = args->magic;
-  ncclResult_t res = ncclSuccess;
-  int nranks = 0, c = 0;
-  struct extInfo info;
-  union ncclSocketAddress *rankAddresses = NULL;
-  union ncclSocketAddress *rankAddressesRoot = NULL; // for initial rank <-> root information exchange
-  union ncclSocketAddress *zero = NULL;
-  NCCLCHECKGOTO(ncclCalloc(&zero, 1), res, out);
-  setFilesLimit();
+NCCL_PARAM(BootstrapRootThreads, "BOOTSTRAP_ROOT_THREADS", 8);
+#define BOOTSTRAP_ROOT_RANKS_PER_THREAD 64
 
-  TRACE(NCCL_INIT, "BEGIN");
-  /* Receive addresses from all ranks */
-  do {
-    struct ncclSocket sock;
-    NCCLCHECKGOTO(ncclSocketInit(&sock), res, out);
-    NCCLCHECKGOTO(ncclSocketAccept(&sock, listenSock), res, out);
-    NCCLCHECKGOTO(bootstrapNetRecv(&sock, &info, sizeof(info)), res, out);
-    NCCLCHECKGOTO(ncclSocketClose(&sock), res, out);
-
-    if (c == 0) {
-      nranks = info.nranks;
-      NCCLCHECKGOTO(ncclCalloc(&rankAddresses, nranks), res, out);
-      NCCLCHECKGOTO(ncclCalloc(&rankAddressesRoot, nranks), res, out);
-    }
-
-    if (nranks != info.nranks) {
-      WARN("Bootstrap Root : mismatch in rank count from procs %d : %d", nranks, info.nranks);
-      goto out;
-    }
+struct bootstrapRootState {
+  struct ncclSocket* listenSock;
+  uint64_t magic;
+  int nranks;
+  int next; // Next rank to handle, claimed atomically by the root threads
+  ncclResult_t error;
+  pthread_mutex_t lock;
+  union ncclSocketAddress* rankAddresses;
+  union ncclSocketAddress* rankAddressesRoot; // for initial rank <-> root information exchange
+};
 
-    if (memcmp(zero, &rankAddressesRoot[info.rank], sizeof(union ncclSocketAddress)) != 0) {
-      WARN("Bootstrap Root : rank %d of %d ranks has already checked in", info.rank, nranks);
-      goto out;
-    }
+static ncclResult_t bootstrapRootRecvInfo(struct bootstrapRootState* state, struct extInfo* info) {
+  struct ncclSocket sock;
+  NCCLCHECK(ncclSocketInit(&sock));
+  NCCLCHECK(ncclSocketAccept(&sock, state->listenSock));
+  NCCLCHECK(bootstrapNetRecv(&sock, info, sizeof(struct extInfo)));
+  NCCLCHECK(ncclSocketClose(&sock));
+  return ncclSuccess;
+}
 
+static ncclResult_t bootstrapRootStoreInfo(struct bootstrapRootState* state, struct extInfo* info) {
+  static const union ncclSocketAddress zero = {};
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&state->lock);
+  if (state->nranks != info->nranks) {
+    WARN("Bootstrap Root : mismatch in rank count from procs %d : %d", state->nranks, info->nranks);
+    ret = ncclInvalidUsage;
+  } else if (memcmp(&zero, state->rankAddressesRoot+info->rank, sizeof(union ncclSocketAddress)) != 0) {
+    WARN("Bootstrap Root : rank %d of %d ranks has already checked in", info->rank, state->nranks);
+    ret = ncclInvalidUsage;
+  } else {
     // Save the connection handle for that rank
-    memcpy(rankAddressesRoot+info.rank, &info.extAddressListenRoot, sizeof(union ncclSocketAddress));
-    memcpy(rankAddresses+info.rank, &info.extAddressListen, sizeof(union ncclSocketAddress));
+    memcpy(state->rankAddressesRoot+info->rank, &info->extAddressListenRoot, sizeof(union ncclSocketAddress));
+    memcpy(state->rankAddresses+info->rank, &info->extAddressListen, sizeof(union ncclSocketAddress));
+  }
+  pthread_mutex_unlock(&state->lock);
+  return ret;
+}
 
-    ++c;
-    TRACE(NCCL_INIT, "Received connect from rank %d total %d/%d",  info.rank, c, nranks);
-  } while (c < nranks);
-  TRACE(NCCL_INIT, "COLLECTED ALL %d HANDLES", nranks);
+static void* bootstrapRootAcceptThread(void* arg) {
+  struct bootstrapRootState* state = (struct bootstrapRootState*)arg;
+  struct extInfo info;
+  int c;
+  while (__atomic_load_n(&state->error, __ATOMIC_RELAXED) == ncclSuccess &&
+         (c = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->nranks) {
+    ncclResult_t res = bootstrapRootRecvInfo(state, &info);
+    if (res == ncclSuccess) res = bootstrapRootStoreInfo(state, &info);
+    if (res != ncclSuccess) {
+      __atomic_store_n(&state->error, res, __ATOMIC_RELAXED);
+      break;
+    }
+    TRACE(NCCL_INIT, "Received connect from rank %d total %d/%d", info.rank, c+1, state->nranks);
+  }
+  return NULL;
+}
 
+static void* bootstrapRootSendThread(void* arg) {
+  struct bootstrapRootState* state = (struct bootstrapRootState*)arg;
+  int r;
   // Send the connect handle for the next rank in the AllGather ring
-  for (int r=0; r<nranks; ++r) {
-    int next = (r+1) % nranks;
+  while (__atomic_load_n(&state->error, __ATOMIC_RELAXED) == ncclSuccess &&
+         (r = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->nranks) {
+    int next = (r+1) % state->nranks;
     struct ncclSocket sock;
-    NCCLCHECKGOTO(ncclSocketInit(&sock, rankAddressesRoot+r, magic, ncclSocketTypeBootstrap), res, out);
-    NCCLCHECKGOTO(ncclSocketConnect(&sock), res, out);
-    NCCLCHECKGOTO(bootstrapNetSend(&sock, rankAddresses+next, sizeof(union ncclSocketAddress)), res, out);
-    NCCLCHECKGOTO(ncclSocketClose(&sock), res, out);
+    ncclResult_t res = ncclSocketInit(&sock, state->rankAddressesRoot+r, state->magic, ncclSocketTypeBootstrap);
+    if (res == ncclSuccess) res = ncclSocketConnect(&sock);
+    if (res == ncclSuccess) res = bootstrapNetSend(&sock, state->rankAddresses+next, sizeof(union ncclSocketAddress));
+    ncclSocketClose(&sock);
+    if (res != ncclSuccess) {
+      __atomic_store_n(&state->error, res, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Run fn on nThreads threads, including the calling one, and wait for all of them.
+static ncclResult_t bootstrapRootRun(struct bootstrapRootState* state, int nThreads, void* (*fn)(void*)) {
+  pthread_t* threads = NULL;
+  int nStarted = 0;
+  if (nThreads > 1) {
+    NCCLCHECK(ncclCalloc(&threads, nThreads-1));
+    for (; nStarted<nThreads-1; nStarted++) {
+      if (pthread_create(threads+nStarted, NULL, fn, state) != 0) {
+        INFO(NCCL_INIT, "Bootstrap Root : could only start %d/%d threads", nStarted+1, nThreads);
+        break;
+      }
+      ncclSetThreadName(threads[nStarted], "NCCL BootstrapR");
+    }
   }
-  TRACE(NCCL_INIT, "SENT OUT ALL %d HANDLES", nranks);
+  fn(state);
+  for (int t=0; t<nStarted; t++) pthread_join(threads[t], NULL);
+  free(threads);
+  return state->error;
+}
+
+static void *bootstrapRoot(void* rargs) {
+  struct bootstrapRootArgs* args = (struct bootstrapRootArgs*)rargs;
+  struct bootstrapRootState state = {};
+  ncclResult_t res = ncclSuccess;
+  int nThreads;
+  struct extInfo info;
+  state.listenSock = args->listenSock;
+  state.magic = args->magic;
+  pthread_mutex_init(&state.lock, NULL);
+  setFilesLimit();
+
+  TRACE(NCCL_INIT, "BEGIN");
+  /* Receive addresses from all ranks. The first one tells us how many we should expect. */
+  NCCLCHECKGOTO(bootstrapRootRecvInfo(&state, &info), res, out);
+  state.nranks = info.nranks;
+  NCCLCHECKGOTO(ncclCalloc(&state.rankAddresses, state.nranks), res, out);
+  NCCLCHECKGOTO(ncclCalloc(&state.rankAddressesRoot, state.nranks), res, out);
+  NCCLCHECKGOTO(bootstrapRootStoreInfo(&state, &info), res, out);
+  TRACE(NCCL_INIT, "Received connect from rank %d total %d/%d",  info.rank, 1, state.nranks);
+
+  // Accepting connections and sending the ring handles back are both dominated by socket round
+  // trips, so spread them over several threads for large jobs.
+  nThreads = std::max(1, std::min((int)ncclParamBootstrapRootThreads(), DIVUP(state.nranks, BOOTSTRAP_ROOT_RANKS_PER_THREAD)));
+  state.next = 1;
+  NCCLCHECKGOTO(bootstrapRootRun(&state, nThreads, bootstrapRootAcceptThread), res, out);
+  TRACE(NCCL_INIT, "COLLECTED ALL %d HANDLES", state.nranks);
+
+  state.next = 0;
+  NCCLCHECKGOTO(bootstrapRootRun(&state, nThreads, bootstrapRootSendThread), res, out);
+  TRACE(NCCL_INIT, "SENT OUT ALL %d HANDLES", state.nranks);
 
 out:
-  if (listenSock != NULL) {
-    ncclSocketClose(listenSock);
-    free(listenSock);
+  if (state.listenSock != NULL) {
+    ncclSocketClose(state.listenSock);
+    free(state.listenSock);
   }
-  if (rankAddresses) free(rankAddresses);
-  if (rankAddressesRoot) free(rankAddressesRoot);
-  if (zero) free(zero);
+  if (state.rankAddresses) free(state.rankAddresses);
+  if (state.rankAddressesRoot) free(state.rankAddressesRoot);
+  pthread_mutex_destroy(&state.lock);
   free(rargs);
 
   TRACE(NCCL_INIT, "DONE");
@@ -218,19 +290,78 @@ struct bootstrapState {
   union ncclSocketAddress* peerCommAddresses;
   union ncclSocketAddress* peerProxyAddresses;
   struct unexConn* unexpectedConnections;
+  // Node layout, used by the hierarchical AllGather. nodeRanks lists ranks grouped by node, node n
+  // owning nodeRanks[nodeRanksOffset[n]..nodeRanksOffset[n+1]-1]; nodes are numbered in order of
+  // their lowest rank.
+  int nNodes;
+  int* rankNode;
+  int* nodeRanks;
+  int* nodeRanksOffset;
   int cudaDev;
   int rank;
   int nranks;
   uint64_t magic;
   volatile uint32_t *abortFlag;
+  // Ring over the network plugin for bulk AllGathers, see bootstrapNetRingInit
+  ncclNet_t* net;
+  int netRingState; // 0 : not set up yet, 1 : ready, -1 : not used
+  void* netSendComm;
+  void* netRecvComm;
 };
 
+static ncclResult_t bootstrapRingAllGather(struct bootstrapState* state, void* allData, int size);
+
+struct bootstrapPeerInfo {
+  union ncclSocketAddress addr;
+  uint64_t hostHash;
+};
+
+// Gather the listen address and host of every rank over the bootstrap ring, then derive the node
+// layout used by the hierarchical AllGather.
+static ncclResult_t bootstrapExchangePeers(struct bootstrapState* state, union ncclSocketAddress* listenAddr) {
+  ncclResult_t ret = ncclSuccess;
+  int nranks = state->nranks;
+  struct bootstrapPeerInfo* peerInfo = NULL;
+  int* nodeCounts = NULL;
+  NCCLCHECKGOTO(ncclCalloc(&peerInfo, nranks), ret, exit);
+  memcpy(&peerInfo[state->rank].addr, listenAddr, sizeof(union ncclSocketAddress));
+  peerInfo[state->rank].hostHash = getHostHash();
+  NCCLCHECKGOTO(bootstrapRingAllGather(state, peerInfo, sizeof(struct bootstrapPeerInfo)), ret, exit);
+
+  NCCLCHECKGOTO(ncclCalloc(&state->peerCommAddresses, nranks), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&state->rankNode, nranks), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&state->nodeRanks, nranks), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&state->nodeRanksOffset, nranks+1), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&nodeCounts, nranks), ret, exit);
+  state->nNodes = 0;
+  for (int r=0; r<nranks; r++) {
+    memcpy(state->peerCommAddresses+r, &peerInfo[r].addr, sizeof(union ncclSocketAddress));
+    int n = 0;
+    while (n < state->nNodes && peerInfo[state->nodeRanks[n]].hostHash != peerInfo[r].hostHash) n++;
+    // Temporarily use nodeRanks to remember the first rank of each node
+    if (n == state->nNodes) state->nodeRanks[state->nNodes++] = r;
+    state->rankNode[r] = n;
+    nodeCounts[n]++;
+  }
+  for (int n=0; n<state->nNodes; n++) state->nodeRanksOffset[n+1] = state->nodeRanksOffset[n] + nodeCounts[n];
+  for (int n=0; n<state->nNodes; n++) nodeCounts[n] = 0;
+  for (int r=0; r<nranks; r++) {
+    int n = state->rankNode[r];
+    state->nodeRanks[state->nodeRanksOffset[n] + nodeCounts[n]++] = r;
+  }
+  TRACE(NCCL_INIT, "rank %d nranks %d nNodes %d", state->rank, nranks, state->nNodes);
+exit:
+  free(nodeCounts);
+  free(peerInfo);
+  return ret;
+}
+
 ncclResult_t bootstrapInit(struct ncclBootstrapHandle* handle, struct ncclComm* comm) {
   int rank = comm->rank;
   int nranks = comm->nRanks;
   struct bootstrapState* state;
   struct ncclSocket* proxySocket;
-  ncclSocketAddress nextAddr;
+  ncclSocketAddress nextAddr, listenAddr;
   struct ncclSocket sock, listenSockRoot;
   struct extInfo info = { 0 };
 
@@ -238,6 +369,7 @@ ncclResult_t bootstrapInit(struct ncclBootstrapHandle* handle, struct ncclComm*
   state->rank = rank;
   state->nranks = nranks;
   state->abortFlag = comm->abortFlag;
+  state->net = comm->ncclNet;
   comm->bootstrap = state;
   comm->magic = state->magic = handle->magic;
 
@@ -257,7 +389,7 @@ ncclResult_t bootstrapInit(struct ncclBootstrapHandle* handle, struct ncclComm*
 
   // stagger connection times to avoid an overload of the root
   if (nranks > 128) {
-    long msec = rank;
+    long msec = rank / std::max(1, (int)ncclParamBootstrapRootThreads());
     struct timespec tv;
     tv.tv_sec = msec / 1000;
     tv.tv_nsec = 1000000 * (msec % 1000);
@@ -285,9 +417,8 @@ ncclResult_t bootstrapInit(struct ncclBootstrapHandle* handle, struct ncclComm*
   NCCLCHECK(ncclSocketAccept(&state->ringRecvSocket, &state->listenSock));
 
   // AllGather all listen handlers
-  NCCLCHECK(ncclCalloc(&state->peerCommAddresses, nranks));
-  NCCLCHECK(ncclSocketGetAddr(&state->listenSock, state->peerCommAddresses+rank));
-  NCCLCHECK(bootstrapAllGather(state, state->peerCommAddresses, sizeof(union ncclSocketAddress)));
+  NCCLCHECK(ncclSocketGetAddr(&state->listenSock, &listenAddr));
+  NCCLCHECK(bootstrapExchangePeers(state, &listenAddr));
 
   // Create the service proxy
   NCCLCHECK(ncclCalloc(&state->peerProxyAddresses, nranks));
@@ -318,6 +449,7 @@ ncclResult_t bootstrapSplit(struct ncclBootstrapHandle* handle, struct ncclComm*
   state->rank = rank;
   state->nranks = nranks;
   state->abortFlag = comm->abortFlag;
+  state->net = comm->ncclNet;
   comm->bootstrap = state;
   comm->magic = state->magic = handle->magic;
 
@@ -342,9 +474,7 @@ ncclResult_t bootstrapSplit(struct ncclBootstrapHandle* handle, struct ncclComm*
   NCCLCHECKGOTO(ncclSocketAccept(&state->ringRecvSocket, &state->listenSock), ret, fail);
 
   // AllGather all listen handlers
-  NCCLCHECKGOTO(ncclCalloc(&state->peerCommAddresses, nranks), ret, fail);
-  memcpy(state->peerCommAddresses+rank, &listenAddr, sizeof(union ncclSocketAddress));
-  NCCLCHECKGOTO(bootstrapAllGather(state, state->peerCommAddresses, sizeof(union ncclSocketAddress)), ret, fail);
+  NCCLCHECKGOTO(bootstrapExchangePeers(state, &listenAddr), ret, fail);
 
   if (parent->config.splitShare) {
     /* map local rank to top parent local rank. */
@@ -373,14 +503,11 @@ fail:
   goto exit;
 }
 
-ncclResult_t bootstrapAllGather(void* commState, void* allData, int size) {
-  struct bootstrapState* state = (struct bootstrapState*)commState;
+static ncclResult_t bootstrapRingAllGather(struct bootstrapState* state, void* allData, int size) {
   char* data = (char*)allData;
   int rank = state->rank;
   int nranks = state->nranks;
 
-  TRACE(NCCL_INIT, "rank %d nranks %d size %d", rank, nranks, size);
-
   /* Simple ring based AllGather
    * At each step i receive data from (rank-i-1) from left
    * and send previous step's data from (rank-i) to right
@@ -394,8 +521,248 @@ ncclResult_t bootstrapAllGather(void* commState, void* allData, int size) {
     // Recv slice from the left
     NCCLCHECK(bootstrapNetRecv(&state->ringRecvSocket, data+rslice*size, size));
   }
+  return ncclSuccess;
+}
 
-  TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", rank, nranks, size);
+#define BOOTSTRAP_TAG_ALLGATHER -3
+
+// Copy the slices of all ranks on nodes [n0,n1) between data and a packed buffer. Returns the
+// number of bytes copied.
+static int bootstrapNodesCopy(struct bootstrapState* state, char* data, char* buffer, int size, int n0, int n1, bool pack) {
+  n0 = std::min(n0, state->nNodes);
+  n1 = std::min(n1, state->nNodes);
+  int offset = 0;
+  for (int i=state->nodeRanksOffset[n0]; i<state->nodeRanksOffset[n1]; i++, offset += size) {
+    char* slice = data + (size_t)state->nodeRanks[i]*size;
+    if (pack) memcpy(buffer+offset, slice, size);
+    else memcpy(slice, buffer+offset, size);
+  }
+  return offset;
+}
+
+// Nodes gathered so far by leader j are those whose index, once folded onto [0,pow2), matches j
+// on all bits above the block size.
+static int bootstrapLeaderCopy(struct bootstrapState* state, char* data, char* buffer, int size, int pow2, int j, int block, bool pack) {
+  int first = j & ~(block-1);
+  int bytes = bootstrapNodesCopy(state, data, buffer, size, first, first+block, pack);
+  bytes += bootstrapNodesCopy(state, data, buffer+bytes, size, first+pow2, first+pow2+block, pack);
+  return bytes;
+}
+
+/* Hierarchical AllGather
+ * Ranks first send their slice to the first rank of their node. Node leaders then run a recursive
+ * doubling AllGather among themselves, leaders beyond the largest power of two folding into a
+ * partner before and receiving the result after. Leaders finally send the full buffer back to their
+ * local ranks. This takes O(log(nNodes)) inter-node steps instead of nranks-1 for the ring.
+ */
+static ncclResult_t bootstrapHierAllGather(struct bootstrapState* state, void* allData, int size) {
+  ncclResult_t ret = ncclSuccess;
+  char* data = (char*)allData;
+  char* buffer = NULL;
+  int rank = state->rank;
+  int nranks = state->nranks;
+  int nNodes = state->nNodes;
+  int node = state->rankNode[rank];
+  int* localRanks = state->nodeRanks + state->nodeRanksOffset[node];
+  int nLocal = state->nodeRanksOffset[node+1] - state->nodeRanksOffset[node];
+  int total = nranks*size;
+  int tag = BOOTSTRAP_TAG_ALLGATHER;
+
+  if (rank != localRanks[0]) {
+    NCCLCHECK(bootstrapSend(state, localRanks[0], tag, data+(size_t)rank*size, size));
+    NCCLCHECK(bootstrapRecv(state, localRanks[0], tag, data, total));
+    return ncclSuccess;
+  }
+
+  for (int l=1; l<nLocal; l++) {
+    NCCLCHECK(bootstrapRecv(state, localRanks[l], tag, data+(size_t)localRanks[l]*size, size));
+  }
+
+  if (nNodes > 1) {
+    int pow2 = 1;
+    while (pow2*2 <= nNodes) pow2 *= 2;
+    NCCLCHECK(ncclCalloc(&buffer, total));
+#define LEADER(n) state->nodeRanks[state->nodeRanksOffset[n]]
+    if (node >= pow2) {
+      int bytes = bootstrapNodesCopy(state, data, buffer, size, node, node+1, true);
+      NCCLCHECKGOTO(bootstrapSend(state, LEADER(node-pow2), tag, buffer, bytes), ret, exit);
+      NCCLCHECKGOTO(bootstrapRecv(state, LEADER(node-pow2), tag, data, total), ret, exit);
+    } else {
+      if (node+pow2 < nNodes) {
+        NCCLCHECKGOTO(bootstrapRecv(state, LEADER(node+pow2), tag, buffer, total), ret, exit);
+        bootstrapNodesCopy(state, data, buffer, size, node+pow2, node+pow2+1, false);
+      }
+      for (int mask=1; mask<pow2; mask<<=1) {
+        int partner = node ^ mask;
+        int bytes = bootstrapLeaderCopy(state, data, buffer, size, pow2, node, mask, true);
+        // Lower node sends first so that large messages can not deadlock
+        if (node < partner) NCCLCHECKGOTO(bootstrapSend(state, LEADER(partner), tag, buffer, bytes), ret, exit);
+        NCCLCHECKGOTO(bootstrapRecv(state, LEADER(partner), tag, buffer, total), ret, exit);
+        bootstrapLeaderCopy(state, data, buffer, size, pow2, partner, mask, false);
+        if (node > partner) {
+          bytes = bootstrapLeaderCopy(state, data, buffer, size, pow2, node, mask, true);
+          NCCLCHECKGOTO(bootstrapSend(state, LEADER(partner), tag, buffer, bytes), ret, exit);
+        }
+      }
+      if (node+pow2 < nNodes) NCCLCHECKGOTO(bootstrapSend(state, LEADER(node+pow2), tag, data, total), ret, exit);
+    }
+#undef LEADER
+  }
+
+  for (int l=1; l<nLocal; l++) {
+    NCCLCHECKGOTO(bootstrapSend(state, localRanks[l], tag, data, total), ret, exit);
+  }
+exit:
+  free(buffer);
+  return ret;
+}
+
+// Use the hierarchical AllGather from that many ranks on; 0 always uses the ring.
+NCCL_PARAM(BootstrapHierThreshold, "BOOTSTRAP_HIER_THRESHOLD", 64);
+
+/* Network AllGather
+ * The bootstrap sockets live on NCCL_SOCKET_IFNAME, which is often a slow management network.
+ * With NCCL_OOB_NET_ENABLE=1, AllGathers of at least NCCL_OOB_NET_MIN_BYTES in total run a ring
+ * through the network plugin (e.g. IB) instead, the TCP sockets only carrying the connection
+ * handles. The ring is set up by the first such AllGather, which all ranks call together.
+ */
+NCCL_PARAM(OobNetEnable, "OOB_NET_ENABLE", 0);
+NCCL_PARAM(OobNetDev, "OOB_NET_DEV", 0);
+NCCL_PARAM(OobNetMinBytes, "OOB_NET_MIN_BYTES", 1<<20);
+#define BOOTSTRAP_TAG_NET_RING -7
+
+static ncclResult_t bootstrapNetRingInit(struct bootstrapState* state) {
+  ncclResult_t ret = ncclSuccess;
+  ncclNet_t* net = state->net;
+  int rank = state->rank, nranks = state->nranks;
+  int prev = (rank-1+nranks)%nranks, next = (rank+1)%nranks;
+  ncclNetHandle_t handle, nextHandle;
+  ncclNetProperties_t props;
+  void* listenComm = NULL;
+  int ndev = 0, dev = ncclParamOobNetDev();
+  int* ready = NULL;
+
+  // Every rank must come to the same decision on its own here, before any exchange.
+  state->netRingState = -1;
+  if (net == NULL || strcmp(net->name, "Socket") == 0) return ncclSuccess;
+
+  // Check the device locally, then agree over the sockets, so that a rank which can't use it
+  // makes all ranks stay on the sockets instead of leaving its neighbors waiting for a handle.
+  NCCLCHECK(ncclCalloc(&ready, nranks));
+  if (net->devices(&ndev) != ncclSuccess) {
+    WARN("Bootstrap : could not list the %s devices", net->name);
+  } else if (dev < 0 || dev >= ndev) {
+    WARN("Bootstrap : NCCL_OOB_NET_DEV %d is not a valid %s device (%d devices)", dev, net->name, ndev);
+  } else if (net->getProperties(dev, &props) != ncclSuccess) {
+    WARN("Bootstrap : could not get the properties of %s device %d", net->name, dev);
+  } else if ((props.ptrSupport & NCCL_PTR_HOST) == 0) {
+    WARN("Bootstrap : %s device %d does not support host memory", net->name, dev);
+  } else if (net->listen(dev, handle, &listenComm) != ncclSuccess) {
+    WARN("Bootstrap : could not listen on %s device %d", net->name, dev);
+    listenComm = NULL;
+  } else {
+    ready[rank] = 1;
+  }
+  NCCLCHECKGOTO(bootstrapRingAllGather(state, ready, sizeof(int)), ret, fail);
+  for (int r=0; r<nranks; r++) {
+    if (ready[r] == 0) {
+      INFO(NCCL_INIT, "Bootstrap : rank %d cannot use %s device %d, bulk AllGathers stay on the sockets", r, net->name, dev);
+      goto exit;
+    }
+  }
+
+  NCCLCHECKGOTO(bootstrapSend(state, prev, BOOTSTRAP_TAG_NET_RING, handle, sizeof(ncclNetHandle_t)), ret, fail);
+  NCCLCHECKGOTO(bootstrapRecv(state, next, BOOTSTRAP_TAG_NET_RING, nextHandle, sizeof(ncclNetHandle_t)), ret, fail);
+  // connect and accept are non-blocking, and each needs the peer to progress the other one.
+  while (state->netSendComm == NULL || state->netRecvComm == NULL) {
+    if (state->netSendComm == NULL) NCCLCHECKGOTO(net->connect(dev, nextHandle, &state->netSendComm), ret, fail);
+    if (state->netRecvComm == NULL) NCCLCHECKGOTO(net->accept(listenComm, &state->netRecvComm), ret, fail);
+    if (__atomic_load_n(state->abortFlag, __ATOMIC_RELAXED)) {
+      ret = ncclInternalError;
+      goto fail;
+    }
+  }
+  state->netRingState = 1;
+  INFO(NCCL_INIT, "Bootstrap : using %s device %d (%s) for bulk AllGathers", net->name, dev, props.name);
+exit:
+  if (listenComm) net->closeListen(listenComm);
+  free(ready);
+  return ret;
+fail:
+  goto exit;
+}
+
+static ncclResult_t bootstrapNetWait(struct bootstrapState* state, void* request) {
+  int done = 0;
+  while (!done) {
+    NCCLCHECK(state->net->test(request, &done, NULL));
+    if (__atomic_load_n(state->abortFlag, __ATOMIC_RELAXED)) return ncclInternalError;
+  }
+  return ncclSuccess;
+}
+
+// Same ring as bootstrapRingAllGather, going through the network plugin.
+static ncclResult_t bootstrapNetRingAllGather(struct bootstrapState* state, void* allData, int size) {
+  ncclResult_t ret = ncclSuccess;
+  ncclNet_t* net = state->net;
+  char* data = (char*)allData;
+  int rank = state->rank;
+  int nranks = state->nranks;
+  void *sendMhandle = NULL, *recvMhandle = NULL;
+  NCCLCHECKGOTO(net->regMr(state->netSendComm, data, nranks*size, NCCL_PTR_HOST, &sendMhandle), ret, exit);
+  NCCLCHECKGOTO(net->regMr(state->netRecvComm, data, nranks*size, NCCL_PTR_HOST, &recvMhandle), ret, exit);
+  for (int i=0; i<nranks-1; i++) {
+    size_t rslice = (rank - i - 1 + nranks) % nranks;
+    size_t sslice = (rank - i + nranks) % nranks;
+    void* rdata = data+rslice*size;
+    int tag = 0;
+    void *sendReq = NULL, *recvReq = NULL;
+    // Post the receive first, the send may not start before the peer posted its own.
+    while (recvReq == NULL) {
+      NCCLCHECKGOTO(net->irecv(state->netRecvComm, 1, &rdata, &size, &tag, &recvMhandle, &recvReq), ret, exit);
+    }
+    while (sendReq == NULL) {
+      NCCLCHECKGOTO(net->isend(state->netSendComm, data+sslice*size, size, tag, sendMhandle, &sendReq), ret, exit);
+      if (__atomic_load_n(state->abortFlag, __ATOMIC_RELAXED)) { ret = ncclInternalError; goto exit; }
+    }
+    NCCLCHECKGOTO(bootstrapNetWait(state, sendReq), ret, exit);
+    NCCLCHECKGOTO(bootstrapNetWait(state, recvReq), ret, exit);
+  }
+exit:
+  if (sendMhandle) net->deregMr(state->netSendComm, sendMhandle);
+  if (recvMhandle) net->deregMr(state->netRecvComm, recvMhandle);
+  return ret;
+}
+
+static void bootstrapNetRingClose(struct bootstrapState* state) {
+  if (state->netSendComm) state->net->closeSend(state->netSendComm);
+  if (state->netRecvComm) state->net->closeRecv(state->netRecvComm);
+  state->netSendComm = state->netRecvComm = NULL;
+}
+
+ncclResult_t bootstrapAllGather(void* commState, void* allData, int size) {
+  struct bootstrapState* state = (struct bootstrapState*)commState;
+  int nranks = state->nranks;
+  int threshold = ncclParamBootstrapHierThreshold();
+
+  TRACE(NCCL_INIT, "rank %d nranks %d size %d", state->rank, nranks, size);
+
+  if (nranks > 1 && ncclParamOobNetEnable() && (int64_t)nranks*size >= ncclParamOobNetMinBytes() && state->netRingState >= 0) {
+    if (state->netRingState == 0) NCCLCHECK(bootstrapNetRingInit(state));
+    if (state->netRingState == 1) {
+      NCCLCHECK(bootstrapNetRingAllGather(state, allData, size));
+      TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", state->rank, nranks, size);
+      return ncclSuccess;
+    }
+  }
+
+  if (threshold > 0 && nranks >= threshold) {
+    NCCLCHECK(bootstrapHierAllGather(state, allData, size));
+  } else {
+    NCCLCHECK(bootstrapRingAllGather(state, allData, size));
+  }
+
+  TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", state->rank, nranks, size);
   return ncclSuccess;
 }
 
@@ -560,6 +927,42 @@ fail:
   goto exit;
 }
 
+#include <poll.h>
+
+// Check without blocking whether a message with that tag is waiting, from any peer. Pending
+// connections are moved to the unexpected queue and the message is left there for bootstrapRecv.
+ncclResult_t bootstrapProbe(void* commState, int tag, int* peer, int* found) {
+  struct bootstrapState* state = (struct bootstrapState*)commState;
+  struct pollfd pfd;
+  *found = 0;
+  NCCLCHECK(ncclSocketGetFd(&state->listenSock, &pfd.fd));
+  pfd.events = POLLIN;
+  while (1) {
+    pfd.revents = 0;
+    int ready = poll(&pfd, 1, 0);
+    if (ready < 0 && errno != EINTR) {
+      WARN("bootstrapProbe: poll failed: %s", strerror(errno));
+      return ncclSystemError;
+    }
+    if (ready <= 0 || (pfd.revents & POLLIN) == 0) break;
+    struct ncclSocket sock;
+    int newPeer, newTag;
+    NCCLCHECK(ncclSocketInit(&sock));
+    NCCLCHECK(ncclSocketAccept(&sock, &state->listenSock));
+    NCCLCHECK(bootstrapNetRecv(&sock, &newPeer, sizeof(int)));
+    NCCLCHECK(bootstrapNetRecv(&sock, &newTag, sizeof(int)));
+    NCCLCHECK(unexpectedEnqueue(state, newPeer, newTag, &sock));
+  }
+  for (struct unexConn* elem = state->unexpectedConnections; elem; elem = elem->next) {
+    if (elem->tag == tag) {
+      *peer = elem->peer;
+      *found = 1;
+      break;
+    }
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t bootstrapClose(void* commState) {
   struct bootstrapState* state = (struct bootstrapState*)commState;
   if (state->unexpectedConnections != NULL) {
@@ -573,8 +976,12 @@ ncclResult_t bootstrapClose(void* commState) {
   NCCLCHECK(ncclSocketClose(&state->listenSock));
   NCCLCHECK(ncclSocketClose(&state->ringSendSocket));
   NCCLCHECK(ncclSocketClose(&state->ringRecvSocket));
+  bootstrapNetRingClose(state);
 
   free(state->peerCommAddresses);
+  free(state->rankNode);
+  free(state->nodeRanks);
+  free(state->nodeRanksOffset);
   free(state);
 
   return ncclSuccess;
@@ -586,8 +993,12 @@ ncclResult_t bootstrapAbort(void* commState) {
   NCCLCHECK(ncclSocketClose(&state->listenSock));
   NCCLCHECK(ncclSocketClose(&state->ringSendSocket));
   NCCLCHECK(ncclSocketClose(&state->ringRecvSocket));
+  bootstrapNetRingClose(state);
   free(state->peerCommAddresses);
   free(state->peerProxyAddresses);
+  free(state->rankNode);
+  free(state->nodeRanks);
+  free(state->nodeRanksOffset);
   free(state);
   return ncclSuccess;
 }
@@ -0,0 +1,258 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "ce_coll.h"
+#include "comm.h"
+#include "group.h"
+#include "bootstrap.h"
+#include "graph.h"
+#include "p2p.h"
+#include "cudawrap.h"
+
+NCCL_PARAM(CeColl, "CE_COLL", 0);
+NCCL_PARAM(CeCollBuffSize, "CE_COLL_BUFFSIZE", 1 << 22);
+NCCL_PARAM(CeCollMinBytes, "CE_COLL_MIN_BYTES", 1 << 20);
+
+#define NCCL_CE_COLL_MAX_RANKS 64
+#define NCCL_CE_COLL_SLOTS 2
+#define NCCL_CE_COLL_HEADER_SIZE 4096
+
+// Start of each rank's staging buffer, followed by NCCL_CE_COLL_SLOTS data slots.
+// Chunks are numbered by seq, which advances identically on all ranks, and chunk
+// seq goes through slot seq%NCCL_CE_COLL_SLOTS. Values are compared cyclically
+// by cuStreamWaitValue32, so they may wrap around.
+struct ncclCeCollHeader {
+  uint32_t ready;                       // Last chunk copied into this buffer by its owner
+  uint32_t pad[31];
+  uint32_t ack[NCCL_CE_COLL_MAX_RANKS]; // Last chunk rank r is done with
+};
+static_assert(sizeof(struct ncclCeCollHeader) <= NCCL_CE_COLL_HEADER_SIZE, "ncclCeCollHeader too large");
+
+struct ncclCeColl {
+  char* buff;
+  ncclIpcDesc ipcDesc;
+  size_t size;
+  size_t slotSize;
+  char* peerBuffs[NCCL_CE_COLL_MAX_RANKS];
+  int peerImported[NCCL_CE_COLL_MAX_RANKS];
+  uint64_t seq;
+};
+
+struct ncclCeCollExchange {
+  ncclIpcDesc ipcDesc;
+  void* ptr;
+  int ok;
+};
+
+static char* ceSlot(char* buff, size_t slotSize, uint64_t seq) {
+  return buff + NCCL_CE_COLL_HEADER_SIZE + (seq%NCCL_CE_COLL_SLOTS)*slotSize;
+}
+
+#if CUDA_VERSION >= 11070
+static ncclResult_t ceWait(cudaStream_t stream, uint32_t* addr, uint32_t value) {
+  CUCHECK(cuStreamWaitValue32(stream, (CUdeviceptr)addr, value, CU_STREAM_WAIT_VALUE_GEQ));
+  return ncclSuccess;
+}
+
+static ncclResult_t ceWrite(cudaStream_t stream, uint32_t* addr, uint32_t value) {
+  // Default flags order the write after all previous work on the stream
+  CUCHECK(cuStreamWriteValue32(stream, (CUdeviceptr)addr, value, CU_STREAM_WRITE_VALUE_DEFAULT));
+  return ncclSuccess;
+}
+#endif
+
+// Whether copy engines can serve this communicator. This must come out the same
+// on all ranks, so it only depends on the parameters and the topology.
+static bool ceCollPossible(struct ncclComm* comm) {
+#if CUDA_VERSION >= 11070
+  if (comm->nNodes != 1 || comm->nRanks < 2 || comm->nRanks > NCCL_CE_COLL_MAX_RANKS) return false;
+  for (int i=0; i<comm->nRanks; i++) {
+    for (int j=i+1; j<comm->nRanks; j++) {
+      int p2p, intermediateRank;
+      if (ncclTopoCheckP2p(comm->topo, comm->peerInfo[i].busId, comm->peerInfo[j].busId, &p2p, NULL, &intermediateRank) != ncclSuccess) return false;
+      if (!p2p || intermediateRank != -1) return false;
+    }
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+ncclResult_t ncclCeCollInit(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclCeColl* ce = NULL;
+  struct ncclCeCollExchange* all = NULL;
+  int rank = comm->rank;
+  int nRanks = comm->nRanks;
+  bool allOk = true;
+
+  comm->ceCollState = -1;
+  if (!ncclParamCeColl()) return ncclSuccess;
+  // The copies are issued before the call returns, which nonblocking communicators
+  // don't allow. Every rank must take the same path through the allgather below.
+  if (!comm->allBlocking) {
+    INFO(NCCL_INIT, "CE collectives unavailable : not supported with nonblocking communicators");
+    return ncclSuccess;
+  }
+  if (!ceCollPossible(comm)) {
+    INFO(NCCL_INIT, "CE collectives unavailable : need a single node with P2P between all GPUs");
+    return ncclSuccess;
+  }
+
+  NCCLCHECK(ncclCalloc(&ce, 1));
+  NCCLCHECKGOTO(ncclCalloc(&all, nRanks), ret, fail);
+  ce->slotSize = ROUNDUP(std::max<int64_t>(ncclParamCeCollBuffSize()/NCCL_CE_COLL_SLOTS, 4096), 4096);
+  ce->size = NCCL_CE_COLL_HEADER_SIZE + NCCL_CE_COLL_SLOTS*ce->slotSize;
+
+  all[rank].ok = 0;
+  if (ncclP2pAllocateShareableBuffer(ce->size, &ce->ipcDesc, (void**)&ce->buff) == ncclSuccess) {
+    cudaStream_t stream;
+    all[rank].ok = 1;
+    CUDACHECKGOTO(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking), ret, fail);
+    CUDACHECKGOTO(cudaMemsetAsync(ce->buff, 0, NCCL_CE_COLL_HEADER_SIZE, stream), ret, fail);
+#if CUDA_VERSION >= 11070
+    // Stream memory operations may be disabled on this system
+    if (CUPFN(cuStreamWriteValue32) == NULL || CUPFN(cuStreamWaitValue32) == NULL ||
+        CUPFN(cuStreamWriteValue32(stream, (CUdeviceptr)ce->buff, 0, CU_STREAM_WRITE_VALUE_DEFAULT)) != CUDA_SUCCESS) {
+      all[rank].ok = 0;
+    }
+#endif
+    CUDACHECKGOTO(cudaStreamSynchronize(stream), ret, fail);
+    CUDACHECKGOTO(cudaStreamDestroy(stream), ret, fail);
+  }
+  all[rank].ipcDesc = ce->ipcDesc;
+  all[rank].ptr = ce->buff;
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, all, sizeof(struct ncclCeCollExchange)), ret, fail);
+
+  for (int r=0; r<nRanks; r++) allOk &= all[r].ok != 0;
+  if (!allOk) {
+    INFO(NCCL_INIT, "CE collectives unavailable : staging buffer or stream memory operations not supported on all ranks");
+    if (ce->buff) {
+      ncclP2pFreeShareableBuffer(&ce->ipcDesc);
+      ncclCudaFree(ce->buff);
+    }
+    goto exit;
+  }
+  for (int p=0; p<nRanks; p++) {
+    if (p == rank) {
+      ce->peerBuffs[p] = ce->buff;
+    } else {
+      NCCLCHECKGOTO(ncclP2pMapPeerBuffer(comm, p, ce->size, &all[p].ipcDesc, all[p].ptr, (void**)ce->peerBuffs+p, ce->peerImported+p), ret, fail);
+    }
+  }
+  INFO(NCCL_INIT, "CE collectives enabled for AllGather and Broadcast, %zu bytes per chunk", ce->slotSize);
+  comm->ceColl = ce;
+  comm->ceCollState = 1;
+  ce = NULL;
+
+exit:
+  free(all);
+  free(ce);
+  return ret;
+fail:
+  goto exit;
+}
+
+ncclResult_t ncclCeCollEligible(struct ncclInfo* info, bool* eligible) {
+  struct ncclComm* comm = info->comm;
+  *eligible = false;
+  // Only arguments and state shared by all ranks, so that they all pick the same path
+  if (comm->ceCollState != 1) return ncclSuccess;
+  if (info->coll != ncclFuncAllGather && info->coll != ncclFuncBroadcast) return ncclSuccess;
+  if (info->count*ncclTypeSize(info->datatype) < (size_t)ncclParamCeCollMinBytes()) return ncclSuccess;
+  // The copies are issued before returning, out of order with the rest of a group, and
+  // chunk numbers would be baked into a graph. Only this rank knows about either, so the
+  // others cannot be told to fall back.
+  if (ncclGroupDepth != 1) {
+    WARN("%s : CE collectives (NCCL_CE_COLL) cannot be called within a group", info->opName);
+    return ncclInvalidUsage;
+  }
+  cudaStreamCaptureStatus status;
+  CUDACHECK(cudaStreamIsCapturing(info->stream, &status));
+  if (status != cudaStreamCaptureStatusNone) {
+    WARN("%s : CE collectives (NCCL_CE_COLL) cannot be captured in a CUDA graph", info->opName);
+    return ncclInvalidUsage;
+  }
+  *eligible = true;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclCeCollLaunch(struct ncclInfo* info) {
+#if CUDA_VERSION >= 11070
+  struct ncclComm* comm = info->comm;
+  struct ncclCeColl* ce = comm->ceColl;
+  struct ncclStrongStream* deviceStream = &comm->sharedRes->deviceStream;
+  cudaStream_t stream = info->stream;
+  int rank = comm->rank;
+  int nRanks = comm->nRanks;
+  size_t nBytes = info->count*ncclTypeSize(info->datatype);
+  bool allGather = info->coll == ncclFuncAllGather;
+  bool publish = allGather || info->root == rank;
+  const char* sendbuff = (const char*)info->sendbuff;
+  char* recvbuff = (char*)info->recvbuff;
+  char* myRecv = recvbuff + (allGather ? rank*nBytes : 0);
+  struct ncclCeCollHeader* hdr = (struct ncclCeCollHeader*)ce->buff;
+
+  // Order against kernels of this communicator launched on other streams
+  NCCLCHECK(ncclStrongStreamAcquireUncaptured(deviceStream));
+  NCCLCHECK(ncclStrongStreamWaitStream(ncclCudaGraphNone(), stream, deviceStream));
+
+  for (size_t off = 0; off < nBytes; off += ce->slotSize) {
+    size_t bytes = std::min(ce->slotSize, nBytes-off);
+    uint64_t seq = ++ce->seq;
+    if (publish) {
+      // All peers must be done with the chunk this slot held before
+      if (seq > NCCL_CE_COLL_SLOTS) {
+        for (int p=0; p<nRanks; p++) {
+          if (p == rank) continue;
+          NCCLCHECK(ceWait(stream, hdr->ack+p, uint32_t(seq-NCCL_CE_COLL_SLOTS)));
+        }
+      }
+      CUDACHECK(cudaMemcpyAsync(ceSlot(ce->buff, ce->slotSize, seq), sendbuff+off, bytes, cudaMemcpyDeviceToDevice, stream));
+      NCCLCHECK(ceWrite(stream, &hdr->ready, uint32_t(seq)));
+      if (myRecv+off != sendbuff+off) {
+        CUDACHECK(cudaMemcpyAsync(myRecv+off, sendbuff+off, bytes, cudaMemcpyDeviceToDevice, stream));
+      }
+    }
+    for (int i=1; i<nRanks; i++) {
+      int peer = (rank+i)%nRanks;
+      if (!allGather && peer != info->root) continue;
+      struct ncclCeCollHeader* peerHdr = (struct ncclCeCollHeader*)ce->peerBuffs[peer];
+      char* dst = recvbuff + (allGather ? peer*nBytes : 0) + off;
+      NCCLCHECK(ceWait(stream, &peerHdr->ready, uint32_t(seq)));
+      CUDACHECK(cudaMemcpyAsync(dst, ceSlot(ce->peerBuffs[peer], ce->slotSize, seq), bytes, cudaMemcpyDeviceToDevice, stream));
+    }
+    // Every rank acknowledges every chunk, so that acks stay in step whatever
+    // the sequence of AllGather and Broadcast operations.
+    for (int p=0; p<nRanks; p++) {
+      if (p == rank) continue;
+      struct ncclCeCollHeader* peerHdr = (struct ncclCeCollHeader*)ce->peerBuffs[p];
+      NCCLCHECK(ceWrite(stream, peerHdr->ack+rank, uint32_t(seq)));
+    }
+  }
+
+  NCCLCHECK(ncclStrongStreamWaitStream(ncclCudaGraphNone(), deviceStream, stream));
+  NCCLCHECK(ncclStrongStreamRelease(ncclCudaGraphNone(), deviceStream));
+  comm->opCount++;
+  return ncclSuccess;
+#else
+  return ncclInternalError;
+#endif
+}
+
+ncclResult_t ncclCeCollFree(struct ncclComm* comm) {
+  struct ncclCeColl* ce = comm->ceColl;
+  if (ce == NULL) return ncclSuccess;
+  for (int p=0; p<comm->nRanks; p++) {
+    if (ce->peerImported[p]) NCCLCHECK(ncclP2pUnmapPeerBuffer(ce->peerBuffs[p]));
+  }
+  ncclP2pFreeShareableBuffer(&ce->ipcDesc);
+  NCCLCHECK(ncclCudaFree(ce->buff));
+  free(ce);
+  comm->ceColl = NULL;
+  return ncclSuccess;
+}
@@ -40,8 +40,7 @@ ncclResult_t initChannel(struct ncclComm* comm, int channelId) {
       NCCLCHECK(ncclCudaCallocAsync(sharedRes->devPeers + channelId, sharedRes->tpNRanks, sharedRes->deviceStream.cudaStream));
     }
     /* channel->devPeers is not shared, so just free it when calling commFree() */
-    NCCLCHECK(ncclCudaCallocAsync(&channel->devPeers, nPeers, sharedRes->deviceStream.cudaStream));
-    ncclCommPushCudaFree(comm, channel->devPeers);
+    NCCLCHECK(ncclCudaArenaCalloc(&comm->devArena, &channel->devPeers, nPeers));
     for (int r = 0; r < nRanks; r++) {
       uintptr_t addr = (uintptr_t)(comm->sharedRes->devPeers[channelId] + comm->topParentRanks[r]);
       NCCLCHECK(ncclCudaMemcpyAsync((uintptr_t*)(channel->devPeers + r), (uintptr_t*)&addr, 1, sharedRes->deviceStream.cudaStream));
@@ -49,8 +48,9 @@ ncclResult_t initChannel(struct ncclComm* comm, int channelId) {
   }
 
   channel->ring.userRanks = ncclMemoryStackAlloc<int>(&comm->memPermanent, nRanks);
-  NCCLCHECK(ncclCudaCallocAsync(&channel->devRingUserRanks, nRanks, sharedRes->deviceStream.cudaStream));
-  ncclCommPushCudaFree(comm, channel->devRingUserRanks);
+  NCCLCHECK(ncclCudaArenaCalloc(&comm->devArena, &channel->devRingUserRanks, nRanks));
+  channel->treeToRoot = ncclMemoryStackAlloc<int8_t>(&comm->memPermanent, nRanks);
+  NCCLCHECK(ncclCudaArenaCalloc(&comm->devArena, &channel->devTreeToRoot, nRanks));
 
   NCCLCHECK(ncclStrongStreamRelease(ncclCudaGraphNone(), &sharedRes->deviceStream));
 
@@ -6,6 +6,60 @@
 
 #include "enqueue.h"
 #include "collectives.h"
+#include "argcheck.h"
+
+NCCL_PARAM(AllGatherBruckMinRanks, "ALLGATHER_BRUCK_MIN_RANKS", 0);
+NCCL_PARAM(AllGatherBruckMaxBytes, "ALLGATHER_BRUCK_MAX_BYTES", 65536);
+
+// Send or receive blocks [first, first+nBlocks) of recvbuff, taken modulo nRanks,
+// as at most two contiguous pieces. Both ends of a transfer cut at the same block.
+static ncclResult_t bruckBlocks(ncclFunc_t func, char* recvbuff, int first, int nBlocks, size_t count,
+    ncclDataType_t datatype, int peer, ncclComm_t comm, cudaStream_t stream) {
+  size_t bytes = count*ncclTypeSize(datatype);
+  int nRanks = comm->nRanks;
+  while (nBlocks > 0) {
+    int n = std::min(nBlocks, nRanks-first);
+    struct ncclInfo info = { func, "AllGather",
+      NULL, recvbuff + first*bytes, n*count, datatype, ncclSum, peer, comm, stream, /* Args */
+      1, 1 };
+    NCCLCHECK(ncclEnqueueCheck(&info));
+    first = (first+n) % nRanks;
+    nBlocks -= n;
+  }
+  return ncclSuccess;
+}
+
+// Bruck AllGather for small blocks on many ranks: ceil(log2(nRanks)) rounds of
+// point-to-point exchanges instead of nRanks-1 ring steps. After round k, each
+// rank holds blocks rank..rank+2^(k+1)-1 at their final place in recvbuff. Each
+// round is its own group so that it starts once the previous one has landed.
+static ncclResult_t allGatherBruck(const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  int rank = comm->rank, nRanks = comm->nRanks;
+  char* recv = (char*)recvbuff;
+  size_t bytes = count*ncclTypeSize(datatype);
+  ncclResult_t ret = ncclSuccess;
+  if (sendbuff != recv + rank*bytes) {
+    NCCLCHECK(ncclGroupStart());
+    struct ncclInfo send = { ncclFuncSend, "AllGather",
+      NULL, (void*)sendbuff, count, datatype, ncclSum, rank, comm, stream, /* Args */
+      1, 1 };
+    NCCLCHECKGOTO(ncclEnqueueCheck(&send), ret, exit);
+    NCCLCHECKGOTO(bruckBlocks(ncclFuncRecv, recv, rank, 1, count, datatype, rank, comm, stream), ret, exit);
+    NCCLCHECK(ncclGroupEnd());
+  }
+  for (int d=1; d<nRanks; d*=2) {
+    int nBlocks = std::min(d, nRanks-d);
+    NCCLCHECK(ncclGroupStart());
+    NCCLCHECKGOTO(bruckBlocks(ncclFuncSend, recv, rank, nBlocks, count, datatype, (rank-d+nRanks)%nRanks, comm, stream), ret, exit);
+    NCCLCHECKGOTO(bruckBlocks(ncclFuncRecv, recv, (rank+d)%nRanks, nBlocks, count, datatype, (rank+d)%nRanks, comm, stream), ret, exit);
+    NCCLCHECK(ncclGroupEnd());
+  }
+  return ncclSuccess;
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
 
 NCCL_API(ncclResult_t, ncclAllGather, const void* sendbuff, void* recvbuff, size_t sendcount,
     ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
@@ -18,8 +72,49 @@ ncclResult_t ncclAllGather(const void* sendbuff, void* recvbuff, size_t sendcoun
   size_t msgsize = sendcount * ncclTypeSize(datatype);
   NVTX3_FUNC_WITH_PARAMS(AllGather, AllGatherSchema, msgsize)
 
+  // Rounds must be ordered on the stream, which a nonblocking communicator would
+  // not guarantee. The choice only depends on values which are the same on all
+  // ranks; a user group would merge the rounds, so it is rejected.
+  if (comm && comm->allBlocking && sendcount > 0 &&
+      ncclParamAllGatherBruckMinRanks() > 0 && comm->nRanks >= ncclParamAllGatherBruckMinRanks() &&
+      msgsize <= ncclParamAllGatherBruckMaxBytes()) {
+    NCCLCHECK(ncclCommEnsureReady(comm));
+    if (ncclGroupDepth != 0) {
+      WARN("AllGather : Bruck AllGather (NCCL_ALLGATHER_BRUCK_MIN_RANKS) cannot be called within a group");
+      return ncclInvalidUsage;
+    }
+    return allGatherBruck(sendbuff, recvbuff, sendcount, datatype, comm, stream);
+  }
+
   struct ncclInfo info = { ncclFuncAllGather, "AllGather",
     sendbuff, recvbuff, sendcount, datatype, ncclSum, 0, comm, stream, /* Args */
     ALLGATHER_CHUNKSTEPS, ALLGATHER_SLICESTEPS };
   return ncclEnqueueCheck(&info);
 }
+
+// Variable-count AllGather: one Broadcast per rank in a single group. Each
+// block crosses every ring link once, as in a ring AllGather, without padding.
+NCCL_API(ncclResult_t, ncclAllGatherv, const void* sendbuff, void* recvbuff, const size_t recvcounts[],
+    const size_t displs[], ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllGatherv(const void* sendbuff, void* recvbuff, const size_t recvcounts[],
+    const size_t displs[], ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "AllGatherv", "comm"));
+  NCCLCHECK(PtrCheck((void*)recvcounts, "AllGatherv", "recvcounts"));
+  NCCLCHECK(PtrCheck((void*)displs, "AllGatherv", "displs"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  size_t eltSize = ncclTypeSize(datatype);
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  for (int r=0; r<comm->nRanks; r++) {
+    // Counts are the same on all ranks, so all ranks skip the same blocks
+    if (recvcounts[r] == 0) continue;
+    struct ncclInfo info = { ncclFuncBroadcast, "AllGatherv",
+      sendbuff, (char*)recvbuff + displs[r]*eltSize, recvcounts[r], datatype, ncclSum, r, comm, stream, /* Args */
+      BROADCAST_CHUNKSTEPS, BROADCAST_SLICESTEPS };
+    NCCLCHECKGOTO(ncclEnqueueCheck(&info), ret, exit);
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
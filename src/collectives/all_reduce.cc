@@ -6,6 +6,7 @@
 
 #include "enqueue.h"
 #include "nccl.h"
+#include "argcheck.h"
 
 NCCL_API(ncclResult_t, ncclAllReduce, const void* sendbuff, void* recvbuff, size_t count,
     ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream);
@@ -29,3 +30,67 @@ ncclResult_t ncclAllReduce(const void* sendbuff, void* recvbuff, size_t count,
     ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
   return ncclEnqueueCheck(&info);
 }
+
+// The tensors are enqueued as one group of AllReduces. Consecutive collectives
+// of the same type and op are aggregated by scheduleCollTasksToPlan() : one
+// algorithm and protocol are picked for the total size, each tensor gets a
+// share of the channels, and they all pack into the ncclWorks of a single
+// kernel, reading and writing the user buffers in place.
+NCCL_API(ncclResult_t, ncclAllReduceMulti, int nTensors, const void* const sendbuffs[], void* const recvbuffs[],
+    const size_t counts[], ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream);
+ncclResult_t ncclAllReduceMulti(int nTensors, const void* const sendbuffs[], void* const recvbuffs[],
+    const size_t counts[], ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "AllReduceMulti", "comm"));
+  if (nTensors < 0) {
+    WARN("AllReduceMulti : invalid number of tensors %d", nTensors);
+    return ncclInvalidArgument;
+  }
+  if (nTensors == 0) return ncclSuccess;
+  NCCLCHECK(PtrCheck((void*)sendbuffs, "AllReduceMulti", "sendbuffs"));
+  NCCLCHECK(PtrCheck((void*)recvbuffs, "AllReduceMulti", "recvbuffs"));
+  NCCLCHECK(PtrCheck((void*)counts, "AllReduceMulti", "counts"));
+
+  // Check every tensor before enqueuing any, so that a bad entry doesn't leave part of the set queued
+  ncclResult_t ret = ncclSuccess;
+  int devOld = -1;
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (comm->checkPointers) {
+    CUDACHECK(cudaGetDevice(&devOld));
+    CUDACHECK(cudaSetDevice(comm->cudaDev));
+  }
+  for (int t=0; t<nTensors; t++) {
+    struct ncclInfo info = { ncclFuncAllReduce, "AllReduceMulti",
+      sendbuffs[t], recvbuffs[t], counts[t], datatype, op, 0, comm, stream, /* Args */
+      ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
+    NCCLCHECKGOTO(ArgsCheck(&info), ret, check);
+  }
+check:
+  if (devOld != -1) CUDACHECK(cudaSetDevice(devOld));
+  if (ret != ncclSuccess) return ret;
+
+  NCCLCHECK(ncclGroupStart());
+  for (int t=0; t<nTensors; t++) {
+    struct ncclInfo info = { ncclFuncAllReduce, "AllReduceMulti",
+      sendbuffs[t], recvbuffs[t], counts[t], datatype, op, 0, comm, stream, /* Args */
+      ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
+    NCCLCHECKGOTO(ncclEnqueueCheck(&info), ret, exit);
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclAllReduceMixed, const void* sendbuff, ncclDataType_t sendtype, void* recvbuff,
+    ncclDataType_t recvtype, size_t count, ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream);
+ncclResult_t ncclAllReduceMixed(const void* sendbuff, ncclDataType_t sendtype, void* recvbuff,
+    ncclDataType_t recvtype, size_t count, ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  struct ncclInfo info = { ncclFuncAllReduce, "AllReduceMixed",
+    sendbuff, recvbuff, count, datatype, op, 0, comm, stream, /* Args */
+    ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
+  info.mixed = true;
+  info.sendType = sendtype;
+  info.recvType = recvtype;
+  return ncclEnqueueCheck(&info);
+}
@@ -0,0 +1,76 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "enqueue.h"
+#include "collectives.h"
+#include "argcheck.h" // Need some checks here since we access comm
+
+// AllToAll(v) is a single group of sends and receives with every peer. The
+// p2p tasks then go through the regular p2p scheduler, which already orders
+// peers pairwise by node distance, fuses several peers per ncclWork on node
+// boundaries, and routes through PXN when enabled.
+static ncclResult_t allToAllEnqueue(const char* opName, const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+    void* recvbuff, const size_t* recvcounts, const size_t* rdispls, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  size_t eltSize = ncclTypeSize(datatype);
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  for (int peer=0; peer<comm->nRanks; peer++) {
+    struct ncclInfo send = { ncclFuncSend, opName,
+      NULL, (char*)sendbuff + sdispls[peer]*eltSize, sendcounts[peer], datatype, ncclSum, peer, comm, stream, /* Args */
+      1, 1 };
+    struct ncclInfo recv = { ncclFuncRecv, opName,
+      NULL, (char*)recvbuff + rdispls[peer]*eltSize, recvcounts[peer], datatype, ncclSum, peer, comm, stream, /* Args */
+      1, 1 };
+    NCCLCHECKGOTO(ncclEnqueueCheck(&send), ret, exit);
+    NCCLCHECKGOTO(ncclEnqueueCheck(&recv), ret, exit);
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclAllToAll, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllToAll(const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  // Just pass the size of one message and not the total bytes sent/received.
+  constexpr nvtxPayloadSchemaEntry_t AllToAllSchema[] = {
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_SIZE, "Message size [bytes]"}
+  };
+  size_t msgsize = count * ncclTypeSize(datatype);
+  NVTX3_FUNC_WITH_PARAMS(AllToAll, AllToAllSchema, msgsize)
+
+  NCCLCHECK(PtrCheck(comm, "AllToAll", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  size_t* counts;
+  size_t* displs;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclCalloc(&counts, comm->nRanks));
+  NCCLCHECKGOTO(ncclCalloc(&displs, comm->nRanks), ret, fail);
+  for (int r=0; r<comm->nRanks; r++) {
+    counts[r] = count;
+    displs[r] = r*count;
+  }
+  ret = allToAllEnqueue("AllToAll", sendbuff, counts, displs, recvbuff, counts, displs, datatype, comm, stream);
+  free(displs);
+fail:
+  free(counts);
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclAllToAllv, const void* sendbuff, const size_t sendcounts[], const size_t sdispls[],
+    void* recvbuff, const size_t recvcounts[], const size_t rdispls[], ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllToAllv(const void* sendbuff, const size_t sendcounts[], const size_t sdispls[],
+    void* recvbuff, const size_t recvcounts[], const size_t rdispls[], ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "AllToAllv", "comm"));
+  NCCLCHECK(PtrCheck((void*)sendcounts, "AllToAllv", "sendcounts"));
+  NCCLCHECK(PtrCheck((void*)sdispls, "AllToAllv", "sdispls"));
+  NCCLCHECK(PtrCheck((void*)recvcounts, "AllToAllv", "recvcounts"));
+  NCCLCHECK(PtrCheck((void*)rdispls, "AllToAllv", "rdispls"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  return allToAllEnqueue("AllToAllv", sendbuff, sendcounts, sdispls, recvbuff, recvcounts, rdispls, datatype, comm, stream);
+}
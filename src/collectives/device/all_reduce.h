@@ -374,11 +374,58 @@ struct RunWorkElement<ncclFuncAllReduce, T, RedOp, NCCL_ALGO_COLLNET_DIRECT, NCC
   }
 };
 
+#if NCCL_NVLS_ENABLED
+// Waits until the blocks running this channel on all local ranks got there, with
+// a counter they all increment through its multicast address.
+__device__ __forceinline__ void nvlsRegBarrier(struct ncclNvls* nvls, int nranks, int nthreads) {
+  __threadfence_system();
+  asm volatile("bar.sync 15, %0;" :: "r"(nthreads) : "memory");
+  if (threadIdx.x == 0) {
+    uint64_t epoch = nvls->barrierUc[1] + 1;
+    nvls->barrierUc[1] = epoch;
+    asm volatile("multimem.red.release.sys.global.add.u64 [%0], %1;" :: "l"(nvls->barrierMc), "l"((uint64_t)1) : "memory");
+    uint64_t arrived;
+    do {
+      asm volatile("ld.acquire.sys.global.u64 %0, [%1];" : "=l"(arrived) : "l"(nvls->barrierUc) : "memory");
+    } while (arrived < epoch*nranks);
+  }
+  asm volatile("bar.sync 15, %0;" :: "r"(nthreads) : "memory");
+}
+
+// Registered buffers are bound to multicast objects: each block reduces its part of
+// the buffer straight from the multicast address of sendbuff on all ranks, and
+// stores the result through the multicast address of recvbuff.
+template<typename T, typename RedOp>
+__device__ __forceinline__ void runNvlsReg(struct ncclWorkElemReg* args) {
+  const int tid = threadIdx.x;
+  const int nthreads = args->elem.nWarps*WARP_SIZE;
+  struct ncclNvls* nvls = &ncclShmem.channel.nvls;
+  const int nranks = ncclShmem.comm.nRanks;
+  const ssize_t size = args->elem.count;
+  const ssize_t partSize = roundUp(divUp(size, ssize_t(args->elem.nChannels)*nranks), ssize_t(16/sizeof(T)));
+  const ssize_t offset = (ssize_t(args->elem.bid)*nranks + ncclShmem.comm.rank)*partSize;
+  const ssize_t nelem = min(partSize, size-offset);
+
+  nvlsRegBarrier(nvls, nranks, nthreads);
+  if (nelem > 0) {
+    void* src = (T*)args->dnInputs[0] + offset;
+    void* dst = (T*)args->dnOutputs[0] + offset;
+    reduceCopy<COLL_UNROLL, RedOp, T, /*MultimemSrcs=*/1, 1, 1, /*MultimemDsts=*/1, 1, 1, /*PreOpSrcs=*/0>
+      (tid, nthreads, args->elem.redOpArg, &args->elem.redOpArg, false, 1, &src, 1, &dst, nelem);
+  }
+  nvlsRegBarrier(nvls, nranks, nthreads);
+}
+#endif
+
 template<typename T, typename RedOp>
 struct RunWorkElement<ncclFuncAllReduce, T, RedOp, NCCL_ALGO_NVLS, NCCL_PROTO_SIMPLE> {
   __device__ __forceinline__ void run(ncclWorkElem *args) {
   #if NCCL_NVLS_ENABLED
     const int tid = threadIdx.x;
+    if (args->regUsed) {
+      runNvlsReg<T, RedOp>((struct ncclWorkElemReg*)args);
+      return;
+    }
     const int bid = args->bid;
     const int nChannels = args->nChannels;
     struct ncclNvls* nvls = &ncclShmem.channel.nvls;
@@ -57,6 +57,50 @@ namespace {
       }
     }
   }
+
+  // Pipelined broadcast down the tree of the channel, re-rooted at args->root.
+  template<typename T, typename RedOp, typename Proto>
+  __device__ __forceinline__ void runTree(ncclWorkElem *args) {
+    const int tid = threadIdx.x;
+    const int nthreads = args->nWarps*WARP_SIZE;
+    const int bid = args->bid;
+    const int nChannels = args->nChannels;
+    ssize_t chunkSize = int(
+      Proto::Id == NCCL_PROTO_SIMPLE ? args->lastChunkSize
+                   /* LL & LL128 */  : Proto::calcBytePerStep()/sizeof(T));
+    const ssize_t minChunkSize = int(
+      Proto::Id == NCCL_PROTO_SIMPLE ? (nthreads-2*WARP_SIZE)*8*(sizeof(uint64_t)/sizeof(T))
+                   /* LL & LL128 */  : nthreads*(Proto::calcBytePerGrain()/sizeof(T)));
+    const ssize_t loopSize = int(nChannels*chunkSize);
+    const ssize_t size = args->count;
+
+    if (loopSize > size)
+      chunkSize = divUp((int)size, int(nChannels*minChunkSize))*int(minChunkSize);
+
+    int children[NCCL_MAX_TREE_NEIGHBORS];
+    int parent = ncclTreeReroot(args->root, children);
+
+    T *inputBuf = (T*)args->sendbuff;
+    T *outputBuf = (T*)args->recvbuff;
+    Primitives<T, RedOp, FanAsymmetric<1, NCCL_MAX_TREE_NEIGHBORS>, /*Direct=*/0, Proto, 0>
+      prims(tid, nthreads, &parent, children, inputBuf, outputBuf, args->redOpArg);
+
+    for (ssize_t gridOffset = 0; gridOffset < size; gridOffset += loopSize) {
+      ssize_t offset = gridOffset + bid*int(chunkSize);
+      int nelem = min(chunkSize, size-offset);
+      if (parent == -1) {
+        if (inputBuf == outputBuf) {
+          prims.send(offset, nelem);
+        } else {
+          prims.copySend(offset, offset, nelem);
+        }
+      } else if (children[0] == -1) {
+        prims.recv(offset, nelem);
+      } else {
+        prims.recvCopySend(offset, nelem);
+      }
+    }
+  }
 }
 
 template<typename T, typename RedOp>
@@ -80,3 +124,24 @@ struct RunWorkElement<ncclFuncBroadcast, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_LL
     runRing<T, RedOp, ProtoLL128>(args);
   }
 };
+
+template<typename T, typename RedOp>
+struct RunWorkElement<ncclFuncBroadcast, T, RedOp, NCCL_ALGO_TREE, NCCL_PROTO_SIMPLE> {
+  __device__ __forceinline__ void run(ncclWorkElem *args) {
+    runTree<T, RedOp, ProtoSimple<1, 1>>(args);
+  }
+};
+
+template<typename T, typename RedOp>
+struct RunWorkElement<ncclFuncBroadcast, T, RedOp, NCCL_ALGO_TREE, NCCL_PROTO_LL> {
+  __device__ __forceinline__ void run(ncclWorkElem *args) {
+    runTree<T, RedOp, ProtoLL>(args);
+  }
+};
+
+template<typename T, typename RedOp>
+struct RunWorkElement<ncclFuncBroadcast, T, RedOp, NCCL_ALGO_TREE, NCCL_PROTO_LL128> {
+  __device__ __forceinline__ void run(ncclWorkElem *args) {
+    runTree<T, RedOp, ProtoLL128>(args);
+  }
+};
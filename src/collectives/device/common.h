@@ -21,6 +21,7 @@ struct ncclShmemGroup {
   ncclConnInfo *sendConns[NCCL_MAX_NVLS_ARITY];
   void* srcs[NCCL_MAX_NVLS_ARITY+1];
   void* dsts[NCCL_MAX_NVLS_ARITY+1];
+  void* nextSrcs[NCCL_MAX_NVLS_ARITY]; // next slice of each recv peer if already posted
 };
 
 struct ncclShmemData {
@@ -41,6 +42,43 @@ extern __shared__ ncclShmemData ncclShmem;
   extern __shared__ ulong2 ncclShmemPerWarp[ncclShmemScratchWarpSize()*(NCCL_MAX_NTHREADS/WARP_SIZE)/sizeof(ulong2)];
 #endif
 
+// Re-root the tree of the current channel at root, for Broadcast and Reduce.
+// Returns the parent (-1 on the root) and fills children, terminated by -1.
+#define NCCL_MAX_TREE_NEIGHBORS (1+NCCL_MAX_TREE_ARITY)
+__device__ inline int ncclTreeReroot(int root, int* children) {
+  struct ncclTree* tree = &ncclShmem.channel.tree;
+  int neighbors[NCCL_MAX_TREE_NEIGHBORS];
+  neighbors[0] = tree->up;
+  for (int i=0; i<NCCL_MAX_TREE_ARITY; i++) neighbors[1+i] = tree->down[i];
+  int toRoot = ncclShmem.channel.treeToRoot[root];
+  int nChildren = 0;
+  for (int i=0; i<NCCL_MAX_TREE_NEIGHBORS; i++) {
+    if (i != toRoot && neighbors[i] != -1) children[nChildren++] = neighbors[i];
+  }
+  for (int i=nChildren; i<NCCL_MAX_TREE_NEIGHBORS; i++) children[i] = -1;
+  return toRoot == -1 ? -1 : neighbors[toRoot];
+}
+
+__device__ inline uint64_t ncclGlobalTimer() {
+  uint64_t t;
+  asm volatile("mov.u64 %0, %%globaltimer;" : "=l"(t));
+  return t;
+}
+
+// Record a device timeline event for the current channel. Safe to call from any thread; it is a
+// no-op unless the timeline was enabled at communicator creation.
+__device__ inline void ncclTimelineRecord(uint16_t type, uint16_t info) {
+  struct ncclDevTimelineEvent* events = ncclShmem.comm.timeline;
+  if (events == nullptr) return;
+  int channelId = ncclShmem.channelId;
+  uint32_t ix = atomicAdd(ncclShmem.comm.timelineHead+channelId, 1);
+  struct ncclDevTimelineEvent* e = events + channelId*NCCL_DEV_TIMELINE_EVENTS + ix%NCCL_DEV_TIMELINE_EVENTS;
+  *(volatile uint64_t*)&e->timestamp = ncclGlobalTimer();
+  *(volatile uint32_t*)&e->type = uint32_t(type) | (uint32_t(info)<<16);
+  __threadfence_system();
+  *(volatile uint32_t*)&e->seq = ix+1;
+}
+
 __device__ inline void* ncclScratchForWarp(int warp) {
   return (char*)ncclShmemPerWarp + warp*ncclShmemScratchWarpSize();
 }
@@ -56,15 +94,32 @@ __device__ inline bool barrierReduceAny(int bit) {
 }
 
 // Copy 16-byte aligned data. You must call with at least `(bytes+15)/16` threads.
+// Volatile loads are only needed by the resident kernel, which reads memory the
+// host rewrites while it runs.
+template<bool Volatile=false>
 inline __device__ void copyToShmem16(int tid, void* dst, void const* src, int bytes) {
   int offset = 16*tid;
   if (offset < bytes) {
     uint64_t a=0, b=0;
-    asm("ld.v2.u64 {%0,%1},[%2];" : "=l"(a),"=l"(b) : "l"((char const*)src + offset));
+    if (Volatile) {
+      asm volatile("ld.volatile.v2.u64 {%0,%1},[%2];" : "=l"(a),"=l"(b) : "l"((char const*)src + offset));
+    } else {
+      asm("ld.v2.u64 {%0,%1},[%2];" : "=l"(a),"=l"(b) : "l"((char const*)src + offset));
+    }
     asm volatile("st.v2.u64 [%0],{%1,%2};" :: "l"((char*)dst + offset), "l"(a), "l"(b));
   }
 }
 
+// Equivalent to ncclShmem.channel.peers[peer], reading shared memory only for the
+// ring and tree neighbors.
+inline __device__ struct ncclDevChannelPeer* ncclShmemPeer(int peer) {
+  #pragma unroll
+  for (int i=0; i<NCCL_DEV_PEER_CACHE; i++) {
+    if (ncclShmem.channel.peerCacheRank[i] == peer) return ncclShmem.channel.peerCache[i];
+  }
+  return ncclShmem.channel.peers[peer];
+}
+
 template<ncclFunc_t Fn, typename T, typename RedOp, int Algo, int Proto>
 struct RunWorkElement {
   __device__ void run(ncclWorkElem*) {
@@ -100,6 +155,8 @@ static __device__ void ncclRedopPtrDeref(struct ncclWorkElem* we) {
      * given the alignment of the pointer. We might be reading in more bytes
      * than we need but that's harmless.
      */
+    uint64_t tag = we->redOpArg & (0xffull<<56); // FuncGeneric op, see NCCL_GENERIC_REDOP
+    we->redOpArg ^= tag;
     if (we->redOpArg%2 != 0)
       we->redOpArg = *reinterpret_cast<uint8_t*>(we->redOpArg);
     else if (we->redOpArg%4 != 0)
@@ -108,17 +165,13 @@ static __device__ void ncclRedopPtrDeref(struct ncclWorkElem* we) {
       we->redOpArg = *reinterpret_cast<uint32_t*>(we->redOpArg);
     else
       we->redOpArg = *reinterpret_cast<uint64_t*>(we->redOpArg);
+    if (tag) we->redOpArg = (we->redOpArg & ~(0xffull<<56)) | tag;
   }
 }
 
-template<ncclFunc_t Fn, typename T, typename RedOp, int Algo, int Proto, int FnIndex>
-__device__ void ncclKernel(
-    struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHead
-  )  {
-  int tid = threadIdx.x;
-
-  // To map blockId to channelId, we need the n'th set bit of channelMask which
-  // is the inverse of counting the number of set bits among the the first n.
+// To map blockId to channelId, we need the n'th set bit of channelMask which
+// is the inverse of counting the number of set bits among the the first n.
+__device__ __forceinline__ void ncclMapChannelId(int tid, uint64_t channelMask) {
   if (tid < WARP_SIZE) {
     int x = tid;
     if (channelMask & (1ull<<x)) {
@@ -133,43 +186,44 @@ __device__ void ncclKernel(
       }
     }
   }
-  __syncthreads(); // publish ncclShmem.channelId
-  int channelId = ncclShmem.channelId;
-  /* set abort flag to 0 */
-  if (tid == 0) ncclShmem.aborted = 0;
+}
 
-  if (true) {
-    void *dst, *src;
-    int bytes;
-    // Use first 3 warps to load comm, channel, and work into ncclShmem
-    switch (tid/WARP_SIZE) {
-    case 0:
-      dst = &ncclShmem.comm;
-      src = comm;
-      bytes = sizeof(ncclDevComm);
-      static_assert(sizeof(ncclDevComm) <= 16*WARP_SIZE, "ncclDevComm cannot be loaded by a single warp in one insn.");
-      break;
-    case 1:
-      // Get address of channel without incurring indirect load from ncclDevComm::channels
-      dst = &ncclShmem.channel;
-      src = &((ncclDevCommAndChannels*)comm)->channels[channelId];
-      bytes = sizeof(ncclDevChannel);
-      static_assert(sizeof(ncclDevChannel) <= 16*WARP_SIZE, "ncclDevChannel cannot be loaded by a single warp in one insn.");
-      break;
-    case 2:
-      dst = &ncclShmem.work;
-      src = workHead + blockIdx.x;
-      bytes = sizeof(ncclWork);
-      static_assert(sizeof(ncclWork) <= 16*WARP_SIZE, "ncclWork cannot be loaded by a single warp in one insn.");
-      break;
-    default:
-      bytes = 0;
-      break;
-    }
-    copyToShmem16(tid%WARP_SIZE, dst, src, bytes);
+// Use first 3 warps to load comm, channel, and work into ncclShmem
+template<bool Volatile>
+__device__ __forceinline__ void ncclLoadShmem(int tid, struct ncclDevComm* comm, int channelId, struct ncclWork* work) {
+  void *dst, *src;
+  int bytes;
+  switch (tid/WARP_SIZE) {
+  case 0:
+    dst = &ncclShmem.comm;
+    src = comm;
+    bytes = sizeof(ncclDevComm);
+    static_assert(sizeof(ncclDevComm) <= 16*WARP_SIZE, "ncclDevComm cannot be loaded by a single warp in one insn.");
+    break;
+  case 1:
+    // Get address of channel without incurring indirect load from ncclDevComm::channels
+    dst = &ncclShmem.channel;
+    src = &((ncclDevCommAndChannels*)comm)->channels[channelId];
+    bytes = sizeof(ncclDevChannel);
+    static_assert(sizeof(ncclDevChannel) <= 16*WARP_SIZE, "ncclDevChannel cannot be loaded by a single warp in one insn.");
+    break;
+  case 2:
+    dst = &ncclShmem.work;
+    src = work;
+    bytes = work != nullptr ? sizeof(ncclWork) : 0; // Inline works are already there
+    static_assert(sizeof(ncclWork) <= 16*WARP_SIZE, "ncclWork cannot be loaded by a single warp in one insn.");
+    break;
+  default:
+    bytes = 0;
+    break;
   }
-  __syncthreads(); // publish ncclShmem
+  copyToShmem16<Volatile>(tid%WARP_SIZE, dst, src, bytes);
+}
 
+// Runs the work in ncclShmem.work and the ones chained after it, until the
+// last one of this block or an abort.
+template<ncclFunc_t Fn, typename T, typename RedOp, int Algo, int Proto, int FnIndex, bool Volatile>
+__device__ __forceinline__ void ncclRunWorks(int tid, struct ncclDevComm* comm, struct ncclWork* workHead) {
   while (true) {
     // Notify host that all fifo reads are complete.
     if (tid == 0 && ncclShmem.work.header.isLast && ncclShmem.work.header.inFifo) {
@@ -184,17 +238,20 @@ __device__ void ncclKernel(
     }
     __syncthreads();
 
-    if (ncclShmem.work.header.funcIndex == FnIndex) {
+    uint16_t funcIndex = ncclShmem.work.header.funcIndex;
+    if (tid == 0) ncclTimelineRecord(ncclDevTimelineWorkBegin, funcIndex);
+    if (funcIndex == FnIndex) {
       RunWork<Fn, T, RedOp, Algo, Proto>().run(&ncclShmem.work);
     } else {
-      ncclFuncs[ncclShmem.work.header.funcIndex]();
+      ncclFuncs[funcIndex]();
     }
 
     int workIxNext = ncclShmem.work.header.workNext;
     __syncthreads();
+    if (tid == 0) ncclTimelineRecord(ncclDevTimelineWorkEnd, funcIndex);
     if (ncclShmem.work.header.isLast) break;
 
-    copyToShmem16(tid, &ncclShmem.work, workHead + workIxNext, sizeof(ncclWork));
+    copyToShmem16<Volatile>(tid, &ncclShmem.work, workHead + workIxNext, sizeof(ncclWork));
 
     { // Check whether the last operation was aborted and make sure all threads exit
       int aborted = tid == 0 ? *comm->abortFlag : 0;
@@ -204,12 +261,39 @@ __device__ void ncclKernel(
   }
 }
 
+template<ncclFunc_t Fn, typename T, typename RedOp, int Algo, int Proto, int FnIndex>
+__device__ void ncclKernel(
+    struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHead
+  )  {
+  int tid = threadIdx.x;
+
+  ncclMapChannelId(tid, channelMask);
+  __syncthreads(); // publish ncclShmem.channelId
+  int channelId = ncclShmem.channelId;
+  /* set abort flag to 0 */
+  if (tid == 0) ncclShmem.aborted = 0;
+
+  ncclLoadShmem</*Volatile=*/false>(tid, comm, channelId, workHead != nullptr ? workHead + blockIdx.x : nullptr);
+  __syncthreads(); // publish ncclShmem
+
+  ncclRunWorks<Fn, T, RedOp, Algo, Proto, FnIndex, /*Volatile=*/false>(tid, comm, workHead);
+}
+
 // Only generate kernels for SUM
 #if NCCL_OP == 0
+// Inline works are indexed straight from the argument, taking its address
+// would make the compiler copy it to local memory.
 #define IMPL_COLL_KERN(func, algo, proto, devredop, type, fIndex) \
 __global__ void NCCL_KERN_NAME(func, algo, proto, devredop, type)( \
-    struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHead \
+    struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHead, \
+    struct ncclKernelInlineWorks inlineWorks \
   ) { \
+  if (workHead == nullptr && threadIdx.x < NCCL_WORK_SIZE/16) { \
+    uint64_t a = inlineWorks.data[blockIdx.x][2*threadIdx.x]; \
+    uint64_t b = inlineWorks.data[blockIdx.x][2*threadIdx.x+1]; \
+    asm volatile("st.shared.v2.u64 [%0],{%1,%2};" :: \
+      "r"((uint32_t)__cvta_generic_to_shared((char*)&ncclShmem.work + 16*threadIdx.x)), "l"(a), "l"(b)); \
+  } \
   ncclKernel<ncclFunc##func, type, Func##devredop<type>, NCCL_ALGO_##algo, NCCL_PROTO_##proto, fIndex> \
     (comm, channelMask, workHead); \
 }
@@ -258,6 +342,10 @@ __device__ void NCCL_FUNC_NAME(func, algo, proto, devredop, type)() { \
 #define IMPL_COLL2(func, devredop) IMPL_COLL3(func, devredop, double,   ncclFloat64)
 #elif NCCL_TYPE == 9 && defined(__CUDA_BF16_TYPES_EXIST__)
 #define IMPL_COLL2(func, devredop) IMPL_COLL3(func, devredop, __nv_bfloat16, ncclBfloat16)
+#elif NCCL_TYPE == 10 && defined(__CUDA_FP8_TYPES_EXIST__)
+#define IMPL_COLL2(func, devredop) IMPL_COLL3(func, devredop, __nv_fp8_e4m3, ncclFloat8e4m3)
+#elif NCCL_TYPE == 11 && defined(__CUDA_FP8_TYPES_EXIST__)
+#define IMPL_COLL2(func, devredop) IMPL_COLL3(func, devredop, __nv_fp8_e5m2, ncclFloat8e5m2)
 #endif
 
 // Reduction define all functions
@@ -277,6 +365,19 @@ __device__ void NCCL_FUNC_NAME(func, algo, proto, devredop, type)() { \
   #else
     #define IMPL_COLL_R(func) // skip SumPostDiv for floating point
   #endif
+#elif NCCL_OP == 6
+  #if NCCL_TYPE >= 6
+    #define IMPL_COLL_R(func) IMPL_COLL2(func, SumPostOp);
+  #else
+    #define IMPL_COLL_R(func) // SumPostOp is only for floating point
+  #endif
+#elif NCCL_OP == 7
+  // Slim builds only, see NCCL_GENERIC_REDOP
+  #if NCCL_TYPE <= 3
+    #define IMPL_COLL_R(func) IMPL_COLL2(func, Generic);
+  #else
+    #define IMPL_COLL_R(func)
+  #endif
 #endif
 
 #if NCCL_OP == 0 && NCCL_TYPE == 0
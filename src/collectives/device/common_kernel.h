@@ -238,4 +238,81 @@ __device__ __forceinline__ void reduceCopy(
      nSrcs, srcPtrs, nDsts, dstPtrs, /*&*/nBytesBehind, /*&*/nBytesAhead);
 }
 
+#if __CUDA_ARCH__ >= 900 && __CUDACC_VER_MAJOR__ >= 12
+#define NCCL_BULK_COPY 1
+
+// Copy nBytes from src to each of dsts with bulk asynchronous copies (TMA).
+// Lane 0 of each warp streams BufBytes hunks through two buffers in the warp's
+// shared memory scratch, so a single thread per warp keeps the copy engine of
+// the SM busy. Returns false without copying anything when the pointers are
+// not 16B aligned or there is too little data to give every warp a hunk, in
+// which case the caller should fall back to reduceCopy.
+template<typename IntBytes>
+__device__ __forceinline__ bool bulkCopy(
+    int thread, int nThreads, void* scratch,
+    void* src, int nDsts, void** dstPtrs, IntBytes nBytes
+  ) {
+  constexpr int BufBytes = 2048;
+  static_assert(2*BufBytes + 2*sizeof(uint64_t) <= ncclShmemScratchWarpSize(900), "Warp scratch too small for bulk copies");
+  int nWarps = nThreads/WARP_SIZE;
+  int warp = thread/WARP_SIZE;
+  int lane = thread%WARP_SIZE;
+
+  if (nBytes < IntBytes(nWarps)*BufBytes) return false;
+  bool aligned = cvta_to_global(src)%16 == 0;
+  for (int d=0; d < nDsts; d++) aligned &= cvta_to_global(dstPtrs[d])%16 == 0;
+  if (!aligned) return false;
+
+  IntBytes nBulk = nBytes - nBytes%16;
+  if (lane == 0) {
+    uint32_t buf = cvta_to_shared(scratch);
+    uint32_t bar = buf + 2*BufBytes;
+    asm volatile("mbarrier.init.shared.b64 [%0], 1;" :: "r"(bar) : "memory");
+    asm volatile("mbarrier.init.shared.b64 [%0], 1;" :: "r"(bar+8) : "memory");
+    // Order the generic proxy accesses which made src ready (and any previous
+    // use of dsts) before the bulk copies, which go through the async proxy.
+    asm volatile("fence.proxy.async;" ::: "memory");
+    uint32_t phase = 0;
+    int b = 0;
+    for (IntBytes off = IntBytes(warp)*BufBytes; off < nBulk; off += IntBytes(nWarps)*BufBytes, b ^= 1) {
+      int bytes = nBulk-off < BufBytes ? int(nBulk-off) : BufBytes;
+      uint32_t bbuf = buf + b*BufBytes;
+      uint32_t bbar = bar + b*8;
+      // Stores from this buffer were issued two hunks ago, wait for them to read it.
+      asm volatile("cp.async.bulk.wait_group.read 1;" ::: "memory");
+      asm volatile("mbarrier.arrive.expect_tx.shared::cta.b64 _, [%0], %1;" :: "r"(bbar), "r"(bytes) : "memory");
+      asm volatile("cp.async.bulk.shared::cluster.global.mbarrier::complete_tx::bytes [%0], [%1], %2, [%3];"
+          :: "r"(bbuf), "l"(cvta_to_global(src)+off), "r"(bytes), "r"(bbar) : "memory");
+      uint32_t done;
+      do {
+        asm volatile("{ .reg .pred p; mbarrier.try_wait.parity.shared::cta.b64 p, [%1], %2; selp.u32 %0, 1, 0, p; }"
+            : "=r"(done) : "r"(bbar), "r"((phase>>b)&1) : "memory");
+      } while (!done);
+      phase ^= 1<<b;
+      for (int d=0; d < nDsts; d++) {
+        asm volatile("cp.async.bulk.global.shared::cta.bulk_group [%0], [%1], %2;"
+            :: "l"(cvta_to_global(dstPtrs[d])+off), "r"(bbuf), "r"(bytes) : "memory");
+      }
+      asm volatile("cp.async.bulk.commit_group;" ::: "memory");
+    }
+    // Stores must be complete and visible to the generic proxy before the
+    // caller signals the peers.
+    asm volatile("cp.async.bulk.wait_group 0;" ::: "memory");
+    asm volatile("fence.proxy.async;" ::: "memory");
+    asm volatile("mbarrier.inval.shared.b64 [%0];" :: "r"(bar) : "memory");
+    asm volatile("mbarrier.inval.shared.b64 [%0];" :: "r"(bar+8) : "memory");
+  }
+
+  // Bytes past the last 16B boundary are copied with regular stores.
+  if (thread < nBytes - nBulk) {
+    BytePack<1> v = ld_volatile_global<1>(cvta_to_global(src) + nBulk + thread);
+    for (int d=0; d < nDsts; d++) st_global<1>(cvta_to_global(dstPtrs[d]) + nBulk + thread, v);
+  }
+  __syncwarp();
+  return true;
+}
+#else
+#define NCCL_BULK_COPY 0
+#endif
+
 #endif // COMMON_KERNEL_H_
@@ -0,0 +1,79 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "determ.h"
+#include "checks.h"
+
+namespace {
+  // Half precision types accumulate in float
+  template<typename T> struct DetermAcc {
+    typedef T Acc;
+    static __device__ __forceinline__ T load(T x) { return x; }
+    static __device__ __forceinline__ T store(T x) { return x; }
+  };
+  template<> struct DetermAcc<half> {
+    typedef float Acc;
+    static __device__ __forceinline__ float load(half x) { return __half2float(x); }
+    static __device__ __forceinline__ half store(float x) { return __float2half_rn(x); }
+  };
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<> struct DetermAcc<__nv_bfloat16> {
+    typedef float Acc;
+    static __device__ __forceinline__ float load(__nv_bfloat16 x) { return __bfloat162float(x); }
+    static __device__ __forceinline__ __nv_bfloat16 store(float x) { return __float2bfloat16_rn(x); }
+  };
+#endif
+
+  template<typename T>
+  __global__ void determReduceKernel(const T* src, size_t stride, int nSrcs, T* dst, size_t count, ncclRedOp_t op) {
+    typedef typename DetermAcc<T>::Acc Acc;
+    size_t step = size_t(gridDim.x)*blockDim.x;
+    for (size_t i = size_t(blockIdx.x)*blockDim.x + threadIdx.x; i < count; i += step) {
+      Acc acc = DetermAcc<T>::load(src[i]);
+      for (int r=1; r < nSrcs; r++) {
+        Acc v = DetermAcc<T>::load(src[r*stride + i]);
+        acc = op == ncclProd ? acc*v : acc+v;
+      }
+      if (op == ncclAvg) acc = acc/Acc(nSrcs);
+      dst[i] = DetermAcc<T>::store(acc);
+    }
+  }
+
+  template<typename T>
+  ncclResult_t determReduce(const void* src, size_t stride, int nSrcs, void* dst, size_t count, ncclRedOp_t op, cudaStream_t stream) {
+    constexpr int nThreads = 512;
+    constexpr size_t maxBlocks = 1024;
+    size_t nBlocks = (count + nThreads-1)/nThreads;
+    if (nBlocks > maxBlocks) nBlocks = maxBlocks;
+    determReduceKernel<T><<<nBlocks, nThreads, 0, stream>>>((const T*)src, stride, nSrcs, (T*)dst, count, op);
+    CUDACHECK(cudaGetLastError());
+    return ncclSuccess;
+  }
+}
+
+bool ncclDetermTypeSupported(ncclDataType_t datatype) {
+  if (datatype == ncclFloat16 || datatype == ncclFloat32 || datatype == ncclFloat64) return true;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  if (datatype == ncclBfloat16) return true;
+#endif
+  return false;
+}
+
+ncclResult_t ncclDetermReduce(const void* src, size_t stride, int nSrcs, void* dst, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream) {
+  if (count == 0) return ncclSuccess;
+  switch (datatype) {
+  case ncclFloat16: return determReduce<half>(src, stride, nSrcs, dst, count, op, stream);
+  case ncclFloat32: return determReduce<float>(src, stride, nSrcs, dst, count, op, stream);
+  case ncclFloat64: return determReduce<double>(src, stride, nSrcs, dst, count, op, stream);
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16: return determReduce<__nv_bfloat16>(src, stride, nSrcs, dst, count, op, stream);
+#endif
+  default:
+    WARN("Unsupported type %d for deterministic reduction", datatype);
+    return ncclInvalidArgument;
+  }
+}
@@ -26,19 +26,45 @@ __shared__ ncclShmemData ncclShmem;
   NCCL_FUNC5(func, NVLS,           devredop, type, nullify), \
   NCCL_FUNC5(func, NVLS_TREE,      devredop, type, nullify)
 
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+#define NCCL_FUNCS3A_FP8(func, devredop, nullForFloat) \
+  , NCCL_FUNC4(func, devredop, __nv_fp8_e4m3, nullForFloat), \
+  NCCL_FUNC4(func, devredop, __nv_fp8_e5m2, nullForFloat)
+#define NCCL_FUNCS3B_FP8(func, devredop) \
+  , NCCL_FUNC4(func, devredop, int8_t, 0), \
+  NCCL_FUNC4(func, devredop, int8_t, 0)
+#else
+#define NCCL_FUNCS3A_FP8(func, devredop, nullForFloat)
+#define NCCL_FUNCS3B_FP8(func, devredop)
+#endif
+
 #if defined(__CUDA_BF16_TYPES_EXIST__)
 // Must be consistent with ncclDataType_t
-#define NCCL_FUNCS3A(func, devredop, nullForFloat) \
-  NCCL_FUNC4(func, devredop, int8_t, 0), \
-  NCCL_FUNC4(func, devredop, uint8_t, 0), \
-  NCCL_FUNC4(func, devredop, int32_t, 0), \
-  NCCL_FUNC4(func, devredop, uint32_t, 0), \
+#define NCCL_FUNCS3A(func, devredop, nullForFloat, gen8, gen32) \
+  NCCL_FUNC4(func, MACRO_IF(gen8, Generic, devredop), int8_t, 0), \
+  NCCL_FUNC4(func, MACRO_IF(gen8, Generic, devredop), uint8_t, 0), \
+  NCCL_FUNC4(func, MACRO_IF(gen32, Generic, devredop), int32_t, 0), \
+  NCCL_FUNC4(func, MACRO_IF(gen32, Generic, devredop), uint32_t, 0), \
   NCCL_FUNC4(func, devredop, int64_t, 0), \
   NCCL_FUNC4(func, devredop, uint64_t, 0), \
   NCCL_FUNC4(func, devredop, half, nullForFloat), \
   NCCL_FUNC4(func, devredop, float, nullForFloat), \
   NCCL_FUNC4(func, devredop, double, nullForFloat), \
-  NCCL_FUNC4(func, devredop, __nv_bfloat16, nullForFloat)
+  NCCL_FUNC4(func, devredop, __nv_bfloat16, nullForFloat) \
+  NCCL_FUNCS3A_FP8(func, devredop, nullForFloat)
+// SumPostOp only exists for floating point
+#define NCCL_FUNCS3C(func, devredop) \
+  NCCL_FUNC4(func, devredop, int8_t, 1), \
+  NCCL_FUNC4(func, devredop, uint8_t, 1), \
+  NCCL_FUNC4(func, devredop, int32_t, 1), \
+  NCCL_FUNC4(func, devredop, uint32_t, 1), \
+  NCCL_FUNC4(func, devredop, int64_t, 1), \
+  NCCL_FUNC4(func, devredop, uint64_t, 1), \
+  NCCL_FUNC4(func, devredop, half, 0), \
+  NCCL_FUNC4(func, devredop, float, 0), \
+  NCCL_FUNC4(func, devredop, double, 0), \
+  NCCL_FUNC4(func, devredop, __nv_bfloat16, 0) \
+  NCCL_FUNCS3A_FP8(func, devredop, 0)
 #define NCCL_FUNCS3B(func, devredop) \
   NCCL_FUNC4(func, devredop, int8_t, 0), \
   NCCL_FUNC4(func, devredop, int8_t, 0), \
@@ -49,19 +75,30 @@ __shared__ ncclShmemData ncclShmem;
   NCCL_FUNC4(func, devredop, int8_t, 0), \
   NCCL_FUNC4(func, devredop, int8_t, 0), \
   NCCL_FUNC4(func, devredop, int8_t, 0), \
-  NCCL_FUNC4(func, devredop, int8_t, 0)
+  NCCL_FUNC4(func, devredop, int8_t, 0) \
+  NCCL_FUNCS3B_FP8(func, devredop)
 #else
 // Must be consistent with ncclDataType_t
-#define NCCL_FUNCS3A(func, devredop, nullForFloat) \
-  NCCL_FUNC4(func, devredop, int8_t, 0), \
-  NCCL_FUNC4(func, devredop, uint8_t, 0), \
-  NCCL_FUNC4(func, devredop, int32_t, 0), \
-  NCCL_FUNC4(func, devredop, uint32_t, 0), \
+#define NCCL_FUNCS3A(func, devredop, nullForFloat, gen8, gen32) \
+  NCCL_FUNC4(func, MACRO_IF(gen8, Generic, devredop), int8_t, 0), \
+  NCCL_FUNC4(func, MACRO_IF(gen8, Generic, devredop), uint8_t, 0), \
+  NCCL_FUNC4(func, MACRO_IF(gen32, Generic, devredop), int32_t, 0), \
+  NCCL_FUNC4(func, MACRO_IF(gen32, Generic, devredop), uint32_t, 0), \
   NCCL_FUNC4(func, devredop, int64_t, 0), \
   NCCL_FUNC4(func, devredop, uint64_t, 0), \
   NCCL_FUNC4(func, devredop, half, nullForFloat), \
   NCCL_FUNC4(func, devredop, float, nullForFloat), \
   NCCL_FUNC4(func, devredop, double, nullForFloat)
+#define NCCL_FUNCS3C(func, devredop) \
+  NCCL_FUNC4(func, devredop, int8_t, 1), \
+  NCCL_FUNC4(func, devredop, uint8_t, 1), \
+  NCCL_FUNC4(func, devredop, int32_t, 1), \
+  NCCL_FUNC4(func, devredop, uint32_t, 1), \
+  NCCL_FUNC4(func, devredop, int64_t, 1), \
+  NCCL_FUNC4(func, devredop, uint64_t, 1), \
+  NCCL_FUNC4(func, devredop, half, 0), \
+  NCCL_FUNC4(func, devredop, float, 0), \
+  NCCL_FUNC4(func, devredop, double, 0)
 #define NCCL_FUNCS3B(func, devredop) \
   NCCL_FUNC4(func, devredop, int8_t, 0), \
   NCCL_FUNC4(func, devredop, int8_t, 0), \
@@ -74,14 +111,22 @@ __shared__ ncclShmemData ncclShmem;
   NCCL_FUNC4(func, devredop, int8_t, 0)
 #endif
 
+// Pairs of NCCL_GENERIC_REDOP go to FuncGeneric in slim builds
+#if NCCL_SLIM_KERNELS
+#define NCCL_SLIM 1
+#else
+#define NCCL_SLIM 0
+#endif
+
 // Must be consistent with ncclRedOp_t
 #define NCCL_FUNCS2A(func) \
-  NCCL_FUNCS3A(func, Sum,        /*nullForFloat=*/0), \
-  NCCL_FUNCS3A(func, Prod,       /*nullForFloat=*/0), \
-  NCCL_FUNCS3A(func, Max,        /*nullForFloat=*/0), \
-  NCCL_FUNCS3A(func, Min,        /*nullForFloat=*/0), \
-  NCCL_FUNCS3A(func, PreMulSum,  /*nullForFloat=*/0), \
-  NCCL_FUNCS3A(func, SumPostDiv, /*nullForFloat=*/1)
+  NCCL_FUNCS3A(func, Sum,        /*nullForFloat=*/0, /*gen8=*/0,         /*gen32=*/0), \
+  NCCL_FUNCS3A(func, Prod,       /*nullForFloat=*/0, /*gen8=*/NCCL_SLIM, /*gen32=*/0), \
+  NCCL_FUNCS3A(func, Max,        /*nullForFloat=*/0, /*gen8=*/NCCL_SLIM, /*gen32=*/0), \
+  NCCL_FUNCS3A(func, Min,        /*nullForFloat=*/0, /*gen8=*/NCCL_SLIM, /*gen32=*/0), \
+  NCCL_FUNCS3A(func, PreMulSum,  /*nullForFloat=*/0, /*gen8=*/NCCL_SLIM, /*gen32=*/NCCL_SLIM), \
+  NCCL_FUNCS3A(func, SumPostDiv, /*nullForFloat=*/1, /*gen8=*/0,         /*gen32=*/0), \
+  NCCL_FUNCS3C(func, SumPostOp)
 
 #define NCCL_FUNCS2B(func) \
   NCCL_FUNCS3B(func, Sum), \
@@ -89,10 +134,11 @@ __shared__ ncclShmemData ncclShmem;
   NCCL_FUNCS3B(func, Sum), \
   NCCL_FUNCS3B(func, Sum), \
   NCCL_FUNCS3B(func, Sum), \
+  NCCL_FUNCS3B(func, Sum), \
   NCCL_FUNCS3B(func, Sum)
 
 // Must be consistent with the ncclFuncSet enum
-__device__ ncclKern_t ncclFuncs[1+ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNumDevRedOps*ncclNumTypes*NCCL_NUM_ALGORITHMS*NCCL_NUM_PROTOCOLS] = {
+__device__ ncclKern_t ncclFuncs[1+2*ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNumDevRedOps*ncclNumTypes*NCCL_NUM_ALGORITHMS*NCCL_NUM_PROTOCOLS] = {
 // Don't try to initialize the host shadow copy of this device-side global
 // variable. There is no host pointer to a device-side function, which
 // confuses clang. This will be fixed in the next clang release.
@@ -110,6 +156,26 @@ __device__ ncclKern_t ncclFuncs[1+ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNumDevRedO
   #if defined(__CUDA_BF16_TYPES_EXIST__)
     NCCL_ONERANK_REDUCE_NAME(PreMulSum, __nv_bfloat16),
   #endif
+  #if defined(__CUDA_FP8_TYPES_EXIST__)
+    NCCL_ONERANK_REDUCE_NAME(PreMulSum, __nv_fp8_e4m3),
+    NCCL_ONERANK_REDUCE_NAME(PreMulSum, __nv_fp8_e5m2),
+  #endif
+  nullptr,
+  nullptr,
+  nullptr,
+  nullptr,
+  nullptr,
+  nullptr,
+  NCCL_ONERANK_REDUCE_NAME(SumPostOp, half),
+  NCCL_ONERANK_REDUCE_NAME(SumPostOp, float),
+  NCCL_ONERANK_REDUCE_NAME(SumPostOp, double),
+  #if defined(__CUDA_BF16_TYPES_EXIST__)
+    NCCL_ONERANK_REDUCE_NAME(SumPostOp, __nv_bfloat16),
+  #endif
+  #if defined(__CUDA_FP8_TYPES_EXIST__)
+    NCCL_ONERANK_REDUCE_NAME(SumPostOp, __nv_fp8_e4m3),
+    NCCL_ONERANK_REDUCE_NAME(SumPostOp, __nv_fp8_e5m2),
+  #endif
   NCCL_FUNCS2B(Broadcast),
   NCCL_FUNCS2A(Reduce),
   NCCL_FUNCS2B(AllGather),
@@ -118,5 +184,55 @@ __device__ ncclKern_t ncclFuncs[1+ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNumDevRedO
 #endif
 };
 
+// Resident kernel of NCCL_RESIDENT_KERNEL. Block y serves the y'th channel of
+// channelMask: it waits for the host to ring its doorbell, runs the works the
+// doorbell points at, then copies the doorbell to its done flag.
+// The doorbell layout is described in devcomm.h.
+__global__ void ncclResidentKernel(struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHeap, uint64_t* doorbells) {
+  __shared__ uint64_t bell;
+  int tid = threadIdx.x;
+  ncclMapChannelId(tid, channelMask);
+  __syncthreads(); // publish ncclShmem.channelId
+  int channelId = ncclShmem.channelId;
+  volatile uint64_t* doorbell = doorbells + channelId;
+  volatile uint64_t* done = doorbells + MAXCHANNELS + channelId;
+  uint64_t last = 0;
+
+  while (true) {
+    if (tid == 0) {
+      uint64_t b;
+      int spins = 0;
+      while ((b = *doorbell) == last) {
+        if (++spins == (1<<20)) {
+          spins = 0;
+          if (*comm->abortFlag) { b = NCCL_RESIDENT_KERNEL_STOP; break; }
+        }
+      }
+      bell = b;
+      ncclShmem.aborted = 0;
+    }
+    __syncthreads(); // publish bell
+    uint64_t b = bell;
+    if (b == NCCL_RESIDENT_KERNEL_STOP) break;
+    last = b;
+
+    // Reload comm and channel too, connections may have been added since the last plan.
+    struct ncclWork* workHead = workHeap + uint32_t(b);
+    ncclLoadShmem</*Volatile=*/true>(tid, comm, channelId, workHead + ((b>>32) & 0xff));
+    __syncthreads(); // publish ncclShmem
+
+    // No funcIndex is -1, all works go through ncclFuncs[].
+    ncclRunWorks<ncclNumFuncs, int8_t, void, NCCL_ALGO_RING, NCCL_PROTO_SIMPLE, /*FnIndex=*/-1, /*Volatile=*/true>(tid, comm, workHead);
+    __syncthreads();
+    // Release the stream even when aborting, like a regular kernel exiting would.
+    if (tid == 0) {
+      __threadfence_system();
+      *done = b;
+    }
+    int aborted = tid == 0 ? *comm->abortFlag : 0;
+    if (barrierReduceAny(aborted)) break;
+  }
+}
+
 // Workaround for https://reviews.llvm.org/D55580
 __device__ void ncclWorkaroundClangD55580() {}
@@ -12,15 +12,38 @@ if [ "$CUDA_MAJOR" -ge 11 ]
 then
     datatypes+=" bf16"
 fi
+if [ "$CUDA_MAJOR" -gt 11 ] || [ "$CUDA_MAJOR" -eq 11 -a "$CUDA_MINOR" -ge 8 ]
+then
+    datatypes+=" f8e4m3 f8e5m2"
+fi
 
 targets="GENOBJS := \\\\\n"
 
+ops="sum prod min max premulsum sumpostdiv sumpostop"
+slim=0
+if [ "$SLIM_KERNELS" != "" ] && [ "$SLIM_KERNELS" != "0" ]
+then
+    # Op 7 is the runtime dispatched op taking over NCCL_GENERIC_REDOP pairs
+    ops+=" generic"
+    slim=1
+fi
+
 for base in sendrecv all_reduce all_gather broadcast reduce reduce_scatter; do
   opn=0
-  for op in sum prod min max premulsum sumpostdiv; do
+  for op in ${ops}; do
     dtn=0
     # Order must match that of the ncclDataType_t enum
     for dt in ${datatypes}; do
+      if [ "$slim" -eq 1 ]
+      then
+        # Pairs of NCCL_GENERIC_REDOP in collectives.h only exist in the generic op,
+        # which is only built for the datatypes that have such pairs.
+        generic=0
+        if [ $dtn -le 1 ] && [ $opn -ge 1 -a $opn -le 4 ]; then generic=1; fi
+        if [ $dtn -ge 2 -a $dtn -le 3 ] && [ $opn -eq 4 ]; then generic=1; fi
+        if [ "$op" = "generic" ] && [ $dtn -le 3 ]; then generic=0; elif [ "$op" = "generic" ]; then generic=1; fi
+        if [ $generic -eq 1 ]; then dtn=$(($dtn + 1)); continue; fi
+      fi
       # Generate a unique filename for each compilation unit,
       # otherwise the __nv_module_id may conflict at link time
       echo "${dir}/${base}_${op}_${dt}.cu : ${base}.cu"
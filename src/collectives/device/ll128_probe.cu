@@ -0,0 +1,180 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "ll128_probe.h"
+#include "checks.h"
+#include <pthread.h>
+#include <string.h>
+
+// Lines have the LL128 layout: 8 threads store 16 bytes each, and the last 8 bytes
+// of a line hold the flag. The writer runs on our GPU and the reader on a peer GPU,
+// polling the lines the way a receiver does and checking the data once the flag is there.
+#define LL128_PROBE_LINES 4096
+#define LL128_PROBE_TIMEOUT (1LL<<31) // clocks, about a second
+#define LL128_PROBE_MAX_DEVS 64
+
+namespace {
+  // Shared by both kernels, in mapped host memory
+  struct probeSync {
+    int ready; // reader is polling
+    int torn;
+    int timeout;
+  };
+
+  __device__ __forceinline__ uint64_t probeData(int line, int word) {
+    return (uint64_t(line+1)*0x9E3779B97F4A7C15ULL) ^ (uint64_t(word+1) << 56);
+  }
+
+  __global__ void ll128ProbeWriter(uint64_t* lines, struct probeSync* sync) {
+    int lane = threadIdx.x;
+    int l = lane/8, w = lane%8;
+    // Start storing only once the reader is polling, so loads race with the stores
+    long long start = clock64();
+    while (*(volatile int*)&sync->ready == 0) {
+      if (clock64() - start > LL128_PROBE_TIMEOUT) return;
+    }
+    for (int base = 0; base < LL128_PROBE_LINES; base += 4) {
+      int line = base+l;
+      uint64_t* p = lines + line*16 + w*2;
+      uint64_t v0 = probeData(line, 2*w);
+      uint64_t v1 = w == 7 ? uint64_t(line+1) : probeData(line, 2*w+1);
+      asm volatile("st.volatile.global.v2.u64 [%0], {%1,%2};" :: "l"(p), "l"(v0), "l"(v1) : "memory");
+    }
+  }
+
+  __global__ void ll128ProbeReader(uint64_t* lines, struct probeSync* sync) {
+    int lane = threadIdx.x;
+    int l = lane/8, w = lane%8;
+    int torn = 0;
+    if (lane == 0) {
+      *(volatile int*)&sync->ready = 1;
+      __threadfence_system();
+    }
+    for (int base = 0; base < LL128_PROBE_LINES; base += 4) {
+      int line = base+l;
+      uint64_t* p = lines + line*16 + w*2;
+      uint64_t r0, r1;
+      long long start = clock64();
+      while (true) {
+        asm volatile("ld.volatile.global.v2.u64 {%0,%1}, [%2];" : "=l"(r0), "=l"(r1) : "l"(p) : "memory");
+        uint64_t flag = __shfl_sync(~0u, r1, (lane & ~7) + 7);
+        if (__all_sync(~0u, flag == uint64_t(line+1))) break;
+        if (clock64() - start > LL128_PROBE_TIMEOUT) {
+          if (lane == 0) *(volatile int*)&sync->timeout = 1;
+          return;
+        }
+      }
+      uint64_t v0 = probeData(line, 2*w);
+      uint64_t v1 = w == 7 ? uint64_t(line+1) : probeData(line, 2*w+1);
+      uint32_t bad = __ballot_sync(~0u, r0 != v0 || r1 != v1);
+      for (int i = 0; i < 4; i++) torn += (bad >> (8*i)) & 0xff ? 1 : 0;
+    }
+    if (lane == 0) *(volatile int*)&sync->torn = torn;
+  }
+
+  // Returns 1 if no torn line was seen, 0 if one was, -1 if the test could not complete.
+  // lines must be reachable from both devices.
+  ncclResult_t probeBuffer(uint64_t* lines, struct probeSync* sync, int writerDev, cudaStream_t writerStream,
+      int readerDev, cudaStream_t readerStream, int* result) {
+    memset(sync, 0, sizeof(*sync));
+    // Zero the lines before either kernel runs
+    CUDACHECK(cudaMemset(lines, 0, LL128_PROBE_LINES*128));
+    CUDACHECK(cudaSetDevice(readerDev));
+    ll128ProbeReader<<<1, 32, 0, readerStream>>>(lines, sync);
+    cudaError_t err = cudaGetLastError();
+    CUDACHECK(cudaSetDevice(writerDev));
+    CUDACHECK(err);
+    ll128ProbeWriter<<<1, 32, 0, writerStream>>>(lines, sync);
+    CUDACHECK(cudaGetLastError());
+    CUDACHECK(cudaStreamSynchronize(writerStream));
+    CUDACHECK(cudaStreamSynchronize(readerStream));
+    *result = sync->timeout ? -1 : sync->torn == 0 ? 1 : 0;
+    if (sync->torn) INFO(NCCL_INIT, "LL128 probe saw %d torn lines out of %d", sync->torn, LL128_PROBE_LINES);
+    return ncclSuccess;
+  }
+
+  ncclResult_t probeDevice(int cudaDev, int* tested, int* passed) {
+    ncclResult_t ret = ncclSuccess;
+    cudaStream_t stream = NULL, peerStream = NULL;
+    struct probeSync* sync = NULL;
+    uint64_t* hostLines = NULL;
+    uint64_t* peerLines = NULL;
+    int peerDev = -1, peerEnabled = 0, result, nDevs = 0;
+    *tested = *passed = 0;
+
+    // Both paths need a GPU on the other end, which is only visible when the process
+    // was given several
+    CUDACHECKGOTO(cudaGetDeviceCount(&nDevs), ret, exit);
+    for (int d=0; d<nDevs && peerDev == -1; d++) {
+      int canAccess = 0;
+      if (d != cudaDev && cudaDeviceCanAccessPeer(&canAccess, cudaDev, d) == cudaSuccess && canAccess) peerDev = d;
+    }
+    if (peerDev == -1) goto exit;
+
+    CUDACHECKGOTO(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking), ret, exit);
+    CUDACHECKGOTO(cudaHostAlloc(&sync, sizeof(*sync), cudaHostAllocMapped|cudaHostAllocPortable), ret, exit);
+    CUDACHECKGOTO(cudaHostAlloc(&hostLines, LL128_PROBE_LINES*128, cudaHostAllocMapped|cudaHostAllocPortable), ret, exit);
+    {
+      cudaError_t err = cudaDeviceEnablePeerAccess(peerDev, 0);
+      if (err == cudaSuccess) peerEnabled = 1;
+      else if (err == cudaErrorPeerAccessAlreadyEnabled) (void)cudaGetLastError();
+      else { (void)cudaGetLastError(); goto exit; }
+    }
+    CUDACHECKGOTO(cudaSetDevice(peerDev), ret, exit);
+    {
+      cudaError_t err = cudaStreamCreateWithFlags(&peerStream, cudaStreamNonBlocking);
+      if (err == cudaSuccess) err = cudaMalloc(&peerLines, LL128_PROBE_LINES*128);
+      CUDACHECKGOTO(cudaSetDevice(cudaDev), ret, exit);
+      CUDACHECKGOTO(err, ret, exit);
+    }
+
+    // Our GPU stores into host memory and the peer loads from it, as with SHM
+    NCCLCHECKGOTO(probeBuffer(hostLines, sync, cudaDev, stream, peerDev, peerStream, &result), ret, exit);
+    if (result != -1) *tested |= NCCL_LL128_PROBE_HOST;
+    if (result == 1) *passed |= NCCL_LL128_PROBE_HOST;
+    // Our GPU stores into the peer memory and the peer loads locally, as with P2P
+    NCCLCHECKGOTO(probeBuffer(peerLines, sync, cudaDev, stream, peerDev, peerStream, &result), ret, exit);
+    if (result != -1) *tested |= NCCL_LL128_PROBE_PEER;
+    if (result == 1) *passed |= NCCL_LL128_PROBE_PEER;
+
+  exit:
+    if (peerLines || peerStream) {
+      CUDACHECKIGNORE(cudaSetDevice(peerDev));
+      if (peerLines) CUDACHECKIGNORE(cudaFree(peerLines));
+      if (peerStream) CUDACHECKIGNORE(cudaStreamDestroy(peerStream));
+      CUDACHECKIGNORE(cudaSetDevice(cudaDev));
+    }
+    if (peerEnabled) CUDACHECKIGNORE(cudaDeviceDisablePeerAccess(peerDev));
+    if (hostLines) CUDACHECKIGNORE(cudaFreeHost(hostLines));
+    if (sync) CUDACHECKIGNORE(cudaFreeHost(sync));
+    if (stream) CUDACHECKIGNORE(cudaStreamDestroy(stream));
+    INFO(NCCL_INIT, "LL128 probe tested 0x%x passed 0x%x (peer GPU %d)", *tested, *passed, peerDev);
+    return ret;
+  }
+}
+
+// Results are kept per device, so the peer context is only touched by the first
+// communicator on each GPU
+static pthread_mutex_t probeLock = PTHREAD_MUTEX_INITIALIZER;
+static int probeDone[LL128_PROBE_MAX_DEVS];
+static int probeTested[LL128_PROBE_MAX_DEVS];
+static int probePassed[LL128_PROBE_MAX_DEVS];
+
+ncclResult_t ncclLl128Probe(int cudaDev, int* tested, int* passed) {
+  ncclResult_t ret = ncclSuccess;
+  *tested = *passed = 0;
+  if (cudaDev < 0 || cudaDev >= LL128_PROBE_MAX_DEVS) return ncclSuccess;
+  pthread_mutex_lock(&probeLock);
+  if (!probeDone[cudaDev]) {
+    NCCLCHECKGOTO(probeDevice(cudaDev, probeTested+cudaDev, probePassed+cudaDev), ret, exit);
+    probeDone[cudaDev] = 1;
+  }
+  *tested = probeTested[cudaDev];
+  *passed = probePassed[cudaDev];
+exit:
+  pthread_mutex_unlock(&probeLock);
+  return ret;
+}
@@ -58,5 +58,19 @@ INSTANTIATE(PreMulSum, half)
 #if defined(__CUDA_BF16_TYPES_EXIST__)
 INSTANTIATE(PreMulSum, __nv_bfloat16)
 #endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+INSTANTIATE(PreMulSum, __nv_fp8_e4m3)
+INSTANTIATE(PreMulSum, __nv_fp8_e5m2)
+#endif
 INSTANTIATE(PreMulSum, float)
 INSTANTIATE(PreMulSum, double)
+INSTANTIATE(SumPostOp, half)
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+INSTANTIATE(SumPostOp, __nv_bfloat16)
+#endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+INSTANTIATE(SumPostOp, __nv_fp8_e4m3)
+INSTANTIATE(SumPostOp, __nv_fp8_e5m2)
+#endif
+INSTANTIATE(SumPostOp, float)
+INSTANTIATE(SumPostOp, double)
@@ -64,9 +64,13 @@ class Primitives<T, RedOp, Fan, Direct, ProtoLL, P2p>:
   inline __device__ void waitSend(int nbytes) {
     if (sendConnHeadPtr) {
       int spins = 0;
-      while (sendConnHeadCache + NCCL_STEPS < sendConnHead + 1) {
-        sendConnHeadCache = *sendConnHeadPtr;
-        if (checkAbort(spins, 1)) break;
+      if (sendConnHeadCache + NCCL_STEPS < sendConnHead + 1) {
+        if (tid == 0) ncclTimelineRecord(ncclDevTimelineLLWaitBegin, 2*group+1);
+        while (sendConnHeadCache + NCCL_STEPS < sendConnHead + 1) {
+          sendConnHeadCache = *sendConnHeadPtr;
+          if (checkAbort(spins, 1)) break;
+        }
+        if (tid == 0) ncclTimelineRecord(ncclDevTimelineLLWaitEnd, 2*group+1);
       }
       if (sendConnFifoPtr) {
         int size = ((sendConnHead & NCCL_LL_CLEAN_MASK) == NCCL_LL_CLEAN_MASK) ? stepLines*sizeof(union ncclLLFifoLine) : nbytes;
@@ -99,10 +103,16 @@ class Primitives<T, RedOp, Fan, Direct, ProtoLL, P2p>:
     uint32_t flag = recvFlag(i);
     uint32_t data1, flag1, data2, flag2;
     int spins = 0;
+    bool waited = false;
     do {
       asm("ld.volatile.global.v4.u32 {%0,%1,%2,%3}, [%4];" : "=r"(data1), "=r"(flag1), "=r"(data2), "=r"(flag2) : "l"(&src->i4));
       if (checkAbort(spins, 0)) break;
+      if (tid == 0 && !waited && ((flag1 != flag) || (flag2 != flag))) {
+        waited = true;
+        ncclTimelineRecord(ncclDevTimelineLLWaitBegin, 2*group);
+      }
     } while ((flag1 != flag) || (flag2 != flag));
+    if (waited) ncclTimelineRecord(ncclDevTimelineLLWaitEnd, 2*group);
     uint64_t val64 = data1 + (((uint64_t)data2) << 32);
     return val64;
   }
@@ -328,16 +338,15 @@ class Primitives<T, RedOp, Fan, Direct, ProtoLL, P2p>:
     redOp(redOpArg),
     tid(tid), nthreads(nthreads), wid(tid%WARP_SIZE), group(group),
     stepLines(ncclShmem.comm.buffSizes[NCCL_PROTO_LL]/NCCL_STEPS/sizeof(ncclLLFifoLine)) {
-    auto *channel = &ncclShmem.channel;
     // If we are going to support oneshot collNet + LL, then we would need to add connector index here
     int nrecv=0, nsend=0;
     // We compare with Fan::MaxRecv here because this->MaxRecv is always at least 1
     while (nrecv < Fan::MaxRecv && recvPeers[nrecv] >= 0) {
-      loadRecvConn(&channel->peers[recvPeers[nrecv]]->recv[connIndexRecv], nrecv);
+      loadRecvConn(&ncclShmemPeer(recvPeers[nrecv])->recv[connIndexRecv], nrecv);
       nrecv++;
     }
     while (nsend < MaxSend && sendPeers[nsend] >= 0) {
-      loadSendConn(&channel->peers[sendPeers[nsend]]->send[connIndexSend], nsend);
+      loadSendConn(&ncclShmemPeer(sendPeers[nsend])->send[connIndexSend], nsend);
       nsend++;
     }
     this->fan = Fan(nrecv, nsend);
@@ -67,9 +67,13 @@ class Primitives<T, RedOp, Fan, Direct, ProtoLL128, P2p>:
   inline __device__ void waitSend(int nbytes) {
     if (sendConnHeadPtr) {
       int spins = 0;
-      while (sendConnHeadCache + NCCL_STEPS < sendConnHead + 1) {
-        sendConnHeadCache = *sendConnHeadPtr;
-        if (checkAbort(spins, wid, 1)) break;
+      if (sendConnHeadCache + NCCL_STEPS < sendConnHead + 1) {
+        if (tid == 0) ncclTimelineRecord(ncclDevTimelineLLWaitBegin, 2*group+1);
+        while (sendConnHeadCache + NCCL_STEPS < sendConnHead + 1) {
+          sendConnHeadCache = *sendConnHeadPtr;
+          if (checkAbort(spins, wid, 1)) break;
+        }
+        if (tid == 0) ncclTimelineRecord(ncclDevTimelineLLWaitEnd, 2*group+1);
       }
       if (sendConnFifoPtr) {
         sendConnFifoPtr[sendStep[wid]%NCCL_STEPS] = nbytes;
@@ -371,14 +375,13 @@ public:
     warpInBlock(threadIdx.x/WARP_SIZE),
     flagThread((tid%8)==7), group(group),
     stepSize(ncclShmem.comm.buffSizes[NCCL_PROTO_LL128]/NCCL_STEPS/sizeof(uint64_t)) {
-    auto *channel = &ncclShmem.channel;
     int nrecv=0, nsend=0;
     while (nrecv < MaxRecv && recvPeers[nrecv] >= 0) {
-      loadRecvConn(&channel->peers[recvPeers[nrecv]]->recv[connIndexRecv], nrecv);
+      loadRecvConn(&ncclShmemPeer(recvPeers[nrecv])->recv[connIndexRecv], nrecv);
       nrecv++;
     }
     while (nsend < MaxSend && sendPeers[nsend] >= 0) {
-      loadSendConn(&channel->peers[sendPeers[nsend]]->send[connIndexSend], nsend);
+      loadSendConn(&ncclShmemPeer(sendPeers[nsend])->send[connIndexSend], nsend);
       nsend++;
     }
     this->fan = Fan(nrecv, nsend);
@@ -44,6 +44,7 @@ class Primitives<
   };
   uint64_t *connStepPtr;
   uint64_t connStepCache; // Cache last seen value of (*connStepPtr)
+  int connSteps;          // Slots of the connection buffer, see ncclConnInfo::stepsShift
 
   // Don't use barrier 0 as it's used by the final sync
   __device__ void barrier() {
@@ -104,6 +105,9 @@ class Primitives<
     return flags & Aborted;
   }
 
+  // connSteps is a power of two
+  inline __device__ int stepSlot(uint64_t s) const { return s & (connSteps-1); }
+
   inline __device__ uint64_t loadStepValue(uint64_t* ptr) {
     #if __CUDA_ARCH__ >= 900 && CUDART_VERSION >= 12010
     if (flags & NvlsMinPolling) {
@@ -125,28 +129,32 @@ class Primitives<
     if (((flags & (Recv*RoleWaitRecv)) && !noRecvWait) ||
         ((flags & (Send*RoleWaitSend)) && !noSendWait)) {
       int spins = 0;
-      while (connStepCache + (isSendNotRecv ? NCCL_STEPS : 0) < step + StepPerSlice) {
-        connStepCache = loadStepValue(connStepPtr);
-        if (checkAbort(spins)) break;
-        //if (spins == 0) printf("r=%d b=%d t=%d SPUN OUT got=%d want=%d\n", ncclShmem.comm.rank, blockIdx.x, threadIdx.x, int(connStepCache + (isSendNotRecv ? NCCL_STEPS : 0)), int(step+StepPerSlice));
+      if (connStepCache + (isSendNotRecv ? connSteps : 0) < step + StepPerSlice) {
+        ncclTimelineRecord(ncclDevTimelineWaitBegin, 2*group+isSendNotRecv);
+        while (connStepCache + (isSendNotRecv ? connSteps : 0) < step + StepPerSlice) {
+          connStepCache = loadStepValue(connStepPtr);
+          if (checkAbort(spins)) break;
+          //if (spins == 0) printf("r=%d b=%d t=%d SPUN OUT got=%d want=%d\n", ncclShmem.comm.rank, blockIdx.x, threadIdx.x, int(connStepCache + (isSendNotRecv ? connSteps : 0)), int(step+StepPerSlice));
+        }
+        ncclTimelineRecord(ncclDevTimelineWaitEnd, 2*group+isSendNotRecv);
       }
     }
 
     if (flags & (Recv*RoleWaitRecv | Send*RoleWaitSend)) {
       if (isSendNotRecv && (flags & SizesFifoEnabled))
-        connSizesFifoPtr[step%NCCL_STEPS] = nelts*sizeof(T);
+        connSizesFifoPtr[stepSlot(step)] = nelts*sizeof(T);
 
       void **ptrs = isSendNotRecv ? (ncclShmem.groups[group].dsts + Dst)
                                   : (ncclShmem.groups[group].srcs + Src);
       if (flags & OffsFifoEnabled)
-        ptrs[index] = connEltsFifo + loadInt(connOffsFifoPtr + (step%NCCL_STEPS))/sizeof(T);
+        ptrs[index] = connEltsFifo + loadInt(connOffsFifoPtr + stepSlot(step))/sizeof(T);
       else if (isSendNotRecv && DirectSend) {
         if (flags & DirectWrite) {
           ptrs[index] = directBuff + dstIx + offset;
         } else if (flags & DirectRead) {  // empty send
           ptrs[index] = nullptr;
         } else {
-          ptrs[index] = connEltsFifo + (step%NCCL_STEPS)*stepSize;
+          ptrs[index] = connEltsFifo + stepSlot(step)*stepSize;
         }
       } else if (!isSendNotRecv && DirectRecv) {
         if (flags & DirectRead) {
@@ -154,13 +162,34 @@ class Primitives<
         } else if (flags & DirectWrite) {
           ptrs[index] = directBuff + dstIx + offset;  // send to next from my output buffer
         } else {
-          ptrs[index] = connEltsFifo + (step%NCCL_STEPS)*stepSize;
+          ptrs[index] = connEltsFifo + stepSlot(step)*stepSize;
         }
       }
       else {
-        ptrs[index] = connEltsFifo + (step%NCCL_STEPS)*stepSize;
+        ptrs[index] = connEltsFifo + stepSlot(step)*stepSize;
       }
       step += StepPerSlice;
+      if (!isSendNotRecv && ncclShmem.comm.prefetch) {
+        // Tell workers where the next slice is if the peer posted it already, so
+        // they can pull it into L2 while reducing this one.
+        void* next = nullptr;
+        if (!(flags & OffsFifoEnabled) && !(DirectRecv && (flags & (DirectRead|DirectWrite)))) {
+          if (connStepCache < step + StepPerSlice) connStepCache = loadStepValue(connStepPtr);
+          if (connStepCache >= step + StepPerSlice) next = connEltsFifo + stepSlot(step)*stepSize;
+        }
+        ncclShmem.groups[group].nextSrcs[index] = next;
+      }
+    }
+  }
+
+  // Workers spread L2 prefetches of the next slice of each peer, as published by waitPeer.
+  __device__ __forceinline__ void prefetchNextSlices(int nbytes) {
+    for (int i=0; i < fan.nrecv(); i++) {
+      char* next = (char*)ncclShmem.groups[group].nextSrcs[i];
+      if (next == nullptr) continue;
+      for (int off = tid*128; off < nbytes; off += nworkers*128) {
+        asm volatile("prefetch.global.L2 [%0];" :: "l"(next+off) : "memory");
+      }
     }
   }
 
@@ -173,6 +202,16 @@ class Primitives<
     }
   }
 
+  // Copies without reduction can be done with bulk asynchronous copies on sm_90.
+  __device__ __forceinline__ bool bulkCopySlice(void* src, int nDsts, void** dsts, int nelem) {
+  #if NCCL_BULK_COPY
+    return ncclShmem.comm.bulkCopy &&
+      bulkCopy(tid, nworkers, ncclScratchForWarp(tidInBlock/WARP_SIZE), src, nDsts, dsts, ssize_t(nelem)*sizeof(T));
+  #else
+    return false;
+  #endif
+  }
+
   template <int DirectRecv1, int DirectSend1, int Recv, int Send, int SrcBuf, int DstBuf>
   __device__ __forceinline__ void genericOp(
       intptr_t srcIx, intptr_t dstIx, int nelem, bool postOp
@@ -229,9 +268,10 @@ class Primitives<
         /* if user abort the kernel, we don't need to actually perform copy/reduce; just set size
          * to 0 to avoid unnecessary workload. */
         int workSize = ncclShmem.aborted ? 0 : sliceSize;
+        if (tid == 0) ncclTimelineRecord(ncclDevTimelineCopyBegin, group);
         if (DirectRecv && ncclShmem.groups[group].srcs[0] == ncclShmem.groups[group].dsts[0]) {
           // We can only have one direct receive. Since srcs[0] == dstPtr+offset, skip one copy
-          if (Send) {
+          if (Send && !bulkCopySlice(ncclShmem.groups[group].srcs[0], fan.nsend(), ncclShmem.groups[group].dsts+1, workSize)) {
             reduceCopy<Unroll, RedOp, T, 0, 1, 1, 0, 1, MaxSend, /*PreOpSrcs*/0>
               (tid, nworkers, /*redArg*/0, /*preOpArgs*/nullptr, /*postOp*/false,
                1, ncclShmem.groups[group].srcs,
@@ -245,6 +285,10 @@ class Primitives<
              Recv, ncclShmem.groups[group].srcs,
              Dst, ncclShmem.groups[group].dsts,
              workSize);
+        } else if (Recv*MaxRecv+Src == 1 && MultimemSrcs == 0 && MultimemDsts == 0 &&
+                   Apply_PreOp<RedOp, 1>::IsIdentity && Apply_PostOp<RedOp, 1>::IsIdentity &&
+                   bulkCopySlice(ncclShmem.groups[group].srcs[0], Send*fan.nsend()+Dst, ncclShmem.groups[group].dsts, workSize)) {
+          // Copied by bulkCopySlice
         } else {
           constexpr int PreOpSrcs = SrcBuf != Input ? 0 :
                                     DirectRecv*MaxRecv == NCCL_MAX_DIRECT_ARITY ? (1+NCCL_MAX_DIRECT_ARITY) : 1;
@@ -256,7 +300,9 @@ class Primitives<
              Send*fan.nsend()+Dst, ncclShmem.groups[group].dsts,
              workSize);
         }
+        if (Recv && ncclShmem.comm.prefetch) prefetchNextSlices(sliceSize*sizeof(T));
         barrier(); // This barrier has a counterpart in following loop
+        if (tid == 0) ncclTimelineRecord(ncclDevTimelineCopyEnd, group);
         postPeer<Recv, Send>(0 < sliceSize);
         offset += sliceSize;
         slice += 1;
@@ -348,6 +394,7 @@ class Primitives<
   __device__ __forceinline__ void loadRecvConn(ncclDevChannelPeer *peer, int connIndex, struct ncclWorkElem* e) {
     if (flags & (RoleWaitRecv|RolePostRecv)) {
       auto *conn = &peer->recv[connIndex];
+      connSteps = NCCL_STEPS << conn->stepsShift;
       step = conn->step;
       step = roundUp(step, SlicePerChunk*StepPerSlice);
       if (flags & RolePostRecv) {
@@ -382,6 +429,7 @@ class Primitives<
         if (flags & OffsFifoEnabled)
           connOffsFifoPtr = conn->offsFifo;
         connEltsFifo = (T*)conn->buffs[NCCL_PROTO_SIMPLE];
+        if (ncclShmem.work.header.p2pWrite && conn->buffWrite) connEltsFifo = (T*)conn->buffWrite;
       }
     }
   }
@@ -389,6 +437,7 @@ class Primitives<
   __device__ __forceinline__ void loadSendConn(ncclDevChannelPeer *peer, int connIndex, struct ncclWorkElem* e) {
     if (flags & (RoleWaitSend|RolePostSend)) {
       auto *conn = &peer->send[connIndex];
+      connSteps = NCCL_STEPS << conn->stepsShift;
       step = conn->step;
       step = roundUp(step, SlicePerChunk*StepPerSlice);
       if (flags & RolePostSend) {
@@ -403,6 +452,7 @@ class Primitives<
         if (flags & OffsFifoEnabled)
           connOffsFifoPtr = conn->offsFifo;
         connEltsFifo = (T*)conn->buffs[NCCL_PROTO_SIMPLE];
+        if (ncclShmem.work.header.p2pWrite && conn->buffWrite) connEltsFifo = (T*)conn->buffWrite;
 
         if (conn->sizesFifo != nullptr) {
           flags |= SizesFifoEnabled;
@@ -454,6 +504,7 @@ class Primitives<
     int ng = nthreads / ThreadPerSync;
     index = tid % ThreadPerSync;
     flags = 0;
+    connSteps = NCCL_STEPS;
     if (g == 0) {
       if (index < nrecv) flags |= RoleWaitRecv;
       if (index == nrecv) flags |= RoleInput;
@@ -470,8 +521,10 @@ class Primitives<
     if (flags & (RoleWaitRecv|RolePostRecv)) peer = recvPeers[index];
     if (flags & (RoleWaitSend|RolePostSend)) peer = sendPeers[index];
 
-    loadRecvConn(ncclShmem.channel.peers[peer], connIndexRecv, e);
-    loadSendConn(ncclShmem.channel.peers[peer], connIndexSend, e);
+    // Threads without a peer role load nothing
+    struct ncclDevChannelPeer* devPeer = (flags & (RoleWaitRecv|RolePostRecv|RoleWaitSend|RolePostSend)) ? ncclShmemPeer(peer) : nullptr;
+    loadRecvConn(devPeer, connIndexRecv, e);
+    loadSendConn(devPeer, connIndexSend, e);
 
     setDataPtrs(inputBuf, outputBuf, redOpArg, (struct ncclWorkElemReg*)e);
   }
@@ -9,6 +9,7 @@
 #define NCCL_REDUCE_KERNEL_H_
 
 #include "op128.h"
+#include "collectives.h"
 #include <limits>
 #include <type_traits>
 
@@ -29,8 +30,20 @@ struct FuncMin  { using EltType = T; __device__ FuncMin(uint64_t opArg=0) {}; };
 template<typename T>
 struct FuncMax  { using EltType = T; __device__ FuncMax(uint64_t opArg=0) {}; };
 
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+// Sums of bfloat16 round to nearest, or stochastically when opArg is non zero
+// (NCCL_BF16_STOCHASTIC_ROUND). Its low 32 bits then seed the random bits.
+template<>
+struct FuncSum<__nv_bfloat16> {
+  using EltType = __nv_bfloat16;
+  uint32_t seed;
+  __device__ FuncSum(uint64_t opArg=0): seed(uint32_t(opArg)) {}
+};
+#endif
+
 template<typename T> struct FuncPreMulSum;
 template<typename T> struct FuncSumPostDiv;
+template<typename T> struct FuncSumPostOp;
 
 ////////////////////////////////////////////////////////////////////////////////
 // Trait classes for reduction functions. Given a function (FuncSum, etc.)
@@ -245,8 +258,6 @@ struct Apply_Reduce<FuncSum<int8_t>, /*EltPerPack=*/4> {
 
 #if defined(__CUDA_BF16_TYPES_EXIST__)
 #if __CUDA_ARCH__ >= 800
-  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 1, __nv_bfloat16, __hadd(x, y))
-  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 2, __nv_bfloat162, __hadd2(x, y))
   SPECIALIZE_REDUCE(FuncProd, __nv_bfloat16, 1, __nv_bfloat16, __hmul(x, y))
   SPECIALIZE_REDUCE(FuncProd, __nv_bfloat16, 2, __nv_bfloat162, __hmul2(x, y))
   SPECIALIZE_REDUCE(FuncMin, __nv_bfloat16, 1, __nv_bfloat16, __hmin(x, y))
@@ -254,7 +265,6 @@ struct Apply_Reduce<FuncSum<int8_t>, /*EltPerPack=*/4> {
   SPECIALIZE_REDUCE(FuncMax, __nv_bfloat16, 1, __nv_bfloat16, __hmax(x, y))
   SPECIALIZE_REDUCE(FuncMax, __nv_bfloat16, 2, __nv_bfloat162, __hmax2(x, y))
 #else
-  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 1, __nv_bfloat16, __float2bfloat16(__bfloat162float(x) + __bfloat162float(y)))
   SPECIALIZE_REDUCE(FuncProd, __nv_bfloat16, 1, __nv_bfloat16, __float2bfloat16(__bfloat162float(x) * __bfloat162float(y)))
   SPECIALIZE_REDUCE(FuncMin, __nv_bfloat16, 1, __nv_bfloat16, __float2bfloat16(fminf(__bfloat162float(x), __bfloat162float(y))))
   SPECIALIZE_REDUCE(FuncMax, __nv_bfloat16, 1, __nv_bfloat16, __float2bfloat16(fmaxf(__bfloat162float(x), __bfloat162float(y))))
@@ -263,6 +273,112 @@ struct Apply_Reduce<FuncSum<int8_t>, /*EltPerPack=*/4> {
 
 #undef SPECIALIZE_REDUCE
 
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+// Stochastic rounding of bfloat16 sums : the float sum is rounded up with a
+// probability equal to the fraction of the bf16 ulp it is past the lower value,
+// so the rounding errors of successive ring steps cancel out on average instead
+// of accumulating. The random bits are a hash of the seed, the thread and the
+// inputs, so results are still reproducible from run to run.
+__device__ __forceinline__ uint32_t bf16RandomBits(uint32_t seed, uint32_t inputs) {
+  uint32_t x = seed ^ inputs ^ ((blockIdx.x*blockDim.x + threadIdx.x)*0x9e3779b9u);
+  x ^= x >> 16; x *= 0x7feb352du;
+  x ^= x >> 15; x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+__device__ __forceinline__ __nv_bfloat16 bf16StochasticRound(float f, uint32_t rnd) {
+  uint32_t u = __float_as_uint(f);
+  if ((u & 0x7f800000u) == 0x7f800000u) return __float2bfloat16(f); // Inf and NaN
+  return __ushort_as_bfloat16(uint16_t((u + (rnd & 0xffffu)) >> 16));
+}
+
+template<>
+struct Apply_Reduce<FuncSum<__nv_bfloat16>, /*EltPerPack=*/1> {
+  __device__ __forceinline__ static BytePack<sizeof(__nv_bfloat16)> reduce(
+      FuncSum<__nv_bfloat16> fn, BytePack<sizeof(__nv_bfloat16)> a, BytePack<sizeof(__nv_bfloat16)> b
+    ) {
+    __nv_bfloat16 x = fromPack<__nv_bfloat16>(a);
+    __nv_bfloat16 y = fromPack<__nv_bfloat16>(b);
+    if (fn.seed == 0) {
+#if __CUDA_ARCH__ >= 800
+      return toPack<__nv_bfloat16>(__hadd(x, y));
+#else
+      return toPack<__nv_bfloat16>(__float2bfloat16(__bfloat162float(x) + __bfloat162float(y)));
+#endif
+    }
+    float sum = __bfloat162float(x) + __bfloat162float(y);
+    return toPack<__nv_bfloat16>(bf16StochasticRound(sum, bf16RandomBits(fn.seed, a.u16 | uint32_t(b.u16)<<16)));
+  }
+};
+
+#if __CUDA_ARCH__ >= 800
+template<>
+struct Apply_Reduce<FuncSum<__nv_bfloat16>, /*EltPerPack=*/2> {
+  __device__ __forceinline__ static BytePack<sizeof(__nv_bfloat162)> reduce(
+      FuncSum<__nv_bfloat16> fn, BytePack<sizeof(__nv_bfloat162)> a, BytePack<sizeof(__nv_bfloat162)> b
+    ) {
+    __nv_bfloat162 x = fromPack<__nv_bfloat162>(a);
+    __nv_bfloat162 y = fromPack<__nv_bfloat162>(b);
+    if (fn.seed == 0) return toPack<__nv_bfloat162>(__hadd2(x, y));
+    float2 fx = __bfloat1622float2(x), fy = __bfloat1622float2(y);
+    uint32_t rnd = bf16RandomBits(fn.seed, a.u32 ^ (b.u32*0x85ebca6bu));
+    __nv_bfloat162 z;
+    z.x = bf16StochasticRound(fx.x + fy.x, rnd);
+    z.y = bf16StochasticRound(fx.y + fy.y, rnd >> 16);
+    return toPack<__nv_bfloat162>(z);
+  }
+};
+#endif
+#endif
+
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+// FP8 elements are widened to float (or to half2 for pairs of elements) to be
+// reduced, and the result is rounded back saturating to the largest finite value.
+#define SPECIALIZE_REDUCE_FP8(Fn, T, interp, expr_of_x_y) \
+  template<> \
+  struct Apply_Reduce<Fn<T>, /*EltPerPack=*/1> { \
+    __device__ __forceinline__ static BytePack<1> reduce(Fn<T> fn, BytePack<1> a, BytePack<1> b) { \
+      float x = __half2float(__half(__nv_cvt_fp8_to_halfraw(a.u8, interp))); \
+      float y = __half2float(__half(__nv_cvt_fp8_to_halfraw(b.u8, interp))); \
+      a.u8 = __nv_cvt_float_to_fp8(expr_of_x_y, __NV_SATFINITE, interp); \
+      return a; \
+    } \
+  };
+#define SPECIALIZE_REDUCE_FP8X2(Fn, T, interp, expr_of_x_y) \
+  template<> \
+  struct Apply_Reduce<Fn<T>, /*EltPerPack=*/2> { \
+    __device__ __forceinline__ static BytePack<2> reduce(Fn<T> fn, BytePack<2> a, BytePack<2> b) { \
+      half2 x = __half2(__nv_cvt_fp8x2_to_halfraw2(a.u16, interp)); \
+      half2 y = __half2(__nv_cvt_fp8x2_to_halfraw2(b.u16, interp)); \
+      a.u16 = __nv_cvt_halfraw2_to_fp8x2(__half2_raw(expr_of_x_y), __NV_SATFINITE, interp); \
+      return a; \
+    } \
+  };
+
+  SPECIALIZE_REDUCE_FP8(FuncSum, __nv_fp8_e4m3, __NV_E4M3, x + y)
+  SPECIALIZE_REDUCE_FP8(FuncProd, __nv_fp8_e4m3, __NV_E4M3, x * y)
+  SPECIALIZE_REDUCE_FP8(FuncMin, __nv_fp8_e4m3, __NV_E4M3, fminf(x, y))
+  SPECIALIZE_REDUCE_FP8(FuncMax, __nv_fp8_e4m3, __NV_E4M3, fmaxf(x, y))
+  SPECIALIZE_REDUCE_FP8(FuncSum, __nv_fp8_e5m2, __NV_E5M2, x + y)
+  SPECIALIZE_REDUCE_FP8(FuncProd, __nv_fp8_e5m2, __NV_E5M2, x * y)
+  SPECIALIZE_REDUCE_FP8(FuncMin, __nv_fp8_e5m2, __NV_E5M2, fminf(x, y))
+  SPECIALIZE_REDUCE_FP8(FuncMax, __nv_fp8_e5m2, __NV_E5M2, fmaxf(x, y))
+#if __CUDA_ARCH__ >= 800
+  SPECIALIZE_REDUCE_FP8X2(FuncSum, __nv_fp8_e4m3, __NV_E4M3, __hadd2(x, y))
+  SPECIALIZE_REDUCE_FP8X2(FuncProd, __nv_fp8_e4m3, __NV_E4M3, __hmul2(x, y))
+  SPECIALIZE_REDUCE_FP8X2(FuncMin, __nv_fp8_e4m3, __NV_E4M3, __hmin2(x, y))
+  SPECIALIZE_REDUCE_FP8X2(FuncMax, __nv_fp8_e4m3, __NV_E4M3, __hmax2(x, y))
+  SPECIALIZE_REDUCE_FP8X2(FuncSum, __nv_fp8_e5m2, __NV_E5M2, __hadd2(x, y))
+  SPECIALIZE_REDUCE_FP8X2(FuncProd, __nv_fp8_e5m2, __NV_E5M2, __hmul2(x, y))
+  SPECIALIZE_REDUCE_FP8X2(FuncMin, __nv_fp8_e5m2, __NV_E5M2, __hmin2(x, y))
+  SPECIALIZE_REDUCE_FP8X2(FuncMax, __nv_fp8_e5m2, __NV_E5M2, __hmax2(x, y))
+#endif
+
+#undef SPECIALIZE_REDUCE_FP8X2
+#undef SPECIALIZE_REDUCE_FP8
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // Apply_PreOp
 
@@ -405,6 +521,35 @@ struct FuncPreMulSum<half> {
   };
 #endif
 
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+  // The scalar is given in the fp8 type itself.
+  #if __CUDA_ARCH__ >= 800
+    #define DEFINE_FP8_PREMULSUM(T, interp) \
+      template<> \
+      struct FuncPreMulSum<T> { \
+        using EltType = T; \
+        half2 scalar; \
+        __device__ FuncPreMulSum(uint64_t opArg=0) { \
+          scalar.x = __half(__nv_cvt_fp8_to_halfraw(__nv_fp8_storage_t(opArg), interp)); \
+          scalar.y = scalar.x; \
+        } \
+      };
+  #else
+    #define DEFINE_FP8_PREMULSUM(T, interp) \
+      template<> \
+      struct FuncPreMulSum<T> { \
+        using EltType = T; \
+        float scalar; \
+        __device__ FuncPreMulSum(uint64_t opArg=0) { \
+          scalar = __half2float(__half(__nv_cvt_fp8_to_halfraw(__nv_fp8_storage_t(opArg), interp))); \
+        } \
+      };
+  #endif
+  DEFINE_FP8_PREMULSUM(__nv_fp8_e4m3, __NV_E4M3)
+  DEFINE_FP8_PREMULSUM(__nv_fp8_e5m2, __NV_E5M2)
+  #undef DEFINE_FP8_PREMULSUM
+#endif
+
 template<typename T>
 struct Apply_Reduce<FuncPreMulSum<T>, /*EltPerPack=*/1> {
   __device__ static BytePack<sizeof(T)> reduce(FuncPreMulSum<T> fn, BytePack<sizeof(T)> a, BytePack<sizeof(T)> b) {
@@ -476,6 +621,47 @@ struct Apply_PreOp<FuncPreMulSum<half>, /*EltPerPack=*/1> {
   #endif
 #endif
 
+////////////////////////////////////////////////////////////////////////////////
+// Apply_PreOp of FuncPreMulSum for fp8.
+
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+  #if __CUDA_ARCH__ >= 800
+    #define DEFINE_FP8_PREOP(T, interp) \
+      template<> \
+      struct Apply_PreOp<FuncPreMulSum<T>, /*EltPerPack=*/1> { \
+        static constexpr bool IsIdentity = false; \
+        __device__ static BytePack<1> preOp(FuncPreMulSum<T> fn, BytePack<1> a) { \
+          __half x = __hmul(__half(__nv_cvt_fp8_to_halfraw(a.u8, interp)), fn.scalar.x); \
+          a.u8 = __nv_cvt_halfraw_to_fp8(__half_raw(x), __NV_SATFINITE, interp); \
+          return a; \
+        } \
+      }; \
+      template<> \
+      struct Apply_PreOp<FuncPreMulSum<T>, /*EltPerPack=*/2> { \
+        static constexpr bool IsIdentity = false; \
+        __device__ static BytePack<2> preOp(FuncPreMulSum<T> fn, BytePack<2> a) { \
+          half2 x = __hmul2(__half2(__nv_cvt_fp8x2_to_halfraw2(a.u16, interp)), fn.scalar); \
+          a.u16 = __nv_cvt_halfraw2_to_fp8x2(__half2_raw(x), __NV_SATFINITE, interp); \
+          return a; \
+        } \
+      };
+  #else
+    #define DEFINE_FP8_PREOP(T, interp) \
+      template<> \
+      struct Apply_PreOp<FuncPreMulSum<T>, /*EltPerPack=*/1> { \
+        static constexpr bool IsIdentity = false; \
+        __device__ static BytePack<1> preOp(FuncPreMulSum<T> fn, BytePack<1> a) { \
+          float x = __half2float(__half(__nv_cvt_fp8_to_halfraw(a.u8, interp))) * fn.scalar; \
+          a.u8 = __nv_cvt_float_to_fp8(x, __NV_SATFINITE, interp); \
+          return a; \
+        } \
+      };
+  #endif
+  DEFINE_FP8_PREOP(__nv_fp8_e4m3, __NV_E4M3)
+  DEFINE_FP8_PREOP(__nv_fp8_e5m2, __NV_E5M2)
+  #undef DEFINE_FP8_PREOP
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // FuncSumPostDiv
 
@@ -487,6 +673,12 @@ struct IsFloatingPoint<half>: std::true_type {};
 template<>
 struct IsFloatingPoint<__nv_bfloat16>: std::true_type {};
 #endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+template<>
+struct IsFloatingPoint<__nv_fp8_e4m3>: std::true_type {};
+template<>
+struct IsFloatingPoint<__nv_fp8_e5m2>: std::true_type {};
+#endif
 template<>
 struct IsFloatingPoint<float>: std::true_type {};
 template<>
@@ -502,11 +694,37 @@ struct FuncSumPostDiv: FuncSumPostDiv_IntOnly<T> {
   }
 };
 
+// The division of the final step is a multiply-high by a magic number, computed once
+// here (Granlund & Montgomery, "Division by invariant integers using multiplication",
+// figure 4.1), rather than an integer division per element, 64-bit ones being emulated.
 template<typename T>
 struct FuncSumPostDiv_IntOnly<T, /*IsFloating=*/false>: FuncSum<T> {
   using EltType = T;
+  using UintType = typename std::conditional<sizeof(T) == 8, uint64_t, uint32_t>::type;
   int divisor;
-  __device__ FuncSumPostDiv_IntOnly(uint64_t opArg=0): divisor(opArg) {}
+  UintType magic;
+  int shift1, shift2;
+  __device__ FuncSumPostDiv_IntOnly(uint64_t opArg=0): divisor(opArg) {
+    uint32_t d = divisor > 0 ? divisor : 1;
+    int l = d == 1 ? 0 : 32 - __clz(d-1); // ceil(log2(d))
+    uint64_t r = (uint64_t(1)<<l) - d; // < d < 2^31
+    // magic = floor(2^N * r / d) + 1, N being the bits of UintType
+    if (sizeof(UintType) == 8) {
+      uint64_t hi = (r<<32)/d;
+      uint64_t lo = (((r<<32)%d)<<32)/d;
+      magic = UintType((hi<<32 | lo) + 1);
+    } else {
+      magic = UintType(((r<<32)/d) + 1);
+    }
+    shift1 = min(l, 1);
+    shift2 = max(l-1, 0);
+  }
+  __device__ UintType divide(UintType n) const {
+    UintType t;
+    if (sizeof(UintType) == 8) t = __umul64hi(uint64_t(magic), uint64_t(n));
+    else t = __umulhi(uint32_t(magic), uint32_t(n));
+    return (t + ((n - t) >> shift1)) >> shift2;
+  }
 };
 
 template<typename T>
@@ -527,7 +745,134 @@ template<typename T>
 struct Apply_PostOp<FuncSumPostDiv<T>, /*EltPerPack=*/1> {
   static constexpr bool IsIdentity = false;
   __device__ static BytePack<sizeof(T)> postOp(FuncSumPostDiv<T> fn, BytePack<sizeof(T)> a) {
-    return toPack<T>(fromPack<T>(a) / fn.divisor);
+    using UintType = typename FuncSumPostDiv<T>::UintType;
+    T x = fromPack<T>(a);
+    // Divide the magnitude, the quotient rounds toward zero as x / divisor does
+    bool neg = std::is_signed<T>::value && x < T(0);
+    UintType u = neg ? UintType(0) - UintType(x) : UintType(x);
+    UintType q = fn.divide(u);
+    return toPack<T>(T(neg ? UintType(0) - q : q));
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// FuncSumPostOp: a sum whose result goes through an epilogue,
+// y = postOp(scale*x), computed in float (double for double).
+// opArg holds the scale's float bits in the low word and the ncclPostOp_t in
+// the high word.
+
+template<typename T>
+struct FuncSumPostOp: FuncSum<T> {
+  using EltType = T;
+  float scale;
+  int postOp;
+  __device__ FuncSumPostOp(uint64_t opArg=0) {
+    scale = __uint_as_float(uint32_t(opArg));
+    postOp = int(opArg>>32);
+  }
+};
+
+template<typename U>
+__device__ __forceinline__ U applySumPostOp(int postOp, U x) {
+  switch (postOp) {
+  case ncclPostOpRelu: return x > U(0) ? x : U(0);
+  case ncclPostOpGelu: return U(0.5)*x*(U(1) + erf(x*U(0.70710678118654752)));
+  default: return x;
+  }
+}
+
+template<typename T>
+struct Apply_Reduce<FuncSumPostOp<T>, /*EltPerPack=*/1>:
+    Apply_Reduce<FuncSum<T>, 1> {
+  __device__ static BytePack<sizeof(T)> reduce(FuncSumPostOp<T> fn, BytePack<sizeof(T)> a, BytePack<sizeof(T)> b) {
+    // FuncSumPostOp reduce dispatches to FuncSum.
+    return Apply_Reduce<FuncSum<T>, 1>::reduce(FuncSum<T>(), a, b);
+  }
+};
+
+template<typename T>
+struct Apply_PostOp<FuncSumPostOp<T>, /*EltPerPack=*/1> {
+  static constexpr bool IsIdentity = false;
+  __device__ static BytePack<sizeof(T)> postOp(FuncSumPostOp<T> fn, BytePack<sizeof(T)> a) {
+    return toPack<T>(T(applySumPostOp<float>(fn.postOp, fn.scale*float(fromPack<T>(a)))));
+  }
+};
+template<>
+struct Apply_PostOp<FuncSumPostOp<double>, /*EltPerPack=*/1> {
+  static constexpr bool IsIdentity = false;
+  __device__ static BytePack<sizeof(double)> postOp(FuncSumPostOp<double> fn, BytePack<sizeof(double)> a) {
+    return toPack<double>(applySumPostOp<double>(fn.postOp, double(fn.scale)*fromPack<double>(a)));
+  }
+};
+template<>
+struct Apply_PostOp<FuncSumPostOp<half>, /*EltPerPack=*/1> {
+  static constexpr bool IsIdentity = false;
+  __device__ static BytePack<sizeof(half)> postOp(FuncSumPostOp<half> fn, BytePack<sizeof(half)> a) {
+    return toPack<half>(__float2half(applySumPostOp<float>(fn.postOp, fn.scale*__half2float(fromPack<half>(a)))));
+  }
+};
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<>
+  struct Apply_PostOp<FuncSumPostOp<__nv_bfloat16>, /*EltPerPack=*/1> {
+    static constexpr bool IsIdentity = false;
+    __device__ static BytePack<sizeof(__nv_bfloat16)> postOp(FuncSumPostOp<__nv_bfloat16> fn, BytePack<sizeof(__nv_bfloat16)> a) {
+      return toPack<__nv_bfloat16>(__float2bfloat16(applySumPostOp<float>(fn.postOp, fn.scale*__bfloat162float(fromPack<__nv_bfloat16>(a)))));
+    }
+  };
+#endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+  #define DEFINE_FP8_SUMPOSTOP(T, interp) \
+    template<> \
+    struct Apply_PostOp<FuncSumPostOp<T>, /*EltPerPack=*/1> { \
+      static constexpr bool IsIdentity = false; \
+      __device__ static BytePack<sizeof(T)> postOp(FuncSumPostOp<T> fn, BytePack<sizeof(T)> a) { \
+        float x = __half2float(__half(__nv_cvt_fp8_to_halfraw(a.u8, interp))); \
+        a.u8 = __nv_cvt_float_to_fp8(applySumPostOp<float>(fn.postOp, fn.scale*x), __NV_SATFINITE, interp); \
+        return a; \
+      } \
+    };
+  DEFINE_FP8_SUMPOSTOP(__nv_fp8_e4m3, __NV_E4M3)
+  DEFINE_FP8_SUMPOSTOP(__nv_fp8_e5m2, __NV_E5M2)
+  #undef DEFINE_FP8_SUMPOSTOP
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// FuncGeneric, used instead of the pairs of NCCL_GENERIC_REDOP in slim builds.
+// The host puts the ncclDevRedOp_t in the top byte of opArg, the PreMulSum
+// scalar (or the FuncSum argument) stays in the low bytes.
+
+template<typename T>
+struct FuncGeneric {
+  using EltType = T;
+  int op;
+  T scalar;
+  uint32_t sumArg;
+  __device__ FuncGeneric(uint64_t opArg=0) {
+    union { uint64_t u64; T val; };
+    u64 = opArg;
+    op = int(opArg>>56);
+    scalar = val;
+    sumArg = op == ncclDevSum ? uint32_t(opArg) : 0;
+  }
+};
+
+template<typename T>
+struct Apply_Reduce<FuncGeneric<T>, /*EltPerPack=*/1> {
+  __device__ static BytePack<sizeof(T)> reduce(FuncGeneric<T> fn, BytePack<sizeof(T)> a, BytePack<sizeof(T)> b) {
+    switch (fn.op) {
+    case ncclDevProd: return Apply_Reduce<FuncProd<T>, 1>::reduce(FuncProd<T>(), a, b);
+    case ncclDevMax:  return Apply_Reduce<FuncMax<T>, 1>::reduce(FuncMax<T>(), a, b);
+    case ncclDevMin:  return Apply_Reduce<FuncMin<T>, 1>::reduce(FuncMin<T>(), a, b);
+    default:          return Apply_Reduce<FuncSum<T>, 1>::reduce(FuncSum<T>(fn.sumArg), a, b);
+    }
+  }
+};
+
+template<typename T>
+struct Apply_PreOp<FuncGeneric<T>, /*EltPerPack=*/1> {
+  static constexpr bool IsIdentity = false;
+  __device__ static BytePack<sizeof(T)> preOp(FuncGeneric<T> fn, BytePack<sizeof(T)> a) {
+    return fn.op == ncclDevPreMulSum ? toPack<T>(fromPack<T>(a) * fn.scalar) : a;
   }
 };
 
@@ -129,3 +129,48 @@ struct RunWorkElement<ncclFuncReduceScatter, T, RedOp, NCCL_ALGO_NVLS, NCCL_PROT
     }
   }
 };
+
+// One rank per node only: the chain is reduced to this rank and the network.
+// Each loop posts one network window per rank with the piece reduced into
+// that rank; only the owner of a window receives data for it.
+template<typename T, typename RedOp>
+struct RunWorkElement<ncclFuncReduceScatter, T, RedOp, NCCL_ALGO_COLLNET_CHAIN, NCCL_PROTO_SIMPLE> {
+  __device__ __forceinline__ void run(ncclWorkElem *args) {
+    const int tid = threadIdx.x;
+    const int nthreads = args->nWarps*WARP_SIZE;
+    const int bid = args->bid;
+    const int nChannels = args->nChannels;
+    ncclTree *tree = &ncclShmem.channel.collnetChain;
+    const ssize_t chunkSize = int(args->lastChunkSize);
+    const ssize_t loopSize = nChannels*chunkSize;
+    const int rank = ncclShmem.comm.rank;
+    const int nranks = ncclShmem.comm.nRanks;
+    const ssize_t size = args->count;
+
+    int nthreadsSplit = nthreads/2;
+    if (nthreadsSplit >= 256) nthreadsSplit += 64;
+
+    using Proto = ProtoSimple<1, 1>;
+    if (tid < nthreadsSplit) {
+      // Send the piece destined to every rank
+      Primitives<T, RedOp, FanAsymmetric<0, 1>, /*Direct=*/0, Proto, 0>
+        prims(tid, nthreadsSplit, NULL, &tree->up, args->sendbuff, NULL,
+            args->redOpArg, 0*Proto::MaxGroupWidth, 1, 1);
+      for (ssize_t gridOffset = 0; gridOffset < size; gridOffset += loopSize) {
+        ssize_t offset = gridOffset + bid*chunkSize;
+        int nelem = min(chunkSize, size-offset);
+        for (int r=0; r<nranks; r++) prims.send(r*size+offset, nelem);
+      }
+    } else {
+      // Receive the reduced result in my window, empty steps in the others
+      Primitives<T, RedOp, FanAsymmetric<1, 0>, /*Direct=*/0, Proto, 0>
+        prims(tid-nthreadsSplit, nthreads-nthreadsSplit, &tree->up, NULL, NULL, args->recvbuff,
+            args->redOpArg, 1*Proto::MaxGroupWidth, 0, 0);
+      for (ssize_t gridOffset = 0; gridOffset < size; gridOffset += loopSize) {
+        ssize_t offset = gridOffset + bid*chunkSize;
+        int nelem = min(chunkSize, size-offset);
+        for (int r=0; r<nranks; r++) prims.recv(offset, r == rank ? nelem : 0, /*postOp=*/true);
+      }
+    }
+  }
+};
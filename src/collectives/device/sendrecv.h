@@ -55,35 +55,152 @@ struct RunWork<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPLE> {
     }
   }
 
+  // The network sends from/receives into the registered user buffer itself (see
+  // ncclCommRegister), so we only exchange step counters and sizes with the
+  // proxy. One thread is enough for that.
+  __device__ bool regWait(uint64_t* ptr, uint64_t slack, uint64_t value) {
+    int spins = 0;
+    while (ld_volatile_global(ptr) + slack < value) {
+      if (++spins == NCCL_SPINS_BEFORE_CHECK_ABORT) {
+        if (*ncclShmem.comm.abortFlag) { ncclShmem.aborted = 1; return false; }
+        spins = 0;
+      }
+    }
+    return true;
+  }
+
+  __device__ void runSendNetReg(const int tid, struct ncclWorkElemP2p* args) {
+    if (tid != 0) return;
+    ssize_t count = reinterpret_cast<size_t>(size_t(args->countHi32)<<32 | args->countLo32);
+    int chunkSize = args->chunkSize/sizeof(T);
+    struct ncclConnInfo* conn = ncclShmem.channel.peers[args->peer]->send+1;
+    uint64_t step = conn->step;
+    size_t offset = 0;
+    do {
+      int nelem = min(size_t(chunkSize), count-offset);
+      if (!regWait(conn->head, NCCL_STEPS << conn->stepsShift, step+1)) return;
+      ((volatile int*)conn->sizesFifo)[step%(NCCL_STEPS << conn->stepsShift)] = nelem*sizeof(T);
+      __threadfence_system();
+      st_relaxed_sys_global(conn->tail, ++step);
+      offset += nelem;
+    } while (offset < count);
+    // The buffer is the user's again once we return
+    if (!regWait(conn->regDone, 0, step)) return;
+    conn->step = step;
+  }
+
+  __device__ void runRecvNetReg(const int tid, struct ncclWorkElemP2p* args) {
+    if (tid != 0) return;
+    ssize_t count = reinterpret_cast<size_t>(size_t(args->countHi32)<<32 | args->countLo32);
+    int chunkSize = args->chunkSize/sizeof(T);
+    struct ncclConnInfo* conn = ncclShmem.channel.peers[args->peer]->recv+1;
+    uint64_t step = conn->step;
+    size_t offset = 0;
+    do {
+      int nelem = min(size_t(chunkSize), count-offset);
+      if (!regWait(conn->tail, 0, step+1)) return;
+      st_relaxed_sys_global(conn->head, ++step);
+      offset += nelem;
+    } while (offset < count);
+    conn->step = step;
+  }
+
+  // Between processes of a node, the receiver copies straight from the sender's
+  // registered buffer, which the sender passes in buff already mapped in the
+  // receiver's address space (see ncclRegFindP2p). The sender hands the pointer
+  // over through ptrExchange with a single step, then waits for the receiver to
+  // be done with its buffer.
+  __device__ void runSendP2pReg(const int tid, struct ncclWorkElemP2p* args) {
+    if (tid != 0) return;
+    void* buff = reinterpret_cast<void*>(uintptr_t(args->buffHi32)<<32 | args->buffLo32);
+    struct ncclConnInfo* conn = ncclShmem.channel.peers[args->peer]->send+1;
+    uint64_t step = conn->step;
+    // Once all previous steps are consumed the receiver has also emptied ptrExchange
+    if (!regWait(conn->head, 0, step)) return;
+    *(void* volatile*)conn->ptrExchange = buff;
+    __threadfence_system();
+    st_relaxed_sys_global(conn->tail, ++step);
+    if (!regWait(conn->head, 0, step)) return;
+    conn->step = step;
+  }
+
+  // The receiver cannot know whether the sender's buffer is registered, so it
+  // looks at ptrExchange once the first step arrives and falls back to the
+  // staged path when the sender did not put a pointer there.
+  __device__ void runRecvP2pReg(const int tid, const int nthreads, const uint8_t group, struct ncclWorkElemP2p* args) {
+    struct ncclConnInfo* conn = ncclShmem.channel.peers[args->peer]->recv+1;
+    if (tid == 0) {
+      void* src = nullptr;
+      if (regWait(conn->tail, 0, conn->step+1)) {
+        __threadfence();
+        src = *(void* volatile*)conn->ptrExchange;
+      }
+      ncclShmem.groups[group].srcs[0] = src;
+    }
+    groupBarrier(group, nthreads);
+    void* src = ncclShmem.groups[group].srcs[0];
+    groupBarrier(group, nthreads);
+    if (ncclShmem.aborted) return;
+    if (src == nullptr) {
+      runRecv<ProtoSimple<1,1>>(tid, nthreads, group, args);
+      return;
+    }
+    void* buff = reinterpret_cast<void*>(uintptr_t(args->buffHi32)<<32 | args->buffLo32);
+    ssize_t count = reinterpret_cast<size_t>(size_t(args->countHi32)<<32 | args->countLo32);
+    reduceCopy<COLL_UNROLL, RedOp, T, 0,1,1, 0,1,1, /*PreOpSrcs=*/0>
+      (tid, nthreads, 0, nullptr, false, 1, &src, 1, &buff, count);
+    groupBarrier(group, nthreads);
+    if (tid == 0) {
+      *(void* volatile*)conn->ptrExchange = nullptr;
+      __threadfence_system();
+      st_relaxed_sys_global(conn->head, ++conn->step);
+    }
+  }
+
+  // Same barrier as the primitives of the group use
+  __device__ void groupBarrier(const uint8_t group, const int nthreads) {
+    if (nthreads == WARP_SIZE) __syncwarp();
+    else asm volatile("bar.sync %0, %1;" :: "r"(15-group), "r"(nthreads) : "memory");
+  }
+
   __device__ __forceinline__ void run(ncclWork *work) {
     struct ncclWorkElemP2p* args = work->p2pElems;
     int ngroups = args->ngroups;
     int tid = threadIdx.x;
     int wid = tid / WARP_SIZE;
-    // This has to work even for groups of 2.5 warps (which is 8 groups, and means 3
-    // warps for send, 2 warps for recv).
-    // warpStarts were rounded thanks to int division, but for group number we need to round the other way around
-    // So we mirror wid then mirror again the group.
-    #define NWARPS (NCCL_MAX_NTHREADS/WARP_SIZE)
-    uint8_t group = ngroups-1- (NWARPS-1-wid) * ngroups / NWARPS;
+    // Groups own disjoint ranges of warps, which are not all the same size (e.g. 3
+    // warps for send and 2 for recv), and may be empty when the element is unused.
+    int group = -1;
+    for (int g=0; g < ngroups; g++) {
+      if (wid >= args[g].warpStart && wid < args[g].warpStart + args[g].nWarps) group = g;
+    }
+    if (group == -1) return;
     args += group;
     tid -= args->warpStart * WARP_SIZE;
     int nthreads = args->nWarps * WARP_SIZE;
 
     if (args->p2pType == ncclWorkP2pTypeUnused) return;
-    if (tid >= nthreads || args->peer == -1) return;
+    if (args->peer == -1) return;
 
     // Select Proto here
     // This is to allow the same kernel to run multiple primitives on different warps (thread groups)
     if ((group%2) == 0) {
       if (args->proto == NCCL_PROTO_LL) {
         runRecv<ProtoLL>(tid, nthreads, group, args);
+      } else if (args->netReg) {
+        runRecvNetReg(tid, args);
+      } else if (args->p2pReg) {
+        runRecvP2pReg(tid, nthreads, group, args);
       } else {
         runRecv<ProtoSimple<1,1>>(tid, nthreads, group, args);
       }
     } else {
       if (args->proto == NCCL_PROTO_LL) {
         runSend<ProtoLL>(tid, nthreads, group, args);
+      } else if (args->netReg) {
+        runSendNetReg(tid, args);
+      } else if (args->p2pReg) {
+        runSendP2pReg(tid, args);
       } else {
         runSend<ProtoSimple<1,1>>(tid, nthreads, group, args);
       }
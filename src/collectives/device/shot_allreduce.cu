@@ -0,0 +1,187 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "shot_allreduce.h"
+#include "checks.h"
+
+#define SHOT_AR_SPINS_BEFORE_CHECK_ABORT 1000000
+
+namespace {
+  // Half precision types accumulate in float
+  template<typename T> struct ShotArAcc {
+    typedef T Acc;
+    static __device__ __forceinline__ T load(T x) { return x; }
+    static __device__ __forceinline__ T store(T x) { return x; }
+  };
+  template<> struct ShotArAcc<half> {
+    typedef float Acc;
+    static __device__ __forceinline__ float load(half x) { return __half2float(x); }
+    static __device__ __forceinline__ half store(float x) { return __float2half_rn(x); }
+  };
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<> struct ShotArAcc<__nv_bfloat16> {
+    typedef float Acc;
+    static __device__ __forceinline__ float load(__nv_bfloat16 x) { return __bfloat162float(x); }
+    static __device__ __forceinline__ __nv_bfloat16 store(float x) { return __float2bfloat16_rn(x); }
+  };
+#endif
+
+  template<typename Acc>
+  __device__ __forceinline__ Acc shotArApply(Acc a, Acc b, ncclRedOp_t op) {
+    switch (op) {
+    case ncclProd: return a*b;
+    case ncclMax: return a < b ? b : a;
+    case ncclMin: return a < b ? a : b;
+    default: return a+b;
+    }
+  }
+
+  __device__ __forceinline__ struct ncclShotArHeader* shotArHeader(const struct ncclShotArArgs& args, int r) {
+    return (struct ncclShotArHeader*)args.buffs[r];
+  }
+
+  // Input area of rank r for operation seq, the result area follows it
+  __device__ __forceinline__ char* shotArInput(const struct ncclShotArArgs& args, int r, uint32_t seq) {
+    return args.buffs[r] + NCCL_SHOT_AR_HEADER_SIZE + (seq%NCCL_SHOT_AR_SLOTS)*2*args.maxBytes;
+  }
+
+  __device__ __forceinline__ void shotArPost(uint32_t* flag, uint32_t seq) {
+    __threadfence_system();
+    *(volatile uint32_t*)flag = seq;
+  }
+
+  // Returns false if the communicator was aborted while waiting
+  __device__ __forceinline__ bool shotArWait(uint32_t* flag, uint32_t seq, volatile uint32_t* abortFlag) {
+    int spins = 0;
+    while (int32_t(*(volatile uint32_t*)flag - seq) < 0) {
+      if (++spins == SHOT_AR_SPINS_BEFORE_CHECK_ABORT) {
+        if (*abortFlag) return false;
+        spins = 0;
+      }
+    }
+    return true;
+  }
+
+  // Block b works on the b-th part of the buffer on all ranks, so blocks only wait for
+  // the same block of their peers. Monotonic flags let operation seq+2 reuse the slot of
+  // seq: every rank has then seen all peers post seq+1, which they do once done with seq.
+  // Staged data is read once per launch, after its flag, so it is never stale in L1.
+  // Launches are ordered on the device stream, so seq doesn't move until all blocks exit.
+  template<typename T>
+  __global__ void shotArKernel(struct ncclShotArArgs args, ncclRedOp_t op) {
+    typedef typename ShotArAcc<T>::Acc Acc;
+    __shared__ uint32_t seq;
+    __shared__ bool aborted;
+    struct ncclShotArHeader* header = shotArHeader(args, args.rank);
+    if (threadIdx.x == 0) {
+      seq = *(volatile uint32_t*)&header->seq + 1;
+      aborted = false;
+    }
+    __syncthreads();
+    size_t per = (args.count + gridDim.x-1)/gridDim.x;
+    size_t lo = per*blockIdx.x < args.count ? per*blockIdx.x : args.count;
+    size_t hi = lo+per < args.count ? lo+per : args.count;
+    const T* send = (const T*)args.sendbuff;
+    T* recv = (T*)args.recvbuff;
+    T* mine = (T*)shotArInput(args, args.rank, seq);
+    int nRanks = args.nRanks;
+
+    for (size_t i = lo + threadIdx.x; i < hi; i += blockDim.x) mine[i] = send[i];
+    __syncthreads();
+    if (threadIdx.x == 0) {
+      shotArPost(header->ready+blockIdx.x, seq);
+      for (int p=0; p<nRanks && !aborted; p++) aborted = !shotArWait(shotArHeader(args, p)->ready+blockIdx.x, seq, args.abortFlag);
+      __threadfence_system();
+    }
+    __syncthreads();
+    if (aborted) return;
+
+    // Reduce in rank order so that all ranks get the same bits
+    size_t rlo = lo, rhi = hi;
+    if (args.twoShot) {
+      size_t sub = (hi-lo + nRanks-1)/nRanks;
+      rlo = lo + sub*args.rank < hi ? lo + sub*args.rank : hi;
+      rhi = rlo+sub < hi ? rlo+sub : hi;
+    }
+    for (size_t i = rlo + threadIdx.x; i < rhi; i += blockDim.x) {
+      Acc acc = ShotArAcc<T>::load(((const T*)shotArInput(args, 0, seq))[i]);
+      for (int r=1; r<nRanks; r++) acc = shotArApply(acc, ShotArAcc<T>::load(((const T*)shotArInput(args, r, seq))[i]), op);
+      if (op == ncclAvg) acc = acc/Acc(nRanks);
+      T v = ShotArAcc<T>::store(acc);
+      if (!args.twoShot) {
+        recv[i] = v;
+      } else {
+        for (int p=0; p<nRanks; p++) ((T*)(shotArInput(args, p, seq)+args.maxBytes))[i] = v;
+      }
+    }
+
+    if (args.twoShot) {
+      __syncthreads();
+      if (threadIdx.x == 0) {
+        for (int p=0; p<nRanks; p++) shotArPost(shotArHeader(args, p)->done[args.rank]+blockIdx.x, seq);
+        for (int p=0; p<nRanks && !aborted; p++) aborted = !shotArWait(header->done[p]+blockIdx.x, seq, args.abortFlag);
+        __threadfence_system();
+      }
+      __syncthreads();
+      if (aborted) return;
+      const T* result = (const T*)((char*)mine+args.maxBytes);
+      for (size_t i = lo + threadIdx.x; i < hi; i += blockDim.x) recv[i] = result[i];
+    }
+
+    // The last block out moves this rank to the next operation
+    __syncthreads();
+    if (threadIdx.x == 0 && atomicAdd(&header->exited, 1) == gridDim.x-1) {
+      header->exited = 0;
+      *(volatile uint32_t*)&header->seq = seq;
+    }
+  }
+
+  template<typename T>
+  ncclResult_t shotAr(struct ncclShotArArgs* args, ncclRedOp_t op, cudaStream_t stream) {
+    constexpr int nThreads = 512;
+    // Only depends on the count, so that blocks match across ranks
+    size_t nBlocks = (args->count + 4*nThreads-1)/(4*nThreads);
+    if (nBlocks > NCCL_SHOT_AR_MAX_BLOCKS) nBlocks = NCCL_SHOT_AR_MAX_BLOCKS;
+    shotArKernel<T><<<nBlocks, nThreads, 0, stream>>>(*args, op);
+    CUDACHECK(cudaGetLastError());
+    return ncclSuccess;
+  }
+}
+
+bool ncclShotArTypeSupported(ncclDataType_t datatype) {
+  switch (datatype) {
+  case ncclInt8: case ncclUint8: case ncclInt32: case ncclUint32: case ncclInt64: case ncclUint64:
+  case ncclFloat16: case ncclFloat32: case ncclFloat64:
+    return true;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+ncclResult_t ncclShotArKernelLaunch(struct ncclShotArArgs* args, ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream) {
+  if (args->count == 0) return ncclSuccess;
+  switch (datatype) {
+  case ncclInt8: return shotAr<int8_t>(args, op, stream);
+  case ncclUint8: return shotAr<uint8_t>(args, op, stream);
+  case ncclInt32: return shotAr<int32_t>(args, op, stream);
+  case ncclUint32: return shotAr<uint32_t>(args, op, stream);
+  case ncclInt64: return shotAr<int64_t>(args, op, stream);
+  case ncclUint64: return shotAr<uint64_t>(args, op, stream);
+  case ncclFloat16: return shotAr<half>(args, op, stream);
+  case ncclFloat32: return shotAr<float>(args, op, stream);
+  case ncclFloat64: return shotAr<double>(args, op, stream);
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16: return shotAr<__nv_bfloat16>(args, op, stream);
+#endif
+  default:
+    WARN("Unsupported type %d for one-shot/two-shot AllReduce", datatype);
+    return ncclInvalidArgument;
+  }
+}
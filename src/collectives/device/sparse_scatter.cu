@@ -0,0 +1,145 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "sparse.h"
+#include "checks.h"
+
+namespace {
+  template<typename T> struct SparseFloat16;
+  template<> struct SparseFloat16<half> {
+    static __device__ __forceinline__ float load(half x) { return __half2float(x); }
+    static __device__ __forceinline__ half store(float x) { return __float2half_rn(x); }
+  };
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<> struct SparseFloat16<__nv_bfloat16> {
+    static __device__ __forceinline__ float load(__nv_bfloat16 x) { return __bfloat162float(x); }
+    static __device__ __forceinline__ __nv_bfloat16 store(float x) { return __float2bfloat16_rn(x); }
+  };
+#endif
+
+  // 16-bit types are added by swapping the 32-bit word holding them
+  template<typename T>
+  __device__ __forceinline__ void sparseAdd16(T* p, T v) {
+    unsigned int* word = (unsigned int*)((uintptr_t)p & ~uintptr_t(3));
+    int shift = ((uintptr_t)p & 2) ? 16 : 0;
+    unsigned int old = *word, assumed;
+    do {
+      assumed = old;
+      union { unsigned short u; T t; } cur, sum;
+      cur.u = (unsigned short)(assumed >> shift);
+      sum.t = SparseFloat16<T>::store(SparseFloat16<T>::load(cur.t) + SparseFloat16<T>::load(v));
+      old = atomicCAS(word, assumed, (assumed & ~(0xffffu << shift)) | ((unsigned int)sum.u << shift));
+    } while (old != assumed);
+  }
+
+  template<typename T> struct SparseAdd;
+  template<> struct SparseAdd<int32_t> {
+    static __device__ __forceinline__ void add(int32_t* p, int32_t v) { atomicAdd((int*)p, (int)v); }
+  };
+  template<> struct SparseAdd<uint32_t> {
+    static __device__ __forceinline__ void add(uint32_t* p, uint32_t v) { atomicAdd((unsigned int*)p, (unsigned int)v); }
+  };
+  // Two's complement makes the unsigned add right for int64_t as well
+  template<> struct SparseAdd<int64_t> {
+    static __device__ __forceinline__ void add(int64_t* p, int64_t v) { atomicAdd((unsigned long long*)p, (unsigned long long)v); }
+  };
+  template<> struct SparseAdd<uint64_t> {
+    static __device__ __forceinline__ void add(uint64_t* p, uint64_t v) { atomicAdd((unsigned long long*)p, (unsigned long long)v); }
+  };
+  template<> struct SparseAdd<float> {
+    static __device__ __forceinline__ void add(float* p, float v) { atomicAdd(p, v); }
+  };
+  template<> struct SparseAdd<double> {
+    static __device__ __forceinline__ void add(double* p, double v) {
+#if __CUDA_ARCH__ >= 600
+      atomicAdd(p, v);
+#else
+      unsigned long long* word = (unsigned long long*)p;
+      unsigned long long old = *word, assumed;
+      do {
+        assumed = old;
+        old = atomicCAS(word, assumed, __double_as_longlong(__longlong_as_double(assumed) + v));
+      } while (old != assumed);
+#endif
+    }
+  };
+  template<> struct SparseAdd<half> {
+    static __device__ __forceinline__ void add(half* p, half v) { sparseAdd16(p, v); }
+  };
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<> struct SparseAdd<__nv_bfloat16> {
+    static __device__ __forceinline__ void add(__nv_bfloat16* p, __nv_bfloat16 v) { sparseAdd16(p, v); }
+  };
+#endif
+
+  template<typename I, typename T>
+  __global__ void sparseScatterAddKernel(const I* indices, const T* values, size_t n, T* dst, size_t dstCount) {
+    size_t step = size_t(gridDim.x)*blockDim.x;
+    for (size_t i = size_t(blockIdx.x)*blockDim.x + threadIdx.x; i < n; i += step) {
+      I idx = indices[i];
+      if (idx < 0 || size_t(idx) >= dstCount) continue;
+      SparseAdd<T>::add(dst+idx, values[i]);
+    }
+  }
+
+  template<typename I, typename T>
+  ncclResult_t sparseScatterAdd(const void* indices, const void* values, size_t n, void* dst, size_t dstCount, cudaStream_t stream) {
+    constexpr int nThreads = 512;
+    constexpr size_t maxBlocks = 1024;
+    size_t nBlocks = (n + nThreads-1)/nThreads;
+    if (nBlocks > maxBlocks) nBlocks = maxBlocks;
+    sparseScatterAddKernel<I, T><<<nBlocks, nThreads, 0, stream>>>((const I*)indices, (const T*)values, n, (T*)dst, dstCount);
+    CUDACHECK(cudaGetLastError());
+    return ncclSuccess;
+  }
+
+  template<typename I>
+  ncclResult_t sparseScatterAddIndexed(const void* indices, const void* values, size_t n, void* dst, size_t dstCount,
+      ncclDataType_t datatype, cudaStream_t stream) {
+    switch (datatype) {
+    case ncclInt32: return sparseScatterAdd<I, int32_t>(indices, values, n, dst, dstCount, stream);
+    case ncclUint32: return sparseScatterAdd<I, uint32_t>(indices, values, n, dst, dstCount, stream);
+    case ncclInt64: return sparseScatterAdd<I, int64_t>(indices, values, n, dst, dstCount, stream);
+    case ncclUint64: return sparseScatterAdd<I, uint64_t>(indices, values, n, dst, dstCount, stream);
+    case ncclFloat16: return sparseScatterAdd<I, half>(indices, values, n, dst, dstCount, stream);
+    case ncclFloat32: return sparseScatterAdd<I, float>(indices, values, n, dst, dstCount, stream);
+    case ncclFloat64: return sparseScatterAdd<I, double>(indices, values, n, dst, dstCount, stream);
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+    case ncclBfloat16: return sparseScatterAdd<I, __nv_bfloat16>(indices, values, n, dst, dstCount, stream);
+#endif
+    default:
+      WARN("Unsupported type %d for sparse scatter-add", datatype);
+      return ncclInvalidArgument;
+    }
+  }
+}
+
+bool ncclSparseIndexTypeSupported(ncclDataType_t indextype) {
+  return indextype == ncclInt32 || indextype == ncclInt64;
+}
+
+bool ncclSparseTypeSupported(ncclDataType_t datatype) {
+  switch (datatype) {
+  case ncclInt32: case ncclUint32: case ncclInt64: case ncclUint64:
+  case ncclFloat16: case ncclFloat32: case ncclFloat64:
+    return true;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+ncclResult_t ncclSparseScatterAdd(const void* indices, ncclDataType_t indextype, const void* values, size_t n,
+    void* dst, size_t dstCount, ncclDataType_t datatype, cudaStream_t stream) {
+  if (n == 0) return ncclSuccess;
+  if (indextype == ncclInt32) return sparseScatterAddIndexed<int32_t>(indices, values, n, dst, dstCount, datatype, stream);
+  if (indextype == ncclInt64) return sparseScatterAddIndexed<int64_t>(indices, values, n, dst, dstCount, datatype, stream);
+  WARN("Unsupported index type %d for sparse scatter-add", indextype);
+  return ncclInvalidArgument;
+}
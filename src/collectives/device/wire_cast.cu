@@ -0,0 +1,98 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "wire.h"
+#include "checks.h"
+
+namespace {
+  // Conversions go through float, which holds half and bfloat16 exactly
+  template<typename T> struct WireFloat {
+    static __device__ __forceinline__ float load(float x) { return x; }
+    static __device__ __forceinline__ float store(float x) { return x; }
+  };
+  template<> struct WireFloat<half> {
+    static __device__ __forceinline__ float load(half x) { return __half2float(x); }
+    static __device__ __forceinline__ half store(float x) { return __float2half_rn(x); }
+  };
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<> struct WireFloat<__nv_bfloat16> {
+    static __device__ __forceinline__ float load(__nv_bfloat16 x) { return __bfloat162float(x); }
+    static __device__ __forceinline__ __nv_bfloat16 store(float x) { return __float2bfloat16_rn(x); }
+  };
+#endif
+  template<typename Dst, typename Src> struct WireCast {
+    static __device__ __forceinline__ Dst cast(Src x) { return WireFloat<Dst>::store(WireFloat<Src>::load(x)); }
+  };
+
+  template<typename Dst, typename Src>
+  __global__ void wireCastKernel(const Src* src, Dst* dst, size_t count) {
+    size_t stride = size_t(gridDim.x)*blockDim.x;
+    for (size_t i = size_t(blockIdx.x)*blockDim.x + threadIdx.x; i < count; i += stride) {
+      dst[i] = WireCast<Dst, Src>::cast(src[i]);
+    }
+  }
+
+  template<typename Dst, typename Src>
+  ncclResult_t wireCast(const void* src, void* dst, size_t count, cudaStream_t stream) {
+    constexpr int nThreads = 512;
+    constexpr size_t maxBlocks = 1024;
+    size_t nBlocks = (count + nThreads-1)/nThreads;
+    if (nBlocks > maxBlocks) nBlocks = maxBlocks;
+    wireCastKernel<Dst, Src><<<nBlocks, nThreads, 0, stream>>>((const Src*)src, (Dst*)dst, count);
+    CUDACHECK(cudaGetLastError());
+    return ncclSuccess;
+  }
+}
+
+bool ncclWireTypeSupported(ncclDataType_t datatype, ncclDataType_t wireType) {
+  if (datatype != ncclFloat32) return false;
+  if (wireType == ncclFloat16) return true;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  if (wireType == ncclBfloat16) return true;
+#endif
+  return false;
+}
+
+static bool wireFloatType(ncclDataType_t t) {
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  if (t == ncclBfloat16) return true;
+#endif
+  return t == ncclFloat16 || t == ncclFloat32;
+}
+
+bool ncclWireCastSupported(ncclDataType_t srcType, ncclDataType_t dstType) {
+  return wireFloatType(srcType) && wireFloatType(dstType);
+}
+
+namespace {
+  template<typename Dst>
+  ncclResult_t wireCastFrom(const void* src, ncclDataType_t srcType, void* dst, size_t count, cudaStream_t stream) {
+    switch (srcType) {
+    case ncclFloat16: return wireCast<Dst, half>(src, dst, count, stream);
+    case ncclFloat32: return wireCast<Dst, float>(src, dst, count, stream);
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+    case ncclBfloat16: return wireCast<Dst, __nv_bfloat16>(src, dst, count, stream);
+#endif
+    default: return ncclInvalidArgument;
+    }
+  }
+}
+
+ncclResult_t ncclWireCast(const void* src, ncclDataType_t srcType, void* dst, ncclDataType_t dstType, size_t count, cudaStream_t stream) {
+  if (count == 0) return ncclSuccess;
+  if (ncclWireCastSupported(srcType, dstType)) {
+    switch (dstType) {
+    case ncclFloat16: return wireCastFrom<half>(src, srcType, dst, count, stream);
+    case ncclFloat32: return wireCastFrom<float>(src, srcType, dst, count, stream);
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+    case ncclBfloat16: return wireCastFrom<__nv_bfloat16>(src, srcType, dst, count, stream);
+#endif
+    default: break;
+    }
+  }
+  WARN("Unsupported wire conversion from type %d to type %d", srcType, dstType);
+  return ncclInvalidArgument;
+}
@@ -0,0 +1,56 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "enqueue.h"
+#include "collectives.h"
+#include "argcheck.h" // Need some checks here since we access comm
+
+// Rooted Gather and Scatter are a group of sends and receives between the root
+// and every rank, including itself, and go through the p2p scheduler.
+static ncclResult_t rootedEnqueue(ncclFunc_t rootFunc, const char* opName, void* rootbuff, void* buff,
+    size_t count, ncclDataType_t datatype, int root, ncclComm_t comm, cudaStream_t stream) {
+  ncclFunc_t peerFunc = rootFunc == ncclFuncRecv ? ncclFuncSend : ncclFuncRecv;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  if (comm->rank == root) {
+    size_t bytes = count*ncclTypeSize(datatype);
+    for (int r=0; r<comm->nRanks; r++) {
+      struct ncclInfo info = { rootFunc, opName,
+        NULL, (char*)rootbuff + r*bytes, count, datatype, ncclSum, r, comm, stream, /* Args */
+        1, 1 };
+      NCCLCHECKGOTO(ncclEnqueueCheck(&info), ret, exit);
+    }
+  }
+  {
+    struct ncclInfo info = { peerFunc, opName,
+      NULL, buff, count, datatype, ncclSum, root, comm, stream, /* Args */
+      1, 1 };
+    NCCLCHECKGOTO(ncclEnqueueCheck(&info), ret, exit);
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclGather, const void* sendbuff, void* recvbuff, size_t sendcount,
+    ncclDataType_t datatype, int root, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclGather(const void* sendbuff, void* recvbuff, size_t sendcount,
+    ncclDataType_t datatype, int root, ncclComm_t comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "Gather", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  return rootedEnqueue(ncclFuncRecv, "Gather", recvbuff, (void*)sendbuff, sendcount, datatype, root, comm, stream);
+}
+
+NCCL_API(ncclResult_t, ncclScatter, const void* sendbuff, void* recvbuff, size_t recvcount,
+    ncclDataType_t datatype, int root, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclScatter(const void* sendbuff, void* recvbuff, size_t recvcount,
+    ncclDataType_t datatype, int root, ncclComm_t comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "Scatter", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  return rootedEnqueue(ncclFuncSend, "Scatter", (void*)sendbuff, recvbuff, recvcount, datatype, root, comm, stream);
+}
@@ -6,6 +6,7 @@
 
 #include "enqueue.h"
 #include "collectives.h"
+#include "argcheck.h"
 #include "nccl.h"
 
 NCCL_API(ncclResult_t, ncclReduceScatter, const void* sendbuff, void* recvbuff, size_t recvcount,
@@ -29,3 +30,44 @@ ncclResult_t ncclReduceScatter(const void* sendbuff, void* recvbuff, size_t recv
     REDUCESCATTER_CHUNKSTEPS, REDUCESCATTER_SLICESTEPS };
   return ncclEnqueueCheck(&info);
 }
+
+NCCL_API(ncclResult_t, ncclReduceScatterMixed, const void* sendbuff, ncclDataType_t sendtype, void* recvbuff,
+    ncclDataType_t recvtype, size_t recvcount, ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream);
+ncclResult_t ncclReduceScatterMixed(const void* sendbuff, ncclDataType_t sendtype, void* recvbuff,
+    ncclDataType_t recvtype, size_t recvcount, ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  struct ncclInfo info = { ncclFuncReduceScatter, "ReduceScatterMixed",
+    sendbuff, recvbuff, recvcount, datatype, op, 0, comm, stream, /* Args */
+    REDUCESCATTER_CHUNKSTEPS, REDUCESCATTER_SLICESTEPS };
+  info.mixed = true;
+  info.sendType = sendtype;
+  info.recvType = recvtype;
+  return ncclEnqueueCheck(&info);
+}
+
+// Variable-count ReduceScatter: one Reduce per rank in a single group. Each
+// block crosses every ring link once, as in a ring ReduceScatter, without padding.
+NCCL_API(ncclResult_t, ncclReduceScatterv, const void* sendbuff, void* recvbuff, const size_t recvcounts[],
+    const size_t displs[], ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream);
+ncclResult_t ncclReduceScatterv(const void* sendbuff, void* recvbuff, const size_t recvcounts[],
+    const size_t displs[], ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "ReduceScatterv", "comm"));
+  NCCLCHECK(PtrCheck((void*)recvcounts, "ReduceScatterv", "recvcounts"));
+  NCCLCHECK(PtrCheck((void*)displs, "ReduceScatterv", "displs"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  size_t eltSize = ncclTypeSize(datatype);
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  for (int r=0; r<comm->nRanks; r++) {
+    // Counts are the same on all ranks, so all ranks skip the same blocks
+    if (recvcounts[r] == 0) continue;
+    struct ncclInfo info = { ncclFuncReduce, "ReduceScatterv",
+      (char*)sendbuff + displs[r]*eltSize, recvbuff, recvcounts[r], datatype, op, r, comm, stream, /* Args */
+      REDUCE_CHUNKSTEPS, REDUCE_SLICESTEPS };
+    NCCLCHECKGOTO(ncclEnqueueCheck(&info), ret, exit);
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
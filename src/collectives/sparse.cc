@@ -0,0 +1,117 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "enqueue.h"
+#include "collectives.h"
+#include "argcheck.h"
+#include "bootstrap.h"
+#include "sparse.h"
+
+// Segments are only as long as their rank's count. The transfers are sized on the
+// host, so the counts are exchanged there first, which also lets all ranks size their
+// output before anything is sent.
+static ncclResult_t sparseCounts(size_t sendcount, size_t* counts, size_t* total, ncclComm_t comm) {
+  counts[comm->rank] = sendcount;
+  NCCLCHECK(bootstrapAllGather(comm->bootstrap, counts, sizeof(size_t)));
+  *total = 0;
+  for (int r=0; r<comm->nRanks; r++) *total += counts[r];
+  return ncclSuccess;
+}
+
+static ncclResult_t sparseCheck(const char* opName, ncclDataType_t indextype, ncclDataType_t datatype, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, opName, "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  // The counts are exchanged on the host right away, which a group would have to defer
+  if (ncclGroupDepth != 0) {
+    WARN("%s : cannot be called within a group", opName);
+    return ncclInvalidUsage;
+  }
+  if (!ncclSparseIndexTypeSupported(indextype)) {
+    WARN("%s : invalid index type %d, must be ncclInt32 or ncclInt64", opName, indextype);
+    return ncclInvalidArgument;
+  }
+  if (!ncclSparseTypeSupported(datatype)) {
+    WARN("%s : unsupported type %d", opName, datatype);
+    return ncclInvalidArgument;
+  }
+  return ncclSuccess;
+}
+
+// Rank r's segment lands at offset counts[0]+...+counts[r-1] of both outputs
+static ncclResult_t sparseGather(const void* sendindices, const void* sendvalues, void* recvindices, void* recvvalues,
+    const size_t* counts, ncclDataType_t indextype, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  size_t* displs = NULL;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclCalloc(&displs, comm->nRanks));
+  for (int r=1; r<comm->nRanks; r++) displs[r] = displs[r-1] + counts[r-1];
+  NCCLCHECKGOTO(ncclGroupStart(), ret, exit);
+  NCCLCHECKGOTO(ncclAllGatherv(sendindices, recvindices, counts, displs, indextype, comm, stream), ret, group);
+  NCCLCHECKGOTO(ncclAllGatherv(sendvalues, recvvalues, counts, displs, datatype, comm, stream), ret, group);
+group:
+  NCCLCHECKGOTO(ncclGroupEnd(), ret, exit);
+exit:
+  free(displs);
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclSparseAllGather, const void* sendindices, const void* sendvalues, size_t sendcount,
+    void* recvindices, void* recvvalues, size_t recvcounts[], size_t maxrecvcount, ncclDataType_t indextype,
+    ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclSparseAllGather(const void* sendindices, const void* sendvalues, size_t sendcount,
+    void* recvindices, void* recvvalues, size_t recvcounts[], size_t maxrecvcount, ncclDataType_t indextype,
+    ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  size_t total;
+  NCCLCHECK(sparseCheck("SparseAllGather", indextype, datatype, comm));
+  NCCLCHECK(PtrCheck(recvcounts, "SparseAllGather", "recvcounts"));
+  NCCLCHECK(sparseCounts(sendcount, recvcounts, &total, comm));
+  // All ranks see the same total, so they all fail together
+  if (total > maxrecvcount) {
+    WARN("SparseAllGather : %zu elements gathered, more than the %zu the outputs hold", total, maxrecvcount);
+    return ncclInvalidArgument;
+  }
+  TRACE_CALL("ncclSparseAllGather(%p,%p,%zu,%p,%p,%zu,%d,%d,%p,%p)", sendindices, sendvalues, sendcount, recvindices, recvvalues, total, indextype, datatype, comm, stream);
+  return sparseGather(sendindices, sendvalues, recvindices, recvvalues, recvcounts, indextype, datatype, comm, stream);
+}
+
+NCCL_API(ncclResult_t, ncclSparseAllReduce, const void* sendindices, const void* sendvalues, size_t sendcount,
+    void* recvbuff, size_t recvcount, ncclDataType_t indextype, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclSparseAllReduce(const void* sendindices, const void* sendvalues, size_t sendcount,
+    void* recvbuff, size_t recvcount, ncclDataType_t indextype, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  size_t* counts = NULL;
+  size_t total;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(sparseCheck("SparseAllReduce", indextype, datatype, comm));
+  // The scatter-add is issued after the gather, which must therefore be launched now
+  if (!comm->config.blocking) {
+    WARN("SparseAllReduce : cannot be called on a non-blocking communicator");
+    return ncclInvalidUsage;
+  }
+  NCCLCHECK(ncclCalloc(&counts, comm->nRanks));
+  NCCLCHECKGOTO(sparseCounts(sendcount, counts, &total, comm), ret, exit);
+  TRACE_CALL("ncclSparseAllReduce(%p,%p,%zu,%p,%zu,%d,%d,%p,%p)", sendindices, sendvalues, sendcount, recvbuff, recvcount, indextype, datatype, comm, stream);
+  {
+    // Gathered into the wire scratch buffer: indices, then values
+    struct ncclInfo info = { ncclFuncAllGather, "SparseAllReduce",
+      NULL, recvbuff, total, datatype, ncclSum, 0, comm, stream, /* Args */
+      ALLGATHER_CHUNKSTEPS, ALLGATHER_SLICESTEPS };
+    size_t indexBytes = ROUNDUP(total*ncclTypeSize(indextype), 16);
+    void* scratch;
+    NCCLCHECKGOTO(ncclScratchPrepare(&info, &comm->wireBuff, indexBytes + total*ncclTypeSize(datatype), &scratch), ret, exit);
+    char* indices = (char*)scratch;
+    char* values = indices + indexBytes;
+    NCCLCHECKGOTO(sparseGather(sendindices, sendvalues, indices, values, counts, indextype, datatype, comm, stream), ret, exit);
+    // The memset and the scatter-add are nodes of their own when captured
+    NCCLCHECKGOTO(ncclGraphUserBuffRecord(comm, stream, recvbuff, recvcount*ncclTypeSize(datatype), NULL, 0), ret, exit);
+    CUDACHECKGOTO(cudaMemsetAsync(recvbuff, 0, recvcount*ncclTypeSize(datatype), stream), ret, exit);
+    NCCLCHECKGOTO(ncclSparseScatterAdd(indices, indextype, values, total, recvbuff, recvcount, datatype, stream), ret, exit);
+    NCCLCHECKGOTO(ncclScratchRelease(&comm->wireBuff, stream, scratch), ret, exit);
+  }
+exit:
+  free(counts);
+  return ret;
+}
@@ -22,6 +22,153 @@ std::chrono::steady_clock::time_point ncclEpoch;
 
 static __thread int tid = -1;
 
+// NCCL_DEBUG_RATE_LIMIT : maximum number of INFO/TRACE lines per second from a
+// given call site, the others are dropped and counted.
+static int debugRateLimit = 0;
+#define NCCL_DEBUG_RATE_SITES 1024
+struct debugRateSite {
+  const char* filefunc;
+  int line;
+  uint64_t windowStart;
+  uint32_t count;
+  uint32_t suppressed;
+};
+static struct debugRateSite debugRateSites[NCCL_DEBUG_RATE_SITES];
+
+// Returns false if the line must be dropped, otherwise the number of lines of
+// that call site suppressed since the last one printed.
+static bool debugRateCheck(const char* filefunc, int line, uint32_t* suppressed) {
+  *suppressed = 0;
+  if (debugRateLimit <= 0) return true;
+  uint64_t now = clockNano();
+  uint64_t h = ((uintptr_t)filefunc ^ ((uint64_t)line << 32)) * 0x9e3779b97f4a7c15ULL;
+  struct debugRateSite* site = debugRateSites + (h >> 54) % NCCL_DEBUG_RATE_SITES;
+  // Races between threads logging from the same site only make the limit approximate.
+  if (site->filefunc != filefunc || site->line != line) {
+    site->filefunc = filefunc;
+    site->line = line;
+    site->windowStart = now;
+    site->count = site->suppressed = 0;
+  } else if (now - site->windowStart >= 1000000000ULL) {
+    site->windowStart = now;
+    site->count = 0;
+  }
+  if (site->count >= (uint32_t)debugRateLimit) {
+    __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  site->count++;
+  *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  return true;
+}
+
+// NCCL_DEBUG_ASYNC=1 : INFO and TRACE lines go to a ring owned by the logging
+// thread, and a background thread writes them out. WARN lines are still written
+// right away so they are not lost if the process aborts. A thread finding its
+// ring full writes the pending lines itself, so no line is lost.
+#define NCCL_DEBUG_RING_LINES 64
+#define NCCL_DEBUG_LINE_MAX 1024
+struct debugRing {
+  char lines[NCCL_DEBUG_RING_LINES][NCCL_DEBUG_LINE_MAX];
+  int lens[NCCL_DEBUG_RING_LINES];
+  uint64_t head; // Written by the writer thread
+  uint64_t tail; // Written by the owning thread
+  bool owned;
+  struct debugRing* next;
+};
+static bool debugAsync = false;
+static struct debugRing* debugRings = NULL;
+static pthread_mutex_t debugRingsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t debugDrainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t debugWriterCond = PTHREAD_COND_INITIALIZER;
+static int debugWriterSleeping = 0;
+
+// Gives the ring back when its thread exits, for the next thread to reuse.
+struct debugRingOwner {
+  struct debugRing* ring = NULL;
+  ~debugRingOwner() { if (ring) __atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE); }
+};
+static thread_local debugRingOwner debugRingOwned;
+
+static struct debugRing* debugRingGet() {
+  if (debugRingOwned.ring) return debugRingOwned.ring;
+  struct debugRing* ring;
+  pthread_mutex_lock(&debugRingsLock);
+  for (ring = debugRings; ring; ring = ring->next) {
+    if (!__atomic_load_n(&ring->owned, __ATOMIC_ACQUIRE)) break;
+  }
+  if (ring == NULL) {
+    ring = (struct debugRing*)calloc(1, sizeof(struct debugRing));
+    if (ring) {
+      ring->next = debugRings;
+      __atomic_store_n(&debugRings, ring, __ATOMIC_RELEASE);
+    }
+  }
+  if (ring) ring->owned = true;
+  pthread_mutex_unlock(&debugRingsLock);
+  debugRingOwned.ring = ring;
+  return ring;
+}
+
+// Returns the number of lines written
+static int debugRingsDrain() {
+  int n = 0;
+  pthread_mutex_lock(&debugDrainLock);
+  for (struct debugRing* ring = __atomic_load_n(&debugRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (uint64_t head = ring->head; head < tail; head++, n++) {
+      int slot = head%NCCL_DEBUG_RING_LINES;
+      fwrite(ring->lines[slot], 1, ring->lens[slot], ncclDebugFile);
+      __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&debugDrainLock);
+  return n;
+}
+
+static void* debugWriter(void*) {
+  while (1) {
+    if (debugRingsDrain()) continue;
+    pthread_mutex_lock(&debugRingsLock);
+    __atomic_store_n(&debugWriterSleeping, 1, __ATOMIC_SEQ_CST);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100000000;
+    if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+    pthread_cond_timedwait(&debugWriterCond, &debugRingsLock, &ts);
+    __atomic_store_n(&debugWriterSleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&debugRingsLock);
+  }
+  return NULL;
+}
+
+static void debugAsyncFlush() {
+  debugRingsDrain();
+}
+
+// Returns whether the line was handed to the writer thread.
+static bool debugAsyncLog(const char* prefix, size_t prefixLen, const char* fmt, va_list vargs) {
+  struct debugRing* ring = debugRingGet();
+  if (ring == NULL) return false;
+  uint64_t tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == NCCL_DEBUG_RING_LINES) debugRingsDrain();
+  int slot = tail%NCCL_DEBUG_RING_LINES;
+  char* line = ring->lines[slot];
+  size_t len = std::min(prefixLen, (size_t)NCCL_DEBUG_LINE_MAX-1);
+  memcpy(line, prefix, len);
+  int n = vsnprintf(line+len, NCCL_DEBUG_LINE_MAX-1-len, fmt, vargs);
+  if (n > 0) len = std::min(len+n, (size_t)NCCL_DEBUG_LINE_MAX-2);
+  line[len++] = '\n';
+  ring->lens[slot] = len;
+  __atomic_store_n(&ring->tail, tail+1, __ATOMIC_RELEASE);
+  if (__atomic_load_n(&debugWriterSleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&debugRingsLock);
+    pthread_cond_signal(&debugWriterCond);
+    pthread_mutex_unlock(&debugRingsLock);
+  }
+  return true;
+}
+
 void ncclDebugInit() {
   pthread_mutex_lock(&ncclDebugLock);
   if (ncclDebugLevel != -1) { pthread_mutex_unlock(&ncclDebugLock); return; }
@@ -133,6 +280,19 @@ void ncclDebugInit() {
     }
   }
 
+  // Not NCCL_PARAM, which would log and recurse into us
+  const char* rateLimitEnv = getenv("NCCL_DEBUG_RATE_LIMIT");
+  if (rateLimitEnv) debugRateLimit = atoi(rateLimitEnv);
+  const char* asyncEnv = getenv("NCCL_DEBUG_ASYNC");
+  if (tempNcclDebugLevel >= NCCL_LOG_INFO && asyncEnv && atoi(asyncEnv) == 1) {
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, debugWriter, NULL) == 0) {
+      pthread_detach(writer);
+      atexit(debugAsyncFlush);
+      debugAsync = true;
+    }
+  }
+
   ncclEpoch = std::chrono::steady_clock::now();
   __atomic_store_n(&ncclDebugLevel, tempNcclDebugLevel, __ATOMIC_RELEASE);
   pthread_mutex_unlock(&ncclDebugLock);
@@ -156,6 +316,8 @@ void ncclDebugLog(ncclDebugLogLevel level, unsigned long flags, const char *file
     pthread_mutex_unlock(&ncclDebugLock);
   }
   if (ncclDebugLevel < level || ((flags & ncclDebugMask) == 0)) return;
+  uint32_t suppressed = 0;
+  if (level >= NCCL_LOG_INFO && flags != NCCL_CALL && !debugRateCheck(filefunc, line, &suppressed)) return;
 
   if (tid == -1) {
     tid = syscall(SYS_gettid);
@@ -182,11 +344,22 @@ void ncclDebugLog(ncclDebugLogLevel level, unsigned long flags, const char *file
                    hostname, pid, tid, cudaDev, timestamp, filefunc, line);
   }
 
+  if (len && suppressed) {
+    len += snprintf(buffer+len, sizeof(buffer)-len, "[%u lines from here suppressed] ", suppressed);
+  }
+
   if (len) {
     va_list vargs;
     va_start(vargs, fmt);
+    if (debugAsync && level != NCCL_LOG_WARN && debugAsyncLog(buffer, std::min(len, sizeof(buffer)-1), fmt, vargs)) {
+      va_end(vargs);
+      return;
+    }
+    // Keep the order of the lines of this process
+    if (debugAsync) debugRingsDrain();
     len += vsnprintf(buffer+len, sizeof(buffer)-len, fmt, vargs);
     va_end(vargs);
+    if (len > sizeof(buffer)-1) len = sizeof(buffer)-1;
     buffer[len++] = '\n';
     fwrite(buffer, 1, len, ncclDebugFile);
   }
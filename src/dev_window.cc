@@ -0,0 +1,277 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "nccl_device.h"
+#include "dev_window.h"
+#include "comm.h"
+#include "bootstrap.h"
+#include "graph.h"
+#include "p2p.h"
+#include "argcheck.h"
+#include "cudawrap.h"
+
+// Each rank's allocation starts with its signals, followed by the window.
+#define NCCL_DEV_WINDOW_ALIGN 4096
+
+struct ncclDevWindowHost {
+  struct ncclDevWindowHost* next;
+  ncclDevWindow_t* devWindow; // Descriptor in device memory, followed by peerBuffs and peerSignals
+  char* buff;
+  ncclIpcDesc ipcDesc;
+  size_t size;
+  size_t signalSize;
+  size_t allocSize;
+  void** peerPtrs;   // Base of each peer's allocation, NULL if not reachable
+  int* peerImported;
+  uint64_t* signalTotals; // Value ncclSignal last wrote on each peer
+};
+
+struct ncclDevWindowExchange {
+  ncclIpcDesc ipcDesc;
+  void* ptr;
+  int ok;
+};
+
+// Only direct P2P peers, the window has no network or SHM path.
+static bool devWindowReachable(struct ncclComm* comm, int peer) {
+  if (peer == comm->rank) return true;
+  if (comm->rankToNode[peer] != comm->node) return false;
+  int p2p, intermediateRank;
+  if (ncclTopoCheckP2p(comm->topo, comm->peerInfo[comm->rank].busId, comm->peerInfo[peer].busId, &p2p, NULL, &intermediateRank) != ncclSuccess) return false;
+  return p2p && intermediateRank == -1;
+}
+
+static ncclResult_t devWindowFree(struct ncclComm* comm, struct ncclDevWindowHost* win) {
+  for (int p=0; p<comm->nRanks; p++) {
+    if (win->peerImported[p]) NCCLCHECK(ncclP2pUnmapPeerBuffer(win->peerPtrs[p]));
+  }
+  if (win->buff) {
+    ncclP2pFreeShareableBuffer(&win->ipcDesc);
+    NCCLCHECK(ncclCudaFree(win->buff));
+  }
+  if (win->devWindow) NCCLCHECK(ncclCudaFree(win->devWindow));
+  free(win->peerPtrs);
+  free(win->peerImported);
+  free(win->signalTotals);
+  free(win);
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclDevWindowCreate, ncclComm_t comm, size_t size, void** buff, ncclDevWindow_t** window);
+ncclResult_t ncclDevWindowCreate(ncclComm_t comm, size_t size, void** buff, ncclDevWindow_t** window) {
+  NCCLCHECK(PtrCheck(comm, "DevWindowCreate", "comm"));
+  NCCLCHECK(PtrCheck(buff, "DevWindowCreate", "buff"));
+  NCCLCHECK(PtrCheck(window, "DevWindowCreate", "window"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  ncclResult_t ret = ncclSuccess;
+  int rank = comm->rank;
+  int nRanks = comm->nRanks;
+  size_t signalSize = ROUNDUP(nRanks*sizeof(uint64_t), NCCL_DEV_WINDOW_ALIGN);
+  struct ncclDevWindowExchange* all = NULL;
+  struct ncclDevWindowHost* win = NULL;
+  char* hostDesc = NULL;
+  size_t descSize = sizeof(ncclDevWindow_t) + 2*nRanks*sizeof(void*);
+  ncclDevWindow_t* desc;
+  char** peerBuffs;
+  uint64_t** peerSignals;
+
+  NCCLCHECK(ncclCalloc(&win, 1));
+  NCCLCHECKGOTO(ncclCalloc(&win->peerPtrs, nRanks), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&win->peerImported, nRanks), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&win->signalTotals, nRanks), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&all, nRanks), ret, fail);
+  win->size = size;
+  win->signalSize = signalSize;
+  win->allocSize = signalSize + ROUNDUP(size, NCCL_DEV_WINDOW_ALIGN);
+
+  // Signals must be zero before any peer can see the window
+  if (ncclP2pAllocateShareableBuffer(win->allocSize, &win->ipcDesc, (void**)&win->buff) == ncclSuccess &&
+      cudaMemset(win->buff, 0, signalSize) == cudaSuccess && cudaDeviceSynchronize() == cudaSuccess) {
+    all[rank].ok = 1;
+  }
+  all[rank].ipcDesc = win->ipcDesc;
+  all[rank].ptr = win->buff;
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, all, sizeof(struct ncclDevWindowExchange)), ret, fail);
+  for (int r=0; r<nRanks; r++) {
+    if (!all[r].ok) {
+      WARN("DevWindowCreate : rank %d failed to allocate %zu bytes", r, win->allocSize);
+      ret = ncclUnhandledCudaError;
+      goto fail;
+    }
+  }
+
+  for (int p=0; p<nRanks; p++) {
+    if (p == rank) {
+      win->peerPtrs[p] = win->buff;
+    } else if (devWindowReachable(comm, p)) {
+      NCCLCHECKGOTO(ncclP2pMapPeerBuffer(comm, p, win->allocSize, &all[p].ipcDesc, all[p].ptr, win->peerPtrs+p, win->peerImported+p), ret, fail);
+    }
+  }
+
+  // Build the descriptor on the host, then copy it to the device
+  NCCLCHECKGOTO(ncclCudaCalloc((char**)&win->devWindow, descSize), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&hostDesc, descSize), ret, fail);
+  desc = (ncclDevWindow_t*)hostDesc;
+  peerBuffs = (char**)(hostDesc + sizeof(ncclDevWindow_t));
+  peerSignals = (uint64_t**)(peerBuffs + nRanks);
+  desc->rank = rank;
+  desc->nRanks = nRanks;
+  desc->size = size;
+  desc->peerBuffs = (char**)((char*)win->devWindow + sizeof(ncclDevWindow_t));
+  desc->peerSignals = (uint64_t**)(desc->peerBuffs + nRanks);
+  desc->signals = (uint64_t*)win->buff;
+  for (int p=0; p<nRanks; p++) {
+    if (win->peerPtrs[p] == NULL) continue;
+    peerBuffs[p] = (char*)win->peerPtrs[p] + signalSize;
+    peerSignals[p] = (uint64_t*)win->peerPtrs[p];
+  }
+  NCCLCHECKGOTO(ncclCudaMemcpy((char*)win->devWindow, hostDesc, descSize), ret, fail);
+
+  INFO(NCCL_INIT, "DevWindowCreate : comm %p rank %d window %p size %zu", comm, rank, win->devWindow, size);
+  win->next = comm->devWindows;
+  comm->devWindows = win;
+  *buff = win->buff + signalSize;
+  *window = win->devWindow;
+  win = NULL;
+
+exit:
+  free(hostDesc);
+  free(all);
+  if (win) devWindowFree(comm, win);
+  return ret;
+fail:
+  goto exit;
+}
+
+static struct ncclDevWindowHost** devWindowFind(struct ncclComm* comm, ncclDevWindow_t* window) {
+  struct ncclDevWindowHost** prev = &comm->devWindows;
+  while (*prev && (*prev)->devWindow != window) prev = &(*prev)->next;
+  return prev;
+}
+
+NCCL_API(ncclResult_t, ncclDevWindowDestroy, ncclComm_t comm, ncclDevWindow_t* window);
+ncclResult_t ncclDevWindowDestroy(ncclComm_t comm, ncclDevWindow_t* window) {
+  NCCLCHECK(PtrCheck(comm, "DevWindowDestroy", "comm"));
+  struct ncclDevWindowHost** prev = devWindowFind(comm, window);
+  if (*prev == NULL) {
+    WARN("DevWindowDestroy : window %p unknown to this communicator", window);
+    return ncclInvalidArgument;
+  }
+  struct ncclDevWindowHost* win = *prev;
+  *prev = win->next;
+  // Peers must have unmapped our window before we free it
+  for (int p=0; p<comm->nRanks; p++) {
+    if (win->peerImported[p]) NCCLCHECK(ncclP2pUnmapPeerBuffer(win->peerPtrs[p]));
+    win->peerImported[p] = 0;
+  }
+  int* dummy;
+  NCCLCHECK(ncclCalloc(&dummy, comm->nRanks));
+  ncclResult_t ret = bootstrapAllGather(comm->bootstrap, dummy, sizeof(int));
+  free(dummy);
+  NCCLCHECK(devWindowFree(comm, win));
+  return ret;
+}
+
+// Checks the arguments of one-sided operations and returns the window
+static ncclResult_t rmaCheck(struct ncclComm* comm, ncclDevWindow_t* window, int peer, size_t offset, size_t bytes,
+    const char* opName, struct ncclDevWindowHost** win) {
+  NCCLCHECK(PtrCheck(comm, opName, "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  *win = *devWindowFind(comm, window);
+  if (*win == NULL) {
+    WARN("%s : window %p unknown to this communicator", opName, window);
+    return ncclInvalidArgument;
+  }
+  if (peer < 0 || peer >= comm->nRanks) {
+    WARN("%s : invalid peer %d (peer should be in the 0..%d range)", opName, peer, comm->nRanks-1);
+    return ncclInvalidArgument;
+  }
+  if ((*win)->peerPtrs[peer] == NULL) {
+    WARN("%s : peer %d is not reachable through P2P from rank %d, network and SHM peers are not supported", opName, peer, comm->rank);
+    return ncclInvalidUsage;
+  }
+  if (offset > (*win)->size || bytes > (*win)->size - offset) {
+    WARN("%s : %zu bytes at offset %zu exceed the window size %zu", opName, bytes, offset, (*win)->size);
+    return ncclInvalidArgument;
+  }
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclPut, const void* src, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclPut(const void* src, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream) {
+  struct ncclDevWindowHost* win;
+  NCCLCHECK(rmaCheck(comm, window, peer, offset, bytes, "Put", &win));
+  if (bytes == 0) return ncclSuccess;
+  char* dst = (char*)win->peerPtrs[peer] + win->signalSize + offset;
+  CUDACHECK(cudaMemcpyAsync(dst, src, bytes, cudaMemcpyDeviceToDevice, stream));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclGet, void* dst, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclGet(void* dst, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream) {
+  struct ncclDevWindowHost* win;
+  NCCLCHECK(rmaCheck(comm, window, peer, offset, bytes, "Get", &win));
+  if (bytes == 0) return ncclSuccess;
+  char* src = (char*)win->peerPtrs[peer] + win->signalSize + offset;
+  CUDACHECK(cudaMemcpyAsync(dst, src, bytes, cudaMemcpyDeviceToDevice, stream));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclSignal, int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclSignal(int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream) {
+  struct ncclDevWindowHost* win;
+  NCCLCHECK(rmaCheck(comm, window, peer, 0, 0, "Signal", &win));
+#if CUDA_VERSION >= 11070
+  // The value written is computed now, so a graph would replay it unchanged
+  cudaStreamCaptureStatus status;
+  CUDACHECK(cudaStreamIsCapturing(stream, &status));
+  if (status != cudaStreamCaptureStatusNone) {
+    WARN("Signal : cannot be captured in a CUDA graph");
+    return ncclInvalidUsage;
+  }
+  if (CUPFN(cuStreamWriteValue64) == NULL) {
+    WARN("Signal : stream memory operations are not supported");
+    return ncclInvalidUsage;
+  }
+  uint64_t* signal = (uint64_t*)win->peerPtrs[peer] + comm->rank;
+  // Stream writes are not atomic adds: this rank owns its signal on peer, so
+  // it keeps the running total and writes it.
+  uint64_t total = win->signalTotals[peer] + value;
+  CUCHECK(cuStreamWriteValue64(stream, (CUdeviceptr)signal, total, CU_STREAM_WRITE_VALUE_DEFAULT));
+  win->signalTotals[peer] = total;
+  return ncclSuccess;
+#else
+  WARN("Signal : requires CUDA 11.7 or later");
+  return ncclInvalidUsage;
+#endif
+}
+
+NCCL_API(ncclResult_t, ncclWaitSignal, int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclWaitSignal(int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream) {
+  struct ncclDevWindowHost* win;
+  NCCLCHECK(rmaCheck(comm, window, peer, 0, 0, "WaitSignal", &win));
+#if CUDA_VERSION >= 11070
+  if (CUPFN(cuStreamWaitValue64) == NULL) {
+    WARN("WaitSignal : stream memory operations are not supported");
+    return ncclInvalidUsage;
+  }
+  uint64_t* signal = (uint64_t*)win->buff + peer;
+  CUCHECK(cuStreamWaitValue64(stream, (CUdeviceptr)signal, value, CU_STREAM_WAIT_VALUE_GEQ));
+  return ncclSuccess;
+#else
+  WARN("WaitSignal : requires CUDA 11.7 or later");
+  return ncclInvalidUsage;
+#endif
+}
+
+ncclResult_t ncclDevWindowFreeAll(struct ncclComm* comm) {
+  while (comm->devWindows) {
+    struct ncclDevWindowHost* win = comm->devWindows;
+    comm->devWindows = win->next;
+    NCCLCHECK(devWindowFree(comm, win));
+  }
+  return ncclSuccess;
+}
@@ -11,6 +11,18 @@
 #include "bootstrap.h"
 #include "channel.h"
 #include "cudawrap.h"
+#include "profiler.h"
+#include "stats.h"
+#include "autotune.h"
+#include "ce_coll.h"
+#include "tuner.h"
+#include "wire.h"
+#include "determ.h"
+#include "shot_allreduce.h"
+#include "hier_allreduce.h"
+#include "ib_mcast.h"
+#include "host_coll.h"
+#include "register.h"
 
 #include <cstring> // std::memcpy
 #include <cinttypes> // PRIx64
@@ -41,6 +53,11 @@ struct ncclKernelMatch {
 #else
   #define HAVE_BFLOAT16 0
 #endif
+#ifdef __CUDA_FP8_TYPES_EXIST__
+  #define HAVE_FP8 1
+#else
+  #define HAVE_FP8 0
+#endif
 
 // Must be consistent with ncclDataType_t
 #define NCCL_FUNCS3(func, devredop, reduction, specialized) \
@@ -56,6 +73,11 @@ struct ncclKernelMatch {
   MACRO_IF(HAVE_BFLOAT16, \
     SINGLE_ARG(, NCCL_FUNC4(func, devredop, MACRO_IF(reduction, __nv_bfloat16, int8_t), specialized)), \
     /*nothing*/ \
+  ) \
+  MACRO_IF(HAVE_FP8, \
+    SINGLE_ARG(, NCCL_FUNC4(func, devredop, MACRO_IF(reduction, __nv_fp8_e4m3, int8_t), specialized), \
+                 NCCL_FUNC4(func, devredop, MACRO_IF(reduction, __nv_fp8_e5m2, int8_t), specialized)), \
+    /*nothing*/ \
   )
 
 // Must be consistent with ncclDevRedOp_t -- but we only generate kernel for sums.
@@ -65,12 +87,29 @@ struct ncclKernelMatch {
   NCCL_FUNCS3(func, Sum, reduction, /*specialized=*/0), /*Max*/ \
   NCCL_FUNCS3(func, Sum, reduction, /*specialized=*/0), /*Min*/ \
   NCCL_FUNCS3(func, Sum, reduction, /*specialized=*/0), /*PreMulSum*/ \
-  NCCL_FUNCS3(func, Sum, reduction, /*specialized=*/0)  /*SumPostDiv*/
+  NCCL_FUNCS3(func, Sum, reduction, /*specialized=*/0), /*SumPostDiv*/ \
+  NCCL_FUNCS3(func, Sum, reduction, /*specialized=*/0)  /*SumPostOp*/
 
 // Must be consistent with the ncclFuncSet enum
-static const ncclKernelMatch ncclKerns[1+ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNumDevRedOps*ncclNumTypes*NCCL_NUM_ALGORITHMS*NCCL_NUM_PROTOCOLS] = {
+static const ncclKernelMatch ncclKerns[1+2*ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNumDevRedOps*ncclNumTypes*NCCL_NUM_ALGORITHMS*NCCL_NUM_PROTOCOLS] = {
   {(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), true},
-  // We don't bake special kernels for the one-rank reductions
+  // We don't bake special kernels for the one-rank reductions (PreMulSum, then SumPostOp)
+  {/*int8*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*uint8*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*int32*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*uint32*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*int64*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*uint64*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*half*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*float*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  {/*double*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  #if HAVE_BFLOAT16
+    {/*bfloat16*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  #endif
+  #if HAVE_FP8
+    {/*fp8e4m3*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+    {/*fp8e5m2*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  #endif
   {/*int8*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
   {/*uint8*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
   {/*int32*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
@@ -83,6 +122,10 @@ static const ncclKernelMatch ncclKerns[1+ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNum
   #if HAVE_BFLOAT16
     {/*bfloat16*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
   #endif
+  #if HAVE_FP8
+    {/*fp8e4m3*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+    {/*fp8e5m2*/(void*)NCCL_KERN_NAME(SendRecv, RING, SIMPLE, Sum, int8_t), false},
+  #endif
   NCCL_FUNCS2(Broadcast, /*reduction=*/0),
   NCCL_FUNCS2(Reduce, /*reduction=*/1),
   NCCL_FUNCS2(AllGather, /*reduction=*/0),
@@ -91,47 +134,123 @@ static const ncclKernelMatch ncclKerns[1+ncclNumTypes+NCCL_NUM_FUNCTIONS*ncclNum
 };
 
 static ncclResult_t computeColl(struct ncclInfo* info /* input */, int* workFuncIndex, struct ncclWorkElem* work, struct ncclProxyOp* proxyOp /* output */);
+static ncclResult_t computeCollCached(struct ncclInfo* info, int* workFuncIndex, struct ncclWorkElem* work, struct ncclProxyOp* proxyOp);
 
 NCCL_PARAM(L1SharedMemoryCarveout, "L1_SHARED_MEMORY_CARVEOUT", 0);
 
+static constexpr int ncclKernelCount = sizeof(ncclKerns)/sizeof(ncclKerns[0]);
+
+// With CUDA_MODULE_LOADING=LAZY, querying or setting an attribute loads the kernel, so
+// touching all of them at init defeats lazy loading. Only the generic kernels are set
+// up at init and the others on their first launch, once per device.
+NCCL_PARAM(LazyKernelInit, "LAZY_KERNEL_INIT", -1);
+static int lazyKernelInit = -1;
+static uint64_t kernelReadyDevs[ncclKernelCount]; // bit d is set once kernel is set up on device d
+
+static ncclResult_t initKernel(void* fn, int cudaArch, size_t* stackSize) {
+  ncclResult_t result = ncclSuccess;
+  int carveout = ncclParamL1SharedMemoryCarveout();
+
+  if (stackSize) {
+    cudaFuncAttributes attr = {0};
+    CUDACHECKGOTO(cudaFuncGetAttributes(&attr, fn), result, ignore0);
+    *stackSize = attr.localSizeBytes;
+  ignore0:;
+  }
+
+  if (carveout) {
+    CUDACHECKGOTO(cudaFuncSetAttribute(fn,
+      cudaFuncAttributePreferredSharedMemoryCarveout, carveout),
+      result, ignore1);
+  ignore1:;
+  }
+
+  if (ncclShmemDynamicSize(cudaArch) != 0) {
+    CUDACHECKGOTO(cudaFuncSetAttribute(fn,
+      cudaFuncAttributeMaxDynamicSharedMemorySize, ncclShmemDynamicSize(cudaArch)),
+      result, exit);
+  }
+exit:
+  return result;
+}
+
 // Returns maximum kernel stack size of all CUDA kernels
 ncclResult_t ncclInitKernelsForDevice(int cudaArch, size_t* maxStackSize) {
-  constexpr int KernelCount = sizeof(ncclKerns)/sizeof(ncclKerns[0]);
   ncclResult_t result = ncclSuccess;
 
   if (maxStackSize) *maxStackSize = 0;
-  int carveout = ncclParamL1SharedMemoryCarveout();
+  if (lazyKernelInit == -1) {
+    int64_t lazy = ncclParamLazyKernelInit();
+    if (lazy == -1) {
+      const char* env = getenv("CUDA_MODULE_LOADING");
+      lazy = env && strcmp(env, "LAZY") == 0 ? 1 : 0;
+    }
+    lazyKernelInit = lazy ? 1 : 0;
+    if (lazyKernelInit) INFO(NCCL_INIT, "Setting up collective kernels on first use");
+  }
+
+  // Lean builds (NCCL_ARCHS) may not carry code for this GPU.
+  cudaFuncAttributes attr;
+  if (cudaFuncGetAttributes(&attr, ncclKernelGeneric) == cudaErrorNoKernelImageForDevice) {
+    (void)cudaGetLastError();
+    WARN("NCCL was not built for compute capability %d.%d, rebuild with NCCL_ARCHS including %d",
+        cudaArch/100, (cudaArch%100)/10, cudaArch/10);
+    return ncclInvalidUsage;
+  }
+
+  if (lazyKernelInit) {
+    // The stack size of the generic kernels is the one most kernels need. Kernels that
+    // need more raise the limit on their first launch.
+    void* fns[2] = { ncclKernelGeneric, (void*)ncclResidentKernel };
+    for (int i=0; i<2; i++) {
+      size_t stackSize = 0;
+      ncclResult_t res = initKernel(fns[i], cudaArch, maxStackSize ? &stackSize : NULL);
+      if (res != ncclSuccess) result = res;
+      if (maxStackSize && stackSize > *maxStackSize) *maxStackSize = stackSize;
+    }
+    return result;
+  }
 
   // Keep track if we already visited a function pointer.
   void* lru[2] = {nullptr, nullptr};
-  for (int i=0; i < KernelCount; i++) {
-    void* fn = ncclKerns[i].kernelFn;
-    if (fn == lru[0] || fn == lru[1]) goto next_kernel;
+  // The last one is the resident kernel, which can run any work.
+  for (int i=0; i < ncclKernelCount+1; i++) {
+    void* fn = i < ncclKernelCount ? ncclKerns[i].kernelFn : (void*)ncclResidentKernel;
+    if (fn == lru[0] || fn == lru[1]) continue;
     lru[1] = lru[0];
     lru[0] = fn;
 
-    if (maxStackSize) {
-      cudaFuncAttributes attr = {0};
-      CUDACHECKGOTO(cudaFuncGetAttributes(&attr, fn), result, ignore0);
-      if (attr.localSizeBytes > *maxStackSize) *maxStackSize = attr.localSizeBytes;
-    ignore0:;
-    }
+    size_t stackSize = 0;
+    ncclResult_t res = initKernel(fn, cudaArch, maxStackSize ? &stackSize : NULL);
+    if (res != ncclSuccess) result = res;
+    if (maxStackSize && stackSize > *maxStackSize) *maxStackSize = stackSize;
+  }
+  return result;
+}
 
-    if (carveout) {
-      CUDACHECKGOTO(cudaFuncSetAttribute(fn,
-        cudaFuncAttributePreferredSharedMemoryCarveout, carveout),
-        result, ignore1);
-    ignore1:;
-    }
+// Dynamic shmem of the kernels launched for comm. Low shmem communicators don't use
+// LL128 nor bulk copies, which are the only users of the per-warp scratch.
+static size_t ncclKernelShmemSize(struct ncclComm* comm) {
+  return comm->config.lowShmem ? 0 : ncclShmemDynamicSize(comm->cudaArch);
+}
 
-    if (ncclShmemDynamicSize(cudaArch) != 0) {
-      CUDACHECKGOTO(cudaFuncSetAttribute(fn,
-        cudaFuncAttributeMaxDynamicSharedMemorySize, ncclShmemDynamicSize(cudaArch)),
-        result, next_kernel);
-    }
-  next_kernel:;
+int64_t ncclParamSetStackSize();
+
+// Sets up the kernel of a plan on its first launch on this device when kernels are set up lazily.
+static ncclResult_t lazyInitKernel(struct ncclComm* comm, struct ncclKernelPlan* plan) {
+  if (lazyKernelInit != 1) return ncclSuccess;
+  uint64_t bit = comm->cudaDev < 64 ? 1ULL<<comm->cudaDev : 0;
+  uint64_t* ready = &kernelReadyDevs[plan->kernelIndex];
+  if (bit && (__atomic_load_n(ready, __ATOMIC_ACQUIRE) & bit)) return ncclSuccess;
+
+  size_t stackSize = 0, limit = 0;
+  NCCLCHECK(initKernel(plan->kernelFn, comm->cudaArch, &stackSize));
+  if (ncclParamSetStackSize() == 1 && cudaDeviceGetLimit(&limit, cudaLimitStackSize) == cudaSuccess && stackSize > limit) {
+    TRACE(NCCL_INIT, "Raising cudaLimitStackSize to %zi for kernel %d", stackSize, plan->kernelIndex);
+    CUDACHECKIGNORE(cudaDeviceSetLimit(cudaLimitStackSize, stackSize));
   }
-  return result;
+  __atomic_fetch_or(ready, bit, __ATOMIC_RELEASE);
+  return ncclSuccess;
 }
 
 /*****************************************************************************/
@@ -146,6 +265,7 @@ static void appendWorkElemColl(
   struct ncclWorkList* q = ncclIntruQueueTail(&chan->workQueue);
   if (q && funcIndex == q->work.header.funcIndex
         && elem->nWarps == q->work.elems[0].nWarps
+        && elem->p2pWrite == q->work.header.p2pWrite
         && chan->nWorkElem < NCCL_MAX_WORK_ELEMENTS) {
     int e = chan->nWorkElem++;
     q->work.elems[e] = *elem; // C++ struct assignment
@@ -156,6 +276,7 @@ static void appendWorkElemColl(
   q = ncclMemoryStackAlloc<struct ncclWorkList>(&comm->memScoped);
   q->work.header.type = ncclWorkTypeColl;
   q->work.header.funcIndex = funcIndex;
+  q->work.header.p2pWrite = elem->p2pWrite;
   q->work.elems[0] = *elem; // C++ struct assignment
   q->work.elems[0].bid = bid;
   q->work.elems[0].isUsed = 1;
@@ -172,6 +293,7 @@ static void appendWorkElemColl(
   struct ncclWorkList* q = ncclIntruQueueTail(&chan->workQueue);
   if (q && funcIndex == q->work.header.funcIndex
         && elem->elem.nWarps == q->work.regElems[0].elem.nWarps
+        && elem->elem.p2pWrite == q->work.header.p2pWrite
         && chan->nWorkElem < NCCL_MAX_WORK_ELEMENTS_REG) {
     int e = chan->nWorkElem++;
     q->work.regElems[e] = *elem; // C++ struct assignment
@@ -182,6 +304,7 @@ static void appendWorkElemColl(
   q = ncclMemoryStackAlloc<struct ncclWorkList>(&comm->memScoped);
   q->work.header.type = ncclWorkTypeRegColl;
   q->work.header.funcIndex = funcIndex;
+  q->work.header.p2pWrite = elem->elem.p2pWrite;
   q->work.regElems[0] = *elem; // C++ struct assignment
   q->work.regElems[0].elem.bid = bid;
   q->work.regElems[0].elem.isUsed = 1;
@@ -191,13 +314,36 @@ static void appendWorkElemColl(
 }
 
 static void finishWorkP2p(struct ncclWork* work) {
-  int nElem = 0;
+  int nElem = 0, nUsed = 0;
+  bool allLL = true;
   for (int e=0; e < NCCL_MAX_WORK_ELEMENTS_P2P; e++) {
-    if (work->p2pElems[e].p2pType != ncclWorkP2pTypeUnused)
+    if (work->p2pElems[e].p2pType != ncclWorkP2pTypeUnused) {
       nElem = e+1;
+      nUsed++;
+      if (work->p2pElems[e].proto != NCCL_PROTO_LL) allLL = false;
+    }
   }
   int nGroup = 1;
   while (nGroup < nElem) nGroup *= 2;
+  if (allLL && nUsed < nGroup) {
+    // Small messages: split the warps between the peers which are there instead of
+    // leaving those of the empty elements idle. The last barrier id is shared with
+    // __syncthreads, so the group using it must stay a single warp.
+    int warpsLeft = NCCL_MAX_NTHREADS/WARP_SIZE, warpStart = 0;
+    for (int i=0; i < nGroup; i++) {
+      int nWarps = 0;
+      if (i < nElem && work->p2pElems[i].p2pType != ncclWorkP2pTypeUnused) {
+        nWarps = i == NCCL_MAX_GROUPS-1 ? 1 : warpsLeft/nUsed;
+        nUsed--;
+      }
+      work->p2pElems[i].ngroups = nGroup;
+      work->p2pElems[i].warpStart = warpStart;
+      work->p2pElems[i].nWarps = nWarps;
+      warpStart += nWarps;
+      warpsLeft -= nWarps;
+    }
+    return;
+  }
   int nWarp = 1;
   while (nWarp*nGroup <= (NCCL_MAX_NTHREADS/WARP_SIZE)/2) nWarp *= 2;
   for (int i=0; i < nGroup; i++) {
@@ -261,31 +407,32 @@ static ncclResult_t addProxyOpIfNeeded(struct ncclComm* comm, struct ncclKernelP
 }
 
 // Put coll workelem & proxyOp in plan assuming nWorkBudget permits, so please
-// ensure *nWorkBudget >= nBids upon entry.
+// ensure *nWorkBudget >= nBids upon entry. Channels are picked among
+// [channelLo, channelLo+nCollChannels).
 static ncclResult_t addCollToPlan(
     struct ncclComm* comm, struct ncclKernelPlan* plan, int* nWorkBudget, int funcIndex,
     struct ncclWorkElem const* workElem, struct ncclProxyOp const* proxyOp,
-    int nCollChannels, int nBid, size_t bytes, bool regBufUsed, void* regBufSend[], void* regBufRecv[]
+    int channelLo, int nCollChannels, int nBid, size_t bytes, int algorithm, bool regBufUsed, void* regBufSend[], void* regBufRecv[]
   ) {
   struct ncclKernelPlan::Channel *chans = plan->channels;
 
   // Choose the `nBid` least loaded channels to do the work. This ensures
   // all bids go to different channels in case they need to synchronize.
   int least[/*nBid*/MAXCHANNELS];
-  least[0] = 0;
+  least[0] = channelLo;
   int maxIndexInLeast = 0;
-  size_t maxBytesInLeast = chans[0].collBytes;
+  size_t maxBytesInLeast = chans[channelLo].collBytes;
   // Initialize least[] such that the first nBid channels are accounted for.
   for (int b=1; b < nBid; b++) {
-    least[b] = b;
-    if (maxBytesInLeast < chans[b].collBytes) {
+    least[b] = channelLo+b;
+    if (maxBytesInLeast < chans[channelLo+b].collBytes) {
       maxIndexInLeast = b;
-      maxBytesInLeast = chans[b].collBytes;
+      maxBytesInLeast = chans[channelLo+b].collBytes;
     }
   }
   // Sort in the rest of the channels. If a channel has less work than the max
   // member of least[], replace that member and compute the new max.
-  for (int c=nBid; c < nCollChannels; c++) {
+  for (int c=channelLo+nBid; c < channelLo+nCollChannels; c++) {
     if (chans[c].collBytes < maxBytesInLeast) {
       least[maxIndexInLeast] = c;
       maxBytesInLeast = chans[least[0]].collBytes;
@@ -309,8 +456,16 @@ static ncclResult_t addCollToPlan(
     *nWorkBudget += chans[c].nWork;
     if (!regBufUsed) {
       appendWorkElemColl(comm, plan, c, funcIndex, workElem, bid);
+    } else if (algorithm == NCCL_ALGO_NVLS) {
+      // NVLS works on the multicast addresses of the registered buffers
+      struct ncclWorkElemReg workElemReg = {};
+      workElemReg.elem = *workElem; // C++ struct assignment
+      workElemReg.elem.regUsed = 1;
+      workElemReg.dnInputs[0] = regBufSend[0];
+      workElemReg.dnOutputs[0] = regBufRecv[0];
+      appendWorkElemColl(comm, plan, c, funcIndex, &workElemReg, bid);
     } else {
-      // Buffer registration in play which could only for CollNet at the moment.
+      // Buffer registration for CollNet
       struct ncclChannel* channel = &comm->channels[c];
       struct ncclWorkElemReg workElemReg;
       workElemReg.elem = *workElem; // C++ struct assignment
@@ -346,6 +501,11 @@ static ncclResult_t addCollToPlan(
 }
 
 NCCL_PARAM(P2pLLThreshold, "P2P_LL_THRESHOLD", 16384);
+// Minimum size of network sends/receives from/to a registered buffer to skip staging copies.
+NCCL_PARAM(NetRegThreshold, "NET_REG_THRESHOLD", 1<<18);
+// Minimum size of intra-node sends/receives between processes copied straight from the
+// registered send buffer. Receivers decide on it too, so it must be the same on all ranks.
+NCCL_PARAM(P2pRegThreshold, "P2P_REG_THRESHOLD", 1<<20);
 
 // Put p2p op in plan assuming there is space in nWorkBudget, so you must
 // ensure *nWorkBudget >= 1 upon entry.
@@ -360,18 +520,56 @@ static ncclResult_t addP2pToPlan(
     /*Args*/1, 1
   };
 
+  plan->autotuneSample = nullptr; // Don't time collectives sharing the kernel with p2p operations
+
   int channelId;
   NCCLCHECK(ncclChannelCompute(comm, peer, chunk%comm->p2pnChannelsPerPeer, info.coll, &channelId));
   info.channelId = channelId;
 
   // 1 is connIndex
-  struct ncclConnInfo* conn = isSendNotRecv ?
-    &comm->channels[channelId].peers[peer]->send[1].conn : &comm->channels[channelId].peers[peer]->recv[1].conn;
+  struct ncclConnector* connector = isSendNotRecv ?
+    comm->channels[channelId].peers[peer]->send+1 : comm->channels[channelId].peers[peer]->recv+1;
+  struct ncclConnInfo* conn = &connector->conn;
   info.protocol = ((conn->buffs[NCCL_PROTO_LL] != nullptr) && bytes <= ncclParamP2pLLThreshold()) ? NCCL_PROTO_LL : NCCL_PROTO_SIMPLE;
 
   struct ncclProxyOp proxyOp = {};
   NCCLCHECK(ncclProxyComputeP2p(&info, &proxyOp));
 
+  // Let the network use registered user buffers directly. The proxy needs to
+  // live in our process to access them.
+  int regSlot = -1;
+  if (ncclRegAny(comm) && info.protocol == NCCL_PROTO_SIMPLE && bytes >= (size_t)ncclParamNetRegThreshold() &&
+      connector->transportComm == (isSendNotRecv ? &netTransport.send : &netTransport.recv) &&
+      connector->proxyConn.sameProcess) {
+    NCCLCHECK(ncclRegFindNet(comm, connector, addr, bytes, &regSlot));
+  }
+  if (regSlot >= 0) {
+    proxyOp.reg = regSlot+1;
+    proxyOp.buffer = (uint8_t*)addr;
+    proxyOp.nbytes = bytes;
+  }
+
+  // Between processes of a node, the receiver copies straight from a registered
+  // send buffer once mapped on its side. Receivers find out at runtime whether
+  // the sender's buffer is registered. Connections within a process already
+  // exchange user buffer pointers (NCCL_DIRECT_READ/WRITE).
+  bool p2pReg = false;
+  if (info.protocol == NCCL_PROTO_SIMPLE && bytes >= (size_t)ncclParamP2pRegThreshold() &&
+      connector->transportComm == (isSendNotRecv ? &p2pTransport.send : &p2pTransport.recv) &&
+      (conn->flags & (NCCL_IPC_READ|NCCL_IPC_WRITE)) && conn->ptrExchange != nullptr) {
+    if (!isSendNotRecv) {
+      p2pReg = true;
+    } else if (ncclRegAny(comm)) {
+      void* peerPtr;
+      NCCLCHECK(ncclRegFindP2p(comm, peer, addr, bytes, &peerPtr));
+      // The sender passes the mapping of its buffer on the receiver in place of its own
+      if (peerPtr) {
+        addr = peerPtr;
+        p2pReg = true;
+      }
+    }
+  }
+
   struct ncclWorkElemP2p elem = {0};
   elem.proto = info.protocol;
   elem.peer = peer;
@@ -382,6 +580,8 @@ static ncclResult_t addP2pToPlan(
   elem.countLo32 = uint32_t(bytes);
   elem.countHi32 = bytes>>32;
   elem.chunkSize = info.chunkSize; // computed by ncclProxyComputeP2p
+  elem.netReg = regSlot >= 0 ? 1 : 0;
+  elem.p2pReg = p2pReg ? 1 : 0;
 
   *nWorkBudget += plan->channels[channelId].nWork;
   appendWorkElemP2p(comm, plan, channelId, &elem, fuseOk);
@@ -394,14 +594,20 @@ static ncclResult_t addP2pToPlan(
   return ncclSuccess;
 }
 
+NCCL_PARAM(KernelInlineWork, "KERNEL_INLINE_WORK", 1);
+// Captured plans keep their works in device memory, where ncclCommGraphUpdateBuffer can patch them
+NCCL_PARAM(GraphBufferUpdate, "GRAPH_BUFFER_UPDATE", 0);
+
 static void finishPlan(struct ncclKernelPlan* plan) {
   int channelUbound = 0;
   int channelCount = 0;
   uint64_t channelMask = 0;
   bool hasProxyOps = false;
+  bool singleWork = true;
   for (int c=0; c < MAXCHANNELS; c++) {
     struct ncclWorkList* tail = ncclIntruQueueTail(&plan->channels[c].workQueue);
     if (tail != nullptr) {
+      singleWork &= ncclIntruQueueHead(&plan->channels[c].workQueue) == tail;
       channelUbound = c+1;
       channelCount += 1;
       channelMask |= 1ull<<c;
@@ -415,6 +621,9 @@ static void finishPlan(struct ncclKernelPlan* plan) {
   plan->channelMask = channelMask;
   plan->hasProxyOps = hasProxyOps;
   plan->threadPerBlock = std::max(plan->threadPerBlock, 3*WARP_SIZE);
+  // Plans with one work per block pass them as kernel arguments.
+  plan->workInline = ncclParamKernelInlineWork() && singleWork && channelCount <= NCCL_KERNEL_INLINE_WORKS &&
+    !(plan->persistent && ncclParamGraphBufferUpdate());
 }
 
 static ncclResult_t registerIntraNodeBuffers(
@@ -476,9 +685,45 @@ fallback:
 }
 
 NCCL_PARAM(GraphRegister, "GRAPH_REGISTER", 0);
+// Bind buffers registered with ncclCommRegister to multicast objects so that single node NVLS
+// AllReduce works in place. Local ranks agree on the buffers through the bootstrap, which is
+// only worth it for operations captured in graphs, where it happens once per capture.
+NCCL_PARAM(NvlsRegister, "NVLS_REGISTER", 0);
+
+// Number of channels reserved to collectives issued on high priority streams,
+// the others use the remaining channels. Send/receive keep their usual channels.
+NCCL_PARAM(PriorityChannels, "PRIORITY_CHANNELS", 0);
+
+static int priorityChannels(struct ncclComm* comm) {
+  int n = ncclParamPriorityChannels();
+  return 0 < n && n < comm->nChannels ? n : 0;
+}
+
+// Channels the collectives of the group being scheduled may use.
+static void collChannelRange(struct ncclComm* comm, int* lo, int* n) {
+  int nHigh = priorityChannels(comm);
+  *lo = comm->tasks.priorityHigh ? comm->nChannels-nHigh : 0;
+  *n = comm->tasks.priorityHigh ? nHigh : comm->nChannels-nHigh;
+}
 
 static ncclResult_t getCollNetSupport(struct ncclInfo* info, int* collNetTypeSupport);
-static ncclResult_t getAlgoInfo(struct ncclInfo* info, int collNetTypeSupport, int numPipeOps);
+static ncclResult_t getAlgoInfo(struct ncclInfo* info, int collNetTypeSupport, int numPipeOps, bool autotune=false);
+
+// NVTX payload of the mark left for each collective once its algorithm is chosen
+struct NvtxParamsCollPlanned {
+  size_t bytes;
+  int algorithm;
+  int protocol;
+  int nChannels;
+  int nThreads;
+};
+static constexpr nvtxPayloadSchemaEntry_t CollPlannedSchema[] = {
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_SIZE, "Message size [bytes]"},
+  {0, NVTX_PAYLOAD_ENTRY_NCCL_ALGO, "Algorithm", nullptr, 0, offsetof(NvtxParamsCollPlanned, algorithm)},
+  {0, NVTX_PAYLOAD_ENTRY_NCCL_PROTO, "Protocol", nullptr, 0, offsetof(NvtxParamsCollPlanned, protocol)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Channels", nullptr, 0, offsetof(NvtxParamsCollPlanned, nChannels)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Threads per block", nullptr, 0, offsetof(NvtxParamsCollPlanned, nThreads)}
+};
 
 static ncclResult_t scheduleCollTasksToPlan(
     struct ncclComm* comm, struct ncclKernelPlan* plan, int* nWorkBudget
@@ -497,8 +742,11 @@ static ncclResult_t scheduleCollTasksToPlan(
     bytePerChannel[/*collNetSupport=*/1] = 256<<10; // Hand-tuned
   }
 
+  int channelLo, nLaneChannels;
+  collChannelRange(comm, &channelLo, &nLaneChannels);
+
   for (int collNetSupport=0; collNetSupport < 2; collNetSupport++) {
-    while (tasks->collBytesTotal < bytePerChannel[collNetSupport]*comm->nChannels &&
+    while (tasks->collBytesTotal < bytePerChannel[collNetSupport]*nLaneChannels &&
            bytePerChannel[collNetSupport] > NCCL_MIN_CHANNEL_SIZE) {
       // Reduce per-channel size so we utilize all channels.
       bytePerChannel[collNetSupport] /= 2;
@@ -527,7 +775,7 @@ static ncclResult_t scheduleCollTasksToPlan(
            aggEnd->op.op == aggInfo.opFull.op) {
       aggInfo.count += aggEnd->count;
       int nc = DIVUP(aggEnd->count*ncclTypeSize(aggInfo.datatype), bytePerChannel[collNetSupport]);
-      nc = std::max(1, std::min(nc, comm->nChannels));
+      nc = std::max(1, std::min(nc, nLaneChannels));
       nAggChannels += nc;
       nAggOps++;
       aggEnd = aggEnd->next;
@@ -535,7 +783,7 @@ static ncclResult_t scheduleCollTasksToPlan(
 
     if (nAggOps > 1) {
       NCCLCHECK(ncclInfoSetDerived(&aggInfo, comm->nRanks));
-      aggInfo.nChannels = std::min(comm->nChannels, nAggChannels);
+      aggInfo.nChannels = std::min(nLaneChannels, nAggChannels);
       int opPerChannel = DIVUP(nAggChannels, aggInfo.nChannels);
       NCCLCHECK(getAlgoInfo(&aggInfo, collNetSupport, opPerChannel));
     }
@@ -555,7 +803,7 @@ static ncclResult_t scheduleCollTasksToPlan(
       info.sliceSteps = head->sliceSteps;
       NCCLCHECK(ncclInfoSetDerived(&info, comm->nRanks));
       if (nAggOps > 1) {
-        int maxChannels = aggInfo.algorithm == NCCL_ALGO_NVLS || aggInfo.algorithm == NCCL_ALGO_NVLS_TREE ? comm->nvlsChannels : comm->nChannels;
+        int maxChannels = aggInfo.algorithm == NCCL_ALGO_NVLS || aggInfo.algorithm == NCCL_ALGO_NVLS_TREE ? comm->nvlsChannels : nLaneChannels;
         info.nChannels = DIVUP(info.nBytes, bytePerChannel[collNetSupport]);
         info.nChannels = std::max(1, std::min(info.nChannels, maxChannels));
         info.algorithm = aggInfo.algorithm;
@@ -563,12 +811,23 @@ static ncclResult_t scheduleCollTasksToPlan(
         info.nThreads = aggInfo.nThreads;
       }
 
+      // getAlgoInfo() tunes the number of channels down from there.
+      if (nAggOps == 1 && priorityChannels(comm)) info.nChannels = nLaneChannels;
+
       int workFuncIndex;
       struct ncclWorkElem workElem = {};
       struct ncclProxyOp proxyOp = {};
-      NCCLCHECK(computeColl(&info, &workFuncIndex, &workElem, &proxyOp));
+      if (nAggOps > 1) {
+        NCCLCHECK(computeColl(&info, &workFuncIndex, &workElem, &proxyOp));
+      } else {
+        NCCLCHECK(computeCollCached(&info, &workFuncIndex, &workElem, &proxyOp));
+      }
 
       if (*nWorkBudget < info.nChannels) return ncclSuccess; // Ensure room for addCollToPlan()
+      NvtxParamsCollPlanned planned{info.nBytes, info.algorithm, info.protocol, info.nChannels, info.nThreads};
+      NVTX3_MARK_WITH_PARAMS(CollPlanned, CollPlannedSchema, planned);
+
+      if (info.algorithm == NCCL_ALGO_NVLS || info.algorithm == NCCL_ALGO_NVLS_TREE) NCCLCHECK(ncclNvlsBufferSetup(comm));
 
       bool regBufUsed = false;
       void* regBufSend[NCCL_MAX_LOCAL_RANKS];
@@ -578,11 +837,17 @@ static ncclResult_t scheduleCollTasksToPlan(
           comm->intraHighestTransportType == TRANSPORT_P2P && // only when all ranks can p2p each other
           comm->intraRanks < comm->localRanks) { // only with inter-process & intra-node peers
         NCCLCHECK(registerIntraNodeBuffers(comm, plan, &info, &regBufUsed, regBufSend, regBufRecv));
+      } else if (plan->persistent && ncclParamNvlsRegister() && info.algorithm == NCCL_ALGO_NVLS && info.coll == ncclFuncAllReduce &&
+                 comm->nNodes == 1 && comm->channels[0].nvls.barrierMc != nullptr) {
+        NCCLCHECK(ncclNvlsRegisterBuffers(comm, info.sendbuff, info.recvbuff, info.nBytes, &regBufUsed, regBufSend, regBufRecv));
       }
 
-      int maxChannels = info.algorithm == NCCL_ALGO_NVLS || aggInfo.algorithm == NCCL_ALGO_NVLS_TREE ? comm->nvlsChannels : comm->nChannels;
+      // NVLS only runs on its own channels, whatever the lane.
+      bool nvls = info.algorithm == NCCL_ALGO_NVLS || aggInfo.algorithm == NCCL_ALGO_NVLS_TREE;
       NCCLCHECK(addCollToPlan(comm, plan, nWorkBudget, workFuncIndex, &workElem, &proxyOp,
-        maxChannels, info.nChannels, info.nBytes, regBufUsed, regBufSend, regBufRecv));
+        nvls ? 0 : channelLo, nvls ? comm->nvlsChannels : nLaneChannels, info.nChannels, info.nBytes, info.algorithm, regBufUsed, regBufSend, regBufRecv));
+      // Only plans made of a single collective can be timed.
+      if (plan->collOpCount == 1) plan->autotuneSample = info.autotuneSample;
       tasks->nTasksColl -= 1;
       tasks->collBytesTotal -= info.nBytes;
       ncclIntruQueueDequeue(&tasks->collQueue);
@@ -591,6 +856,7 @@ static ncclResult_t scheduleCollTasksToPlan(
       plan->threadPerBlock = std::max(plan->threadPerBlock, info.nThreads);
       if (!plan->kernelSpecialized) {
         plan->kernelFn = ncclKerns[workFuncIndex].kernelFn;
+        plan->kernelIndex = workFuncIndex;
         plan->kernelSpecialized = ncclKerns[workFuncIndex].specialized;
       }
     }
@@ -608,11 +874,42 @@ static size_t calcP2pChunkSize(size_t totalSize, int minChannels, int maxChannel
   return alignUp(size, minSize);
 }
 
+// Channel range send/recv operations are split over, see scheduleP2pTasksToPlan.
+static void p2pChannelLimits(struct ncclComm* comm, int* nChannelsMin, int* nChannelsMax) {
+  int nRanks = comm->nRanks;
+  // Try to use all channels
+  *nChannelsMax = comm->p2pnChannelsPerPeer;
+  *nChannelsMin = *nChannelsMax;
+  if (comm->nNodes == 1) {
+    // Try to use all channels, but one channel per operation.
+    while (*nChannelsMin*nRanks > comm->p2pnChannels && *nChannelsMin > 1) *nChannelsMin /= 2;
+    // Avoid overloading channels with 8+ operations as we loose the sync warp, hence a bit of bandwidth.
+    while (*nChannelsMax*nRanks > comm->p2pnChannels*4 && *nChannelsMax > 1) *nChannelsMax /= 2;
+  }
+}
+
+static ssize_t p2pChunkBytesMax(struct ncclComm* comm, ssize_t bytes, int nChannelsMin, int nChannelsMax) {
+  // Natural step size matching buffer steps.
+  ssize_t stepSize = comm->p2pChunkSize;
+  ssize_t minSize = stepSize/8;
+  ssize_t maxSize = comm->nNodes > 1 ? stepSize : stepSize*32;
+  return calcP2pChunkSize(bytes, nChannelsMin, nChannelsMax, minSize, maxSize);
+}
+
+// Number of p2p channels an operation of that size will run on. Chunk c of an operation goes to
+// channel c%p2pnChannelsPerPeer, and both ends of a send/recv compute the same chunking.
+static int p2pChannelsUsed(struct ncclComm* comm, ssize_t bytes) {
+  if (bytes == 0) return 1;
+  int nChannelsMin, nChannelsMax;
+  p2pChannelLimits(comm, &nChannelsMin, &nChannelsMax);
+  ssize_t nChunks = divUp(bytes, p2pChunkBytesMax(comm, bytes, nChannelsMin, nChannelsMax));
+  return (int)std::min<ssize_t>(nChunks, comm->p2pnChannelsPerPeer);
+}
+
 static ncclResult_t scheduleP2pTasksToPlan(
     struct ncclComm* comm, struct ncclKernelPlan* plan, int* nWorkBudget
   ) {
   struct ncclTasks* tasks = &comm->tasks;
-  int nRanks = comm->nRanks;
   struct ncclTasks::Peer* peers = tasks->peers;
   int const *sendOrder = tasks->p2pSendOrder;
   int const *recvOrder = tasks->p2pRecvOrder;
@@ -620,21 +917,13 @@ static ncclResult_t scheduleP2pTasksToPlan(
   plan->threadPerBlock = std::max(plan->threadPerBlock, NCCL_MAX_NTHREADS);
   if (!plan->kernelSpecialized) {
     plan->kernelFn = ncclKerns[FUNC_INDEX_P2P].kernelFn;
+    plan->kernelIndex = FUNC_INDEX_P2P;
     plan->kernelSpecialized = ncclKerns[FUNC_INDEX_P2P].specialized;
   }
 
   // Compute how much to split operations
-  // Natural step size matching buffer steps.
-  ssize_t stepSize = comm->p2pChunkSize;
-  // Try to use all channels
-  int nChannelsMax = comm->p2pnChannelsPerPeer;
-  int nChannelsMin = nChannelsMax;
-  if (comm->nNodes == 1) {
-    // Try to use all channels, but one channel per operation.
-    while (nChannelsMin*nRanks > comm->p2pnChannels && nChannelsMin > 1) nChannelsMin /= 2;
-    // Avoid overloading channels with 8+ operations as we loose the sync warp, hence a bit of bandwidth.
-    while (nChannelsMax*nRanks > comm->p2pnChannels*4 && nChannelsMax > 1) nChannelsMax /= 2;
-  }
+  int nChannelsMin, nChannelsMax;
+  p2pChannelLimits(comm, &nChannelsMin, &nChannelsMax);
 
   bool fuseOk;
   // We can perform 8 send/recv per round per CTA. Make sure we jump between fused blocks at node boundaries.
@@ -664,10 +953,8 @@ static ncclResult_t scheduleP2pTasksToPlan(
         char* sendPtr = send ? (char*)send->buff : nullptr;
         ssize_t recvBytes = recv ? recv->bytes : 0;
         ssize_t sendBytes = send ? send->bytes : 0;
-        ssize_t minSize = stepSize/8;
-        ssize_t maxSize = comm->nNodes > 1 ? stepSize : stepSize*32;
-        ssize_t recvChunkBytesMax = calcP2pChunkSize(recvBytes, nChannelsMin, nChannelsMax, minSize, maxSize);
-        ssize_t sendChunkBytesMax = calcP2pChunkSize(sendBytes, nChannelsMin, nChannelsMax, minSize, maxSize);
+        ssize_t recvChunkBytesMax = p2pChunkBytesMax(comm, recvBytes, nChannelsMin, nChannelsMax);
+        ssize_t sendChunkBytesMax = p2pChunkBytesMax(comm, sendBytes, nChannelsMin, nChannelsMax);
         // Zero size send/recv are syncs, encode here with -1.
         recvBytes = recv && recvBytes == 0 ? -1 : recvBytes;
         sendBytes = send && sendBytes == 0 ? -1 : sendBytes;
@@ -725,39 +1012,44 @@ static inline uint32_t rollingMin32(uint32_t a, uint32_t b) {
   return (b-a <= PositiveMax) ? a : b;
 }
 
+// Refresh comm->workFifoAckdMin from the notifications written by the device.
+static void pollWorkFifoAckd(struct ncclComm* comm) {
+  uint32_t* doneLive = comm->workFifoDone;
+  uint32_t ackd[MAXCHANNELS];
+  for (int c=0; c < MAXCHANNELS; c++) {
+    ackd[c] = __atomic_load_n(&doneLive[c], __ATOMIC_RELAXED);
+  }
+  // Compiler-only fence to prevent fusion of loops to encourage dense loads.
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+  uint32_t ackdAll = comm->workFifoSent;
+  for (int c=0; c < MAXCHANNELS; c++) {
+    // ackdAll is min over all non-quiesced channels
+    if (ackd[c] != comm->channels[c].workFifoSent)
+      ackdAll = rollingMin32(ackdAll, ackd[c]);
+  }
+
+  // Compiler only fence to prevent fusion of loops to encourage dense stores.
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+  for (int c=0; c < MAXCHANNELS; c++) {
+    // Advance counter on quiesced channels so they don't lag behind
+    // too far where they could get lost in 32-bit wraparound.
+    if (ackd[c] == comm->channels[c].workFifoSent) {
+      comm->channels[c].workFifoSent = ackdAll;
+      __atomic_store_n(&doneLive[c], ackdAll, __ATOMIC_RELAXED);
+    }
+  }
+  comm->workFifoAckdMin = ackdAll;
+}
+
 // Spin until its safe to increase comm->workFifoSent to desiredSent.
 static void waitWorkFifoAvailable(struct ncclComm* comm, uint32_t desiredSent) {
   if (__builtin_expect(rollingLess32(comm->workFifoAckdMin + comm->workFifoDepth, desiredSent), false)) {
+    ncclStatsAdd(&comm->statsWorkFifoFullWaits, 1);
     while (1) {
       // We have to poll for notifications from device.
-      uint32_t* doneLive = comm->workFifoDone;
-      uint32_t ackd[MAXCHANNELS];
-      for (int c=0; c < MAXCHANNELS; c++) {
-        ackd[c] = __atomic_load_n(&doneLive[c], __ATOMIC_RELAXED);
-      }
-      // Compiler-only fence to prevent fusion of loops to encourage dense loads.
-      __atomic_signal_fence(__ATOMIC_SEQ_CST);
-
-      uint32_t ackdAll = comm->workFifoSent;
-      for (int c=0; c < MAXCHANNELS; c++) {
-        // ackdAll is min over all non-quiesced channels
-        if (ackd[c] != comm->channels[c].workFifoSent)
-          ackdAll = rollingMin32(ackdAll, ackd[c]);
-      }
-
-      // Compiler only fence to prevent fusion of loops to encourage dense stores.
-      __atomic_signal_fence(__ATOMIC_SEQ_CST);
-
-      for (int c=0; c < MAXCHANNELS; c++) {
-        // Advance counter on quiesced channels so they don't lag behind
-        // too far where they could get lost in 32-bit wraparound.
-        if (ackd[c] == comm->channels[c].workFifoSent) {
-          comm->channels[c].workFifoSent = ackdAll;
-          __atomic_store_n(&doneLive[c], ackdAll, __ATOMIC_RELAXED);
-        }
-      }
-      comm->workFifoAckdMin = ackdAll;
-
+      pollWorkFifoAckd(comm);
       // See if that was enough.
       if (!rollingLess32(comm->workFifoAckdMin + comm->workFifoDepth, desiredSent)) break;
       sched_yield();
@@ -765,21 +1057,182 @@ static void waitWorkFifoAvailable(struct ncclComm* comm, uint32_t desiredSent) {
   }
 }
 
+NCCL_PARAM(WorkFifoOverflow, "WORK_FIFO_OVERFLOW", 0);
+
+static int planWorkCount(struct ncclKernelPlan* plan) {
+  int nWork = 0;
+  for (int c=0; c < plan->channelUbound; c++) nWork += plan->channels[c].nWork;
+  return nWork;
+}
+
+// NVTX payload of the ranges following a plan : work upload, kernel launch,
+// host callback and proxy op upload.
+struct NvtxParamsPlan {
+  int nChannels;
+  int nThreads;
+  int nWorks;
+  int nColls;
+};
+static constexpr nvtxPayloadSchemaEntry_t PlanSchema[] = {
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Channels"},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Threads per block", nullptr, 0, offsetof(NvtxParamsPlan, nThreads)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Works", nullptr, 0, offsetof(NvtxParamsPlan, nWorks)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Collectives", nullptr, 0, offsetof(NvtxParamsPlan, nColls)}
+};
+
+static NvtxParamsPlan nvtxPlanParams(struct ncclKernelPlan* plan) {
+  return NvtxParamsPlan{plan->channelCount, plan->threadPerBlock, planWorkCount(plan), plan->collOpCount};
+}
+
+// With NCCL_WORK_FIFO_OVERFLOW, give the plans which would have to wait in
+// waitWorkFifoAvailable() an overflow buffer instead. Plans are uploaded in
+// order with nothing else taking fifo slots in between, and acks only move
+// forward, so replaying the accounting of uploadWork() here is conservative.
+// This runs at prepare time since uploadWork() cannot call CUDA.
+static ncclResult_t prepareWorkOverflow(struct ncclComm* comm, struct ncclKernelPlan* planHead) {
+  // Recycle the buffers of completed kernels.
+  while (!ncclIntruQueueEmpty(&comm->workOverflowBusy)) {
+    struct ncclWorkOverflow* o = ncclIntruQueueHead(&comm->workOverflowBusy);
+    cudaError_t err = cudaEventQuery(o->event);
+    if (err == cudaErrorNotReady) break;
+    CUDACHECK(err);
+    ncclIntruQueueDequeue(&comm->workOverflowBusy);
+    o->next = comm->workOverflowFree;
+    comm->workOverflowFree = o;
+  }
+
+  pollWorkFifoAckd(comm);
+  uint32_t ixMask = comm->workFifoDepth-1;
+  uint32_t ixSent = comm->workFifoSent;
+  for (struct ncclKernelPlan* plan=planHead; plan != nullptr; plan = plan->next) {
+    if (plan->workInline) continue; // Takes no fifo slot
+    int nWork = planWorkCount(plan);
+    uint32_t ixHead = ixSent;
+    if (((ixHead + plan->channelCount-1) & ixMask) < (ixHead & ixMask)) ixHead = (ixHead + ixMask) & ~ixMask;
+    if (!rollingLess32(comm->workFifoAckdMin + comm->workFifoDepth, ixHead + nWork)) {
+      ixSent = ixHead + nWork;
+      continue;
+    }
+    struct ncclWorkOverflow** prev = &comm->workOverflowFree;
+    while (*prev != nullptr && (*prev)->nWorks < nWork) prev = &(*prev)->next;
+    struct ncclWorkOverflow* o = *prev;
+    if (o != nullptr) {
+      *prev = o->next;
+    } else {
+      NCCLCHECK(ncclCalloc(&o, 1));
+      o->nWorks = 1;
+      while (o->nWorks < nWork) o->nWorks *= 2;
+      NCCLCHECK(ncclCudaHostCalloc(&o->works, o->nWorks));
+      CUDACHECK(cudaEventCreateWithFlags(&o->event, cudaEventDisableTiming));
+      INFO(NCCL_ALLOC, "Allocated work fifo overflow buffer of %d works", o->nWorks);
+    }
+    o->next = nullptr;
+    plan->workOverflow = o;
+    ncclStatsAdd(&comm->statsWorkFifoOverflows, 1);
+  }
+  return ncclSuccess;
+}
+
+// Hands the overflow buffer of a just launched plan back to the comm.
+static ncclResult_t releaseWorkOverflow(struct ncclComm* comm, struct ncclKernelPlan* plan, cudaStream_t launchStream) {
+  struct ncclWorkOverflow* o = plan->workOverflow;
+  if (o == nullptr) return ncclSuccess;
+  plan->workOverflow = nullptr;
+  ncclIntruQueueEnqueue(&comm->workOverflowBusy, o);
+  CUDACHECK(cudaEventRecord(o->event, launchStream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclWorkOverflowFree(struct ncclComm* comm) {
+  while (!ncclIntruQueueEmpty(&comm->workOverflowBusy)) {
+    struct ncclWorkOverflow* o = ncclIntruQueueDequeue(&comm->workOverflowBusy);
+    o->next = comm->workOverflowFree;
+    comm->workOverflowFree = o;
+  }
+  while (comm->workOverflowFree != nullptr) {
+    struct ncclWorkOverflow* o = comm->workOverflowFree;
+    comm->workOverflowFree = o->next;
+    CUDACHECK(cudaEventDestroy(o->event));
+    NCCLCHECK(ncclCudaHostFree(o->works));
+    free(o);
+  }
+  return ncclSuccess;
+}
+
+bool ncclWorkFifoIdle(struct ncclComm* comm) {
+  pollWorkFifoAckd(comm);
+  return comm->workFifoAckdMin == comm->workFifoSent;
+}
+
+#define NCCL_WORK_ARENA_BLOCK_WORKS 2048
+
+// Finds room for the nWork works of a persistent plan in the arena, instead of
+// one cudaMalloc per captured plan.
+static ncclResult_t workArenaAlloc(struct ncclComm* comm, struct ncclKernelPlan* plan, int nWork) {
+  struct ncclWorkArenaBlock* block;
+  for (block = comm->workArena; block != nullptr; block = block->next) {
+    if (block->live == 0) block->used = 0;
+    if (block->nWorks - block->used >= nWork) break;
+  }
+  if (block == nullptr) {
+    NCCLCHECK(ncclCalloc(&block, 1));
+    block->nWorks = std::max(nWork, NCCL_WORK_ARENA_BLOCK_WORKS);
+    ncclResult_t ret = ncclCudaCalloc(&block->works, block->nWorks);
+    if (ret != ncclSuccess) {
+      free(block);
+      return ret;
+    }
+    block->next = comm->workArena;
+    comm->workArena = block;
+  }
+  plan->workHead = block->works + block->used;
+  plan->workArenaBlock = block;
+  block->used += nWork;
+  block->live += 1;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclWorkArenaFree(struct ncclComm* comm) {
+  while (comm->workArena != nullptr) {
+    struct ncclWorkArenaBlock* block = comm->workArena;
+    comm->workArena = block->next;
+    NCCLCHECK(ncclCudaFree(block->works));
+    free(block);
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t uploadWork(struct ncclComm* comm, struct ncclKernelPlan* plan) {
+  NvtxParamsPlan payload = nvtxPlanParams(plan);
+  NVTX3_FUNC_WITH_PARAMS(UploadWork, PlanSchema, payload)
   bool persistent = plan->persistent;
+  bool overflow = plan->workOverflow != nullptr;
   int channelUbound = plan->channelUbound;
-  int nWork = 0;
-  for (int c=0; c < channelUbound; c++) nWork += plan->channels[c].nWork;
+  int nWork = planWorkCount(plan);
+
+  if (plan->workInline) {
+    int y = 0;
+    for (int c=0; c < channelUbound; c++) {
+      struct ncclWorkList* q = ncclIntruQueueHead(&plan->channels[c].workQueue);
+      if (q == nullptr) continue;
+      q->work.header.inFifo = 0;
+      memcpy(plan->inlineWorks.data[y++], &q->work, sizeof(struct ncclWork));
+    }
+    plan->workHead = nullptr;
+    return ncclSuccess;
+  }
 
   struct ncclWork* workHeap;
-  if (!persistent) {
+  if (overflow) {
+    workHeap = plan->workOverflow->works;
+  } else if (!persistent) {
     workHeap = comm->workFifoHeap;
   } else {
     workHeap = ncclMemoryStackAlloc<struct ncclWork>(&comm->memScoped, nWork);
   }
-  uint32_t ixMask = persistent ? ~uint32_t(0) : comm->workFifoDepth-1;
+  uint32_t ixMask = persistent || overflow ? ~uint32_t(0) : comm->workFifoDepth-1;
   uint32_t ixSent;
-  if (persistent) {
+  if (persistent || overflow) {
     ixSent = 0;
   } else {
     ixSent = comm->workFifoSent;
@@ -807,11 +1260,11 @@ static ncclResult_t uploadWork(struct ncclComm* comm, struct ncclKernelPlan* pla
       if (q->next != nullptr) {
         q->work.header.workNext = int32_t(ixSent & ixMask) - int32_t(ixHead & ixMask);
       } else {
-        q->work.header.inFifo = !persistent ? 1 : 0;
+        q->work.header.inFifo = !persistent && !overflow ? 1 : 0;
         // Tell channel to ack us back ix+1 indicating that all slots up to and
         // including ix have been consumed.
         q->work.header.doneAcks = ix+1;
-        comm->channels[c].workFifoSent = ix+1;
+        if (!overflow) comm->channels[c].workFifoSent = ix+1;
       }
       workHeap[ix & ixMask] = q->work; // C++ struct assignment
       q = q->next;
@@ -819,18 +1272,23 @@ static ncclResult_t uploadWork(struct ncclComm* comm, struct ncclKernelPlan* pla
     }
   }
 
-  if (!persistent) {
+  if (overflow) {
+    // cudaHost memory, mapped at the same address on the device.
+    plan->workHead = workHeap;
+  } else if (!persistent) {
     comm->workFifoSent = ixSent;
     if (comm->workFifoHeapGdrHandle != nullptr) wc_store_fence();
     plan->workHead = &comm->devWorkFifoHeap[ixHead & ixMask];
   } else {
-    NCCLCHECK(ncclCudaMalloc(&plan->workHead, nWork));
+    NCCLCHECK(workArenaAlloc(comm, plan, nWork));
     NCCLCHECK(ncclCudaMemcpy(plan->workHead, workHeap, nWork));
   }
   return ncclSuccess;
 }
 
 static ncclResult_t uploadProxyOps(struct ncclComm* comm, struct ncclKernelPlan* plan) {
+  NvtxParamsPlan payload = nvtxPlanParams(plan);
+  NVTX3_FUNC_WITH_PARAMS(UploadProxyOps, PlanSchema, payload)
   uint64_t collOpCount = comm->sharedRes->collOpCount;
   // Advance comm's collOpCount by number of colls in this plan.
   comm->sharedRes->collOpCount += plan->collOpCount;
@@ -875,19 +1333,197 @@ static ncclResult_t hostStreamPlanTask(struct ncclComm* comm, struct ncclKernelP
 }
 
 static void CUDART_CB hostStreamPlanCallback(void *plan_) {
-  NVTX3_FUNC_RANGE_IN(nccl_domain);
   struct ncclKernelPlan* plan = (struct ncclKernelPlan*)plan_;
+  NvtxParamsPlan payload = nvtxPlanParams(plan);
+  NVTX3_FUNC_WITH_PARAMS(HostCallback, PlanSchema, payload)
   ncclResult_t result = hostStreamPlanTask(plan->comm, plan);
   if (result != ncclSuccess) {
     WARN("hostStreamPlanCallback() failed : %s", ncclGetErrorString(result));
   }
 }
 
+// Graph doorbells (NCCL_GRAPH_DOORBELL=1). Plans whose proxy ops must be posted when the GPU
+// reaches them (captured plans, and all plans while graphs are alive) normally get a host
+// callback, which CUDA runs on its own thread for every graph replay. Instead, the launch stream
+// waits for a mailbox in host memory to be empty and writes the doorbell slot of the plan in it
+// with stream memory operations, which graphs capture like any other. A thread of the comm polls
+// the mailbox, posts the proxy ops of the plan and empties it, so plans are still posted in the
+// order the GPU runs them.
+NCCL_PARAM(GraphDoorbell, "GRAPH_DOORBELL", 0);
+
+#define NCCL_DOORBELL_CHUNK 1024
+#define NCCL_DOORBELL_MAX_CHUNKS 64
+#define NCCL_DOORBELL_SPIN_NS 10000000 // Poll without sleeping for 10ms after each doorbell
+
+struct ncclGraphDoorbells {
+  volatile uint32_t* mailbox; // slot of the plan to post, 0 when empty
+  uint32_t* mailboxDev;
+  // Plan and free list link of each slot, by slot-1. Chunks are only added, the poller reads them without the lock.
+  struct ncclKernelPlan** plans[NCCL_DOORBELL_MAX_CHUNKS];
+  uint32_t* links[NCCL_DOORBELL_MAX_CHUNKS];
+  int nChunks;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint32_t freeHead;
+  int nUsed;        // The poller sleeps when no slot is in use
+  int eagerPending; // Uncaptured plans given a slot and not posted yet
+  bool stop;
+  pthread_t thread;
+};
+
+static inline struct ncclKernelPlan** doorbellPlan(struct ncclGraphDoorbells* db, uint32_t slot) {
+  return db->plans[(slot-1)/NCCL_DOORBELL_CHUNK] + (slot-1)%NCCL_DOORBELL_CHUNK;
+}
+
+static void doorbellFree(struct ncclGraphDoorbells* db, uint32_t slot) {
+  pthread_mutex_lock(&db->mutex);
+  *doorbellPlan(db, slot) = nullptr;
+  db->links[(slot-1)/NCCL_DOORBELL_CHUNK][(slot-1)%NCCL_DOORBELL_CHUNK] = db->freeHead;
+  db->freeHead = slot;
+  db->nUsed--;
+  pthread_mutex_unlock(&db->mutex);
+}
+
+static void* doorbellThreadMain(void* arg) {
+  struct ncclComm* comm = (struct ncclComm*)arg;
+  struct ncclGraphDoorbells* db = comm->graphDoorbells;
+  (void) cudaSetDevice(comm->cudaDev);
+  uint64_t lastRing = 0;
+  while (true) {
+    uint32_t slot = *db->mailbox;
+    if (slot != 0) {
+      struct ncclKernelPlan* plan = __atomic_load_n(doorbellPlan(db, slot), __ATOMIC_ACQUIRE);
+      bool persistent = plan->persistent; // Uncaptured plans are reclaimed once posted
+      ncclResult_t ret = hostStreamPlanTask(comm, plan);
+      if (ret != ncclSuccess) WARN("Graph doorbell : posting proxy ops failed : %s", ncclGetErrorString(ret));
+      if (!persistent) {
+        doorbellFree(db, slot);
+        __atomic_sub_fetch(&db->eagerPending, 1, __ATOMIC_RELEASE);
+      }
+      __atomic_store_n(db->mailbox, 0, __ATOMIC_SEQ_CST);
+      lastRing = clockNano();
+      continue;
+    }
+    if (__atomic_load_n(&db->nUsed, __ATOMIC_ACQUIRE) == 0 || __atomic_load_n(&db->stop, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&db->mutex);
+      while (db->nUsed == 0 && !db->stop) pthread_cond_wait(&db->cond, &db->mutex);
+      bool stop = db->stop;
+      pthread_mutex_unlock(&db->mutex);
+      if (stop) break;
+    }
+    if (clockNano()-lastRing < NCCL_DOORBELL_SPIN_NS) sched_yield();
+    else usleep(50);
+  }
+  return NULL;
+}
+
+// Returns whether plans go through doorbells, setting them up on first use.
+static bool graphDoorbellsEnabled(struct ncclComm* comm) {
+  if (comm->graphDoorbellState != 0) return comm->graphDoorbellState == 1;
+  comm->graphDoorbellState = -1;
+  if (ncclParamGraphDoorbell() == 0) return false;
+#if CUDART_VERSION >= 11070
+  struct ncclGraphDoorbells* db = nullptr;
+  if (CUPFN(cuStreamWriteValue32) == nullptr || CUPFN(cuStreamWaitValue32) == nullptr) {
+    INFO(NCCL_INIT, "NCCL_GRAPH_DOORBELL ignored, stream memory operations are not supported");
+    return false;
+  }
+  if (ncclCalloc(&db, 1) != ncclSuccess) return false;
+  uint32_t* mailbox;
+  if (ncclCudaHostCalloc(&mailbox, 1) != ncclSuccess) goto fail;
+  db->mailbox = mailbox;
+  if (cudaHostGetDevicePointer((void**)&db->mailboxDev, mailbox, 0) != cudaSuccess) goto fail;
+  pthread_mutex_init(&db->mutex, NULL);
+  pthread_cond_init(&db->cond, NULL);
+  comm->graphDoorbells = db;
+  if (pthread_create(&db->thread, NULL, doorbellThreadMain, comm) != 0) {
+    comm->graphDoorbells = nullptr;
+    goto fail;
+  }
+  ncclSetThreadName(db->thread, "NCCL Doorbell%2d", comm->cudaDev);
+  comm->graphDoorbellState = 1;
+  INFO(NCCL_INIT, "Graph doorbells enabled, proxy ops of graph replays are posted without host callbacks");
+  return true;
+fail:
+  INFO(NCCL_INIT, "NCCL_GRAPH_DOORBELL ignored, could not set up the doorbell mailbox");
+  if (db->mailbox) ncclCudaHostFree((void*)db->mailbox);
+  free(db);
+#endif
+  return false;
+}
+
+// Uncaptured plans must keep going through doorbells until the ones already rung are posted.
+static inline bool graphDoorbellsPending(struct ncclComm* comm) {
+  return comm->graphDoorbellState == 1 && __atomic_load_n(&comm->graphDoorbells->eagerPending, __ATOMIC_ACQUIRE) != 0;
+}
+
+static ncclResult_t graphDoorbellAlloc(struct ncclComm* comm, struct ncclKernelPlan* plan) {
+  struct ncclGraphDoorbells* db = comm->graphDoorbells;
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&db->mutex);
+  if (db->freeHead == 0) {
+    int c = db->nChunks;
+    if (c == NCCL_DOORBELL_MAX_CHUNKS) {
+      WARN("Graph doorbell : more than %d plans in use", NCCL_DOORBELL_MAX_CHUNKS*NCCL_DOORBELL_CHUNK);
+      ret = ncclInternalError;
+      goto exit;
+    }
+    NCCLCHECKGOTO(ncclCalloc(db->plans+c, NCCL_DOORBELL_CHUNK), ret, exit);
+    NCCLCHECKGOTO(ncclCalloc(db->links+c, NCCL_DOORBELL_CHUNK), ret, exit);
+    for (int i=0; i<NCCL_DOORBELL_CHUNK; i++) db->links[c][i] = i+1 < NCCL_DOORBELL_CHUNK ? c*NCCL_DOORBELL_CHUNK+i+2 : 0;
+    db->freeHead = c*NCCL_DOORBELL_CHUNK+1;
+    db->nChunks++;
+  }
+  plan->doorbellSlot = db->freeHead;
+  db->freeHead = db->links[(plan->doorbellSlot-1)/NCCL_DOORBELL_CHUNK][(plan->doorbellSlot-1)%NCCL_DOORBELL_CHUNK];
+  __atomic_store_n(doorbellPlan(db, plan->doorbellSlot), plan, __ATOMIC_RELEASE);
+  if (db->nUsed++ == 0) pthread_cond_signal(&db->cond);
+  if (!plan->persistent) __atomic_add_fetch(&db->eagerPending, 1, __ATOMIC_RELEASE);
+exit:
+  pthread_mutex_unlock(&db->mutex);
+  return ret;
+}
+
+// Rings the doorbell of the plan from the launch stream, once the previous one has been taken.
+static ncclResult_t graphDoorbellRing(struct ncclComm* comm, struct ncclKernelPlan* plan, cudaStream_t launchStream) {
+#if CUDART_VERSION >= 11070
+  CUdeviceptr mailbox = (CUdeviceptr)comm->graphDoorbells->mailboxDev;
+  CUCHECK(cuStreamWaitValue32(launchStream, mailbox, 0, CU_STREAM_WAIT_VALUE_EQ));
+  CUCHECK(cuStreamWriteValue32(launchStream, mailbox, plan->doorbellSlot, CU_STREAM_WRITE_VALUE_DEFAULT));
+#endif
+  return ncclSuccess;
+}
+
+ncclResult_t ncclGraphDoorbellsFree(struct ncclComm* comm) {
+  struct ncclGraphDoorbells* db = comm->graphDoorbells;
+  if (db == nullptr) return ncclSuccess;
+  pthread_mutex_lock(&db->mutex);
+  db->stop = true;
+  pthread_cond_signal(&db->cond);
+  pthread_mutex_unlock(&db->mutex);
+  pthread_join(db->thread, NULL);
+  for (int c=0; c<db->nChunks; c++) {
+    free(db->plans[c]);
+    free(db->links[c]);
+  }
+  NCCLCHECK(ncclCudaHostFree((void*)db->mailbox));
+  pthread_mutex_destroy(&db->mutex);
+  pthread_cond_destroy(&db->cond);
+  free(db);
+  comm->graphDoorbells = nullptr;
+  comm->graphDoorbellState = -1;
+  return ncclSuccess;
+}
+
 static ncclResult_t reclaimPlan(struct ncclComm* comm, struct ncclCommCallback* me) {
   struct ncclKernelPlan* plan = (struct ncclKernelPlan*)me; // cast from first member `reclaim`
   if (plan->persistent) {
     comm->persistentRefs -= 1;
-    NCCLCHECK(ncclCudaFree(plan->workHead));
+    for (struct ncclKernelPlan** p = &comm->persistentPlans; *p != nullptr; p = &(*p)->persistentNext) {
+      if (*p == plan) { *p = plan->persistentNext; break; }
+    }
+    if (plan->doorbellSlot) doorbellFree(comm->graphDoorbells, plan->doorbellSlot);
+    if (plan->workArenaBlock) plan->workArenaBlock->live -= 1;
     while (!ncclIntruQueueEmpty(&plan->ipcMemQueue)) {
       struct ncclPointerList* q = ncclIntruQueueDequeue(&plan->ipcMemQueue);
       CUDACHECKIGNORE(cudaIpcCloseMemHandle(q->ptr));
@@ -909,7 +1545,88 @@ static void persistentDestructor(void* plans_) {
   }
 }
 
+NCCL_PARAM(ResidentKernel, "RESIDENT_KERNEL", 0);
+
+// Picks the channels and the lane of the group being launched. The channels only
+// depend on the priority of the user streams so that all ranks agree on them.
+static ncclResult_t selectPriorityLane(struct ncclComm* comm, bool persistent) {
+  struct ncclTasks* tasks = &comm->tasks;
+  struct ncclSharedResources* res = comm->sharedRes;
+  tasks->priorityHigh = tasks->laneHigh = false;
+  if (priorityChannels(comm) == 0) return ncclSuccess;
+  if (res->laneState == 0) {
+    int least, greatest;
+    CUDACHECK(cudaDeviceGetStreamPriorityRange(&least, &greatest));
+    NCCLCHECK(ncclStrongStreamConstruct(&res->deviceStreamHigh, greatest));
+    for (int l=0; l < 2; l++) CUDACHECK(cudaEventCreateWithFlags(&res->laneEvent[l], cudaEventDisableTiming));
+    res->laneStreamPriorityLeast = least;
+    res->laneState = 1;
+  }
+  bool high = true;
+  for (struct ncclCudaStreamList* l=tasks->streams; l != nullptr && high; l = l->next) {
+    int priority;
+    CUDACHECK(cudaStreamGetPriority(l->stream, &priority));
+    high = priority < res->laneStreamPriorityLeast;
+  }
+  tasks->priorityHigh = high;
+  // Host tasks and the resident kernel need launches to stay in order.
+  tasks->laneHigh = high && !persistent && comm->persistentRefs == 0 && !ncclCudaLaunchBlocking && !ncclParamResidentKernel() && !graphDoorbellsPending(comm);
+  return ncclSuccess;
+}
+
+// Lanes are only ordered with each other where their channels overlap: make
+// launchStream wait for the other lane if it may still run on them.
+static ncclResult_t orderPriorityLanes(struct ncclComm* comm, struct ncclKernelPlan* planHead, cudaStream_t launchStream) {
+  struct ncclSharedResources* res = comm->sharedRes;
+  int lane = comm->tasks.laneHigh ? 1 : 0;
+  uint64_t mask = 0;
+  for (struct ncclKernelPlan* plan=planHead; plan != nullptr; plan = plan->next) mask |= plan->channelMask;
+  if (res->laneMask[1-lane] & mask) {
+    cudaError_t err = cudaEventQuery(res->laneEvent[1-lane]);
+    if (err == cudaSuccess) {
+      res->laneMask[1-lane] = 0;
+    } else if (err == cudaErrorNotReady) {
+      CUDACHECK(cudaStreamWaitEvent(launchStream, res->laneEvent[1-lane], 0));
+    } else {
+      CUDACHECK(err);
+    }
+  }
+  res->laneMask[lane] |= mask;
+  return ncclSuccess;
+}
+
+NCCL_PARAM(P2pSelfCopyCe, "P2P_SELF_COPY_CE", 0);
+
+// Send/recv pairs to self are plain copies. Hand them to the copy engines with
+// cudaMemcpyAsync instead of running them on SMs. This needs a single user
+// stream, since the copy then orders the same way the kernel would.
+static ncclResult_t selfCopiesToStream(struct ncclComm* comm, cudaStream_t stream) {
+  struct ncclTasks* tasks = &comm->tasks;
+  struct ncclTasks::Peer* self = &tasks->peers[comm->rank];
+  while (!ncclIntruQueueEmpty(&self->sendQueue) && !ncclIntruQueueEmpty(&self->recvQueue)) {
+    struct ncclTaskP2p* send = ncclIntruQueueDequeue(&self->sendQueue);
+    struct ncclTaskP2p* recv = ncclIntruQueueDequeue(&self->recvQueue);
+    if (send->bytes != 0 && send->buff != recv->buff) {
+      CUDACHECK(cudaMemcpyAsync(recv->buff, send->buff, send->bytes, cudaMemcpyDeviceToDevice, stream));
+    }
+    tasks->nTasksP2p -= 2;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclLaunchPrepare(struct ncclComm* comm) {
+  struct NvtxParamsLaunchPrepare {
+    int nColls;
+    int nP2ps;
+    size_t collBytes;
+  };
+  static constexpr nvtxPayloadSchemaEntry_t LaunchPrepareSchema[] = {
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Collectives"},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Point to point operations", nullptr, 0, offsetof(NvtxParamsLaunchPrepare, nP2ps)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_SIZE, "Collective bytes", nullptr, 0, offsetof(NvtxParamsLaunchPrepare, collBytes)}
+  };
+  NvtxParamsLaunchPrepare payload{comm->tasks.nTasksColl, comm->tasks.nTasksP2p, comm->tasks.collBytesTotal};
+  NVTX3_FUNC_WITH_PARAMS(LaunchPrepare, LaunchPrepareSchema, payload)
   ncclResult_t result = ncclSuccess;
   struct ncclTasks* tasks = &comm->tasks;
   bool persistent = ncclCudaGraphValid(tasks->capturingGraph);
@@ -918,6 +1635,11 @@ ncclResult_t ncclLaunchPrepare(struct ncclComm* comm) {
   // Poll for callbacks sent to us from other threads. Typically these free
   // resources from to our memory pools.
   NCCLCHECK(ncclCommPollCallbacks(comm, /*waitSome=*/false));
+  if (tasks->nTasksP2p != 0 && ncclParamP2pSelfCopyCe() && tasks->streams && tasks->streams->next == nullptr) {
+    NCCLCHECK(selfCopiesToStream(comm, tasks->streams->stream));
+  }
+  // Write out what the device timeline recorded for the previous launches.
+  ncclProfilingDeviceTimeline(comm);
 
   // We already have one frame present which holds all of our tasks (which we
   // are about to schedule). Now push an additional frame for allocating
@@ -925,6 +1647,7 @@ ncclResult_t ncclLaunchPrepare(struct ncclComm* comm) {
   ncclMemoryStackPush(&comm->memScoped);
 
   if (tasks->nTasksColl + tasks->nTasksP2p != 0) {
+    NCCLCHECKGOTO(selectPriorityLane(comm, persistent), result, failure);
     do {
       struct ncclKernelPlan* plan = ncclMemoryPoolAlloc<struct ncclKernelPlan>(&comm->memPool_ncclKernelPlan, &comm->memPermanent);
       ncclIntruQueueEnqueue(&comm->planQueue, plan);
@@ -962,6 +1685,9 @@ ncclResult_t ncclLaunchPrepare(struct ncclComm* comm) {
 
     struct ncclKernelPlan* planHead = ncclIntruQueueHead(&comm->planQueue);
     comm->unlaunchedPlansHead = planHead;
+    if (!persistent && ncclParamWorkFifoOverflow()) {
+      NCCLCHECKGOTO(prepareWorkOverflow(comm, planHead), result, failure);
+    }
 
     // Semantically we want these dependencies for the kernels launched:
     //   1. Launch host task on hostStream.
@@ -978,21 +1704,37 @@ ncclResult_t ncclLaunchPrepare(struct ncclComm* comm) {
     // The two-level fan-in fan-out is because ncclStrongStreamWaitStream() requires
     // at least one of the two streams to be strong-stream.
     cudaStream_t launchStream = tasks->streams->stream;
-    NCCLCHECKGOTO(ncclStrongStreamAcquire(tasks->capturingGraph, &comm->sharedRes->deviceStream), result, failure);
+    struct ncclStrongStream* deviceStream = tasks->laneHigh ? &comm->sharedRes->deviceStreamHigh : &comm->sharedRes->deviceStream;
+    NCCLCHECKGOTO(ncclStrongStreamAcquire(tasks->capturingGraph, deviceStream), result, failure);
+    if (tasks->laneHigh && tasks->laneSync) {
+      // Connection setup went through the regular lane.
+      NCCLCHECKGOTO(ncclStrongStreamAcquireUncaptured(&comm->sharedRes->deviceStream), result, failure);
+      NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, deviceStream, &comm->sharedRes->deviceStream), result, failure);
+      NCCLCHECKGOTO(ncclStrongStreamRelease(tasks->capturingGraph, &comm->sharedRes->deviceStream), result, failure);
+    }
+    tasks->laneSync = false;
 
     // Create dependency for device stream on user streams. First from extra user
     // streams to deviceStream. Then deviceStream to first user stream.
     for (struct ncclCudaStreamList* l=tasks->streams->next; l != nullptr; l = l->next) {
-      NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, &comm->sharedRes->deviceStream, l->stream), result, failure);
+      NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, deviceStream, l->stream), result, failure);
+    }
+    NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, launchStream, deviceStream), result, failure);
+    if (!persistent && comm->sharedRes->laneState == 1) {
+      NCCLCHECKGOTO(orderPriorityLanes(comm, planHead, launchStream), result, failure);
     }
-    NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, launchStream, &comm->sharedRes->deviceStream), result, failure);
 
-    if (persistent || comm->persistentRefs != 0 || ncclCudaLaunchBlocking) {
+    if (persistent || comm->persistentRefs != 0 || ncclCudaLaunchBlocking || graphDoorbellsPending(comm)) {
       // We have to launch host tasks to push proxy args. We are careful to only
       // do this if necessary since host tasks impose a high performance cost in CUDA.
       bool acquired = false;
+      bool doorbells = graphDoorbellsEnabled(comm);
       for (struct ncclKernelPlan* plan=planHead; plan != nullptr; plan = plan->next) {
-        if (plan->hasProxyOps) {
+        plan->proxyDeferred = true;
+        if (plan->hasProxyOps && doorbells) {
+          // Rung from the launch stream right before the kernel.
+          NCCLCHECKGOTO(graphDoorbellAlloc(comm, plan), result, failure);
+        } else if (plan->hasProxyOps) {
           if (!acquired) {
             acquired = true;
             NCCLCHECKGOTO(ncclStrongStreamAcquire(tasks->capturingGraph, &comm->sharedRes->hostStream), result, failure);
@@ -1009,6 +1751,10 @@ ncclResult_t ncclLaunchPrepare(struct ncclComm* comm) {
 
     if (persistent) {
       comm->persistentRefs += nPlans;
+      for (struct ncclKernelPlan* plan = planHead; plan != nullptr; plan = plan->next) {
+        plan->persistentNext = comm->persistentPlans;
+        comm->persistentPlans = plan;
+      }
       NCCLCHECKGOTO(ncclCudaGraphAddDestructor(tasks->capturingGraph, persistentDestructor, (void*)planHead), result, failure);
     }
   }
@@ -1033,14 +1779,106 @@ ncclResult_t ncclLaunchKernelBefore_NoUncapturedCuda(struct ncclComm* comm, stru
 NCCL_PARAM(MemSyncDomain, "MEM_SYNC_DOMAIN", cudaLaunchMemSyncDomainRemote);
 #endif
 
+// Starts the resident kernel on its own stream, serving every channel plans of
+// this comm use. Leaves it disabled when stream memory operations, which ring
+// the doorbells from the launch streams, are not supported.
+static ncclResult_t residentKernelStart(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  comm->residentKernelState = -1;
+#if CUDART_VERSION >= 11070
+  int nChannels = std::max(comm->nChannels, comm->p2pnChannels);
+  uint64_t* doorbells = nullptr;
+  cudaStream_t stream = nullptr;
+  uint64_t mask = nChannels == 64 ? ~uint64_t(0) : (uint64_t(1)<<nChannels)-1;
+  dim3 grid = {(unsigned)nChannels, 1, 1};
+  dim3 block = {NCCL_MAX_NTHREADS, 1, 1};
+  void* args[4] = {&comm->devComm, &mask, &comm->devWorkFifoHeap, &doorbells};
+  if (CUPFN(cuStreamWriteValue64) == nullptr || CUPFN(cuStreamWaitValue64) == nullptr) {
+    INFO(NCCL_INIT, "NCCL_RESIDENT_KERNEL ignored, stream memory operations are not supported");
+    return ncclSuccess;
+  }
+  NCCLCHECKGOTO(ncclCudaCalloc(&doorbells, 2*MAXCHANNELS), ret, fail);
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking), ret, fail);
+  CUDACHECKGOTO(cudaLaunchKernel((void*)ncclResidentKernel, grid, block, args, ncclKernelShmemSize(comm), stream), ret, fail);
+  comm->residentKernelMask = mask;
+  comm->residentKernelDoorbells = doorbells;
+  comm->residentKernelStream = stream;
+  comm->residentKernelState = 1;
+  INFO(NCCL_INIT, "Resident kernel started on %d channels", nChannels);
+  return ncclSuccess;
+fail:
+  if (stream) cudaStreamDestroy(stream);
+  if (doorbells) ncclCudaFree(doorbells);
+#endif
+  return ret;
+}
+
+// Makes launchStream run the plan on the resident kernel : ring the doorbell of
+// each channel of the plan, then wait for all of them to be done.
+static ncclResult_t residentKernelRing(struct ncclComm* comm, struct ncclKernelPlan* plan, cudaStream_t launchStream) {
+#if CUDART_VERSION >= 11070
+  uint64_t seq = ++comm->residentKernelSeq & 0xffffff;
+  uint64_t ix = uint32_t(plan->workHead - comm->devWorkFifoHeap);
+  for (int pass=0; pass < 2; pass++) {
+    int y = 0;
+    for (int c=0; c < MAXCHANNELS; c++) {
+      if (!(plan->channelMask & (1ull<<c))) continue;
+      uint64_t value = seq<<40 | uint64_t(y++)<<32 | ix;
+      if (pass == 0) {
+        CUCHECK(cuStreamWriteValue64(launchStream, (CUdeviceptr)(comm->residentKernelDoorbells+c), value, CU_STREAM_WRITE_VALUE_DEFAULT));
+      } else {
+        CUCHECK(cuStreamWaitValue64(launchStream, (CUdeviceptr)(comm->residentKernelDoorbells+MAXCHANNELS+c), value, CU_STREAM_WAIT_VALUE_EQ));
+      }
+    }
+  }
+#endif
+  return ncclSuccess;
+}
+
+ncclResult_t ncclResidentKernelStop(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  if (comm->residentKernelState != 1) return ncclSuccess;
+  comm->residentKernelState = -1;
+  // Written from a side stream, the resident kernel never finishes on its own.
+  uint64_t stop[MAXCHANNELS];
+  for (int c=0; c < MAXCHANNELS; c++) stop[c] = NCCL_RESIDENT_KERNEL_STOP;
+  NCCLCHECKGOTO(ncclCudaMemcpy(comm->residentKernelDoorbells, stop, MAXCHANNELS), ret, exit);
+  CUDACHECKGOTO(cudaStreamSynchronize(comm->residentKernelStream), ret, exit);
+exit:
+  CUDACHECK(cudaStreamDestroy(comm->residentKernelStream));
+  NCCLCHECK(ncclCudaFree(comm->residentKernelDoorbells));
+  comm->residentKernelDoorbells = nullptr;
+  return ret;
+}
+
 ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan) {
+  NvtxParamsPlan payload = nvtxPlanParams(plan);
+  NVTX3_FUNC_WITH_PARAMS(KernelLaunch, PlanSchema, payload)
   struct ncclTasks* tasks = &comm->tasks;
   void *fn = plan->kernelFn;
   cudaStream_t launchStream = tasks->streams->stream;
   dim3 grid = {(unsigned)plan->channelCount, 1, 1};
   dim3 block = {(unsigned)plan->threadPerBlock, 1, 1};
-  size_t smem = ncclShmemDynamicSize(comm->cudaArch);
-  void *args[3] = {&comm->devComm, &plan->channelMask, &plan->workHead};
+  size_t smem = ncclKernelShmemSize(comm);
+  void *args[4] = {&comm->devComm, &plan->channelMask, &plan->workHead, &plan->inlineWorks};
+  ncclStatsAdd(&comm->statsPlans, 1);
+  struct ncclAutotuneSample* autotuneSample = plan->collOpCount == 1 ? plan->autotuneSample : nullptr;
+  NCCLCHECK(ncclAutotuneRecord(autotuneSample, launchStream, /*end=*/false));
+
+  if (plan->doorbellSlot) NCCLCHECK(graphDoorbellRing(comm, plan, launchStream));
+
+  // Plans captured in graphs keep their own copy of the works and launch normally.
+  if (ncclParamResidentKernel() && !plan->persistent) {
+    if (comm->residentKernelState == 0) NCCLCHECK(residentKernelStart(comm));
+    if (comm->residentKernelState == 1 && plan->workOverflow == nullptr && !plan->workInline &&
+        (plan->channelMask & ~comm->residentKernelMask) == 0) {
+      NCCLCHECK(residentKernelRing(comm, plan, launchStream));
+      NCCLCHECK(ncclAutotuneRecord(autotuneSample, launchStream, /*end=*/true));
+      return ncclSuccess;
+    }
+  }
+
+  NCCLCHECK(lazyInitKernel(comm, plan));
 
   #if CUDART_VERSION >= 11080
   int driverVersion;
@@ -1085,16 +1923,20 @@ ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan
     launchConfig.stream = launchStream;
 
     CUDACHECK(cudaLaunchKernelExC(&launchConfig, fn, args));
+    NCCLCHECK(releaseWorkOverflow(comm, plan, launchStream));
+    NCCLCHECK(ncclAutotuneRecord(autotuneSample, launchStream, /*end=*/true));
     return ncclSuccess;
   }
   #endif
   // Standard kernel launch
   CUDACHECK(cudaLaunchKernel(fn, grid, block, args, smem, launchStream));
+  NCCLCHECK(releaseWorkOverflow(comm, plan, launchStream));
+  NCCLCHECK(ncclAutotuneRecord(autotuneSample, launchStream, /*end=*/true));
   return ncclSuccess;
 }
 
 ncclResult_t ncclLaunchKernelAfter_NoCuda(struct ncclComm* comm, struct ncclKernelPlan* plan) {
-  if (!(plan->persistent || comm->persistentRefs != 0 || ncclCudaLaunchBlocking)) {
+  if (!plan->proxyDeferred) {
     // If this isn't being captured and there aren't any CUDA graphs alive
     // then we don't need to do our proxyOp pushing on the host stream.
     NCCLCHECK(hostStreamPlanTask(comm, plan));
@@ -1116,10 +1958,15 @@ ncclResult_t ncclLaunchFinish(struct ncclComm* comm) {
     // back to us for reclaiming via callbackQueue.
     ncclIntruQueueConstruct(&comm->planQueue);
     cudaStream_t launchStream = tasks->streams->stream; // First user stream gets launch
+    struct ncclStrongStream* deviceStream = tasks->laneHigh ? &comm->sharedRes->deviceStreamHigh : &comm->sharedRes->deviceStream;
+    if (!ncclCudaGraphValid(tasks->capturingGraph) && comm->sharedRes->laneState == 1) {
+      CUDACHECKGOTO(cudaEventRecord(comm->sharedRes->laneEvent[tasks->laneHigh ? 1 : 0], launchStream), result, resume0);
+    }
+  resume0:
     // Create dependency for deviceStream on launchStream. We know that deviceStream
     // hasn't been modified since launchStream waited on it (in ncclLaunchPrepare),
     // so we can say that launchStream subsumes it.
-    NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, &comm->sharedRes->deviceStream, launchStream, /*b_subsumes_a=*/true), result, resume1);
+    NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, deviceStream, launchStream, /*b_subsumes_a=*/true), result, resume1);
   resume1:
     // Create dependency for other user streams (skip launch stream) on deviceStream.
     // Again, the user streams haven't been touched since deviceStream waited on them
@@ -1127,14 +1974,20 @@ ncclResult_t ncclLaunchFinish(struct ncclComm* comm) {
     struct ncclCudaStreamList* sl = tasks->streams->next;
     tasks->streams = nullptr; // Reset comm->tasks.streams to empty.
     while (sl != nullptr) {
-      NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, sl->stream, &comm->sharedRes->deviceStream, /*b_subsumes_a=*/true), result, resume2);
+      NCCLCHECKGOTO(ncclStrongStreamWaitStream(tasks->capturingGraph, sl->stream, deviceStream, /*b_subsumes_a=*/true), result, resume2);
     resume2:
       sl = sl->next;
     }
     // Release device stream as acquired in ncclLaunchPrepare()
-    NCCLCHECKGOTO(ncclStrongStreamRelease(tasks->capturingGraph, &comm->sharedRes->deviceStream), result, resume3);
+    NCCLCHECKGOTO(ncclStrongStreamRelease(tasks->capturingGraph, deviceStream), result, resume3);
   resume3:;
+  } else {
+    // Self copies alone build no plan. The stream list lives in the group frame,
+    // so don't leave it behind for the next group.
+    tasks->streams = nullptr;
   }
+  tasks->streamRecent = nullptr;
+  tasks->capturingGraph = ncclCudaGraphNone();
   return result;
 }
 
@@ -1146,35 +1999,60 @@ static inline ncclResult_t getCollNetSupport(struct ncclInfo* info, int* collNet
   // Translate ncclAvg and PreMulSum
   ncclRedOp_t netOp = info->op == ncclAvg || info->op >= ncclNumOps ? ncclSum : info->op;
   *collNetTypeSupport = info->comm->collNetSupportMatrix[netOp][info->datatype];
+  // The proxy only completes allreduces (NCCL_COLLNET_PROXY_REDUCE)
+  if (info->coll == ncclFuncReduceScatter && netOp == ncclSum && info->comm->collNetProxyReduce[info->datatype]) *collNetTypeSupport = 0;
+  // AllGather does not reduce anything
+  if (info->coll == ncclFuncAllGather) *collNetTypeSupport = info->comm->collNetSupport;
   return ncclSuccess;
 }
 
 // numPipeOps: number of pipelined ops. Can be greater than 1 in aggregation mode. Used to adjust latency.
-static ncclResult_t getAlgoInfo(struct ncclInfo* info, int collNetTypeSupport, int numPipeOps) {
+static ncclResult_t getAlgoInfo(struct ncclInfo* info, int collNetTypeSupport, int numPipeOps, bool autotune) {
   struct ncclComm* comm = info->comm;
+  int ncShift = 0;
+  int tunerChannels = 0;
   if (comm->nRanks == 1) {
     info->algorithm = NCCL_ALGO_RING;
     info->protocol = NCCL_PROTO_SIMPLE;
   }
   else {
     float minTime = 3600000000.0; // Hopefully no operation will take an hour to complete.
+    float times[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
     // Find algorithm / protocol.
     info->algorithm = -1;
     info->protocol = -1;
     int nAlgos = NCCL_NUM_ALGORITHMS;
     for (int a=0; a<nAlgos; a++) {
+      for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) times[a][p] = -1;
       if ((a == NCCL_ALGO_COLLNET_DIRECT || a == NCCL_ALGO_COLLNET_CHAIN) && collNetTypeSupport != 1) continue;
-      if (a == NCCL_ALGO_NVLS && !NCCL_NVLS_SUPPORTS(info->datatype, info->opFull.op)) continue;
+      // AllGather only stores through multicast, so it works for any type
+      if (a == NCCL_ALGO_NVLS && info->coll != ncclFuncAllGather && !NCCL_NVLS_SUPPORTS(info->datatype, info->opFull.op)) continue;
       if (a == NCCL_ALGO_NVLS && collNetTypeSupport != 1 && comm->nNodes > 1) continue;
       if (a == NCCL_ALGO_NVLS_TREE && !NCCL_NVLS_SUPPORTS(info->datatype, info->opFull.op)) continue;
 
       for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
-        float time;
-        NCCLCHECK(ncclTopoGetAlgoTime(info, a, p, numPipeOps, &time));
-        if (time >= 0 && time < minTime) {
+        NCCLCHECK(ncclTopoGetAlgoTime(info, a, p, numPipeOps, &times[a][p]));
+      }
+    }
+    if (comm->tuner) {
+      // Let the tuner plugin adjust the cost table or force a choice.
+      bool available[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+      for (int a=0; a<nAlgos; a++) for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) available[a][p] = times[a][p] >= 0;
+      int algorithm = -1, protocol = -1;
+      NCCLCHECK(comm->tuner->getCollInfo(comm->tunerContext, info->coll, info->nBytes, numPipeOps, times, &algorithm, &protocol, &tunerChannels));
+      for (int a=0; a<nAlgos; a++) for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) if (!available[a][p]) times[a][p] = -1;
+      if (algorithm >= 0 && algorithm < nAlgos && protocol >= 0 && protocol < NCCL_NUM_PROTOCOLS && available[algorithm][protocol]) {
+        info->algorithm = algorithm;
+        info->protocol = protocol;
+        minTime = times[algorithm][protocol];
+      }
+    }
+    for (int a=0; info->algorithm == -1 && a<nAlgos; a++) {
+      for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+        if (times[a][p] >= 0 && times[a][p] < minTime) {
           info->algorithm = a;
           info->protocol = p;
-          minTime = time;
+          minTime = times[a][p];
         }
       }
     }
@@ -1184,9 +2062,11 @@ static ncclResult_t getAlgoInfo(struct ncclInfo* info, int collNetTypeSupport, i
     }
     //if (comm->rank == 0) INFO(NCCL_TUNING, "%ld Bytes -> Algo %d proto %d time %f", info->nBytes, info->algorithm, info->protocol, minTime);
     TRACE(NCCL_COLL, "%ld Bytes -> Algo %d proto %d time %f", info->nBytes, info->algorithm, info->protocol, minTime);
+    if (autotune) NCCLCHECK(ncclAutotuneSelect(info, times, &ncShift, &info->autotuneSample));
   }
 
-  int nc = (info->nChannels > 0) ? info->nChannels : comm->nChannels;
+  int ncMax = (info->nChannels > 0) ? info->nChannels : comm->nChannels;
+  int nc = ncMax;
   int nt = comm->maxThreads[info->algorithm][info->protocol];
   int threadThreshold = comm->threadThresholds[info->algorithm][info->protocol];
   if (info->algorithm == NCCL_ALGO_COLLNET_DIRECT) {
@@ -1210,7 +2090,13 @@ static ncclResult_t getAlgoInfo(struct ncclInfo* info, int collNetTypeSupport, i
       else if ((nt % 128) == 0) nt/=2;
       else break;
     }
+    // Then drop channels costing more than they bring in bandwidth, unless the caller set them
+    if (info->nChannels == 0) NCCLCHECK(ncclTopoTuneChannels(info, info->algorithm, info->protocol, &nc));
   }
+  if (tunerChannels > 0 && (info->algorithm == NCCL_ALGO_RING || info->algorithm == NCCL_ALGO_TREE)) {
+    nc = std::min(tunerChannels, ncMax);
+  }
+  nc = std::max(1, nc >> ncShift);
   if (info->protocol == NCCL_PROTO_SIMPLE) {
     if (info->algorithm == NCCL_ALGO_RING) nt += WARP_SIZE; // Extra warp for sync
     // More threads or sync warps needed due to split thread model
@@ -1232,6 +2118,8 @@ static ncclResult_t getPatternInfo(struct ncclInfo* info) {
     case ncclFuncAllGather:
       info->pattern =
         info->algorithm == NCCL_ALGO_NVLS ? ncclPatternNvls :
+        info->algorithm == NCCL_ALGO_COLLNET_CHAIN ?
+          (info->coll == ncclFuncAllGather ? ncclPatternCollnetAllGather : ncclPatternCollnetReduceScatter) :
         ncclPatternRing; break;
     case ncclFuncAllReduce:
       info->pattern =
@@ -1263,6 +2151,9 @@ static ncclResult_t getLoopInfo(struct ncclInfo* info) {
       info->nstepsPerLoop = 1; info->nchunksPerLoop = info->comm->channels[0].collnetDirect.nHeads; break;
     case ncclPatternRing:
       info->nstepsPerLoop = info->comm->nRanks-1; info->nchunksPerLoop = info->comm->nRanks; break;
+    case ncclPatternCollnetAllGather:
+    case ncclPatternCollnetReduceScatter:
+      info->nstepsPerLoop = info->nchunksPerLoop = info->comm->nRanks; break;
     case ncclPatternRingTwice:
       info->nstepsPerLoop = 2*(info->comm->nRanks-1); info->nchunksPerLoop = info->comm->nRanks; break;
     case ncclPatternNvlsTree:
@@ -1280,7 +2171,7 @@ static ncclResult_t computeColl(struct ncclInfo* info /* input */, int* workFunc
   // If so, skip the calculation
   if (info->nChannels > 0 && info->nThreads > 0) goto comp_next;
   NCCLCHECK(getCollNetSupport(info, &collNetTypeSupport));
-  NCCLCHECK(getAlgoInfo(info, collNetTypeSupport, 1));
+  NCCLCHECK(getAlgoInfo(info, collNetTypeSupport, 1, /*autotune=*/true));
 
 comp_next:
   // Set nstepsPerLoop and nchunksPerLoop
@@ -1295,10 +2186,12 @@ comp_next:
   work->nWarps = info->nThreads / WARP_SIZE;
   work->redOpArg = info->opFull.scalarArg;
   work->redOpArgIsPtr = info->opFull.scalarArgIsPtr;
+  // Small SIMPLE operations use the write path of P2P connections set up in read mode
+  work->p2pWrite = info->protocol == NCCL_PROTO_SIMPLE && info->nBytes < info->comm->p2pWriteThreshold*info->nChannels;
 
   if (info->comm->nRanks == 1) {
     // one-rank reduce index
-    *workFuncIndex = 1 + int(info->datatype);
+    *workFuncIndex = FUNC_INDEX_ONERANK(info->opFull.op, info->datatype);
     return ncclSuccess;
   }
 
@@ -1311,12 +2204,10 @@ comp_next:
 
   // Compute lastChunkSize
   if (info->algorithm == NCCL_ALGO_TREE && info->protocol == NCCL_PROTO_SIMPLE) {
-    if (info->pattern == ncclPatternTreeUpDown) {
-      // Optimize chunkSize / nSteps
-      while (info->nBytes / (info->nChannels*chunkSize) < info->comm->channels[0].tree.depth*8 && chunkSize > 131072) chunkSize /= 2;
-      while (info->nBytes / (info->nChannels*chunkSize) < info->comm->channels[0].tree.depth*4 && chunkSize > 65536) chunkSize /= 2;
-      while (info->nBytes / (info->nChannels*chunkSize) < info->comm->channels[0].tree.depth && chunkSize > 32768) chunkSize /= 2;
-    }
+    // Optimize chunkSize / nSteps, also for the single pass of Broadcast and Reduce
+    while (info->nBytes / (info->nChannels*chunkSize) < info->comm->channels[0].tree.depth*8 && chunkSize > 131072) chunkSize /= 2;
+    while (info->nBytes / (info->nChannels*chunkSize) < info->comm->channels[0].tree.depth*4 && chunkSize > 65536) chunkSize /= 2;
+    while (info->nBytes / (info->nChannels*chunkSize) < info->comm->channels[0].tree.depth && chunkSize > 32768) chunkSize /= 2;
     // Use lastChunkSize as chunkSize
     work->lastChunkSize = chunkSize / ncclTypeSize(info->datatype);
   } else if (info->algorithm == NCCL_ALGO_COLLNET_DIRECT) {
@@ -1380,7 +2271,7 @@ comp_next:
   proxyOp->chunkSize = chunkSize;
   proxyOp->protocol = info->protocol;
   proxyOp->dtype = info->datatype;
-  proxyOp->redOp = info->opFull.op==ncclDevPreMulSum || info->opFull.op==ncclDevSumPostDiv ? ncclSum : // Network sees avg as sum
+  proxyOp->redOp = info->opFull.op==ncclDevPreMulSum || info->opFull.op==ncclDevSumPostDiv || info->opFull.op==ncclDevSumPostOp ? ncclSum : // Network sees avg as sum
                      info->op;
   proxyOp->pattern = info->pattern;
   proxyOp->root = info->root;
@@ -1395,6 +2286,98 @@ comp_next:
   return ncclSuccess;
 }
 
+NCCL_PARAM(CollCache, "COLL_CACHE", 1);
+
+// Result of computeColl() for a collective of a given shape. The algorithm,
+// protocol and chunking only depend on the fields of the key, not on the
+// buffers, so training loops issuing the same collectives every iteration
+// skip the tuning model and only patch buffers and scalar argument.
+struct ncclCollCacheEntry {
+  bool valid;
+  // Key
+  ncclFunc_t coll;
+  ncclDataType_t datatype;
+  ncclRedOp_t op;
+  ncclDevRedOp_t devOp;
+  size_t count;
+  int root;
+  int chunkSteps;
+  int sliceSteps;
+  // Result
+  int workFuncIndex;
+  int algorithm;
+  int protocol;
+  ncclPattern_t pattern;
+  int nChannels;
+  int nThreads;
+  int nstepsPerLoop;
+  int nchunksPerLoop;
+  struct ncclWorkElem work;
+  struct ncclProxyOp proxyOp;
+};
+#define NCCL_COLL_CACHE_ENTRIES 256
+
+static ncclResult_t computeCollCached(struct ncclInfo* info, int* workFuncIndex, struct ncclWorkElem* work, struct ncclProxyOp* proxyOp) {
+  struct ncclComm* comm = info->comm;
+  // Tuner plugins and the autotuner may decide differently from one call to the next,
+  // and the number of channels is only preset by priority lanes, which the key ignores.
+  if (!ncclParamCollCache() || comm->tuner || comm->autotune || info->nChannels != 0) {
+    return computeColl(info, workFuncIndex, work, proxyOp);
+  }
+  if (comm->collCache == nullptr) NCCLCHECK(ncclCalloc(&comm->collCache, NCCL_COLL_CACHE_ENTRIES));
+
+  uint64_t h = info->count*0x9e3779b97f4a7c15ull;
+  h ^= uint64_t(info->coll)<<56 ^ uint64_t(info->datatype)<<48 ^ uint64_t(info->op)<<32 ^ uint32_t(info->root);
+  h ^= h>>31;
+  struct ncclCollCacheEntry* e = comm->collCache + h%NCCL_COLL_CACHE_ENTRIES;
+  if (e->valid && e->coll == info->coll && e->datatype == info->datatype && e->op == info->op &&
+      e->devOp == info->opFull.op && e->count == info->count && e->root == info->root &&
+      e->chunkSteps == info->chunkSteps && e->sliceSteps == info->sliceSteps) {
+    info->algorithm = e->algorithm;
+    info->protocol = e->protocol;
+    info->pattern = e->pattern;
+    info->nChannels = e->nChannels;
+    info->nThreads = e->nThreads;
+    info->nstepsPerLoop = e->nstepsPerLoop;
+    info->nchunksPerLoop = e->nchunksPerLoop;
+    *workFuncIndex = e->workFuncIndex;
+    *work = e->work; // C++ struct assignment
+    work->sendbuff = info->sendbuff;
+    work->recvbuff = info->recvbuff;
+    work->redOpArg = info->opFull.scalarArg;
+    work->redOpArgIsPtr = info->opFull.scalarArgIsPtr;
+    *proxyOp = e->proxyOp;
+    ncclStatsAdd(&comm->statsCollCacheHits, 1);
+    return ncclSuccess;
+  }
+
+  NCCLCHECK(computeColl(info, workFuncIndex, work, proxyOp));
+  e->valid = true;
+  e->coll = info->coll;
+  e->datatype = info->datatype;
+  e->op = info->op;
+  e->devOp = info->opFull.op;
+  e->count = info->count;
+  e->root = info->root;
+  e->chunkSteps = info->chunkSteps;
+  e->sliceSteps = info->sliceSteps;
+  e->workFuncIndex = *workFuncIndex;
+  e->algorithm = info->algorithm;
+  e->protocol = info->protocol;
+  e->pattern = info->pattern;
+  e->nChannels = info->nChannels;
+  e->nThreads = info->nThreads;
+  e->nstepsPerLoop = info->nstepsPerLoop;
+  e->nchunksPerLoop = info->nchunksPerLoop;
+  e->work = *work;
+  e->proxyOp = *proxyOp;
+  return ncclSuccess;
+}
+
+// Round bfloat16 sums stochastically rather than to nearest, so that the rounding
+// errors of the nRanks-1 reduction steps cancel out instead of accumulating.
+NCCL_PARAM(Bf16StochasticRound, "BF16_STOCHASTIC_ROUND", 0);
+
 static ncclResult_t hostToDevRedOp(
     ncclDevRedOpFull *opFull, ncclRedOp_t op, ncclDataType_t datatype, ncclComm *comm
   ) {
@@ -1416,7 +2399,15 @@ static ncclResult_t hostToDevRedOp(
   u64 = 0;
   opFull->scalarArgIsPtr = false;
   switch (int(op)) {
-  case ncclSum:  opFull->op = ncclDevSum;  break;
+  case ncclSum:
+    opFull->op = ncclDevSum;
+    // The device FuncSum<bfloat16> takes a non zero seed as the request for
+    // stochastic rounding. Vary it across ranks and operations.
+    opFull->scalarArg = 0;
+    if (datatype == ncclBfloat16 && ncclParamBf16StochasticRound()) {
+      opFull->scalarArg = uint32_t(comm->rank*0x9e3779b9u + comm->opCount*0x85ebca6bu) | 1;
+    }
+    break;
   case ncclProd: opFull->op = ncclDevProd; break;
   case ncclMax:  opFull->op = ncclDevMax;  break;
   case ncclMin:  opFull->op = ncclDevMin;  break;
@@ -1437,6 +2428,24 @@ static ncclResult_t hostToDevRedOp(
       bf16 = __float2bfloat16(float(1.0/comm->nRanks));
       break;
     #endif
+    #if defined(__CUDA_FP8_TYPES_EXIST__)
+    // Scaling the inputs keeps the sum in range. The fp8 scalar is only exact when
+    // nRanks is a power of two, and underflows to zero past 1/512 in e4m3, so other
+    // counts divide the sum instead, in float (see FuncSumPostOp).
+    case ncclFloat8e4m3:
+    case ncclFloat8e5m2:
+      u8 = __nv_cvt_float_to_fp8(float(1.0/comm->nRanks), __NV_SATFINITE, datatype == ncclFloat8e4m3 ? __NV_E4M3 : __NV_E5M2);
+      if ((comm->nRanks & (comm->nRanks-1)) == 0 && (u8 & 0x7f) != 0) {
+        opFull->op = ncclDevPreMulSum;
+      } else {
+        float scale = float(1.0/comm->nRanks);
+        uint32_t scaleBits;
+        std::memcpy(&scaleBits, &scale, sizeof(scaleBits));
+        opFull->op = ncclDevSumPostOp;
+        u64 = uint64_t(ncclPostOpNone)<<32 | scaleBits;
+      }
+      break;
+    #endif
     case ncclFloat32:
       opFull->op = ncclDevPreMulSum;
       f32 = float(1.0/comm->nRanks);
@@ -1463,6 +2472,39 @@ static ncclResult_t hostToDevRedOp(
   return ncclSuccess;
 }
 
+// Only connect the p2p channels an operation actually uses rather than all p2pnChannelsPerPeer
+// channels on first contact with a peer.
+NCCL_PARAM(P2pLazyConnect, "P2P_LAZY_CONNECT", 0);
+
+ncclResult_t ncclP2pMarkConnect(struct ncclComm* comm, int peer, bool isSendNotRecv, ssize_t nBytes, bool* needConnect) {
+  struct ncclTasks* tasks = &comm->tasks;
+  int channelBaseId;
+  *needConnect = false;
+  NCCLCHECK(ncclChannelComputeBase(comm, peer, isSendNotRecv ? ncclFuncSend : ncclFuncRecv, &channelBaseId));
+  // In lazy mode, later operations of the group may need more channels than the first one.
+  bool lazy = ncclParamP2pLazyConnect();
+  if (lazy || !(isSendNotRecv ? tasks->peers[peer].sendSeen : tasks->peers[peer].recvSeen)) {
+    (isSendNotRecv ? tasks->peers[peer].sendSeen : tasks->peers[peer].recvSeen) = true;
+    int nChannels = lazy ? p2pChannelsUsed(comm, nBytes) : comm->p2pnChannelsPerPeer;
+    for (int c=0; c < nChannels; c++) {
+      int channelId;
+      NCCLCHECK(ncclChannelComputeFromBase(comm, channelBaseId, c, &channelId));
+      if (isSendNotRecv) {
+        if (comm->channels[channelId].peers[peer]->send[1].connected == 0) { // P2P uses only 1 connector
+          comm->connectSend[peer] |= (1UL<<channelId);
+          *needConnect = tasks->laneSync = true;
+        }
+      } else {
+        if (comm->channels[channelId].peers[peer]->recv[1].connected == 0) { // P2P uses only 1 connector
+          comm->connectRecv[peer] |= (1UL<<channelId);
+          *needConnect = tasks->laneSync = true;
+        }
+      }
+    }
+  }
+  return ncclSuccess;
+}
+
 // Converts `info` to a task and adds it to `comm->tasks`. The exception is with
 // single rank communicators, collectives are issued as `ncclMemcpyAsync`s and
 // thus don't need a task.
@@ -1486,32 +2528,17 @@ static ncclResult_t taskAppend(struct ncclComm* comm, struct ncclInfo const* inf
 
     // Mark channels that need pre-connect
     if (comm->rank != peer) {
-      int channelBaseId;
-      NCCLCHECK(ncclChannelComputeBase(comm, peer, info->coll, &channelBaseId));
-      if (!(isSendNotRecv ? tasks->peers[peer].sendSeen : tasks->peers[peer].recvSeen)) {
-        (isSendNotRecv ? tasks->peers[peer].sendSeen : tasks->peers[peer].recvSeen) = true;
-        for (int c=0; c < comm->p2pnChannelsPerPeer; c++) {
-          int channelId;
-          NCCLCHECK(ncclChannelComputeFromBase(comm, channelBaseId, c, &channelId));
-          if (isSendNotRecv) {
-            if (comm->channels[channelId].peers[peer]->send[1].connected == 0) { // P2P uses only 1 connector
-              comm->connectSend[peer] |= (1UL<<channelId);
-              ncclGroupCommPreconnect(comm);
-            }
-          } else {
-            if (comm->channels[channelId].peers[peer]->recv[1].connected == 0) { // P2P uses only 1 connector
-              comm->connectRecv[peer] |= (1UL<<channelId);
-              ncclGroupCommPreconnect(comm);
-            }
-          }
-        }
-      }
+      bool needConnect;
+      NCCLCHECK(ncclP2pMarkConnect(comm, peer, isSendNotRecv, nBytes, &needConnect));
+      if (needConnect) ncclGroupCommPreconnect(comm);
     }
   } else {
     // Copy reduction op state from op handle into info struct here since the
     // op handle may be destroyed before ncclGroupEnd().
     struct ncclDevRedOpFull opFull;
     NCCLCHECK(hostToDevRedOp(&opFull, info->op, info->datatype, comm));
+    // Slim builds run these through FuncGeneric, which finds the op in the top byte
+    if (NCCL_SLIM_GENERIC_REDOP(int(info->datatype), int(opFull.op))) opFull.scalarArg |= uint64_t(opFull.op)<<56;
 
     // User-defined reduction ops may need alter the data even for unitary reductions
     if (comm->nRanks == 1 && opFull.op < ncclDevPreMulSum) {
@@ -1536,6 +2563,7 @@ static ncclResult_t taskAppend(struct ncclComm* comm, struct ncclInfo const* inf
       ncclIntruQueueEnqueue(&tasks->collQueue, t);
       tasks->collBytesTotal += info->nBytes;
       tasks->nTasksColl += 1;
+      if (comm->runtimeConnect && !comm->collConnected) ncclGroupCommPreconnect(comm);
     }
   }
 
@@ -1566,10 +2594,599 @@ static ncclResult_t taskAppend(struct ncclComm* comm, struct ncclInfo const* inf
   return ncclSuccess;
 }
 
+// Collectives given an op from ncclRedOpCreateWireSum run on a copy of the data
+// converted to the wire type. The conversions are issued on the user stream
+// around the collective, so this requires the collective to be launched before
+// ncclEnqueueCheck returns: outside of groups and on blocking communicators, where
+// such ops are rejected. Mixed precision collectives take the same path, with the
+// collective's datatype as the wire type.
+static ncclResult_t wireTypeOf(struct ncclInfo* info, ncclDataType_t* wireType) {
+  struct ncclComm* comm = info->comm;
+  *wireType = ncclNumTypes;
+  if (info->mixed) {
+    *wireType = info->datatype;
+    return ncclSuccess;
+  }
+  if (info->coll != ncclFuncAllReduce && info->coll != ncclFuncReduceScatter) return ncclSuccess;
+  if (int(info->op) < int(ncclNumOps) || comm->nRanks == 1) return ncclSuccess;
+  int ix = int(ncclUserRedOpMangle(comm, info->op)) - int(ncclNumOps);
+  if (comm->userRedOps[ix].wireType == ncclNumTypes) return ncclSuccess;
+  if (ncclGroupDepth != 1 || !comm->config.blocking) {
+    WARN("%s : reductions with a wire type cannot be called within a group or on a non-blocking communicator", info->opName);
+    return ncclInvalidUsage;
+  }
+  *wireType = comm->userRedOps[ix].wireType;
+  return ncclSuccess;
+}
+
+// Scratch buffer of a captured operation, freed with the graph
+struct ncclGraphScratch {
+  struct ncclCommCallback reclaimer;
+  void* buff;
+};
+
+static ncclResult_t graphScratchFree(struct ncclComm* comm, struct ncclCommCallback* cb) {
+  struct ncclGraphScratch* scratch = (struct ncclGraphScratch*)cb;
+  NCCLCHECK(ncclCudaFree(scratch->buff));
+  free(scratch);
+  return ncclSuccess;
+}
+
+struct ncclGraphScratchOwner {
+  struct ncclComm* comm;
+  struct ncclGraphScratch* scratch;
+};
+
+static void graphScratchDestructor(void* arg) {
+  struct ncclGraphScratchOwner* owner = (struct ncclGraphScratchOwner*)arg;
+  // No CUDA calls from here, the buffer is freed by the next callback poll
+  ncclIntruQueueMpscEnqueue(&owner->comm->callbackQueue, &owner->scratch->reclaimer);
+  free(owner);
+}
+
+ncclResult_t ncclScratchPrepare(struct ncclInfo* info, struct ncclScratchBuff* scratch, size_t bytes, void** buff) {
+  struct ncclComm* comm = info->comm;
+  struct ncclCudaGraph graph;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, info->stream));
+  if (ncclCudaGraphValid(graph)) {
+    // Replays may run concurrently with eager operations and outlive any regrowth of
+    // the scratch buffer, so each captured operation gets a buffer of its own
+    struct ncclGraphScratch* graphScratch;
+    struct ncclGraphScratchOwner* owner;
+    NCCLCHECK(ncclCalloc(&graphScratch, 1));
+    graphScratch->reclaimer.fn = graphScratchFree;
+    ncclResult_t ret = ncclSuccess;
+    NCCLCHECKGOTO(ncclCudaCalloc((char**)&graphScratch->buff, bytes), ret, fail);
+    NCCLCHECKGOTO(ncclCalloc(&owner, 1), ret, fail);
+    owner->comm = comm;
+    owner->scratch = graphScratch;
+    NCCLCHECKGOTO(ncclCudaGraphAddDestructor(graph, graphScratchDestructor, owner), ret, fail_owner);
+    *buff = graphScratch->buff;
+    return ncclSuccess;
+fail_owner:
+    free(owner);
+fail:
+    if (graphScratch->buff) ncclCudaFree(graphScratch->buff);
+    free(graphScratch);
+    return ret;
+  }
+  if (scratch->event == NULL) {
+    CUDACHECK(cudaEventCreateWithFlags(&scratch->event, cudaEventDisableTiming));
+  } else if (info->stream != scratch->stream) {
+    // Do not overwrite the buffer before the previous operation on another stream is done with it
+    CUDACHECK(cudaStreamWaitEvent(info->stream, scratch->event, 0));
+  }
+  if (scratch->size < bytes) {
+    // cudaFree waits for earlier operations still using the buffer; captured ones never do
+    if (scratch->buff) NCCLCHECK(ncclCudaFree(scratch->buff));
+    scratch->buff = NULL;
+    scratch->size = 0;
+    NCCLCHECK(ncclCudaCalloc((char**)&scratch->buff, bytes));
+    scratch->size = bytes;
+  }
+  *buff = scratch->buff;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclScratchRelease(struct ncclScratchBuff* scratch, cudaStream_t stream, void* buff) {
+  if (buff != scratch->buff) return ncclSuccess;
+  CUDACHECK(cudaEventRecord(scratch->event, stream));
+  scratch->stream = stream;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclScratchFree(struct ncclScratchBuff* scratch) {
+  if (scratch->buff) NCCLCHECK(ncclCudaFree(scratch->buff));
+  if (scratch->event) CUDACHECK(cudaEventDestroy(scratch->event));
+  memset(scratch, 0, sizeof(*scratch));
+  return ncclSuccess;
+}
+
+// User buffers read or written by a captured operation outside of the works of a plan:
+// wire casts, one/two-shot kernels, deterministic reductions and sparse scatter-adds
+// are kernel nodes of their own, so ncclCommGraphUpdateBuffer must refuse to move them.
+struct ncclGraphUserBuff {
+  struct ncclCommCallback reclaimer;
+  struct ncclGraphUserBuff* next;
+  uintptr_t base[2];
+  size_t size[2];
+};
+
+static ncclResult_t graphUserBuffFree(struct ncclComm* comm, struct ncclCommCallback* cb) {
+  struct ncclGraphUserBuff* ub = (struct ncclGraphUserBuff*)cb;
+  for (struct ncclGraphUserBuff** p = &comm->graphUserBuffs; *p != nullptr; p = &(*p)->next) {
+    if (*p == ub) { *p = ub->next; break; }
+  }
+  free(ub);
+  return ncclSuccess;
+}
+
+struct ncclGraphUserBuffOwner {
+  struct ncclComm* comm;
+  struct ncclGraphUserBuff* ub;
+};
+
+static void graphUserBuffDestructor(void* arg) {
+  struct ncclGraphUserBuffOwner* owner = (struct ncclGraphUserBuffOwner*)arg;
+  ncclIntruQueueMpscEnqueue(&owner->comm->callbackQueue, &owner->ub->reclaimer);
+  free(owner);
+}
+
+ncclResult_t ncclGraphUserBuffRecord(struct ncclComm* comm, cudaStream_t stream, const void* buff0, size_t size0, const void* buff1, size_t size1) {
+  struct ncclCudaGraph graph;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+  if (!ncclCudaGraphValid(graph)) return ncclSuccess;
+  struct ncclGraphUserBuff* ub;
+  struct ncclGraphUserBuffOwner* owner;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclCalloc(&ub, 1));
+  ub->reclaimer.fn = graphUserBuffFree;
+  ub->base[0] = (uintptr_t)buff0;
+  ub->size[0] = buff0 ? size0 : 0;
+  ub->base[1] = (uintptr_t)buff1;
+  ub->size[1] = buff1 ? size1 : 0;
+  NCCLCHECKGOTO(ncclCalloc(&owner, 1), ret, fail);
+  owner->comm = comm;
+  owner->ub = ub;
+  NCCLCHECKGOTO(ncclCudaGraphAddDestructor(graph, graphUserBuffDestructor, owner), ret, fail_owner);
+  ub->next = comm->graphUserBuffs;
+  comm->graphUserBuffs = ub;
+  return ncclSuccess;
+fail_owner:
+  free(owner);
+fail:
+  free(ub);
+  return ret;
+}
+
+static ncclResult_t wirePrepare(struct ncclInfo* info, ncclDataType_t wireType, struct ncclInfo* wireInfo, void** scratch) {
+  struct ncclComm* comm = info->comm;
+  ncclDataType_t sendType = info->mixed ? info->sendType : info->datatype;
+  ncclDataType_t recvType = info->mixed ? info->recvType : info->datatype;
+  size_t sendCount = info->coll == ncclFuncReduceScatter ? info->count*comm->nRanks : info->count;
+  size_t wireSize = ncclTypeSize(wireType);
+
+  *scratch = NULL;
+  *wireInfo = *info; // C++ struct assignment
+  wireInfo->datatype = wireType;
+  if (!info->mixed) wireInfo->op = ncclSum;
+  wireInfo->mixed = false;
+  const char* send = (const char*)info->sendbuff;
+  const char* recv = (const char*)info->recvbuff;
+  bool overlap = send < recv + sendCount*wireSize && recv < send + sendCount*ncclTypeSize(sendType);
+  // Record before the casts are captured, so that a failure leaves no unchecked cast behind
+  if (sendType != wireType || recvType != wireType) {
+    NCCLCHECK(ncclGraphUserBuffRecord(comm, info->stream, info->sendbuff, sendCount*ncclTypeSize(sendType), info->recvbuff, info->count*ncclTypeSize(recvType)));
+  }
+  if (sendType != wireType && recvType == wireType && info->coll == ncclFuncAllReduce && !overlap) {
+    // Convert straight into the output and reduce it in place
+    NCCLCHECK(ncclWireCast(info->sendbuff, sendType, info->recvbuff, wireType, sendCount, info->stream));
+    wireInfo->sendbuff = info->recvbuff;
+  } else if (sendType != wireType) {
+    NCCLCHECK(ncclScratchPrepare(info, &comm->wireBuff, sendCount*wireSize, scratch));
+    NCCLCHECK(ncclWireCast(info->sendbuff, sendType, *scratch, wireType, sendCount, info->stream));
+    wireInfo->sendbuff = *scratch;
+    // In place; for ReduceScatter, our slice of the input
+    if (recvType != wireType) {
+      wireInfo->recvbuff = (char*)*scratch + (info->coll == ncclFuncReduceScatter ? comm->rank*info->count*wireSize : 0);
+    }
+  } else if (recvType != wireType) {
+    NCCLCHECK(ncclScratchPrepare(info, &comm->wireBuff, info->count*wireSize, scratch));
+    wireInfo->recvbuff = *scratch;
+  }
+  NCCLCHECK(ncclInfoSetDerived(wireInfo, comm->nRanks));
+  return ncclSuccess;
+}
+
+static ncclResult_t wireFinish(struct ncclInfo* info, struct ncclInfo* wireInfo, void* scratch) {
+  struct ncclComm* comm = info->comm;
+  ncclDataType_t recvType = info->mixed ? info->recvType : info->datatype;
+  if (recvType != wireInfo->datatype) {
+    NCCLCHECK(ncclWireCast(wireInfo->recvbuff, wireInfo->datatype, info->recvbuff, recvType, info->count, info->stream));
+  }
+  if (scratch) NCCLCHECK(ncclScratchRelease(&comm->wireBuff, info->stream, scratch));
+  return ncclSuccess;
+}
+
+// The conversions are issued around the collective, which must therefore be launched
+// before ncclEnqueueCheck returns.
+static ncclResult_t mixedCheck(struct ncclInfo* info) {
+  if (!ncclWireCastSupported(info->sendType, info->datatype) || !ncclWireCastSupported(info->datatype, info->recvType)) {
+    WARN("%s : unsupported types %d in, %d out, %d on the wire", info->opName, info->sendType, info->recvType, info->datatype);
+    return ncclInvalidArgument;
+  }
+  if (ncclGroupDepth != 1 || !info->comm->config.blocking) {
+    WARN("%s : mixed precision collectives cannot be called within a group or on a non-blocking communicator", info->opName);
+    return ncclInvalidUsage;
+  }
+  return ncclSuccess;
+}
+
+NCCL_PARAM(Deterministic, "DETERMINISTIC", 0);
+
+// With NCCL_DETERMINISTIC=1, floating point AllReduce and ReduceScatter with sum, prod
+// and avg give the same bits whatever the algorithm, protocol and number of channels.
+// Each rank receives its block from every rank (an all-to-all), reduces them in
+// rank order, and AllReduce gathers the reduced blocks back. That moves as much data
+// as a ring AllReduce. The steps must be ordered on the stream, so this is only done
+// outside of groups and on communicators blocking on all ranks; other calls fail rather
+// than silently giving up determinism.
+static ncclResult_t determEligible(struct ncclInfo* info, bool* determ) {
+  struct ncclComm* comm = info->comm;
+  *determ = false;
+  if (!ncclParamDeterministic() || comm->nRanks == 1 || info->mixed) return ncclSuccess;
+  if (info->coll != ncclFuncAllReduce && info->coll != ncclFuncReduceScatter) return ncclSuccess;
+  if (info->op != ncclSum && info->op != ncclProd && info->op != ncclAvg) return ncclSuccess;
+  if (!ncclDetermTypeSupported(info->datatype)) return ncclSuccess;
+  if (ncclGroupDepth != 1 || !comm->allBlocking) {
+    WARN("%s : NCCL_DETERMINISTIC reductions cannot be called within a group or on a non-blocking communicator", info->opName);
+    return ncclInvalidUsage;
+  }
+  *determ = true;
+  return ncclSuccess;
+}
+
+// AllReduce blocks are count/nRanks elements, the last rank also owns the remainder.
+static void determBlock(struct ncclInfo* info, int rank, size_t* offset, size_t* count) {
+  int nRanks = info->comm->nRanks;
+  if (info->coll == ncclFuncReduceScatter) {
+    *offset = rank*info->count;
+    *count = info->count;
+  } else {
+    size_t q = info->count/nRanks;
+    *offset = rank*q;
+    *count = rank == nRanks-1 ? info->count - (nRanks-1)*q : q;
+  }
+}
+
+// Enqueues the all-to-all of the blocks within the current group
+static ncclResult_t determPrepare(struct ncclInfo* info, void** scratch) {
+  struct ncclComm* comm = info->comm;
+  size_t esize = ncclTypeSize(info->datatype);
+  size_t myOffset, myCount;
+  determBlock(info, comm->rank, &myOffset, &myCount);
+  // The reduction into recvbuff is a kernel of its own, see determFinish
+  NCCLCHECK(ncclGraphUserBuffRecord(comm, info->stream, info->recvbuff, (info->coll == ncclFuncAllReduce ? info->count : myCount)*esize, NULL, 0));
+  NCCLCHECK(ncclScratchPrepare(info, &comm->determBuff, comm->nRanks*myCount*esize, scratch));
+  for (int r=0; r<comm->nRanks; r++) {
+    size_t offset, count;
+    determBlock(info, r, &offset, &count);
+    if (count) {
+      struct ncclInfo send = { ncclFuncSend, info->opName,
+        NULL, (char*)info->sendbuff + offset*esize, count, info->datatype, ncclSum, r, comm, info->stream, /* Args */
+        1, 1 };
+      NCCLCHECK(ncclEnqueueCheck(&send));
+    }
+    if (myCount) {
+      struct ncclInfo recv = { ncclFuncRecv, info->opName,
+        NULL, (char*)*scratch + r*myCount*esize, myCount, info->datatype, ncclSum, r, comm, info->stream, /* Args */
+        1, 1 };
+      NCCLCHECK(ncclEnqueueCheck(&recv));
+    }
+  }
+  return ncclSuccess;
+}
+
+// Once the blocks have landed: reduce ours and, for AllReduce, gather all of them
+static ncclResult_t determFinish(struct ncclInfo* info, void* scratch) {
+  struct ncclComm* comm = info->comm;
+  size_t esize = ncclTypeSize(info->datatype);
+  size_t myOffset, myCount;
+  determBlock(info, comm->rank, &myOffset, &myCount);
+  char* dst = (char*)info->recvbuff + (info->coll == ncclFuncAllReduce ? myOffset*esize : 0);
+  NCCLCHECK(ncclDetermReduce(scratch, myCount, comm->nRanks, dst, myCount, info->datatype, info->op, info->stream));
+  NCCLCHECK(ncclScratchRelease(&comm->determBuff, info->stream, scratch));
+  if (info->coll == ncclFuncAllReduce) {
+    size_t q = info->count/comm->nRanks, tail = info->count - comm->nRanks*q;
+    if (q) NCCLCHECK(ncclAllGather(dst, info->recvbuff, q, info->datatype, comm, info->stream));
+    if (tail) {
+      char* tailBuff = (char*)info->recvbuff + comm->nRanks*q*esize;
+      NCCLCHECK(ncclBroadcast(tailBuff, tailBuff, tail, info->datatype, comm->nRanks-1, comm, info->stream));
+    }
+  }
+  return ncclSuccess;
+}
+
+NCCL_PARAM(ConcurrentEnqueue, "CONCURRENT_ENQUEUE", 0);
+
+static __thread bool ncclSubmitDraining = false;
+
+// Launches the submitted tasks one by one, in queue order, and wakes their threads.
+// They are never fused into a group: which tasks are queued together depends on
+// local timing, so fusing them would make ranks build different plans, and would
+// add dependencies between the streams of unrelated threads.
+static void submitLaunch(struct ncclSubmitTask* head) {
+  ncclSubmitDraining = true;
+  while (head != nullptr) {
+    struct ncclSubmitTask* next = head->next; // head is gone once done is set
+    head->result = ncclEnqueueCheck(&head->info);
+    __atomic_store_n(&head->done, 1, __ATOMIC_RELEASE);
+    head = next;
+  }
+  ncclSubmitDraining = false;
+}
+
+// Takes the launcher role if it is free and launches until the queue is empty.
+static bool submitTryDrain(struct ncclComm* comm) {
+  int idle = 0;
+  if (!__atomic_compare_exchange_n(&comm->submitDraining, &idle, 1, /*weak=*/false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+  struct ncclSubmitTask* head;
+  while ((head = ncclIntruQueueMpscDequeueAll(&comm->submitQueue, /*waitSome=*/false)) != nullptr) {
+    submitLaunch(head);
+  }
+  __atomic_store_n(&comm->submitDraining, 0, __ATOMIC_RELEASE);
+  return true;
+}
+
+// With NCCL_CONCURRENT_ENQUEUE, threads calling collectives on the same comm
+// outside of groups push them on a lock-free queue. Whichever thread wins the
+// launcher role launches everything queued so far, each collective on its own,
+// while the others wait for their collective to be launched, which keeps stream
+// semantics. Ops to be fused must be grouped explicitly with ncclGroupStart/End.
+static ncclResult_t submitConcurrent(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  struct ncclSubmitTask task;
+  task.info = *info;
+  task.result = ncclSuccess;
+  task.done = 0;
+  ncclIntruQueueMpscEnqueue(&comm->submitQueue, &task);
+  int spins = 0;
+  while (!__atomic_load_n(&task.done, __ATOMIC_ACQUIRE)) {
+    if (!submitTryDrain(comm) && ++spins == 1024) {
+      spins = 0;
+      sched_yield();
+    }
+  }
+  return task.result;
+}
+
+ncclResult_t ncclSubmitFlush(struct ncclComm* comm) {
+  if (ncclSubmitDraining) return ncclSuccess;
+  while (!ncclIntruQueueMpscEmpty(&comm->submitQueue) || __atomic_load_n(&comm->submitDraining, __ATOMIC_ACQUIRE)) {
+    if (!submitTryDrain(comm)) sched_yield();
+  }
+  return ncclSuccess;
+}
+
+NCCL_PARAM(CoalesceBytes, "COALESCE_BYTES", 0);
+NCCL_PARAM(CoalesceMaxOps, "COALESCE_MAX_OPS", 128);
+
+ncclResult_t ncclCoalesceFlush(struct ncclComm* comm) {
+  int n = comm->coalesceCount;
+  if (n == 0) return ncclSuccess;
+  comm->coalesceCount = 0;
+  comm->coalesceBytes = 0;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  for (int i=0; i < n; i++) {
+    NCCLCHECKGOTO(ncclEnqueueCheck(&comm->coalesceInfos[i]), ret, exit);
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+// With NCCL_COALESCE_BYTES, ungrouped collectives up to that size are held
+// back on the comm and launched together as one group, which packs them into
+// a single plan. The batch is flushed when it reaches NCCL_COALESCE_BYTES or
+// NCCL_COALESCE_MAX_OPS, on any other operation on the comm, or by ncclCommFlush().
+// Only these triggers, which are the same on all ranks, are used, so that all
+// ranks build the same batches. Held collectives are not on the stream yet, so
+// they are only held on streams which are not capturing.
+// Returns whether info was held back.
+static ncclResult_t coalesceAppend(struct ncclInfo* info, bool* held) {
+  struct ncclComm* comm = info->comm;
+  size_t limit = ncclParamCoalesceBytes();
+  *held = false;
+  if (limit == 0 || comm == nullptr) return ncclSuccess;
+
+  bool eligible = ncclGroupDepth == 0 && !ncclSubmitDraining && comm->config.blocking &&
+    info->coll != ncclFuncSend && info->coll != ncclFuncRecv && !info->mixed &&
+    info->datatype >= 0 && info->datatype < ncclNumTypes && int(info->op) < int(ncclNumOps) &&
+    (comm->coalesceCount == 0 || comm->coalesceInfos[0].stream == info->stream);
+  if (eligible) {
+    cudaStreamCaptureStatus status;
+    CUDACHECK(cudaStreamIsCapturing(info->stream, &status));
+    eligible = status == cudaStreamCaptureStatusNone;
+  }
+  size_t nBytes = eligible ? info->count*ncclTypeSize(info->datatype) : 0;
+  if (info->coll == ncclFuncAllGather || info->coll == ncclFuncReduceScatter) nBytes *= comm->nRanks;
+  if (!eligible || comm->coalesceBytes + nBytes > limit) {
+    NCCLCHECK(ncclCoalesceFlush(comm));
+    if (!eligible || nBytes > limit) return ncclSuccess;
+  }
+
+  int maxOps = std::max(1, (int)ncclParamCoalesceMaxOps());
+  if (comm->coalesceInfos == nullptr) NCCLCHECK(ncclCalloc(&comm->coalesceInfos, maxOps));
+  comm->coalesceInfos[comm->coalesceCount++] = *info;
+  comm->coalesceBytes += nBytes;
+  *held = true;
+  if (comm->coalesceCount == maxOps) NCCLCHECK(ncclCoalesceFlush(comm));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommFlush, ncclComm_t comm);
+ncclResult_t ncclCommFlush(ncclComm_t comm) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "CommFlush", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  return ncclCoalesceFlush(comm);
+}
+
+struct graphBufferUpdate {
+  uintptr_t oldBase, newBase;
+  size_t size;
+  bool apply; // false: only check that the update is possible
+  int nPatched;
+};
+
+template <typename T>
+static bool graphPatchPtr(T* ptr, struct graphBufferUpdate* up) {
+  uintptr_t addr = (uintptr_t)*ptr;
+  if (addr < up->oldBase || addr - up->oldBase >= up->size) return false;
+  if (up->apply) *ptr = (T)(addr - up->oldBase + up->newBase);
+  up->nPatched++;
+  return true;
+}
+
+static ncclResult_t graphPatchWork(struct ncclWork* work, struct graphBufferUpdate* up) {
+  if (work->header.type == ncclWorkTypeP2p) {
+    for (int e=0; e<NCCL_MAX_WORK_ELEMENTS_P2P; e++) {
+      struct ncclWorkElemP2p* elem = work->p2pElems+e;
+      if (elem->p2pType == ncclWorkP2pTypeUnused) continue;
+      uint64_t buff = ((uint64_t)elem->buffHi32<<32) | elem->buffLo32;
+      if (!graphPatchPtr(&buff, up)) continue;
+      if (elem->netReg || elem->p2pReg) {
+        WARN("CommGraphUpdateBuffer : %p is used through a buffer registration, recapture instead", (void*)up->oldBase);
+        return ncclInvalidUsage;
+      }
+      elem->buffHi32 = buff>>32;
+      elem->buffLo32 = buff & 0xffffffff;
+    }
+    return ncclSuccess;
+  }
+  bool reg = work->header.type == ncclWorkTypeRegColl;
+  int nElems = reg ? NCCL_MAX_WORK_ELEMENTS_REG : NCCL_MAX_WORK_ELEMENTS;
+  for (int e=0; e<nElems; e++) {
+    struct ncclWorkElem* elem = reg ? &work->regElems[e].elem : work->elems+e;
+    if (!elem->isUsed) break;
+    bool hit = graphPatchPtr(&elem->sendbuff, up);
+    hit |= graphPatchPtr(&elem->recvbuff, up);
+    if (elem->redOpArgIsPtr) hit |= graphPatchPtr(&elem->redOpArg, up);
+    if (hit && (reg || elem->regUsed)) {
+      WARN("CommGraphUpdateBuffer : %p is used through a buffer registration, recapture instead", (void*)up->oldBase);
+      return ncclInvalidUsage;
+    }
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t graphPatchPlan(struct ncclKernelPlan* plan, struct graphBufferUpdate* up) {
+  ncclResult_t ret = ncclSuccess;
+  int nPatched = up->nPatched;
+  if (plan->workInline) {
+    // Already copied into the kernel node arguments, only check
+    struct ncclWork work;
+    bool apply = up->apply;
+    up->apply = false;
+    for (int y=0; y<plan->channelCount && ret == ncclSuccess; y++) {
+      memcpy(&work, plan->inlineWorks.data[y], sizeof(struct ncclWork));
+      ret = graphPatchWork(&work, up);
+    }
+    up->apply = apply;
+    NCCLCHECK(ret);
+    if (up->nPatched != nPatched) {
+      WARN("CommGraphUpdateBuffer : %p is used by works passed as kernel arguments, capture with NCCL_GRAPH_BUFFER_UPDATE=1", (void*)up->oldBase);
+      return ncclInvalidUsage;
+    }
+  } else if (plan->workHead) {
+    int nWork = planWorkCount(plan);
+    struct ncclWork* works;
+    NCCLCHECK(ncclCalloc(&works, nWork));
+    NCCLCHECKGOTO(ncclCudaMemcpy(works, plan->workHead, nWork), ret, exit);
+    for (int w=0; w<nWork; w++) NCCLCHECKGOTO(graphPatchWork(works+w, up), ret, exit);
+    if (up->apply && up->nPatched != nPatched) NCCLCHECKGOTO(ncclCudaMemcpy(plan->workHead, works, nWork), ret, exit);
+  exit:
+    free(works);
+    NCCLCHECK(ret);
+  }
+  // Proxy ops are reposted from the plan at every graph launch
+  for (int c=0; c<plan->channelUbound; c++) {
+    for (struct ncclProxyOp* q = ncclIntruQueueHead(&plan->channels[c].proxyOpQueue); q != nullptr; q = q->enqNext) {
+      if (q->buffer == nullptr) continue;
+      if (graphPatchPtr(&q->buffer, up) && q->reg) {
+        WARN("CommGraphUpdateBuffer : %p is used through a buffer registration, recapture instead", (void*)up->oldBase);
+        return ncclInvalidUsage;
+      }
+    }
+  }
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommGraphUpdateBuffer, ncclComm_t comm, const void* oldBuff, void* newBuff, size_t size);
+ncclResult_t ncclCommGraphUpdateBuffer(ncclComm_t comm, const void* oldBuff, void* newBuff, size_t size) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "CommGraphUpdateBuffer", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (oldBuff == NULL || newBuff == NULL || size == 0) {
+    WARN("CommGraphUpdateBuffer : invalid buffers %p -> %p size %zu", oldBuff, newBuff, size);
+    return ncclInvalidArgument;
+  }
+  // Steps of a hierarchical AllReduce are captured as plans of its sub-communicators
+  struct ncclComm* comms[3] = { comm };
+  int nComms = 1 + ncclHierArSubComms(comm, comms+1);
+  for (int c=0; c<nComms; c++) {
+    // Drop the plans of graphs already destroyed
+    NCCLCHECK(ncclCommPollCallbacks(comms[c], false));
+    for (struct ncclGraphUserBuff* ub = comms[c]->graphUserBuffs; ub != nullptr; ub = ub->next) {
+      for (int i=0; i<2; i++) {
+        if (ub->base[i] < (uintptr_t)oldBuff + size && (uintptr_t)oldBuff < ub->base[i] + ub->size[i]) {
+          WARN("CommGraphUpdateBuffer : %p is used by a captured kernel outside of NCCL plans, recapture instead", oldBuff);
+          return ncclInvalidUsage;
+        }
+      }
+    }
+  }
+  struct graphBufferUpdate up = { (uintptr_t)oldBuff, (uintptr_t)newBuff, size, false, 0 };
+  // Check every plan first so that a failure changes nothing
+  for (int c=0; c<nComms; c++) {
+    for (struct ncclKernelPlan* plan = comms[c]->persistentPlans; plan != nullptr; plan = plan->persistentNext) {
+      NCCLCHECK(graphPatchPlan(plan, &up));
+    }
+  }
+  if (up.nPatched != 0) {
+    up.apply = true;
+    up.nPatched = 0;
+    for (int c=0; c<nComms; c++) {
+      for (struct ncclKernelPlan* plan = comms[c]->persistentPlans; plan != nullptr; plan = plan->persistentNext) {
+        NCCLCHECK(graphPatchPlan(plan, &up));
+      }
+    }
+  }
+  INFO(NCCL_COLL, "CommGraphUpdateBuffer %p -> %p size %zu : %d addresses updated", oldBuff, newBuff, size, up.nPatched);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclEnqueueCheck(struct ncclInfo* info) {
+  if (ncclGroupDepth == 0 && !ncclSubmitDraining && info->comm != nullptr &&
+      info->comm->config.blocking && ncclParamConcurrentEnqueue()) {
+    return submitConcurrent(info);
+  }
+  bool held;
+  NCCLCHECK(coalesceAppend(info, &held));
+  if (held) return ncclSuccess;
   NCCLCHECK(ncclGroupStartInternal());
   ncclResult_t ret = ncclSuccess;
   int devOld = -1;
+  ncclDataType_t wireType = ncclNumTypes;
+  struct ncclInfo wireInfo;
+  void* wireScratch = NULL;
+  bool hostColl = false;
+  bool ceColl = false;
+  bool ibMcast = false;
+  bool shotAr = false;
+  bool hierAr = false;
+  bool determ = false;
 
   NCCLCHECKGOTO(PtrCheck(info->comm, info->opName, "comm"), ret, fail);
   // Check whether communicator is ready to communicate
@@ -1580,18 +3197,50 @@ ncclResult_t ncclEnqueueCheck(struct ncclInfo* info) {
     CUDACHECKGOTO(cudaSetDevice(info->comm->cudaDev), ret, fail);
   }
   NCCLCHECKGOTO(ArgsCheck(info), ret, fail);
+  if (info->mixed) NCCLCHECKGOTO(mixedCheck(info), ret, fail);
 
   INFO(NCCL_COLL,"%s: opCount %lx sendbuff %p recvbuff %p count %zi datatype %d op %d root %d comm %p [nranks=%d] stream %p",
         info->opName, info->comm->opCount, info->sendbuff, info->recvbuff, info->count,
         info->datatype, info->op, info->root, info->comm, info->comm->nRanks, info->stream);
   TRACE_CALL("nccl%s(%" PRIx64 ",%" PRIx64 ",%zi,%d,%d,%d,%p,%p)", info->opName, reinterpret_cast<int64_t>(info->sendbuff), reinterpret_cast<int64_t>(info->recvbuff), info->count, info->datatype, info->op, info->root, info->comm, info->stream);
 
-  NCCLCHECKGOTO(taskAppend(info->comm, info), ret, fail);
+  NCCLCHECKGOTO(ncclHostCollEligible(info, &hostColl), ret, fail);
+  if (hostColl) {
+    NCCLCHECKGOTO(ncclHostCollRun(info), ret, fail);
+    goto exit;
+  }
+  NCCLCHECKGOTO(ncclCeCollEligible(info, &ceColl), ret, fail);
+  if (!ceColl) NCCLCHECKGOTO(ncclIbMcastEligible(info, &ibMcast), ret, fail);
+  NCCLCHECKGOTO(wireTypeOf(info, &wireType), ret, fail);
+  if (!ceColl) NCCLCHECKGOTO(determEligible(info, &determ), ret, fail);
+  // Deterministic reductions keep their own algorithm
+  if (!ceColl && !determ && wireType == ncclNumTypes) NCCLCHECKGOTO(ncclShotArEligible(info, &shotAr), ret, fail);
+  if (!ceColl && !determ && wireType == ncclNumTypes && !shotAr) NCCLCHECKGOTO(ncclHierArEligible(info, &hierAr), ret, fail);
+  if (ceColl) {
+    NCCLCHECKGOTO(ncclCeCollLaunch(info), ret, fail);
+  } else if (ibMcast) {
+    NCCLCHECKGOTO(ncclIbMcastLaunch(info), ret, fail);
+  } else if (shotAr) {
+    NCCLCHECKGOTO(ncclShotArLaunch(info), ret, fail);
+  } else if (hierAr) {
+    // Issued once the group has ended, see below
+  } else if (determ) {
+    NCCLCHECKGOTO(determPrepare(info, &wireScratch), ret, fail);
+  } else if (wireType != ncclNumTypes) {
+    NCCLCHECKGOTO(wirePrepare(info, wireType, &wireInfo, &wireScratch), ret, fail);
+    NCCLCHECKGOTO(taskAppend(info->comm, &wireInfo), ret, fail);
+  } else {
+    NCCLCHECKGOTO(taskAppend(info->comm, info), ret, fail);
+  }
 
 exit:
   if (devOld != -1) CUDACHECK(cudaSetDevice(devOld));
   ncclGroupErrCheck(ret);
   NCCLCHECK(ncclGroupEndInternal());
+  // The collective has been launched; convert the result back
+  if (ret == ncclSuccess && wireType != ncclNumTypes) NCCLCHECK(wireFinish(info, &wireInfo, wireScratch));
+  if (ret == ncclSuccess && determ) NCCLCHECK(determFinish(info, wireScratch));
+  if (ret == ncclSuccess && hierAr) NCCLCHECK(ncclHierArRun(info));
   /* if depth is 1, ncclGroupEndInternal() will trigger group ops. The state can change
    * so we have to check state here. */
   if (info->comm && !info->comm->config.blocking) { NCCLCHECK(ncclCommGetAsyncError(info->comm, &ret)) };
@@ -1601,12 +3250,7 @@ fail:
   goto exit;
 }
 
-NCCL_API(ncclResult_t, ncclRedOpCreatePreMulSum, ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm);
-ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm) {
-  NCCLCHECK(PtrCheck(comm, "ncclRedOpCreatePreMulSum", "comm"));
-  /* join init thread before creating PreMulSum op. */
-  NCCLCHECK(ncclCommEnsureReady(comm));
-
+static ncclUserRedOp* userRedOpAlloc(ncclComm_t comm, ncclRedOp_t *op) {
   if (comm->userRedOpFreeHead == comm->userRedOpCapacity) {
     // double capacity and resize
     int cap = 2*comm->userRedOpCapacity;
@@ -1625,6 +3269,19 @@ ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataTyp
   comm->userRedOpFreeHead = user->freeNext;
 
   user->freeNext = -1; // allocated
+  user->wireType = ncclNumTypes;
+  *op = ncclRedOp_t(int(ncclNumOps) + ix);
+  *op = ncclUserRedOpMangle(comm, *op);
+  return user;
+}
+
+NCCL_API(ncclResult_t, ncclRedOpCreatePreMulSum, ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm);
+ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, "ncclRedOpCreatePreMulSum", "comm"));
+  /* join init thread before creating PreMulSum op. */
+  NCCLCHECK(ncclCommEnsureReady(comm));
+
+  ncclUserRedOp *user = userRedOpAlloc(comm, op);
   user->datatype = datatype;
   user->opFull.op = ncclDevPreMulSum;
   if (residence == ncclScalarHostImmediate) {
@@ -1634,12 +3291,57 @@ ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataTyp
     user->opFull.scalarArgIsPtr = true;
     user->opFull.scalarArg = reinterpret_cast<uint64_t>(scalar);
   }
-  *op = ncclRedOp_t(int(ncclNumOps) + ix);
-  *op = ncclUserRedOpMangle(comm, *op);
   TRACE_CALL("ncclRedOpCreatePreMulSum(%d,%p,%d,%d,%p)", *op, scalar, datatype, residence, comm);
   return ncclSuccess;
 }
 
+NCCL_API(ncclResult_t, ncclRedOpCreateWireSum, ncclRedOp_t *op, ncclDataType_t datatype, ncclDataType_t wireType, ncclComm_t comm);
+ncclResult_t ncclRedOpCreateWireSum(ncclRedOp_t *op, ncclDataType_t datatype, ncclDataType_t wireType, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, "ncclRedOpCreateWireSum", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (!ncclWireTypeSupported(datatype, wireType)) {
+    WARN("ncclRedOpCreateWireSum : unsupported wire type %d for type %d", wireType, datatype);
+    return ncclInvalidArgument;
+  }
+
+  ncclUserRedOp *user = userRedOpAlloc(comm, op);
+  user->datatype = datatype;
+  user->wireType = wireType;
+  user->opFull.op = ncclDevSum;
+  user->opFull.scalarArgIsPtr = false;
+  user->opFull.scalarArg = 0;
+  TRACE_CALL("ncclRedOpCreateWireSum(%d,%d,%d,%p)", *op, datatype, wireType, comm);
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclRedOpCreateSumPostOp, ncclRedOp_t *op, ncclPostOp_t postOp, float scale, ncclDataType_t datatype, ncclComm_t comm);
+ncclResult_t ncclRedOpCreateSumPostOp(ncclRedOp_t *op, ncclPostOp_t postOp, float scale, ncclDataType_t datatype, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, "ncclRedOpCreateSumPostOp", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (datatype != ncclFloat16 && datatype != ncclFloat32 && datatype != ncclFloat64
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+      && datatype != ncclBfloat16
+#endif
+     ) {
+    WARN("ncclRedOpCreateSumPostOp : unsupported type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  if (int(postOp) < 0 || int(postOp) >= int(ncclNumPostOps)) {
+    WARN("ncclRedOpCreateSumPostOp : invalid postOp %d", postOp);
+    return ncclInvalidArgument;
+  }
+
+  ncclUserRedOp *user = userRedOpAlloc(comm, op);
+  user->datatype = datatype;
+  user->opFull.op = ncclDevSumPostOp;
+  user->opFull.scalarArgIsPtr = false;
+  uint32_t scaleBits;
+  std::memcpy(&scaleBits, &scale, sizeof(scaleBits));
+  user->opFull.scalarArg = uint64_t(postOp)<<32 | scaleBits;
+  TRACE_CALL("ncclRedOpCreateSumPostOp(%d,%d,%f,%d,%p)", *op, postOp, scale, datatype, comm);
+  return ncclSuccess;
+}
+
 NCCL_API(ncclResult_t, ncclRedOpDestroy, ncclRedOp_t op, ncclComm_t comm);
 ncclResult_t ncclRedOpDestroy(ncclRedOp_t op, ncclComm_t comm) {
   if (0 <= int(op) && int(op) < int(ncclNumOps)) {
@@ -1666,3 +3368,44 @@ ncclResult_t ncclRedOpDestroy(ncclRedOp_t op, ncclComm_t comm) {
   TRACE_CALL("ncclRedOpDestroy(%d,%p)", op, comm);
   return ncclSuccess;
 }
+
+NCCL_API(ncclResult_t, ncclCommGetCollInfo, ncclComm_t comm, ncclCollType_t coll, size_t count, ncclDataType_t datatype,
+    ncclRedOp_t op, const char** algorithm, const char** protocol, int* nChannels, float* predictedUs);
+ncclResult_t ncclCommGetCollInfo(ncclComm_t comm, ncclCollType_t coll, size_t count, ncclDataType_t datatype,
+    ncclRedOp_t op, const char** algorithm, const char** protocol, int* nChannels, float* predictedUs) {
+  static const int chunkSteps[] = { BROADCAST_CHUNKSTEPS, REDUCE_CHUNKSTEPS, ALLGATHER_CHUNKSTEPS, REDUCESCATTER_CHUNKSTEPS, ALLREDUCE_CHUNKSTEPS };
+  static const int sliceSteps[] = { BROADCAST_SLICESTEPS, REDUCE_SLICESTEPS, ALLGATHER_SLICESTEPS, REDUCESCATTER_SLICESTEPS, ALLREDUCE_SLICESTEPS };
+  NCCLCHECK(PtrCheck(comm, "CommGetCollInfo", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (int(coll) < 0 || int(coll) > int(ncclCollAllReduce)) {
+    WARN("CommGetCollInfo : invalid collective %d", coll);
+    return ncclInvalidArgument;
+  }
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("CommGetCollInfo : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  struct ncclInfo info = { (ncclFunc_t)coll, "CommGetCollInfo",
+    NULL, NULL, count, datatype, op, 0, comm, NULL, /* Args */
+    chunkSteps[coll], sliceSteps[coll] };
+  int collNetTypeSupport = 0;
+  NCCLCHECK(hostToDevRedOp(&info.opFull, op, datatype, comm));
+  NCCLCHECK(ncclInfoSetDerived(&info, comm->nRanks));
+  NCCLCHECK(getCollNetSupport(&info, &collNetTypeSupport));
+  // Same choice as an operation launched alone, without sampling it for the autotuner
+  NCCLCHECK(getAlgoInfo(&info, collNetTypeSupport, 1));
+  if (algorithm) *algorithm = ncclAlgoStr[info.algorithm];
+  if (protocol) *protocol = ncclProtoStr[info.protocol];
+  if (nChannels) *nChannels = info.nChannels;
+  if (predictedUs) {
+    // The choice is made on the full width of the model, before the channels are tuned
+    int nc = info.nChannels;
+    info.nChannels = 0;
+    NCCLCHECK(ncclTopoGetAlgoTime(&info, info.algorithm, info.protocol, 1, predictedUs));
+    info.nChannels = nc;
+    if (comm->nRanks == 1) *predictedUs = 0;
+  }
+  TRACE_CALL("ncclCommGetCollInfo(%p,%d,%zu,%d,%d) -> %s/%s %d channels", comm, coll, count, datatype, op,
+      ncclAlgoStr[info.algorithm], ncclProtoStr[info.protocol], info.nChannels);
+  return ncclSuccess;
+}
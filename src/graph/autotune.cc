@@ -0,0 +1,281 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "autotune.h"
+#include "comm.h"
+#include "info.h"
+#include "bootstrap.h"
+#include "collectives.h"
+#include <algorithm>
+
+NCCL_PARAM(Autotune, "AUTOTUNE", 0);
+NCCL_PARAM(AutotuneTrials, "AUTOTUNE_TRIALS", 4);         // Timed calls per candidate
+NCCL_PARAM(AutotuneCandidates, "AUTOTUNE_CANDIDATES", 3); // Best algo/proto pairs of the model to try
+NCCL_PARAM(AutotuneChannels, "AUTOTUNE_CHANNELS", 1);     // Also try Ring/Tree with half the channels
+
+#define NCCL_AUTOTUNE_BUCKETS 64
+
+struct ncclAutotuneCandidate {
+  int algorithm;
+  int protocol;
+  int ncShift;
+};
+
+struct ncclAutotuneEntry {
+  int decided;
+  int best;
+  int nCandidates;
+  struct ncclAutotuneCandidate candidates[NCCL_AUTOTUNE_MAX_CANDIDATES];
+  int nCalls;
+  struct ncclAutotuneSample* samples; // [nCandidates*trials], freed once decided
+};
+
+// Weighted least squares fit of time = lat + bytes/bw, minimizing relative errors so that small
+// sizes weigh as much as large ones : sums of w, w*x, w*y, w*x*x, w*x*y with w = 1/y^2.
+struct ncclAutotuneFit {
+  double s, sx, sy, sxx, sxy;
+  int n;
+};
+
+struct ncclAutotune {
+  int trials;
+  // Algorithms available differ by reduction operation, e.g. NVLS and CollNet
+  struct ncclAutotuneEntry* entries[NCCL_NUM_FUNCTIONS][ncclNumDevRedOps][ncclNumTypes][NCCL_AUTOTUNE_BUCKETS];
+  const char* dumpFile;
+  struct ncclAutotuneFit fits[NCCL_NUM_FUNCTIONS][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+};
+
+ncclResult_t ncclAutotuneInit(struct ncclComm* comm) {
+  comm->autotune = NULL;
+  if (ncclParamAutotune() == 0) return ncclSuccess;
+  if (comm->intraRanks > 1) {
+    // Deciding requires all ranks to exchange timings in the middle of ncclGroupEnd, which would
+    // deadlock when a single thread drives several ranks.
+    INFO(NCCL_INIT|NCCL_TUNING, "NCCL_AUTOTUNE ignored : not supported with multiple ranks per process");
+    return ncclSuccess;
+  }
+  struct ncclAutotune* at;
+  NCCLCHECK(ncclCalloc(&at, 1));
+  at->trials = std::max(1, std::min((int)ncclParamAutotuneTrials(), NCCL_AUTOTUNE_MAX_TRIALS));
+  at->dumpFile = getenv("NCCL_TUNING_DUMP_FILE");
+  comm->autotune = at;
+  INFO(NCCL_INIT|NCCL_TUNING, "Autotuning enabled, %d trials per candidate", at->trials);
+  if (at->dumpFile && comm->rank == 0) INFO(NCCL_ENV, "NCCL_TUNING_DUMP_FILE set by environment to %s", at->dumpFile);
+  return ncclSuccess;
+}
+
+static void autotuneFreeSamples(struct ncclAutotuneEntry* e) {
+  if (e->samples == NULL) return;
+  for (int s=0; s<e->nCalls; s++) {
+    // Do not check return code as CUDA may have already shut down
+    cudaEventDestroy(e->samples[s].start);
+    cudaEventDestroy(e->samples[s].stop);
+  }
+  free(e->samples);
+  e->samples = NULL;
+}
+
+static void autotuneFitAdd(struct ncclAutotuneFit* fit, double bytes, double time) {
+  if (time <= 0) return;
+  double w = 1.0/(time*time);
+  fit->s += w;
+  fit->sx += w*bytes;
+  fit->sy += w*time;
+  fit->sxx += w*bytes*bytes;
+  fit->sxy += w*bytes*time;
+  fit->n++;
+}
+
+// Write the fitted latency/bandwidth in the format read by NCCL_TUNING_FILE (tuning.cc).
+static void autotuneDump(struct ncclComm* comm, struct ncclAutotune* at) {
+  FILE* file = fopen(at->dumpFile, "w");
+  if (file == NULL) {
+    WARN("Could not open tuning dump file %s : %s", at->dumpFile, strerror(errno));
+    return;
+  }
+  fprintf(file, "# Measured by NCCL_AUTOTUNE : <coll> <algo> <proto> <latency us> <bandwidth GB/s>\n");
+  fprintf(file, "nranks %d nnodes %d\n", comm->nRanks, comm->nNodes);
+  int nEntries = 0;
+  for (int c=0; c<NCCL_NUM_FUNCTIONS; c++) {
+    for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+      for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+        struct ncclAutotuneFit* fit = &at->fits[c][a][p];
+        double det = fit->s*fit->sxx - fit->sx*fit->sx;
+        // Need at least two sizes, and time has to grow with the size
+        if (fit->n < 2 || det <= 0) continue;
+        double slope = (fit->s*fit->sxy - fit->sx*fit->sy)/det;
+        double lat = (fit->sy - slope*fit->sx)/fit->s;
+        if (slope <= 0) continue;
+        fprintf(file, "%s %s %s %.3f %.3f\n", ncclFuncStr[c], ncclAlgoStr[a], ncclProtoStr[p], std::max(lat, 0.0), 1.0/(1000*slope));
+        nEntries++;
+      }
+    }
+  }
+  fclose(file);
+  INFO(NCCL_TUNING, "Wrote %d tuning entries to %s", nEntries, at->dumpFile);
+}
+
+void ncclAutotuneFree(struct ncclComm* comm) {
+  struct ncclAutotune* at = comm->autotune;
+  if (at == NULL) return;
+  if (at->dumpFile && comm->rank == 0) autotuneDump(comm, at);
+  for (int f=0; f<NCCL_NUM_FUNCTIONS; f++) {
+    for (int o=0; o<ncclNumDevRedOps; o++) {
+      for (int t=0; t<ncclNumTypes; t++) {
+        for (int b=0; b<NCCL_AUTOTUNE_BUCKETS; b++) {
+          struct ncclAutotuneEntry* e = at->entries[f][o][t][b];
+          if (e == NULL) continue;
+          autotuneFreeSamples(e);
+          free(e);
+        }
+      }
+    }
+  }
+  free(at);
+  comm->autotune = NULL;
+}
+
+static ncclResult_t autotuneNewEntry(float times[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS], int trials, struct ncclAutotuneEntry** entry) {
+  struct ncclAutotuneEntry* e;
+  NCCLCHECK(ncclCalloc(&e, 1));
+  // Keep the best algo/proto pairs according to the model, best first. The model choice is
+  // therefore always candidate 0.
+  int nPairs = std::min((int)ncclParamAutotuneCandidates(), NCCL_AUTOTUNE_MAX_CANDIDATES/2);
+  bool used[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS] = {};
+  for (int i=0; i<nPairs; i++) {
+    int ba = -1, bp = -1;
+    for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+      for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+        if (used[a][p] || times[a][p] < 0) continue;
+        if (ba == -1 || times[a][p] < times[ba][bp]) { ba = a; bp = p; }
+      }
+    }
+    if (ba == -1) break;
+    used[ba][bp] = true;
+    e->candidates[e->nCandidates++] = { ba, bp, 0 };
+  }
+  if (ncclParamAutotuneChannels()) {
+    int n = e->nCandidates;
+    for (int c=0; c<n; c++) {
+      int a = e->candidates[c].algorithm;
+      if (a == NCCL_ALGO_RING || a == NCCL_ALGO_TREE) e->candidates[e->nCandidates++] = { a, e->candidates[c].protocol, 1 };
+    }
+  }
+  if (e->nCandidates <= 1) {
+    e->decided = 1;
+  } else {
+    NCCLCHECK(ncclCalloc(&e->samples, e->nCandidates*trials));
+  }
+  *entry = e;
+  return ncclSuccess;
+}
+
+// Median time of a candidate on this rank, ignoring the first (warmup) sample when possible.
+// Also returns the mean size of the calls, which may vary within a bucket.
+static ncclResult_t autotuneCandidateTime(struct ncclAutotuneEntry* e, int c, float* time, double* bytes) {
+  float samples[NCCL_AUTOTUNE_MAX_TRIALS];
+  int n = 0;
+  *bytes = 0;
+  for (int s=0; s<e->nCalls; s++) {
+    struct ncclAutotuneSample* sample = e->samples+s;
+    if (sample->candidate != c || !sample->recorded) continue;
+    CUDACHECK(cudaEventSynchronize(sample->stop));
+    CUDACHECK(cudaEventElapsedTime(samples+n, sample->start, sample->stop));
+    *bytes += sample->nBytes;
+    n++;
+  }
+  if (n == 0) { *time = -1; return ncclSuccess; }
+  *bytes /= n;
+  float* first = n > 1 ? samples+1 : samples;
+  std::sort(first, samples+n);
+  *time = first[(samples+n-first)/2]*1e3; // us
+  return ncclSuccess;
+}
+
+static ncclResult_t autotuneDecide(struct ncclComm* comm, struct ncclInfo* info, struct ncclAutotuneEntry* e) {
+  struct ncclAutotune* at = comm->autotune;
+  ncclResult_t ret = ncclSuccess;
+  float* allTimes;
+  NCCLCHECK(ncclCalloc(&allTimes, comm->nRanks*NCCL_AUTOTUNE_MAX_CANDIDATES));
+  float* myTimes = allTimes+comm->rank*NCCL_AUTOTUNE_MAX_CANDIDATES;
+  double bytes[NCCL_AUTOTUNE_MAX_CANDIDATES];
+  for (int c=0; c<e->nCandidates; c++) NCCLCHECKGOTO(autotuneCandidateTime(e, c, myTimes+c, bytes+c), ret, exit);
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allTimes, NCCL_AUTOTUNE_MAX_CANDIDATES*sizeof(float)), ret, exit);
+
+  {
+    float bestTime = -1;
+    e->best = 0;
+    for (int c=0; c<e->nCandidates; c++) {
+      // A collective is as fast as its slowest rank
+      float time = -1;
+      for (int r=0; r<comm->nRanks; r++) time = std::max(time, allTimes[r*NCCL_AUTOTUNE_MAX_CANDIDATES+c]);
+      if (comm->rank == 0) {
+        TRACE(NCCL_TUNING, "Autotune %s %ld bytes candidate %d %s/%s channels>>%d : %.1f us", ncclFuncStr[info->coll], info->nBytes, c,
+            ncclAlgoStr[e->candidates[c].algorithm], ncclProtoStr[e->candidates[c].protocol], e->candidates[c].ncShift, time);
+      }
+      if (time >= 0 && (bestTime < 0 || time < bestTime)) { bestTime = time; e->best = c; }
+      // Fits are for the full number of channels only, which is what the model predicts
+      if (at->dumpFile && e->candidates[c].ncShift == 0) {
+        autotuneFitAdd(&at->fits[info->coll][e->candidates[c].algorithm][e->candidates[c].protocol], bytes[c], time);
+      }
+    }
+    struct ncclAutotuneCandidate* best = e->candidates+e->best;
+    if (comm->rank == 0) {
+      INFO(NCCL_TUNING, "Autotune %s type %d ~%ld bytes : %s/%s channels>>%d %.1f us (model choice %s/%s)", ncclFuncStr[info->coll], info->datatype, info->nBytes,
+          ncclAlgoStr[best->algorithm], ncclProtoStr[best->protocol], best->ncShift, bestTime,
+          ncclAlgoStr[e->candidates[0].algorithm], ncclProtoStr[e->candidates[0].protocol]);
+    }
+  }
+  e->decided = 1;
+  autotuneFreeSamples(e);
+exit:
+  free(allTimes);
+  return ret;
+}
+
+ncclResult_t ncclAutotuneSelect(struct ncclInfo* info, float times[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS], int* ncShift, struct ncclAutotuneSample** sample) {
+  struct ncclComm* comm = info->comm;
+  struct ncclAutotune* at = comm->autotune;
+  *ncShift = 0;
+  *sample = NULL;
+  if (at == NULL || info->coll >= NCCL_NUM_FUNCTIONS) return ncclSuccess;
+  // Timing graph launches makes no sense ; just use what we learnt so far, or the model.
+  bool capturing = ncclCudaGraphValid(comm->tasks.capturingGraph);
+
+  int bucket = 0;
+  while (bucket < NCCL_AUTOTUNE_BUCKETS-1 && (1ULL<<(bucket+1)) <= info->nBytes) bucket++;
+  struct ncclAutotuneEntry** entryPtr = &at->entries[info->coll][info->opFull.op][info->datatype][bucket];
+  if (*entryPtr == NULL) {
+    if (capturing) return ncclSuccess;
+    NCCLCHECK(autotuneNewEntry(times, at->trials, entryPtr));
+  }
+  struct ncclAutotuneEntry* e = *entryPtr;
+  if (!e->decided) {
+    if (capturing) return ncclSuccess;
+    if (e->nCalls == e->nCandidates*at->trials) {
+      NCCLCHECK(autotuneDecide(comm, info, e));
+    } else {
+      // Sizes within a bucket may not all support the same algorithms. The model is the same
+      // on all ranks, so they all skip the same calls.
+      struct ncclAutotuneCandidate* next = e->candidates + e->nCalls % e->nCandidates;
+      if (times[next->algorithm][next->protocol] < 0) return ncclSuccess;
+      struct ncclAutotuneSample* s = e->samples+e->nCalls;
+      CUDACHECK(cudaEventCreate(&s->start));
+      CUDACHECK(cudaEventCreate(&s->stop));
+      s->nBytes = info->nBytes;
+      s->candidate = e->nCalls % e->nCandidates;
+      s->recorded = false;
+      e->nCalls++;
+      *sample = s;
+    }
+  }
+  struct ncclAutotuneCandidate* c = e->candidates + (e->decided ? e->best : (*sample)->candidate);
+  if (times[c->algorithm][c->protocol] < 0) return ncclSuccess;
+  info->algorithm = c->algorithm;
+  info->protocol = c->protocol;
+  *ncShift = c->ncShift;
+  return ncclSuccess;
+}
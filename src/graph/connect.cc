@@ -9,11 +9,40 @@
 #include "trees.h"
 #include "rings.h"
 #include "topo.h"
+#include <algorithm>
 
 /******************************************************************/
 /********************* Internode connection ***********************/
 /******************************************************************/
 
+// Network locality of this node, to keep inter-node ring hops and tree edges under
+// the same leaf switch. Set either directly through NCCL_TOPO_SWITCH_ID, or through
+// NCCL_TOPO_SWITCH_FILE, with one "<hostname> <switch id>" line per node.
+static uint64_t getNetSwitch() {
+  const char* id = getenv("NCCL_TOPO_SWITCH_ID");
+  if (id && id[0]) return getHash(id, strlen(id));
+  const char* file = getenv("NCCL_TOPO_SWITCH_FILE");
+  if (file == NULL || file[0] == '\0') return 0;
+  FILE* f = fopen(file, "r");
+  if (f == NULL) {
+    INFO(NCCL_GRAPH|NCCL_ENV, "Could not open NCCL_TOPO_SWITCH_FILE %s", file);
+    return 0;
+  }
+  char hostname[1024];
+  getHostName(hostname, 1024, '.');
+  char line[1024], host[256], sw[256];
+  uint64_t netSwitch = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%255s %255s", host, sw) != 2 || host[0] == '#') continue;
+    char* dot = strchr(host, '.');
+    if (dot) *dot = '\0';
+    if (strcmp(host, hostname) == 0) { netSwitch = getHash(sw, strlen(sw)); break; }
+  }
+  fclose(f);
+  if (netSwitch == 0) INFO(NCCL_GRAPH|NCCL_ENV, "Host %s not found in NCCL_TOPO_SWITCH_FILE %s", hostname, file);
+  return netSwitch;
+}
+
 ncclResult_t ncclTopoPreset(struct ncclComm* comm, struct ncclTopoGraph** graphs, struct ncclTopoRanks* topoRanks) {
   int rank = comm->rank;
   int localRanks = comm->topo->nodes[GPU].count;
@@ -65,6 +94,7 @@ ncclResult_t ncclTopoPreset(struct ncclComm* comm, struct ncclTopoGraph** graphs
     topoRanks->ringNext[c] = channel->ring.next;
     topoRanks->nvlsHeads[c] = nvlsIntra[0];
   }
+  topoRanks->netSwitch = getNetSwitch();
   // Duplicate channels rings/trees
   struct ncclChannel* channel0 = comm->channels;
   struct ncclChannel* channel1 = channel0+nChannels;
@@ -72,6 +102,10 @@ ncclResult_t ncclTopoPreset(struct ncclComm* comm, struct ncclTopoGraph** graphs
   return ncclSuccess;
 }
 
+// Run the duplicated ring channels in the opposite direction, so that ring collectives send
+// half of their data each way and use both directions of every NVLink and NIC.
+NCCL_PARAM(RingBidir, "RING_BIDIR", 0);
+
 static ncclResult_t connectRings(struct ncclComm* comm, int* ringRecv, int* ringSend, int* ringPrev, int* ringNext) {
   int nChannels = comm->nChannels;
   int nNodes = comm->nNodes;
@@ -98,6 +132,7 @@ static ncclResult_t connectRings(struct ncclComm* comm, int* ringRecv, int* ring
         channel1->ring.next = nextRecvRank;
       }
     }
+    if (ncclParamRingBidir()) std::swap(channel1->ring.prev, channel1->ring.next);
     TRACE(NCCL_GRAPH, "Ring %d : %d -> %d -> %d", c, channel0->ring.prev, comm->rank, channel0->ring.next);
     TRACE(NCCL_GRAPH, "Ring %d : %d -> %d -> %d", c+nChannels, channel1->ring.prev, comm->rank, channel1->ring.next);
   }
@@ -120,46 +155,68 @@ static ncclResult_t setTreeDown(struct ncclTree* tree, int* indexes, int d) {
   int x = 0;
   while (x < NCCL_MAX_TREE_ARITY && tree->down[x] >= 0) x++;
   if (x == NCCL_MAX_TREE_ARITY) {
-    WARN("Internal error : tree already has %d children (%d %d %d)", x, tree->down[0], tree->down[1], tree->down[2]);
+    WARN("Internal error : tree already has %d children (%d %d %d ...)", x, tree->down[0], tree->down[1], tree->down[2]);
     return ncclInternalError;
   }
   tree->down[x] = indexes[d];
   return ncclSuccess;
 }
 
-static ncclResult_t connectTrees(struct ncclComm* comm, int* treeToParent, int* treeToChild0, int* treeToChild1, int* treePatterns) {
-  const int nChannels = comm->nChannels, nNodes = comm->nNodes, node = comm->node;
+static void printTree(struct ncclComm* comm, int c, struct ncclTree* tree) {
+  char line[128];
+  int len = snprintf(line, sizeof(line), "%d", tree->down[0]);
+  for (int i=1; i<comm->treeArity+1 && i<NCCL_MAX_TREE_ARITY; i++) len += snprintf(line+len, sizeof(line)-len, "/%d", tree->down[i]);
+  INFO(NCCL_GRAPH, "Tree %d : %d -> %d -> %s", c, tree->up, comm->rank, line);
+}
+
+// Number of nodes below each node of the inter-node tree. 2 builds the double binary
+// tree. Higher arities build a pair of mirrored k-ary trees, fewer hops deep, whose
+// children alternate between the two ranks taking inter-node children (and their NICs).
+NCCL_PARAM(TreeArity, "TREE_ARITY", 2);
+
+// Node indexes here are positions in the inter-node order, see ncclTopoPostset.
+static ncclResult_t connectTrees(struct ncclComm* comm, int node, int* treeToParent, int* treeToChild0, int* treeToChild1, int* treePatterns) {
+  const int nChannels = comm->nChannels, nNodes = comm->nNodes;
+  int arity = ncclParamTreeArity();
+  if (arity < 2 || arity > NCCL_MAX_TREE_INTER_ARITY) {
+    WARN("NCCL_TREE_ARITY=%d out of range [2,%d], using 2", arity, NCCL_MAX_TREE_INTER_ARITY);
+    arity = 2;
+  }
+  comm->treeArity = arity;
 
   // Compute tree depth. Not an exact value but a good approximation in most
   // cases
-  int depth = comm->nRanks/nNodes - 1 + log2i(nNodes);
+  int depth = comm->nRanks/nNodes - 1 + ncclTreeLevels(nNodes, arity);
 
-  int t0u, t0d0, t0d1, t0ChildType, t1u, t1d0, t1d1, t1ChildType;
-  int* ttp, *ttc0, *ttc1;
-  NCCLCHECK(ncclGetDtree(nNodes, node, &t0u, &t0d0, &t0d1, &t0ChildType, &t1u, &t1d0, &t1d1, &t1ChildType));
+  int t0u, t0d[NCCL_MAX_TREE_INTER_ARITY], t0ChildType, t1u, t1d[NCCL_MAX_TREE_INTER_ARITY], t1ChildType;
+  int* ttp, *ttc[2];
+  if (arity == 2) {
+    NCCLCHECK(ncclGetDtree(nNodes, node, &t0u, t0d+0, t0d+1, &t0ChildType, &t1u, t1d+0, t1d+1, &t1ChildType));
+  } else {
+    NCCLCHECK(ncclGetDKtree(nNodes, node, arity, &t0u, t0d, &t0ChildType, &t1u, t1d, &t1ChildType));
+  }
   for (int c=0; c<nChannels; c++) {
      struct ncclChannel* channel0 = comm->channels+c;
      struct ncclChannel* channel1 = channel0+nChannels;
      ttp = treeToParent+c*comm->nNodes;
-     ttc0 = treeToChild0+c*comm->nNodes;
-     ttc1 = treeToChild1+c*comm->nNodes;
+     ttc[0] = treeToChild0+c*comm->nNodes;
+     ttc[1] = treeToChild1+c*comm->nNodes;
+     bool inter = false;
      if (comm->rank == ttp[node]) {
-       NCCLCHECK(setTreeUp(&channel0->tree, t0ChildType == 0 ? ttc0 : ttc1, t0u));
-       NCCLCHECK(setTreeUp(&channel1->tree, t1ChildType == 0 ? ttc0 : ttc1, t1u));
-     }
-     if (comm->rank == ttc0[node]) {
-       NCCLCHECK(setTreeDown(&channel0->tree, ttp, t0d0));
-       NCCLCHECK(setTreeDown(&channel1->tree, ttp, t1d0));
+       NCCLCHECK(setTreeUp(&channel0->tree, ttc[t0ChildType%2], t0u));
+       NCCLCHECK(setTreeUp(&channel1->tree, ttc[t1ChildType%2], t1u));
+       inter = true;
      }
-     if (comm->rank == ttc1[node]) {
-       NCCLCHECK(setTreeDown(&channel0->tree, ttp, t0d1));
-       NCCLCHECK(setTreeDown(&channel1->tree, ttp, t1d1));
+     // Child j is taken by the rank at child0 or child1, alternating
+     for (int j=0; j<arity; j++) {
+       if (comm->rank != ttc[j%2][node]) continue;
+       NCCLCHECK(setTreeDown(&channel0->tree, ttp, t0d[j]));
+       NCCLCHECK(setTreeDown(&channel1->tree, ttp, t1d[j]));
+       inter = true;
      }
-     if (comm->rank == ttp[node] ||
-         comm->rank == ttc0[node] ||
-         comm->rank == ttc1[node]) {
-       INFO(NCCL_GRAPH, "Tree %d : %d -> %d -> %d/%d/%d", c,           channel0->tree.up, comm->rank, channel0->tree.down[0], channel0->tree.down[1], channel0->tree.down[2]);
-       INFO(NCCL_GRAPH, "Tree %d : %d -> %d -> %d/%d/%d", c+nChannels, channel1->tree.up, comm->rank, channel1->tree.down[0], channel1->tree.down[1], channel1->tree.down[2]);
+     if (inter) {
+       printTree(comm, c, &channel0->tree);
+       printTree(comm, c+nChannels, &channel1->tree);
      }
      channel0->tree.depth = channel1->tree.depth = depth;
   }
@@ -243,7 +300,7 @@ static ncclResult_t connectNvls(struct ncclComm* comm, int* nvlsHeads, struct nc
     for (int h=0; h<nHeads; h++) channel->nvls.up[h] = comm->nRanks+1+h;
     for (int h=nHeads; h<NCCL_MAX_NVLS_ARITY; h++) channel->nvls.up[h] = -1;
     channel->nvls.down = comm->nRanks+1+headRank;
-    channel->nvls.out = -1;       // NVLS+SHARP not yet implemented.
+    channel->nvls.out = -1;       // Set to the CollNet root by connectCollNet for NVLS+SHARP
     channel->nvls.headRank = headRank;
     channel->nvls.treeUp = channel->nvls.treeDown[0] = channel->nvls.treeDown[1] = channel->nvls.treeDown[2] = -1;
     channel->nvls.node = comm->node;
@@ -348,44 +405,58 @@ static int copyChannels(struct ncclComm* comm, int start, int end, int* ringPrev
   return c;
 }
 
-ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* firstRanks, int* treePatterns, struct ncclTopoRanks** allTopoRanks, int* rings, struct ncclTopoGraph** graphs) {
-  // Gather data from all ranks
-  int *ringRecv, *ringSend, *ringPrev, *ringNext, *treeToParent, *treeToChild0, *treeToChild1, *nvlsHeads;
+ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* treePatterns, struct ncclTopoRanks* nodeTopoRanks,
+    int* ringPrev, int* ringNext, int* rings, struct ncclTopoGraph** graphs) {
+  // Gather data from all nodes
+  int *ringRecv, *ringSend, *treeToParent, *treeToChild0, *treeToChild1, *nvlsHeads;
   int nranks = comm->nRanks;
   int nNodes = comm->nNodes;
   int nChannels = comm->nChannels;
   NCCLCHECK(ncclCalloc(&ringRecv, nNodes*MAXCHANNELS));
   NCCLCHECK(ncclCalloc(&ringSend, nNodes*MAXCHANNELS));
-  NCCLCHECK(ncclCalloc(&ringPrev, nranks*MAXCHANNELS));
-  NCCLCHECK(ncclCalloc(&ringNext, nranks*MAXCHANNELS));
   NCCLCHECK(ncclCalloc(&treeToParent, nNodes*MAXCHANNELS));
   NCCLCHECK(ncclCalloc(&treeToChild0, nNodes*MAXCHANNELS));
   NCCLCHECK(ncclCalloc(&treeToChild1, nNodes*MAXCHANNELS));
   NCCLCHECK(ncclCalloc(&nvlsHeads, nNodes*MAXCHANNELS));
+
+  // Chain nodes into rings and trees grouped by network switch, so that only the
+  // hops between groups cross the spine. Without switch information this keeps
+  // the node order.
+  int* nodeOrder;
+  NCCLCHECK(ncclCalloc(&nodeOrder, nNodes));
+  for (int n=0; n<nNodes; n++) nodeOrder[n] = n;
+  std::sort(nodeOrder, nodeOrder+nNodes, [&](int a, int b) {
+    uint64_t sa = nodeTopoRanks[a].netSwitch, sb = nodeTopoRanks[b].netSwitch;
+    return sa != sb ? sa < sb : a < b;
+  });
+  int nodePos = 0, reordered = 0;
+  for (int n=0; n<nNodes; n++) {
+    if (nodeOrder[n] == comm->node) nodePos = n;
+    if (nodeOrder[n] != n) reordered = 1;
+  }
+  if (reordered && comm->rank == 0) INFO(NCCL_GRAPH, "Ordering %d nodes by network switch", nNodes);
+
   for (int c=0; c<nChannels;c++) {
     for (int n=0; n<nNodes; n++) {
-      int r = firstRanks[n];
-      ringRecv[c*nNodes+n] = allTopoRanks[r]->ringRecv[c];
-      ringSend[c*nNodes+n] = allTopoRanks[r]->ringSend[c];
-      treeToParent[c*nNodes+n] = allTopoRanks[r]->treeToParent[c];
-      treeToChild0[c*nNodes+n] = allTopoRanks[r]->treeToChild0[c];
-      treeToChild1[c*nNodes+n] = allTopoRanks[r]->treeToChild1[c];
-      nvlsHeads[c*nNodes+n] = allTopoRanks[r]->nvlsHeads[c];
-    }
-    for (int r=0; r<nranks; r++) {
-      ringPrev[c*nranks+r] = allTopoRanks[r]->ringPrev[c];
-      ringNext[c*nranks+r] = allTopoRanks[r]->ringNext[c];
+      struct ncclTopoRanks* node = nodeTopoRanks+nodeOrder[n];
+      ringRecv[c*nNodes+n] = node->ringRecv[c];
+      ringSend[c*nNodes+n] = node->ringSend[c];
+      treeToParent[c*nNodes+n] = node->treeToParent[c];
+      treeToChild0[c*nNodes+n] = node->treeToChild0[c];
+      treeToChild1[c*nNodes+n] = node->treeToChild1[c];
+      nvlsHeads[c*nNodes+n] = nodeTopoRanks[n].nvlsHeads[c];
     }
   }
 
   // Connect rings and trees. This should also duplicate the channels.
   NCCLCHECK(connectRings(comm, ringRecv, ringSend, ringPrev, ringNext));
-  NCCLCHECK(connectTrees(comm, treeToParent, treeToChild0, treeToChild1, treePatterns));
+  NCCLCHECK(connectTrees(comm, nodePos, treeToParent, treeToChild0, treeToChild1, treePatterns));
   NCCLCHECK(connectNvls(comm, nvlsHeads, graphs[NCCL_ALGO_NVLS]));
 
-  // Duplicate ringPrev/ringNext for ncclBuildRing
-  memcpy(ringPrev+nChannels*nranks, ringPrev, nChannels*nranks*sizeof(int));
-  memcpy(ringNext+nChannels*nranks, ringNext, nChannels*nranks*sizeof(int));
+  // Duplicate ringPrev/ringNext for ncclBuildRing, reversed for bidirectional rings
+  memcpy(ringPrev+nChannels*nranks, ncclParamRingBidir() ? ringNext : ringPrev, nChannels*nranks*sizeof(int));
+  memcpy(ringNext+nChannels*nranks, ncclParamRingBidir() ? ringPrev : ringNext, nChannels*nranks*sizeof(int));
+  if (ncclParamRingBidir() && comm->rank == 0) INFO(NCCL_GRAPH, "Rings %d-%d run in the reverse direction", nChannels, 2*nChannels-1);
 
   // Duplication should be complete now
   nChannels = comm->nChannels = std::min(MAXCHANNELS,nChannels*2);
@@ -406,15 +477,23 @@ ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* firstRanks, int* treePa
      nChannels = comm->nChannels = copyChannels(comm, nChannels, 2*nChannels, ringPrev, ringNext);
   }
 
+  // Ranks sharing a GPU (NCCL_SHARED_GPU) run concurrently on its SMs, each gets its share of the CTAs
+  int maxCTAs = comm->config.maxCTAs;
+  int minCTAs = std::max(ncclMinNchannels(), comm->config.minCTAs);
+  if (comm->maxGpuRanks > 1) {
+    maxCTAs = std::max(1, std::min(ncclMaxNchannels(), maxCTAs)/comm->maxGpuRanks);
+    minCTAs = std::min(minCTAs, maxCTAs);
+  }
+
   // Honor NCCL_MIN_NRINGS/NCCL_MAX_NRINGS.
   // We permit combining max, then min, to only use the first channels, then duplicate them.
   if (comm->sharedRes->owner != comm) {
     /* child comm #channels cannot exceed top parent #channels. */
-    nChannels = comm->nChannels = std::min(std::min(std::min(ncclMaxNchannels(), nChannels), comm->config.maxCTAs), comm->sharedRes->tpNChannels);
-    nChannels = comm->nChannels = copyChannels(comm, nChannels, std::min(std::max(ncclMinNchannels(), comm->config.minCTAs), comm->sharedRes->tpNChannels), ringPrev, ringNext);
+    nChannels = comm->nChannels = std::min(std::min(std::min(ncclMaxNchannels(), nChannels), maxCTAs), comm->sharedRes->tpNChannels);
+    nChannels = comm->nChannels = copyChannels(comm, nChannels, std::min(minCTAs, comm->sharedRes->tpNChannels), ringPrev, ringNext);
   } else {
-    nChannels = comm->nChannels = std::min(std::min(ncclMaxNchannels(), nChannels), comm->config.maxCTAs);
-    nChannels = comm->nChannels = copyChannels(comm, nChannels, std::max(ncclMinNchannels(), comm->config.minCTAs), ringPrev, ringNext);
+    nChannels = comm->nChannels = std::min(std::min(ncclMaxNchannels(), nChannels), maxCTAs);
+    nChannels = comm->nChannels = copyChannels(comm, nChannels, minCTAs, ringPrev, ringNext);
   }
 
   // Create rings array and check all is fine
@@ -422,12 +501,11 @@ ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* firstRanks, int* treePa
 
   free(ringRecv);
   free(ringSend);
-  free(ringPrev);
-  free(ringNext);
   free(treeToParent);
   free(treeToChild0);
   free(treeToChild1);
   free(nvlsHeads);
+  free(nodeOrder);
 
   return ncclSuccess;
 }
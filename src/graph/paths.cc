@@ -92,6 +92,8 @@ static ncclResult_t ncclTopoSetPaths(struct ncclTopoNode* baseNode, struct ncclT
           if (node->type == PCI && remNode->type == PCI) type = PATH_PXB;
           // Consider a path going through the CPU as PATH_PHB
           if (link->type == LINK_PCI && (node->type == CPU || link->remNode->type == CPU)) type = PATH_PHB;
+          // C2C only makes the CPU itself close to the GPU, going further through the CPU is PATH_PHB
+          if (link->type == LINK_C2C && path->count > 0) type = PATH_PHB;
           // Set 1 hop NVLink as NVB
           if (node->type == GPU && path->type == PATH_NVL && type == PATH_NVL && remPath->count > 1) type = PATH_NVB;
 
@@ -273,6 +275,14 @@ ncclResult_t ncclTopoCheckP2p(struct ncclTopoSystem* system, int64_t id1, int64_
     }
   }
 
+  // Valid flag, p2p, read
+  uint8_t* cache = &system->p2pCache[g1][g2];
+  if (*cache) {
+    *p2p = *cache & 1;
+    if (read) *read = (*cache >> 1) & 1;
+    return ncclSuccess;
+  }
+
   // In general, use P2P whenever we can.
   int p2pLevel = PATH_SYS;
 
@@ -302,7 +312,8 @@ compare:
   if (*p2p == 1) {
     // NCCL_IGNORE_DISABLED_P2P=2 is used by unit tests that don't want to
     // validate against NVML at all since they are pretending to be on other hw.
-    if (g1 != g2 && ncclParamIgnoreDisabledP2p() != 2) {
+    // Ranks sharing a GPU have nothing to validate.
+    if (gpu1->gpu.dev != system->nodes[GPU].nodes[g2].gpu.dev && ncclParamIgnoreDisabledP2p() != 2) {
       int indexes[3] = {-1,-1,-1};
       int verticeN = 0;
       NCCLCHECK(ncclNvmlEnsureInitialized());
@@ -331,11 +342,14 @@ compare:
     }
   }
 
+  int p2pRead = 0;
   if (path->type == PATH_NVL) {
     struct ncclTopoNode* gpu2 = system->nodes[GPU].nodes+g2;
     // Enable P2P Read for Ampere/NVLink only
-    if (read && (gpu1->gpu.cudaCompCap == gpu2->gpu.cudaCompCap) && (gpu1->gpu.cudaCompCap == 80)) *read = 1;
+    if ((gpu1->gpu.cudaCompCap == gpu2->gpu.cudaCompCap) && (gpu1->gpu.cudaCompCap == 80)) p2pRead = 1;
   }
+  if (read) *read = p2pRead;
+  *cache = 0x80 | (p2pRead << 1) | *p2p;
 
   return ncclSuccess;
 }
@@ -343,7 +357,80 @@ compare:
 NCCL_PARAM(NetGdrRead, "NET_GDR_READ", -2);
 int ncclTopoUserGdrLevel = -1;
 
-ncclResult_t ncclTopoCheckGdr(struct ncclTopoSystem* system, int64_t busId, int netDev, int read, int* useGdr) {
+// Measured GDR bandwidth per GPU/NIC pair, read from NCCL_NET_GDR_FILE. Each line is
+// "<GPU busId> <net dev> <write GB/s> <read GB/s>", as measured on this node for example
+// with an RDMA benchmark using GPU memory. '#' starts a comment.
+struct ncclGdrMeasure {
+  int64_t busId;
+  int netDev;
+  float bw[2]; // [read]
+};
+static struct ncclGdrMeasure* gdrMeasures = NULL;
+static int gdrMeasureCount = -1;
+static pthread_mutex_t gdrMeasureLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void gdrMeasureLoad() {
+  gdrMeasureCount = 0;
+  const char* file = getenv("NCCL_NET_GDR_FILE");
+  if (file == NULL) return;
+  INFO(NCCL_ENV, "NCCL_NET_GDR_FILE set by environment to %s", file);
+  FILE* f = fopen(file, "r");
+  if (f == NULL) {
+    WARN("Could not open GDR bandwidth file %s : %s", file, strerror(errno));
+    return;
+  }
+  char line[1024];
+  int capacity = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char* comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char busIdStr[64];
+    struct ncclGdrMeasure m;
+    if (sscanf(line, "%63s %d %f %f", busIdStr, &m.netDev, m.bw+0, m.bw+1) != 4) continue;
+    if (busIdToInt64(busIdStr, &m.busId) != ncclSuccess) continue;
+    if (gdrMeasureCount == capacity) {
+      capacity = capacity ? capacity*2 : 16;
+      struct ncclGdrMeasure* measures = (struct ncclGdrMeasure*)realloc(gdrMeasures, capacity*sizeof(struct ncclGdrMeasure));
+      if (measures == NULL) break;
+      gdrMeasures = measures;
+    }
+    gdrMeasures[gdrMeasureCount++] = m;
+  }
+  fclose(f);
+  INFO(NCCL_NET, "Loaded %d GDR bandwidth measurements from %s", gdrMeasureCount, file);
+}
+
+static int gdrMeasuredBw(int64_t busId, int netDev, int read, float* bw) {
+  pthread_mutex_lock(&gdrMeasureLock);
+  if (gdrMeasureCount == -1) gdrMeasureLoad();
+  pthread_mutex_unlock(&gdrMeasureLock);
+  for (int i=0; i<gdrMeasureCount; i++) {
+    if (gdrMeasures[i].busId == busId && gdrMeasures[i].netDev == netDev) {
+      *bw = gdrMeasures[i].bw[read];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Minimum GDR bandwidth, in percent of the NIC bandwidth, for a measured pair to use GDR.
+NCCL_PARAM(NetGdrMinRatio, "NET_GDR_MIN_RATIO", 80);
+// Allow GDR between a C2C attached GPU and a NIC attached to the same CPU.
+NCCL_PARAM(NetGdrC2c, "NET_GDR_C2C", 1);
+
+// Whether the GPU is attached to the CPU of the NIC through C2C, in which case the NIC
+// reaches GPU memory through the coherent C2C link rather than through PCI peer-to-peer.
+static int gdrThroughC2c(struct ncclTopoSystem* system, int g, int n) {
+  struct ncclTopoNode* gpu = system->nodes[GPU].nodes+g;
+  struct ncclTopoNode* net = system->nodes[NET].nodes+n;
+  for (int c=0; c<system->nodes[CPU].count; c++) {
+    if (gpu->paths[CPU][c].type != PATH_C2C) continue;
+    if (net->paths[CPU][c].type <= PATH_PHB) return 1;
+  }
+  return 0;
+}
+
+static ncclResult_t topoCheckGdr(struct ncclTopoSystem* system, int64_t busId, int netDev, int read, int* useGdr) {
   *useGdr = 0;
 
   // Get GPU and NET
@@ -357,9 +444,19 @@ ncclResult_t ncclTopoCheckGdr(struct ncclTopoSystem* system, int64_t busId, int
   if (net->net.gdrSupport == 0) return ncclSuccess;
   if (gpu->gpu.gdrSupport == 0) return ncclSuccess;
 
+  if (read && ncclParamNetGdrRead() == 0) return ncclSuccess;
+
+  // Measured bandwidth replaces the heuristics below
+  float measuredBw;
+  if (gdrMeasuredBw(busId, netDev, read, &measuredBw)) {
+    *useGdr = measuredBw*100 >= net->net.bw*ncclParamNetGdrMinRatio() ? 1 : 0;
+    INFO(NCCL_NET,"GPU Direct RDMA %s for GPU %lx / HCA %d (measured %g GB/s, NIC %g GB/s), read %d",
+        *useGdr ? "Enabled" : "Disabled", busId, netDev, measuredBw, net->net.bw, read);
+    return ncclSuccess;
+  }
+
   if (read) { // For reads (sends) only enable under certain conditions
     int gdrReadParam = ncclParamNetGdrRead();
-    if (gdrReadParam == 0) return ncclSuccess;
     if (gdrReadParam < 0) {
       int nvlink = 0;
       // Since we don't know whether there are other communicators,
@@ -389,6 +486,9 @@ ncclResult_t ncclTopoCheckGdr(struct ncclTopoSystem* system, int64_t busId, int
     struct ncclTopoNode* proxyGpu = system->nodes[GPU].nodes+g;
     distance = proxyGpu->paths[NET][n].type;
   }
+  if (distance == PATH_PHB && ncclTopoUserGdrLevel == -2 && ncclParamNetGdrC2c() && gdrThroughC2c(system, g, n)) {
+    distance = PATH_C2C;
+  }
   if (distance > netGdrLevel) {
     INFO(NCCL_NET,"GPU Direct RDMA Disabled for GPU %lx / HCA %d (distance %d > %d)", busId, netDev, distance, netGdrLevel);
     return ncclSuccess;
@@ -399,6 +499,22 @@ ncclResult_t ncclTopoCheckGdr(struct ncclTopoSystem* system, int64_t busId, int
   return ncclSuccess;
 }
 
+ncclResult_t ncclTopoCheckGdr(struct ncclTopoSystem* system, int64_t busId, int netDev, int read, int* useGdr) {
+  int n, g;
+  NCCLCHECK(ncclTopoIdToIndex(system, NET, netDev, &n));
+  NCCLCHECK(ncclTopoIdToIndex(system, GPU, busId, &g));
+  // Valid flag and result for read=0 in bits 0-1, for read=1 in bits 2-3
+  uint8_t* cache = &system->gdrCache[g][n];
+  int shift = read ? 2 : 0;
+  if ((*cache >> shift) & 1) {
+    *useGdr = (*cache >> (shift+1)) & 1;
+    return ncclSuccess;
+  }
+  NCCLCHECK(topoCheckGdr(system, busId, netDev, read, useGdr));
+  *cache |= (1 | (*useGdr << 1)) << shift;
+  return ncclSuccess;
+}
+
 // Set to 0 to disable the flush on Hopper when using GDR
 NCCL_PARAM(NetForceFlush, "NET_FORCE_FLUSH", 1);
 
@@ -522,6 +638,7 @@ ncclResult_t ncclTopoComputePaths(struct ncclTopoSystem* system, struct ncclComm
 
   // Remove everything in case we're re-computing
   for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) ncclTopoRemovePathType(system, t);
+  ncclTopoClearCaches(system);
 
   // Set direct paths to CPUs. We need them in many cases.
   for (int c=0; c<system->nodes[CPU].count; c++) {
@@ -611,6 +728,77 @@ ncclResult_t ncclTopoComputePaths(struct ncclTopoSystem* system, struct ncclComm
       }
     }
   }
+  // Results computed above were based on partially updated paths
+  ncclTopoClearCaches(system);
+  return ncclSuccess;
+}
+
+// Find the node owning a link, from its address since links are embedded in nodes.
+static struct ncclTopoNode* linkOwner(struct ncclTopoSystem* system, struct ncclTopoLink* link) {
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    struct ncclTopoNode* nodes = system->nodes[t].nodes;
+    if ((char*)link >= (char*)nodes && (char*)link < (char*)(nodes+system->nodes[t].count)) {
+      return nodes + ((char*)link-(char*)nodes)/sizeof(struct ncclTopoNode);
+    }
+  }
+  return NULL;
+}
+
+// Remove a node without recomputing paths. This is only valid when no remaining path goes
+// through the node, e.g. for NICs which are leaves in the topology; *kept is set to false (and
+// paths are left alone) otherwise, in which case paths must be recomputed.
+// Paths are lists of pointers to links, which ncclTopoRemoveNode moves in two ways: links to
+// the removed node are removed from their node's array, and nodes after the removed one are
+// shifted down. We rewrite every pointer to where its link will be, then remove the node's
+// entry from the paths to its type.
+static ncclResult_t ncclTopoRemoveNodeKeepPaths(struct ncclTopoSystem* system, int type, int index, bool* kept) {
+  struct ncclTopoNode* delNode = system->nodes[type].nodes+index;
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<system->nodes[t].count; n++) {
+      struct ncclTopoNode* node = system->nodes[t].nodes+n;
+      if (node == delNode) continue;
+      for (int p=0; p<NCCL_TOPO_NODE_TYPES; p++) {
+        if (node->paths[p] == NULL) continue;
+        for (int i=0; i<system->nodes[p].count; i++) {
+          if (p == type && i == index) continue;
+          struct ncclTopoLinkList* path = node->paths[p]+i;
+          for (int h=0; h<path->count; h++) {
+            if (path->list[h]->remNode == delNode || linkOwner(system, path->list[h]) == delNode) {
+              *kept = false;
+              return ncclSuccess;
+            }
+          }
+        }
+      }
+    }
+  }
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<system->nodes[t].count; n++) {
+      struct ncclTopoNode* node = system->nodes[t].nodes+n;
+      if (node == delNode) continue;
+      for (int p=0; p<NCCL_TOPO_NODE_TYPES; p++) {
+        if (node->paths[p] == NULL) continue;
+        for (int i=0; i<system->nodes[p].count; i++) {
+          struct ncclTopoLinkList* path = node->paths[p]+i;
+          if (p == type && i == index) continue;
+          for (int h=0; h<path->count; h++) {
+            struct ncclTopoLink* link = path->list[h];
+            struct ncclTopoNode* owner = linkOwner(system, link);
+            int l = link - owner->links, removed = 0;
+            for (int k=0; k<l; k++) if (owner->links[k].remNode == delNode) removed++;
+            if (owner->type == type && owner > delNode) owner--;
+            path->list[h] = owner->links + l - removed;
+          }
+        }
+        if (p == type) {
+          memmove(node->paths[p]+index, node->paths[p]+index+1, (system->nodes[p].count-index-1)*sizeof(struct ncclTopoLinkList));
+        }
+      }
+    }
+  }
+  // ncclTopoRemoveNode frees the paths of the node itself
+  NCCLCHECK(ncclTopoRemoveNode(system, type, index));
+  *kept = true;
   return ncclSuccess;
 }
 
@@ -620,6 +808,7 @@ ncclResult_t ncclTopoTrimSystem(struct ncclTopoSystem* system, struct ncclComm*
   NCCLCHECK(ncclCalloc(&domains, system->nodes[GPU].count));
   NCCLCHECK(ncclCalloc(&ids, system->nodes[GPU].count));
   int myDomain = 0;
+  bool recompute = false;
   for (int g=0; g<system->nodes[GPU].count; g++) {
     struct ncclTopoNode* gpu = system->nodes[GPU].nodes+g;
     domains[g] = g;
@@ -648,14 +837,25 @@ ncclResult_t ncclTopoTrimSystem(struct ncclTopoSystem* system, struct ncclComm*
       return ncclInternalError;
     }
     NCCLCHECK(ncclTopoRemoveNode(system, GPU, g));
+    // Which GPU is local to a NIC may have changed (PXN), recompute everything.
+    recompute = true;
   }
 
   if (system->nodes[GPU].count == comm->nRanks) {
-    for (int n=system->nodes[NET].count-1; n>=0; n--)
-      NCCLCHECK(ncclTopoRemoveNode(system, NET, n));
+    for (int n=system->nodes[NET].count-1; n>=0; n--) {
+      bool kept = false;
+      if (!recompute) NCCLCHECK(ncclTopoRemoveNodeKeepPaths(system, NET, n, &kept));
+      if (!kept) {
+        NCCLCHECK(ncclTopoRemoveNode(system, NET, n));
+        recompute = true;
+      }
+    }
+    ncclTopoRemovePathType(system, NET);
+    ncclTopoClearCaches(system);
   }
   free(domains);
   free(ids);
+  if (recompute) NCCLCHECK(ncclTopoComputePaths(system, comm));
   return ncclSuccess;
 }
 
@@ -664,6 +864,87 @@ void ncclTopoFree(struct ncclTopoSystem* system) {
   free(system);
 }
 
+template <typename T>
+static inline void relocate(T*& ptr, intptr_t shift) { ptr = (T*)((char*)ptr + shift); }
+
+// Deep copy of a system, including paths. Nodes and links are embedded in the system structure,
+// so pointers only need to be shifted by the distance between the two copies.
+ncclResult_t ncclTopoDupSystem(struct ncclTopoSystem* system, struct ncclTopoSystem** copy) {
+  struct ncclTopoSystem* dup;
+  NCCLCHECK(ncclCalloc(&dup, 1));
+  memcpy(dup, system, sizeof(struct ncclTopoSystem));
+  const intptr_t shift = (char*)dup - (char*)system;
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<dup->nodes[t].count; n++) {
+      struct ncclTopoNode* node = dup->nodes[t].nodes+n;
+      for (int l=0; l<node->nlinks; l++) relocate(node->links[l].remNode, shift);
+      for (int p=0; p<NCCL_TOPO_NODE_TYPES; p++) node->paths[p] = NULL;
+    }
+  }
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<dup->nodes[t].count; n++) {
+      struct ncclTopoNode* src = system->nodes[t].nodes+n;
+      struct ncclTopoNode* node = dup->nodes[t].nodes+n;
+      for (int p=0; p<NCCL_TOPO_NODE_TYPES; p++) {
+        if (src->paths[p] == NULL) continue;
+        int count = system->nodes[p].count;
+        if (ncclCalloc(node->paths+p, count) != ncclSuccess) {
+          ncclTopoFree(dup);
+          return ncclSystemError;
+        }
+        memcpy(node->paths[p], src->paths[p], count*sizeof(struct ncclTopoLinkList));
+        for (int i=0; i<count; i++) {
+          struct ncclTopoLinkList* path = node->paths[p]+i;
+          for (int h=0; h<path->count; h++) relocate(path->list[h], shift);
+        }
+      }
+    }
+  }
+  *copy = dup;
+  return ncclSuccess;
+}
+
+// Rank of the child on the local GPU with the given bus ID
+static int splitLocalRank(struct ncclComm* comm, int64_t busId) {
+  uint64_t hostHash = comm->peerInfo[comm->rank].hostHash;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (comm->peerInfo[r].hostHash == hostHash && comm->peerInfo[r].busId == busId) return r;
+  }
+  return -1;
+}
+
+ncclResult_t ncclTopoSplitSystem(struct ncclComm* comm, struct ncclComm* parent, struct ncclTopoSystem** system) {
+  NCCLCHECK(ncclTopoDupSystem(parent->topo, system));
+  for (int g=0; g<(*system)->nodes[GPU].count; g++) {
+    struct ncclTopoNode* gpu = (*system)->nodes[GPU].nodes+g;
+    gpu->gpu.rank = splitLocalRank(comm, gpu->id);
+    if (gpu->gpu.rank == -1) {
+      WARN("Split : could not find GPU %lx in child communicator", gpu->id);
+      return ncclInternalError;
+    }
+  }
+  INFO(NCCL_INIT, "Reusing topology of parent communicator");
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoSplitGraph(struct ncclComm* comm, struct ncclComm* parent, struct ncclTopoGraph* src, struct ncclTopoGraph* graph) {
+  int ngpus = comm->topo->nodes[GPU].count;
+  // NVLS channels only have their head GPU
+  int n = src->pattern == NCCL_TOPO_PATTERN_NVLS ? 1 : ngpus;
+  memcpy(graph, src, sizeof(struct ncclTopoGraph));
+  for (int c=0; c<graph->nChannels; c++) {
+    for (int g=0; g<n; g++) {
+      int* r = graph->intra+c*ngpus+g;
+      *r = splitLocalRank(comm, parent->peerInfo[*r].busId);
+      if (*r == -1) {
+        WARN("Split : could not find parent rank %d in child communicator", src->intra[c*ngpus+g]);
+        return ncclInternalError;
+      }
+    }
+  }
+  return ncclSuccess;
+}
+
 NCCL_PARAM(NChannelsPerNetPeer, "NCHANNELS_PER_NET_PEER", 2);
 
 static ncclResult_t ncclTopoGetNchannels(struct ncclTopoSystem* system, int g /*local gpu index*/, int peerRank, int* nChannels) {
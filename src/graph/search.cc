@@ -619,6 +619,57 @@ ncclResult_t ncclTopoSearchParams(struct ncclTopoSystem* system, int pattern, in
   return ncclSuccess;
 }
 
+NCCL_PARAM(TopoNvsFastSearch, "TOPO_NVS_FAST_SEARCH", 1);
+
+// Check whether all GPUs hang off a single NVSwitch with the same bandwidth,
+// in which case all GPU orders are equivalent.
+static int ncclTopoNvsSymmetric(struct ncclTopoSystem* system) {
+  int ngpus = system->nodes[GPU].count;
+  if (system->nodes[NVS].count != 1 || system->nodes[NET].count != 0 || ngpus <= 2) return 0;
+  float bw = system->nodes[GPU].nodes[0].paths[GPU][1].bw;
+  for (int g=0; g<ngpus; g++) {
+    struct ncclTopoLinkList* paths = system->nodes[GPU].nodes[g].paths[GPU];
+    for (int p=0; p<ngpus; p++) {
+      if (p == g) continue;
+      if (paths[p].type != PATH_NVL || paths[p].count != 2 || paths[p].bw != bw) return 0;
+    }
+  }
+  return 1;
+}
+
+// Symmetric NVSwitch systems : build channels in GPU order until we run out
+// of bandwidth instead of exploring GPU permutations, which would not find
+// anything better and would time out for large NVLink domains.
+static ncclResult_t ncclTopoSearchNvsSymmetric(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoGraph* saveGraph, int backToFirstRank, int* time) {
+  int ngpus = system->nodes[GPU].count;
+  int nEdges = backToFirstRank == -1 ? ngpus-1 : ngpus;
+  int nChannels = graph->nChannels;
+  struct ncclTopoNode* next;
+  while (graph->nChannels < graph->maxChannels && *time > 0) {
+    int e;
+    for (e=0; e<nEdges; e++) {
+      NCCLCHECK(ncclTopoFollowPath(system, graph, GPU, e, GPU, (e+1)%ngpus, 1, &next));
+      if (next == NULL) break;
+    }
+    (*time)--;
+    if (e < nEdges) {
+      while (e-- > 0) NCCLCHECK(ncclTopoFollowPath(system, graph, GPU, e, GPU, (e+1)%ngpus, -1, &next));
+      break;
+    }
+    for (int g=0; g<ngpus; g++) graph->intra[graph->nChannels*ngpus+g] = system->nodes[GPU].nodes[g].gpu.rank;
+    graph->nChannels++;
+    int copy = 0;
+    NCCLCHECK(ncclTopoCompareGraphs(system, graph, saveGraph, &copy));
+    if (copy) memcpy(saveGraph, graph, sizeof(struct ncclTopoGraph));
+  }
+  // Give back the bandwidth we took
+  while (graph->nChannels > nChannels) {
+    graph->nChannels--;
+    for (int e=0; e<nEdges; e++) NCCLCHECK(ncclTopoFollowPath(system, graph, GPU, e, GPU, (e+1)%ngpus, -1, &next));
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoSearchRec(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoGraph* saveGraph, int* time) {
   int backToNet, backToFirstRank;
   NCCLCHECK(ncclTopoSearchParams(system, graph->pattern, &backToNet, &backToFirstRank));
@@ -630,6 +681,9 @@ ncclResult_t ncclTopoSearchRec(struct ncclTopoSystem* system, struct ncclTopoGra
     if (graph->pattern == NCCL_TOPO_PATTERN_NVLS) {
       NCCLCHECK(ncclTopoSearchTryGpu(system, graph, saveGraph, 0, backToNet, backToFirstRank, 0, time, -1, -1, graph->nChannels));
       return ncclSuccess;
+    } else if (ncclParamTopoNvsFastSearch() && ncclTopoNvsSymmetric(system)) {
+      NCCLCHECK(ncclTopoSearchNvsSymmetric(system, graph, saveGraph, backToFirstRank, time));
+      return ncclSuccess;
     } else if (graph->nChannels == 0) {
       // Try PCI order first
       NCCLCHECK(ncclTopoSearchTryGpu(system, graph, saveGraph, 0, backToNet, backToFirstRank, FORCED_ORDER_PCI, time, -1, -1, 0));
@@ -657,6 +711,7 @@ struct kvDict kvDictLinkType[] = {
   { "LOC", PATH_LOC },
   { "NVL", PATH_NVL },
   { "NVB", PATH_NVB },
+  { "C2C", PATH_C2C },
   { "PIX", PATH_PIX },
   { "PXB", PATH_PXB },
   { "PXN", PATH_PXN },
@@ -678,8 +733,11 @@ ncclResult_t ncclTopoGetChannelFromXml(struct ncclXmlNode *xmlChannel, int c, st
       inter[n++] = dev;
     } else if (strcmp(sub->name, "gpu") == 0) {
       int rank = -1;
-      for (int g=0; g<ngpus; g++) {
-        if (system->nodes[GPU].nodes[g].gpu.dev == dev) rank = system->nodes[GPU].nodes[g].gpu.rank;
+      for (int i=0; i<ngpus && rank == -1; i++) {
+        if (system->nodes[GPU].nodes[i].gpu.dev != dev) continue;
+        rank = system->nodes[GPU].nodes[i].gpu.rank;
+        // Ranks sharing a GPU have the same dev, take the next one not in the channel yet
+        for (int p=0; p<g; p++) if (intra[p] == rank) rank = -1;
       }
       if (rank == -1) {
         WARN("XML Import Channel : dev %d not found.", dev);
@@ -979,6 +1037,56 @@ done:
   return ncclSuccess;
 }
 
+NCCL_PARAM(TopoSearchThreads, "TOPO_SEARCH_THREADS", 4);
+
+struct ncclTopoSearchJob {
+  struct ncclTopoSystem* system;
+  struct ncclTopoGraph* graph;
+  ncclResult_t ret;
+};
+
+static void* ncclTopoSearchThreadMain(void* arg) {
+  struct ncclTopoSearchJob* job = (struct ncclTopoSearchJob*)arg;
+  job->ret = ncclTopoCompute(job->system, job->graph);
+  return NULL;
+}
+
+ncclResult_t ncclTopoComputeConcurrent(struct ncclTopoSystem* system, int ngraphs, struct ncclTopoGraph** graphs) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclTopoSearchJob jobs[NCCL_NUM_ALGORITHMS];
+  pthread_t threads[NCCL_NUM_ALGORITHMS];
+  int nThreads = std::min(ngraphs, (int)ncclParamTopoSearchThreads());
+  if (ngraphs > NCCL_NUM_ALGORITHMS) nThreads = 1;
+  if (nThreads <= 1) {
+    for (int g=0; g<ngraphs; g++) NCCLCHECK(ncclTopoCompute(system, graphs[g]));
+    return ncclSuccess;
+  }
+  // The search temporarily takes bandwidth from the links it goes through, so concurrent
+  // searches need their own copy of the system. The calling thread works on the original.
+  int nJobs = 0;
+  for (int g=0; g<ngraphs; g++) {
+    jobs[g].graph = graphs[g];
+    jobs[g].system = system;
+    jobs[g].ret = ncclSuccess;
+    if (g > 0 && g < nThreads) NCCLCHECKGOTO(ncclTopoDupSystem(system, &jobs[g].system), ret, exit);
+    nJobs = g+1;
+  }
+  for (int g=1; g<nThreads; g++) {
+    if (pthread_create(threads+g, NULL, ncclTopoSearchThreadMain, jobs+g) != 0) {
+      // Run it ourselves
+      threads[g] = 0;
+      jobs[g].ret = ncclTopoCompute(jobs[g].system, jobs[g].graph);
+    }
+  }
+  jobs[0].ret = ncclTopoCompute(system, graphs[0]);
+  for (int g=nThreads; g<ngraphs; g++) jobs[g].ret = ncclTopoCompute(system, graphs[g]);
+  for (int g=1; g<nThreads; g++) if (threads[g]) pthread_join(threads[g], NULL);
+  for (int g=0; g<ngraphs; g++) if (jobs[g].ret != ncclSuccess) ret = jobs[g].ret;
+exit:
+  for (int g=1; g<std::min(nJobs, nThreads); g++) if (jobs[g].system != system) ncclTopoFree(jobs[g].system);
+  return ret;
+}
+
 ncclResult_t ncclTopoPrintGraph(struct ncclTopoSystem* system, struct ncclTopoGraph* graph) {
   INFO(NCCL_GRAPH, "Pattern %d, crossNic %d, nChannels %d, bw %f/%f, type %s/%s, sameChannels %d", graph->pattern, graph->crossNic, graph->nChannels, graph->bwIntra, graph->bwInter, topoPathTypeStr[graph->typeIntra], topoPathTypeStr[graph->typeInter], graph->sameChannels);
   int ngpus = system->nodes[GPU].count;
@@ -1004,6 +1112,26 @@ ncclResult_t ncclTopoPrintGraph(struct ncclTopoSystem* system, struct ncclTopoGr
   return ncclSuccess;
 }
 
+ncclResult_t ncclTopoRotateChannels(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, int offset) {
+  int nChannels = graph->nChannels;
+  if (nChannels == 0 || offset%nChannels == 0) return ncclSuccess;
+  int ngpus = system->nodes[GPU].count;
+  int* intra;
+  int inter[MAXCHANNELS*2];
+  NCCLCHECK(ncclCalloc(&intra, nChannels*ngpus));
+  memcpy(intra, graph->intra, nChannels*ngpus*sizeof(int));
+  memcpy(inter, graph->inter, nChannels*2*sizeof(int));
+  for (int c=0; c<nChannels; c++) {
+    int src = (c+offset)%nChannels;
+    memcpy(graph->intra+c*ngpus, intra+src*ngpus, ngpus*sizeof(int));
+    graph->inter[2*c] = inter[2*src];
+    graph->inter[2*c+1] = inter[2*src+1];
+  }
+  free(intra);
+  INFO(NCCL_GRAPH, "Pattern %d, channels rotated by %d", graph->pattern, offset%nChannels);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoDumpGraphs(struct ncclTopoSystem* system, int ngraphs, struct ncclTopoGraph** graphs) {
   char* str = getenv("NCCL_GRAPH_DUMP_FILE");
   if (str) {
@@ -1018,6 +1146,100 @@ ncclResult_t ncclTopoDumpGraphs(struct ncclTopoSystem* system, int ngraphs, stru
 }
 
 #include "comm.h"
+#include "stats.h"
+
+// Graph search cache. The result of ncclTopoCompute only depends on the topology and on a few
+// environment variables, so we store the graphs in NCCL_GRAPH_CACHE_DIR under a file named after
+// a fingerprint of both, and reuse them on the next init with the same fingerprint.
+static const char* graphCacheEnv[] = { "NCCL_CROSS_NIC", "NCCL_P2P_LEVEL", "NCCL_P2P_DISABLE", "NCCL_SHM_DISABLE",
+  "NCCL_NET_GDR_LEVEL", "NCCL_NET_GDR_READ", "NCCL_NVB_DISABLE", "NCCL_IGNORE_DISABLED_P2P", "NCCL_NET_DISABLE_INTRA",
+  "NCCL_PXN_DISABLE", "NCCL_COLLNET_ENABLE", "NCCL_NVLS_ENABLE", "NCCL_TOPO_FILE" };
+
+static uint64_t graphCacheFingerprint(struct ncclComm* comm, int ngraphs, struct ncclTopoGraph** graphs) {
+  uint64_t hash = comm->topo->xmlHash;
+  hash = hash*31 ^ NCCL_VERSION_CODE;
+  hash = hash*31 ^ (comm->collNetSupport | (comm->nvlsSupport << 1));
+  for (int g=0; g<ngraphs; g++) {
+    // Channel bounds of later graphs derive from earlier results, only hash what identifies the graph.
+    hash = hash*31 ^ (graphs[g]->id | (graphs[g]->pattern << 8) | (graphs[g]->collNet << 16));
+  }
+  for (int e=0; e<sizeof(graphCacheEnv)/sizeof(graphCacheEnv[0]); e++) {
+    const char* str = getenv(graphCacheEnv[e]);
+    hash = hash*31 ^ (str ? getHash(str, strlen(str)) : 0);
+  }
+  return hash;
+}
+
+static bool graphCacheFile(struct ncclComm* comm, int ngraphs, struct ncclTopoGraph** graphs, char* fileName, uint64_t* fingerprint) {
+  const char* dir = getenv("NCCL_GRAPH_CACHE_DIR");
+  if (dir == NULL || dir[0] == '\0') return false;
+  // Graphs given by the user take precedence.
+  if (getenv("NCCL_GRAPH_FILE")) return false;
+  *fingerprint = graphCacheFingerprint(comm, ngraphs, graphs);
+  snprintf(fileName, PATH_MAX, "%s/nccl-graphs-%016lx.xml", dir, *fingerprint);
+  return true;
+}
+
+ncclResult_t ncclTopoGraphCacheLoad(struct ncclComm* comm, int ngraphs, struct ncclTopoGraph** graphs, int* loaded) {
+  ncclResult_t ret = ncclSuccess;
+  char fileName[PATH_MAX];
+  uint64_t fingerprint;
+  struct ncclXml* xml = NULL;
+  *loaded = 0;
+  if (!graphCacheFile(comm, ngraphs, graphs, fileName, &fingerprint)) return ncclSuccess;
+  if (access(fileName, R_OK) != 0) {
+    INFO(NCCL_GRAPH, "Graph cache miss for fingerprint %016lx", fingerprint);
+    return ncclSuccess;
+  }
+  NCCLCHECK(ncclCalloc(&xml, 1));
+  if (ncclTopoGetXmlGraphFromFile(fileName, xml) == ncclSuccess && xml->maxIndex > 0) {
+    const char* str;
+    NCCLCHECKGOTO(xmlGetAttr(xml->nodes, "fingerprint", &str), ret, exit);
+    if (str == NULL || strtoull(str, NULL, 16) != fingerprint) goto mismatch;
+    for (int g=0; g<ngraphs; g++) {
+      int nChannels = -1;
+      graphs[g]->nChannels = 0;
+      if (ncclTopoGetGraphFromXml(xml->nodes, comm->topo, graphs[g], &nChannels) != ncclSuccess || nChannels == -1) goto mismatch;
+    }
+    *loaded = 1;
+    INFO(NCCL_GRAPH, "Loaded %d graphs from cache %s", ngraphs, fileName);
+    goto exit;
+  }
+mismatch:
+  INFO(NCCL_GRAPH, "Ignoring invalid graph cache file %s", fileName);
+exit:
+  free(xml);
+  return ret;
+}
+
+ncclResult_t ncclTopoGraphCacheSave(struct ncclComm* comm, int ngraphs, struct ncclTopoGraph** graphs) {
+  ncclResult_t ret = ncclSuccess;
+  char fileName[PATH_MAX];
+  char tmpName[PATH_MAX+32];
+  uint64_t fingerprint;
+  struct ncclXml* xml = NULL;
+  if (!graphCacheFile(comm, ngraphs, graphs, fileName, &fingerprint)) return ncclSuccess;
+  if (access(fileName, F_OK) == 0) return ncclSuccess; // Another rank saved it already
+  NCCLCHECK(ncclCalloc(&xml, 1));
+  NCCLCHECKGOTO(ncclTopoGetXmlFromGraphs(ngraphs, graphs, comm->topo, xml), ret, exit);
+  char str[32];
+  snprintf(str, sizeof(str), "%016lx", fingerprint);
+  NCCLCHECKGOTO(xmlSetAttr(xml->nodes, "fingerprint", str), ret, exit);
+  // Ranks on the same node likely write the same file concurrently : write to a temporary file
+  // and atomically rename it.
+  snprintf(tmpName, sizeof(tmpName), "%s.%d.tmp", fileName, getpid());
+  NCCLCHECKGOTO(ncclTopoDumpXmlToFile(tmpName, xml), ret, exit);
+  if (rename(tmpName, fileName) != 0) {
+    INFO(NCCL_GRAPH, "Could not save graph cache %s : %s", fileName, strerror(errno));
+    unlink(tmpName);
+  } else {
+    INFO(NCCL_GRAPH, "Saved graphs to cache %s", fileName);
+  }
+exit:
+  free(xml);
+  return ret;
+}
+
 // NVLS channels aren't compute channels. Find which NIC corresponds to our rank being the head
 ncclResult_t getNvlsNetDev(struct ncclComm* comm, struct ncclTopoGraph* graph, int* dev) {
   int localRanks = comm->topo->nodes[GPU].count;
@@ -1034,6 +1256,25 @@ ncclResult_t getNvlsNetDev(struct ncclComm* comm, struct ncclTopoGraph* graph, i
 // 0: don't use PXN for P2P, 1: use PXN if needed, 2: use PXN as much as possible to maximize aggregation
 NCCL_PARAM(P2pPxnLevel, "P2P_PXN_LEVEL", 2);
 
+// Steer new p2p connections away from local NICs running slower than the others at runtime
+NCCL_PARAM(NetRebalance, "NET_REBALANCE", 0);
+
+// Move to the next local NIC in round-robin order which is not degraded. Connections which
+// are already established keep their NIC; if all local NICs are degraded, keep the original.
+static ncclResult_t avoidDegradedNet(struct ncclComm* comm, int rank, int channelId, int* dev) {
+  if (ncclProxyStatsNetDegraded(comm->proxyState, *dev) == 0) return ncclSuccess;
+  for (int c=1; c<64; c++) {
+    int netDev;
+    NCCLCHECK(ncclTopoGetLocalNet(comm->topo, rank, channelId+c, &netDev));
+    if (netDev != *dev && ncclProxyStatsNetDegraded(comm->proxyState, netDev) == 0) {
+      INFO(NCCL_NET, "Rank %d channel %d : moving p2p connection from degraded NET/%d to NET/%d", rank, channelId, *dev, netDev);
+      *dev = netDev;
+      break;
+    }
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoGetNetDev(struct ncclComm* comm, int rank, struct ncclTopoGraph* graph, int channelId, int peerRank, int* dev, int* proxyRank) {
   if (graph) {
     // Honor the net device in the graph
@@ -1049,6 +1290,8 @@ ncclResult_t ncclTopoGetNetDev(struct ncclComm* comm, int rank, struct ncclTopoG
   } else if (peerRank == -1) {
     return ncclInternalError;
   } else {
+    // Spread the peers of communicators with different channel offsets on different NICs
+    channelId += comm->config.channelOffset;
     // Start with our local NIC and local Rank
     NCCLCHECK(ncclTopoGetLocalNet(comm->topo, rank, channelId, dev));
     *proxyRank = rank;
@@ -1097,6 +1340,10 @@ ncclResult_t ncclTopoGetNetDev(struct ncclComm* comm, int rank, struct ncclTopoG
         }
       }
     }
+    // The NIC only has to match the peer's with NCCL_CROSS_NIC=0, and we only monitor our own NICs
+    if (ncclParamNetRebalance() && ncclParamCrossNic() != 0 && *proxyRank == rank) {
+      NCCLCHECK(avoidDegradedNet(comm, rank, channelId, dev));
+    }
   }
   return ncclSuccess;
 }
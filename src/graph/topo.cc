@@ -11,6 +11,7 @@
 #include "nvmlwrap.h"
 #include "net.h"
 #include "coll_net.h"
+#include "bootstrap.h"
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "xml.h"
@@ -20,8 +21,8 @@
 #define BUSID_REDUCED_SIZE (sizeof("0000:00"))
 
 const char* topoNodeTypeStr[] = { "GPU", "PCI", "NVS", "CPU", "NIC", "NET" };
-const char* topoLinkTypeStr[] = { "LOC", "NVL", "",    "PCI",    "",    "",    "", "SYS", "NET" };
-const char* topoPathTypeStr[] = { "LOC", "NVL", "NVB", "PIX", "PXB", "PXN", "PHB", "SYS", "DIS" };
+const char* topoLinkTypeStr[] = { "LOC", "NVL", "",    "C2C", "PCI",    "",    "",    "", "SYS", "NET" };
+const char* topoPathTypeStr[] = { "LOC", "NVL", "NVB", "C2C", "PIX", "PXB", "PXN", "PHB", "SYS", "NET", "DIS" };
 
 /******************************************************************/
 /******************* Graph Creation Functions *********************/
@@ -489,8 +490,38 @@ ncclResult_t ncclTopoAddCpu(struct ncclXmlNode* xmlCpu, struct ncclTopoSystem* s
   return ncclSuccess;
 }
 
+// NVLink-C2C between a GPU and its CPU (Grace Hopper). Host memory is then close to the GPU.
+static ncclResult_t ncclTopoAddC2c(struct ncclXmlNode* node, struct ncclTopoSystem* system, const char* parentBusId) {
+  struct ncclTopoNode* gpu = NULL;
+  int64_t pBusId;
+  NCCLCHECK(busIdToInt64(parentBusId, &pBusId));
+  NCCLCHECK(ncclTopoGetNode(system, &gpu, GPU, pBusId));
+  if (gpu == NULL) {
+    WARN("Add C2C error : could not find GPU %lx", pBusId);
+    return ncclInternalError;
+  }
+  int count, index;
+  NCCLCHECK(xmlGetAttrInt(node, "count", &count));
+  // Per link bandwidth in MB/s, as reported by NVML. Count C2C links like NVLinks otherwise.
+  float bw = count*ncclTopoNVLinkBw(gpu->gpu.cudaCompCap);
+  NCCLCHECK(xmlGetAttrIndex(node, "bw", &index));
+  if (index != -1) {
+    int linkBw;
+    NCCLCHECK(xmlGetAttrInt(node, "bw", &linkBw));
+    bw = count*linkBw/1000.0;
+  }
+  struct ncclTopoNode* cpu = NULL;
+  NCCLCHECK(findLocalCpu(gpu, &cpu));
+  if (cpu == NULL || count == 0) return ncclSuccess;
+  NCCLCHECK(ncclTopoConnectNodes(gpu, cpu, LINK_C2C, bw));
+  NCCLCHECK(ncclTopoConnectNodes(cpu, gpu, LINK_C2C, bw));
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoAddNvLinks(struct ncclXmlNode* node, struct ncclTopoSystem* system, const char* parentBusId) {
-  if (strcmp(node->name, "nvlink") == 0) {
+  if (strcmp(node->name, "c2c") == 0) {
+    NCCLCHECK(ncclTopoAddC2c(node, system, parentBusId));
+  } else if (strcmp(node->name, "nvlink") == 0) {
     struct ncclTopoNode* gpu = NULL;
     int64_t pBusId;
     NCCLCHECK(busIdToInt64(parentBusId, &pBusId));
@@ -592,9 +623,30 @@ static ncclResult_t xmlInitAttrFloat(struct ncclXmlNode* node, const char* attrN
 }
 
 
-ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** system) {
-  struct ncclXml* xml;
-  NCCLCHECK(ncclCalloc(&xml, 1));
+// Hash every node name and attribute of the (trimmed) XML, in order.
+static uint64_t ncclTopoXmlHash(struct ncclXml* xml) {
+  uint64_t hash = 5381;
+  for (int n=0; n<xml->maxIndex; n++) {
+    struct ncclXmlNode* node = xml->nodes+n;
+    hash = hash*31 ^ getHash(node->name, strlen(node->name));
+    for (int a=0; a<node->nAttrs; a++) {
+      hash = hash*31 ^ getHash(node->attrs[a].key, strlen(node->attrs[a].key));
+      hash = hash*31 ^ getHash(node->attrs[a].value, strlen(node->attrs[a].value));
+    }
+  }
+  return hash;
+}
+
+// Lowest local rank on the GPU of rank r. Ranks sharing a GPU (NCCL_SHARED_GPU) only appear
+// in the XML through that one, the others are added to the system afterwards.
+static int topoGpuFirstRank(struct ncclComm* comm, int r) {
+  for (int p=0; p<r; p++) {
+    if (comm->peerInfo[p].hostHash == comm->peerInfo[r].hostHash && comm->peerInfo[p].busId == comm->peerInfo[r].busId) return p;
+  }
+  return r;
+}
+
+static ncclResult_t ncclTopoDetectXml(struct ncclComm* comm, struct ncclXml* xml) {
   char* xmlTopoFile = getenv("NCCL_TOPO_FILE");
   if (xmlTopoFile) {
     INFO(NCCL_ENV, "NCCL_TOPO_FILE set by environment to %s", xmlTopoFile);
@@ -612,7 +664,7 @@ ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** sy
 
   // Auto-detect GPUs if needed
   for (int r=0; r<comm->nRanks; r++) {
-    if (comm->peerInfo[r].hostHash == comm->peerInfo[comm->rank].hostHash) {
+    if (comm->peerInfo[r].hostHash == comm->peerInfo[comm->rank].hostHash && topoGpuFirstRank(comm, r) == r) {
       char busId[NVML_DEVICE_PCI_BUS_ID_BUFFER_SIZE];
       NCCLCHECK(int64ToBusId(comm->peerInfo[r].busId, busId));
       struct ncclXmlNode* node;
@@ -667,15 +719,213 @@ ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** sy
 
   // Remove XML branches which don't have a node with keep="1" (typically when importing a topology)
   NCCLCHECK(ncclTopoTrimXml(xml));
+  return ncclSuccess;
+}
+
+// Detection walks sysfs and queries NVML and the network plugins. Communicators of a process spanning
+// the same local GPUs get the same XML except for the ranks, so keep one XML per set of local GPUs
+// for the lifetime of the process, and only set the ranks again on reuse.
+NCCL_PARAM(TopoProcessCache, "TOPO_PROCESS_CACHE", 1);
 
-  xmlTopoFile = getenv("NCCL_TOPO_DUMP_FILE");
+struct topoXmlCacheEntry {
+  uint64_t key;
+  char* buff;
+  size_t size;
+  struct topoXmlCacheEntry* next;
+};
+static struct topoXmlCacheEntry* topoXmlCache = NULL;
+static pthread_mutex_t topoXmlCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t topoXmlCacheKey(struct ncclComm* comm) {
+  uint64_t hash = getHash(comm->ncclNet->name, strlen(comm->ncclNet->name));
+  if (collNetSupport(comm)) hash = hash*31 ^ getHash(comm->ncclCollNet->name, strlen(comm->ncclCollNet->name));
+  const char* topoFile = getenv("NCCL_TOPO_FILE");
+  if (topoFile) hash = hash*31 ^ getHash(topoFile, strlen(topoFile));
+  // Ranks are in increasing order, but bus IDs are not : combine them independently of the order.
+  uint64_t gpus = 0;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (comm->peerInfo[r].hostHash != comm->peerInfo[comm->rank].hostHash) continue;
+    uint64_t busId = comm->peerInfo[r].busId;
+    gpus += getHash((const char*)&busId, sizeof(busId));
+  }
+  return hash*31 ^ gpus;
+}
+
+// Set the rank and GDR support of each local GPU in an XML from the cache
+static ncclResult_t topoXmlSetRanks(struct ncclComm* comm, struct ncclXml* xml, int* found) {
+  *found = 0;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (comm->peerInfo[r].hostHash != comm->peerInfo[comm->rank].hostHash || topoGpuFirstRank(comm, r) != r) continue;
+    char busId[NVML_DEVICE_PCI_BUS_ID_BUFFER_SIZE];
+    NCCLCHECK(int64ToBusId(comm->peerInfo[r].busId, busId));
+    struct ncclXmlNode *pciNode, *gpuNode = NULL;
+    NCCLCHECK(xmlFindTagKv(xml, "pci", &pciNode, "busid", busId));
+    if (pciNode) NCCLCHECK(xmlGetSub(pciNode, "gpu", &gpuNode));
+    if (gpuNode == NULL) return ncclSuccess;
+    NCCLCHECK(xmlSetAttrInt(gpuNode, "rank", r));
+    NCCLCHECK(xmlSetAttrInt(gpuNode, "gdr", comm->peerInfo[r].gdrSupport));
+  }
+  *found = 1;
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclTopoDetectXmlCached(struct ncclComm* comm, struct ncclXml* xml) {
+  if (ncclParamTopoProcessCache() == 0) return ncclTopoDetectXml(comm, xml);
+  ncclResult_t ret = ncclSuccess;
+  uint64_t key = topoXmlCacheKey(comm);
+  // Hold the lock while detecting, so that communicators initialized concurrently on the same
+  // GPUs wait for the first one instead of all detecting.
+  pthread_mutex_lock(&topoXmlCacheLock);
+  struct topoXmlCacheEntry* entry = topoXmlCache;
+  while (entry && entry->key != key) entry = entry->next;
+  if (entry) {
+    int found;
+    NCCLCHECKGOTO(ncclTopoGetXmlFromBuffer(entry->buff, entry->size, xml), ret, exit);
+    NCCLCHECKGOTO(topoXmlSetRanks(comm, xml, &found), ret, exit);
+    if (found) {
+      INFO(NCCL_GRAPH, "Reusing topology detected earlier by this process");
+      goto exit;
+    }
+    // Should not happen, detect again
+    memset(xml, 0, sizeof(struct ncclXml));
+  }
+  NCCLCHECKGOTO(ncclTopoDetectXml(comm, xml), ret, exit);
+  if (entry == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&entry, 1), ret, exit);
+    if (ncclTopoDumpXmlToBuffer(xml, &entry->buff, &entry->size) != ncclSuccess) {
+      free(entry);
+      goto exit;
+    }
+    entry->key = key;
+    entry->next = topoXmlCache;
+    topoXmlCache = entry;
+  }
+exit:
+  pthread_mutex_unlock(&topoXmlCacheLock);
+  return ret;
+}
+
+// The XML only depends on the node, so by default the first rank of each node detects it
+// and sends it to the other local ranks, instead of all of them walking sysfs and NVML.
+NCCL_PARAM(TopoShare, "TOPO_SHARE", 1);
+#define TOPO_TAG_XML_SIZE -5 // -4 is used by buffer reclaim
+#define TOPO_TAG_XML -6
+
+// Every other rank on a GPU gets a GPU node of its own, so that graphs place all ranks. It is
+// a copy of the GPU node with the same links, plus local links to the other ranks of the GPU.
+// Its id keeps the bus ID in its low bits, lookups by bus ID (P2P and GDR checks) find the GPU.
+static ncclResult_t ncclTopoAddSharedGpus(struct ncclComm* comm, struct ncclTopoSystem* system) {
+  int nShared = 0;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (comm->peerInfo[r].hostHash != comm->peerInfo[comm->rank].hostHash) continue;
+    int first = topoGpuFirstRank(comm, r);
+    if (first == r) continue;
+    int g;
+    NCCLCHECK(ncclTopoRankToIndex(system, first, &g));
+    struct ncclTopoNode* gpu = system->nodes[GPU].nodes+g;
+    struct ncclTopoNode* shared;
+    NCCLCHECK(ncclTopoCreateNode(system, &shared, GPU, gpu->id + NCCL_TOPO_ID_SHARED(++nShared)));
+    shared->gpu = gpu->gpu;
+    shared->gpu.rank = r;
+    for (int l=0; l<gpu->nlinks; l++) {
+      struct ncclTopoNode* remNode = gpu->links[l].remNode;
+      if (remNode == gpu) continue;
+      if (shared->nlinks == NCCL_TOPO_MAX_LINKS || remNode->nlinks == NCCL_TOPO_MAX_LINKS) {
+        WARN("Shared GPU %lx : too many links to add rank %d", gpu->id, r);
+        return ncclInternalError;
+      }
+      NCCLCHECK(ncclTopoConnectNodes(shared, remNode, gpu->links[l].type, gpu->links[l].bw));
+      for (int rl=0; rl<remNode->nlinks; rl++) {
+        struct ncclTopoLink* link = remNode->links+rl;
+        if (link->remNode != gpu) continue;
+        NCCLCHECK(ncclTopoConnectNodes(remNode, shared, link->type, link->bw));
+        break;
+      }
+    }
+    NCCLCHECK(ncclTopoConnectNodes(gpu, shared, LINK_LOC, LOC_BW));
+    NCCLCHECK(ncclTopoConnectNodes(shared, gpu, LINK_LOC, LOC_BW));
+    system->xmlHash = system->xmlHash*31 ^ (r+1);
+    INFO(NCCL_GRAPH, "Rank %d shares GPU %lx with rank %d", r, gpu->id, first);
+  }
+  if (nShared == 0) return ncclSuccess;
+
+  // Copies of a GPU go through the same PCI and NVLink lanes, so each only gets its share of
+  // a link: a link between two GPUs is shared by all pairs of their ranks.
+  int nGpus = system->nodes[GPU].count;
+  int* gpuRanks;
+  NCCLCHECK(ncclCalloc(&gpuRanks, nGpus));
+  for (int g=0; g<nGpus; g++) {
+    int64_t busId = system->nodes[GPU].nodes[g].id & (NCCL_TOPO_ID_SHARED(1)-1);
+    for (int h=0; h<nGpus; h++) gpuRanks[g] += (system->nodes[GPU].nodes[h].id & (NCCL_TOPO_ID_SHARED(1)-1)) == busId;
+  }
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<system->nodes[t].count; n++) {
+      struct ncclTopoNode* node = system->nodes[t].nodes+n;
+      int nodeRanks = t == GPU ? gpuRanks[n] : 1;
+      for (int l=0; l<node->nlinks; l++) {
+        struct ncclTopoLink* link = node->links+l;
+        if (link->type == LINK_LOC) continue;
+        struct ncclTopoNode* rem = link->remNode;
+        int remRanks = rem->type == GPU ? gpuRanks[rem-system->nodes[GPU].nodes] : 1;
+        link->bw /= nodeRanks*remRanks;
+      }
+    }
+  }
+  free(gpuRanks);
+  // Keep PCI up links last
+  NCCLCHECK(ncclTopoSortSystem(system));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** system) {
+  struct ncclXml* xml;
+  NCCLCHECK(ncclCalloc(&xml, 1));
+
+  int leader = -1, nLocal = 0;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (comm->peerInfo[r].hostHash != comm->peerInfo[comm->rank].hostHash) continue;
+    if (leader == -1) leader = r;
+    nLocal++;
+  }
+  if (ncclParamTopoShare() == 0 || nLocal == 1) {
+    NCCLCHECK(ncclTopoDetectXmlCached(comm, xml));
+  } else if (comm->rank == leader) {
+    NCCLCHECK(ncclTopoDetectXmlCached(comm, xml));
+    char* buff;
+    size_t bytes;
+    NCCLCHECK(ncclTopoDumpXmlToBuffer(xml, &buff, &bytes));
+    int size = bytes;
+    ncclResult_t ret = ncclSuccess;
+    for (int r=leader+1; r<comm->nRanks; r++) {
+      if (comm->peerInfo[r].hostHash != comm->peerInfo[comm->rank].hostHash) continue;
+      NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, r, TOPO_TAG_XML_SIZE, &size, sizeof(int)), ret, sendDone);
+      NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, r, TOPO_TAG_XML, buff, size), ret, sendDone);
+    }
+sendDone:
+    free(buff);
+    NCCLCHECK(ret);
+  } else {
+    int size;
+    NCCLCHECK(bootstrapRecv(comm->bootstrap, leader, TOPO_TAG_XML_SIZE, &size, sizeof(int)));
+    char* buff;
+    NCCLCHECK(ncclCalloc(&buff, size));
+    ncclResult_t ret = bootstrapRecv(comm->bootstrap, leader, TOPO_TAG_XML, buff, size);
+    if (ret == ncclSuccess) ret = ncclTopoGetXmlFromBuffer(buff, size, xml);
+    free(buff);
+    NCCLCHECK(ret);
+    INFO(NCCL_GRAPH, "Topology received from rank %d (%d bytes)", leader, size);
+  }
+
+  char* xmlTopoFile = getenv("NCCL_TOPO_DUMP_FILE");
   if (xmlTopoFile && comm->rank == ncclParamTopoDumpFileRank()) {
     INFO(NCCL_ENV, "NCCL_TOPO_DUMP_FILE set by environment to %s", xmlTopoFile);
     NCCLCHECK(ncclTopoDumpXmlToFile(xmlTopoFile, xml));
   }
 
   NCCLCHECK(ncclTopoGetSystemFromXml(xml, system));
+  (*system)->xmlHash = ncclTopoXmlHash(xml);
   free(xml);
+  NCCLCHECK(ncclTopoAddSharedGpus(comm, *system));
   return ncclSuccess;
 }
 
@@ -878,6 +1128,36 @@ ncclResult_t ncclTopoGetCpuAffinity(struct ncclTopoSystem* system, int rank, cpu
   return ncclSuccess;
 }
 
+// Affinity of the CPU closest to the first NIC used by rank, restricted to the
+// CPUs we are allowed to run on. Left empty when the rank uses no NIC.
+ncclResult_t ncclTopoGetNetCpuAffinity(struct ncclTopoSystem* system, int rank, cpu_set_t* affinity) {
+  CPU_ZERO(affinity);
+  if (system->nodes[NET].count == 0 || system->nodes[CPU].count == 0) return ncclSuccess;
+  int netId, n;
+  if (ncclTopoGetLocalNet(system, rank, 0, &netId) != ncclSuccess) return ncclSuccess;
+  NCCLCHECK(ncclTopoIdToIndex(system, NET, netId, &n));
+  struct ncclTopoNode* net = system->nodes[NET].nodes+n;
+  int cpuIndex = -1, minHops = 0;
+  for (int c=0; c<system->nodes[CPU].count; c++) {
+    if (net->paths[CPU] == NULL) break;
+    int nHops = net->paths[CPU][c].count;
+    if (cpuIndex == -1 || nHops < minHops) {
+      cpuIndex = c;
+      minHops = nHops;
+    }
+  }
+  if (cpuIndex == -1) return ncclSuccess;
+  cpu_set_t cpuMask = system->nodes[CPU].nodes[cpuIndex].cpu.affinity;
+  if (ncclParamIgnoreCpuAffinity()) {
+    memcpy(affinity, &cpuMask, sizeof(cpu_set_t));
+  } else {
+    cpu_set_t mask;
+    SYSCHECK(sched_getaffinity(0, sizeof(cpu_set_t), &mask), "sched_getaffinity");
+    CPU_AND(affinity, &mask, &cpuMask);
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoGetGpuCount(struct ncclTopoSystem* system, int* count) {
   *count = system->nodes[GPU].count;
   return ncclSuccess;
@@ -906,6 +1186,15 @@ ncclResult_t ncclTopoGetCompCap(struct ncclTopoSystem* system, int* ccMin, int*
   return ncclSuccess;
 }
 
+// Position of rank among the ranks of the GPUs of the system, in rank order
+ncclResult_t ncclTopoGetRankIndex(struct ncclTopoSystem* system, int rank, int* index) {
+  *index = 0;
+  for (int g=0; g<system->nodes[GPU].count; g++) {
+    if (system->nodes[GPU].nodes[g].gpu.rank < rank) (*index)++;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoGetLocalRank(struct ncclTopoSystem* system, int rank, int* localRank) {
   for (int g=0; g<system->nodes[GPU].count; g++) {
     if (system->nodes[GPU].nodes[g].gpu.rank == rank) {
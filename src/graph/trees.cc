@@ -5,6 +5,8 @@
  ************************************************************************/
 
 #include "nccl.h"
+#include "checks.h"
+#include "utils.h"
 
 #define RANK_TO_INDEX(r) (rank > root ? rank-1 : rank)
 
@@ -107,3 +109,43 @@ ncclResult_t ncclGetDtree(int nranks, int rank, int* s0, int* d0_0, int* d0_1, i
   }
   return ncclSuccess;
 }
+
+/* K-ary tree, stored as a heap : the children of r are arity*r+1 ... arity*r+arity.
+ * parentChildType is our position among the children of our parent.
+ *
+ * Illustration (arity 4) :
+ *               0
+ *     ______/ /   \ \______
+ *    1       2     3      4
+ *  / | | \  / | | \
+ * 5  6 7  8 9 10 11 12
+ */
+ncclResult_t ncclGetKtree(int nranks, int rank, int arity, int* u, int* d, int* parentChildType) {
+  *u = rank == 0 ? -1 : (rank-1)/arity;
+  *parentChildType = rank == 0 ? 0 : (rank-1)%arity;
+  for (int j=0; j<arity; j++) {
+    int child = arity*rank+1+j;
+    d[j] = child < nranks ? child : -1;
+  }
+  return ncclSuccess;
+}
+
+/* Pair of k-ary trees. The second one is the mirror of the first, so that the nodes
+ * forwarding data in one tree are leaves in the other.
+ */
+ncclResult_t ncclGetDKtree(int nranks, int rank, int arity, int* u0, int* d0, int* parentChildType0, int* u1, int* d1, int* parentChildType1) {
+  NCCLCHECK(ncclGetKtree(nranks, rank, arity, u0, d0, parentChildType0));
+  int u;
+  NCCLCHECK(ncclGetKtree(nranks, nranks-1-rank, arity, &u, d1, parentChildType1));
+  *u1 = u == -1 ? -1 : nranks-1-u;
+  for (int j=0; j<arity; j++) if (d1[j] != -1) d1[j] = nranks-1-d1[j];
+  return ncclSuccess;
+}
+
+// Number of inter-node hops from the root to the deepest leaf
+int ncclTreeLevels(int nranks, int arity) {
+  if (arity == 2) return log2i(nranks);
+  int levels = 0;
+  for (int span = 1, n = 1; n < nranks; n += span) { span *= arity; levels++; }
+  return levels;
+}
@@ -8,9 +8,20 @@
 #include "devcomm.h"
 #include "comm.h"
 #include "topo.h"
+#include "ll128_probe.h"
+#include "trees.h"
 
 NCCL_PARAM(Nthreads, "NTHREADS", -2);
 NCCL_PARAM(Ll128Nthreads, "LL128_NTHREADS", -2);
+int64_t ncclParamP2pWriteThreshold();
+
+// Paths the LL128 self-test needs to have passed for a graph with this intra-node path type
+static int ll128ProbePaths(int typeIntra) {
+  if (typeIntra == PATH_LOC) return 0;
+  if (typeIntra <= PATH_PXB) return NCCL_LL128_PROBE_PEER;
+  // Through the CPU, with P2P or SHM
+  return NCCL_LL128_PROBE_PEER|NCCL_LL128_PROBE_HOST;
+}
 
 static int getNthreads(const char* name, int env, int min, int max, int def) {
   int nt = env;
@@ -58,6 +69,9 @@ static const float baseLat  [NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS] = {
        {  6.8, 14.0,    0 }, {  6.8, 14.0,    0 },       // Collnet Direct, Chain
        {    0,    0, 23.0 }, {    0,    0, 23.0 }};     // NVLS, NVLS Tree
 
+// Launch and staging cost of the one-shot and two-shot AllReduce kernels
+static const float shotArBaseLat = 4.0;
+
 // NVLink, PCI, Network
 #define NCCL_HW_NVLINK 0
 #define NCCL_HW_PCI 1
@@ -117,6 +131,62 @@ static float getNetOverhead(struct ncclComm* comm) {
   else return 1.0;
 }
 
+static int tuningStrIndex(const char* str, const char** names, int n) {
+  for (int i=0; i<n; i++) if (strcasecmp(str, names[i]) == 0) return i;
+  return -1;
+}
+
+// NCCL_TUNING_FILE overrides the latency (us) and bandwidth (GB/s) of the model with measured
+// ones, as written by NCCL_TUNING_DUMP_FILE (see autotune.cc). Lines are
+//   nranks <n> nnodes <n>              : following entries only apply to that shape
+//   <coll> <algo> <proto> <lat> <bw>   : e.g. AllReduce Ring LL128 10.5 120.3
+// and '#' starts a comment. Combinations the model considers unavailable are not enabled.
+static ncclResult_t tuningFileLoad(struct ncclComm* comm, const char* fileName) {
+  FILE* file = fopen(fileName, "r");
+  if (file == NULL) {
+    WARN("Could not open tuning file %s : %s", fileName, strerror(errno));
+    return ncclSuccess;
+  }
+  char line[1024];
+  int lineNum = 0, nLoaded = 0;
+  bool match = true;
+  while (fgets(line, sizeof(line), file)) {
+    lineNum++;
+    char* comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char coll[64], algo[64], proto[64];
+    int nranks, nnodes;
+    float lat, bw;
+    if (sscanf(line, " %63s", coll) != 1) continue;
+    if (sscanf(line, " nranks %d nnodes %d", &nranks, &nnodes) == 2) {
+      match = nranks == comm->nRanks && nnodes == comm->nNodes;
+      continue;
+    }
+    if (sscanf(line, " %63s %63s %63s %f %f", coll, algo, proto, &lat, &bw) != 5) {
+      WARN("Tuning file %s:%d : could not parse line", fileName, lineNum);
+      continue;
+    }
+    if (!match) continue;
+    int c = tuningStrIndex(coll, ncclFuncStr, NCCL_NUM_FUNCTIONS);
+    int a = tuningStrIndex(algo, ncclAlgoStr, NCCL_NUM_ALGORITHMS);
+    int p = tuningStrIndex(proto, ncclProtoStr, NCCL_NUM_PROTOCOLS);
+    if (c == -1 || a == -1 || p == -1 || lat < 0 || bw <= 0) {
+      WARN("Tuning file %s:%d : invalid entry %s/%s/%s %g us %g GB/s", fileName, lineNum, coll, algo, proto, lat, bw);
+      continue;
+    }
+    if (comm->bandwidths[c][a][p] == 0) continue;
+    TRACE(NCCL_TUNING, "Tuning file : %s/%s/%s latency %.2f -> %.2f us, bandwidth %.2f -> %.2f GB/s", coll, algo, proto,
+        comm->latencies[c][a][p], lat, comm->bandwidths[c][a][p], bw);
+    comm->latencies[c][a][p] = lat;
+    comm->bandwidths[c][a][p] = bw;
+    comm->measuredModel[c][a][p] = true;
+    nLoaded++;
+  }
+  fclose(file);
+  INFO(NCCL_TUNING, "Loaded %d entries from tuning file %s for %d ranks on %d nodes", nLoaded, fileName, comm->nRanks, comm->nNodes);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCompCap, struct ncclTopoGraph** graphs) {
   int simpleDefaultThreads = (graphs[NCCL_ALGO_RING]->bwIntra*graphs[NCCL_ALGO_RING]->nChannels <= PCI_BW) ? 256 : NCCL_SIMPLE_MAX_NTHREADS;
   comm->maxThreads[NCCL_ALGO_RING][NCCL_PROTO_SIMPLE] =
@@ -148,7 +218,11 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
   double perChMaxTreeLL128Bw = perChMaxTreeLL128Bws[compCapIndex][index2];
   // De-penalize Tree/Simple latency on Power systems to favor Tree than Ring
   if (cpuArch == NCCL_TOPO_CPU_ARCH_POWER) hwLat[NCCL_HW_PCI][NCCL_ALGO_TREE][NCCL_PROTO_SIMPLE] = hwLat[NCCL_HW_PCI][NCCL_ALGO_RING][NCCL_PROTO_SIMPLE];
+  int treeArity = std::max(2, comm->treeArity);
+  int treeLevels = ncclTreeLevels(nNodes, treeArity);
   float ppn = (float)nRanks / nNodes; // if ppn < 2, then we are sending/receiving at the same GPU through the NIC, apply some bw discount
+  int collNetAgRs = comm->collNetSupport && nRanks == nNodes && comm->ncclCollNet &&
+    comm->ncclCollNet->iallgather && comm->ncclCollNet->ireducescatter;
 
   int intraHw[NCCL_NUM_ALGORITHMS], hw[NCCL_NUM_ALGORITHMS];
   for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) intraHw[a] = graphs[a]->typeIntra == LINK_NVL ? NCCL_HW_NVLINK : NCCL_HW_PCI;
@@ -163,10 +237,15 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
       nNodes;
 
     for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
-      if (coll == ncclFuncBroadcast && a != NCCL_ALGO_RING) continue;
-      if (coll == ncclFuncReduce && a != NCCL_ALGO_RING) continue;
-      if (coll == ncclFuncReduceScatter && a != NCCL_ALGO_RING) continue;
-      if (coll == ncclFuncAllGather && a != NCCL_ALGO_RING) continue;
+      // Broadcast and Reduce can run on the trees, re-rooted at their root, across nodes
+      if ((coll == ncclFuncBroadcast || coll == ncclFuncReduce) &&
+          a != NCCL_ALGO_RING && (a != NCCL_ALGO_TREE || nNodes == 1)) continue;
+      // ReduceScatter and AllGather can go through NVLS multicast within a node,
+      // or through CollNet when there is one rank per node and the plugin has
+      // the windowed AllGather/ReduceScatter entry points.
+      if ((coll == ncclFuncReduceScatter || coll == ncclFuncAllGather) &&
+          a != NCCL_ALGO_RING && (a != NCCL_ALGO_NVLS || nNodes > 1) &&
+          (a != NCCL_ALGO_COLLNET_CHAIN || !collNetAgRs)) continue;
 
       for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
         if ((a == NCCL_ALGO_NVLS || a == NCCL_ALGO_NVLS_TREE) && p != NCCL_PROTO_SIMPLE) continue;
@@ -181,6 +260,8 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
         if (a == NCCL_ALGO_TREE && p == NCCL_PROTO_LL) busBw = std::min(busBw*1.0/3.8, llMaxBw);
         if (a == NCCL_ALGO_TREE && p == NCCL_PROTO_LL128) busBw = std::min(busBw * (nNodes == 1 ? 7.0/9.0 : 120.0/128.0), graphs[a]->nChannels*perChMaxTreeLL128Bw);
         if (a == NCCL_ALGO_TREE && graphs[a]->pattern == NCCL_TOPO_PATTERN_TREE) busBw *= .85;
+        // Forwarding nodes of k-ary trees receive from arity children instead of two
+        if (a == NCCL_ALGO_TREE && nNodes > 1) busBw *= 2.0/treeArity;
         if (a == NCCL_ALGO_COLLNET_DIRECT && p != NCCL_PROTO_SIMPLE) busBw = 0;  // Not used
         if (a == NCCL_ALGO_COLLNET_CHAIN && p != NCCL_PROTO_SIMPLE) busBw = 0;  // Not used
         if (a == NCCL_ALGO_COLLNET_DIRECT && p == NCCL_PROTO_SIMPLE) {
@@ -190,12 +271,17 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
           busBw /= factor;
         }
         if (a == NCCL_ALGO_COLLNET_DIRECT && p == NCCL_PROTO_SIMPLE && minCompCap >= 90) busBw *= .85;
+        // NVLS across nodes goes through SHARP between the node heads, bound by the CollNet bandwidth
+        if (a == NCCL_ALGO_NVLS && nNodes > 1 && comm->collNetSupport)
+          busBw = std::min(busBw, graphs[NCCL_ALGO_COLLNET_CHAIN]->nChannels*graphs[NCCL_ALGO_COLLNET_CHAIN]->bwInter);
 
         // Convert bus BW to algorithm BW
         float ratio;
         if (a == NCCL_ALGO_RING) ratio = (1.0 * nRanks) / nsteps;
+        else if (a == NCCL_ALGO_NVLS && coll != ncclFuncAllReduce) ratio = .85 * nRanks / nsteps;
         else if (a == NCCL_ALGO_NVLS) ratio = 5.0/6.0;
         else if (a == NCCL_ALGO_NVLS_TREE) ratio = .70 * nNodes / (2*(nNodes-1));
+        else if (a == NCCL_ALGO_COLLNET_CHAIN && coll != ncclFuncAllReduce) ratio = .9 * nRanks / nsteps;
         else ratio = .5;
         comm->bandwidths[coll][a][p] = busBw * ratio;
 
@@ -224,16 +310,22 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
             intraLat = std::max(intraLat, netOverhead);
             comm->latencies[coll][a][p] += (nsteps-nInterSteps)*intraLat + nInterSteps*interLat;
           }
+        } else if (a == NCCL_ALGO_TREE && (coll == ncclFuncBroadcast || coll == ncclFuncReduce)) {
+          // One pass, but the root may sit at the bottom of the tree: up then down
+          comm->latencies[coll][a][p] +=
+            (nRanks/nNodes-1) * intraLat + 2 * treeLevels * interLat;
         } else if (a == NCCL_ALGO_TREE) {
           comm->latencies[coll][a][p] +=
-            2 * ((nRanks/nNodes-1) * intraLat + log2i(nNodes) * interLat);
+            2 * ((nRanks/nNodes-1) * intraLat + treeLevels * interLat);
         } else if (a == NCCL_ALGO_COLLNET_DIRECT) {
           comm->latencies[coll][a][p] +=
             2 * (std::min(1, (nRanks/nNodes-1)) * intraLat + (nRanks/nNodes-1) * 0.5) + interLat;  // Add 0.5 arity serialization latency
         } else if (a == NCCL_ALGO_COLLNET_CHAIN) {
           comm->latencies[coll][a][p] += 2 * (nRanks/nNodes-1) * intraLat + interLat;
+          // AllGather/ReduceScatter post one network window per rank
+          if (coll != ncclFuncAllReduce) comm->latencies[coll][a][p] += (nNodes-1) * 0.5;
         } else if (a == NCCL_ALGO_NVLS) {
-          if (nNodes > 1) comm->latencies[coll][a][p] += hwLat[NCCL_HW_NET][a][p];
+          if (nNodes > 1) comm->latencies[coll][a][p] += hwLat[NCCL_HW_NET][a][p] + graphs[NCCL_ALGO_COLLNET_CHAIN]->latencyInter;
         } else if (a == NCCL_ALGO_NVLS_TREE) {
           comm->latencies[coll][a][p] += 2*(nNodes-1)*hwLat[NCCL_HW_NET][a][p];
         }
@@ -241,6 +333,25 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
     }
   }
 
+  // One-shot and two-shot AllReduce within a node. Each rank stages its input, then either
+  // reads all inputs (one-shot) or reduces its share and writes it to all peers (two-shot),
+  // synchronizing once per phase. Their bandwidth is the per-GPU P2P bandwidth divided by
+  // the data each rank moves: nRanks times the buffer, or 1+2*(nRanks-1)/nRanks times.
+  if (nNodes == 1) {
+    float busBw = graphs[NCCL_ALGO_RING]->nChannels * graphs[NCCL_ALGO_RING]->bwIntra;
+    float syncLat = hwLat[intraHw[NCCL_ALGO_RING]][NCCL_ALGO_RING][NCCL_PROTO_LL];
+    comm->shotArLatencies[0] = shotArBaseLat + syncLat;
+    comm->shotArLatencies[1] = shotArBaseLat + 2*syncLat;
+    comm->shotArBandwidths[0] = busBw / nRanks;
+    comm->shotArBandwidths[1] = busBw / (1 + 2.0*(nRanks-1)/nRanks);
+  }
+
+  const char* tuningFile = getenv("NCCL_TUNING_FILE");
+  if (tuningFile) {
+    INFO(NCCL_ENV, "NCCL_TUNING_FILE set by environment to %s", tuningFile);
+    NCCLCHECK(tuningFileLoad(comm, tuningFile));
+  }
+
   // Protocols/Algorithms enable/disable, and user overrides.
   // All are enabled except ll128 which is enabled by default only in certain cases.
   int protoEnable[NCCL_NUM_PROTOCOLS] = { 1, 2, 1 };
@@ -263,11 +374,19 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
   if (comm->collNetSupport == 0) {
     algoEnable[NCCL_ALGO_COLLNET_DIRECT] = 0;
     algoEnable[NCCL_ALGO_COLLNET_CHAIN] = 0;
-    if (comm->nNodes > 1) algoEnable[NCCL_ALGO_NVLS] = 0;
+    // NVLS across nodes reduces inter-node through SHARP. Without it, fall back
+    // to NVLS intra-node with a tree inter-node, and to ring for the rest.
+    int nvlsWanted = algoEnable[NCCL_ALGO_NVLS];
+    if (comm->nNodes > 1) {
+      algoEnable[NCCL_ALGO_NVLS] = 0;
+      if (nvlsWanted && comm->nvlsSupport && comm->rank == 0)
+        INFO(NCCL_TUNING, "CollNet unavailable, NVLS falls back to NVLS_TREE and RING between nodes");
+    }
     // If user has hard set NCCL_ALGO=COLLNET, ignore it
     if (algoEnable[NCCL_ALGO_RING] == 0 && algoEnable[NCCL_ALGO_TREE] == 0 &&
         algoEnable[NCCL_ALGO_NVLS] == 0 && algoEnable[NCCL_ALGO_NVLS_TREE] == 0) {
       algoEnable[NCCL_ALGO_RING] = algoEnable[NCCL_ALGO_TREE] = 1;
+      if (nvlsWanted && comm->nvlsSupport && comm->nNodes > 1) algoEnable[NCCL_ALGO_NVLS_TREE] = 1;
       if (comm->rank == 0) WARN("CollNet is not supported or fails to initialize, ignoring NCCL_ALGO=COLLNET");
     }
   } else {
@@ -281,17 +400,31 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
     int pEnable = protoEnable[p];
     if (pEnable == 2 && p == NCCL_PROTO_LL128) {
       // Enable LL128 by default only on Volta/Ampere/Hopper+NVLink. Other cases are not tested and may cause silent data corruption.
+      int interOk = (graphs[a]->typeInter <= PATH_PXB || (minCompCap >= 90 && graphs[a]->typeInter <= PATH_PXN));
+      int cudaOk = !(minCompCap == 90 && CUDART_VERSION == 11080 && c == ncclFuncAllReduce && a == NCCL_ALGO_RING && comm->nRanks == 2);
       pEnable = 1;
-      pEnable &= (graphs[a]->typeInter <= PATH_PXB || (minCompCap >= 90 && graphs[a]->typeInter <= PATH_PXN));
+      pEnable &= interOk;
       pEnable &= (graphs[a]->typeIntra <= PATH_NVB);
       pEnable &= (minCompCap == maxCompCap);
       switch (minCompCap) {
       case 70: pEnable &= 1; break;
       case 80: pEnable &= 1; break;
-      case 90: pEnable &= !(CUDART_VERSION == 11080 && c == ncclFuncAllReduce && a == NCCL_ALGO_RING && comm->nRanks == 2); break;
+      case 90: pEnable &= cudaOk; break;
       default: pEnable &= 0; break;
       }
+      // The init self-test (NCCL_LL128_PROBE) overrides the list above for the intra-node
+      // paths it checked. Paths through the NIC cannot be checked and keep the rules above.
+      int paths = ll128ProbePaths(graphs[a]->typeIntra);
+      if (paths & comm->ll128Tested & ~comm->ll128Passed) {
+        pEnable = 0;
+      } else if (paths && (comm->ll128Passed & paths) == paths) {
+        pEnable = interOk && cudaOk && minCompCap == maxCompCap && minCompCap >= 70;
+      }
     }
+    // LL128 stages misaligned data through the per-warp scratch
+    if (p == NCCL_PROTO_LL128 && comm->config.lowShmem) pEnable = 0;
+    // The memory budget (ncclConfig_t memBudget) may leave no room for LL128 buffers
+    if (p == NCCL_PROTO_LL128 && comm->memBudgetNoLL128) pEnable = 0;
     if (pEnable == 0) comm->bandwidths[c][a][p] = 0;
     // Never disable ring for non-allreduce operations. That allows to run real apps with NCCL_ALGO=TREE.
     if (a == NCCL_ALGO_RING && c != ncclFuncAllReduce) continue;
@@ -345,6 +478,9 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
   comm->threadThresholds[NCCL_ALGO_COLLNET_DIRECT][NCCL_PROTO_SIMPLE] = 512;
   comm->threadThresholds[NCCL_ALGO_COLLNET_CHAIN][NCCL_PROTO_SIMPLE] = 512;
 
+  // P2P read connections only have a write path when NCCL_P2P_WRITE_THRESHOLD is set
+  comm->p2pWriteThreshold = ncclParamP2pWriteThreshold();
+
   // Override defaults with user env
   char* str = getenv("NCCL_THREAD_THRESHOLDS");
   if (str) {
@@ -384,10 +520,12 @@ ncclResult_t ncclTopoGetAlgoTime(struct ncclInfo* info, int algorithm, int proto
   if (bw == 0) {
     *time = -1.0; return ncclSuccess;
   }
+  // Measured latencies and bandwidths already include the effects corrected below
+  bool measured = info->comm->measuredModel[info->coll][algorithm][protocol];
   int logSize = log2i(info->nBytes>>6);
-  if (algorithm == NCCL_ALGO_TREE && logSize < 23) bw *= treeCorrectionFactor[protocol][logSize];
+  if (algorithm == NCCL_ALGO_TREE && logSize < 23 && !measured) bw *= treeCorrectionFactor[protocol][logSize];
   if (info->nChannels != 0) bw = bw / info->comm->nChannels * info->nChannels;
-  if (algorithm == NCCL_ALGO_RING && protocol == NCCL_PROTO_SIMPLE && info->comm->nNodes > 1
+  if (algorithm == NCCL_ALGO_RING && protocol == NCCL_PROTO_SIMPLE && info->comm->nNodes > 1 && !measured
       && info->coll == ncclFuncAllReduce && info->nBytes/(info->comm->nChannels*info->comm->nRanks) >= 64) {
     lat *= info->comm->minCompCap < 80 ? 1.9 : 1.4; // Plateau effect of ring
   }
@@ -396,3 +534,42 @@ ncclResult_t ncclTopoGetAlgoTime(struct ncclInfo* info, int algorithm, int proto
   *time = lat * latCount + (info->nBytes) / (1000 * bw);
   return ncclSuccess;
 }
+
+ncclResult_t ncclTopoGetShotArTime(struct ncclInfo* info, int twoShot, float* time) {
+  float bw = info->comm->shotArBandwidths[twoShot];
+  if (bw == 0) {
+    *time = -1.0; return ncclSuccess;
+  }
+  *time = info->comm->shotArLatencies[twoShot] + info->nBytes / (1000 * bw);
+  return ncclSuccess;
+}
+
+// Fixed cost of each channel in ns : launching and scheduling one more CTA, and the per-step
+// synchronization of its smaller chunks. 0 disables the channel cost model.
+NCCL_PARAM(ChannelLatency, "CHANNEL_LATENCY", 100);
+// Extra time, in percent, accepted to run on fewer channels (and therefore fewer SMs).
+// 0 only drops channels which do not make the operation slower.
+NCCL_PARAM(ChannelTolerance, "CHANNEL_TOLERANCE", 0);
+
+static float channelTime(float nBytes, float chBw, float chLat, int nc) {
+  return nBytes / (1000 * chBw * nc) + nc * chLat;
+}
+
+// Reduce *nChannels to the fewest channels whose modeled time, accounting for the fixed cost of
+// each channel, is within NCCL_CHANNEL_TOLERANCE of the time on *nChannels.
+ncclResult_t ncclTopoTuneChannels(struct ncclInfo* info, int algorithm, int protocol, int* nChannels) {
+  struct ncclComm* comm = info->comm;
+  float chLat = ncclParamChannelLatency() * .001;
+  float bw = comm->bandwidths[info->coll][algorithm][protocol];
+  if (chLat <= 0 || bw == 0 || *nChannels <= 1) return ncclSuccess;
+  float chBw = bw / comm->nChannels;
+  float maxTime = channelTime(info->nBytes, chBw, chLat, *nChannels) * (1 + ncclParamChannelTolerance() / 100.0);
+  for (int nc=1; nc<*nChannels; nc++) {
+    if (channelTime(info->nBytes, chBw, chLat, nc) <= maxTime) {
+      TRACE(NCCL_TUNING, "%ld Bytes %s/%s : %d -> %d channels", info->nBytes, ncclAlgoStr[algorithm], ncclProtoStr[protocol], *nChannels, nc);
+      *nChannels = nc;
+      break;
+    }
+  }
+  return ncclSuccess;
+}
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <sys/mman.h>
 #include "core.h"
 #include "nvmlwrap.h"
 #include "xml.h"
@@ -234,12 +235,204 @@ ncclResult_t ncclTopoDumpXmlRec(int indent, FILE* file, struct ncclXmlNode* node
   return ncclSuccess;
 }
 
+/**************************/
+/* Binary format          */
+/**************************/
+
+// Header, then the nodes in depth-first order, each as the int32 index of its parent (-1 for the
+// top node), the uint8 number of attributes, then the name, keys and values. Strings are stored
+// as a uint8 length followed by the characters, since they are at most MAX_STR_LEN long.
+#define NCCL_XML_BINARY_MAGIC "NCCLXMLB"
+#define NCCL_XML_BINARY_VERSION 1
+struct ncclXmlBinaryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t nNodes;
+};
+
+struct xmlBinaryWriter {
+  char* buff;
+  size_t size;
+  size_t capacity;
+};
+
+static ncclResult_t xmlBinaryWrite(struct xmlBinaryWriter* w, const void* data, size_t bytes) {
+  if (w->size + bytes > w->capacity) {
+    size_t capacity = w->capacity ? w->capacity : 4096;
+    while (capacity < w->size + bytes) capacity *= 2;
+    char* buff = (char*)realloc(w->buff, capacity);
+    if (buff == NULL) {
+      WARN("Failed to allocate %ld bytes for binary XML", capacity);
+      return ncclSystemError;
+    }
+    w->buff = buff;
+    w->capacity = capacity;
+  }
+  memcpy(w->buff+w->size, data, bytes);
+  w->size += bytes;
+  return ncclSuccess;
+}
+
+static ncclResult_t xmlBinaryWriteStr(struct xmlBinaryWriter* w, const char* str) {
+  uint8_t len = strnlen(str, MAX_STR_LEN);
+  NCCLCHECK(xmlBinaryWrite(w, &len, sizeof(uint8_t)));
+  NCCLCHECK(xmlBinaryWrite(w, str, len));
+  return ncclSuccess;
+}
+
+static ncclResult_t xmlBinaryWriteRec(struct xmlBinaryWriter* w, struct ncclXmlNode* node, int32_t parent, uint32_t* nNodes) {
+  int32_t index = (*nNodes)++;
+  uint8_t nAttrs = node->nAttrs;
+  NCCLCHECK(xmlBinaryWrite(w, &parent, sizeof(int32_t)));
+  NCCLCHECK(xmlBinaryWrite(w, &nAttrs, sizeof(uint8_t)));
+  NCCLCHECK(xmlBinaryWriteStr(w, node->name));
+  for (int a=0; a<node->nAttrs; a++) {
+    NCCLCHECK(xmlBinaryWriteStr(w, node->attrs[a].key));
+    NCCLCHECK(xmlBinaryWriteStr(w, node->attrs[a].value));
+  }
+  for (int s=0; s<node->nSubs; s++) NCCLCHECK(xmlBinaryWriteRec(w, node->subs[s], index, nNodes));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoDumpXmlToBuffer(struct ncclXml* xml, char** buff, size_t* size) {
+  struct xmlBinaryWriter w = { NULL, 0, 0 };
+  struct ncclXmlBinaryHeader header;
+  memcpy(header.magic, NCCL_XML_BINARY_MAGIC, sizeof(header.magic));
+  header.version = NCCL_XML_BINARY_VERSION;
+  header.nNodes = 0;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECKGOTO(xmlBinaryWrite(&w, &header, sizeof(header)), ret, fail);
+  if (xml->maxIndex > 0) NCCLCHECKGOTO(xmlBinaryWriteRec(&w, xml->nodes, -1, &header.nNodes), ret, fail);
+  memcpy(w.buff, &header, sizeof(header));
+  *buff = w.buff;
+  *size = w.size;
+  return ncclSuccess;
+fail:
+  free(w.buff);
+  return ret;
+}
+
+static ncclResult_t xmlBinaryRead(const char* buff, size_t size, size_t* offset, void* data, size_t bytes) {
+  if (*offset + bytes > size) {
+    WARN("Binary XML is truncated (%ld bytes)", size);
+    return ncclInvalidUsage;
+  }
+  memcpy(data, buff+*offset, bytes);
+  *offset += bytes;
+  return ncclSuccess;
+}
+
+static ncclResult_t xmlBinaryReadStr(const char* buff, size_t size, size_t* offset, char* str) {
+  uint8_t len;
+  NCCLCHECK(xmlBinaryRead(buff, size, offset, &len, sizeof(uint8_t)));
+  NCCLCHECK(xmlBinaryRead(buff, size, offset, str, len));
+  str[len] = '\0';
+  return ncclSuccess;
+}
+
+static bool xmlIsBinary(const char* buff, size_t size) {
+  return size >= sizeof(struct ncclXmlBinaryHeader) && memcmp(buff, NCCL_XML_BINARY_MAGIC, 8) == 0;
+}
+
+ncclResult_t ncclTopoGetXmlFromBuffer(const char* buff, size_t size, struct ncclXml* xml) {
+  struct ncclXmlBinaryHeader header;
+  size_t offset = 0;
+  xml->maxIndex = 0;
+  if (!xmlIsBinary(buff, size)) {
+    WARN("Binary XML has no valid header");
+    return ncclInvalidUsage;
+  }
+  NCCLCHECK(xmlBinaryRead(buff, size, &offset, &header, sizeof(header)));
+  if (header.version != NCCL_XML_BINARY_VERSION) {
+    WARN("Binary XML has wrong version %d, %d needed", header.version, NCCL_XML_BINARY_VERSION);
+    return ncclInvalidUsage;
+  }
+  for (uint32_t n=0; n<header.nNodes; n++) {
+    int32_t parent;
+    uint8_t nAttrs;
+    char name[MAX_STR_LEN+1];
+    NCCLCHECK(xmlBinaryRead(buff, size, &offset, &parent, sizeof(int32_t)));
+    NCCLCHECK(xmlBinaryRead(buff, size, &offset, &nAttrs, sizeof(uint8_t)));
+    NCCLCHECK(xmlBinaryReadStr(buff, size, &offset, name));
+    if (parent >= (int32_t)n || (n > 0 && parent < 0) || nAttrs > MAX_ATTR_COUNT ||
+        (parent >= 0 && xml->nodes[parent].nSubs == MAX_SUBS)) {
+      WARN("Binary XML node %d (%s) is invalid", n, name);
+      return ncclInvalidUsage;
+    }
+    struct ncclXmlNode* node;
+    NCCLCHECK(xmlAddNode(xml, parent >= 0 ? xml->nodes+parent : NULL, name, &node));
+    node->type = NODE_TYPE_SINGLE;
+    if (parent >= 0) xml->nodes[parent].type = NODE_TYPE_OPEN;
+    for (int a=0; a<nAttrs; a++) {
+      NCCLCHECK(xmlBinaryReadStr(buff, size, &offset, node->attrs[a].key));
+      NCCLCHECK(xmlBinaryReadStr(buff, size, &offset, node->attrs[a].value));
+    }
+    node->nAttrs = nAttrs;
+  }
+  return ncclSuccess;
+}
+
+// Load a binary file through mmap, and check its top node is what the text parser expects.
+static ncclResult_t xmlLoadBinaryFile(int fd, const char* fileName, struct ncclXml* xml, const char* topName, int version) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    WARN("Could not stat %s : %s", fileName, strerror(errno));
+    return ncclSystemError;
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    WARN("Could not map %s : %s", fileName, strerror(errno));
+    return ncclSystemError;
+  }
+  ncclResult_t ret = ncclTopoGetXmlFromBuffer((const char*)data, st.st_size, xml);
+  munmap(data, st.st_size);
+  NCCLCHECK(ret);
+  int fileVersion;
+  if (xml->maxIndex == 0 || strcmp(xml->nodes[0].name, topName) != 0) {
+    WARN("Binary XML file %s has no top node %s", fileName, topName);
+    return ncclInvalidUsage;
+  }
+  NCCLCHECK(xmlGetAttrInt(xml->nodes, "version", &fileVersion));
+  if (fileVersion != version) {
+    WARN("Binary XML file %s has wrong version %d, %d needed", fileName, fileVersion, version);
+    return ncclInvalidUsage;
+  }
+  INFO(NCCL_GRAPH, "Loaded binary XML file %s (%d nodes)", fileName, xml->maxIndex);
+  return ncclSuccess;
+}
+
+// Returns 1 if file starts with the binary header. The file position is restored.
+static int xmlFileIsBinary(FILE* file) {
+  char magic[8];
+  int binary = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, NCCL_XML_BINARY_MAGIC, sizeof(magic)) == 0;
+  rewind(file);
+  return binary;
+}
+
+// Write NCCL_TOPO_DUMP_FILE/NCCL_GRAPH_DUMP_FILE and the graph cache in the binary format.
+// Loading detects the format, so both can always be read back.
+NCCL_PARAM(XmlDumpBinary, "XML_DUMP_BINARY", 0);
+
 ncclResult_t ncclTopoDumpXmlToFile(const char* xmlTopoFile, struct ncclXml* xml) {
   FILE* file = fopen(xmlTopoFile, "w");
   if (file == NULL) {
     WARN("Unable to open %s, not dumping topology.", xmlTopoFile);
     return ncclSuccess;
   }
+  if (ncclParamXmlDumpBinary()) {
+    char* buff;
+    size_t size;
+    ncclResult_t ret = ncclTopoDumpXmlToBuffer(xml, &buff, &size);
+    if (ret == ncclSuccess) {
+      if (fwrite(buff, 1, size, file) != size) {
+        WARN("Could not write %s : %s", xmlTopoFile, strerror(errno));
+        ret = ncclSystemError;
+      }
+      free(buff);
+    }
+    fclose(file);
+    return ret;
+  }
   NCCLCHECK(ncclTopoDumpXmlRec(0, file, xml->nodes));
   fclose(file);
   return ncclSuccess;
@@ -255,8 +448,8 @@ ncclResult_t ncclTopoXmlLoadNvlink(FILE* file, struct ncclXml* xml, struct ncclX
 }
 
 ncclResult_t ncclTopoXmlLoadGpu(FILE* file, struct ncclXml* xml, struct ncclXmlNode* head) {
-  struct xmlHandler handlers[] = { { "nvlink", ncclTopoXmlLoadNvlink } };
-  NCCLCHECK(xmlLoadSub(file, xml, head, handlers, 1));
+  struct xmlHandler handlers[] = { { "nvlink", ncclTopoXmlLoadNvlink }, { "c2c", ncclTopoXmlLoadNvlink } };
+  NCCLCHECK(xmlLoadSub(file, xml, head, handlers, 2));
   return ncclSuccess;
 }
 
@@ -309,6 +502,11 @@ ncclResult_t ncclTopoGetXmlFromFile(const char* xmlTopoFile, struct ncclXml* xml
     return ncclSuccess;
   }
   INFO(NCCL_GRAPH, "Loading topology file %s", xmlTopoFile);
+  if (xmlFileIsBinary(file)) {
+    ncclResult_t ret = xmlLoadBinaryFile(fileno(file), xmlTopoFile, xml, "system", NCCL_TOPO_XML_VERSION);
+    fclose(file);
+    return ret;
+  }
   struct xmlHandler handlers[] = { { "system", ncclTopoXmlLoadSystem } };
   xml->maxIndex = 0;
   NCCLCHECK(xmlLoadSub(file, xml, NULL, handlers, 1));
@@ -676,6 +874,37 @@ ncclResult_t ncclTopoGetXmlFromGpu(struct ncclXmlNode* pciNode, nvmlDevice_t nvm
       }
     }
   }
+
+  struct ncclXmlNode* c2cNode = NULL;
+  NCCLCHECK(xmlGetSub(gpuNode, "c2c", &c2cNode));
+  if (c2cNode == NULL && sm >= 90 && nvmlDev != NULL) {
+    // NVML C2C detection (Grace Hopper)
+    nvmlFieldValue_t fv;
+    fv.fieldId = NVML_FI_DEV_C2C_LINK_COUNT;
+    fv.scopeId = 0;
+    int nLinks = 0;
+    if (ncclNvmlDeviceGetFieldValues(nvmlDev, 1, &fv) == ncclSuccess && fv.nvmlReturn == NVML_SUCCESS) nLinks = fv.value.uiVal;
+    int count = 0;
+    unsigned int linkBw = 0;
+    for (int l=0; l<nLinks; l++) {
+      nvmlFieldValue_t fvs[2];
+      fvs[0].fieldId = NVML_FI_DEV_C2C_LINK_GET_STATUS;
+      fvs[0].scopeId = l;
+      fvs[1].fieldId = NVML_FI_DEV_C2C_LINK_GET_MAX_BW;
+      fvs[1].scopeId = l;
+      if (ncclNvmlDeviceGetFieldValues(nvmlDev, 2, fvs) != ncclSuccess) continue;
+      if (fvs[0].nvmlReturn != NVML_SUCCESS || fvs[0].value.uiVal != 1) continue;
+      if (fvs[1].nvmlReturn != NVML_SUCCESS) continue;
+      count++;
+      linkBw = fvs[1].value.uiVal;
+    }
+    if (count > 0) {
+      NCCLCHECK(xmlAddNode(xml, gpuNode, "c2c", &c2cNode));
+      NCCLCHECK(xmlSetAttrInt(c2cNode, "count", count));
+      NCCLCHECK(xmlSetAttrInt(c2cNode, "bw", linkBw));
+    }
+  }
+
   // Fill target classes
   for (int s=0; s<gpuNode->nSubs; s++) {
     struct ncclXmlNode* sub = gpuNode->subs[s];
@@ -843,6 +1072,11 @@ ncclResult_t ncclTopoGetXmlGraphFromFile(const char* xmlGraphFile, struct ncclXm
     WARN("Could not open XML graph file %s : %s", xmlGraphFile, strerror(errno));
     return ncclSystemError;
   }
+  if (xmlFileIsBinary(file)) {
+    ncclResult_t ret = xmlLoadBinaryFile(fileno(file), xmlGraphFile, xml, "graphs", NCCL_GRAPH_XML_VERSION);
+    fclose(file);
+    return ret;
+  }
   struct xmlHandler handlers[] = { { "graphs", ncclTopoXmlGraphLoadGraphs } };
   xml->maxIndex = 0;
   NCCLCHECK(xmlLoadSub(file, xml, NULL, handlers, 1));
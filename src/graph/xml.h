@@ -45,6 +45,9 @@ struct ncclXml {
 #define NCCL_TOPO_XML_VERSION 1
 ncclResult_t ncclTopoGetXmlFromFile(const char* xmlTopoFile, struct ncclXml* xml, int warn);
 ncclResult_t ncclTopoDumpXmlToFile(const char* xmlTopoFile, struct ncclXml* xml);
+/* Binary format, also accepted by the file functions above */
+ncclResult_t ncclTopoGetXmlFromBuffer(const char* buff, size_t size, struct ncclXml* xml);
+ncclResult_t ncclTopoDumpXmlToBuffer(struct ncclXml* xml, char** buff, size_t* size);
 #define NCCL_GRAPH_XML_VERSION 1
 ncclResult_t ncclTopoGetXmlGraphFromFile(const char* xmlGraphFile, struct ncclXml* xml);
 
@@ -58,19 +58,113 @@ ncclResult_t ncclAsyncLaunch(
   return ret;
 }
 
+// Async jobs (comm init, preconnect, nonblocking group launch, destroy) run on a process-wide pool
+// of threads instead of a new thread each. A job never waits for an idle thread unless
+// NCCL_ASYNC_MAX_THREADS is set : jobs of a group may wait on each other (e.g. ranks of the same
+// communicator bootstrapping together), so the pool grows as needed by default. Threads beyond
+// NCCL_ASYNC_IDLE_THREADS exit once they find no work.
+NCCL_PARAM(AsyncIdleThreads, "ASYNC_IDLE_THREADS", 16);
+NCCL_PARAM(AsyncMaxThreads, "ASYNC_MAX_THREADS", 0);
+
+static struct ncclAsyncPool {
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+  pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+  struct ncclIntruQueue<struct ncclAsyncJob, &ncclAsyncJob::poolNext> pending; // ready to run
+  struct ncclIntruQueue<struct ncclAsyncJob, &ncclAsyncJob::poolNext> waiting; // bounded, over the limit
+  int nPending;
+  int nIdle;
+  int nThreads;
+  int nBounded; // bounded jobs pending or running
+} ncclAsyncPool;
+
 void* ncclAsyncJobMain(void* arg) {
-  struct ncclAsyncJob* job = (struct ncclAsyncJob*)arg;
-  job->result = job->func(job);
-  if (job->result != ncclSuccess) {
-    INFO(NCCL_INIT,"%s:%d -> %d [Async thread]", __FILE__, __LINE__, job->result);
+  struct ncclAsyncPool* pool = &ncclAsyncPool;
+  int maxIdle = ncclParamAsyncIdleThreads();
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (ncclIntruQueueEmpty(&pool->pending)) {
+      if (pool->nIdle >= maxIdle) {
+        pool->nThreads--;
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+      }
+      pool->nIdle++;
+      pthread_cond_wait(&pool->workCond, &pool->mutex);
+      pool->nIdle--;
+    }
+    struct ncclAsyncJob* job = ncclIntruQueueDequeue(&pool->pending);
+    pool->nPending--;
+    pthread_mutex_unlock(&pool->mutex);
+
+    sched_setaffinity(0, sizeof(cpu_set_t), &job->affinity);
+    job->result = job->func(job);
+    if (job->result != ncclSuccess) {
+      INFO(NCCL_INIT,"%s:%d -> %d [Async thread]", __FILE__, __LINE__, job->result);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (job->poolBounded) {
+      pool->nBounded--;
+      // Hand over the slot, this thread picks the job up next.
+      if (!ncclIntruQueueEmpty(&pool->waiting)) {
+        ncclIntruQueueEnqueue(&pool->pending, ncclIntruQueueDequeue(&pool->waiting));
+        pool->nPending++;
+        pool->nBounded++;
+      }
+    }
+    // The job may be freed as soon as it is seen done, don't touch it past this point.
+    __atomic_store_n(&job->state, ncclGroupJobDone, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->doneCond);
   }
-  __atomic_store_n(&job->state, ncclGroupJobDone, __ATOMIC_RELEASE);
-  return arg;
+}
+
+ncclResult_t ncclAsyncJobStart(struct ncclAsyncJob* job, bool bounded) {
+  struct ncclAsyncPool* pool = &ncclAsyncPool;
+  int maxThreads = ncclParamAsyncMaxThreads();
+  ncclResult_t ret = ncclSuccess;
+  job->state = ncclGroupJobRunning;
+  job->poolBounded = bounded;
+  // As if the job had its own thread, which would inherit the affinity of the caller
+  sched_getaffinity(0, sizeof(cpu_set_t), &job->affinity);
+  pthread_mutex_lock(&pool->mutex);
+  if (bounded && maxThreads > 0 && pool->nBounded >= maxThreads) {
+    ncclIntruQueueEnqueue(&pool->waiting, job);
+    goto exit;
+  }
+  if (pool->nIdle <= pool->nPending) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, ncclAsyncJobMain, NULL);
+    if (err != 0) {
+      WARN("Could not start async thread : %s", strerror(err));
+      ret = ncclSystemError;
+      goto exit;
+    }
+    pthread_detach(thread);
+    ncclSetThreadName(thread, "NCCL Async");
+    pool->nThreads++;
+  }
+  if (bounded) pool->nBounded++;
+  ncclIntruQueueEnqueue(&pool->pending, job);
+  pool->nPending++;
+  pthread_cond_signal(&pool->workCond);
+exit:
+  pthread_mutex_unlock(&pool->mutex);
+  return ret;
+}
+
+ncclResult_t ncclAsyncJobWait(struct ncclAsyncJob* job) {
+  struct ncclAsyncPool* pool = &ncclAsyncPool;
+  pthread_mutex_lock(&pool->mutex);
+  while (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == ncclGroupJobRunning) pthread_cond_wait(&pool->doneCond, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+  job->state = ncclGroupJobJoined;
+  return job->result;
 }
 
 ncclResult_t ncclAsyncJobComplete(struct ncclAsyncJob* job) {
   ncclResult_t ret;
-  SYSCHECK(pthread_join(job->thread, NULL), "pthread_join");
+  (void) ncclAsyncJobWait(job);
   if (job->result != ncclSuccess) {
     WARN("ncclAsyncJobComplete: job %p failed, job error %d", job, job->result);
   }
@@ -108,10 +202,115 @@ ncclResult_t ncclPreconnectFunc(struct ncclAsyncJob* job_) {
   struct ncclComm* comm = job->comm;
   CUDACHECK(cudaSetDevice(comm->cudaDev));
   if (CPU_COUNT(&comm->cpuAffinity)) sched_setaffinity(0, sizeof(cpu_set_t), &comm->cpuAffinity);
+  if (comm->runtimeConnect && !comm->collConnected && comm->tasks.nTasksColl) {
+    struct ncclTopoGraph* graphs = comm->connectGraphs;
+    NCCLCHECK(ncclTransportCollConnect(comm, graphs+0, graphs+1, graphs+2));
+  }
   NCCLCHECK(ncclTransportP2pSetup(comm, NULL, 1));
   return ncclSuccess;
 }
 
+// Launches all plans of one comm. Run by the thread of each member of a clique, the barriers
+// keep the members in lockstep exactly as when every rank has its own thread.
+static ncclResult_t doLaunchesComm(struct ncclComm* comm, bool useBarrier) {
+  ncclResult_t ret = ncclSuccess;
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, fail);
+  NCCLCHECKGOTO(ncclLaunchPrepare(comm), ret, fail);
+  if (useBarrier) ncclCommIntraBarrierIn(comm, 1);
+  while (true) {
+    // Barrier reduction result tells us if this was the final round.
+    bool moreRounds = useBarrier ? 0 != ncclCommIntraBarrierOut(comm) : comm->unlaunchedPlansHead != nullptr;
+    if (!moreRounds) break;
+    struct ncclKernelPlan* plan = comm->unlaunchedPlansHead;
+    if (plan != nullptr) {
+      comm->unlaunchedPlansHead = plan->next;
+      NCCLCHECKGOTO(ncclLaunchKernelBefore_NoUncapturedCuda(comm, plan), ret, fail);
+      NCCLCHECKGOTO(ncclLaunchKernel(comm, plan), ret, fail);
+    }
+    // Barrier reduction input indicates if we require further rounds.
+    if (useBarrier) ncclCommIntraBarrierIn(comm, comm->unlaunchedPlansHead != nullptr ? 1 : 0);
+    if (plan != nullptr) NCCLCHECKGOTO(ncclLaunchKernelAfter_NoCuda(comm, plan), ret, joined);
+  }
+  NCCLCHECK(ncclLaunchFinish(comm));
+  return ncclSuccess;
+fail:
+  // The other members wait for us in every round, keep taking part without launching
+  if (useBarrier) ncclCommIntraBarrierIn(comm, 0);
+joined:
+  if (useBarrier) while (ncclCommIntraBarrierOut(comm) != 0) ncclCommIntraBarrierIn(comm, 0);
+  return ret;
+}
+
+// Takes part in the barrier rounds for members which will not launch, from one thread, until
+// the members which do are done.
+static void doLaunchesDrain(struct ncclComm** comms, int n) {
+  for (int c=0; c<n; c++) ncclCommIntraBarrierIn(comms[c], 0);
+  while (true) {
+    uint32_t moreRounds = 0;
+    for (int c=0; c<n; c++) moreRounds = ncclCommIntraBarrierOut(comms[c]);
+    if (moreRounds == 0) break;
+    for (int c=0; c<n; c++) ncclCommIntraBarrierIn(comms[c], 0);
+  }
+}
+
+struct ncclLaunchJob {
+  struct ncclAsyncJob base;
+  struct ncclComm* comm;
+  bool useBarrier;
+};
+static ncclResult_t ncclLaunchJobFunc(struct ncclAsyncJob* job_) {
+  struct ncclLaunchJob* job = (struct ncclLaunchJob*)job_;
+  return doLaunchesComm(job->comm, job->useBarrier);
+}
+
+// When one thread drives several GPUs, the members of a clique can prepare and launch on
+// threads of the async pool, one per comm, so that the host time per group does not grow with
+// the number of GPUs. Captured groups stay on the calling thread, CUDA may not allow other
+// threads to use the runtime while it captures.
+NCCL_PARAM(LaunchThreads, "LAUNCH_THREADS", 0);
+
+static ncclResult_t doLaunchesParallel(struct ncclComm* cliqueHead, struct ncclComm* cliqueNextHead, int nComms, bool useBarrier) {
+  ncclResult_t result = ncclSuccess;
+  struct ncclLaunchJob* jobs;
+  struct ncclComm** unstarted = NULL;
+  struct ncclComm* comm;
+  int nJobs = 0;
+  NCCLCHECK(ncclCalloc(&jobs, nComms-1));
+  // The calling thread takes the first member
+  for (comm = cliqueHead->groupNext; comm != cliqueNextHead; comm = comm->groupNext) {
+    struct ncclLaunchJob* job = jobs+nJobs;
+    job->base.func = ncclLaunchJobFunc;
+    job->base.abortFlag = comm->abortFlag;
+    job->base.comm = comm;
+    job->comm = comm;
+    job->useBarrier = useBarrier;
+    // Unbounded, members wait on each other in the barriers
+    NCCLCHECKGOTO(ncclAsyncJobStart(&job->base, false), result, unstartedJobs);
+    nJobs++;
+  }
+  result = doLaunchesComm(cliqueHead, useBarrier);
+  goto wait;
+unstartedJobs:
+  // Members already started would wait for the others in the barriers
+  if (useBarrier && nJobs > 0 && ncclCalloc(&unstarted, nComms-nJobs) == ncclSuccess) {
+    int n = 0;
+    unstarted[n++] = cliqueHead;
+    for (; comm != cliqueNextHead; comm = comm->groupNext) unstarted[n++] = comm;
+    doLaunchesDrain(unstarted, n);
+    free(unstarted);
+  }
+wait:
+  for (int j=0; j<nJobs; j++) {
+    ncclResult_t res = ncclAsyncJobWait(&jobs[j].base);
+    if (res != ncclSuccess) {
+      WARN("Launch on device %d failed, error %d", jobs[j].comm->cudaDev, res);
+      if (result == ncclSuccess) result = res;
+    }
+  }
+  free(jobs);
+  return result;
+}
+
 static ncclResult_t doLaunches(struct ncclComm* head) {
   ncclResult_t result = ncclSuccess;
   struct ncclComm* cliqueComm0 = head->intraComm0;
@@ -124,24 +323,34 @@ static ncclResult_t doLaunches(struct ncclComm* head) {
   do {
     struct ncclComm* comm = cliqueHead;
     bool capturingYes = false, capturingNo = false;
+    int nComms = 0;
     do {
       (ncclCudaGraphValid(comm->tasks.capturingGraph) ? capturingYes : capturingNo) = true;
-      CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), result, failure);
-      NCCLCHECKGOTO(ncclLaunchPrepare(comm), result, failure);
-      if (useBarrier) ncclCommIntraBarrierIn(comm, 1);
+      nComms++;
       comm = comm->groupNext;
     } while (comm != nullptr && comm->intraComm0 == cliqueComm0);
     cliqueNextHead = comm;
 
     if (capturingYes && capturingNo) {
-      // We have entered barriers but are aborting without leaving them. Thus
-      // these comms are permanently trashed. We need a good mechanism for
-      // tracking and reporting that.
       WARN("Either none or all communicators in a ncclGroup() can be CUDA graph captured.");
       result = ncclInvalidUsage;
       goto failure;
     }
 
+    if (ncclParamLaunchThreads() && nComms > 1 && !capturingYes) {
+      NCCLCHECKGOTO(doLaunchesParallel(cliqueHead, cliqueNextHead, nComms, useBarrier), result, failure);
+      cliqueHead = cliqueNextHead;
+      continue;
+    }
+
+    comm = cliqueHead;
+    do {
+      CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), result, failure);
+      NCCLCHECKGOTO(ncclLaunchPrepare(comm), result, failure);
+      if (useBarrier) ncclCommIntraBarrierIn(comm, 1);
+      comm = comm->groupNext;
+    } while (comm != cliqueNextHead);
+
     while (true) { // Iterate rounds of launches for clique.
       bool moreRounds;
       comm = cliqueHead;
@@ -259,6 +468,17 @@ static ncclResult_t groupLaunch(struct ncclAsyncJob *job_) {
 
   CUDACHECKGOTO(cudaGetDevice(&savedDev), ret, fail);
 
+  // Release idle p2p connections first; connections this group uses may need to be re-established.
+  for (struct ncclComm* comm = groupCommHeadMain; comm != nullptr; comm = comm->groupNext) {
+    bool needConnect;
+    CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, fail);
+    NCCLCHECKGOTO(ncclTransportP2pReclaim(comm, &needConnect), ret, fail);
+    if (needConnect && comm->preconnectNext == reinterpret_cast<struct ncclComm*>(0x1)) {
+      comm->preconnectNext = groupCommPreconnectHeadMain;
+      groupCommPreconnectHeadMain = comm;
+    }
+  }
+
   if (groupCommPreconnectHeadMain != nullptr) {
     struct ncclComm* comm = groupCommPreconnectHeadMain;
     do {
@@ -281,7 +501,7 @@ static ncclResult_t groupLaunch(struct ncclAsyncJob *job_) {
   if (!ncclIntruQueueEmpty(asyncJobsMain)) {
     struct ncclAsyncJob* job = ncclIntruQueueHead(asyncJobsMain);
     do {
-      SYSCHECKGOTO(pthread_create(&job->thread, nullptr, ncclAsyncJobMain, job), ret, fail);
+      NCCLCHECKGOTO(ncclAsyncJobStart(job, true), ret, fail);
       job = job->next;
     } while (job != nullptr);
 
@@ -293,10 +513,6 @@ static ncclResult_t groupLaunch(struct ncclAsyncJob *job_) {
         if (state == ncclGroupJobRunning) {
           jobsDone = false;
         } else if (state == ncclGroupJobDone) {
-          if (pthread_join(job->thread, nullptr) != 0) {
-            WARN("Error waiting for pthread_join : %s", strerror(errno));
-            ret = ncclSystemError;
-          }
           job->state = ncclGroupJobJoined;
           if (job->result != ncclSuccess && ret == ncclSuccess) {
             ret = job->result;
@@ -399,7 +615,7 @@ ncclResult_t ncclGroupEndInternal() {
         } while (comm);
       }
       ncclGroupJobMainPtr->base.func = groupLaunch;
-      SYSCHECKGOTO(pthread_create(&ncclGroupJobMainPtr->base.thread, NULL, ncclAsyncJobMain, (void*)&ncclGroupJobMainPtr->base), ret, fail);
+      NCCLCHECKGOTO(ncclAsyncJobStart(&ncclGroupJobMainPtr->base, false), ret, fail);
       ret = ncclInProgress;
     } else {
       /* blocking group */
@@ -0,0 +1,186 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "health.h"
+#include "comm.h"
+#include "bootstrap.h"
+#include <algorithm>
+
+NCCL_PARAM(HealthCheck, "HEALTH_CHECK", 0);
+NCCL_PARAM(HealthCheckBytes, "HEALTH_CHECK_BYTES", 1 << 20);
+NCCL_PARAM(HealthCheckIters, "HEALTH_CHECK_ITERS", 5);
+
+// Links are compared to the median of links of the same kind (within a node or across nodes)
+#define HEALTH_BW_RATIO 0.5
+#define HEALTH_LAT_RATIO 2.0
+#define HEALTH_LAT_BYTES 8
+
+enum { healthRing, healthTree, healthNumPatterns };
+static const char* healthPatternStr[] = { "ring", "tree" };
+
+struct healthLink {
+  int peer;  // Ring next or tree parent, -1 for none
+  float bw;  // GB/s
+  float lat; // us
+};
+
+struct healthInfo {
+  struct healthLink links[healthNumPatterns];
+};
+
+// Average time of one exchange, in us. The first exchange also establishes the
+// connections and is not timed.
+static ncclResult_t healthTime(struct ncclComm* comm, int* sendPeers, int nSend, int* recvPeers, int nRecv,
+    char* sendbuff, char* recvbuff, size_t bytes, int iters, cudaStream_t stream, cudaEvent_t start, cudaEvent_t stop, float* us) {
+  for (int i=-1; i<iters; i++) {
+    if (i == 0) CUDACHECK(cudaEventRecord(start, stream));
+    NCCLCHECK(ncclGroupStart());
+    for (int p=0; p<nSend; p++) NCCLCHECK(ncclSend(sendbuff, bytes, ncclChar, sendPeers[p], comm, stream));
+    for (int p=0; p<nRecv; p++) NCCLCHECK(ncclRecv(recvbuff+p*bytes, bytes, ncclChar, recvPeers[p], comm, stream));
+    NCCLCHECK(ncclGroupEnd());
+  }
+  CUDACHECK(cudaEventRecord(stop, stream));
+  CUDACHECK(cudaEventSynchronize(stop));
+  float ms;
+  CUDACHECK(cudaEventElapsedTime(&ms, start, stop));
+  *us = ms*1e3/iters;
+  return ncclSuccess;
+}
+
+static float healthMedian(float* values, int n) {
+  if (n == 0) return 0;
+  std::nth_element(values, values+n/2, values+n);
+  return values[n/2];
+}
+
+static bool healthInter(struct ncclComm* comm, int rank, int peer) {
+  return comm->peerInfo[rank].hostHash != comm->peerInfo[peer].hostHash;
+}
+
+// Checks all links of one pattern against the median of their kind and returns in *ratio
+// how much the slowest one lags behind (1 when none does).
+static void healthReport(struct ncclComm* comm, struct healthInfo* allInfo, int pattern, float* values, float* ratio) {
+  struct ncclPeerInfo* info = comm->peerInfo;
+  *ratio = 1.0;
+  for (int inter=0; inter<2; inter++) {
+    float medBw, medLat, minBw = 0, maxLat = 0;
+    int n = 0;
+    for (int r=0; r<comm->nRanks; r++) {
+      struct healthLink* l = allInfo[r].links+pattern;
+      if (l->peer != -1 && healthInter(comm, r, l->peer) == inter) values[n++] = l->bw;
+    }
+    if (n == 0) continue;
+    medBw = healthMedian(values, n);
+    n = 0;
+    for (int r=0; r<comm->nRanks; r++) {
+      struct healthLink* l = allInfo[r].links+pattern;
+      if (l->peer != -1 && healthInter(comm, r, l->peer) == inter) values[n++] = l->lat;
+    }
+    medLat = healthMedian(values, n);
+    for (int r=0; r<comm->nRanks; r++) {
+      struct healthLink* l = allInfo[r].links+pattern;
+      if (l->peer == -1 || healthInter(comm, r, l->peer) != inter) continue;
+      if (minBw == 0 || l->bw < minBw) minBw = l->bw;
+      maxLat = std::max(maxLat, l->lat);
+      if (comm->rank != 0) continue;
+      if (l->bw < medBw*HEALTH_BW_RATIO) {
+        WARN("Health check : slow %s link rank %d [%lx] -> rank %d [%lx] : %.2f GB/s, median %.2f GB/s",
+            healthPatternStr[pattern], r, info[r].busId, l->peer, info[l->peer].busId, l->bw, medBw);
+      }
+      if (l->lat > medLat*HEALTH_LAT_RATIO) {
+        WARN("Health check : high latency on %s link rank %d [%lx] -> rank %d [%lx] : %.1f us, median %.1f us",
+            healthPatternStr[pattern], r, info[r].busId, l->peer, info[l->peer].busId, l->lat, medLat);
+      }
+    }
+    if (comm->rank == 0) {
+      INFO(NCCL_INIT|NCCL_TUNING, "Health check : %s links %s : bw min/median %.2f/%.2f GB/s, latency median/max %.1f/%.1f us",
+          healthPatternStr[pattern], inter ? "across nodes" : "within nodes", minBw, medBw, medLat, maxLat);
+    }
+    if (medBw > 0) *ratio = std::min(*ratio, minBw/medBw);
+  }
+}
+
+ncclResult_t ncclHealthCheck(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  int mode = ncclParamHealthCheck();
+  if (mode == 0 || comm->nRanks == 1) return ncclSuccess;
+  if (!comm->allBlocking) {
+    // Communication is only allowed once the nonblocking init has been seen complete by the user.
+    // All ranks must skip it together.
+    INFO(NCCL_INIT, "NCCL_HEALTH_CHECK ignored : not supported with nonblocking communicators");
+    return ncclSuccess;
+  }
+
+  size_t bytes = std::max((int64_t)HEALTH_LAT_BYTES, ncclParamHealthCheckBytes());
+  int iters = std::max(1, (int)ncclParamHealthCheckIters());
+  struct ncclChannel* channel = comm->channels;
+  int ringSend[1] = { channel->ring.next };
+  int ringRecv[1] = { channel->ring.prev };
+  int treePeers[NCCL_MAX_TREE_ARITY+1];
+  int nTree = 0;
+  if (channel->tree.up != -1) treePeers[nTree++] = channel->tree.up;
+  for (int i=0; i<NCCL_MAX_TREE_ARITY; i++) if (channel->tree.down[i] != -1) treePeers[nTree++] = channel->tree.down[i];
+
+  char* sendbuff = NULL;
+  char* recvbuff = NULL;
+  cudaStream_t stream = NULL;
+  cudaEvent_t start = NULL, stop = NULL;
+  struct healthInfo* allInfo = NULL;
+  float* values = NULL;
+  float us, ratios[healthNumPatterns];
+  struct healthInfo* myInfo;
+
+  NCCLCHECKGOTO(ncclCalloc(&allInfo, comm->nRanks), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&values, comm->nRanks), ret, exit);
+  NCCLCHECKGOTO(ncclCudaCalloc(&sendbuff, bytes), ret, exit);
+  // One receive buffer per tree neighbor, the ring uses the first one
+  NCCLCHECKGOTO(ncclCudaCalloc(&recvbuff, bytes*std::max(nTree, 1)), ret, exit);
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&start), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&stop), ret, exit);
+
+  myInfo = allInfo+comm->rank;
+  myInfo->links[healthRing].peer = channel->ring.next;
+  NCCLCHECKGOTO(healthTime(comm, ringSend, 1, ringRecv, 1, sendbuff, recvbuff, HEALTH_LAT_BYTES, iters, stream, start, stop, &us), ret, exit);
+  myInfo->links[healthRing].lat = us;
+  NCCLCHECKGOTO(healthTime(comm, ringSend, 1, ringRecv, 1, sendbuff, recvbuff, bytes, iters, stream, start, stop, &us), ret, exit);
+  myInfo->links[healthRing].bw = bytes/(us*1e3);
+  // Every rank has a tree neighbor when there is more than one rank, but only the link to the parent is reported
+  myInfo->links[healthTree].peer = channel->tree.up;
+  NCCLCHECKGOTO(healthTime(comm, treePeers, nTree, treePeers, nTree, sendbuff, recvbuff, HEALTH_LAT_BYTES, iters, stream, start, stop, &us), ret, exit);
+  myInfo->links[healthTree].lat = us;
+  NCCLCHECKGOTO(healthTime(comm, treePeers, nTree, treePeers, nTree, sendbuff, recvbuff, bytes, iters, stream, start, stop, &us), ret, exit);
+  myInfo->links[healthTree].bw = bytes/(us*1e3);
+  TRACE(NCCL_INIT, "Health check : ring -> %d %.2f GB/s %.1f us, tree -> %d %.2f GB/s %.1f us",
+      myInfo->links[healthRing].peer, myInfo->links[healthRing].bw, myInfo->links[healthRing].lat,
+      myInfo->links[healthTree].peer, myInfo->links[healthTree].bw, myInfo->links[healthTree].lat);
+
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allInfo, sizeof(struct healthInfo)), ret, exit);
+  for (int p=0; p<healthNumPatterns; p++) healthReport(comm, allInfo, p, values, ratios+p);
+
+  if (mode == 2) {
+    // Ring and Tree run at the pace of their slowest link, which the model assumed to be as fast as the others.
+    // All ranks compute the same ratios from the same data, so they keep making the same choices.
+    int algos[healthNumPatterns] = { NCCL_ALGO_RING, NCCL_ALGO_TREE };
+    for (int p=0; p<healthNumPatterns; p++) {
+      if (ratios[p] >= 1.0) continue;
+      for (int f=0; f<NCCL_NUM_FUNCTIONS; f++) {
+        for (int pr=0; pr<NCCL_NUM_PROTOCOLS; pr++) comm->bandwidths[f][algos[p]][pr] *= ratios[p];
+      }
+      INFO(NCCL_INIT|NCCL_TUNING, "Health check : %s bandwidths scaled by %.2f", healthPatternStr[p], ratios[p]);
+    }
+  }
+
+exit:
+  if (stop) cudaEventDestroy(stop);
+  if (start) cudaEventDestroy(start);
+  if (stream) cudaStreamDestroy(stream);
+  if (recvbuff) ncclCudaFree(recvbuff);
+  if (sendbuff) ncclCudaFree(sendbuff);
+  free(values);
+  free(allInfo);
+  return ret;
+}
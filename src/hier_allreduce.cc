@@ -0,0 +1,208 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "hier_allreduce.h"
+#include "comm.h"
+#include "group.h"
+#include "graph.h"
+#include "bootstrap.h"
+
+// 0: disabled, 1: when the tuning model prefers it, 2: always
+NCCL_PARAM(HierAllReduce, "HIER_ALLREDUCE", 0);
+NCCL_PARAM(HierAllReduceMinBytes, "HIER_ALLREDUCE_MIN_BYTES", 1 << 20);
+NCCL_PARAM(HierAllReduceChunkSize, "HIER_ALLREDUCE_CHUNKSIZE", 1 << 23);
+
+struct ncclHierAr {
+  ncclComm_t node;      // GPUs of this node, by local rank
+  ncclComm_t rail;      // GPUs of this local rank, by node
+  cudaStream_t stream;  // Runs the operations on the rail
+  cudaEvent_t scattered;
+  cudaEvent_t reduced[2];
+  uint64_t wanted;      // Bit i: the model wants sizes from 2^i bytes hierarchical, on all ranks
+};
+
+#define HIER_AR_MAX_LOG 48
+
+// Set while running an AllReduce the model did not want hierarchical, which comes back here
+static __thread bool hierArBypass = false;
+
+// Best modeled time of a collective of nBytes on comm
+static ncclResult_t hierArTime(struct ncclComm* comm, ncclFunc_t coll, size_t nBytes, float* time) {
+  struct ncclInfo model;
+  memset(&model, 0, sizeof(model));
+  model.comm = comm;
+  model.coll = coll;
+  model.datatype = ncclFloat32;
+  model.op = ncclSum;
+  model.nBytes = nBytes;
+  *time = -1;
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    if (a == NCCL_ALGO_COLLNET_DIRECT || a == NCCL_ALGO_COLLNET_CHAIN) continue;
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      float t;
+      NCCLCHECK(ncclTopoGetAlgoTime(&model, a, p, 1, &t));
+      if (t >= 0 && (*time < 0 || t < *time)) *time = t;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Whether the hierarchical schedule is modeled faster than the regular algorithms. The work
+// within the node (ReduceScatter then AllGather) overlaps the AllReduce across nodes, except
+// for the first and last chunks.
+static ncclResult_t hierArWanted(struct ncclComm* comm, size_t nBytes, bool* wanted) {
+  struct ncclHierAr* ha = comm->hierAr;
+  size_t nChunks = DIVUP(nBytes, (size_t)ncclParamHierAllReduceChunkSize());
+  float flat, rs, ag, ar;
+  *wanted = true;
+  NCCLCHECK(hierArTime(comm, ncclFuncAllReduce, nBytes, &flat));
+  NCCLCHECK(hierArTime(ha->node, ncclFuncReduceScatter, nBytes, &rs));
+  NCCLCHECK(hierArTime(ha->node, ncclFuncAllGather, nBytes, &ag));
+  NCCLCHECK(hierArTime(ha->rail, ncclFuncAllReduce, nBytes/comm->localRanks, &ar));
+  if (flat < 0) return ncclSuccess;
+  if (rs < 0 || ag < 0 || ar < 0) { *wanted = false; return ncclSuccess; }
+  float hier = std::max(rs+ag, ar) + std::min(rs+ag, ar)/nChunks;
+  *wanted = hier < flat;
+  if (comm->rank == 0) TRACE(NCCL_TUNING, "%ld Bytes -> hierarchical AllReduce time %f (regular %f)", nBytes, hier, flat);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclHierArInit(struct ncclComm* comm) {
+  struct ncclHierAr* ha = NULL;
+  uint64_t* wanted = NULL;
+  ncclResult_t ret = ncclSuccess;
+
+  comm->hierArState = -1;
+  if (!ncclParamHierAllReduce() || !comm->allBlocking) return ncclSuccess;
+  // Every node needs the same number of GPUs, and more than one, for the rails to line up
+  if (comm->nNodes < 2 || comm->maxLocalRanks < 2 || comm->nNodes*comm->maxLocalRanks != comm->nRanks) return ncclSuccess;
+
+  NCCLCHECK(ncclCalloc(&ha, 1));
+  comm->hierAr = ha;
+  NCCLCHECKGOTO(ncclCommSplit(comm, comm->node, comm->localRank, &ha->node, NULL), ret, fail);
+  NCCLCHECKGOTO(ncclCommSplit(comm, comm->localRank, comm->node, &ha->rail, NULL), ret, fail);
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&ha->stream, cudaStreamNonBlocking), ret, fail);
+  CUDACHECKGOTO(cudaEventCreateWithFlags(&ha->scattered, cudaEventDisableTiming), ret, fail);
+  for (int i=0; i<2; i++) CUDACHECKGOTO(cudaEventCreateWithFlags(ha->reduced+i, cudaEventDisableTiming), ret, fail);
+
+  // The node and rail models differ between ranks, so decide per power of two on each rank
+  // and only go hierarchical where all ranks want it.
+  NCCLCHECKGOTO(ncclCalloc(&wanted, comm->nRanks), ret, fail);
+  for (int i=0; i<HIER_AR_MAX_LOG; i++) {
+    bool w = true;
+    if (ncclParamHierAllReduce() != 2) NCCLCHECKGOTO(hierArWanted(comm, 1ULL << i, &w), ret, fail);
+    if (w) wanted[comm->rank] |= 1ULL << i;
+  }
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, wanted, sizeof(uint64_t)), ret, fail);
+  ha->wanted = ~0ULL;
+  for (int r=0; r<comm->nRanks; r++) ha->wanted &= wanted[r];
+  INFO(NCCL_INIT, "Hierarchical AllReduce enabled, %d nodes of %d GPUs", comm->nNodes, comm->localRanks);
+  comm->hierArState = 1;
+exit:
+  free(wanted);
+  return ret;
+fail:
+  (void)ncclHierArFree(comm, true);
+  goto exit;
+}
+
+ncclResult_t ncclHierArEligible(struct ncclInfo* info, bool* eligible) {
+  struct ncclComm* comm = info->comm;
+  *eligible = false;
+  if (hierArBypass || comm->hierArState != 1) return ncclSuccess;
+  if (info->coll != ncclFuncAllReduce) return ncclSuccess;
+  // User operations belong to this communicator, and integer averages would round twice
+  if (int(info->op) >= int(ncclNumOps)) return ncclSuccess;
+  if (info->op == ncclAvg && info->datatype != ncclFloat16 && info->datatype != ncclFloat32 &&
+      info->datatype != ncclFloat64 && info->datatype != ncclBfloat16) return ncclSuccess;
+  if (info->count*ncclTypeSize(info->datatype) < (size_t)ncclParamHierAllReduceMinBytes()) return ncclSuccess;
+  // The steps are issued once the group has ended, one after the other, out of order with
+  // the rest of a group. Only this rank knows whether it is in one, so the others cannot
+  // be told to fall back.
+  if (ncclGroupDepth != 1) {
+    WARN("%s : hierarchical AllReduce (NCCL_HIER_ALLREDUCE) cannot be called within a group", info->opName);
+    return ncclInvalidUsage;
+  }
+  *eligible = true;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclHierArRun(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  size_t esize = ncclTypeSize(info->datatype);
+  int localRanks = comm->localRanks;
+  size_t chunkCount = std::max<size_t>(ncclParamHierAllReduceChunkSize()/esize/localRanks, 1)*localRanks;
+  const char* sendbuff = (const char*)info->sendbuff;
+  char* recvbuff = (char*)info->recvbuff;
+  cudaStream_t stream = info->stream;
+  size_t bulk = info->count/localRanks*localRanks;
+  struct ncclHierAr* ha = comm->hierAr;
+  int log = std::min((int)log2i(info->count*esize), HIER_AR_MAX_LOG-1);
+  int nChunks = 0;
+
+  if ((ha->wanted & (1ULL << log)) == 0) {
+    ncclResult_t ret;
+    hierArBypass = true;
+    ret = ncclAllReduce(info->sendbuff, info->recvbuff, info->count, info->datatype, info->op, comm, stream);
+    hierArBypass = false;
+    return ret;
+  }
+
+  // Chunk k: ReduceScatter on the stream, AllReduce of our share on the side stream once
+  // it is scattered, and AllGather on the stream once it is reduced. The AllGather of chunk
+  // k is issued after the ReduceScatter of chunk k+1, so that the node keeps busy while
+  // the rail works.
+  for (size_t off = 0; off < bulk; off += chunkCount, nChunks++) {
+    size_t count = std::min(chunkCount, bulk-off);
+    size_t share = count/localRanks;
+    char* mine = recvbuff + (off + comm->localRank*share)*esize;
+    NCCLCHECK(ncclReduceScatter(sendbuff+off*esize, mine, share, info->datatype, info->op, ha->node, stream));
+    CUDACHECK(cudaEventRecord(ha->scattered, stream));
+    CUDACHECK(cudaStreamWaitEvent(ha->stream, ha->scattered, 0));
+    NCCLCHECK(ncclAllReduce(mine, mine, share, info->datatype, info->op, ha->rail, ha->stream));
+    CUDACHECK(cudaEventRecord(ha->reduced[nChunks%2], ha->stream));
+    if (off > 0) {
+      size_t prevOff = off-chunkCount, prevShare = chunkCount/localRanks;
+      CUDACHECK(cudaStreamWaitEvent(stream, ha->reduced[(nChunks-1)%2], 0));
+      NCCLCHECK(ncclAllGather(recvbuff + (prevOff + comm->localRank*prevShare)*esize, recvbuff+prevOff*esize, prevShare, info->datatype, ha->node, stream));
+    }
+  }
+  if (nChunks > 0) {
+    size_t lastOff = (nChunks-1)*chunkCount, lastShare = (bulk-lastOff)/localRanks;
+    CUDACHECK(cudaStreamWaitEvent(stream, ha->reduced[(nChunks-1)%2], 0));
+    NCCLCHECK(ncclAllGather(recvbuff + (lastOff + comm->localRank*lastShare)*esize, recvbuff+lastOff*esize, lastShare, info->datatype, ha->node, stream));
+  }
+  // Less than one element per local rank left
+  if (bulk < info->count) {
+    hierArBypass = true;
+    ncclResult_t ret = ncclAllReduce(sendbuff+bulk*esize, recvbuff+bulk*esize, info->count-bulk, info->datatype, info->op, comm, stream);
+    hierArBypass = false;
+    NCCLCHECK(ret);
+  }
+  return ncclSuccess;
+}
+
+int ncclHierArSubComms(struct ncclComm* comm, struct ncclComm* subComms[2]) {
+  struct ncclHierAr* ha = comm->hierAr;
+  int n = 0;
+  if (ha == NULL) return 0;
+  if (ha->node) subComms[n++] = ha->node;
+  if (ha->rail) subComms[n++] = ha->rail;
+  return n;
+}
+
+ncclResult_t ncclHierArFree(struct ncclComm* comm, bool abort) {
+  struct ncclHierAr* ha = comm->hierAr;
+  if (ha == NULL) return ncclSuccess;
+  if (ha->node) NCCLCHECK(abort ? ncclCommAbort(ha->node) : ncclCommDestroy(ha->node));
+  if (ha->rail) NCCLCHECK(abort ? ncclCommAbort(ha->rail) : ncclCommDestroy(ha->rail));
+  if (ha->scattered) CUDACHECK(cudaEventDestroy(ha->scattered));
+  for (int i=0; i<2; i++) if (ha->reduced[i]) CUDACHECK(cudaEventDestroy(ha->reduced[i]));
+  if (ha->stream) CUDACHECK(cudaStreamDestroy(ha->stream));
+  free(ha);
+  comm->hierAr = NULL;
+  return ncclSuccess;
+}
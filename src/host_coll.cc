@@ -0,0 +1,495 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "host_coll.h"
+#include "comm.h"
+#include "group.h"
+#include "bootstrap.h"
+#include "graph.h"
+#include "net.h"
+#include "cudawrap.h"
+#include <pthread.h>
+
+NCCL_PARAM(HostColl, "HOST_COLL", 0);
+NCCL_PARAM(HostCollChunkSize, "HOST_COLL_CHUNKSIZE", 1 << 19);
+// Run host collectives on a worker thread in stream order instead of on the caller
+NCCL_PARAM(HostCollOffload, "HOST_COLL_OFFLOAD", 1);
+
+#define NCCL_HOST_COLL_SLOTS 4 // Chunks in flight in each direction
+
+// An operation handed to the worker
+struct ncclHostCollOp {
+  struct ncclHostCollOp* next;
+  struct ncclHostColl* hc;
+  ncclFunc_t coll;
+  const void* sendbuff;
+  void* recvbuff;
+  size_t count;
+  ncclDataType_t datatype;
+  ncclRedOp_t op;
+  int root;
+  uint32_t seq;
+};
+
+struct ncclHostColl {
+  void* listenComm;
+  void* sendComm; // To rank+1
+  void* recvComm; // From rank-1
+  // NCCL_HOST_COLL_SLOTS send slots then as many receive slots, registered on both comms
+  char* pool;
+  void* sendMhandle;
+  void* recvMhandle;
+  size_t chunkSize;
+
+  // With NCCL_HOST_COLL_OFFLOAD, operations run on a worker thread. A host function
+  // on the stream hands each one over once the work before it is done, and the
+  // stream waits for the worker to set doneFlag to its sequence number. Operations
+  // run in sequence order, which is the same on all ranks, whatever order their
+  // streams reach them in.
+  bool offload;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct ncclHostCollOp* ready; // Handed over, not run yet
+  bool stop;
+  uint32_t posted; // Sequence number of the last operation enqueued
+  uint32_t* doneFlag;
+  CUdeviceptr doneFlagDev;
+};
+
+// Host reductions are plain loops over restrict pointers, which the compiler
+// vectorizes, see NCCL_HOST_SIMD.
+
+#define HOST_REDUCE(name, T) \
+NCCL_HOST_SIMD static void name(T* __restrict__ dst, const T* __restrict__ src, size_t n, ncclRedOp_t op) { \
+  switch (op) { \
+  case ncclProd: for (size_t i=0; i<n; i++) dst[i] *= src[i]; break; \
+  case ncclMax: for (size_t i=0; i<n; i++) dst[i] = dst[i] < src[i] ? src[i] : dst[i]; break; \
+  case ncclMin: for (size_t i=0; i<n; i++) dst[i] = dst[i] < src[i] ? dst[i] : src[i]; break; \
+  default: for (size_t i=0; i<n; i++) dst[i] += src[i]; break; \
+  } \
+}
+
+HOST_REDUCE(hostReduceI8, int8_t)
+HOST_REDUCE(hostReduceU8, uint8_t)
+HOST_REDUCE(hostReduceI32, int32_t)
+HOST_REDUCE(hostReduceU32, uint32_t)
+HOST_REDUCE(hostReduceI64, int64_t)
+HOST_REDUCE(hostReduceU64, uint64_t)
+HOST_REDUCE(hostReduceF32, float)
+HOST_REDUCE(hostReduceF64, double)
+
+// bfloat16 sums are computed in fp32 and rounded to nearest even, like on the GPU
+NCCL_HOST_SIMD static void hostReduceBF16(uint16_t* __restrict__ dst, const uint16_t* __restrict__ src, size_t n) {
+  for (size_t i=0; i<n; i++) {
+    uint32_t a = uint32_t(dst[i]) << 16, b = uint32_t(src[i]) << 16;
+    float fa, fb;
+    memcpy(&fa, &a, sizeof(float));
+    memcpy(&fb, &b, sizeof(float));
+    float sum = fa + fb;
+    uint32_t bits;
+    memcpy(&bits, &sum, sizeof(float));
+    bits = sum != sum ? (bits | 0x00400000) : bits + 0x7fff + ((bits >> 16) & 1);
+    dst[i] = bits >> 16;
+  }
+}
+
+static bool hostReduceSupported(ncclDataType_t datatype, ncclRedOp_t op) {
+  if (int(op) >= int(ncclNumOps)) return false;
+  switch (datatype) {
+  case ncclInt8: case ncclUint8: case ncclInt32: case ncclUint32: case ncclInt64: case ncclUint64:
+    // Averages of integers would be rounded differently from the GPU path
+    return op != ncclAvg;
+  case ncclFloat32: case ncclFloat64:
+    return true;
+  case ncclBfloat16:
+    return op == ncclSum;
+  default:
+    return false;
+  }
+}
+
+// dst[i] = dst[i] op src[i], sum for ncclAvg
+static void hostReduce(void* dst, const void* src, size_t bytes, ncclDataType_t datatype, ncclRedOp_t op) {
+  size_t n = bytes/ncclTypeSize(datatype);
+  switch (datatype) {
+  case ncclInt8: hostReduceI8((int8_t*)dst, (const int8_t*)src, n, op); break;
+  case ncclUint8: hostReduceU8((uint8_t*)dst, (const uint8_t*)src, n, op); break;
+  case ncclInt32: hostReduceI32((int32_t*)dst, (const int32_t*)src, n, op); break;
+  case ncclUint32: hostReduceU32((uint32_t*)dst, (const uint32_t*)src, n, op); break;
+  case ncclInt64: hostReduceI64((int64_t*)dst, (const int64_t*)src, n, op); break;
+  case ncclUint64: hostReduceU64((uint64_t*)dst, (const uint64_t*)src, n, op); break;
+  case ncclFloat32: hostReduceF32((float*)dst, (const float*)src, n, op); break;
+  case ncclFloat64: hostReduceF64((double*)dst, (const double*)src, n, op); break;
+  case ncclBfloat16: hostReduceBF16((uint16_t*)dst, (const uint16_t*)src, n); break;
+  default: break;
+  }
+}
+
+static ncclResult_t hostCollOp(struct ncclComm* comm, struct ncclHostCollOp* op);
+
+static void* hostCollWorker(void* arg) {
+  struct ncclComm* comm = (struct ncclComm*)arg;
+  struct ncclHostColl* hc = comm->hostColl;
+  uint32_t next = 1;
+  pthread_mutex_lock(&hc->lock);
+  while (!hc->stop) {
+    struct ncclHostCollOp** prev = &hc->ready;
+    while (*prev && (*prev)->seq != next) prev = &(*prev)->next;
+    if (*prev == NULL) {
+      pthread_cond_wait(&hc->cond, &hc->lock);
+      continue;
+    }
+    struct ncclHostCollOp* op = *prev;
+    *prev = op->next;
+    pthread_mutex_unlock(&hc->lock);
+    ncclResult_t ret = hostCollOp(comm, op);
+    // The stream is released even on failure, the error is reported on the comm
+    if (ret != ncclSuccess) (void)ncclCommSetAsyncError(comm, ret);
+    __atomic_store_n(hc->doneFlag, op->seq, __ATOMIC_RELEASE);
+    free(op);
+    if (++next == 0) next = 1;
+    pthread_mutex_lock(&hc->lock);
+  }
+  pthread_mutex_unlock(&hc->lock);
+  return NULL;
+}
+
+// Runs on the stream once the work before the operation is done. No CUDA calls here.
+static void hostCollKick(void* arg) {
+  struct ncclHostCollOp* op = (struct ncclHostCollOp*)arg;
+  struct ncclHostColl* hc = op->hc;
+  pthread_mutex_lock(&hc->lock);
+  op->next = hc->ready;
+  hc->ready = op;
+  pthread_cond_signal(&hc->cond);
+  pthread_mutex_unlock(&hc->lock);
+}
+
+static ncclResult_t hostCollOffloadStart(struct ncclComm* comm) {
+  struct ncclHostColl* hc = comm->hostColl;
+  void* dflag;
+  NCCLCHECK(ncclCudaHostCalloc(&hc->doneFlag, 1));
+  CUDACHECK(cudaHostGetDevicePointer(&dflag, hc->doneFlag, 0));
+  hc->doneFlagDev = (CUdeviceptr)dflag;
+  pthread_mutex_init(&hc->lock, NULL);
+  pthread_cond_init(&hc->cond, NULL);
+  if (pthread_create(&hc->thread, NULL, hostCollWorker, comm) != 0) {
+    WARN("HostColl : failed to start the worker thread");
+    pthread_mutex_destroy(&hc->lock);
+    pthread_cond_destroy(&hc->cond);
+    return ncclSystemError;
+  }
+  hc->offload = true;
+  ncclSetThreadName(hc->thread, "NCCL HostColl%2d", comm->cudaDev);
+  return ncclSuccess;
+}
+
+static ncclResult_t hostCollSetup(struct ncclComm* comm) {
+  struct ncclHostColl* hc = NULL;
+  ncclNetHandle_t* handles = NULL;
+  ncclResult_t ret = ncclSuccess;
+  int dev;
+  size_t poolSize;
+
+  NCCLCHECK(ncclCalloc(&hc, 1));
+  comm->hostColl = hc;
+  hc->chunkSize = ROUNDUP(std::max<int64_t>(ncclParamHostCollChunkSize(), 4096), 4096);
+  poolSize = 2*NCCL_HOST_COLL_SLOTS*hc->chunkSize;
+  NCCLCHECKGOTO(ncclTopoGetLocalNet(comm->topo, comm->rank, 0, &dev), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&handles, comm->nRanks), ret, fail);
+  NCCLCHECKGOTO(comm->ncclNet->listen(dev, handles+comm->rank, &hc->listenComm), ret, fail);
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, handles, sizeof(ncclNetHandle_t)), ret, fail);
+  // Neither side blocks, so connect to the next rank while accepting the previous one
+  while (hc->sendComm == NULL || hc->recvComm == NULL) {
+    if (hc->sendComm == NULL) NCCLCHECKGOTO(comm->ncclNet->connect(dev, handles+(comm->rank+1)%comm->nRanks, &hc->sendComm), ret, fail);
+    if (hc->recvComm == NULL) NCCLCHECKGOTO(comm->ncclNet->accept(hc->listenComm, &hc->recvComm), ret, fail);
+  }
+  NCCLCHECKGOTO(ncclCalloc(&hc->pool, poolSize), ret, fail);
+  NCCLCHECKGOTO(comm->ncclNet->regMr(hc->sendComm, hc->pool, poolSize, NCCL_PTR_HOST, &hc->sendMhandle), ret, fail);
+  NCCLCHECKGOTO(comm->ncclNet->regMr(hc->recvComm, hc->pool, poolSize, NCCL_PTR_HOST, &hc->recvMhandle), ret, fail);
+  if (ncclParamHostCollOffload() && ncclCudaStreamMemOpsSupported(comm->cudaDev)) NCCLCHECKGOTO(hostCollOffloadStart(comm), ret, fail);
+  INFO(NCCL_INIT|NCCL_NET, "Host memory collectives enabled over %s, chunks of %zu bytes%s", comm->ncclNet->name, hc->chunkSize,
+      hc->offload ? ", on a worker thread" : "");
+  comm->hostCollState = 1;
+exit:
+  free(handles);
+  return ret;
+fail:
+  (void)ncclHostCollFree(comm);
+  goto exit;
+}
+
+ncclResult_t ncclHostCollInit(struct ncclComm* comm) {
+  comm->hostCollState = -1;
+  if (!ncclParamHostColl() || !comm->allBlocking) return ncclSuccess;
+  // A single rank only copies, without a ring
+  if (comm->nRanks == 1) {
+    comm->hostCollState = 1;
+    return ncclSuccess;
+  }
+  return hostCollSetup(comm);
+}
+
+static bool hostPtr(const void* ptr) {
+  cudaPointerAttributes attr;
+  if (cudaPointerGetAttributes(&attr, ptr) != cudaSuccess) {
+    (void)cudaGetLastError();
+    return false;
+  }
+  return attr.type == cudaMemoryTypeHost || attr.type == cudaMemoryTypeUnregistered;
+}
+
+ncclResult_t ncclHostCollEligible(struct ncclInfo* info, bool* eligible) {
+  struct ncclComm* comm = info->comm;
+  ncclResult_t ret = ncclSuccess;
+  int* states = NULL;
+  int any = 0, all = 1;
+  *eligible = false;
+  if (comm->hostCollState != 1 || info->mixed) return ncclSuccess;
+  if (info->coll == ncclFuncAllReduce) {
+    if (!hostReduceSupported(info->datatype, info->op)) return ncclSuccess;
+  } else if (info->coll != ncclFuncBroadcast) {
+    return ncclSuccess;
+  }
+  if (info->count == 0) return ncclSuccess;
+  // Where the buffers are, whether the call is in a group and whether the stream is captured
+  // are only known to this rank, so the ranks agree on the path. 0: device buffers, 1: host
+  // buffers, 2: host buffers but the call is issued right away, out of order with the rest
+  // of a group, as a per-call operation which a graph cannot replay.
+  NCCLCHECK(ncclCalloc(&states, comm->nRanks));
+  if (hostPtr(info->recvbuff) && ((info->coll == ncclFuncBroadcast && info->root != comm->rank) || hostPtr(info->sendbuff))) {
+    cudaStreamCaptureStatus status;
+    CUDACHECKGOTO(cudaStreamIsCapturing(info->stream, &status), ret, exit);
+    states[comm->rank] = ncclGroupDepth != 1 || status != cudaStreamCaptureStatusNone ? 2 : 1;
+  }
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, states, sizeof(int)), ret, exit);
+  for (int r=0; r<comm->nRanks; r++) {
+    any |= states[r] != 0;
+    all &= states[r] == 1;
+  }
+  if (any && !all) {
+    WARN("%s : host memory collectives (NCCL_HOST_COLL) need buffers in host memory on all ranks, outside of groups and graphs", info->opName);
+    ret = ncclInvalidUsage;
+    goto exit;
+  }
+  *eligible = all;
+exit:
+  free(states);
+  return ret;
+}
+
+// Sends sendBytes from send to the next rank while receiving recvBytes from the previous
+// one into recv, reduced into it unless op is ncclNumOps. Either side may be empty.
+static ncclResult_t hostExchange(struct ncclComm* comm, const char* send, size_t sendBytes, char* recv, size_t recvBytes,
+    ncclDataType_t datatype, ncclRedOp_t op) {
+  struct ncclHostColl* hc = comm->hostColl;
+  ncclNet_t* net = comm->ncclNet;
+  size_t C = hc->chunkSize;
+  void* sendReqs[NCCL_HOST_COLL_SLOTS];
+  void* recvReqs[NCCL_HOST_COLL_SLOTS];
+  size_t nSends = DIVUP(sendBytes, C), nRecvs = DIVUP(recvBytes, C);
+  size_t sendPosted = 0, sendDone = 0, recvPosted = 0, recvDone = 0;
+  while (sendDone < nSends || recvDone < nRecvs) {
+    if (__atomic_load_n(comm->abortFlag, __ATOMIC_RELAXED)) return ncclInternalError;
+    while (recvPosted < nRecvs && recvPosted-recvDone < NCCL_HOST_COLL_SLOTS) {
+      int slot = recvPosted%NCCL_HOST_COLL_SLOTS, size = C, tag = 0;
+      void* data = hc->pool + (NCCL_HOST_COLL_SLOTS+slot)*C;
+      NCCLCHECK(net->irecv(hc->recvComm, 1, &data, &size, &tag, &hc->recvMhandle, recvReqs+slot));
+      if (recvReqs[slot] == NULL) break;
+      recvPosted++;
+    }
+    while (sendPosted < nSends && sendPosted-sendDone < NCCL_HOST_COLL_SLOTS) {
+      int slot = sendPosted%NCCL_HOST_COLL_SLOTS;
+      size_t off = sendPosted*C;
+      int size = std::min(C, sendBytes-off);
+      memcpy(hc->pool + slot*C, send+off, size);
+      NCCLCHECK(net->isend(hc->sendComm, hc->pool + slot*C, size, 0, hc->sendMhandle, sendReqs+slot));
+      if (sendReqs[slot] == NULL) break;
+      sendPosted++;
+    }
+    while (sendDone < sendPosted) {
+      int done;
+      NCCLCHECK(net->test(sendReqs[sendDone%NCCL_HOST_COLL_SLOTS], &done, NULL));
+      if (!done) break;
+      sendDone++;
+    }
+    while (recvDone < recvPosted) {
+      int done, slot = recvDone%NCCL_HOST_COLL_SLOTS;
+      NCCLCHECK(net->test(recvReqs[slot], &done, NULL));
+      if (!done) break;
+      size_t off = recvDone*C;
+      size_t size = std::min(C, recvBytes-off);
+      const char* data = hc->pool + (NCCL_HOST_COLL_SLOTS+slot)*C;
+      if (op == ncclNumOps) memcpy(recv+off, data, size);
+      else hostReduce(recv+off, data, size, datatype, op);
+      recvDone++;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Receives nBytes from the previous rank into recv, passing each chunk on to the next
+// rank straight from the receive slot as soon as it lands.
+static ncclResult_t hostForward(struct ncclComm* comm, char* recv, size_t nBytes) {
+  struct ncclHostColl* hc = comm->hostColl;
+  ncclNet_t* net = comm->ncclNet;
+  size_t C = hc->chunkSize;
+  void* recvReqs[NCCL_HOST_COLL_SLOTS];
+  void* sendReqs[NCCL_HOST_COLL_SLOTS];
+  size_t n = DIVUP(nBytes, C);
+  size_t recvPosted = 0, recvDone = 0, sendPosted = 0, sendDone = 0;
+  while (sendDone < n) {
+    if (__atomic_load_n(comm->abortFlag, __ATOMIC_RELAXED)) return ncclInternalError;
+    // A slot is free once its chunk has been passed on
+    while (recvPosted < n && recvPosted-sendDone < NCCL_HOST_COLL_SLOTS) {
+      int slot = recvPosted%NCCL_HOST_COLL_SLOTS, size = C, tag = 0;
+      void* data = hc->pool + (NCCL_HOST_COLL_SLOTS+slot)*C;
+      NCCLCHECK(net->irecv(hc->recvComm, 1, &data, &size, &tag, &hc->recvMhandle, recvReqs+slot));
+      if (recvReqs[slot] == NULL) break;
+      recvPosted++;
+    }
+    while (recvDone < recvPosted) {
+      int done, slot = recvDone%NCCL_HOST_COLL_SLOTS;
+      NCCLCHECK(net->test(recvReqs[slot], &done, NULL));
+      if (!done) break;
+      size_t off = recvDone*C;
+      memcpy(recv+off, hc->pool + (NCCL_HOST_COLL_SLOTS+slot)*C, std::min(C, nBytes-off));
+      recvDone++;
+    }
+    while (sendPosted < recvDone) {
+      int slot = sendPosted%NCCL_HOST_COLL_SLOTS;
+      size_t off = sendPosted*C;
+      NCCLCHECK(net->isend(hc->sendComm, hc->pool + (NCCL_HOST_COLL_SLOTS+slot)*C, std::min(C, nBytes-off), 0, hc->sendMhandle, sendReqs+slot));
+      if (sendReqs[slot] == NULL) break;
+      sendPosted++;
+    }
+    while (sendDone < sendPosted) {
+      int done;
+      NCCLCHECK(net->test(sendReqs[sendDone%NCCL_HOST_COLL_SLOTS], &done, NULL));
+      if (!done) break;
+      sendDone++;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Ring ReduceScatter then ring AllGather on recvbuff, in blocks of whole elements
+static ncclResult_t hostAllReduce(struct ncclComm* comm, char* buff, size_t count, ncclDataType_t datatype, ncclRedOp_t op) {
+  int rank = comm->rank, nRanks = comm->nRanks;
+  size_t esize = ncclTypeSize(datatype);
+  size_t blockCount = DIVUP(count, nRanks);
+  auto block = [&](int b, size_t* bytes) -> char* {
+    size_t lo = std::min(count, b*blockCount), hi = std::min(count, (b+1)*blockCount);
+    *bytes = (hi-lo)*esize;
+    return buff + lo*esize;
+  };
+  for (int s=0; s<2*(nRanks-1); s++) {
+    size_t sendBytes, recvBytes;
+    char* send = block((rank-s+2*nRanks)%nRanks, &sendBytes);
+    char* recv = block((rank-s-1+2*nRanks)%nRanks, &recvBytes);
+    NCCLCHECK(hostExchange(comm, send, sendBytes, recv, recvBytes, datatype, s < nRanks-1 ? op : ncclNumOps));
+  }
+  if (op == ncclAvg) {
+    if (datatype == ncclFloat32) for (size_t i=0; i<count; i++) ((float*)buff)[i] /= nRanks;
+    if (datatype == ncclFloat64) for (size_t i=0; i<count; i++) ((double*)buff)[i] /= nRanks;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t hostCollOp(struct ncclComm* comm, struct ncclHostCollOp* op) {
+  int rank = comm->rank, nRanks = comm->nRanks;
+  size_t nBytes = op->count*ncclTypeSize(op->datatype);
+  char* recvbuff = (char*)op->recvbuff;
+  bool copyIn = op->coll == ncclFuncAllReduce || rank == op->root;
+
+  if (copyIn && op->sendbuff != recvbuff) memcpy(recvbuff, op->sendbuff, nBytes);
+  if (nRanks > 1) {
+    if (op->coll == ncclFuncAllReduce) {
+      NCCLCHECK(hostAllReduce(comm, recvbuff, op->count, op->datatype, op->op));
+    } else if (rank == op->root) {
+      NCCLCHECK(hostExchange(comm, recvbuff, nBytes, NULL, 0, op->datatype, ncclNumOps));
+    } else if ((rank+1)%nRanks == op->root) {
+      NCCLCHECK(hostExchange(comm, NULL, 0, recvbuff, nBytes, op->datatype, ncclNumOps));
+    } else {
+      NCCLCHECK(hostForward(comm, recvbuff, nBytes));
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclHostCollRun(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  struct ncclHostColl* hc = comm->hostColl;
+  struct ncclHostCollOp* op;
+  NCCLCHECK(ncclCalloc(&op, 1));
+  op->coll = info->coll;
+  op->sendbuff = info->sendbuff;
+  op->recvbuff = info->recvbuff;
+  op->count = info->count;
+  op->datatype = info->datatype;
+  op->op = info->op;
+  op->root = info->root;
+  comm->opCount++;
+  if (hc == NULL || !hc->offload) {
+    // Data produced on the stream, e.g. copied from the GPU, must have landed
+    ncclResult_t ret = ncclSuccess;
+    CUDACHECKGOTO(cudaStreamSynchronize(info->stream), ret, exit);
+    ret = hostCollOp(comm, op);
+exit:
+    free(op);
+    return ret;
+  }
+#if CUDA_VERSION >= 11070
+  if (++hc->posted == 0) hc->posted = 1; // The flag starts at 0
+  op->seq = hc->posted;
+  op->hc = hc;
+  {
+    uint32_t seq = op->seq;
+    if (cudaLaunchHostFunc(info->stream, hostCollKick, op) != cudaSuccess) {
+      WARN("HostColl : failed to enqueue %s on the stream", info->opName);
+      hc->posted = seq-1;
+      free(op);
+      return ncclUnhandledCudaError;
+    }
+    // op belongs to the worker from here
+    CUCHECK(cuStreamWaitValue32(info->stream, hc->doneFlagDev, seq, CU_STREAM_WAIT_VALUE_GEQ));
+  }
+  return ncclSuccess;
+#else
+  free(op);
+  return ncclInternalError;
+#endif
+}
+
+ncclResult_t ncclHostCollFree(struct ncclComm* comm) {
+  struct ncclHostColl* hc = comm->hostColl;
+  if (hc == NULL) return ncclSuccess;
+  if (hc->offload) {
+    pthread_mutex_lock(&hc->lock);
+    hc->stop = true;
+    pthread_cond_signal(&hc->cond);
+    pthread_mutex_unlock(&hc->lock);
+    pthread_join(hc->thread, NULL);
+    while (hc->ready) {
+      struct ncclHostCollOp* op = hc->ready;
+      hc->ready = op->next;
+      free(op);
+    }
+    pthread_mutex_destroy(&hc->lock);
+    pthread_cond_destroy(&hc->cond);
+  }
+  if (hc->doneFlag) NCCLCHECK(ncclCudaHostFree(hc->doneFlag));
+  if (hc->sendMhandle) NCCLCHECK(comm->ncclNet->deregMr(hc->sendComm, hc->sendMhandle));
+  if (hc->recvMhandle) NCCLCHECK(comm->ncclNet->deregMr(hc->recvComm, hc->recvMhandle));
+  if (hc->sendComm) NCCLCHECK(comm->ncclNet->closeSend(hc->sendComm));
+  if (hc->recvComm) NCCLCHECK(comm->ncclNet->closeRecv(hc->recvComm));
+  if (hc->listenComm) NCCLCHECK(comm->ncclNet->closeListen(hc->listenComm));
+  free(hc->pool);
+  free(hc);
+  comm->hostColl = NULL;
+  return ncclSuccess;
+}
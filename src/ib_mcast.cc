@@ -0,0 +1,616 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "ib_mcast.h"
+#include "comm.h"
+#include "group.h"
+#include "bootstrap.h"
+#include "graph.h"
+#include "ibvwrap.h"
+#include <arpa/inet.h>
+
+NCCL_PARAM(IbMcast, "IB_MCAST", 0);
+NCCL_PARAM(IbMcastLid, "IB_MCAST_LID", 0);
+NCCL_PARAM(IbMcastQkey, "IB_MCAST_QKEY", 0x01234567);
+NCCL_PARAM(IbMcastGidIndex, "IB_MCAST_GID_INDEX", 0);
+NCCL_PARAM(IbMcastMinBytes, "IB_MCAST_MIN_BYTES", 1 << 20);
+NCCL_PARAM(IbMcastBuffSize, "IB_MCAST_BUFFSIZE", 1 << 22);
+NCCL_PARAM(IbMcastTimeout, "IB_MCAST_TIMEOUT", 1000); // us
+NCCL_PARAM(IbMcastRetries, "IB_MCAST_RETRIES", 1000);
+
+#define NCCL_IB_MCAST_WINDOW 256 // Packets acknowledged together
+#define NCCL_IB_MCAST_WINDOW_WORDS (NCCL_IB_MCAST_WINDOW/64)
+#define NCCL_IB_MCAST_SEND_DEPTH (NCCL_IB_MCAST_WINDOW+64)
+#define NCCL_IB_MCAST_GRH 40     // Global route header in front of every UD receive
+#define NCCL_IB_MCAST_QPN 0xFFFFFF
+
+enum ncclIbMcastType { ncclIbMcastData = 0, ncclIbMcastAck = 1, ncclIbMcastNack = 2, ncclIbMcastDone = 3 };
+
+struct ncclIbMcastHdr {
+  uint64_t commHash; // Other communicators may have joined the same group
+  uint32_t seq;  // Transfer, numbered identically on all ranks
+  uint32_t type;
+  uint32_t from; // Sending rank
+  uint32_t idx;  // Packet for data, window for acks and nacks
+};
+
+// Largest control message: a nack carries the packets of the window which arrived
+struct ncclIbMcastCtrl {
+  struct ncclIbMcastHdr hdr;
+  uint64_t got[NCCL_IB_MCAST_WINDOW_WORDS];
+};
+
+struct ncclIbMcastPeer {
+  union ibv_gid gid;
+  uint32_t qpn;
+  uint16_t lid;
+  uint16_t ok;
+};
+
+struct ncclIbMcast {
+  uint64_t commHash;
+  int rank;
+  int nRanks;
+  struct ibv_context* context;
+  struct ibv_pd* pd;
+  struct ibv_cq* sendCq;
+  struct ibv_cq* recvCq;
+  struct ibv_qp* qp;
+  struct ibv_ah* mcastAh;
+  struct ibv_ah** peerAhs;
+  struct ncclIbMcastPeer* peers;
+  union ibv_gid mgid;
+  uint16_t mlid;
+  uint32_t qkey;
+  int port;
+  int attached;
+  int payload; // Data bytes per packet
+
+  char* recvBuffs;
+  struct ibv_mr* recvMr;
+  int recvSize;
+  int nRecvs;
+  struct ncclIbMcastCtrl* sendHdrs; // Ring of NCCL_IB_MCAST_SEND_DEPTH headers
+  struct ibv_mr* sendHdrMr;
+  int sendHead;
+  int sendPending;
+
+  // Data goes through these, the copy out of one overlapping the transfer into the other
+  char* staging[2];
+  struct ibv_mr* stagingMr[2];
+  cudaEvent_t stagingDone[2];
+  size_t stagingSize;
+  int stagingIdx;
+  uint32_t seq;
+};
+
+struct ncclIbMcastXfer {
+  uint32_t seq;
+  int root;
+  char* buff;
+  uint32_t lkey;
+  size_t bytes;
+  uint32_t nPkts;
+  uint32_t nWindows;
+  uint32_t window;  // Root: window in flight. Receivers: first window not acknowledged.
+  // Root
+  uint8_t* acked;
+  int nAcked;
+  uint64_t resend[NCCL_IB_MCAST_WINDOW_WORDS];
+  // Receivers
+  uint64_t* got;
+  bool complete;
+  bool done;
+};
+
+static uint32_t windowPkts(struct ncclIbMcastXfer* x, uint32_t w) {
+  return std::min<uint32_t>(NCCL_IB_MCAST_WINDOW, x->nPkts - w*NCCL_IB_MCAST_WINDOW);
+}
+
+static bool windowComplete(struct ncclIbMcastXfer* x, uint32_t w) {
+  uint32_t n = 0;
+  for (int i=0; i<NCCL_IB_MCAST_WINDOW_WORDS; i++) n += __builtin_popcountll(x->got[w*NCCL_IB_MCAST_WINDOW_WORDS+i]);
+  return n == windowPkts(x, w);
+}
+
+static ncclResult_t mcastPostRecv(struct ncclIbMcast* mc, int i) {
+  struct ibv_sge sge;
+  struct ibv_recv_wr wr, *bad;
+  sge.addr = (uintptr_t)(mc->recvBuffs + (size_t)i*mc->recvSize);
+  sge.length = mc->recvSize;
+  sge.lkey = mc->recvMr->lkey;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = i;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  NCCLCHECK(wrap_ibv_post_recv(mc->qp, &wr, &bad));
+  return ncclSuccess;
+}
+
+static ncclResult_t mcastPollSend(struct ncclIbMcast* mc) {
+  struct ibv_wc wcs[64];
+  int n;
+  NCCLCHECK(wrap_ibv_poll_cq(mc->sendCq, 64, wcs, &n));
+  for (int i=0; i<n; i++) {
+    if (wcs[i].status != IBV_WC_SUCCESS) {
+      WARN("NET/IB : multicast send completed with error status %d", wcs[i].status);
+      return ncclRemoteError;
+    }
+    mc->sendPending--;
+  }
+  return ncclSuccess;
+}
+
+// Sends hdr (and size bytes of data) to peer, or to the group when peer is -1
+static ncclResult_t mcastSend(struct ncclIbMcast* mc, int peer, struct ncclIbMcastCtrl* ctrl, int ctrlSize, const char* data, int size, uint32_t lkey) {
+  struct ibv_sge sge[2];
+  struct ibv_send_wr wr, *bad;
+  while (mc->sendPending == NCCL_IB_MCAST_SEND_DEPTH) NCCLCHECK(mcastPollSend(mc));
+  struct ncclIbMcastCtrl* slot = mc->sendHdrs+mc->sendHead;
+  memcpy(slot, ctrl, ctrlSize);
+  sge[0].addr = (uintptr_t)slot;
+  sge[0].length = ctrlSize;
+  sge[0].lkey = mc->sendHdrMr->lkey;
+  sge[1].addr = (uintptr_t)data;
+  sge[1].length = size;
+  sge[1].lkey = lkey;
+  memset(&wr, 0, sizeof(wr));
+  wr.sg_list = sge;
+  wr.num_sge = size ? 2 : 1;
+  wr.opcode = IBV_WR_SEND;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.ud.ah = peer == -1 ? mc->mcastAh : mc->peerAhs[peer];
+  wr.wr.ud.remote_qpn = peer == -1 ? NCCL_IB_MCAST_QPN : mc->peers[peer].qpn;
+  wr.wr.ud.remote_qkey = mc->qkey;
+  NCCLCHECK(wrap_ibv_post_send(mc->qp, &wr, &bad));
+  mc->sendHead = (mc->sendHead+1)%NCCL_IB_MCAST_SEND_DEPTH;
+  mc->sendPending++;
+  return ncclSuccess;
+}
+
+static ncclResult_t mcastSendCtrl(struct ncclIbMcast* mc, int peer, uint32_t seq, uint32_t type, uint32_t idx, const uint64_t* got) {
+  struct ncclIbMcastCtrl ctrl;
+  ctrl.hdr.commHash = mc->commHash;
+  ctrl.hdr.seq = seq;
+  ctrl.hdr.type = type;
+  ctrl.hdr.from = mc->rank;
+  ctrl.hdr.idx = idx;
+  if (got) memcpy(ctrl.got, got, sizeof(ctrl.got));
+  return mcastSend(mc, peer, &ctrl, got ? sizeof(ctrl) : sizeof(ctrl.hdr), NULL, 0, 0);
+}
+
+static ncclResult_t mcastSendData(struct ncclIbMcast* mc, struct ncclIbMcastXfer* x, uint32_t i) {
+  struct ncclIbMcastCtrl ctrl;
+  size_t off = (size_t)i*mc->payload;
+  ctrl.hdr.commHash = mc->commHash;
+  ctrl.hdr.seq = x->seq;
+  ctrl.hdr.type = ncclIbMcastData;
+  ctrl.hdr.from = mc->rank;
+  ctrl.hdr.idx = i;
+  return mcastSend(mc, -1, &ctrl, sizeof(ctrl.hdr), x->buff+off, std::min<size_t>(mc->payload, x->bytes-off), x->lkey);
+}
+
+static ncclResult_t mcastHandle(struct ncclIbMcast* mc, struct ncclIbMcastXfer* x, struct ncclIbMcastHdr* hdr, int size) {
+  if (size < (int)sizeof(*hdr) || hdr->commHash != mc->commHash) return ncclSuccess;
+  if (hdr->from == (uint32_t)mc->rank || hdr->from >= (uint32_t)mc->nRanks) return ncclSuccess;
+  int32_t age = int32_t(hdr->seq - x->seq);
+  if (hdr->type == ncclIbMcastAck || hdr->type == ncclIbMcastNack) {
+    // The receiver missed the end of a transfer we were the root of
+    if (age < 0) return mcastSendCtrl(mc, hdr->from, hdr->seq, ncclIbMcastDone, 0, NULL);
+    if (age > 0 || x->root != mc->rank || hdr->idx != x->window) return ncclSuccess;
+    if (hdr->type == ncclIbMcastAck) {
+      if (!x->acked[hdr->from]) { x->acked[hdr->from] = 1; x->nAcked++; }
+    } else if (size >= (int)sizeof(struct ncclIbMcastCtrl)) {
+      const uint64_t* got = ((struct ncclIbMcastCtrl*)hdr)->got;
+      for (int i=0; i<NCCL_IB_MCAST_WINDOW_WORDS; i++) x->resend[i] |= ~got[i];
+    }
+    return ncclSuccess;
+  }
+  if (hdr->type == ncclIbMcastDone) {
+    if (age == 0 && x->root != mc->rank) x->done = true;
+    return ncclSuccess;
+  }
+  if (hdr->type != ncclIbMcastData) return ncclSuccess;
+  // We moved on before the root got our last acknowledgement
+  if (age < 0) return mcastSendCtrl(mc, hdr->from, hdr->seq, ncclIbMcastAck, hdr->idx/NCCL_IB_MCAST_WINDOW, NULL);
+  if (x->root == mc->rank) return ncclSuccess;
+  // The next transfer only starts once the root has all acknowledgements
+  if (age > 0 && x->complete) x->done = true;
+  if (age != 0 || hdr->idx >= x->nPkts) return ncclSuccess;
+
+  uint32_t i = hdr->idx, w = i/NCCL_IB_MCAST_WINDOW;
+  uint64_t bit = 1ULL << (i%64);
+  if ((x->got[i/64] & bit) == 0) {
+    size_t off = (size_t)i*mc->payload;
+    size_t bytes = std::min<size_t>(mc->payload, x->bytes-off);
+    if (size - sizeof(*hdr) != bytes) return ncclSuccess;
+    memcpy(x->buff+off, hdr+1, bytes);
+    x->got[i/64] |= bit;
+  }
+  if (w < x->window) {
+    // Resent, the root may not have our acknowledgement
+    return mcastSendCtrl(mc, x->root, x->seq, ncclIbMcastAck, w, NULL);
+  }
+  while (x->window < x->nWindows && windowComplete(x, x->window)) {
+    NCCLCHECK(mcastSendCtrl(mc, x->root, x->seq, ncclIbMcastAck, x->window, NULL));
+    x->window++;
+  }
+  if (x->window == x->nWindows) {
+    x->complete = true;
+  } else if (w == x->window && i == w*NCCL_IB_MCAST_WINDOW + windowPkts(x, w)-1) {
+    // End of the window with holes in it
+    NCCLCHECK(mcastSendCtrl(mc, x->root, x->seq, ncclIbMcastNack, w, x->got+w*NCCL_IB_MCAST_WINDOW_WORDS));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t mcastProgress(struct ncclIbMcast* mc, struct ncclIbMcastXfer* x, int* nRecvd) {
+  struct ibv_wc wcs[64];
+  int n;
+  NCCLCHECK(mcastPollSend(mc));
+  NCCLCHECK(wrap_ibv_poll_cq(mc->recvCq, 64, wcs, &n));
+  for (int i=0; i<n; i++) {
+    if (wcs[i].status != IBV_WC_SUCCESS) {
+      WARN("NET/IB : multicast receive completed with error status %d", wcs[i].status);
+      return ncclRemoteError;
+    }
+    char* buff = mc->recvBuffs + (size_t)wcs[i].wr_id*mc->recvSize;
+    NCCLCHECK(mcastHandle(mc, x, (struct ncclIbMcastHdr*)(buff+NCCL_IB_MCAST_GRH), wcs[i].byte_len-NCCL_IB_MCAST_GRH));
+    NCCLCHECK(mcastPostRecv(mc, wcs[i].wr_id));
+  }
+  *nRecvd = n;
+  return ncclSuccess;
+}
+
+// Root: multicasts each window, resends what receivers report missing, and moves on once
+// all of them acknowledged it. On timeout, the last packet of the window is resent, which
+// every receiver answers.
+static ncclResult_t mcastRoot(struct ncclIbMcast* mc, struct ncclIbMcastXfer* x) {
+  uint64_t timeout = ncclParamIbMcastTimeout()*1000;
+  for (x->window = 0; x->window < x->nWindows; x->window++) {
+    uint32_t first = x->window*NCCL_IB_MCAST_WINDOW, n = windowPkts(x, x->window);
+    int retries = 0;
+    memset(x->acked, 0, mc->nRanks);
+    x->nAcked = 0;
+    memset(x->resend, 0, sizeof(x->resend));
+    for (uint32_t i=0; i<n; i++) NCCLCHECK(mcastSendData(mc, x, first+i));
+    uint64_t last = clockNano();
+    while (x->nAcked < mc->nRanks-1) {
+      int nRecvd;
+      bool resent = false;
+      NCCLCHECK(mcastProgress(mc, x, &nRecvd));
+      for (uint32_t i=0; i<n; i++) {
+        uint64_t bit = 1ULL << (i%64);
+        if ((x->resend[i/64] & bit) == 0) continue;
+        x->resend[i/64] &= ~bit;
+        NCCLCHECK(mcastSendData(mc, x, first+i));
+        resent = true;
+      }
+      memset(x->resend, 0, sizeof(x->resend));
+      if (resent) {
+        last = clockNano();
+      } else if (clockNano()-last > timeout) {
+        if (++retries > ncclParamIbMcastRetries()) {
+          WARN("NET/IB : multicast transfer %u window %u acknowledged by %d of %d ranks after %d retries", x->seq, x->window, x->nAcked, mc->nRanks-1, retries-1);
+          return ncclRemoteError;
+        }
+        NCCLCHECK(mcastSendData(mc, x, first+n-1));
+        last = clockNano();
+      }
+    }
+  }
+  NCCLCHECK(mcastSendCtrl(mc, -1, x->seq, ncclIbMcastDone, 0, NULL));
+  return ncclSuccess;
+}
+
+// Receivers: acknowledge windows as they complete, report holes on timeout, and wait for
+// the root to confirm it got all acknowledgements. The data is complete by then, so not
+// hearing back only means the root moved on.
+static ncclResult_t mcastRecv(struct ncclIbMcast* mc, struct ncclIbMcastXfer* x) {
+  uint64_t timeout = ncclParamIbMcastTimeout()*1000;
+  uint64_t last = clockNano();
+  int retries = 0, nRecvd;
+  while (!x->complete) {
+    NCCLCHECK(mcastProgress(mc, x, &nRecvd));
+    if (nRecvd) {
+      last = clockNano();
+    } else if (clockNano()-last > timeout) {
+      if (++retries > ncclParamIbMcastRetries()) {
+        WARN("NET/IB : multicast transfer %u from rank %d stuck at window %u of %u", x->seq, x->root, x->window, x->nWindows);
+        return ncclRemoteError;
+      }
+      NCCLCHECK(mcastSendCtrl(mc, x->root, x->seq, ncclIbMcastNack, x->window, x->got+x->window*NCCL_IB_MCAST_WINDOW_WORDS));
+      last = clockNano();
+    }
+  }
+  retries = 0;
+  while (!x->done) {
+    NCCLCHECK(mcastProgress(mc, x, &nRecvd));
+    if (clockNano()-last > timeout) {
+      if (++retries > ncclParamIbMcastRetries()) break;
+      NCCLCHECK(mcastSendCtrl(mc, x->root, x->seq, ncclIbMcastAck, x->nWindows-1, NULL));
+      last = clockNano();
+    }
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t mcastOpenDevice(struct ncclComm* comm, struct ncclIbMcast* mc, int* port) {
+  struct ibv_device** devices = NULL;
+  int nDevices = 0, netDev;
+  ncclNetProperties_t props;
+  char name[64];
+
+  NCCLCHECK(ncclTopoGetLocalNet(comm->topo, comm->rank, 0, &netDev));
+  NCCLCHECK(comm->ncclNet->getProperties(netDev, &props));
+  // Merged devices are named dev0+dev1, use the first one
+  snprintf(name, sizeof(name), "%s", props.name);
+  if (strchr(name, '+')) *strchr(name, '+') = '\0';
+  *port = props.port;
+  NCCLCHECK(wrap_ibv_get_device_list(&devices, &nDevices));
+  for (int d=0; d<nDevices && mc->context == NULL; d++) {
+    if (strcmp(wrap_ibv_get_device_name(devices[d]), name) == 0) NCCLCHECK(wrap_ibv_open_device(&mc->context, devices[d]));
+  }
+  if (devices) NCCLCHECK(wrap_ibv_free_device_list(devices));
+  if (mc->context == NULL) {
+    INFO(NCCL_NET, "NET/IB : multicast could not open device %s", name);
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+// Opens the NIC closest to our GPU, creates a UD QP and attaches it to the group
+static ncclResult_t mcastInit(struct ncclComm* comm, struct ncclIbMcast* mc, struct ncclIbMcastPeer* me) {
+  struct ibv_port_attr portAttr;
+  struct ibv_qp_init_attr initAttr;
+  struct ibv_qp_attr qpAttr;
+  int gidIndex = ncclParamIbMcastGidIndex();
+  int port;
+
+  NCCLCHECK(wrap_ibv_symbols());
+  NCCLCHECK(mcastOpenDevice(comm, mc, &port));
+  mc->port = port;
+  NCCLCHECK(wrap_ibv_query_port(mc->context, port, &portAttr));
+  mc->payload = (128 << portAttr.active_mtu) - sizeof(struct ncclIbMcastHdr);
+  mc->recvSize = NCCL_IB_MCAST_GRH + (128 << portAttr.active_mtu);
+  // Room for a window of our own packets looping back, one from the root and everyone's acks
+  mc->nRecvs = 2*NCCL_IB_MCAST_WINDOW + 2*mc->nRanks;
+  NCCLCHECK(wrap_ibv_alloc_pd(&mc->pd, mc->context));
+  NCCLCHECK(wrap_ibv_create_cq(&mc->sendCq, mc->context, NCCL_IB_MCAST_SEND_DEPTH, NULL, NULL, 0));
+  NCCLCHECK(wrap_ibv_create_cq(&mc->recvCq, mc->context, mc->nRecvs, NULL, NULL, 0));
+
+  memset(&initAttr, 0, sizeof(initAttr));
+  initAttr.send_cq = mc->sendCq;
+  initAttr.recv_cq = mc->recvCq;
+  initAttr.qp_type = IBV_QPT_UD;
+  initAttr.cap.max_send_wr = NCCL_IB_MCAST_SEND_DEPTH;
+  initAttr.cap.max_recv_wr = mc->nRecvs;
+  initAttr.cap.max_send_sge = 2;
+  initAttr.cap.max_recv_sge = 1;
+  NCCLCHECK(wrap_ibv_create_qp(&mc->qp, mc->pd, &initAttr));
+  memset(&qpAttr, 0, sizeof(qpAttr));
+  qpAttr.qp_state = IBV_QPS_INIT;
+  qpAttr.pkey_index = 0;
+  qpAttr.port_num = port;
+  qpAttr.qkey = mc->qkey;
+  NCCLCHECK(wrap_ibv_modify_qp(mc->qp, &qpAttr, IBV_QP_STATE|IBV_QP_PKEY_INDEX|IBV_QP_PORT|IBV_QP_QKEY));
+
+  NCCLCHECK(ncclCalloc(&mc->recvBuffs, (size_t)mc->nRecvs*mc->recvSize));
+  NCCLCHECK(wrap_ibv_reg_mr(&mc->recvMr, mc->pd, mc->recvBuffs, (size_t)mc->nRecvs*mc->recvSize, IBV_ACCESS_LOCAL_WRITE));
+  NCCLCHECK(ncclCalloc(&mc->sendHdrs, NCCL_IB_MCAST_SEND_DEPTH));
+  NCCLCHECK(wrap_ibv_reg_mr(&mc->sendHdrMr, mc->pd, mc->sendHdrs, NCCL_IB_MCAST_SEND_DEPTH*sizeof(struct ncclIbMcastCtrl), IBV_ACCESS_LOCAL_WRITE));
+  for (int i=0; i<mc->nRecvs; i++) NCCLCHECK(mcastPostRecv(mc, i));
+
+  memset(&qpAttr, 0, sizeof(qpAttr));
+  qpAttr.qp_state = IBV_QPS_RTR;
+  NCCLCHECK(wrap_ibv_modify_qp(mc->qp, &qpAttr, IBV_QP_STATE));
+  qpAttr.qp_state = IBV_QPS_RTS;
+  qpAttr.sq_psn = 0;
+  NCCLCHECK(wrap_ibv_modify_qp(mc->qp, &qpAttr, IBV_QP_STATE|IBV_QP_SQ_PSN));
+  NCCLCHECK(wrap_ibv_attach_mcast(mc->qp, &mc->mgid, mc->mlid));
+  mc->attached = 1;
+
+  struct ibv_ah_attr ahAttr;
+  memset(&ahAttr, 0, sizeof(ahAttr));
+  ahAttr.is_global = 1;
+  ahAttr.grh.dgid = mc->mgid;
+  ahAttr.grh.sgid_index = gidIndex;
+  ahAttr.grh.hop_limit = 255;
+  ahAttr.dlid = mc->mlid;
+  ahAttr.port_num = port;
+  NCCLCHECK(wrap_ibv_create_ah(&mc->mcastAh, mc->pd, &ahAttr));
+
+  for (int s=0; s<2; s++) {
+    NCCLCHECK(ncclCudaHostCalloc(mc->staging+s, mc->stagingSize));
+    NCCLCHECK(wrap_ibv_reg_mr(mc->stagingMr+s, mc->pd, mc->staging[s], mc->stagingSize, IBV_ACCESS_LOCAL_WRITE));
+    CUDACHECK(cudaEventCreateWithFlags(mc->stagingDone+s, cudaEventDisableTiming));
+  }
+
+  NCCLCHECK(wrap_ibv_query_gid(mc->context, port, gidIndex, &me->gid));
+  me->qpn = mc->qp->qp_num;
+  me->lid = portAttr.lid;
+  return ncclSuccess;
+}
+
+static ncclResult_t mcastCreatePeerAhs(struct ncclIbMcast* mc) {
+  NCCLCHECK(ncclCalloc(&mc->peerAhs, mc->nRanks));
+  for (int r=0; r<mc->nRanks; r++) {
+    if (r == mc->rank) continue;
+    struct ibv_ah_attr ahAttr;
+    memset(&ahAttr, 0, sizeof(ahAttr));
+    ahAttr.is_global = 1;
+    ahAttr.grh.dgid = mc->peers[r].gid;
+    ahAttr.grh.sgid_index = ncclParamIbMcastGidIndex();
+    ahAttr.grh.hop_limit = 255;
+    ahAttr.dlid = mc->peers[r].lid;
+    ahAttr.port_num = mc->port;
+    NCCLCHECK(wrap_ibv_create_ah(mc->peerAhs+r, mc->pd, &ahAttr));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t mcastDestroy(struct ncclIbMcast* mc) {
+  for (int s=0; s<2; s++) {
+    if (mc->stagingDone[s]) CUDACHECK(cudaEventDestroy(mc->stagingDone[s]));
+    if (mc->stagingMr[s]) NCCLCHECK(wrap_ibv_dereg_mr(mc->stagingMr[s]));
+    if (mc->staging[s]) NCCLCHECK(ncclCudaHostFree(mc->staging[s]));
+  }
+  if (mc->peerAhs) {
+    for (int r=0; r<mc->nRanks; r++) if (mc->peerAhs[r]) NCCLCHECK(wrap_ibv_destroy_ah(mc->peerAhs[r]));
+    free(mc->peerAhs);
+  }
+  if (mc->mcastAh) NCCLCHECK(wrap_ibv_destroy_ah(mc->mcastAh));
+  if (mc->attached) NCCLCHECK(wrap_ibv_detach_mcast(mc->qp, &mc->mgid, mc->mlid));
+  if (mc->qp) NCCLCHECK(wrap_ibv_destroy_qp(mc->qp));
+  if (mc->sendHdrMr) NCCLCHECK(wrap_ibv_dereg_mr(mc->sendHdrMr));
+  if (mc->recvMr) NCCLCHECK(wrap_ibv_dereg_mr(mc->recvMr));
+  if (mc->sendCq) NCCLCHECK(wrap_ibv_destroy_cq(mc->sendCq));
+  if (mc->recvCq) NCCLCHECK(wrap_ibv_destroy_cq(mc->recvCq));
+  if (mc->pd) NCCLCHECK(wrap_ibv_dealloc_pd(mc->pd));
+  if (mc->context) NCCLCHECK(wrap_ibv_close_device(mc->context));
+  free(mc->sendHdrs);
+  free(mc->recvBuffs);
+  free(mc->peers);
+  free(mc);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbMcastInit(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclIbMcast* mc = NULL;
+  const char* mgid = getenv("NCCL_IB_MCAST_GID");
+  bool allOk = true;
+
+  comm->ibMcastState = -1;
+  // Within a node the ring over NVLink beats going through the NIC
+  if (!ncclParamIbMcast() || !comm->allBlocking || comm->nNodes < 2) return ncclSuccess;
+  NCCLCHECK(ncclCalloc(&mc, 1));
+  NCCLCHECKGOTO(ncclCalloc(&mc->peers, comm->nRanks), ret, fail);
+  mc->commHash = comm->commHash;
+  mc->rank = comm->rank;
+  mc->nRanks = comm->nRanks;
+  mc->mlid = ncclParamIbMcastLid();
+  mc->qkey = ncclParamIbMcastQkey();
+  mc->stagingSize = ROUNDUP(std::max<int64_t>(ncclParamIbMcastBuffSize(), 4096), 4096);
+  // Ranks which cannot join still take part in the exchange, which tells the others
+  if (mgid == NULL || strcmp(comm->ncclNet->name, "IB") != 0) {
+    INFO(NCCL_INIT|NCCL_NET, "IB multicast unavailable : needs the IB network and NCCL_IB_MCAST_GID");
+  } else if (inet_pton(AF_INET6, mgid, mc->mgid.raw) != 1) {
+    WARN("NET/IB : invalid NCCL_IB_MCAST_GID %s", mgid);
+  } else if (mcastInit(comm, mc, mc->peers+comm->rank) == ncclSuccess) {
+    mc->peers[comm->rank].ok = 1;
+  }
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, mc->peers, sizeof(struct ncclIbMcastPeer)), ret, fail);
+  for (int r=0; r<comm->nRanks; r++) allOk &= mc->peers[r].ok != 0;
+  if (!allOk) {
+    INFO(NCCL_INIT|NCCL_NET, "IB multicast unavailable : could not join group %s on all ranks", mgid ? mgid : "(unset)");
+    goto fail;
+  }
+  NCCLCHECKGOTO(mcastCreatePeerAhs(mc), ret, fail);
+  INFO(NCCL_INIT|NCCL_NET, "IB multicast enabled for Broadcast and AllGather through group %s, %d bytes per packet", mgid, mc->payload);
+  comm->ibMcast = mc;
+  comm->ibMcastState = 1;
+  return ncclSuccess;
+fail:
+  (void)mcastDestroy(mc);
+  return ret;
+}
+
+ncclResult_t ncclIbMcastEligible(struct ncclInfo* info, bool* eligible) {
+  struct ncclComm* comm = info->comm;
+  *eligible = false;
+  if (comm->ibMcastState != 1) return ncclSuccess;
+  if (info->coll != ncclFuncAllGather && info->coll != ncclFuncBroadcast) return ncclSuccess;
+  if (info->count*ncclTypeSize(info->datatype) < (size_t)ncclParamIbMcastMinBytes()) return ncclSuccess;
+  // The transfer is driven by this thread before returning, out of order with the rest of
+  // a group, and cannot be replayed by a graph. Only this rank knows about either, so the
+  // others cannot be told to fall back.
+  if (ncclGroupDepth != 1) {
+    WARN("%s : IB multicast (NCCL_IB_MCAST) cannot be called within a group", info->opName);
+    return ncclInvalidUsage;
+  }
+  cudaStreamCaptureStatus status;
+  CUDACHECK(cudaStreamIsCapturing(info->stream, &status));
+  if (status != cudaStreamCaptureStatusNone) {
+    WARN("%s : IB multicast (NCCL_IB_MCAST) cannot be captured in a CUDA graph", info->opName);
+    return ncclInvalidUsage;
+  }
+  *eligible = true;
+  return ncclSuccess;
+}
+
+// Multicasts bytes from root at buff (device memory) to buff on all other ranks
+static ncclResult_t mcastBroadcast(struct ncclIbMcast* mc, int root, const char* sendbuff, char* recvbuff, size_t nBytes, cudaStream_t stream) {
+  struct ncclIbMcastXfer x;
+  memset(&x, 0, sizeof(x));
+  x.root = root;
+  NCCLCHECK(ncclCalloc(&x.acked, mc->nRanks));
+  NCCLCHECK(ncclCalloc(&x.got, DIVUP(mc->stagingSize, mc->payload)/64 + NCCL_IB_MCAST_WINDOW_WORDS));
+  ncclResult_t ret = ncclSuccess;
+  for (size_t off = 0; off < nBytes; off += mc->stagingSize) {
+    int s = mc->stagingIdx;
+    mc->stagingIdx ^= 1;
+    x.seq = ++mc->seq;
+    x.buff = mc->staging[s];
+    x.lkey = mc->stagingMr[s]->lkey;
+    x.bytes = std::min(mc->stagingSize, nBytes-off);
+    x.nPkts = DIVUP(x.bytes, mc->payload);
+    x.nWindows = DIVUP(x.nPkts, NCCL_IB_MCAST_WINDOW);
+    x.window = 0;
+    x.complete = x.done = false;
+    memset(x.got, 0, (DIVUP(mc->stagingSize, mc->payload)/64 + NCCL_IB_MCAST_WINDOW_WORDS)*sizeof(uint64_t));
+    // The copy out of this buffer two chunks ago must be done
+    CUDACHECKGOTO(cudaEventSynchronize(mc->stagingDone[s]), ret, exit);
+    if (root == mc->rank) {
+      CUDACHECKGOTO(cudaMemcpyAsync(x.buff, sendbuff+off, x.bytes, cudaMemcpyDeviceToHost, stream), ret, exit);
+      CUDACHECKGOTO(cudaStreamSynchronize(stream), ret, exit);
+      NCCLCHECKGOTO(mcastRoot(mc, &x), ret, exit);
+      if (recvbuff != sendbuff) CUDACHECKGOTO(cudaMemcpyAsync(recvbuff+off, sendbuff+off, x.bytes, cudaMemcpyDeviceToDevice, stream), ret, exit);
+    } else {
+      NCCLCHECKGOTO(mcastRecv(mc, &x), ret, exit);
+      CUDACHECKGOTO(cudaMemcpyAsync(recvbuff+off, x.buff, x.bytes, cudaMemcpyHostToDevice, stream), ret, exit);
+    }
+    CUDACHECKGOTO(cudaEventRecord(mc->stagingDone[s], stream), ret, exit);
+  }
+exit:
+  free(x.acked);
+  free(x.got);
+  return ret;
+}
+
+ncclResult_t ncclIbMcastLaunch(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  struct ncclIbMcast* mc = comm->ibMcast;
+  struct ncclStrongStream* deviceStream = &comm->sharedRes->deviceStream;
+  cudaStream_t stream = info->stream;
+  size_t nBytes = info->count*ncclTypeSize(info->datatype);
+  const char* sendbuff = (const char*)info->sendbuff;
+  char* recvbuff = (char*)info->recvbuff;
+
+  // Order against kernels of this communicator launched on other streams
+  NCCLCHECK(ncclStrongStreamAcquireUncaptured(deviceStream));
+  NCCLCHECK(ncclStrongStreamWaitStream(ncclCudaGraphNone(), stream, deviceStream));
+  if (info->coll == ncclFuncBroadcast) {
+    NCCLCHECK(mcastBroadcast(mc, info->root, sendbuff, recvbuff, nBytes, stream));
+  } else {
+    // Every rank broadcasts its part in turn
+    for (int r=0; r<comm->nRanks; r++) {
+      const char* src = r == comm->rank ? sendbuff : NULL;
+      NCCLCHECK(mcastBroadcast(mc, r, src, recvbuff+r*nBytes, nBytes, stream));
+    }
+  }
+  NCCLCHECK(ncclStrongStreamWaitStream(ncclCudaGraphNone(), deviceStream, stream));
+  NCCLCHECK(ncclStrongStreamRelease(ncclCudaGraphNone(), deviceStream));
+  comm->opCount++;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbMcastFree(struct ncclComm* comm) {
+  if (comm->ibMcast == NULL) return ncclSuccess;
+  NCCLCHECK(mcastDestroy(comm->ibMcast));
+  comm->ibMcast = NULL;
+  return ncclSuccess;
+}
@@ -19,13 +19,20 @@
 
 uint64_t clockNano(); // from utils.h with which we have a circular dependency
 
+// Large pinned host buffers are backed by huge pages and kept for reuse by later connections,
+// see cudawrap.cc. pooled is set when ptr was allocated, or freed, by the pool.
+ncclResult_t ncclHostPoolAlloc(void** ptr, size_t size, int* pooled);
+ncclResult_t ncclHostPoolFree(void* ptr, int* pooled);
+
 template <typename T>
 ncclResult_t ncclCudaHostCallocDebug(T** ptr, size_t nelem, const char *filefunc, int line) {
   ncclResult_t result = ncclSuccess;
   cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
   *ptr = nullptr;
+  int pooled;
   CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
-  CUDACHECKGOTO(cudaHostAlloc(ptr, nelem*sizeof(T), cudaHostAllocMapped), result, finish);
+  NCCLCHECKGOTO(ncclHostPoolAlloc((void**)ptr, nelem*sizeof(T), &pooled), result, finish);
+  if (!pooled) CUDACHECKGOTO(cudaHostAlloc(ptr, nelem*sizeof(T), cudaHostAllocMapped), result, finish);
   memset(*ptr, 0, nelem*sizeof(T));
 finish:
   CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
@@ -36,6 +43,9 @@ finish:
 #define ncclCudaHostCalloc(...) ncclCudaHostCallocDebug(__VA_ARGS__, __FILE__, __LINE__)
 
 inline ncclResult_t ncclCudaHostFree(void* ptr) {
+  int pooled;
+  NCCLCHECK(ncclHostPoolFree(ptr, &pooled));
+  if (pooled) return ncclSuccess;
   CUDACHECK(cudaFreeHost(ptr));
   return ncclSuccess;
 }
@@ -78,6 +88,11 @@ ncclResult_t ncclRealloc(T** ptr, size_t oldNelem, size_t nelem) {
 #include <cuda.h>
 #include "cudawrap.h"
 
+// Small allocations without an exported handle come from chunks shared by the whole process,
+// see cudawrap.cc. pooled is set when ptr was allocated, or freed, by the pool.
+ncclResult_t ncclCuMemPoolAlloc(void** ptr, size_t size, size_t granularity, CUmemAllocationProp* prop, int* pooled);
+ncclResult_t ncclCuMemPoolFree(void* ptr, int* pooled);
+
 static inline ncclResult_t ncclCuMemAlloc(void **ptr, CUmemGenericAllocationHandle *handlep, size_t size) {
   ncclResult_t result = ncclSuccess;
   size_t granularity = 0;
@@ -97,6 +112,11 @@ static inline ncclResult_t ncclCuMemAlloc(void **ptr, CUmemGenericAllocationHand
   CUCHECK(cuDeviceGetAttribute(&flag, CU_DEVICE_ATTRIBUTE_GPU_DIRECT_RDMA_SUPPORTED, currentDev));
   if (flag) prop.allocFlags.gpuDirectRDMACapable = 1;
   CUCHECK(cuMemGetAllocationGranularity(&granularity, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
+  if (handlep == NULL) {
+    int pooled;
+    NCCLCHECK(ncclCuMemPoolAlloc(ptr, size, granularity, &prop, &pooled));
+    if (pooled) return ncclSuccess;
+  }
   ALIGN_SIZE(size, granularity);
   /* Allocate the physical memory on the device */
   CUCHECK(cuMemCreate(&handle, size, &prop, 0));
@@ -119,6 +139,9 @@ static inline ncclResult_t ncclCuMemFree(void *ptr) {
   ncclResult_t result = ncclSuccess;
   CUmemGenericAllocationHandle handle;
   size_t size = 0;
+  int pooled;
+  NCCLCHECK(ncclCuMemPoolFree(ptr, &pooled));
+  if (pooled) return ncclSuccess;
   CUCHECK(cuMemRetainAllocationHandle(&handle, ptr));
   CUCHECK(cuMemRelease(handle));
   CUCHECK(cuMemGetAddressRange(NULL, &size, (CUdeviceptr)ptr));
@@ -251,6 +274,66 @@ finish:
   return result;
 }
 
+/* ncclCudaArena: bump allocator for the small device (or mapped host) objects which live as long
+ * as a communicator. Objects are carved, zeroed, out of large chunks, which are only freed all at
+ * once by ncclCudaArenaDestruct(). Large objects get their own chunk.
+ */
+#define NCCL_CUDA_ARENA_CHUNK_SIZE (1<<20)
+#define NCCL_CUDA_ARENA_ALIGN 256
+
+struct ncclCudaArenaChunk {
+  struct ncclCudaArenaChunk* next;
+  char* base;
+  size_t size;
+  size_t used;
+};
+
+struct ncclCudaArena {
+  bool host; // cudaHostAlloc'd, mapped memory rather than device memory
+  struct ncclCudaArenaChunk* head;
+};
+
+template <typename T>
+ncclResult_t ncclCudaArenaCalloc(struct ncclCudaArena* arena, T** ptr, size_t nelem) {
+  size_t size = ROUNDUP(nelem*sizeof(T), NCCL_CUDA_ARENA_ALIGN);
+  struct ncclCudaArenaChunk* chunk = arena->head;
+  if (chunk == NULL || chunk->used + size > chunk->size) {
+    bool own = size > NCCL_CUDA_ARENA_CHUNK_SIZE/2;
+    NCCLCHECK(ncclCalloc(&chunk, 1));
+    chunk->size = own ? size : NCCL_CUDA_ARENA_CHUNK_SIZE;
+    ncclResult_t ret = arena->host ? ncclCudaHostCalloc(&chunk->base, chunk->size) : ncclCudaCalloc(&chunk->base, chunk->size);
+    if (ret != ncclSuccess) {
+      free(chunk);
+      return ret;
+    }
+    // Keep filling the current chunk after a large object
+    if (own && arena->head) {
+      chunk->next = arena->head->next;
+      arena->head->next = chunk;
+    } else {
+      chunk->next = arena->head;
+      arena->head = chunk;
+    }
+  }
+  *ptr = (T*)(chunk->base + chunk->used);
+  chunk->used += size;
+  return ncclSuccess;
+}
+
+inline ncclResult_t ncclCudaArenaDestruct(struct ncclCudaArena* arena) {
+  while (arena->head) {
+    struct ncclCudaArenaChunk* chunk = arena->head;
+    arena->head = chunk->next;
+    if (arena->host) {
+      NCCLCHECK(ncclCudaHostFree(chunk->base));
+    } else {
+      NCCLCHECK(ncclCudaFree(chunk->base));
+    }
+    free(chunk);
+  }
+  return ncclSuccess;
+}
+
 // Allocate memory to be potentially ibv_reg_mr'd. This needs to be
 // allocated on separate pages as those pages will be marked DONTFORK
 // and if they are shared, that could cause a crash in a child process
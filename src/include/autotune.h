@@ -0,0 +1,51 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_AUTOTUNE_H_
+#define NCCL_AUTOTUNE_H_
+
+#include "nccl.h"
+#include "devcomm.h"
+#include "checks.h"
+
+// Empirical algorithm/protocol selection (NCCL_AUTOTUNE=1).
+// For each (collective, reduction operation, datatype, log2 size) the first calls cycle through
+// the best candidates of the analytic model, timing each launch with CUDA events. Once all candidates have been tried
+// NCCL_AUTOTUNE_TRIALS times, ranks exchange their timings and all pick the candidate with the
+// lowest time on the slowest rank. The sequence of candidates only depends on the call order, so
+// all ranks make the same choice for every call.
+//
+// With NCCL_TUNING_DUMP_FILE, the timings also feed a fit of the latency and bandwidth of each
+// (collective, algorithm, protocol), which rank 0 writes to that file when the communicator is
+// destroyed. Running a sweep of sizes and then setting NCCL_TUNING_FILE to the result makes the
+// model (and therefore the default choices) match the measured hardware.
+
+#define NCCL_AUTOTUNE_MAX_CANDIDATES 8
+#define NCCL_AUTOTUNE_MAX_TRIALS 8
+
+struct ncclAutotuneSample {
+  cudaEvent_t start, stop;
+  size_t nBytes;
+  int candidate;
+  bool recorded;
+};
+
+struct ncclInfo;
+ncclResult_t ncclAutotuneInit(struct ncclComm* comm);
+void ncclAutotuneFree(struct ncclComm* comm);
+// Called once the model has computed times[algo][proto] (negative when not available). May
+// override info->algorithm/protocol with a pair available for this call, sets *ncShift (divide
+// the number of channels by 1<<ncShift) and returns in *sample the sample to time, if any.
+ncclResult_t ncclAutotuneSelect(struct ncclInfo* info, float times[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS], int* ncShift, struct ncclAutotuneSample** sample);
+
+static inline ncclResult_t ncclAutotuneRecord(struct ncclAutotuneSample* sample, cudaStream_t stream, bool end) {
+  if (sample == NULL) return ncclSuccess;
+  CUDACHECK(cudaEventRecord(end ? sample->stop : sample->start, stream));
+  if (end) sample->recorded = true;
+  return ncclSuccess;
+}
+
+#endif
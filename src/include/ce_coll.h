@@ -0,0 +1,27 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_CE_COLL_H_
+#define NCCL_CE_COLL_H_
+
+#include "info.h"
+
+// Copy engine collectives (NCCL_CE_COLL=1): intra-node AllGather and Broadcast
+// run as cudaMemcpyAsync and stream memory operations on the user stream, using
+// no SM at all. Each rank stages its data through a buffer which every other
+// rank maps, and ranks synchronize through flags in these buffers.
+
+// Sets up the staging buffers at init, collectively, when NCCL_CE_COLL is set and all
+// ranks are blocking.
+ncclResult_t ncclCeCollInit(struct ncclComm* comm);
+// Sets *eligible when the operation described by info should use copy engines, which only
+// depends on its arguments and the communicator. Fails with ncclInvalidUsage when it
+// should but is called within a group or captured.
+ncclResult_t ncclCeCollEligible(struct ncclInfo* info, bool* eligible);
+ncclResult_t ncclCeCollLaunch(struct ncclInfo* info);
+ncclResult_t ncclCeCollFree(struct ncclComm* comm);
+
+#endif
@@ -12,6 +12,8 @@
 
 typedef char collNetHandle_t[NCCL_NET_HANDLE_MAXSIZE];
 
+int64_t ncclParamCollNetProxyReduce();
+
 // Translation to external API
 static const char* collNetName(struct ncclComm* comm) { return comm->ncclCollNet->name; }
 static ncclResult_t collNetDevices(struct ncclComm* comm, int* ndev) { NCCLCHECK(comm->ncclCollNet->devices(ndev)); return ncclSuccess; }
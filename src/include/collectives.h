@@ -9,7 +9,7 @@
 
 enum ncclDevRedOp_t {
   ncclDevSum, ncclDevProd, ncclDevMax, ncclDevMin,
-  ncclDevPreMulSum, ncclDevSumPostDiv,
+  ncclDevPreMulSum, ncclDevSumPostDiv, ncclDevSumPostOp,
   ncclNumDevRedOps
 };
 struct ncclDevRedOpFull {
@@ -19,7 +19,9 @@ struct ncclDevRedOpFull {
 };
 
 #define FUNC_INDEX_P2P 0
-#define FUNC_INDEX(func, devredop, ncclType, al, pr) (1+ncclNumTypes+(((((func)*ncclNumDevRedOps + (devredop))*ncclNumTypes) + (ncclType))*NCCL_NUM_ALGORITHMS+(al))*NCCL_NUM_PROTOCOLS+(pr))
+// One-rank reductions: PreMulSum for all types, then SumPostOp for all types
+#define FUNC_INDEX_ONERANK(devredop, ncclType) (1+((devredop) == ncclDevSumPostOp ? ncclNumTypes : 0)+(ncclType))
+#define FUNC_INDEX(func, devredop, ncclType, al, pr) (1+2*ncclNumTypes+(((((func)*ncclNumDevRedOps + (devredop))*ncclNumTypes) + (ncclType))*NCCL_NUM_ALGORITHMS+(al))*NCCL_NUM_PROTOCOLS+(pr))
 
 #define NCCL_FUNC_NAME(func, algo, proto, devredop, type) \
   ncclFunction_##func##_##algo##_##proto##_##devredop##_##type
@@ -36,7 +38,7 @@ struct ncclDevRedOpFull {
 /* Declare all collective operations */
 #define DECL5(func, algo, proto, devredop, type) \
   extern __device__ void NCCL_FUNC_NAME(func, algo, proto, devredop, type)(); \
-  extern __global__ void NCCL_KERN_NAME(func, algo, proto, devredop, type)(struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHead); \
+  extern __global__ void NCCL_KERN_NAME(func, algo, proto, devredop, type)(struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHead, struct ncclKernelInlineWorks inlineWorks); \
 
 #define SINGLE_ARG(...) __VA_ARGS__
 #define CONCAT(a,b) a##b
@@ -57,6 +59,14 @@ struct ncclDevRedOpFull {
   DECL4(func, NVLS,           devredop, type, undef) \
   DECL4(func, NVLS_TREE,      devredop, type, undef)
 
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+#define DECL2_FP8(func, devredop, undefForFloat) \
+  DECL3(func, devredop, __nv_fp8_e4m3, /*undef=*/undefForFloat) \
+  DECL3(func, devredop, __nv_fp8_e5m2, /*undef=*/undefForFloat)
+#else
+#define DECL2_FP8(func, devredop, undefForFloat)
+#endif
+
 #if defined(__CUDA_BF16_TYPES_EXIST__)
 #define DECL2(func, devredop, undefForFloat) \
   DECL3(func, devredop, int8_t, /*undef=*/0) \
@@ -68,7 +78,8 @@ struct ncclDevRedOpFull {
   DECL3(func, devredop, half, /*undef=*/undefForFloat) \
   DECL3(func, devredop, float, /*undef=*/undefForFloat) \
   DECL3(func, devredop, double, /*undef=*/undefForFloat) \
-  DECL3(func, devredop, __nv_bfloat16, /*undef=*/undefForFloat)
+  DECL3(func, devredop, __nv_bfloat16, /*undef=*/undefForFloat) \
+  DECL2_FP8(func, devredop, undefForFloat)
 #else
 #define DECL2(func, devredop, undefForFloat) \
   DECL3(func, devredop, int8_t, /*undef=*/0) \
@@ -88,7 +99,8 @@ struct ncclDevRedOpFull {
   DECL2(func, Min, /*undefForFloat=*/0) \
   DECL2(func, Max, /*undefForFloat=*/0) \
   DECL2(func, PreMulSum, /*undefForFloat=*/0) \
-  DECL2(func, SumPostDiv, /*undefForFloat=*/1)
+  DECL2(func, SumPostDiv, /*undefForFloat=*/1) \
+  DECL2(func, SumPostOp, /*undefForFloat=*/0)
 
 DECL2(Broadcast, Sum, /*undefForFloat=*/0)
 DECL(Reduce)
@@ -97,6 +109,17 @@ DECL(ReduceScatter)
 DECL(AllReduce)
 DECL5(SendRecv, RING, SIMPLE, Sum, int8_t)
 
+#if NCCL_SLIM_KERNELS
+#define DECL_GENERIC(func) \
+  DECL3(func, Generic, int8_t, /*undef=*/0) \
+  DECL3(func, Generic, uint8_t, /*undef=*/0) \
+  DECL3(func, Generic, int32_t, /*undef=*/0) \
+  DECL3(func, Generic, uint32_t, /*undef=*/0)
+DECL_GENERIC(Reduce)
+DECL_GENERIC(ReduceScatter)
+DECL_GENERIC(AllReduce)
+#endif
+
 extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, int8_t)();
 extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, uint8_t)();
 extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, int32_t)();
@@ -107,8 +130,25 @@ extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, half)();
 #if defined(__CUDA_BF16_TYPES_EXIST__)
 extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, __nv_bfloat16)();
 #endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, __nv_fp8_e4m3)();
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, __nv_fp8_e5m2)();
+#endif
 extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, float)();
 extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, double)();
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(SumPostOp, half)();
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(SumPostOp, __nv_bfloat16)();
+#endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(SumPostOp, __nv_fp8_e4m3)();
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(SumPostOp, __nv_fp8_e5m2)();
+#endif
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(SumPostOp, float)();
+extern __device__ void NCCL_ONERANK_REDUCE_NAME(SumPostOp, double)();
+
+// Resident kernel of NCCL_RESIDENT_KERNEL, defined in functions.cu
+extern __global__ void ncclResidentKernel(struct ncclDevComm* comm, uint64_t channelMask, struct ncclWork* workHeap, uint64_t* doorbells);
 
 // CHUNKSIZE must be a multiple of SLICESIZE
 #define ALLREDUCE_SLICESTEPS (NCCL_STEPS/4)
@@ -125,6 +165,19 @@ extern __device__ void NCCL_ONERANK_REDUCE_NAME(PreMulSum, double)();
 
 // We can't use the enum identifiers like ncclSum, ncclFloat, etc since this
 // macro will be used in preprocessor conditionals where enums have no meaning.
+// Op and datatype pairs which are rarely used. Slim builds (SLIM_KERNELS=1) do not
+// specialize kernels for them, but run them through FuncGeneric with the op in the
+// top byte of the op argument. Datatypes must be at most 32 bits wide.
+#define NCCL_GENERIC_REDOP(/*ncclDataType_t*/ type, /*ncclDevRedOp_t*/ red) \
+  (((type==0 || type==1) && (red==1 || red==2 || red==3 || red==4)) || \
+   ((type==2 || type==3) && red==4))
+
+#if NCCL_SLIM_KERNELS
+  #define NCCL_SLIM_GENERIC_REDOP(type, red) NCCL_GENERIC_REDOP(type, red)
+#else
+  #define NCCL_SLIM_GENERIC_REDOP(type, red) 0
+#endif
+
 #define NCCL_NVLS_SUPPORTS(/*ncclDataType_t*/ type, /*ncclDevRedOp_t*/ red) \
   (((type==2 || type==3) && (red==0 || red==2 || red==3)) || \
    ((type==4 || type==5) && (red==0 || red==2 || red==3)) || \
@@ -12,6 +12,7 @@
 #include "collectives.h"
 #include "proxy.h"
 #include "strongstream.h"
+#include "nccl_tuner.h"
 
 #if CUDART_VERSION < 9000
 struct cudaLaunchParams {
@@ -41,7 +42,8 @@ struct ncclSendMem {
       void* ptrExchange;
       uint64_t redOpArgExchange[2];
       char pad2[CACHE_LINE_SIZE-sizeof(void*)-2*sizeof(uint64_t)];
-      int offsFifo[NCCL_STEPS];
+      int offsFifo[NCCL_MAX_STEPS];
+      uint64_t regDone; // Steps sent by the network from registered user buffers
     };
     char pad3[MEM_ALIGN];
   };
@@ -52,8 +54,8 @@ struct ncclRecvMem {
     struct {
       uint64_t tail;
       char pad1[CACHE_LINE_SIZE-sizeof(uint64_t)];
-      int sizesFifo[NCCL_STEPS];
-      int offsFifo[NCCL_STEPS];
+      int sizesFifo[NCCL_MAX_STEPS];
+      int offsFifo[NCCL_MAX_STEPS];
       int flush; // For GDRCopy-based flush
     };
     char pad4[MEM_ALIGN];
@@ -78,6 +80,7 @@ struct ncclUserRedOp {
   int freeNext; // -1=allocated, otherwise index of next free entry in array
   ncclDataType_t datatype;
   ncclDevRedOpFull opFull;
+  ncclDataType_t wireType; // ncclNumTypes unless created by ncclRedOpCreateWireSum
 };
 
 struct ncclNodeRanks {
@@ -110,12 +113,22 @@ struct ncclSharedResources {
   int tpNChannels;
   int tpP2pNChannels;
   int tpP2pChunkSize;
+  int tpBuffSizes[NCCL_NUM_PROTOCOLS];
+  int tpNetStepsShift;
+  int tpMemBudgetNoLL128;
   uint64_t magic;
 
   // top parent rank to localRank translation table
   int* tpRankToLocalRank;
   // Internal streams
   struct ncclStrongStream deviceStream, hostStream;
+  // Priority lanes (NCCL_PRIORITY_CHANNELS). Groups on high priority user streams
+  // are ordered by deviceStreamHigh instead of deviceStream, lane 1 below.
+  int laneState; // 0: not set up, 1: ready
+  int laneStreamPriorityLeast;
+  struct ncclStrongStream deviceStreamHigh;
+  cudaEvent_t laneEvent[2]; // Recorded after the last launch of each lane
+  uint64_t laneMask[2]; // Channels used by launches of each lane which may still run
 
   /* proxy related shared res */
   struct ncclProxyState* proxyState;
@@ -127,6 +140,9 @@ struct ncclChannel {
   struct ncclRing ring;
   int* devRingUserRanks;
   struct ncclTree tree;
+  // [nRanks] neighbor toward each root in the tree: -1 self, 0 up, 1+i down[i]
+  int8_t* treeToRoot;
+  int8_t* devTreeToRoot;
 
   struct ncclTree collnetChain;
   struct ncclDirect collnetDirect;
@@ -153,6 +169,34 @@ struct ncclPointerList {
   void *ptr;
 };
 
+// Block of CUDA memory holding the works of graph-captured plans. Plans bump
+// allocate from it, and it is reused once all of them have been destroyed.
+struct ncclWorkArenaBlock {
+  struct ncclWorkArenaBlock* next;
+  struct ncclWork* works; // in CUDA memory
+  int nWorks;
+  int used;
+  int live; // Plans with works in this block
+};
+
+// Host buffer receiving the works of a plan which doesn't fit in the work fifo.
+// Buffers are reused once the event recorded after their kernel completed.
+struct ncclWorkOverflow {
+  struct ncclWorkOverflow* next;
+  struct ncclWork* works; // in cudaHost memory
+  int nWorks;
+  cudaEvent_t event;
+};
+
+// Collective enqueued while another thread is launching (NCCL_CONCURRENT_ENQUEUE).
+// Lives on the stack of the submitting thread until done is set.
+struct ncclSubmitTask {
+  struct ncclSubmitTask* next;
+  struct ncclInfo info;
+  ncclResult_t result;
+  int done;
+};
+
 struct ncclKernelPlan {
   // A kernel plan is also a callback that reclaims itself. Hence this must
   // be the first member.
@@ -163,17 +207,29 @@ struct ncclKernelPlan {
   struct ncclKernelPlan* next;
 
   bool persistent; // aka captured in a graph
+  struct ncclKernelPlan* persistentNext; // in comm->persistentPlans
   bool kernelSpecialized;
   void *kernelFn;
+  int kernelIndex; // index of kernelFn in ncclKerns
   int channelUbound; // only channels c < channelUbound are present
   int channelCount; // number of channels present
   uint64_t channelMask; // which channels are present, channelCount == popcount(channelMask)
   bool hasProxyOps; // does any channel have a non-empty proxyOpQueue
+  bool proxyDeferred; // proxy ops are posted when the stream reaches the plan, not at launch
+  uint32_t doorbellSlot; // NCCL_GRAPH_DOORBELL slot posting the proxy ops, 0 if none
   int threadPerBlock;
   // workHeap fields are null until uploadWorkFifo() or preparePersistentKernel()
   struct ncclWork* workHead;
+  // Holds the works instead of the fifo when it was too full (NCCL_WORK_FIFO_OVERFLOW)
+  struct ncclWorkOverflow* workOverflow;
+  // Holds the works of persistent plans
+  struct ncclWorkArenaBlock* workArenaBlock;
+  // Works passed as kernel arguments instead, workHead is then null
+  bool workInline;
+  struct ncclKernelInlineWorks inlineWorks;
 
   int collOpCount; // zero based for this plan
+  struct ncclAutotuneSample* autotuneSample; // Only timed when the plan has a single collective
 
   struct ncclIntruQueue<struct ncclPointerList, &ncclPointerList::next> ipcMemQueue;
 
@@ -189,8 +245,18 @@ struct ncclKernelPlan {
   } channels[MAXCHANNELS];
 };
 
+// Scratch buffer reused by eager operations, see ncclScratchPrepare
+struct ncclScratchBuff {
+  void* buff;
+  size_t size;
+  cudaEvent_t event; // Recorded after the last use of buff, on stream
+  cudaStream_t stream;
+};
+
 struct ncclComm {
   struct ncclMemoryStack memPermanent, memScoped;
+  // Small device and mapped host objects freed with the communicator
+  struct ncclCudaArena devArena, hostArena;
   // List of destructors to run when comm is destructed
   struct ncclDestructor* destructorHead;
 
@@ -201,6 +267,16 @@ struct ncclComm {
   struct ncclChannel channels[MAXCHANNELS];
   struct ncclPeerInfo* peerInfo;
   struct ncclTopoSystem* topo;
+  // Ring, tree, collnet and NVLS graphs as searched, kept so that ncclCommSplit children
+  // spanning the same GPUs can reuse them. NULL if NCCL_SPLIT_REUSE_TOPO=0.
+  struct ncclTopoGraph* splitGraphs;
+  int splitGraphsCollNet;
+  int splitGraphsNvls;
+  // With NCCL_RUNTIME_CONNECT=1, rings and trees are connected by the first collective, using
+  // these ring, tree and NVLS graphs.
+  int runtimeConnect;
+  bool collConnected;
+  struct ncclTopoGraph* connectGraphs;
 
   ncclNet_t* ncclNet;
   ncclCollNet_t* ncclCollNet;
@@ -208,6 +284,7 @@ struct ncclComm {
   // Bitmasks for ncclTransportP2pSetup
   uint64_t* connectSend;
   uint64_t* connectRecv;
+  struct ncclP2pPeerState* p2pPeerState; // [nRanks], allocated when p2p reclamation is enabled
 
   uint64_t magic; // Magic number for all network communication. Not a security key -- only goal is to detect mismatches.
 
@@ -217,9 +294,12 @@ struct ncclComm {
   int cudaDev; // my cuda device index
   int nvmlDev; // my nvml device index
   int compCap; // compute capability of the GPU
+  int ll128Tested; // NCCL_LL128_PROBE_* paths checked by any rank
+  int ll128Passed; // ... and not failed on any rank
   int minCompCap, maxCompCap; // min/max compute capability in the communicator
   int64_t busId;   // my PCI bus ID in int format
   cpu_set_t cpuAffinity; // CPU affinity of the GPU
+  cpu_set_t proxyAffinity; // CPU affinity of the proxy threads, empty to inherit
   int cudaArch; // matches __CUDA_ARCH__ of device
 
   int node;
@@ -253,12 +333,18 @@ struct ncclComm {
 
   // Buffer sizes
   int buffSizes[NCCL_NUM_PROTOCOLS];
+  int netStepsShift; // SIMPLE pipeline depth of dedicated network connections, see ncclConnInfo::stepsShift
   int p2pChunkSize;
 
   // Algorithm/Protocols thresholds
   ssize_t threadThresholds[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+  ssize_t p2pWriteThreshold; // Per channel bytes below which SIMPLE uses the write path of P2P read connections
   float latencies[NCCL_NUM_FUNCTIONS][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
   float bandwidths[NCCL_NUM_FUNCTIONS][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+  bool measuredModel[NCCL_NUM_FUNCTIONS][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS]; // Loaded from NCCL_TUNING_FILE
+  // Intra-node one-shot [0] and two-shot [1] AllReduce, see shot_allreduce.cc
+  float shotArLatencies[2];
+  float shotArBandwidths[2];
   int maxThreads[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
 
   /* This attribute can indicate the states of communicators and return code of
@@ -283,6 +369,47 @@ struct ncclComm {
   uint32_t* workFifoDone/*[MAXCHANNELS]*/; // in cudaHost memory
   uint32_t workFifoSent; // Monotonic (mod 1<<32) index of next unused fifo slot.
   uint32_t workFifoAckdMin; // Monotonic index of least unprocessed fifo slot over all channels.
+  // Blocks holding the works of persistent plans
+  struct ncclWorkArenaBlock* workArena;
+  // Overflow buffers in use by launched kernels, in launch order, and free ones
+  struct ncclIntruQueue<struct ncclWorkOverflow, &ncclWorkOverflow::next> workOverflowBusy;
+  struct ncclWorkOverflow* workOverflowFree;
+
+  // Resident kernel (NCCL_RESIDENT_KERNEL), started on first launch
+  int residentKernelState; // 0: not started, 1: running, -1: disabled
+  uint64_t residentKernelMask; // Channels served by the resident kernel
+  uint64_t residentKernelSeq;
+  uint64_t* residentKernelDoorbells/*[2*MAXCHANNELS]*/; // in CUDA memory
+  cudaStream_t residentKernelStream;
+
+  // Graph doorbells (NCCL_GRAPH_DOORBELL), set up on first use
+  int graphDoorbellState; // 0: not set up, 1: enabled, -1: disabled
+  struct ncclGraphDoorbells* graphDoorbells;
+
+  // Ungrouped collectives held back to be launched together (NCCL_COALESCE_BYTES)
+  struct ncclInfo* coalesceInfos/*[NCCL_COALESCE_MAX_OPS]*/;
+  int coalesceCount;
+  size_t coalesceBytes;
+
+  // Results of computeColl() per collective shape (NCCL_COLL_CACHE), allocated on first use
+  struct ncclCollCacheEntry* collCache;
+
+  // Device timeline (NCCL_DEVICE_TIMELINE), null when disabled
+  struct ncclDevTimelineEvent* timeline/*[MAXCHANNELS][NCCL_DEV_TIMELINE_EVENTS]*/; // in cudaHost memory
+  uint32_t timelineHarvested[MAXCHANNELS]; // Number of events already written out, per channel
+
+  // Tuner plugin
+  ncclTuner_t* tuner;
+  void* tunerContext;
+
+  // Empirical tuning (NCCL_AUTOTUNE)
+  struct ncclAutotune* autotune;
+
+  // Runtime counters (ncclCommGetStats)
+  uint64_t statsPlans;
+  uint64_t statsWorkFifoFullWaits;
+  uint64_t statsWorkFifoOverflows;
+  uint64_t statsCollCacheHits;
 
   // Intra-process sync
   struct ncclComm* intraComm0; // leader of intra-process comms (self possible)
@@ -297,15 +424,28 @@ struct ncclComm {
 
   struct ncclProxyState* proxyState;
   int proxyRefCountOld; /* store proxy post-atomic-sub refcount */
+  // Proxy calls whose responses are gathered by ncclProxyCallDeferredWait()
+  struct ncclProxyDeferredCall* proxyDeferred;
+  struct ncclProxyDeferredCall* proxyDeferredLast;
   // Whether this communicator uses collNet
   int collNetSupport;
   uint8_t collNetSupportMatrix[4/*sum,prod,min,max*/][ncclNumTypes];
+  // Sums the proxy reduces after an allgather (NCCL_COLLNET_PROXY_REDUCE), AllReduce only
+  uint8_t collNetProxyReduce[ncclNumTypes];
   int intraHighestTransportType;
   int* collNetHeads;
   int collNetHeadsNum;
   /* sharable collNet proxy progress resource. */
   struct ncclCollNetSharedRes* collNetSharedRes;
 
+  // Some local ranks share a GPU (NCCL_SHARED_GPU)
+  bool sharedGpus;
+  // Most ranks on one GPU, on any host. They split its channels between them.
+  int maxGpuRanks;
+  // All ranks use blocking calls. Paths which need their steps ordered on the stream
+  // check this rather than their own config, so that all ranks pick the same one.
+  bool allBlocking;
+
   // NVLink SHARP (NVLS) support
   int nvlsSupport;
   /* sharable NVLS resource. */
@@ -323,14 +463,59 @@ struct ncclComm {
   // Subset of those in groupNext list. Holds 0x1 if not needing preconnect.
   struct ncclComm* preconnectNext;
   int persistentRefs; // number of persistent plan-lists capturing this comm
+  int treeArity; // inter-node children per tree node, see NCCL_TREE_ARITY
+  struct ncclKernelPlan* persistentPlans; // launched and not reclaimed, see ncclCommGraphUpdateBuffer
+  struct ncclGraphUserBuff* graphUserBuffs; // user buffers of captured kernels outside of plans, which it cannot patch
   struct ncclTasks tasks;
 
   // user-created reduction ops
   int userRedOpCapacity, userRedOpFreeHead;
   ncclUserRedOp *userRedOps;
 
+  // Wire-format copy of ncclRedOpCreateWireSum collectives and sparse gathers
+  struct ncclScratchBuff wireBuff;
+  // Blocks gathered by deterministic reductions (NCCL_DETERMINISTIC)
+  struct ncclScratchBuff determBuff;
+
+  // Copy engine collectives (NCCL_CE_COLL), set up by the first eligible operation
+  int ceCollState; // 0: not set up, 1: ready, -1: unavailable
+  struct ncclCeColl* ceColl;
+
+  // One-shot and two-shot AllReduce (NCCL_SHOT_ALLREDUCE), set up at init
+  int shotArState; // 0: not set up, 1: ready, -1: unavailable
+  struct ncclShotAr* shotAr;
+
+  // Hierarchical AllReduce (NCCL_HIER_ALLREDUCE), set up at init
+  int hierArState; // 0: not set up, 1: ready, -1: unavailable
+  struct ncclHierAr* hierAr;
+
+  // InfiniBand multicast (NCCL_IB_MCAST), set up at init
+  int ibMcastState; // 0: not set up, 1: ready, -1: unavailable
+  struct ncclIbMcast* ibMcast;
+
+  // Collectives on host memory (NCCL_HOST_COLL), set up at init
+  int hostCollState; // 0: not set up, 1: ready, -1: unavailable
+  struct ncclHostColl* hostColl;
+
+  // Windows created by ncclDevWindowCreate
+  struct ncclDevWindowHost* devWindows;
+
+  // Bytes of the memory budget (ncclConfig_t memBudget) left for p2p connections, 0 for none
+  int64_t memBudgetP2p;
+  // Set when the memory budget left no room for LL128 buffers, which disables LL128
+  int memBudgetNoLL128;
+
+  // Buffers registered by ncclCommRegister
+  struct ncclReg* regs;
+  // Per peer, connection to the proxy of local peers mapping our registered buffers
+  struct ncclProxyConnector* p2pRegConns;
+  int nvlsRegId; // Id of the next multicast binding of registered buffers, same on all local ranks
+
   // Queue of things for the main thread to do
   struct ncclIntruQueueMpsc<struct ncclCommCallback, &ncclCommCallback::next> callbackQueue;
+  // Collectives submitted concurrently by several threads, see ncclEnqueueCheck()
+  struct ncclIntruQueueMpsc<struct ncclSubmitTask, &ncclSubmitTask::next> submitQueue;
+  int submitDraining; // Set while one of the submitting threads launches the queue
 
   // List of kernel plans built form tasks.
   struct ncclIntruQueue<struct ncclKernelPlan, &ncclKernelPlan::next> planQueue;
@@ -13,6 +13,10 @@
 
 // Is cuMem API usage enabled
 extern int ncclCuMemEnable();
+// Whether this platform supports cuMem allocations which the network can register
+int ncclIsCuMemSupported();
+// Whether streams of this device can wait on and write to memory (cuStreamWaitValue32)
+int ncclCudaStreamMemOpsSupported(int cudaDev);
 
 #if CUDART_VERSION >= 11030
 #include <cudaTypedefs.h>
@@ -93,6 +97,11 @@ DECLARE_CUDA_PFN_EXTERN(cuMemSetAccess, 10020);
 DECLARE_CUDA_PFN_EXTERN(cuMemUnmap, 10020);
 #if CUDA_VERSION >= 11070
 DECLARE_CUDA_PFN_EXTERN(cuMemGetHandleForAddressRange, 11070); // DMA-BUF support
+// Stream memory operations
+DECLARE_CUDA_PFN_EXTERN(cuStreamWaitValue32, 11070);
+DECLARE_CUDA_PFN_EXTERN(cuStreamWriteValue32, 11070);
+DECLARE_CUDA_PFN_EXTERN(cuStreamWaitValue64, 11070);
+DECLARE_CUDA_PFN_EXTERN(cuStreamWriteValue64, 11070);
 #endif
 #if CUDA_VERSION >= 12010
 /* NVSwitch Multicast support */
@@ -0,0 +1,21 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_DETERM_H_
+#define NCCL_DETERM_H_
+
+#include "nccl.h"
+#include <cuda_runtime.h>
+
+// Deterministic reductions (NCCL_DETERMINISTIC=1): the blocks of all ranks are
+// gathered by their owner, which reduces them in rank order.
+bool ncclDetermTypeSupported(ncclDataType_t datatype);
+// dst[i] = src[0*stride+i] op src[1*stride+i] op ... op src[(nSrcs-1)*stride+i], left to right.
+// op is ncclSum, ncclProd or ncclAvg.
+ncclResult_t ncclDetermReduce(const void* src, size_t stride, int nSrcs, void* dst, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream);
+
+#endif
@@ -0,0 +1,15 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_DEV_WINDOW_H_
+#define NCCL_DEV_WINDOW_H_
+
+#include "nccl.h"
+
+// Frees the windows of ncclDevWindowCreate the application did not destroy
+ncclResult_t ncclDevWindowFreeAll(struct ncclComm* comm);
+
+#endif
@@ -32,6 +32,9 @@ extern const char* ncclProtoStr[NCCL_NUM_PROTOCOLS];
 
 #define NCCL_MAX_OPS 2048
 #define NCCL_STEPS 8
+// SIMPLE connections may run deeper pipelines, of NCCL_STEPS<<ncclConnInfo::stepsShift steps
+#define NCCL_MAX_STEPS 32
+#define NCCL_MAX_STEPS_SHIFT 2
 
 union ncclLLFifoLine {
   /* Flags have to be *after* data, because otherwise, an incomplete receive
@@ -85,6 +88,7 @@ static_assert(NCCL_LL_CLEAN_MASK % NCCL_STEPS == 0, "Invalid NCCL_LL_CLEAN_MASK
 struct ncclConnInfo {
   // Regular comm mechanism
   char *buffs[NCCL_NUM_PROTOCOLS]; // Local for recv, remote for send
+  char *buffWrite;    // Receiver side SIMPLE buffer of P2P read connections, used by works with p2pWrite set
   uint64_t *tail;     // Local for recv, remote for send
   uint64_t *head;     // Local for send, remote for recv
 
@@ -95,6 +99,8 @@ struct ncclConnInfo {
 
   int *sizesFifo;     // Sizes fifo from GPU to proxy
   int *offsFifo;      // Buffer fifo from proxy to GPU
+  uint64_t *regDone;  // Steps sent from registered user buffers, local for send
+  int stepsShift;     // SIMPLE runs NCCL_STEPS<<stepsShift steps, its buffer holds as many
 
   uint64_t step;      // Keep where we are
   uint64_t llLastCleaning;
@@ -129,10 +135,13 @@ struct ncclRing {
 };
 
 
-// The root of each tree only has one node down (+1 intra-node).
-#define NCCL_MAX_TREE_ARITY_TOP 2
-// Nodes inside the binary tree can have to two nodes down (+1 intra-node).
-#define NCCL_MAX_TREE_ARITY 3
+// Nodes inside the inter-node tree have up to NCCL_TREE_ARITY nodes down (+1 intra-node),
+// the binary tree is the default.
+#define NCCL_MAX_TREE_INTER_ARITY 4
+#define NCCL_MAX_TREE_ARITY (NCCL_MAX_TREE_INTER_ARITY+1)
+// The root of each double binary tree only has one node down, the root of a k-ary tree
+// has all of them.
+#define NCCL_MAX_TREE_ARITY_TOP NCCL_MAX_TREE_ARITY
 struct ncclTree {
   int depth;
   int up;
@@ -162,6 +171,8 @@ struct ncclNvls {
   int treeDown[NCCL_MAX_NVLS_TREE_ARITY];
   int node;
   int nNodes;
+  uint64_t* barrierUc; // {arrivals, epoch} of this channel for operations on registered buffers
+  uint64_t* barrierMc; // Multicast address of barrierUc[0], NULL if not available
 };
 
 #define NCCL_MAX_CONNS 2
@@ -198,6 +209,7 @@ struct ncclWorkHeader {
   uint16_t funcIndex;
   uint8_t isLast:1; // last work for this kernel
   uint8_t inFifo:1; // is this work in the fifo
+  uint8_t p2pWrite:1; // use the write path of P2P read connections for SIMPLE
   enum ncclWorkType type;
 };
 
@@ -205,7 +217,7 @@ struct ncclWorkElem {
   union {
     uint8_t flagBits;
     struct {
-      uint8_t isUsed:1, redOpArgIsPtr:1, regUsed:1;
+      uint8_t isUsed:1, redOpArgIsPtr:1, regUsed:1, p2pWrite:1;
     };
   };
   uint8_t nWarps;
@@ -226,8 +238,10 @@ struct ncclWorkElem {
 static_assert(NCCL_MAX_WORK_ELEMENTS == 9, "Sanity check: NCCL_MAX_WORK_ELEMENTS == 9");
 
 struct ncclWorkElemP2p {
-  int peer : 30;
+  int peer : 28;
   int proto : 2;
+  unsigned netReg : 1; // Network reads/writes buff directly, see ncclCommRegister
+  unsigned p2pReg : 1; // Intra-node copy between user buffers, see ncclRegFindP2p
 
   enum ncclWorkP2PType p2pType;
   uint8_t nWarps;
@@ -271,6 +285,14 @@ struct ncclWork {
 static_assert(sizeof(struct ncclWork) == NCCL_WORK_SIZE, "Sanity check: sizeof(struct ncclWork) == NCCL_WORK_SIZE");
 static_assert(sizeof(struct ncclWork)%16 == 0, "Sanity check: sizeof(struct ncclWork)%16 == 0");
 
+// Works of a small plan passed by value as the last kernel argument, with a
+// null workHead, so that blocks start without reading the work fifo. Block y
+// gets data[y] as its only work.
+#define NCCL_KERNEL_INLINE_WORKS 4
+struct ncclKernelInlineWorks {
+  uint64_t data[NCCL_KERNEL_INLINE_WORKS][NCCL_WORK_SIZE/sizeof(uint64_t)];
+};
+
 struct ncclDevChannelPeer {
   // Stripped version of ncclChannelPeer where we only keep the ncclConnInfo
   // instead of the full ncclConnector.
@@ -278,16 +300,53 @@ struct ncclDevChannelPeer {
   struct ncclConnInfo recv[NCCL_MAX_CONNS];
 };
 
+// Ring and tree neighbors (prev, next, up and every down) whose peers[] entry the host resolves ahead of time
+#define NCCL_DEV_PEER_CACHE (3+NCCL_MAX_TREE_ARITY)
+
 struct alignas(16) ncclDevChannel {
   struct ncclDevChannelPeer** peers;
+  // peers[peerCacheRank[i]], loaded to shared memory with the rest of the channel
+  // so that Primitives skip the dependent global load of peers[] at startup
+  struct ncclDevChannelPeer* peerCache[NCCL_DEV_PEER_CACHE];
+  int peerCacheRank[NCCL_DEV_PEER_CACHE]; // -1 when unused
   struct ncclRing ring;
   struct ncclTree tree;
+  int8_t* treeToRoot; // [nRanks] tree neighbor toward each root, see ncclChannel
   struct ncclTree collnetChain;
   struct ncclDirect collnetDirect;
   struct ncclNvls nvls;
   uint32_t* workFifoDone; // Location of done counter, device writes index+1 of last work processed
 };
 
+// Device timeline (NCCL_DEVICE_TIMELINE=1). Each channel stamps work elements and primitive
+// wait/copy phases with %globaltimer into its own ring of events in host memory, which the host
+// harvests and merges into the proxy profiler trace.
+#define NCCL_DEV_TIMELINE_EVENTS 4096
+enum ncclDevTimelineType : uint16_t {
+  ncclDevTimelineWorkBegin = 0,   // info = funcIndex
+  ncclDevTimelineWorkEnd = 1,
+  ncclDevTimelineWaitBegin = 2,   // Simple protocol waitPeer, info = 2*group+isSend
+  ncclDevTimelineWaitEnd = 3,
+  ncclDevTimelineLLWaitBegin = 4, // LL/LL128 flag or head spinning, info = 2*group+isSend
+  ncclDevTimelineLLWaitEnd = 5,
+  ncclDevTimelineCopyBegin = 6,   // Simple protocol reduceCopy, info = group
+  ncclDevTimelineCopyEnd = 7,
+  ncclDevTimelineNumTypes = 8
+};
+
+struct ncclDevTimelineEvent {
+  uint64_t timestamp; // %globaltimer, in ns
+  uint16_t type;
+  uint16_t info;
+  uint32_t seq;       // Written last : index+1 of this event in the channel's event stream
+};
+
+// Resident kernel doorbells (NCCL_RESIDENT_KERNEL) : doorbells[c] for channel c
+// holds seq<<40 | y<<32 | ix, pointing that channel at the work heap entry ix+y,
+// ix being the workHead of the plan and y the index of c among its channels.
+// doorbells[MAXCHANNELS+c] gets the same value back once the works are done.
+#define NCCL_RESIDENT_KERNEL_STOP (~uint64_t(0))
+
 struct ncclDevComm {
   int rank;
   int nRanks;
@@ -300,8 +359,17 @@ struct ncclDevComm {
   // Flag to ask NCCL kernels to abort
   volatile uint32_t* abortFlag;
 
+  // Use bulk asynchronous copies for data movement without reduction (sm_90)
+  int bulkCopy;
+  // Prefetch the next slice received from peers into L2 in the Simple protocol
+  int prefetch;
+
   // Channels, device side
   struct ncclDevChannel* channels/*[MAXCHANNELS]*/;
+
+  // Device timeline, null when disabled
+  struct ncclDevTimelineEvent* timeline/*[MAXCHANNELS][NCCL_DEV_TIMELINE_EVENTS]*/; // cudaHost memory
+  uint32_t* timelineHead/*[MAXCHANNELS]*/; // CUDA memory
 };
 
 struct alignas(16) ncclDevCommAndChannels {
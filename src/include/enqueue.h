@@ -22,5 +22,30 @@ ncclResult_t ncclLaunchKernelBefore_NoUncapturedCuda(struct ncclComm* comm, stru
 ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan);
 ncclResult_t ncclLaunchKernelAfter_NoCuda(struct ncclComm* comm, struct ncclKernelPlan* plan);
 ncclResult_t ncclLaunchFinish(struct ncclComm* comm);
+// Launches the collectives held back for coalescing (NCCL_COALESCE_BYTES)
+ncclResult_t ncclCoalesceFlush(struct ncclComm* comm);
+// Returns once the collectives queued by all threads (NCCL_CONCURRENT_ENQUEUE) are launched
+ncclResult_t ncclSubmitFlush(struct ncclComm* comm);
+// Frees the blocks holding the works of persistent plans
+ncclResult_t ncclWorkArenaFree(struct ncclComm* comm);
+// Frees the work fifo overflow buffers (NCCL_WORK_FIFO_OVERFLOW)
+ncclResult_t ncclWorkOverflowFree(struct ncclComm* comm);
+// Stops the resident kernel (NCCL_RESIDENT_KERNEL) if it was started
+ncclResult_t ncclResidentKernelStop(struct ncclComm* comm);
+ncclResult_t ncclGraphDoorbellsFree(struct ncclComm* comm);
+// Set the connectSend/connectRecv bits for the channels a send/recv of nBytes with peer needs.
+ncclResult_t ncclP2pMarkConnect(struct ncclComm* comm, int peer, bool isSendNotRecv, ssize_t nBytes, bool* needConnect);
+// Whether all work launched on the communicator so far has been consumed by the device.
+bool ncclWorkFifoIdle(struct ncclComm* comm);
+// Returns a buffer of at least bytes, ready to be overwritten on info->stream: that of
+// scratch, or a buffer owned by the graph when info->stream is capturing.
+// Users call ncclScratchRelease once their last use of it is enqueued on that stream.
+ncclResult_t ncclScratchPrepare(struct ncclInfo* info, struct ncclScratchBuff* scratch, size_t bytes, void** buff);
+ncclResult_t ncclScratchRelease(struct ncclScratchBuff* scratch, cudaStream_t stream, void* buff);
+ncclResult_t ncclScratchFree(struct ncclScratchBuff* scratch);
+// Records user buffers which an operation captured on stream uses outside of the works of
+// a plan, which ncclCommGraphUpdateBuffer must then refuse to move. Does nothing unless
+// stream is capturing; a NULL buffer is skipped.
+ncclResult_t ncclGraphUserBuffRecord(struct ncclComm* comm, cudaStream_t stream, const void* buff0, size_t size0, const void* buff1, size_t size1);
 
 #endif // End include guard
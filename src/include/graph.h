@@ -26,6 +26,10 @@ ncclResult_t ncclTopoPrint(struct ncclTopoSystem* system);
 ncclResult_t ncclTopoComputePaths(struct ncclTopoSystem* system, struct ncclComm* comm);
 void ncclTopoFree(struct ncclTopoSystem* system);
 ncclResult_t ncclTopoTrimSystem(struct ncclTopoSystem* system, struct ncclComm* comm);
+// Copy the system and graphs of the parent of a split communicator having the same local GPUs,
+// renumbering GPUs with the ranks of the child.
+ncclResult_t ncclTopoSplitSystem(struct ncclComm* comm, struct ncclComm* parent, struct ncclTopoSystem** system);
+ncclResult_t ncclTopoSplitGraph(struct ncclComm* comm, struct ncclComm* parent, struct ncclTopoGraph* src, struct ncclTopoGraph* graph);
 ncclResult_t ncclTopoComputeP2pChannels(struct ncclComm* comm);
 ncclResult_t ncclTopoGetNvbGpus(struct ncclTopoSystem* system, int rank, int* nranks, int** ranks);
 int ncclTopoPathAllNVLink(struct ncclTopoSystem* system);
@@ -42,6 +46,7 @@ ncclResult_t ncclTopoGetLocalRank(struct ncclTopoSystem* system, int rank, int*
 
 // Find CPU affinity
 ncclResult_t ncclTopoGetCpuAffinity(struct ncclTopoSystem* system, int rank, cpu_set_t* affinity);
+ncclResult_t ncclTopoGetNetCpuAffinity(struct ncclTopoSystem* system, int rank, cpu_set_t* affinity);
 
 #define NCCL_TOPO_CPU_ARCH_X86 1
 #define NCCL_TOPO_CPU_ARCH_POWER 2
@@ -54,6 +59,7 @@ ncclResult_t ncclTopoGetCpuAffinity(struct ncclTopoSystem* system, int rank, cpu
 #define NCCL_TOPO_CPU_TYPE_YONGFENG 1
 ncclResult_t ncclTopoCpuType(struct ncclTopoSystem* system, int* arch, int* vendor, int* model);
 ncclResult_t ncclTopoGetGpuCount(struct ncclTopoSystem* system, int* count);
+ncclResult_t ncclTopoGetRankIndex(struct ncclTopoSystem* system, int rank, int* index);
 ncclResult_t ncclTopoGetNvsCount(struct ncclTopoSystem* system, int* count);
 ncclResult_t ncclTopoGetNvsCount(struct ncclTopoSystem* system, int* count);
 ncclResult_t ncclTopoGetLocalNet(struct ncclTopoSystem* system, int rank, int channelId, int* id);
@@ -90,9 +96,17 @@ struct ncclTopoGraph {
   int inter[MAXCHANNELS*2];
 };
 ncclResult_t ncclTopoCompute(struct ncclTopoSystem* system, struct ncclTopoGraph* graph);
+// Compute independent graphs concurrently, each on its own copy of the system.
+ncclResult_t ncclTopoComputeConcurrent(struct ncclTopoSystem* system, int ngraphs, struct ncclTopoGraph** graphs);
 
 ncclResult_t ncclTopoPrintGraph(struct ncclTopoSystem* system, struct ncclTopoGraph* graph);
+// Make channel c of the graph be its channel (c+offset)%nChannels, see ncclConfig_t::channelOffset.
+ncclResult_t ncclTopoRotateChannels(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, int offset);
 ncclResult_t ncclTopoDumpGraphs(struct ncclTopoSystem* system, int ngraphs, struct ncclTopoGraph** graphs);
+// Graph search cache (NCCL_GRAPH_CACHE_DIR). Load sets *loaded to 1 only if all graphs were found
+// for this topology fingerprint.
+ncclResult_t ncclTopoGraphCacheLoad(struct ncclComm* comm, int ngraphs, struct ncclTopoGraph** graphs, int* loaded);
+ncclResult_t ncclTopoGraphCacheSave(struct ncclComm* comm, int ngraphs, struct ncclTopoGraph** graphs);
 
 struct ncclTopoRanks {
   int ringRecv[MAXCHANNELS];
@@ -103,15 +117,21 @@ struct ncclTopoRanks {
   int treeToChild0[MAXCHANNELS];
   int treeToChild1[MAXCHANNELS];
   int nvlsHeads[MAXCHANNELS];
+  uint64_t netSwitch; // Hash of the network switch of the node, 0 if unknown
 };
 
 ncclResult_t ncclTopoPreset(struct ncclComm* comm, struct ncclTopoGraph** graphs, struct ncclTopoRanks* topoRanks);
 
-ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* firstRanks, int* treePatterns,
-    struct ncclTopoRanks** allTopoRanks, int* rings, struct ncclTopoGraph** graphs);
+// nodeTopoRanks holds the ring/tree heads of each node, ringPrev/ringNext the ring neighbors of
+// each rank as [MAXCHANNELS][nRanks], with the first nChannels set; the rest is used for duplication.
+ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* treePatterns, struct ncclTopoRanks* nodeTopoRanks,
+    int* ringPrev, int* ringNext, int* rings, struct ncclTopoGraph** graphs);
 
 ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCompCap, struct ncclTopoGraph** graphs);
 #include "info.h"
 ncclResult_t ncclTopoGetAlgoTime(struct ncclInfo* info, int algorithm, int protocol, int numPipeOps, float* time);
+// Modeled time of the one-shot (twoShot=0) or two-shot (twoShot=1) intra-node AllReduce, -1 when unavailable
+ncclResult_t ncclTopoGetShotArTime(struct ncclInfo* info, int twoShot, float* time);
+ncclResult_t ncclTopoTuneChannels(struct ncclInfo* info, int algorithm, int protocol, int* nChannels);
 
 #endif
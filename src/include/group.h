@@ -28,7 +28,9 @@ typedef enum ncclGroupJobState {
 
 struct ncclAsyncJob {
   struct ncclAsyncJob* next;
-  pthread_t thread;
+  struct ncclAsyncJob* poolNext; /* link in the thread pool queues */
+  bool poolBounded;              /* counts against NCCL_ASYNC_MAX_THREADS */
+  cpu_set_t affinity;            /* of the thread which started the job, the pool thread runs it there */
   ncclResult_t result;
   ncclResult_t(*func)(struct ncclAsyncJob*);
   void(*undo)(struct ncclAsyncJob*);
@@ -58,6 +60,12 @@ struct ncclGroupJob {
 
 ncclResult_t ncclGroupStartInternal();
 ncclResult_t ncclGroupEndInternal();
+// Runs job->func on a pooled thread; job->state becomes ncclGroupJobDone once it returned. Bounded
+// jobs may wait for a thread when NCCL_ASYNC_MAX_THREADS is set, so jobs which other running jobs
+// wait on (e.g. the group launch job itself) must not be bounded.
+ncclResult_t ncclAsyncJobStart(struct ncclAsyncJob* job, bool bounded);
+// Waits until a started job is done and returns its result.
+ncclResult_t ncclAsyncJobWait(struct ncclAsyncJob* job);
 ncclResult_t ncclAsyncJobComplete(struct ncclAsyncJob* job);
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,21 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_HEALTH_H_
+#define NCCL_HEALTH_H_
+
+#include "nccl.h"
+
+// Link health probe (NCCL_HEALTH_CHECK), run once the communicator is ready.
+// Each rank times send/recv with its ring neighbors and its tree parent and
+// children, for a large size (bandwidth) and a small one (latency). Rank 0
+// warns about the links which are much slower than the median. With
+// NCCL_HEALTH_CHECK=2, Ring and Tree bandwidths of the tuning model are also
+// scaled down by how much the slowest link lags, on all ranks alike.
+struct ncclComm;
+ncclResult_t ncclHealthCheck(struct ncclComm* comm);
+
+#endif
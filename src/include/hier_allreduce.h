@@ -0,0 +1,34 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_HIER_ALLREDUCE_H_
+#define NCCL_HIER_ALLREDUCE_H_
+
+#include "info.h"
+
+// Hierarchical AllReduce (NCCL_HIER_ALLREDUCE): a ReduceScatter within the node, an
+// AllReduce of each GPU's share with the GPUs of the same local rank on the other nodes
+// (the rail, which reaches them through its closest NIC), and an AllGather within the
+// node. Each GPU only sends 1/localRanks of the buffer across nodes. The buffer is cut in
+// chunks so that the AllReduce across nodes of a chunk overlaps the work within the node
+// of the next ones.
+
+// Creates the node and rail communicators at init, when enabled on all ranks and every node
+// has the same number of GPUs.
+ncclResult_t ncclHierArInit(struct ncclComm* comm);
+// Sets *eligible when the AllReduce described by info may run hierarchically, in which
+// case ncclHierArRun must be called once the current group has ended. This only depends
+// on its arguments and the communicator; it fails with ncclInvalidUsage when the AllReduce
+// may run hierarchically but is called within a group.
+ncclResult_t ncclHierArEligible(struct ncclInfo* info, bool* eligible);
+// Runs the AllReduce hierarchically or, if the model prefers it, on the communicator itself.
+ncclResult_t ncclHierArRun(struct ncclInfo* info);
+// Fills subComms with the node and rail communicators, on which the steps are issued,
+// and returns how many there are.
+int ncclHierArSubComms(struct ncclComm* comm, struct ncclComm* subComms[2]);
+ncclResult_t ncclHierArFree(struct ncclComm* comm, bool abort);
+
+#endif
@@ -0,0 +1,30 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_HOST_COLL_H_
+#define NCCL_HOST_COLL_H_
+
+#include "info.h"
+
+// Collectives on host memory (NCCL_HOST_COLL): AllReduce and Broadcast whose buffers
+// are in host memory, pinned or not, run on the CPU around a ring of network
+// connections, reducing on the host, instead of having the GPU reach the buffers
+// across PCI.
+
+// Connects the ring at init, when NCCL_HOST_COLL is set on all ranks.
+ncclResult_t ncclHostCollInit(struct ncclComm* comm);
+// Sets *eligible when the operation described by info should run on the host. The ranks
+// agree on it through the bootstrap for every AllReduce and Broadcast it could serve, and
+// all fail with ncclInvalidUsage unless the buffers are in host memory on all ranks or on
+// none, or if any rank passing host buffers is in a group or capturing.
+ncclResult_t ncclHostCollEligible(struct ncclInfo* info, bool* eligible);
+// Runs the operation once the work already on its stream is done. With
+// NCCL_HOST_COLL_OFFLOAD this happens on a worker thread and the stream waits for
+// it; otherwise the call returns once the result is in recvbuff.
+ncclResult_t ncclHostCollRun(struct ncclInfo* info);
+ncclResult_t ncclHostCollFree(struct ncclComm* comm);
+
+#endif
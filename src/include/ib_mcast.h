@@ -0,0 +1,27 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_IB_MCAST_H_
+#define NCCL_IB_MCAST_H_
+
+#include "info.h"
+
+// InfiniBand multicast (NCCL_IB_MCAST=1): Broadcast and AllGather across nodes send each
+// buffer once, to a UD multicast group which all ranks joined, instead of relaying it
+// through the ring. The group must exist in the fabric (NCCL_IB_MCAST_GID, and
+// NCCL_IB_MCAST_LID on InfiniBand). Data goes through host memory in windows of packets
+// which every receiver acknowledges, or reports missing packets of, to the root.
+
+// Joins the group at init, when enabled on all ranks and the communicator spans nodes.
+ncclResult_t ncclIbMcastInit(struct ncclComm* comm);
+// Sets *eligible when the operation described by info should go through multicast, which
+// only depends on its arguments and the communicator. Fails with ncclInvalidUsage when it
+// should but is called within a group or captured.
+ncclResult_t ncclIbMcastEligible(struct ncclInfo* info, bool* eligible);
+ncclResult_t ncclIbMcastLaunch(struct ncclInfo* info);
+ncclResult_t ncclIbMcastFree(struct ncclComm* comm);
+
+#endif
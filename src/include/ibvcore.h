@@ -321,9 +321,21 @@ enum ibv_access_flags {
 	IBV_ACCESS_REMOTE_READ		= (1<<2),
 	IBV_ACCESS_REMOTE_ATOMIC	= (1<<3),
 	IBV_ACCESS_MW_BIND		= (1<<4),
+	IBV_ACCESS_ZERO_BASED		= (1<<5),
+	IBV_ACCESS_ON_DEMAND		= (1<<6),
 	IBV_ACCESS_RELAXED_ORDERING     = (1<<20),
 };
 
+enum ibv_advise_mr_advice {
+	IBV_ADVISE_MR_ADVICE_PREFETCH,
+	IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+	IBV_ADVISE_MR_ADVICE_PREFETCH_NO_FAULT,
+};
+
+enum {
+	IBV_ADVISE_MR_FLAG_FLUSH = 1 << 0,
+};
+
 struct ibv_pd {
 	struct ibv_context     *context;
 	uint32_t		handle;
@@ -362,6 +374,22 @@ struct ibv_mr {
 	uint32_t		rkey;
 };
 
+struct ibv_alloc_dm_attr {
+	size_t length;
+	uint32_t log_align_req;
+	uint32_t comp_mask;
+};
+
+struct ibv_dm {
+	struct ibv_context *context;
+	int (*memcpy_to_dm)(struct ibv_dm *dm, uint64_t dm_offset,
+			    const void *host_addr, size_t length);
+	int (*memcpy_from_dm)(void *host_addr, struct ibv_dm *dm,
+			      uint64_t dm_offset, size_t length);
+	uint32_t comp_mask;
+	uint32_t handle;
+};
+
 enum ibv_mw_type {
 	IBV_MW_TYPE_1			= 1,
 	IBV_MW_TYPE_2			= 2
@@ -498,6 +526,7 @@ enum ibv_qp_type {
 	IBV_QPT_RAW_ETH = 8,
 	IBV_QPT_XRC_SEND = 9,
 	IBV_QPT_XRC_RECV,
+	IBV_QPT_DRIVER = 0xff,
 
 	/* Leave a gap for future qp types before starting with
 	 * experimental qp types.
@@ -529,7 +558,25 @@ struct ibv_qp_init_attr {
 enum ibv_qp_init_attr_mask {
 	IBV_QP_INIT_ATTR_PD		= 1 << 0,
 	IBV_QP_INIT_ATTR_XRCD		= 1 << 1,
-	IBV_QP_INIT_ATTR_RESERVED	= 1 << 2
+	IBV_QP_INIT_ATTR_RESERVED	= 1 << 2,
+	IBV_QP_INIT_ATTR_SEND_OPS_FLAGS	= 1 << 6
+};
+
+enum ibv_qp_create_send_ops_flags {
+	IBV_QP_EX_WITH_RDMA_WRITE		= 1 << 0,
+	IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM	= 1 << 1,
+	IBV_QP_EX_WITH_SEND			= 1 << 2,
+	IBV_QP_EX_WITH_SEND_WITH_IMM		= 1 << 3,
+	IBV_QP_EX_WITH_RDMA_READ		= 1 << 4
+};
+
+struct ibv_rwq_ind_table;
+
+struct ibv_rx_hash_conf {
+	uint8_t			rx_hash_function;
+	uint8_t			rx_hash_key_len;
+	uint8_t		       *rx_hash_key;
+	uint64_t		rx_hash_fields_mask;
 };
 
 struct ibv_qp_init_attr_ex {
@@ -544,6 +591,13 @@ struct ibv_qp_init_attr_ex {
 	uint32_t		comp_mask;
 	struct ibv_pd	       *pd;
 	struct ibv_xrcd	       *xrcd;
+	/* Below is only looked at when enabled in comp_mask */
+	uint32_t		create_flags;
+	uint16_t		max_tso_header;
+	struct ibv_rwq_ind_table *rwq_ind_tbl;
+	struct ibv_rx_hash_conf	rx_hash_conf;
+	uint32_t		source_qpn;
+	uint64_t		send_ops_flags;
 };
 
 enum ibv_qp_open_attr_mask {
@@ -754,6 +808,44 @@ struct ibv_qp {
 	uint32_t		events_completed;
 };
 
+struct ibv_mw;
+struct ibv_mw_bind_info;
+
+struct ibv_data_buf {
+	void			*addr;
+	size_t			length;
+};
+
+/* Work request posting API of IBVERBS_1.6, used through function pointers only */
+struct ibv_qp_ex {
+	struct ibv_qp		qp_base;
+	uint64_t		comp_mask;
+
+	uint64_t		wr_id;
+	unsigned int		wr_flags; /* enum ibv_send_flags */
+
+	void (*wr_atomic_cmp_swp)(struct ibv_qp_ex *qp, uint32_t rkey, uint64_t remote_addr, uint64_t compare, uint64_t swap);
+	void (*wr_atomic_fetch_add)(struct ibv_qp_ex *qp, uint32_t rkey, uint64_t remote_addr, uint64_t add);
+	void (*wr_bind_mw)(struct ibv_qp_ex *qp, struct ibv_mw *mw, uint32_t rkey, const struct ibv_mw_bind_info *bind_info);
+	void (*wr_local_inv)(struct ibv_qp_ex *qp, uint32_t invalidate_rkey);
+	void (*wr_rdma_read)(struct ibv_qp_ex *qp, uint32_t rkey, uint64_t remote_addr);
+	void (*wr_rdma_write)(struct ibv_qp_ex *qp, uint32_t rkey, uint64_t remote_addr);
+	void (*wr_rdma_write_imm)(struct ibv_qp_ex *qp, uint32_t rkey, uint64_t remote_addr, uint32_t imm_data);
+	void (*wr_send)(struct ibv_qp_ex *qp);
+	void (*wr_send_imm)(struct ibv_qp_ex *qp, uint32_t imm_data);
+	void (*wr_send_inv)(struct ibv_qp_ex *qp, uint32_t invalidate_rkey);
+	void (*wr_send_tso)(struct ibv_qp_ex *qp, void *hdr, uint16_t hdr_sz, uint16_t mss);
+	void (*wr_set_ud_addr)(struct ibv_qp_ex *qp, struct ibv_ah *ah, uint32_t remote_qpn, uint32_t remote_qkey);
+	void (*wr_set_xrc_srqn)(struct ibv_qp_ex *qp, uint32_t remote_srqn);
+	void (*wr_set_inline_data)(struct ibv_qp_ex *qp, void *addr, size_t length);
+	void (*wr_set_inline_data_list)(struct ibv_qp_ex *qp, size_t num_buf, const struct ibv_data_buf *buf_list);
+	void (*wr_set_sge)(struct ibv_qp_ex *qp, uint32_t lkey, uint64_t addr, uint32_t length);
+	void (*wr_set_sge_list)(struct ibv_qp_ex *qp, size_t num_sge, const struct ibv_sge *sg_list);
+	void (*wr_start)(struct ibv_qp_ex *qp);
+	int (*wr_complete)(struct ibv_qp_ex *qp);
+	void (*wr_abort)(struct ibv_qp_ex *qp);
+};
+
 struct ibv_comp_channel {
 	struct ibv_context     *context;
 	int			fd;
@@ -35,6 +35,14 @@ struct ncclIbvSymbols {
   struct ibv_qp * (*ibv_internal_create_qp)(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr);
   int (*ibv_internal_modify_qp)(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask);
   int (*ibv_internal_destroy_qp)(struct ibv_qp *qp);
+  struct ibv_srq * (*ibv_internal_create_srq)(struct ibv_pd *pd, struct ibv_srq_init_attr *srq_init_attr);
+  int (*ibv_internal_destroy_srq)(struct ibv_srq *srq);
+  struct ibv_ah * (*ibv_internal_create_ah)(struct ibv_pd *pd, struct ibv_ah_attr *attr);
+  int (*ibv_internal_destroy_ah)(struct ibv_ah *ah);
+  int (*ibv_internal_attach_mcast)(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid);
+  int (*ibv_internal_detach_mcast)(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid);
+  /* Extended work request API (IBVERBS 1.6), only needed for DC */
+  struct ibv_qp_ex * (*ibv_internal_qp_to_qp_ex)(struct ibv_qp *qp);
   const char * (*ibv_internal_event_type_str)(enum ibv_event_type event);
 };
 
@@ -50,6 +50,18 @@ ncclResult_t wrap_ibv_reg_mr_iova2(struct ibv_mr **ret, struct ibv_pd *pd, void
 ncclResult_t wrap_ibv_reg_dmabuf_mr(struct ibv_mr **ret, struct ibv_pd *pd, uint64_t offset, size_t length, uint64_t iova, int fd, int access);
 struct ibv_mr * wrap_direct_ibv_reg_dmabuf_mr(struct ibv_pd *pd, uint64_t offset, size_t length, uint64_t iova, int fd, int access);
 ncclResult_t wrap_ibv_dereg_mr(struct ibv_mr *mr);
+ncclResult_t wrap_ibv_alloc_dm(struct ibv_dm **ret, struct ibv_context *context, struct ibv_alloc_dm_attr *attr);
+ncclResult_t wrap_ibv_free_dm(struct ibv_dm *dm);
+ncclResult_t wrap_ibv_reg_dm_mr(struct ibv_mr **ret, struct ibv_pd *pd, struct ibv_dm *dm, uint64_t dm_offset, size_t length, unsigned int access);
+static inline ncclResult_t wrap_ibv_memcpy_from_dm(void *host_addr, struct ibv_dm *dm, uint64_t dm_offset, size_t length) {
+  int ret = dm->memcpy_from_dm(host_addr, dm, dm_offset, length);
+  if (ret != IBV_SUCCESS) {
+    WARN("ibv_memcpy_from_dm() failed with error %s", strerror(ret));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+ncclResult_t wrap_ibv_advise_mr(struct ibv_pd *pd, enum ibv_advise_mr_advice advice, uint32_t flags, struct ibv_sge *sg_list, uint32_t num_sge);
 ncclResult_t wrap_ibv_create_comp_channel(struct ibv_comp_channel **ret, struct ibv_context *context);
 ncclResult_t wrap_ibv_destroy_comp_channel(struct ibv_comp_channel *channel);
 ncclResult_t wrap_ibv_create_cq(struct ibv_cq **ret, struct ibv_context *context, int cqe, void *cq_context, struct ibv_comp_channel *channel, int comp_vector);
@@ -85,6 +97,24 @@ static inline ncclResult_t wrap_ibv_post_recv(struct ibv_qp *qp, struct ibv_recv
   return ncclSuccess;
 }
 
+ncclResult_t wrap_ibv_create_srq(struct ibv_srq **ret, struct ibv_pd *pd, struct ibv_srq_init_attr *srq_init_attr);
+ncclResult_t wrap_ibv_destroy_srq(struct ibv_srq *srq);
+
+static inline ncclResult_t wrap_ibv_post_srq_recv(struct ibv_srq *srq, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr) {
+  int ret = srq->context->ops.post_srq_recv(srq, wr, bad_wr); /*returns 0 on success, or the value of errno on failure (which indicates the failure reason)*/
+  if (ret != IBV_SUCCESS) {
+    WARN("ibv_post_srq_recv() failed with error %s", strerror(ret));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t wrap_ibv_create_ah(struct ibv_ah **ret, struct ibv_pd *pd, struct ibv_ah_attr *attr);
+ncclResult_t wrap_ibv_destroy_ah(struct ibv_ah *ah);
+ncclResult_t wrap_ibv_attach_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid);
+ncclResult_t wrap_ibv_detach_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid);
+ncclResult_t wrap_ibv_qp_to_qp_ex(struct ibv_qp_ex **ret, struct ibv_qp *qp);
+
 ncclResult_t wrap_ibv_event_type_str(char **ret, enum ibv_event_type event);
 
 #endif //End include guard
@@ -24,6 +24,8 @@ typedef enum : uint8_t {
   ncclPatternTreeUpDown,
   ncclPatternCollnetChain,
   ncclPatternCollnetDirect,
+  ncclPatternCollnetAllGather,     // One network window per rank and chunk, see coll_net.cc
+  ncclPatternCollnetReduceScatter,
   ncclPatternNvls,
   ncclPatternNvlsTree,
   ncclPatternSend,
@@ -58,6 +60,12 @@ struct ncclInfo {
   int nchunksPerLoop;
   int chunkSize;
   int channelId;
+  struct ncclAutotuneSample* autotuneSample; // Launch to time, see autotune.h
+  // Mixed precision (ncclAllReduceMixed, ncclReduceScatterMixed): the collective runs in
+  // datatype, on buffers of sendType and recvType
+  bool mixed;
+  ncclDataType_t sendType;
+  ncclDataType_t recvType;
 };
 
 inline ncclResult_t ncclInfoSetDerived(struct ncclInfo* info, int nRanks) {
@@ -116,6 +124,11 @@ struct ncclTasks {
   // at all. Technically we could probably relax this, but that would mean
   // collecting a different `ncclTasks` per graph and one for non-graph.
   struct ncclCudaGraph capturingGraph;
+  // All user streams have a high priority: collectives use the channels reserved
+  // by NCCL_PRIORITY_CHANNELS, and laneHigh when launched on the high priority lane.
+  bool priorityHigh, laneHigh;
+  // A connection was set up for this group on the regular lane
+  bool laneSync;
 };
 
 #endif
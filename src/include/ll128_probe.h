@@ -0,0 +1,24 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_LL128_PROBE_H_
+#define NCCL_LL128_PROBE_H_
+
+#include "nccl.h"
+
+// Paths checked by the LL128 self-test, see NCCL_LL128_PROBE
+#define NCCL_LL128_PROBE_HOST 0x1 // GPU stores to and loads from host memory
+#define NCCL_LL128_PROBE_PEER 0x2 // GPU stores to and loads from the memory of a peer GPU
+
+// Checks that 128-byte lines stored by cudaDev with 16-byte stores are never seen by
+// another GPU with their flag but without the rest of their data. The reader runs on a
+// peer GPU of the process, so nothing is tested when cudaDev is the only one visible.
+// *tested has the paths which could be checked, *passed those where no torn line was
+// seen. A clean run shows the path did not tear lines during the test, not that it never
+// does, so the probe is opt-in.
+ncclResult_t ncclLl128Probe(int cudaDev, int* tested, int* passed);
+
+#endif
@@ -0,0 +1,119 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_DEVICE_API_H_
+#define NCCL_DEVICE_API_H_
+
+#include "nccl.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Device-initiated communication
+ *
+ * A window is a buffer of the same size on every rank of a communicator, which
+ * user kernels can write into on other ranks and signal them, without going
+ * through a host-enqueued NCCL operation. Peers are reachable when they are
+ * on the same node and connected to this GPU through P2P (NVLink or PCI);
+ * peerBuffs[peer] is NULL for other peers.
+ *
+ * Windows are limited to such P2P peers for now: peers on other nodes, which
+ * would go through the network, and local peers NCCL only reaches through shared
+ * host memory or an intermediate GPU, cannot be accessed at all. Applications
+ * spanning nodes need regular NCCL operations to reach them.
+ *
+ * Each rank holds one 64-bit signal per peer, which only grows.
+ * ncclDevWindowSignal(w, peer, v) adds v to the signal of this rank on peer,
+ * and ncclDevWindowWait(w, peer, v) waits until the signal of peer on this
+ * rank reaches v. Data put before a signal is visible to the peer once its
+ * wait returns.
+ */
+typedef struct ncclDevWindow {
+  int rank;
+  int nRanks;
+  size_t size;
+  char** peerBuffs;       // [nRanks] window of each peer, NULL if not reachable
+  uint64_t** peerSignals; // [nRanks] signals of each peer, NULL if not reachable
+  uint64_t* signals;      // [nRanks] signals of this rank, indexed by sender
+} ncclDevWindow_t;
+
+/*
+ * Allocates a window of size bytes on every rank. This is a collective call:
+ * all ranks of comm must call it with the same size. Returns the local buffer
+ * in *buff and the device descriptor to pass to kernels in *window.
+ */
+ncclResult_t  ncclDevWindowCreate(ncclComm_t comm, size_t size, void** buff, ncclDevWindow_t** window);
+ncclResult_t pncclDevWindowCreate(ncclComm_t comm, size_t size, void** buff, ncclDevWindow_t** window);
+
+/*
+ * Frees a window. This is a collective call and must only happen when no
+ * kernel uses the window anymore on any rank.
+ */
+ncclResult_t  ncclDevWindowDestroy(ncclComm_t comm, ncclDevWindow_t* window);
+ncclResult_t pncclDevWindowDestroy(ncclComm_t comm, ncclDevWindow_t* window);
+
+/*
+ * Stream-ordered one-sided operations on a window, issued from the host.
+ *
+ * ncclPut copies bytes from src to offset in the window of peer, and ncclGet
+ * copies bytes from offset in the window of peer to dst, both with copy engines.
+ * ncclSignal raises the signal of this rank on peer by value once previous work
+ * on stream is done, and ncclWaitSignal makes stream wait until the signal of
+ * peer on this rank reaches value. No matching call is needed on the peer.
+ *
+ * Only reachable (P2P) peers can be accessed, see above; the other peers make
+ * these calls fail with ncclInvalidUsage. A given signal must be
+ * raised either through ncclSignal or through ncclDevWindowSignal, not both,
+ * and ncclSignal cannot be captured in a CUDA graph.
+ */
+ncclResult_t  ncclPut(const void* src, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t pncclPut(const void* src, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t  ncclGet(void* dst, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t pncclGet(void* dst, size_t bytes, int peer, size_t offset, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t  ncclSignal(int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t pncclSignal(int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t  ncclWaitSignal(int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t pncclWaitSignal(int peer, uint64_t value, ncclDevWindow_t* window, ncclComm_t comm, cudaStream_t stream);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+
+#if defined(__CUDACC__)
+// Copies bytes from src to offset within the window of peer. To be called by
+// all threads of the block with the same arguments.
+__device__ inline void ncclDevWindowPut(const ncclDevWindow_t* w, int peer, size_t offset, const void* src, size_t bytes) {
+  char* dst = w->peerBuffs[peer] + offset;
+  const char* s = (const char*)src;
+  if ((((uintptr_t)dst | (uintptr_t)s | bytes) & 15) == 0) {
+    for (size_t i = threadIdx.x*16; i < bytes; i += blockDim.x*16) {
+      *(int4*)(dst+i) = *(const int4*)(s+i);
+    }
+  } else {
+    for (size_t i = threadIdx.x; i < bytes; i += blockDim.x) dst[i] = s[i];
+  }
+}
+
+// Adds value to the signal of this rank on peer. Writes of the calling thread,
+// and of the threads it synchronized with (e.g. through __syncthreads() after
+// ncclDevWindowPut), are visible to the peer before the signal is.
+__device__ inline void ncclDevWindowSignal(const ncclDevWindow_t* w, int peer, uint64_t value) {
+  __threadfence_system();
+  atomicAdd((unsigned long long*)(w->peerSignals[peer] + w->rank), (unsigned long long)value);
+}
+
+// Waits until the signal of peer on this rank reaches value.
+__device__ inline void ncclDevWindowWait(const ncclDevWindow_t* w, int peer, uint64_t value) {
+  volatile uint64_t* signal = w->signals + peer;
+  while (*signal < value);
+  __threadfence_system();
+}
+#endif
+
+#endif
@@ -86,9 +86,156 @@ typedef struct {
   ncclResult_t (*closeListen)(void* listenComm);
 } ncclNet_v6_t;
 
-typedef ncclNet_v6_t ncclNet_t;
+// The net API versions adding isendv/testBatch (sochin v1) and later fields are
+// specific to this version of NCCL. They use their own version names rather than
+// the next upstream ones, whose layouts differ, so that plugins written for an
+// upstream ncclNetPlugin_v7 or later are not loaded with the wrong layout.
+typedef struct {
+  // Name of the network (mainly for logs)
+  const char* name;
+  // Initialize the network.
+  ncclResult_t (*init)(ncclDebugLogger_t logFunction);
+  // Return the number of adapters.
+  ncclResult_t (*devices)(int* ndev);
+  // Get various device properties.
+  ncclResult_t (*getProperties)(int dev, ncclNetProperties_v6_t* props);
+  // Create a receiving object and provide a handle to connect to it. The
+  // handle can be up to NCCL_NET_HANDLE_MAXSIZE bytes and will be exchanged
+  // between ranks to create a connection.
+  ncclResult_t (*listen)(int dev, void* handle, void** listenComm);
+  // Connect to a handle and return a sending comm object for that peer.
+  // This call must not block for the connection to be established, and instead
+  // should return successfully with sendComm == NULL with the expectation that
+  // it will be called again until sendComm != NULL.
+  ncclResult_t (*connect)(int dev, void* handle, void** sendComm);
+  // Finalize connection establishment after remote peer has called connect.
+  // This call must not block for the connection to be established, and instead
+  // should return successfully with recvComm == NULL with the expectation that
+  // it will be called again until recvComm != NULL.
+  ncclResult_t (*accept)(void* listenComm, void** recvComm);
+  // Register/Deregister memory. Comm can be either a sendComm or a recvComm.
+  // Type is either NCCL_PTR_HOST or NCCL_PTR_CUDA.
+  ncclResult_t (*regMr)(void* comm, void* data, int size, int type, void** mhandle);
+  /* DMA-BUF support */
+  ncclResult_t (*regMrDmaBuf)(void* comm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle);
+  ncclResult_t (*deregMr)(void* comm, void* mhandle);
+  // Asynchronous send to a peer.
+  // May return request == NULL if the call cannot be performed (or would block)
+  ncclResult_t (*isend)(void* sendComm, void* data, int size, int tag, void* mhandle, void** request);
+  // Asynchronous recv from a peer.
+  // May return request == NULL if the call cannot be performed (or would block)
+  ncclResult_t (*irecv)(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** request);
+  // Perform a flush/fence to make sure all data received with NCCL_PTR_CUDA is
+  // visible to the GPU
+  ncclResult_t (*iflush)(void* recvComm, int n, void** data, int* sizes, void** mhandles, void** request);
+  // Test whether a request is complete. If size is not NULL, it returns the
+  // number of bytes sent/received.
+  ncclResult_t (*test)(void* request, int* done, int* sizes);
+  // Close and free send/recv comm objects
+  ncclResult_t (*closeSend)(void* sendComm);
+  ncclResult_t (*closeRecv)(void* recvComm);
+  ncclResult_t (*closeListen)(void* listenComm);
+  // Post n sends to the same peer at once, in order, as n calls to isend would.
+  // The first *nPosted of them are posted and get their request; the others
+  // could not be performed and will be given again later.
+  // Optional, may be NULL.
+  ncclResult_t (*isendv)(void* sendComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted);
+  // Test n requests of the same comm at once, in order, stopping at the first
+  // one which is not complete. The first *nDone requests are complete, as if
+  // test had returned done for each of them. If sizes is not NULL, it returns
+  // the number of bytes sent/received by each of them.
+  // Optional, may be NULL.
+  ncclResult_t (*testBatch)(int n, void** requests, int* nDone, int* sizes);
+} ncclNet_sochin_v1_t;
+
+typedef struct {
+  // Name of the network (mainly for logs)
+  const char* name;
+  // Initialize the network.
+  ncclResult_t (*init)(ncclDebugLogger_t logFunction);
+  // Return the number of adapters.
+  ncclResult_t (*devices)(int* ndev);
+  // Get various device properties.
+  ncclResult_t (*getProperties)(int dev, ncclNetProperties_v6_t* props);
+  // Create a receiving object and provide a handle to connect to it. The
+  // handle can be up to NCCL_NET_HANDLE_MAXSIZE bytes and will be exchanged
+  // between ranks to create a connection.
+  ncclResult_t (*listen)(int dev, void* handle, void** listenComm);
+  // Connect to a handle and return a sending comm object for that peer.
+  // This call must not block for the connection to be established, and instead
+  // should return successfully with sendComm == NULL with the expectation that
+  // it will be called again until sendComm != NULL.
+  ncclResult_t (*connect)(int dev, void* handle, void** sendComm);
+  // Finalize connection establishment after remote peer has called connect.
+  // This call must not block for the connection to be established, and instead
+  // should return successfully with recvComm == NULL with the expectation that
+  // it will be called again until recvComm != NULL.
+  ncclResult_t (*accept)(void* listenComm, void** recvComm);
+  // Register/Deregister memory. Comm can be either a sendComm or a recvComm.
+  // Type is either NCCL_PTR_HOST or NCCL_PTR_CUDA. Size can go beyond 2GB.
+  ncclResult_t (*regMr)(void* comm, void* data, size_t size, int type, void** mhandle);
+  /* DMA-BUF support */
+  ncclResult_t (*regMrDmaBuf)(void* comm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle);
+  ncclResult_t (*deregMr)(void* comm, void* mhandle);
+  // Asynchronous send to a peer.
+  // May return request == NULL if the call cannot be performed (or would block)
+  ncclResult_t (*isend)(void* sendComm, void* data, int size, int tag, void* mhandle, void** request);
+  // Asynchronous recv from a peer.
+  // May return request == NULL if the call cannot be performed (or would block)
+  ncclResult_t (*irecv)(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** request);
+  // Perform a flush/fence to make sure all data received with NCCL_PTR_CUDA is
+  // visible to the GPU
+  ncclResult_t (*iflush)(void* recvComm, int n, void** data, int* sizes, void** mhandles, void** request);
+  // Test whether a request is complete. If size is not NULL, it returns the
+  // number of bytes sent/received.
+  ncclResult_t (*test)(void* request, int* done, int* sizes);
+  // Close and free send/recv comm objects
+  ncclResult_t (*closeSend)(void* sendComm);
+  ncclResult_t (*closeRecv)(void* recvComm);
+  ncclResult_t (*closeListen)(void* listenComm);
+  // Post n sends to the same peer at once, in order, as n calls to isend would.
+  // The first *nPosted of them are posted and get their request; the others
+  // could not be performed and will be given again later.
+  // Optional, may be NULL.
+  ncclResult_t (*isendv)(void* sendComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted);
+  // Test n requests of the same comm at once, in order, stopping at the first
+  // one which is not complete. The first *nDone requests are complete, as if
+  // test had returned done for each of them. If sizes is not NULL, it returns
+  // the number of bytes sent/received by each of them.
+  // Optional, may be NULL.
+  ncclResult_t (*testBatch)(int n, void** requests, int* nDone, int* sizes);
+  // Same as irecv, and in addition once the data of receive i is visible in
+  // memory, the network itself writes values[i] to the 64-bit signals[i], which
+  // lies in host memory registered with regMr as signalMhandles[i]. NCCL uses this
+  // to let the NIC update the tail counter the GPU waits on, without waiting for
+  // the proxy to see the completion. The request still needs to be tested.
+  // Optional, may be NULL.
+  ncclResult_t (*irecvSignal)(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles,
+      uint64_t** signals, uint64_t* values, void** signalMhandles, void** request);
+  // Post the receives of several steps at once, in order, as nRecvs calls to
+  // irecv would. Receive r has n[r] buffers, taken in turn from data, sizes,
+  // tags and mhandles. The first *nPosted receives are posted and get their
+  // request; the others will be given again later. Lets the network post one
+  // descriptor for several steps, e.g. with hardware tag matching or
+  // multi-packet receive buffers.
+  // Optional, may be NULL.
+  ncclResult_t (*irecvv)(void* recvComm, int nRecvs, int* n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted);
+} ncclNet_sochin_v2_t;
 
-#define NCCL_PLUGIN_SYMBOL ncclNetPlugin_v6
+typedef ncclNet_sochin_v2_t ncclNet_t;
+
+#define NCCL_PLUGIN_SYMBOL ncclNetPlugin_sochin_v2
+
+// The collective network API with iallgather and ireducescatter is specific to this
+// version of NCCL, so it uses its own version name rather than the next upstream
+// one: plugins written for an upstream ncclCollNetPlugin_v7 are not mistaken for it.
+
+// Part of a buffer given to a collective network operation
+typedef struct {
+  void* mhandle;
+  void* address;
+  uint32_t size;
+} ncclNetSGE_sochin_v1_t;
 
 typedef struct {
   // Name of the collective network (mainly for logs)
@@ -119,6 +266,19 @@ typedef struct {
   // May return request == NULL if the call cannot be performed (or would block).
   ncclResult_t (*iallreduce)(void* collComm, void* sendData, void* recvData, int count,
       ncclDataType_t dataType, ncclRedOp_t redOp, void* sendMhandle, void* recvMhandle, void** request);
+  // Performs an asynchronous allgather. Each rank contributes bytesPerRank bytes, and the contribution
+  // of rank r lands at offset r*bytesPerRank of the gathered vector. Only the window [windowOffset,
+  // windowOffset+windowBytes) of the gathered vector is received, laid out over recvParts in order.
+  // sendData is only read on ranks whose contribution overlaps the window.
+  ncclResult_t (*iallgather)(void* collComm, void* sendData, int nRecvParts, ncclNetSGE_sochin_v1_t* recvParts,
+      size_t bytesPerRank, size_t windowOffset, size_t windowBytes, void* sendMhandle, void** request);
+  // Performs an asynchronous reduce-scatter. Each rank contributes the vector laid out over sendParts,
+  // and rank r receives the reduction of [r*bytesPerRank, (r+1)*bytesPerRank) into recvData. Only the
+  // window [windowOffset, windowOffset+windowBytes) of the vector is exchanged; recvData is only
+  // written on the ranks whose part overlaps the window.
+  ncclResult_t (*ireducescatter)(void* collComm, int nSendParts, ncclNetSGE_sochin_v1_t* sendParts, void* recvData,
+      size_t bytesPerRank, size_t windowOffset, size_t windowBytes, ncclDataType_t dataType, ncclRedOp_t redOp,
+      void* recvMhandle, void** request);
   // Perform a flush/fence to make sure all data received with NCCL_PTR_CUDA is
   // visible to the GPU
   ncclResult_t (*iflush)(void* collComm, void* data, int size, void* mhandle, void** request);
@@ -128,11 +288,52 @@ typedef struct {
   // Close and free collective comm objects
   ncclResult_t (*closeColl)(void* collComm);
   ncclResult_t (*closeListen)(void* listenComm);
-} ncclCollNet_v6_t;
+} ncclCollNet_sochin_v1_t;
+
+typedef ncclCollNet_sochin_v1_t ncclCollNet_t;
 
-typedef ncclCollNet_v6_t ncclCollNet_t;
+#define NCCL_COLLNET_PLUGIN_SYMBOL ncclCollNetPlugin_sochin_v1
 
-#define NCCL_COLLNET_PLUGIN_SYMBOL ncclCollNetPlugin_v6
+// v6 struct for backwards compatibility
+typedef struct {
+  // Name of the collective network (mainly for logs)
+  const char* name;
+  // Initialize the collective network.
+  ncclResult_t (*init)(ncclDebugLogger_t logFunction);
+  // Return the number of adapters capable of doing collective operations.
+  // If ndev returns 0, all other functions might be set to NULL.
+  ncclResult_t (*devices)(int* ndev);
+  // Get various device properties.
+  ncclResult_t (*getProperties)(int dev, ncclNetProperties_v6_t* props);
+  // Create a receiving object and provide a handle to connect to it. The
+  // handle can be up to NCCL_NET_HANDLE_MAXSIZE bytes and will be exchanged
+  // between ranks to create connections.
+  ncclResult_t (*listen)(int dev, void* handle, void** listenComm);
+  // Create a group for collective operations. handles have been created
+  // using listen() above. rank indicates caller's rank in the collective network.
+  ncclResult_t (*connect)(void* handles[], int nranks, int rank, void* listenComm, void** collComm);
+  // Returns whether a reduction operation on a data type is supported.
+  // 1 for supported, 0 otherwise.
+  ncclResult_t (*reduceSupport)(ncclDataType_t dataType, ncclRedOp_t redOp, int* supported);
+  // Register/Deregister memory. Type is either NCCL_PTR_HOST or NCCL_PTR_CUDA.
+  ncclResult_t (*regMr)(void* collComm, void* data, int size, int type, void** mhandle);
+  /* DMA-BUF support */
+  ncclResult_t (*regMrDmaBuf)(void* collComm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle);
+  ncclResult_t (*deregMr)(void* collComm, void* mhandle);
+  // Performs an asynchronous allreduce operation on the collective group.
+  // May return request == NULL if the call cannot be performed (or would block).
+  ncclResult_t (*iallreduce)(void* collComm, void* sendData, void* recvData, int count,
+      ncclDataType_t dataType, ncclRedOp_t redOp, void* sendMhandle, void* recvMhandle, void** request);
+  // Perform a flush/fence to make sure all data received with NCCL_PTR_CUDA is
+  // visible to the GPU
+  ncclResult_t (*iflush)(void* collComm, void* data, int size, void* mhandle, void** request);
+  // Test whether a request is complete. If size is not NULL, it returns the
+  // number of bytes sent/received.
+  ncclResult_t (*test)(void* request, int* done, int* size);
+  // Close and free collective comm objects
+  ncclResult_t (*closeColl)(void* collComm);
+  ncclResult_t (*closeListen)(void* listenComm);
+} ncclCollNet_v6_t;
 
 // v5 struct for backwards compatibility
 typedef struct {
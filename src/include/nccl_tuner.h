@@ -0,0 +1,61 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_TUNER_H_
+#define NCCL_TUNER_H_
+
+#include "nccl.h"
+#include "nccl_net.h"
+#include <stddef.h>
+
+// Collective types, algorithms and protocols, in the order NCCL uses internally.
+#define NCCL_TUNER_COLL_BROADCAST 0
+#define NCCL_TUNER_COLL_REDUCE 1
+#define NCCL_TUNER_COLL_ALLGATHER 2
+#define NCCL_TUNER_COLL_REDUCESCATTER 3
+#define NCCL_TUNER_COLL_ALLREDUCE 4
+
+#define NCCL_TUNER_NUM_ALGORITHMS 6 // Tree/Ring/CollNetDirect/CollNetChain/NVLS/NVLSTree
+#define NCCL_TUNER_NUM_PROTOCOLS 3  // LL/LL128/Simple
+
+typedef struct {
+  // Name of the tuner
+  const char* name;
+
+  // Initializes tuner states for a communicator.
+  // nRanks: number of ranks in the communicator.
+  // nNodes: number of nodes in the communicator.
+  // logFunction: a logFunction can be useful to integrate logging together with NCCL core.
+  // context: opaque tuner state, passed back to getCollInfo and destroy.
+  ncclResult_t (*init)(size_t nRanks, size_t nNodes, ncclDebugLogger_t logFunction, void** context);
+
+  // Gets info (algo, protocol, number of channels) for a given collective.
+  // Inputs:
+  //   - collType: one of NCCL_TUNER_COLL_*
+  //   - nBytes: total size of the collective
+  //   - numPipeOps: number of operations aggregated in the same kernel
+  //   - collCostTable: estimated time in microseconds of each algorithm/protocol according to
+  //     NCCL's model, negative when the combination is not available. The tuner may modify it ;
+  //     NCCL then picks the lowest non-negative entry.
+  // Outputs (left untouched to keep NCCL's choice):
+  //   - algorithm: selected algorithm, -1 by default
+  //   - protocol: selected protocol, -1 by default
+  //   - nChannels: number of channels (hence SMs) to use, 0 by default
+  //
+  // The tuner must return the same result on all ranks of a communicator.
+  ncclResult_t (*getCollInfo)(void* context, int collType, size_t nBytes, int numPipeOps,
+                              float collCostTable[][NCCL_TUNER_NUM_PROTOCOLS],
+                              int* algorithm, int* protocol, int* nChannels);
+
+  // Terminates the tuner for a communicator and cleans up any resources the tuner allocated.
+  ncclResult_t (*destroy)(void* context);
+} ncclTuner_v1_t;
+
+typedef ncclTuner_v1_t ncclTuner_t;
+
+#define NCCL_TUNER_PLUGIN_SYMBOL "ncclTunerPlugin_v1"
+
+#endif
@@ -21,6 +21,28 @@ int ncclNetVersion(struct ncclComm* comm);
 // Test whether the current GPU support GPU Direct RDMA.
 ncclResult_t ncclGpuGdrSupport(struct ncclComm* comm, int* gdrSupport);
 
+// Batched isend and test (ncclNet_sochin_v1_t), falling back to one call per request
+// for networks which do not provide them.
+static inline ncclResult_t ncclNetIsendv(ncclNet_t* net, void* sendComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** requests, int* nPosted) {
+  if (net->isendv) return net->isendv(sendComm, n, data, sizes, tags, mhandles, requests, nPosted);
+  for (*nPosted = 0; *nPosted < n; (*nPosted)++) {
+    int i = *nPosted;
+    NCCLCHECK(net->isend(sendComm, data[i], sizes[i], tags[i], mhandles[i], requests+i));
+    if (requests[i] == NULL) break;
+  }
+  return ncclSuccess;
+}
+
+static inline ncclResult_t ncclNetTestBatch(ncclNet_t* net, int n, void** requests, int* nDone, int* sizes) {
+  if (net->testBatch) return net->testBatch(n, requests, nDone, sizes);
+  for (*nDone = 0; *nDone < n; (*nDone)++) {
+    int done, i = *nDone;
+    NCCLCHECK(net->test(requests[i], &done, sizes ? sizes+i : NULL));
+    if (!done) break;
+  }
+  return ncclSuccess;
+}
+
 extern ncclNet_t ncclNetIb;
 extern ncclNet_t ncclNetSocket;
 
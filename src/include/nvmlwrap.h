@@ -179,6 +179,13 @@ typedef struct nvmlFieldValue_st
 /* End of nvml.h */
 #endif // NCCL_NVML_DIRECT
 
+// NVLink-C2C fields, missing from older nvml.h
+#ifndef NVML_FI_DEV_C2C_LINK_COUNT
+#define NVML_FI_DEV_C2C_LINK_COUNT                    170 //!< Number of C2C links present on the device
+#define NVML_FI_DEV_C2C_LINK_GET_STATUS               171 //!< C2C link status, 1 if active. Link ID in scopeId
+#define NVML_FI_DEV_C2C_LINK_GET_MAX_BW               172 //!< C2C link speed in MB/s. Link ID in scopeId
+#endif
+
 constexpr int ncclNvmlMaxDevices = 32;
 struct ncclNvmlDeviceInfo {
   nvmlDevice_t handle;
@@ -27,9 +27,24 @@
 #define NVTX_SID_Reduce        8
 #define NVTX_SID_Send          9
 #define NVTX_SID_Recv          10
+// Internal ranges, see enqueue.cc and transport/net.cc
+#define NVTX_SID_LaunchPrepare 12
+#define NVTX_SID_CollPlanned   13 // mark
+#define NVTX_SID_KernelLaunch  14
+#define NVTX_SID_UploadWork    15 // same schema as NVTX_SID_KernelLaunch
+#define NVTX_SID_HostCallback  16 // same schema as NVTX_SID_KernelLaunch
+#define NVTX_SID_UploadProxyOps 17 // same schema as NVTX_SID_KernelLaunch
+#define NVTX_SID_ProxyOp       18 // start/end range
+#define NVTX_SID_NetSend       19
+#define NVTX_SID_NetRecv       20 // same schema as NVTX_SID_NetSend
+// 11, 21 and 22 are the payload entries below
+#define NVTX_SID_AllToAll      23
 
 // Define static schema ID for the reduction operation.
 #define NVTX_PAYLOAD_ENTRY_NCCL_REDOP 11 + NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START
+// Static schema IDs of the algorithm and protocol enums.
+#define NVTX_PAYLOAD_ENTRY_NCCL_ALGO 21 + NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START
+#define NVTX_PAYLOAD_ENTRY_NCCL_PROTO 22 + NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START
 
 extern const nvtxDomainHandle_t ncclNvtxDomainHandle;
 
@@ -80,6 +95,40 @@ class payload_schema {
   ::nvtx3::v1::event_attributes const nvtx3_func_attr__{nvtx3_func_name__, nvtx3_bpl__}; \
   ::nvtx3::v1::scoped_range_in<nccl_domain> const nvtx3_range__{nvtx3_func_attr__};
 
+// Same as NVTX3_FUNC_WITH_PARAMS for a scope which is not a whole function. The
+// range is named after ID, and several can be used in a function if each is in its own scope.
+#define NVTX3_RANGE_WITH_PARAMS(ID, S, P) \
+  static const payload_schema nvtx3_schema__{S, std::extent<decltype(S)>::value, \
+    NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, #ID}; \
+  static ::nvtx3::v1::registered_string_in<nccl_domain> const nvtx3_range_name__{#ID}; \
+  nvtxPayloadData_t nvtx3_bpl__[] = { \
+    {NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, sizeof(P), &(P)}}; \
+  ::nvtx3::v1::event_attributes const nvtx3_range_attr__{nvtx3_range_name__, nvtx3_bpl__}; \
+  ::nvtx3::v1::scoped_range_in<nccl_domain> const nvtx3_range__{nvtx3_range_attr__};
+
+// Instantaneous event with parameters, named after ID.
+#define NVTX3_MARK_WITH_PARAMS(ID, S, P) do { \
+  static const payload_schema nvtx3_schema__{S, std::extent<decltype(S)>::value, \
+    NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, #ID}; \
+  static ::nvtx3::v1::registered_string_in<nccl_domain> const nvtx3_mark_name__{#ID}; \
+  nvtxPayloadData_t nvtx3_bpl__[] = { \
+    {NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, sizeof(P), &(P)}}; \
+  ::nvtx3::v1::mark_in<nccl_domain>(::nvtx3::v1::event_attributes{nvtx3_mark_name__, nvtx3_bpl__}); \
+} while (0)
+
+// Range which does not follow a scope, e.g. a proxy operation progressed over many calls.
+// Sets the nvtxRangeId_t H, to be passed to NVTX3_RANGE_END.
+#define NVTX3_RANGE_START_WITH_PARAMS(ID, S, P, H) do { \
+  static const payload_schema nvtx3_schema__{S, std::extent<decltype(S)>::value, \
+    NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, #ID}; \
+  static ::nvtx3::v1::registered_string_in<nccl_domain> const nvtx3_range_name__{#ID}; \
+  nvtxPayloadData_t nvtx3_bpl__[] = { \
+    {NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, sizeof(P), &(P)}}; \
+  (H) = ::nvtx3::v1::start_range_in<nccl_domain>(::nvtx3::v1::event_attributes{nvtx3_range_name__, nvtx3_bpl__}).get_value(); \
+} while (0)
+
+#define NVTX3_RANGE_END(H) ::nvtx3::v1::end_range_in<nccl_domain>(::nvtx3::v1::range_handle{H})
+
 extern void initNvtxRegisteredEnums();
 
 #endif
@@ -25,5 +25,17 @@ typedef union {
 ncclResult_t ncclP2pAllocateShareableBuffer(size_t size, ncclIpcDesc *ipcDesc, void **ptr);
 ncclResult_t ncclP2pFreeShareableBuffer(ncclIpcDesc *ipcDesc);
 ncclResult_t ncclP2pImportShareableBuffer(struct ncclComm *comm, int tpPeer, size_t size, ncclIpcDesc *ipcDesc, void **devMemPtr);
+// Map the shareable buffer of a local peer, at peerPtr in its address space. Buffers
+// of the same process are used as is; otherwise *imported is set and the mapping
+// must be released with ncclP2pUnmapPeerBuffer.
+ncclResult_t ncclP2pMapPeerBuffer(struct ncclComm* comm, int peer, size_t size, ncclIpcDesc* ipcDesc, void* peerPtr, void** ptr, int* imported);
+ncclResult_t ncclP2pUnmapPeerBuffer(void* ptr);
+
+// Request of ncclProxyMsgRegister on a P2P connection to the proxy of a local
+// peer, answered with the mapping of the buffer on that peer or NULL.
+// ncclProxyMsgDeregister takes the mapping.
+struct ncclP2pRegisterReq {
+  cudaIpcMemHandle_t ipc;
+};
 
 #endif
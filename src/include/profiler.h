@@ -31,7 +31,14 @@ enum ncclProxyProfileState {
   ncclProxyProfileAppendEnd = 25
 };
 
+// Enabled at runtime with NCCL_PROXY_PROFILE=<file>. Must be called from proxy progress threads.
 ncclResult_t ncclProfilingRecord(struct ncclProxyArgs* args, int sub, int step, int state);
+// Flush and release the events recorded by the calling thread.
 void ncclProfilingDump();
 
+// Whether NCCL_PROXY_PROFILE is set and the output file could be opened.
+bool ncclProfilingEnabled();
+// Write out the device timeline events (NCCL_DEVICE_TIMELINE) the GPU recorded since the last call.
+void ncclProfilingDeviceTimeline(struct ncclComm* comm);
+
 #endif
@@ -25,20 +25,22 @@ static_assert(NCCL_MAX_WORK_ELEMENTS <= MAXCHANNELS, "Not enough sub space for m
 
 struct ncclProxyOp {
   struct ncclProxyConnection* connection;
-  int channelId;
-  int nsteps;
-  ssize_t nbytes;
+  ssize_t nbytes; // Total size of buffer when reg is set
+  uint64_t opCount;
   int root;
   int next;
-
-  uint64_t opCount;
-  int sliceSteps;
-  int chunkSteps;
+  int nsteps;
   int chunkSize;
+
+  uint8_t sliceSteps;
+  uint8_t chunkSteps;
+  uint8_t channelId;
   uint8_t /*ncclDataType_t*/ dtype;
   uint8_t /*ncclDevRedOp_t*/ redOp;
   uint8_t /*ncclPattern_t*/ pattern;
   uint8_t protocol;
+  uint8_t reg; // Registration slot+1 of buffer on the connection, 0 if not registered
+  uint8_t* buffer; // User buffer used directly by the network when reg is set
 
   union {
     uint64_t unused;
@@ -63,8 +65,23 @@ struct ncclProxySubArgs {
   uint64_t transmitted;
   uint64_t done;
   uint64_t end;
-  void* requests[NCCL_STEPS];
-  void* profilingEvents[NCCL_STEPS];
+  // One entry per step of the connection's pipeline, indexed modulo nSteps. They stay
+  // with the pooled args and only grow, to the deepest connection which used them.
+  int nSteps;
+  int maxSteps;
+  void** requests;
+  void** profilingEvents;
+  double profilingBegin;
+  int* stepBytes; // Bytes in flight per step, for runtime counters
+  uint64_t* stepNs; // clockNano() when the step was posted, for NIC throughput
+  uint64_t lastDoneNs;
+  uint64_t nvtxRange; // nvtxRangeId_t of the NVTX range covering the operation
+
+  // Registered user buffer, sent from or received into directly
+  int reg;
+  int chunkSize;
+  uint8_t* buffer;
+  void* mhandle;
 };
 
 struct ncclProxyArgs {
@@ -86,10 +103,17 @@ struct ncclProxyArgs {
 
   int idle;
 
+  // Proxy watchdog : progress counters when they last moved, and when that was
+  uint64_t watchdogProgress;
+  uint64_t watchdogNs; // 0 until the first check
+  int watchdogReported;
+
   // Element linking
-  struct ncclProxyArgs* next;
+  struct ncclProxyArgs* next; // Free list
   struct ncclProxyArgs* nextPeer;
   struct ncclProxyArgs** proxyAppendPtr;
+  int activeGroup; // Position in ncclProxyProgressState::activeOps
+  int activeIndex;
 };
 #define NCCL_MAX_NETDEVS 128
 
@@ -98,11 +122,23 @@ struct ncclProxyArgs {
 // Otherwise we'd be unable to post half of them to free new elements.
 #define MAX_OPS_PER_PEER (2*MAXCHANNELS*NCCL_MAX_WORK_ELEMENTS_P2P)
 #define NCCL_MAX_LOCAL_RANKS 64
+// Chains of ops posted by one local rank and not yet taken by the progress
+// thread. Each chain holds at least one of the MAX_OPS_PER_PEER ops of that
+// rank, so the ring cannot overflow.
+struct ncclProxyPostRing {
+  volatile uint64_t tail; // Written by the posting rank
+  char pad1[64-sizeof(uint64_t)];
+  volatile uint64_t head; // Written by the progress thread
+  char pad2[64-sizeof(uint64_t)];
+  int chains[MAX_OPS_PER_PEER][2]; // First and last op of each chain
+};
+
 struct ncclProxyOpsPool {
   struct ncclProxyOp ops[MAX_OPS_PER_PEER*NCCL_MAX_LOCAL_RANKS];
-  volatile int nextOps;
-  volatile int nextOpsEnd;
+  struct ncclProxyPostRing posted[NCCL_MAX_LOCAL_RANKS];
   volatile int freeOps[NCCL_MAX_LOCAL_RANKS];
+  // Only used to sleep when there is nothing to progress
+  volatile int sleeping;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
 };
@@ -123,6 +159,8 @@ struct ncclProxySharedP2p {
   char* hostBuff;
   // CUDA IPC
   ncclIpcDesc ipcDesc;
+  // Per-channel bitmask of the slots in use when slots are handed out on demand
+  uint32_t* slotMask;
   struct ncclProxyArgs* proxyAppend[MAXCHANNELS]; // Separate send and recv
 };
 
@@ -139,6 +177,17 @@ struct ncclSharedNetComms {
 };
 
 struct ncclProxyPool;
+struct ncclProxyShard;
+// Active ops are kept in dense arrays, one per progress function, so that the
+// progress loop calls the same function back to back and removes ops in O(1).
+#define NCCL_PROXY_MAX_PROGRESS_FUNCS 8
+struct ncclProxyActiveOps {
+  proxyProgressFunc_t progress;
+  struct ncclProxyArgs** ops;
+  int count;
+  int size;
+};
+
 struct ncclProxyProgressState {
   // Used by main threads to send work to progress thread
   struct ncclProxyOpsPool* opsPool;
@@ -149,10 +198,39 @@ struct ncclProxyProgressState {
   bool stop;
   struct ncclProxyPeer** localPeers;
   struct ncclSharedNetComms* netComms[NCCL_MAX_NETDEVS];
-  struct ncclProxyArgs* active;
+  struct ncclProxyActiveOps activeOps[NCCL_PROXY_MAX_PROGRESS_FUNCS];
+  int nActiveFuncs;
+  int nActive; // Ops in activeOps, not counting the nextPeer chains
   struct ncclProxyArgs* pool;
   struct ncclProxyPool* pools;
   int nextOps;
+  uint64_t idleLoops; // Progress loops which found no active or posted operation
+
+  // Extra progress threads (NCCL_PROXY_PROGRESS_THREADS). Ops of channel c go to
+  // shards[c%(nShards+1)-1], the others stay on this thread.
+  int nShards;
+  struct ncclProxyShard* shards;
+  struct ncclProxyShardOp* shardFreeOps; // Main progress thread only
+};
+
+// Copy of a posted op handed from the main progress thread to a shard
+struct ncclProxyShardOp {
+  struct ncclProxyOp op;
+  struct ncclProxyShardOp* next;
+};
+
+struct ncclProxyShard {
+  // Only active, pool, pools and stop are used
+  struct ncclProxyProgressState state;
+  struct ncclProxyState* proxyState;
+  int index;
+  bool active; // Has ops to progress, read by the main progress thread to count idle loops
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Guarded by mutex
+  struct ncclProxyShardOp* posted; // Oldest first
+  struct ncclProxyShardOp* postedEnd;
+  struct ncclProxyShardOp* freeOps; // Consumed ops for the main progress thread to reuse
 };
 
 // Expected proxy response fifo
@@ -181,6 +259,8 @@ struct ncclProxyLocalPeer {
   int asyncOpCounter;
 };
 
+struct ncclProxyProgressGroup;
+
 struct ncclProxyState {
   int refCount;
   int tpRank;
@@ -196,6 +276,10 @@ struct ncclProxyState {
   ncclNet_t* ncclNet;
   ncclCollNet_t* ncclCollNet;
   volatile uint32_t* abortFlag;
+  cpu_set_t affinity; // Empty to inherit the affinity of the creating thread
+  // Network send pacing (ncclConfig_t netBwLimit, in MB/s), see ncclProxyPaceReady
+  uint64_t netBwLimit;
+  uint64_t paceNs;
   // Service thread
   pthread_t thread;
   struct ncclSocket* listenSock;
@@ -211,9 +295,14 @@ struct ncclProxyState {
 
   // Progress thread
   struct ncclProxyProgressState progressState;
+  // Thread shared with the other communicators on the GPU (NCCL_PROXY_SHARED_PROGRESS)
+  struct ncclProxyProgressGroup* progressGroup;
 
   // Queue of expected responses from the proxy
   struct ncclExpectedProxyResponse* expectedResponses;
+
+  // Runtime counters
+  struct ncclProxyStats* stats;
 };
 
 enum proxyConnectState {
@@ -235,6 +324,8 @@ struct ncclProxyConnection {
   void* transportResources;
   proxyConnectState state;
   struct ncclCollNetSharedRes* collNet;
+  int64_t memDevice, memHost; // Buffers of the connection, see ncclProxyConnectionMem
+  int nSteps; // Deepest pipeline of the connection, NCCL_STEPS unless the transport says otherwise
 };
 
 typedef ncclResult_t (*threadFunc_t)(struct ncclProxyArgs*);
@@ -248,6 +339,9 @@ enum proxyMode {
 ncclResult_t ncclProxySaveOp(struct ncclComm* comm, struct ncclProxyOp* proxyOp, bool *justInquire);
 ncclResult_t ncclProxyComputeP2p(struct ncclInfo* info, struct ncclProxyOp* proxyOp);
 ncclResult_t ncclProxyStart(struct ncclComm* comm);
+// Network send pacing : whether sends can be posted now, then the bytes posted
+bool ncclProxyPaceReady(struct ncclProxyState* proxyState);
+void ncclProxyPaceCharge(struct ncclProxyState* proxyState, size_t bytes);
 ncclResult_t ncclProxyInit(struct ncclComm* comm, struct ncclSocket* sock, union ncclSocketAddress* peerAddresses);
 ncclResult_t ncclProxyCreate(struct ncclComm* comm);
 ncclResult_t ncclProxyConnect(struct ncclComm* comm, int transport, int send, int proxyRank, struct ncclProxyConnector* proxyConn);
@@ -261,6 +355,16 @@ enum ncclProxyMsgType {
   ncclProxyMsgAbort = 7,
   ncclProxyMsgStop = 8,
   ncclProxyMsgConvertFd = 9, // cuMem API support (UDS)
+  ncclProxyMsgFree = 10, // Release the resources of a single connection
+  ncclProxyMsgRegister = 11, // Register a user buffer with the network, see register.h
+  ncclProxyMsgDeregister = 12,
+};
+
+// Request of ncclProxyMsgRegister, answered with the registration slot or -1.
+// ncclProxyMsgDeregister takes the slot.
+struct ncclProxyRegisterReq {
+  void* buff;
+  size_t size;
 };
 
 // This function is called by a client of the proxy that needs to invoke any of the non-progress proxyOp types
@@ -272,6 +376,19 @@ ncclResult_t ncclProxyCallAsync(struct ncclComm* comm, struct ncclProxyConnector
 ncclResult_t ncclProxyCallBlocking(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int type, void* reqBuff, int reqSize, void* respBuff, int respSize);
 ncclResult_t ncclPollProxyResponse(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, void* respBuff, void* opId);
 
+// Like ncclProxyCallBlocking(), but only sends the request. The response is written to respBuff, which must
+// stay valid, by ncclProxyCallDeferredWait(), which gathers all deferred calls of the communicator at once.
+ncclResult_t ncclProxyCallDeferred(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int type, void* reqBuff, int reqSize, void* respBuff, int respSize);
+ncclResult_t ncclProxyCallDeferredWait(struct ncclComm* comm);
+
+struct ncclProxyDeferredCall {
+  struct ncclProxyConnector* proxyConn;
+  void* respBuff;
+  void* opId;
+  int type;
+  struct ncclProxyDeferredCall* next;
+};
+
 ncclResult_t ncclProxyClientConvertFdBlocking(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int fd, int* convertedFd);
 
 ncclResult_t ncclProxyStop(struct ncclComm* comm);
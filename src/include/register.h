@@ -0,0 +1,69 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_REGISTER_H_
+#define NCCL_REGISTER_H_
+
+#include "nccl.h"
+#include "proxy.h"
+
+// Registration of a user buffer on one network connection, done lazily the
+// first time an operation uses the buffer on that connection.
+struct ncclRegConn {
+  struct ncclProxyConnector proxyConn;
+  int slot; // -1 if the transport could not register the buffer
+};
+
+// Mapping of a user buffer in the address space of a local peer in another
+// process, made lazily by the proxy of that peer.
+struct ncclRegPeer {
+  int peer;
+  uintptr_t base; // CUDA allocation holding the buffer
+  size_t size;
+  void* peerBase; // Mapping of base on the peer, NULL if it could not be mapped
+};
+
+struct ncclReg {
+  struct ncclReg* next;
+  uintptr_t addr; // Page aligned
+  size_t size;
+  int nConns;
+  int maxConns;
+  struct ncclRegConn* conns;
+  // Binding to an NVLS multicast object, see ncclNvlsRegisterBuffers
+  int nvlsState; // 0 not tried yet, 1 bound, -1 cannot be bound
+  struct ncclNvlsReg* nvls;
+  int nPeers;
+  int maxPeers;
+  struct ncclRegPeer* peers;
+  // For allocations of ncclMemAlloc registered the first time an operation uses them, 0 otherwise
+  uint64_t memId;
+};
+
+// Number of live ncclMemAlloc allocations, which every communicator registers on first use
+extern int ncclMemAllocCount;
+// Whether ncclRegLookup can find anything
+bool ncclRegAny(struct ncclComm* comm);
+
+// Returns in *reg the registration holding [data, data+size), registering the allocation
+// it belongs to if it came from ncclMemAlloc, or NULL.
+ncclResult_t ncclRegLookup(struct ncclComm* comm, const void* data, size_t size, struct ncclReg** reg);
+
+struct ncclConnector;
+
+// Returns in *slot the registration of [data, data+size) on the net connector,
+// or -1 if the buffer was not registered with ncclCommRegister or ncclMemAlloc.
+ncclResult_t ncclRegFindNet(struct ncclComm* comm, struct ncclConnector* connector, const void* data, size_t size, int* slot);
+// Returns in *peerPtr the address of [data, data+size) in the address space of
+// local peer in another process, or NULL if the buffer was not registered or cannot
+// be shared with that peer.
+ncclResult_t ncclRegFindP2p(struct ncclComm* comm, int peer, const void* data, size_t size, void** peerPtr);
+// Forgets registrations on a connector about to be freed, the proxy releases them with the connection.
+ncclResult_t ncclRegConnFree(struct ncclComm* comm, struct ncclConnector* connector);
+// Frees the registrations the application did not deregister
+ncclResult_t ncclRegFreeAll(struct ncclComm* comm);
+
+#endif
@@ -0,0 +1,16 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_REQUEST_H_
+#define NCCL_REQUEST_H_
+
+#include "nccl.h"
+
+// Detaches the requests of ncclCommRequestRecord which the application did not
+// test to completion from comm, which is being destroyed
+ncclResult_t ncclRequestCommDetach(struct ncclComm* comm);
+
+#endif
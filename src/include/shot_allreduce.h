@@ -0,0 +1,66 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_SHOT_ALLREDUCE_H_
+#define NCCL_SHOT_ALLREDUCE_H_
+
+#include "nccl.h"
+#include <cuda_runtime.h>
+#include <stdint.h>
+
+// One-shot and two-shot AllReduce (NCCL_SHOT_ALLREDUCE) for small buffers within a
+// node where all GPUs have direct P2P. Each rank copies its input into a staging
+// buffer which all peers map. One-shot: every rank reduces all inputs into its output.
+// Two-shot: rank r reduces the r-th part of each block and writes it into all peers'
+// result areas, then every rank copies the result out.
+
+#define NCCL_SHOT_AR_MAX_RANKS 8
+#define NCCL_SHOT_AR_MAX_BLOCKS 16
+#define NCCL_SHOT_AR_SLOTS 2
+#define NCCL_SHOT_AR_HEADER_SIZE 4096
+
+// Start of each rank's staging buffer, followed by NCCL_SHOT_AR_SLOTS slots, each an input
+// area and a result area of maxBytes. Operation seq goes through slot seq%NCCL_SHOT_AR_SLOTS,
+// flags hold the last seq and are compared cyclically. The sequence number lives here rather
+// than in the launch arguments so that captured operations replay with the current one.
+struct ncclShotArHeader {
+  uint32_t ready[NCCL_SHOT_AR_MAX_BLOCKS];                        // Input block staged by the owner
+  uint32_t done[NCCL_SHOT_AR_MAX_RANKS][NCCL_SHOT_AR_MAX_BLOCKS]; // Two-shot: part of block written by rank r
+  uint32_t seq;    // Last operation completed by this rank
+  uint32_t exited; // Blocks of the running operation done, the last one bumps seq
+};
+static_assert(sizeof(struct ncclShotArHeader) <= NCCL_SHOT_AR_HEADER_SIZE, "ncclShotArHeader too large");
+
+struct ncclShotArArgs {
+  char* buffs[NCCL_SHOT_AR_MAX_RANKS]; // Staging buffers, mapped in this process
+  const void* sendbuff;
+  void* recvbuff;
+  size_t count;
+  size_t maxBytes;
+  volatile uint32_t* abortFlag;
+  int rank;
+  int nRanks;
+  int twoShot;
+};
+
+struct ncclInfo;
+struct ncclComm;
+
+// Sets up the staging buffers at init, collectively, when NCCL_SHOT_ALLREDUCE is set and
+// all ranks are blocking.
+ncclResult_t ncclShotArInit(struct ncclComm* comm);
+// Sets *eligible when the AllReduce described by info should run one-shot or two-shot,
+// which only depends on its arguments and the communicator. Fails with ncclInvalidUsage
+// when it should but is called within a group.
+ncclResult_t ncclShotArEligible(struct ncclInfo* info, bool* eligible);
+ncclResult_t ncclShotArLaunch(struct ncclInfo* info);
+ncclResult_t ncclShotArFree(struct ncclComm* comm);
+
+// Device side, in collectives/device/shot_allreduce.cu
+bool ncclShotArTypeSupported(ncclDataType_t datatype);
+ncclResult_t ncclShotArKernelLaunch(struct ncclShotArArgs* args, ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream);
+
+#endif
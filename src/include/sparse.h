@@ -0,0 +1,21 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_SPARSE_H_
+#define NCCL_SPARSE_H_
+
+#include "nccl.h"
+#include <cuda_runtime.h>
+
+// Sparse collectives (ncclSparseAllGather, ncclSparseAllReduce) on (index, value) pairs
+bool ncclSparseIndexTypeSupported(ncclDataType_t indextype);
+bool ncclSparseTypeSupported(ncclDataType_t datatype);
+// dst[indices[i]] += values[i] for i < n, with atomics so that indices may repeat.
+// Indices outside of [0, dstCount) are ignored.
+ncclResult_t ncclSparseScatterAdd(const void* indices, ncclDataType_t indextype, const void* values, size_t n,
+    void* dst, size_t dstCount, ncclDataType_t datatype, cudaStream_t stream);
+
+#endif
@@ -0,0 +1,120 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_STATS_H_
+#define NCCL_STATS_H_
+
+#include "nccl.h"
+#include "transport.h"
+#include "proxy.h"
+#include "utils.h"
+
+// Runtime counters, exposed through ncclCommGetStats/ncclCommGetPeerStats.
+// Byte counters may be updated by several proxy progress threads (NCCL_PROXY_PROGRESS_THREADS),
+// so updates are relaxed atomic adds and readers may see slightly stale values.
+struct ncclStatsCounter {
+  uint64_t posted;
+  uint64_t completed;
+};
+
+// Send throughput of each NIC. busyNs sums, over connections, the time during which the
+// connection had at least one request in flight, so bytes/busyNs is the mean per-connection
+// bandwidth, which drops on every connection using a NIC when that NIC degrades.
+struct ncclNetDevStats {
+  uint64_t bytes;
+  uint64_t busyNs;
+  // Last evaluation, see ncclProxyStatsNetDegraded
+  uint64_t lastBytes;
+  uint64_t lastBusyNs;
+  double bw; // GB/s
+  int degraded;
+};
+
+struct ncclProxyStats {
+  struct ncclStatsCounter channels[MAXCHANNELS][2]; // [recv=0/send=1]
+  struct ncclStatsCounter protocols[NCCL_NUM_PROTOCOLS][2];
+  struct ncclStatsCounter transports[NTRANSPORTS][2];
+  struct ncclStatsCounter* peers; // [nPeers][2]
+  int nPeers;
+  uint64_t netTestPending;
+  struct ncclNetDevStats netDevs[NCCL_MAX_NETDEVS];
+  uint64_t progressCalls[NTRANSPORTS];
+  uint64_t stalls; // Ops reported by the proxy watchdog
+  // Memory held, see ncclCommGetMemUsage. Updated by the proxy and by the transports setting
+  // up connections on the communicator threads.
+  uint64_t memDevice[NCCL_MEM_NUM_KINDS];
+  uint64_t memHost[NCCL_MEM_NUM_KINDS];
+};
+
+static inline void ncclStatsAdd(uint64_t* counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t ncclStatsLoad(const uint64_t* counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Account 'bytes' as posted (completed=0) or completed (completed=1) on the connection of 'sub'.
+static inline void ncclProxyStatsRecord(struct ncclProxyState* proxyState, struct ncclProxyArgs* args,
+    struct ncclProxySubArgs* sub, int send, int completed, uint64_t bytes) {
+  struct ncclProxyStats* stats = proxyState->stats;
+  if (stats == NULL || bytes == 0) return;
+#define NCCL_STATS_ADD(b) ncclStatsAdd(completed ? &(b).completed : &(b).posted, bytes)
+  NCCL_STATS_ADD(stats->channels[sub->channelId][send]);
+  NCCL_STATS_ADD(stats->protocols[args->protocol][send]);
+  NCCL_STATS_ADD(stats->transports[sub->connection->transport][send]);
+  if (sub->peer >= 0 && sub->peer < stats->nPeers) NCCL_STATS_ADD(stats->peers[2*sub->peer+send]);
+#undef NCCL_STATS_ADD
+}
+
+static inline void ncclProxyStatsProgress(struct ncclProxyState* proxyState, struct ncclProxyArgs* op) {
+  if (proxyState->stats) ncclStatsAdd(&proxyState->stats->progressCalls[op->subs[0].connection->transport], 1);
+}
+
+static inline void ncclProxyStatsStall(struct ncclProxyState* proxyState) {
+  if (proxyState->stats) ncclStatsAdd(&proxyState->stats->stalls, 1);
+}
+
+// Account bytes allocated (positive) or freed (negative) for subsystem kind (NCCL_MEM_*)
+static inline void ncclProxyStatsMem(struct ncclProxyState* proxyState, int kind, int64_t device, int64_t host) {
+  struct ncclProxyStats* stats = proxyState ? proxyState->stats : NULL;
+  if (stats == NULL) return;
+  if (device) ncclStatsAdd(&stats->memDevice[kind], (uint64_t)device);
+  if (host) ncclStatsAdd(&stats->memHost[kind], (uint64_t)host);
+}
+
+// Account the buffers of a connection, which proxyFree returns once the transport freed them
+static inline void ncclProxyConnectionMem(struct ncclProxyState* proxyState, struct ncclProxyConnection* connection, int64_t device, int64_t host) {
+  connection->memDevice += device;
+  connection->memHost += host;
+  ncclProxyStatsMem(proxyState, NCCL_MEM_CONNECTIONS, device, host);
+}
+
+static inline void ncclProxyStatsTestPending(struct ncclProxyState* proxyState) {
+  if (proxyState->stats) ncclStatsAdd(&proxyState->stats->netTestPending, 1);
+}
+
+// Account a completed send request of 'bytes' on NIC 'dev', posted at 'postNs'.
+static inline void ncclProxyStatsNetDev(struct ncclProxyState* proxyState, struct ncclProxySubArgs* sub,
+    int dev, uint64_t bytes, uint64_t postNs) {
+  struct ncclProxyStats* stats = proxyState->stats;
+  if (stats == NULL || dev < 0 || dev >= NCCL_MAX_NETDEVS) return;
+  uint64_t now = clockNano();
+  // Only count time not already accounted by the previous completion on this connection
+  uint64_t start = postNs > sub->lastDoneNs ? postNs : sub->lastDoneNs;
+  sub->lastDoneNs = now;
+  if (now <= start) return;
+  ncclStatsAdd(&stats->netDevs[dev].bytes, bytes);
+  ncclStatsAdd(&stats->netDevs[dev].busyNs, now-start);
+}
+
+// Returns 1 if NIC 'dev' runs significantly slower than the fastest NIC (NCCL_NET_REBALANCE_PCT).
+int ncclProxyStatsNetDegraded(struct ncclProxyState* proxyState, int dev);
+
+ncclResult_t ncclProxyStatsInit(struct ncclProxyState* proxyState, int nPeers);
+void ncclProxyStatsFree(struct ncclProxyState* proxyState);
+
+#endif
@@ -57,4 +57,42 @@ static double startTimes[8];
 #define TIME_CANCEL(index) while(0);
 #define TIME_PRINT(name)
 #endif
+
+// Communicator init phases, always timed and reported with NCCL_INIT_TIMERS.
+// Each stop charges the time since the previous stop to the given phase.
+#include <stdint.h>
+uint64_t clockNano(); // from utils.h
+
+enum ncclInitPhase {
+  ncclInitPhaseKernels,
+  ncclInitPhaseBootstrap,
+  ncclInitPhaseAllGather1,
+  ncclInitPhaseTopo,
+  ncclInitPhasePaths,
+  ncclInitPhaseSearch,
+  ncclInitPhaseAllGather3,
+  ncclInitPhaseSetup,
+  ncclInitPhaseProxy,
+  ncclInitPhaseConnect,
+  ncclInitPhaseTune,
+  ncclInitPhaseProxyConnect,
+  ncclInitPhaseDevComm,
+  ncclNumInitPhases
+};
+
+struct ncclInitTimers {
+  uint64_t mark;
+  double us[ncclNumInitPhases];
+};
+
+static inline void ncclInitTimerStart(struct ncclInitTimers* t) {
+  for (int p=0; p<ncclNumInitPhases; p++) t->us[p] = 0;
+  t->mark = clockNano();
+}
+
+static inline void ncclInitTimerStop(struct ncclInitTimers* t, enum ncclInitPhase phase) {
+  uint64_t now = clockNano();
+  t->us[phase] += (now - t->mark)/1e3;
+  t->mark = now;
+}
 #endif
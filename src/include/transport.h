@@ -12,6 +12,9 @@
 #include "nvmlwrap.h"
 #include "core.h"
 
+// Steps of each channel in the network buffers shared by p2p operations, see transport/net.cc
+#define NCCL_SHARED_STEPS 16
+
 #define NTRANSPORTS 4
 #define TRANSPORT_P2P 0
 #define TRANSPORT_SHM 1
@@ -32,6 +35,14 @@ struct ncclRing;
 struct ncclConnector;
 struct ncclComm;
 
+enum ncclP2pReclaimState { ncclP2pReclaimNone = 0, ncclP2pReclaimRequested = 1, ncclP2pReclaimAgreed = 2 };
+
+struct ncclP2pPeerState {
+  uint64_t lastUse; // clockNano() of the last launch with send/recv work for that peer
+  int reclaim; // ncclP2pReclaimState
+  uint64_t drainLoops; // Proxy idle loop count to wait for before freeing, 0 if not started
+};
+
 struct ncclPeerInfo {
   int rank;
   int cudaDev;
@@ -43,6 +54,9 @@ struct ncclPeerInfo {
   int64_t busId;
   struct ncclComm* comm;
   int cudaCompCap;
+  int blocking; // config.blocking
+  int ll128Tested; // NCCL_LL128_PROBE_* paths checked on this rank
+  int ll128Passed;
 };
 
 #define CONNECT_SIZE 128
@@ -66,6 +80,7 @@ struct ncclNvlsSharedRes {
   char* ucBuff; // Unicast NVLS buffer address
   char shareableHandle[NVLS_HANDLE_SIZE];
   int nChannels;
+  int inited; // Buffers are allocated, see ncclNvlsBufferSetup
 };
 
 #endif /* CUDART_VERSION >= 12010 */
@@ -90,6 +105,9 @@ struct ncclTransportComm {
   ncclResult_t (*proxyConnect)(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize, void* respBuff, int respSize, int* done);
   ncclResult_t (*proxyFree)(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState);
   ncclResult_t (*proxyProgress)(struct ncclProxyState* proxyState, struct ncclProxyArgs*);
+  // Optional, register user buffers so that proxyProgress can use them in place of the connection buffers
+  ncclResult_t (*proxyRegister)(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize, void* respBuff, int respSize);
+  ncclResult_t (*proxyDeregister)(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize);
 };
 
 struct ncclTransport {
@@ -101,10 +119,22 @@ struct ncclTransport {
 
 ncclResult_t ncclTransportP2pConnect(struct ncclComm* comm, int channelId, int nrecv, int* peerRecv, int nsend, int* peerSend, int connIndex);
 ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, int connIndex, int* highestTransportType=NULL);
+ncclResult_t ncclTransportCollConnect(struct ncclComm* comm, struct ncclTopoGraph* ringGraph, struct ncclTopoGraph* treeGraph, struct ncclTopoGraph* nvlsGraph);
+// Negotiate the release of idle p2p connections with peers, see NCCL_P2P_IDLE_TIMEOUT. Called
+// before launching the tasks of a group; sets needConnect if some of them need to reconnect.
+ncclResult_t ncclTransportP2pReclaim(struct ncclComm* comm, bool* needConnect);
 
 ncclResult_t ncclNvlsInit(struct ncclComm* comm);
 ncclResult_t ncclNvlsSetup(struct ncclComm* comm, struct ncclComm* parent);
+// Allocates the NVLS buffers if they are not yet, otherwise done by the first NVLS operation
+// (see NCCL_NVLS_LAZY_SETUP). All local ranks must call it for the same operation.
+ncclResult_t ncclNvlsBufferSetup(struct ncclComm* comm);
 ncclResult_t ncclNvlsFree(struct ncclComm* comm);
+// Binds sendbuff and recvbuff, registered with ncclCommRegister, to multicast objects shared with
+// the other local ranks. All local ranks must call it for the same operation. When *regUsed is
+// set, *mcSend and *mcRecv are the multicast addresses of the buffers.
+ncclResult_t ncclNvlsRegisterBuffers(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t size, bool* regUsed, void** mcSend, void** mcRecv);
+ncclResult_t ncclNvlsDeregisterBuffer(struct ncclComm* comm, struct ncclReg* reg);
 
 enum { collNetRecv=0, collNetSend=1 };
 int ncclTransportCollNetSetup(struct ncclComm* comm, struct ncclTopoGraph* collNetGraph, struct ncclChannel* channel, int masterRank, int masterPeer, int collNetGraphChannelId, int type);
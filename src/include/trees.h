@@ -9,5 +9,9 @@
 
 ncclResult_t ncclGetBtree(int nranks, int rank, int* u0, int* d1, int* d0, int* parentChildType);
 ncclResult_t ncclGetDtree(int nranks, int rank, int* u0, int* d0_0, int* d0_1, int* parentChildType0, int* u1, int* d1_0, int* d1_1, int* parentChildType1);
+// k-ary counterparts, d0 and d1 hold arity children
+ncclResult_t ncclGetKtree(int nranks, int rank, int arity, int* u, int* d, int* parentChildType);
+ncclResult_t ncclGetDKtree(int nranks, int rank, int arity, int* u0, int* d0, int* parentChildType0, int* u1, int* d1, int* parentChildType1);
+int ncclTreeLevels(int nranks, int arity);
 
 #endif
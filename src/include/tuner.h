@@ -0,0 +1,17 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_INT_TUNER_H_
+#define NCCL_INT_TUNER_H_
+
+#include "nccl_tuner.h"
+
+// Tuner plugin (libnccl-tuner.so, or libnccl-tuner-${NCCL_TUNER_PLUGIN}.so).
+// Sets comm->tuner to NULL when no plugin is available.
+ncclResult_t ncclTunerPluginLoad(struct ncclComm* comm);
+void ncclTunerPluginUnload(struct ncclComm* comm);
+
+#endif
@@ -0,0 +1,61 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_URINGWRAP_H_
+#define NCCL_URINGWRAP_H_
+
+#include "nccl.h"
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring ring, driven through the raw system calls so that we do not
+// depend on liburing. A ring is not thread safe and must be used by one thread.
+struct ncclUring {
+  int fd;
+  unsigned entries;
+  // Submission queue, shared with the kernel
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned sqeHead; // SQEs handed out but not yet published to the kernel
+  unsigned sqeTail;
+  // Completion queue, shared with the kernel
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  struct io_uring_cqe* cqes;
+  // Mappings
+  void* sqPtr;
+  size_t sqSize;
+  void* cqPtr;
+  size_t cqSize;
+  size_t sqesSize;
+  int fixedFiles;
+};
+
+// Returns ncclSystemError when io_uring is not available on this system
+ncclResult_t ncclUringInit(struct ncclUring* ring, unsigned entries);
+ncclResult_t ncclUringFini(struct ncclUring* ring);
+// Register file descriptors, to be referenced by index with IOSQE_FIXED_FILE
+ncclResult_t ncclUringRegisterFiles(struct ncclUring* ring, int* fds, int nfds);
+// Returns NULL when the submission queue is full
+struct io_uring_sqe* ncclUringGetSqe(struct ncclUring* ring);
+// Publish all SQEs obtained so far and submit them, without waiting
+ncclResult_t ncclUringSubmit(struct ncclUring* ring);
+
+static inline struct io_uring_cqe* ncclUringPeekCqe(struct ncclUring* ring) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+  return ring->cqes + (head & *ring->cqMask);
+}
+
+static inline void ncclUringCqeSeen(struct ncclUring* ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead+1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -17,6 +17,14 @@
 
 int ncclCudaCompCap();
 
+// Host loops meant to be vectorized. On x86 they are also built for AVX2 and
+// AVX-512, picked at load time.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6
+#define NCCL_HOST_SIMD __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define NCCL_HOST_SIMD
+#endif
+
 // PCI Bus ID <-> int64 conversion functions
 ncclResult_t int64ToBusId(int64_t id, char* busId);
 ncclResult_t busIdToInt64(const char* busId, int64_t* id);
@@ -0,0 +1,22 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_WIRE_H_
+#define NCCL_WIRE_H_
+
+#include "nccl.h"
+#include <cuda_runtime.h>
+
+// Reduced-precision wire format: collectives created with ncclRedOpCreateWireSum
+// run on a copy of the data converted to the wire type. So do mixed precision
+// collectives, whose input and output types may differ.
+bool ncclWireTypeSupported(ncclDataType_t datatype, ncclDataType_t wireType);
+// Whether ncclWireCast converts srcType to dstType: half, bfloat16 and float, either way
+bool ncclWireCastSupported(ncclDataType_t srcType, ncclDataType_t dstType);
+// Convert count elements from srcType to dstType on stream
+ncclResult_t ncclWireCast(const void* src, ncclDataType_t srcType, void* dst, ncclDataType_t dstType, size_t count, cudaStream_t stream);
+
+#endif
@@ -14,8 +14,23 @@
 #include "net.h"
 #include "coll_net.h"
 #include "enqueue.h"
+#include "ce_coll.h"
+#include "shot_allreduce.h"
+#include "hier_allreduce.h"
+#include "ib_mcast.h"
+#include "host_coll.h"
+#include "dev_window.h"
+#include "request.h"
+#include "register.h"
 #include "graph.h"
 #include "argcheck.h"
+#include "profiler.h"
+#include "autotune.h"
+#include "tuner.h"
+#include "cpuset.h"
+#include "ll128_probe.h"
+#include "timer.h"
+#include "health.h"
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
@@ -145,7 +160,7 @@ void ncclCommPushCudaFree(struct ncclComm* comm, void* obj) {
 }
 
 static ncclResult_t ncclDestructorFnCudaHostFree(struct ncclDestructor* dtor) {
-  CUDACHECK(cudaFreeHost(dtor->obj));
+  NCCLCHECK(ncclCudaHostFree(dtor->obj));
   return ncclSuccess;
 }
 void ncclCommPushCudaHostFree(struct ncclComm* comm, void* obj) {
@@ -176,14 +191,31 @@ static ncclResult_t commFree(ncclComm_t comm) {
   /* in commReclaim, we have guaranteed only last rank which calls ncclCommDestroy() will
    * free all intra-process communicators; therefore, we only need to focus on local
    * resource cleanup in commFree(). */
-  if (comm->proxyState && comm->proxyRefCountOld == 0 && comm->proxyState->thread) {
-    pthread_join(comm->proxyState->thread, nullptr);
-  }
+
+  NCCLCHECK(ncclResidentKernelStop(comm));
+  NCCLCHECK(ncclGraphDoorbellsFree(comm));
+  NCCLCHECK(ncclWorkOverflowFree(comm));
+  NCCLCHECK(ncclWorkArenaFree(comm));
+  ncclProfilingDeviceTimeline(comm);
+  ncclAutotuneFree(comm);
+  ncclTunerPluginUnload(comm);
 
   delete[] comm->userRedOps;
+  free(comm->collCache);
+  free(comm->coalesceInfos);
+  NCCLCHECK(ncclScratchFree(&comm->wireBuff));
+  NCCLCHECK(ncclScratchFree(&comm->determBuff));
+  NCCLCHECK(ncclCeCollFree(comm));
+  NCCLCHECK(ncclShotArFree(comm));
+  NCCLCHECK(ncclIbMcastFree(comm));
+  NCCLCHECK(ncclHostCollFree(comm));
+  NCCLCHECK(ncclDevWindowFreeAll(comm));
+  NCCLCHECK(ncclRequestCommDetach(comm));
+  NCCLCHECK(ncclRegFreeAll(comm));
 
   free(comm->connectSend);
   free(comm->connectRecv);
+  free(comm->p2pPeerState);
 
   free(comm->peerInfo);
   if (comm->topo)
@@ -204,6 +236,10 @@ static ncclResult_t commFree(ncclComm_t comm) {
 
   if (comm->sharedRes) {
     if (ncclAtomicRefCountDecrement(&comm->sharedRes->refCount) == 0) {
+      /* The proxy thread has been stopped by ncclProxyStop() and frees all its connections on
+       * its way out. Only join it now so that this overlaps with our own cleanup above. */
+      struct ncclProxyState* proxyState = comm->sharedRes->proxyState;
+      if (proxyState && proxyState->thread) pthread_join(proxyState->thread, nullptr);
       for (int c=0; c<MAXCHANNELS; c++) {
         if (comm->sharedRes->peers[c]) free(comm->sharedRes->peers[c]);
         if (comm->sharedRes->devPeers[c]) ncclCudaFree(comm->sharedRes->devPeers[c]);
@@ -211,6 +247,10 @@ static ncclResult_t commFree(ncclComm_t comm) {
       free(comm->sharedRes->tpRankToLocalRank);
       NCCLCHECK(ncclStrongStreamDestruct(&comm->sharedRes->hostStream));
       NCCLCHECK(ncclStrongStreamDestruct(&comm->sharedRes->deviceStream));
+      if (comm->sharedRes->laneState == 1) {
+        NCCLCHECK(ncclStrongStreamDestruct(&comm->sharedRes->deviceStreamHigh));
+        for (int l=0; l<2; l++) CUDACHECK(cudaEventDestroy(comm->sharedRes->laneEvent[l]));
+      }
       NCCLCHECK(ncclProxyDestroy(comm));
       free(comm->sharedRes);
     }
@@ -224,6 +264,8 @@ static ncclResult_t commFree(ncclComm_t comm) {
     dtor = dtor->next;
   }
 
+  NCCLCHECK(ncclCudaArenaDestruct(&comm->devArena));
+  NCCLCHECK(ncclCudaArenaDestruct(&comm->hostArena));
   ncclMemoryStackDestruct(&comm->memScoped);
   ncclMemoryStackDestruct(&comm->memPermanent);
 
@@ -302,6 +344,8 @@ static ncclResult_t commAlloc(struct ncclComm* comm, struct ncclComm* parent, in
 
   ncclMemoryStackConstruct(&comm->memPermanent);
   ncclMemoryStackConstruct(&comm->memScoped);
+  comm->devArena.host = false;
+  comm->hostArena.host = true;
   comm->destructorHead = nullptr;
   comm->rank = rank;
   comm->nRanks = ndev;
@@ -334,6 +378,7 @@ static ncclResult_t commAlloc(struct ncclComm* comm, struct ncclComm* parent, in
 
   comm->collNetSupport = 0;
   memset(comm->collNetSupportMatrix, 0, sizeof(comm->collNetSupportMatrix));
+  memset(comm->collNetProxyReduce, 0, sizeof(comm->collNetProxyReduce));
 
   ncclMemoryPoolConstruct(&comm->memPool_ncclKernelPlan);
   ncclMemoryPoolConstruct(&comm->memPool_ncclProxyOp);
@@ -374,9 +419,14 @@ static ncclResult_t commAlloc(struct ncclComm* comm, struct ncclComm* parent, in
   }
 
   ncclIntruQueueMpscConstruct(&comm->callbackQueue);
+  ncclIntruQueueMpscConstruct(&comm->submitQueue);
   return ncclSuccess;
 }
 
+NCCL_PARAM(DeviceTimeline, "DEVICE_TIMELINE", 0);
+NCCL_PARAM(BulkCopy, "BULK_COPY", 0);
+NCCL_PARAM(SimplePrefetch, "SIMPLE_PREFETCH", 0);
+
 static ncclResult_t devCommSetup(ncclComm_t comm) {
   ncclResult_t ret = ncclSuccess;
   int nRanks = comm->nRanks;
@@ -384,22 +434,20 @@ static ncclResult_t devCommSetup(ncclComm_t comm) {
   struct ncclDevCommAndChannels *devCommAndChans = NULL;
 
   NCCLCHECKGOTO(ncclStrongStreamAcquireUncaptured(&comm->sharedRes->deviceStream), ret, fail);
-  NCCLCHECKGOTO(ncclCudaCallocAsync(&devCommAndChans, 1, comm->sharedRes->deviceStream.cudaStream), ret, fail);
-  ncclCommPushCudaFree(comm, devCommAndChans);
+  NCCLCHECKGOTO(ncclCudaArenaCalloc(&comm->devArena, &devCommAndChans, 1), ret, fail);
   comm->devComm = &devCommAndChans->comm;
   tmpCommAndChans.comm.rank = comm->rank;
   tmpCommAndChans.comm.nRanks = nRanks;
   tmpCommAndChans.comm.abortFlag = comm->abortFlag;
+  // Bulk copies stage through the per-warp scratch, which low shmem kernels don't have
+  tmpCommAndChans.comm.bulkCopy = ncclParamBulkCopy() && comm->cudaArch >= 900 && !comm->config.lowShmem ? 1 : 0;
+  tmpCommAndChans.comm.prefetch = ncclParamSimplePrefetch() ? 1 : 0;
   for (int p=0; p < NCCL_NUM_PROTOCOLS; p++) {
     tmpCommAndChans.comm.buffSizes[p] = comm->buffSizes[p];
   }
   tmpCommAndChans.comm.channels = &devCommAndChans->channels[0];
 
-  comm->workFifoDepth = ncclParamWorkFifoDepth();
-  if (0 != (comm->workFifoDepth & (comm->workFifoDepth-1))) {
-    WARN("NCCL_WORK_FIFO_DEPTH=%d is being ignored because it is not a power of 2.", comm->workFifoDepth);
-    comm->workFifoDepth = 64<<10;
-  }
+  // comm->workFifoDepth was set by memBudgetFit
   tmpCommAndChans.comm.workFifoDepth = comm->workFifoDepth;
 
   if (ncclGdrCopy != NULL && ncclParamGdrCopyFifoEnable() == 1) {
@@ -415,24 +463,63 @@ static ncclResult_t devCommSetup(ncclComm_t comm) {
   }
   tmpCommAndChans.comm.workFifoHeap = comm->devWorkFifoHeap;
 
-  NCCLCHECKGOTO(ncclCudaHostCalloc(&comm->workFifoDone, MAXCHANNELS), ret, fail);
-  ncclCommPushCudaHostFree(comm, comm->workFifoDone);
+  NCCLCHECKGOTO(ncclCudaArenaCalloc(&comm->hostArena, &comm->workFifoDone, MAXCHANNELS), ret, fail);
   comm->workFifoSent = 0;
   comm->workFifoAckdMin = 0;
 
+  comm->timeline = nullptr;
+  tmpCommAndChans.comm.timeline = nullptr;
+  tmpCommAndChans.comm.timelineHead = nullptr;
+  if (ncclParamDeviceTimeline()) {
+    if (!ncclProfilingEnabled()) {
+      WARN("NCCL_DEVICE_TIMELINE is set but the proxy profiler is disabled (set NCCL_PROXY_PROFILE), ignoring.");
+    } else {
+      uint32_t* timelineHead;
+      NCCLCHECKGOTO(ncclCudaArenaCalloc(&comm->hostArena, &comm->timeline, MAXCHANNELS*NCCL_DEV_TIMELINE_EVENTS), ret, fail);
+      NCCLCHECKGOTO(ncclCudaArenaCalloc(&comm->devArena, &timelineHead, MAXCHANNELS), ret, fail);
+      memset(comm->timelineHarvested, 0, sizeof(comm->timelineHarvested));
+      tmpCommAndChans.comm.timeline = comm->timeline;
+      tmpCommAndChans.comm.timelineHead = timelineHead;
+      INFO(NCCL_INIT, "Device timeline enabled, %d events per channel", NCCL_DEV_TIMELINE_EVENTS);
+    }
+  }
+
   for (int c=0; c < MAXCHANNELS; c++) {
     tmpCommAndChans.channels[c].peers = comm->channels[c].devPeers;
     tmpCommAndChans.channels[c].ring = comm->channels[c].ring;
     tmpCommAndChans.channels[c].ring.userRanks = comm->channels[c].devRingUserRanks;
     tmpCommAndChans.channels[c].tree = comm->channels[c].tree;
+    tmpCommAndChans.channels[c].treeToRoot = comm->channels[c].devTreeToRoot;
     tmpCommAndChans.channels[c].collnetChain = comm->channels[c].collnetChain;
     tmpCommAndChans.channels[c].collnetDirect = comm->channels[c].collnetDirect;
     tmpCommAndChans.channels[c].nvls = comm->channels[c].nvls;
     tmpCommAndChans.channels[c].workFifoDone = &comm->workFifoDone[c];
+    {
+      // Ring neighbors first, they are the most common peers
+      struct ncclDevChannel* devChannel = tmpCommAndChans.channels+c;
+      int cacheRanks[NCCL_DEV_PEER_CACHE] = { comm->channels[c].ring.prev, comm->channels[c].ring.next, comm->channels[c].tree.up };
+      for (int d=0; d<NCCL_MAX_TREE_ARITY; d++) cacheRanks[3+d] = comm->channels[c].tree.down[d];
+      int nCache = 0;
+      for (int i=0; i<NCCL_DEV_PEER_CACHE; i++) {
+        int r = cacheRanks[i];
+        bool dup = false;
+        for (int j=0; j<nCache; j++) dup |= devChannel->peerCacheRank[j] == r;
+        if (r < 0 || r >= nRanks || dup || comm->channels[c].devPeers == NULL) continue;
+        devChannel->peerCache[nCache] = comm->sharedRes->devPeers[c] + comm->topParentRanks[r];
+        devChannel->peerCacheRank[nCache++] = r;
+      }
+      for (int i=nCache; i<NCCL_DEV_PEER_CACHE; i++) {
+        devChannel->peerCache[i] = NULL;
+        devChannel->peerCacheRank[i] = -1;
+      }
+    }
 
     if (comm->channels[c].ring.userRanks != nullptr) {
       NCCLCHECKGOTO(ncclCudaMemcpyAsync(tmpCommAndChans.channels[c].ring.userRanks, comm->channels[c].ring.userRanks, nRanks, comm->sharedRes->deviceStream.cudaStream), ret, fail);
     }
+    if (comm->channels[c].treeToRoot != nullptr) {
+      NCCLCHECKGOTO(ncclCudaMemcpyAsync(tmpCommAndChans.channels[c].treeToRoot, comm->channels[c].treeToRoot, nRanks, comm->sharedRes->deviceStream.cudaStream), ret, fail);
+    }
   }
 
   NCCLCHECKGOTO(ncclCudaMemcpyAsync(devCommAndChans, &tmpCommAndChans, 1, comm->sharedRes->deviceStream.cudaStream), ret, fail);
@@ -457,6 +544,9 @@ static void showVersion() {
   }
 }
 
+// Check 128-byte store atomicity at init to enable LL128 where it holds, see ncclTopoTuneModel
+NCCL_PARAM(Ll128Probe, "LL128_PROBE", 0);
+
 static ncclResult_t fillInfo(struct ncclComm* comm, struct ncclPeerInfo* info, uint64_t commHash) {
   info->rank = comm->rank;
   info->cudaDev = comm->cudaDev;
@@ -476,6 +566,9 @@ static ncclResult_t fillInfo(struct ncclComm* comm, struct ncclPeerInfo* info, u
   NCCLCHECK(ncclGpuGdrSupport(comm, &info->gdrSupport));
   info->comm = comm;
   info->cudaCompCap = comm->minCompCap = comm->maxCompCap = comm->compCap;
+  info->blocking = comm->config.blocking;
+  info->ll128Tested = info->ll128Passed = 0;
+  if (ncclParamLl128Probe()) NCCLCHECK(ncclLl128Probe(comm->cudaDev, &info->ll128Tested, &info->ll128Passed));
   return ncclSuccess;
 }
 
@@ -509,7 +602,54 @@ NCCL_PARAM(P2pNetChunkSize, "P2P_NET_CHUNKSIZE", (1 << 17)); /* 128 kB */
 NCCL_PARAM(P2pPciChunkSize, "P2P_PCI_CHUNKSIZE", (1 << 17)); /* 128 kB */
 NCCL_PARAM(P2pNvlChunkSize, "P2P_NVL_CHUNKSIZE", (1 << 19)); /* 512 kB */
 
-static ncclResult_t computeBuffSizes(struct ncclComm* comm) {
+// Per link class SIMPLE buffer sizes. They only replace the default, NCCL_BUFFSIZE still wins.
+NCCL_PARAM(NetBuffSize, "NET_BUFFSIZE", -2);
+NCCL_PARAM(PciBuffSize, "PCI_BUFFSIZE", -2);
+NCCL_PARAM(NvlBuffSize, "NVL_BUFFSIZE", -2);
+// Network latency (in us) assumed when the NIC does not report one.
+NCCL_PARAM(NetBdpLatency, "NET_BDP_LATENCY", 10);
+#define MAX_BDP_BUFFSIZE (1 << 26) /* 64MiB */
+// SIMPLE steps of dedicated network connections, -2 to size them from the network BDP
+NCCL_PARAM(NetSteps, "NET_STEPS", -2);
+
+static double netBdp(struct ncclTopoGraph* ringGraph) {
+  float latency = ringGraph->latencyInter > 0 ? ringGraph->latencyInter : ncclParamNetBdpLatency();
+  // GB/s * us = 1e3 bytes
+  return (double)ringGraph->bwInter * latency * 1e3;
+}
+
+// Cover the bandwidth-delay product with more steps first: larger steps would
+// also make the chunks of medium size operations larger and pipeline worse.
+// More than NCCL_STEPS requests in flight per network comm are only guaranteed
+// by the internal IB plugin, see NCCL_NET_MAX_REQUESTS.
+static int netStepsShift(struct ncclComm* comm, struct ncclTopoGraph* ringGraph, int buffSize) {
+  int64_t steps = ncclParamNetSteps();
+  int shift = 0;
+  if (steps == -2) {
+    double bdp = netBdp(ringGraph);
+    while (shift < NCCL_MAX_STEPS_SHIFT && ((int64_t)buffSize << shift) < 2*bdp) shift++;
+  } else {
+    while (shift < NCCL_MAX_STEPS_SHIFT && (NCCL_STEPS << shift) < steps) shift++;
+  }
+  if (shift && comm->ncclNet != &ncclNetIb) {
+    if (steps != -2) INFO(NCCL_INIT|NCCL_ENV, "NCCL_NET_STEPS=%ld ignored, network %s only supports %d steps", steps, comm->ncclNet->name, NCCL_STEPS);
+    shift = 0;
+  }
+  return shift;
+}
+
+// Size the SIMPLE buffers on inter-node comms so that a full buffer, with
+// stepsShift deeper pipelines, covers twice the bandwidth-delay product of one
+// channel. The network then always has data in flight while the GPU refills
+// the steps that were sent.
+static int netBdpBuffSize(struct ncclTopoGraph* ringGraph, int defaultSize, int stepsShift) {
+  double bdp = netBdp(ringGraph);
+  int size = defaultSize;
+  while (((int64_t)size << stepsShift) < 2*bdp && size < MAX_BDP_BUFFSIZE) size *= 2;
+  return size;
+}
+
+static ncclResult_t computeBuffSizes(struct ncclComm* comm, struct ncclTopoGraph* ringGraph) {
   int cpuArch, cpuVendor, cpuModel;
   NCCLCHECK(ncclTopoCpuType(comm->topo, &cpuArch, &cpuVendor, &cpuModel));
 
@@ -518,12 +658,42 @@ static ncclResult_t computeBuffSizes(struct ncclComm* comm) {
 
   if (cpuArch == NCCL_TOPO_CPU_ARCH_ARM) defaults[NCCL_PROTO_SIMPLE] = DEFAULT_BUFFSIZE_ARM;
 
+  int allNvlink = ncclTopoPathAllNVLink(comm->topo);
+  const char* linkClass;
+  int64_t classSize;
+  comm->netStepsShift = 0;
+  if (comm->nNodes > 1) {
+    linkClass = "NET";
+    classSize = ncclParamNetBuffSize();
+    int buffSize = classSize > 0 ? classSize : envs[NCCL_PROTO_SIMPLE] != -2 ? envs[NCCL_PROTO_SIMPLE] : defaults[NCCL_PROTO_SIMPLE];
+    comm->netStepsShift = netStepsShift(comm, ringGraph, buffSize);
+    if (classSize == -2) classSize = netBdpBuffSize(ringGraph, defaults[NCCL_PROTO_SIMPLE], comm->netStepsShift);
+  } else if (allNvlink) {
+    linkClass = "NVL";
+    classSize = ncclParamNvlBuffSize();
+  } else {
+    linkClass = "PCI";
+    classSize = ncclParamPciBuffSize();
+  }
+  if (classSize > 0) defaults[NCCL_PROTO_SIMPLE] = classSize;
+
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
     comm->buffSizes[p] = envs[p] != -2 ? envs[p] : defaults[p];
   }
+  if (comm->sharedRes->owner != comm) {
+    /* split comms reuse the connections of their parent, so they must keep its buffer sizes. */
+    memcpy(comm->buffSizes, comm->sharedRes->tpBuffSizes, sizeof(comm->buffSizes));
+    comm->netStepsShift = comm->sharedRes->tpNetStepsShift;
+    comm->memBudgetNoLL128 = comm->sharedRes->tpMemBudgetNoLL128;
+  } else {
+    memcpy(comm->sharedRes->tpBuffSizes, comm->buffSizes, sizeof(comm->buffSizes));
+    comm->sharedRes->tpNetStepsShift = comm->netStepsShift;
+  }
+  INFO(NCCL_INIT, "Buffer sizes set to %d/%d/%d (LL/LL128/Simple, %s links), %d network steps",
+      comm->buffSizes[NCCL_PROTO_LL], comm->buffSizes[NCCL_PROTO_LL128], comm->buffSizes[NCCL_PROTO_SIMPLE], linkClass, NCCL_STEPS << comm->netStepsShift);
 
   if (comm->nNodes > 1) comm->p2pChunkSize = ncclParamP2pNetChunkSize();
-  else if (ncclTopoPathAllNVLink(comm->topo)) comm->p2pChunkSize = ncclParamP2pNvlChunkSize();
+  else if (allNvlink) comm->p2pChunkSize = ncclParamP2pNvlChunkSize();
   else comm->p2pChunkSize = ncclParamP2pPciChunkSize();
   if (comm->sharedRes->owner != comm) {
     /* make sure split comm p2pChunkSize won't exceed shared p2pChunkSize. */
@@ -536,10 +706,212 @@ static ncclResult_t computeBuffSizes(struct ncclComm* comm) {
   return ncclSuccess;
 }
 
+// Memory budget (ncclConfig_t memBudget). The footprint is estimated from values all ranks
+// agree on, so that they all make the same choices: per channel, the buffers of the ring and
+// tree connections receiving data, on both ends for network connections, the network buffers
+// shared by p2p operations and the NVLS buffers. The work fifo gets at most an eighth of the
+// budget and p2p connections what is left, through the reclamation of NCCL_P2P_MEM_BUDGET.
+#define MEM_BUDGET_MIN_BUFFSIZE (1 << 18) /* 256 KiB */
+#define MEM_BUDGET_MIN_FIFO_DEPTH 1024
+
+static int64_t memBudgetConnBytes(struct ncclComm* comm) {
+  int64_t connBytes = 0;
+  for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+    connBytes += (int64_t)comm->buffSizes[p] << (p == NCCL_PROTO_SIMPLE && comm->nNodes > 1 ? comm->netStepsShift : 0);
+  }
+  int64_t bytes = (int64_t)comm->nChannels * 3 * connBytes * (comm->nNodes > 1 ? 2 : 1);
+  if (comm->nNodes > 1) bytes += 2 * (int64_t)comm->nChannels * NCCL_SHARED_STEPS * comm->p2pChunkSize;
+  return bytes;
+}
+
+static int64_t memBudgetNvlsBytes(struct ncclComm* comm, struct ncclTopoGraph* nvlsGraph) {
+  if (comm->nvlsSupport == 0) return 0;
+  return (int64_t)nvlsGraph->nChannels * 2 * comm->nvlsChannels * comm->buffSizes[NCCL_PROTO_SIMPLE];
+}
+
+static ncclResult_t memBudgetFit(struct ncclComm* comm, struct ncclTopoGraph** graphs) {
+  struct ncclTopoGraph* nvlsGraph = graphs[NCCL_ALGO_NVLS];
+  comm->workFifoDepth = ncclParamWorkFifoDepth();
+  if (0 != (comm->workFifoDepth & (comm->workFifoDepth-1))) {
+    WARN("NCCL_WORK_FIFO_DEPTH=%d is being ignored because it is not a power of 2.", comm->workFifoDepth);
+    comm->workFifoDepth = 64<<10;
+  }
+  int64_t budget = (int64_t)comm->config.memBudget << 20;
+  comm->memBudgetP2p = 0;
+  if (budget == 0) return ncclSuccess;
+
+  while (comm->workFifoDepth > MEM_BUDGET_MIN_FIFO_DEPTH && (int64_t)comm->workFifoDepth*sizeof(struct ncclWork) > budget/8) comm->workFifoDepth /= 2;
+  int64_t used = (int64_t)comm->workFifoDepth*sizeof(struct ncclWork);
+
+  // Children sharing their parent's resources allocate no connection buffers of their own
+  if (comm->sharedRes->owner == comm) {
+    int minChannels = std::max(1, comm->config.minCTAs);
+    int* buffSizes = comm->buffSizes;
+    while (used + memBudgetConnBytes(comm) > budget) {
+      if (comm->netStepsShift > 0) comm->netStepsShift--;
+      else if (buffSizes[NCCL_PROTO_SIMPLE] > 4*MEM_BUDGET_MIN_BUFFSIZE) buffSizes[NCCL_PROTO_SIMPLE] /= 2;
+      else if (buffSizes[NCCL_PROTO_LL128] > 0) {
+        buffSizes[NCCL_PROTO_LL128] = 0;
+        comm->memBudgetNoLL128 = 1; // Disables LL128, see tuning.cc
+      }
+      else if (buffSizes[NCCL_PROTO_SIMPLE] > MEM_BUDGET_MIN_BUFFSIZE) buffSizes[NCCL_PROTO_SIMPLE] /= 2;
+      else if (comm->nChannels > minChannels) comm->nChannels--;
+      else break;
+      // p2p steps go through the same buffers
+      comm->p2pChunkSize = std::min(comm->p2pChunkSize, buffSizes[NCCL_PROTO_SIMPLE]/NCCL_STEPS);
+    }
+    used += memBudgetConnBytes(comm);
+    if (used > budget) {
+      WARN("Memory budget of %d MB is too small, the communicator needs about %ld MB with %d channels of %d/%d/%d (LL/LL128/Simple) byte buffers",
+          comm->config.memBudget, used >> 20, comm->nChannels, buffSizes[NCCL_PROTO_LL], buffSizes[NCCL_PROTO_LL128], buffSizes[NCCL_PROTO_SIMPLE]);
+    }
+    // The tuning model must not count on the channels dropped
+    graphs[NCCL_ALGO_RING]->nChannels = std::min(graphs[NCCL_ALGO_RING]->nChannels, comm->nChannels);
+    graphs[NCCL_ALGO_TREE]->nChannels = std::min(graphs[NCCL_ALGO_TREE]->nChannels, comm->nChannels);
+    memcpy(comm->sharedRes->tpBuffSizes, comm->buffSizes, sizeof(comm->buffSizes));
+    comm->sharedRes->tpNetStepsShift = comm->netStepsShift;
+    comm->sharedRes->tpP2pChunkSize = comm->p2pChunkSize;
+    comm->sharedRes->tpMemBudgetNoLL128 = comm->memBudgetNoLL128;
+
+    while (comm->nvlsChannels > 0 && used + memBudgetNvlsBytes(comm, nvlsGraph) > budget) comm->nvlsChannels--;
+    if (comm->nvlsSupport && comm->nvlsChannels == 0) {
+      INFO(NCCL_INIT, "Memory budget of %d MB leaves no room for NVLS buffers, disabling NVLS", comm->config.memBudget);
+      comm->nvlsSupport = 0;
+      nvlsGraph->nChannels = 0;
+    }
+    used += memBudgetNvlsBytes(comm, nvlsGraph);
+  }
+
+  // At least one byte, so that only the peers in use keep their connections
+  comm->memBudgetP2p = std::max<int64_t>(budget - used, 1);
+  INFO(NCCL_INIT, "Memory budget %d MB : %d channels, buffer sizes %d/%d/%d (LL/LL128/Simple), %d network steps, %d nvls channels, work fifo depth %d, %ld MB left for p2p",
+      comm->config.memBudget, comm->nChannels, comm->buffSizes[NCCL_PROTO_LL], comm->buffSizes[NCCL_PROTO_LL128], comm->buffSizes[NCCL_PROTO_SIMPLE],
+      NCCL_STEPS << comm->netStepsShift, comm->nvlsChannels, comm->workFifoDepth, comm->memBudgetP2p >> 20);
+  return ncclSuccess;
+}
+
 NCCL_PARAM(GraphDumpFileRank, "GRAPH_DUMP_FILE_RANK", 0);
 NCCL_PARAM(CollNetNodeThreshold, "COLLNET_NODE_THRESHOLD", 2);
 NCCL_PARAM(NvbPreconnect, "NVB_PRECONNECT", 1);
 NCCL_PARAM(AllocP2pNetLLBuffers, "ALLOC_P2P_NET_LL_BUFFERS", 0);
+NCCL_PARAM(ProxyNetAffinity, "PROXY_NET_AFFINITY", 1);
+
+// Proxy threads mostly touch host buffers and NIC queues, so keep them close to
+// the NIC rather than to the GPU. NCCL_PROXY_CPUS (a mask in the same format as
+// local_cpus, e.g. "ff00") dedicates cores to them, and may point outside the
+// affinity of the application, e.g. to isolated cores.
+static ncclResult_t ncclProxySetAffinity(struct ncclComm* comm) {
+  const char* cpus = getenv("NCCL_PROXY_CPUS");
+  CPU_ZERO(&comm->proxyAffinity);
+  if (cpus) {
+    NCCLCHECK(ncclStrToCpuset(cpus, &comm->proxyAffinity));
+    if (CPU_COUNT(&comm->proxyAffinity) == 0) WARN("NCCL_PROXY_CPUS=%s has no CPU, ignoring", cpus);
+  } else if (ncclParamProxyNetAffinity()) {
+    NCCLCHECK(ncclTopoGetNetCpuAffinity(comm->topo, comm->rank, &comm->proxyAffinity));
+  }
+  if (CPU_COUNT(&comm->proxyAffinity) == 0) {
+    // Fall back to the affinity of the GPU, which the init thread passes on
+    memcpy(&comm->proxyAffinity, &comm->cpuAffinity, sizeof(cpu_set_t));
+  } else if (!CPU_EQUAL(&comm->proxyAffinity, &comm->cpuAffinity)) {
+    char affinityStr[sizeof(cpu_set_t)*2];
+    NCCLCHECK(ncclCpusetToStr(&comm->proxyAffinity, affinityStr));
+    INFO(NCCL_INIT, "Setting proxy affinity for GPU %d to %s", comm->cudaDev, affinityStr);
+  }
+  return ncclSuccess;
+}
+
+// Broadcast and Reduce re-root the tree of each channel at their root: the parent
+// of a rank is its neighbor on the path to the root, and its other neighbors are
+// its children. Gather the tree parent of every rank to find that neighbor.
+static ncclResult_t treeToRootSetup(ncclComm_t comm) {
+  ncclResult_t ret = ncclSuccess;
+  int rank = comm->rank, nRanks = comm->nRanks;
+  int (*ups)[MAXCHANNELS] = NULL;
+  NCCLCHECK(ncclCalloc(&ups, nRanks));
+  for (int c=0; c<comm->nChannels; c++) ups[rank][c] = comm->channels[c].tree.up;
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, ups, sizeof(*ups)), ret, exit);
+  for (int c=0; c<comm->nChannels; c++) {
+    struct ncclChannel* channel = comm->channels+c;
+    for (int root=0; root<nRanks; root++) {
+      int8_t dir = -1;
+      if (root != rank) {
+        // Walk up from the root until we reach one of our children, or the top of the tree
+        int x = root;
+        for (int d=0; d<nRanks && x != -1 && ups[x][c] != rank; d++) x = ups[x][c];
+        dir = 0;
+        for (int i=0; x != -1 && i<NCCL_MAX_TREE_ARITY; i++) if (channel->tree.down[i] == x) dir = 1+i;
+      }
+      channel->treeToRoot[root] = dir;
+    }
+  }
+exit:
+  free(ups);
+  return ret;
+}
+
+NCCL_PARAM(TopoRanksStripe, "TOPO_RANKS_STRIPE", 1);
+
+// Stripe of the AllGather3 exchange: the number of ranks of the smallest host, which bounds the size of
+// the smallest graph node.
+static ncclResult_t ag3StripeCompute(struct ncclComm* comm, int* stripe) {
+  int nranks = comm->nRanks;
+  uint64_t* hostHashes;
+  NCCLCHECK(ncclCalloc(&hostHashes, nranks));
+  for (int r=0; r<nranks; r++) hostHashes[r] = comm->peerInfo[r].hostHash;
+  std::sort(hostHashes, hostHashes+nranks);
+  *stripe = nranks;
+  for (int i=1, start=0; i<=nranks; i++) {
+    if (i == nranks || hostHashes[i] != hostHashes[start]) {
+      *stripe = std::min(*stripe, i-start);
+      start = i;
+    }
+  }
+  free(hostHashes);
+  if (ncclParamTopoRanksStripe() == 0) *stripe = 1;
+  return ncclSuccess;
+}
+
+// Most ranks on one GPU over all hosts, so that all ranks size their channels alike
+static ncclResult_t gpuRanksCompute(struct ncclComm* comm, int* maxGpuRanks) {
+  struct gpuKey { uint64_t hostHash; int64_t busId; };
+  int nranks = comm->nRanks;
+  struct gpuKey* keys;
+  NCCLCHECK(ncclCalloc(&keys, nranks));
+  for (int r=0; r<nranks; r++) keys[r] = { comm->peerInfo[r].hostHash, comm->peerInfo[r].busId };
+  auto same = [](const struct gpuKey& a, const struct gpuKey& b) { return a.hostHash == b.hostHash && a.busId == b.busId; };
+  std::sort(keys, keys+nranks, [](const struct gpuKey& a, const struct gpuKey& b) {
+    return a.hostHash != b.hostHash ? a.hostHash < b.hostHash : a.busId < b.busId;
+  });
+  *maxGpuRanks = 1;
+  for (int i=1, start=0; i<=nranks; i++) {
+    if (i == nranks || !same(keys[i], keys[start])) {
+      *maxGpuRanks = std::max(*maxGpuRanks, i-start);
+      start = i;
+    }
+  }
+  free(keys);
+  return ncclSuccess;
+}
+
+NCCL_PARAM(SplitReuseTopo, "SPLIT_REUSE_TOPO", 1);
+NCCL_PARAM(RuntimeConnect, "RUNTIME_CONNECT", 0);
+// Allow several ranks per GPU, which needs MPS for ranks of different processes to run concurrently
+NCCL_PARAM(SharedGpu, "SHARED_GPU", 0);
+
+// A split child can reuse the topology and graphs of its parent on a host where it has all the
+// GPUs of the parent, as detection and search would give the same result. Every rank of the
+// host reaches the same answer, which matters since ncclTopoGetSystem exchanges data between them.
+static bool splitReuseTopo(struct ncclComm* comm, struct ncclComm* parent) {
+  if (parent == NULL || parent->splitGraphs == NULL || ncclParamSplitReuseTopo() == 0) return false;
+  // Ranks sharing a GPU are matched to GPU nodes by bus ID
+  if (comm->sharedGpus || parent->sharedGpus) return false;
+  uint64_t hostHash = comm->peerInfo[comm->rank].hostHash;
+  int nLocal = 0, nParentLocal = 0;
+  for (int r=0; r<comm->nRanks; r++) if (comm->peerInfo[r].hostHash == hostHash) nLocal++;
+  for (int r=0; r<parent->nRanks; r++) if (parent->peerInfo[r].hostHash == hostHash) nParentLocal++;
+  // NICs are trimmed from single node communicators
+  return nLocal == nParentLocal && (nLocal == comm->nRanks) == (nParentLocal == parent->nRanks);
+}
 
 static ncclResult_t collNetTrySetup(ncclComm_t comm, ncclComm_t parent, struct ncclTopoGraph* collNetGraph) {
   ncclResult_t ret = ncclSuccess;
@@ -646,6 +1018,7 @@ static ncclResult_t collNetTrySetup(ncclComm_t comm, ncclComm_t parent, struct n
 
   if (share) {
     memcpy(comm->collNetSupportMatrix, parent->collNetSupportMatrix, sizeof(comm->collNetSupportMatrix));
+    memcpy(comm->collNetProxyReduce, parent->collNetProxyReduce, sizeof(comm->collNetProxyReduce));
   } else {
     do {
       /* Initialize all entries in collNetSupportMatrix[redop][type]. Since some
@@ -662,8 +1035,11 @@ static ncclResult_t collNetTrySetup(ncclComm_t comm, ncclComm_t parent, struct n
           for (int i=0; i < 4; i++) {
             int support = 0;
             NCCLCHECKGOTO(collNetReduceSupport(comm, (ncclDataType_t)ty, redops[i], &support), ret, matrix_end);
-            // bit 0 = not supported, bit 1 = supported
-            matrix[rank][redops[i]][ty] = 1<<(support ? 1 : 0);
+            // The proxy can sum fp32 and bf16 the network can only gather, see coll_net.cc
+            int proxy = !support && redops[i] == ncclSum && (ty == ncclFloat32 || ty == ncclBfloat16) &&
+              ncclParamCollNetProxyReduce() && comm->ncclCollNet->iallgather;
+            // bit 0 = not supported, bit 1 = supported, bit 2 = reduced by the proxy
+            matrix[rank][redops[i]][ty] = 1<<(support ? 1 : proxy ? 2 : 0);
           }
         }
       }
@@ -673,8 +1049,10 @@ static ncclResult_t collNetTrySetup(ncclComm_t comm, ncclComm_t parent, struct n
           int op = redops[i];
           uint8_t accum = 0;
           for (int r=0; r < comm->nRanks; r++) accum |= matrix[r][op][ty];
-          // We support (redop, type) if some rank supports it and no rank doesn't support it
-          comm->collNetSupportMatrix[op][ty] = (accum == (1<<1));
+          // We support (redop, type) if some rank supports it and no rank doesn't support it,
+          // all heads reducing it the same way
+          comm->collNetSupportMatrix[op][ty] = (accum == (1<<1)) || (accum == (1<<2));
+          if (op == ncclSum) comm->collNetProxyReduce[ty] = (accum == (1<<2));
         }
       }
     matrix_end:
@@ -745,7 +1123,7 @@ fail:
   goto exit;
 }
 
-static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* parent = NULL) {
+static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* parent, struct ncclInitTimers* timers) {
   // We use 2 AllGathers
   // 1. { peerInfo, comm, compCap}
   // 2. { nChannels, graphInfo, topoRanks }
@@ -765,18 +1143,34 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     int sameChannels;
     float bwIntra;
     float bwInter;
+    float latencyInter;
     int typeIntra;
     int typeInter;
   };
 
+  // Ring and tree heads are the same for all ranks of a node, so ranks of a node take turns
+  // sending them : the rank at index i in its node sends channels i, i+stripe, ... after
+  // the fixed part.
   struct allGatherInfo {
     struct graphInfo graphInfo[NCCL_NUM_ALGORITHMS];
-    struct ncclTopoRanks topoRanks;
+    int nodeFirstRank;
+    int ringPrev[MAXCHANNELS/2];
+    int ringNext[MAXCHANNELS/2];
+    uint64_t netSwitch;
   };
+#define NODE_FIELDS 6
+#define AG3_INFO(r) ((struct allGatherInfo*)(allGather3Data+(size_t)(r)*ag3Size))
+#define AG3_NODE(r) ((int*)(AG3_INFO(r)+1))
 
   int nChannelsOrig;
-  struct allGatherInfo *allGather3Data = NULL;
-  struct ncclTopoRanks** allTopoRanks = NULL;
+  char *allGather3Data = NULL;
+  size_t ag3Size;
+  int stripe, stripeChannels;
+  int nodeIndex;
+  int* allNodeData = NULL;
+  struct ncclTopoRanks* myTopoRanks = NULL;
+  struct ncclTopoRanks* nodeTopoRanks = NULL;
+  int *allRingPrev = NULL, *allRingNext = NULL;
   int *nodesFirstRank = NULL, *nodesTreePatterns = NULL;
   int *rings = NULL;
   int* nvbPeers = NULL;
@@ -784,19 +1178,31 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   int* pxnPeers = NULL;
   int *topParentLocalRanks = NULL;
   int tpProxyRank;
+  bool reuseTopo;
 
   // AllGather1 - begin
   NCCLCHECKGOTO(ncclCalloc(&comm->peerInfo, nranks+1), ret, fail); // Extra rank to represent CollNet root
   NCCLCHECKGOTO(fillInfo(comm, comm->peerInfo+rank, comm->commHash), ret, fail);
   NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, comm->peerInfo, sizeof(struct ncclPeerInfo)), ret, fail);
 
+  comm->sharedGpus = false;
   for (int i = 0; i < nranks; i++) {
-    if ((i != rank) && (comm->peerInfo[i].hostHash == comm->peerInfo[rank].hostHash) && (comm->peerInfo[i].busId == comm->peerInfo[rank].busId)) {
-      WARN("Duplicate GPU detected : rank %d and rank %d both on CUDA device %lx", rank, i, comm->peerInfo[rank].busId);
-      ret = ncclInvalidUsage;
-      goto fail;
+    if (comm->peerInfo[i].hostHash != comm->peerInfo[rank].hostHash) continue;
+    for (int j = 0; j < i; j++) {
+      if ((comm->peerInfo[j].hostHash != comm->peerInfo[i].hostHash) || (comm->peerInfo[j].busId != comm->peerInfo[i].busId)) continue;
+      if ((i == rank || j == rank) && ncclParamSharedGpu() == 0) {
+        WARN("Duplicate GPU detected : rank %d and rank %d both on CUDA device %lx (NCCL_SHARED_GPU=1 allows it, e.g. under MPS)", rank, i == rank ? j : i, comm->peerInfo[rank].busId);
+        ret = ncclInvalidUsage;
+        goto fail;
+      }
+      comm->sharedGpus = true;
     }
   }
+  NCCLCHECKGOTO(gpuRanksCompute(comm, &comm->maxGpuRanks), ret, fail);
+  if (comm->sharedGpus) INFO(NCCL_INIT, "Several local ranks share a GPU");
+  if (comm->maxGpuRanks > 1) INFO(NCCL_INIT, "Up to %d ranks share a GPU, channels are split between them", comm->maxGpuRanks);
+  comm->allBlocking = true;
+  for (int i = 0; i < nranks; i++) comm->allBlocking &= comm->peerInfo[i].blocking != 0;
   // AllGather1 - end
 
   do {
@@ -804,6 +1210,14 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     int intraProcRank0 = -1, intraProcRank = -1, intraProcRanks = 0;
     for (int i = 0; i < nranks; i++) comm->minCompCap = std::min(comm->minCompCap, comm->peerInfo[rank].cudaCompCap);
     for (int i = 0; i < nranks; i++) comm->maxCompCap = std::max(comm->maxCompCap, comm->peerInfo[rank].cudaCompCap);
+    // A rank which could not check a path does not veto it
+    comm->ll128Tested = 0;
+    comm->ll128Passed = ~0;
+    for (int i = 0; i < nranks; i++) {
+      comm->ll128Tested |= comm->peerInfo[i].ll128Tested;
+      comm->ll128Passed &= comm->peerInfo[i].ll128Passed | ~comm->peerInfo[i].ll128Tested;
+    }
+    comm->ll128Passed &= comm->ll128Tested;
     for (int i = 0; i < nranks; i++) {
       if ((comm->peerInfo[i].hostHash == comm->peerInfo[rank].hostHash)
           && (comm->peerInfo[i].pidHash == comm->peerInfo[rank].pidHash)) {
@@ -835,23 +1249,30 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     comm->intraBarrierCounter = 0;
     comm->intraBarrierGate = 0;
   } while(0);
+  ncclInitTimerStop(timers, ncclInitPhaseAllGather1);
 
-  // Topo detection / System graph creation
-  NCCLCHECKGOTO(ncclTopoGetSystem(comm, &comm->topo), ret, fail);
-  // Compute paths between GPUs and NICs
-  NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
-  // Remove inaccessible GPUs and unused NICs
-  NCCLCHECKGOTO(ncclTopoTrimSystem(comm->topo, comm), ret, fail);
-  // Recompute paths after trimming
-  NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
-  // Init search
-  NCCLCHECKGOTO(ncclTopoSearchInit(comm->topo), ret, fail);
+  reuseTopo = splitReuseTopo(comm, parent);
+  if (reuseTopo) {
+    NCCLCHECKGOTO(ncclTopoSplitSystem(comm, parent, &comm->topo), ret, fail);
+  } else {
+    // Topo detection / System graph creation
+    NCCLCHECKGOTO(ncclTopoGetSystem(comm, &comm->topo), ret, fail);
+    ncclInitTimerStop(timers, ncclInitPhaseTopo);
+    // Compute paths between GPUs and NICs
+    NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
+    // Remove inaccessible GPUs and unused NICs, updating paths
+    NCCLCHECKGOTO(ncclTopoTrimSystem(comm->topo, comm), ret, fail);
+    // Init search
+    NCCLCHECKGOTO(ncclTopoSearchInit(comm->topo), ret, fail);
+  }
   // Print final topology
   NCCLCHECKGOTO(ncclTopoPrint(comm->topo), ret, fail);
+  ncclInitTimerStop(timers, reuseTopo ? ncclInitPhaseTopo : ncclInitPhasePaths);
 
   // Set Affinity to a CPU local the our GPU, so that all memory we allocate
   // on the host is local.
   NCCLCHECKGOTO(ncclTopoGetCpuAffinity(comm->topo, comm->rank, &comm->cpuAffinity), ret, fail);
+  NCCLCHECKGOTO(ncclProxySetAffinity(comm), ret, fail);
   if (CPU_COUNT(&comm->cpuAffinity)) {
     sched_getaffinity(0, sizeof(cpu_set_t), &affinitySave);
     sched_setaffinity(0, sizeof(cpu_set_t), &comm->cpuAffinity);
@@ -877,39 +1298,72 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   ringGraph.collNet = 0;
   ringGraph.minChannels = 1;
   ringGraph.maxChannels = MAXCHANNELS/2;
-  NCCLCHECKGOTO(ncclTopoCompute(comm->topo, &ringGraph), ret, fail);
-  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &ringGraph), ret, fail);
 
   treeGraph.id = 1;
   treeGraph.pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
   treeGraph.collNet = 0;
-  treeGraph.minChannels = ringGraph.nChannels;
-  treeGraph.maxChannels = ringGraph.nChannels;
-  NCCLCHECKGOTO(ncclTopoCompute(comm->topo, &treeGraph), ret, fail);
-  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &treeGraph), ret, fail);
 
   collNetGraph.id = 2;
   collNetGraph.pattern = NCCL_TOPO_PATTERN_TREE;
   collNetGraph.collNet = 1;
-  collNetGraph.minChannels = collNetGraph.maxChannels = ringGraph.nChannels;
-  if (comm->collNetSupport) {
-    NCCLCHECKGOTO(ncclTopoCompute(comm->topo, &collNetGraph), ret, fail);
-    NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &collNetGraph), ret, fail);
-  } else {
-    collNetGraph.nChannels = 0;
-  }
 
   nvlsGraph.id = 3;
   nvlsGraph.pattern = NCCL_TOPO_PATTERN_NVLS;
   nvlsGraph.collNet = 0;
   nvlsGraph.minChannels = 1;
   nvlsGraph.maxChannels = MAXCHANNELS;
-  if (comm->nvlsSupport) {
-    NCCLCHECKGOTO(ncclTopoCompute(comm->topo, &nvlsGraph), ret, fail);
-    NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &nvlsGraph), ret, fail);
-  } else {
-    nvlsGraph.nChannels = 0;
+
+  {
+    struct ncclTopoGraph* searchGraphs[4] = { &ringGraph, &treeGraph, &collNetGraph, &nvlsGraph };
+    int cached = 0;
+    if (reuseTopo && parent->splitGraphsCollNet == comm->collNetSupport && parent->splitGraphsNvls == comm->nvlsSupport) {
+      for (int g=0; g<4; g++) NCCLCHECKGOTO(ncclTopoSplitGraph(comm, parent, parent->splitGraphs+g, searchGraphs[g]), ret, fail);
+    } else {
+      NCCLCHECKGOTO(ncclTopoGraphCacheLoad(comm, 4, searchGraphs, &cached), ret, fail);
+      if (cached) {
+        treeGraph.minChannels = treeGraph.maxChannels = ringGraph.nChannels;
+        collNetGraph.minChannels = collNetGraph.maxChannels = ringGraph.nChannels;
+      } else {
+        // Ring and NVLS searches are independent ; tree and collnet then depend on the ring.
+        struct ncclTopoGraph* pass[2];
+        int npass = 0;
+        pass[npass++] = &ringGraph;
+        if (comm->nvlsSupport) pass[npass++] = &nvlsGraph;
+        else nvlsGraph.nChannels = 0;
+        NCCLCHECKGOTO(ncclTopoComputeConcurrent(comm->topo, npass, pass), ret, fail);
+
+        npass = 0;
+        treeGraph.minChannels = ringGraph.nChannels;
+        treeGraph.maxChannels = ringGraph.nChannels;
+        pass[npass++] = &treeGraph;
+        collNetGraph.minChannels = collNetGraph.maxChannels = ringGraph.nChannels;
+        if (comm->collNetSupport) pass[npass++] = &collNetGraph;
+        else collNetGraph.nChannels = 0;
+        NCCLCHECKGOTO(ncclTopoComputeConcurrent(comm->topo, npass, pass), ret, fail);
+        NCCLCHECKGOTO(ncclTopoGraphCacheSave(comm, 4, searchGraphs), ret, fail);
+      }
+    }
+    if (ncclParamSplitReuseTopo()) {
+      comm->splitGraphs = ncclMemoryStackAlloc<struct ncclTopoGraph>(&comm->memPermanent, 4);
+      for (int g=0; g<4; g++) memcpy(comm->splitGraphs+g, searchGraphs[g], sizeof(struct ncclTopoGraph));
+      comm->splitGraphsCollNet = comm->collNetSupport;
+      comm->splitGraphsNvls = comm->nvlsSupport;
+    }
   }
+  if (comm->config.channelOffset != 0) {
+    // Children sharing the channels of their parent must keep its order.
+    if (comm->sharedRes->owner != comm) {
+      INFO(NCCL_INIT, "Ignoring channelOffset %d for a communicator sharing resources with its parent", comm->config.channelOffset);
+    } else {
+      NCCLCHECKGOTO(ncclTopoRotateChannels(comm->topo, &ringGraph, comm->config.channelOffset), ret, fail);
+      NCCLCHECKGOTO(ncclTopoRotateChannels(comm->topo, &treeGraph, comm->config.channelOffset), ret, fail);
+      if (comm->collNetSupport) NCCLCHECKGOTO(ncclTopoRotateChannels(comm->topo, &collNetGraph, comm->config.channelOffset), ret, fail);
+    }
+  }
+  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &ringGraph), ret, fail);
+  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &treeGraph), ret, fail);
+  if (comm->collNetSupport) NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &collNetGraph), ret, fail);
+  if (comm->nvlsSupport) NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, &nvlsGraph), ret, fail);
 
   // Initialize num P2P LL buffers for this communicator
   comm->allocP2pNetLLBuffers = ncclParamAllocP2pNetLLBuffers() == 1;
@@ -918,24 +1372,49 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     struct ncclTopoGraph* dumpGraphs[4] = { &ringGraph, &treeGraph, &collNetGraph, &nvlsGraph };
     NCCLCHECKGOTO(ncclTopoDumpGraphs(comm->topo, 4, dumpGraphs), ret, fail);
   }
+  ncclInitTimerStop(timers, ncclInitPhaseSearch);
 
   // AllGather3 - begin
-  NCCLCHECKGOTO(ncclCalloc(&allGather3Data, nranks), ret, fail);
+  NCCLCHECKGOTO(ag3StripeCompute(comm, &stripe), ret, fail);
+  // The ranks of our graph node are the GPUs left in our topology
+  NCCLCHECKGOTO(ncclTopoGetRankIndex(comm->topo, rank, &nodeIndex), ret, fail);
+  stripeChannels = DIVUP(MAXCHANNELS/2, stripe);
+  ag3Size = sizeof(struct allGatherInfo) + ROUNDUP(stripeChannels*NODE_FIELDS*sizeof(int), sizeof(uint64_t));
+  NCCLCHECKGOTO(ncclCalloc(&allGather3Data, nranks*ag3Size), ret, fail);
 
   for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
-    allGather3Data[rank].graphInfo[a].pattern = graphs[a]->pattern;
-    allGather3Data[rank].graphInfo[a].nChannels = graphs[a]->nChannels;
-    allGather3Data[rank].graphInfo[a].sameChannels = graphs[a]->sameChannels;
-    allGather3Data[rank].graphInfo[a].bwIntra = graphs[a]->bwIntra;
-    allGather3Data[rank].graphInfo[a].bwInter = graphs[a]->bwInter;
-    allGather3Data[rank].graphInfo[a].typeIntra = graphs[a]->typeIntra;
-    allGather3Data[rank].graphInfo[a].typeInter = graphs[a]->typeInter;
+    AG3_INFO(rank)->graphInfo[a].pattern = graphs[a]->pattern;
+    AG3_INFO(rank)->graphInfo[a].nChannels = graphs[a]->nChannels;
+    AG3_INFO(rank)->graphInfo[a].sameChannels = graphs[a]->sameChannels;
+    AG3_INFO(rank)->graphInfo[a].bwIntra = graphs[a]->bwIntra;
+    AG3_INFO(rank)->graphInfo[a].bwInter = graphs[a]->bwInter;
+    AG3_INFO(rank)->graphInfo[a].latencyInter = graphs[a]->latencyInter;
+    AG3_INFO(rank)->graphInfo[a].typeIntra = graphs[a]->typeIntra;
+    AG3_INFO(rank)->graphInfo[a].typeInter = graphs[a]->typeInter;
   }
 
   comm->nChannels = std::min(treeGraph.nChannels, ringGraph.nChannels);
-  NCCLCHECKGOTO(ncclTopoPreset(comm, graphs, &allGather3Data[rank].topoRanks), ret, fail);
-
-  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allGather3Data, sizeof(*allGather3Data)), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&myTopoRanks, 1), ret, fail);
+  NCCLCHECKGOTO(ncclTopoPreset(comm, graphs, myTopoRanks), ret, fail);
+  AG3_INFO(rank)->nodeFirstRank = myTopoRanks->ringRecv[0];
+  memcpy(AG3_INFO(rank)->ringPrev, myTopoRanks->ringPrev, sizeof(AG3_INFO(rank)->ringPrev));
+  memcpy(AG3_INFO(rank)->ringNext, myTopoRanks->ringNext, sizeof(AG3_INFO(rank)->ringNext));
+  AG3_INFO(rank)->netSwitch = myTopoRanks->netSwitch;
+  // Ranks past the stripe on larger nodes have nothing to send
+  for (int s=0; nodeIndex<stripe && s<stripeChannels; s++) {
+    int c = s*stripe+nodeIndex;
+    if (c >= MAXCHANNELS/2) break;
+    int* node = AG3_NODE(rank)+s*NODE_FIELDS;
+    node[0] = myTopoRanks->ringRecv[c];
+    node[1] = myTopoRanks->ringSend[c];
+    node[2] = myTopoRanks->treeToParent[c];
+    node[3] = myTopoRanks->treeToChild0[c];
+    node[4] = myTopoRanks->treeToChild1[c];
+    node[5] = myTopoRanks->nvlsHeads[c];
+  }
+
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allGather3Data, ag3Size), ret, fail);
+  ncclInitTimerStop(timers, ncclInitPhaseAllGather3);
 
   // Determine nNodes, firstRanks, ...
   NCCLCHECKGOTO(ncclCalloc(&nodesFirstRank, nranks), ret, fail);
@@ -943,13 +1422,13 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   NCCLCHECKGOTO(ncclCalloc(&comm->rankToNode, comm->nRanks), ret, fail);
   for (int r=0; r<nranks; r++) {
     int node;
-    int firstRank = allGather3Data[r].topoRanks.ringRecv[0];
+    int firstRank = AG3_INFO(r)->nodeFirstRank;
     for (node=0; node<comm->nNodes && nodesFirstRank[node] != firstRank; node++);
     if (node == comm->nNodes) {
       comm->nNodes++;
       nodesFirstRank[node] = firstRank;
       // Record tree pattern of each node as they can be different depending on sm arch
-      nodesTreePatterns[node] = allGather3Data[r].graphInfo[NCCL_ALGO_TREE].pattern;
+      nodesTreePatterns[node] = AG3_INFO(r)->graphInfo[NCCL_ALGO_TREE].pattern;
     }
     comm->rankToNode[r] = node;
   }
@@ -972,6 +1451,24 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     int node = comm->rankToNode[r];
     comm->nodeRanks[node].localRankToRank[comm->nodeRanks[node].localRanks++] = r;
   }
+  // A host split into several graph nodes can have nodes smaller than the stripe, which then miss
+  // channels. All ranks see it from the same data and exchange every channel again.
+  for (int n=0; n<comm->nNodes; n++) {
+    if (comm->nodeRanks[n].localRanks >= stripe) continue;
+    INFO(NCCL_INIT, "Node %d has %d ranks, less than the AllGather3 stripe %d, exchanging all channels", n, comm->nodeRanks[n].localRanks, stripe);
+    NCCLCHECKGOTO(ncclCalloc(&allNodeData, (size_t)nranks*MAXCHANNELS/2*NODE_FIELDS), ret, fail);
+    for (int c=0; c<MAXCHANNELS/2; c++) {
+      int* node = allNodeData+((size_t)rank*MAXCHANNELS/2+c)*NODE_FIELDS;
+      node[0] = myTopoRanks->ringRecv[c];
+      node[1] = myTopoRanks->ringSend[c];
+      node[2] = myTopoRanks->treeToParent[c];
+      node[3] = myTopoRanks->treeToChild0[c];
+      node[4] = myTopoRanks->treeToChild1[c];
+      node[5] = myTopoRanks->nvlsHeads[c];
+    }
+    NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allNodeData, MAXCHANNELS/2*NODE_FIELDS*sizeof(int)), ret, fail);
+    break;
+  }
   comm->node = comm->rankToNode[rank];
   comm->localRankToRank = comm->nodeRanks[comm->node].localRankToRank;
   comm->localRank = comm->rankToLocalRank[rank];
@@ -988,17 +1485,16 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   }
 
   nChannelsOrig = comm->nChannels;
-  NCCLCHECKGOTO(ncclCalloc(&allTopoRanks, comm->nRanks), ret, fail);
   for (int i=0; i<nranks; i++) {
-    allTopoRanks[i] = &allGather3Data[i].topoRanks;
     // Make sure we align all ranks so that the tuning is consistent across ranks
     for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
-      graphs[a]->nChannels = std::min(allGather3Data[i].graphInfo[a].nChannels, graphs[a]->nChannels);
-      graphs[a]->sameChannels = std::min(allGather3Data[i].graphInfo[a].sameChannels, graphs[a]->sameChannels);
-      graphs[a]->bwIntra = std::min(allGather3Data[i].graphInfo[a].bwIntra, graphs[a]->bwIntra);
-      graphs[a]->bwInter = std::min(allGather3Data[i].graphInfo[a].bwInter, graphs[a]->bwInter);
-      graphs[a]->typeIntra = std::max(allGather3Data[i].graphInfo[a].typeIntra, graphs[a]->typeIntra);
-      graphs[a]->typeInter = std::max(allGather3Data[i].graphInfo[a].typeInter, graphs[a]->typeInter);
+      graphs[a]->nChannels = std::min(AG3_INFO(i)->graphInfo[a].nChannels, graphs[a]->nChannels);
+      graphs[a]->sameChannels = std::min(AG3_INFO(i)->graphInfo[a].sameChannels, graphs[a]->sameChannels);
+      graphs[a]->bwIntra = std::min(AG3_INFO(i)->graphInfo[a].bwIntra, graphs[a]->bwIntra);
+      graphs[a]->bwInter = std::min(AG3_INFO(i)->graphInfo[a].bwInter, graphs[a]->bwInter);
+      graphs[a]->latencyInter = std::max(AG3_INFO(i)->graphInfo[a].latencyInter, graphs[a]->latencyInter);
+      graphs[a]->typeIntra = std::max(AG3_INFO(i)->graphInfo[a].typeIntra, graphs[a]->typeIntra);
+      graphs[a]->typeInter = std::max(AG3_INFO(i)->graphInfo[a].typeInter, graphs[a]->typeInter);
     }
     if (graphs[NCCL_ALGO_COLLNET_CHAIN]->nChannels == 0) comm->collNetSupport = 0;
     if (graphs[NCCL_ALGO_NVLS]->nChannels == 0) comm->nvlsSupport = 0;
@@ -1027,8 +1523,36 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     }
   }
 
+  // Put the node data back together from the ranks of each node
+  NCCLCHECKGOTO(ncclCalloc(&nodeTopoRanks, comm->nNodes), ret, fail);
+  for (int n=0; n<comm->nNodes; n++) {
+    int first = nodesFirstRank[n];
+    for (int c=0; c<MAXCHANNELS/2; c++) {
+      int* node = allNodeData ? allNodeData+((size_t)first*MAXCHANNELS/2+c)*NODE_FIELDS :
+        AG3_NODE(comm->nodeRanks[n].localRankToRank[c%stripe])+(c/stripe)*NODE_FIELDS;
+      nodeTopoRanks[n].ringRecv[c] = node[0];
+      nodeTopoRanks[n].ringSend[c] = node[1];
+      nodeTopoRanks[n].treeToParent[c] = node[2];
+      nodeTopoRanks[n].treeToChild0[c] = node[3];
+      nodeTopoRanks[n].treeToChild1[c] = node[4];
+      nodeTopoRanks[n].nvlsHeads[c] = node[5];
+    }
+    nodeTopoRanks[n].netSwitch = AG3_INFO(first)->netSwitch;
+  }
+  NCCLCHECKGOTO(ncclCalloc(&allRingPrev, nranks*MAXCHANNELS), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&allRingNext, nranks*MAXCHANNELS), ret, fail);
+  for (int c=0; c<comm->nChannels; c++) {
+    for (int r=0; r<nranks; r++) {
+      allRingPrev[c*nranks+r] = AG3_INFO(r)->ringPrev[c];
+      allRingNext[c*nranks+r] = AG3_INFO(r)->ringNext[c];
+    }
+  }
+
   NCCLCHECKGOTO(ncclCalloc(&rings, nranks*MAXCHANNELS), ret, fail);
-  NCCLCHECKGOTO(ncclTopoPostset(comm, nodesFirstRank, nodesTreePatterns, allTopoRanks, rings, graphs), ret, fail);
+  NCCLCHECKGOTO(ncclTopoPostset(comm, nodesTreePatterns, nodeTopoRanks, allRingPrev, allRingNext, rings, graphs), ret, fail);
+#undef AG3_NODE
+#undef AG3_INFO
+#undef NODE_FIELDS
   // AllGather3 - end
 
   TRACE(NCCL_INIT, "rank %d nranks %d - BUILT %d TREES/RINGS", rank, nranks, comm->nChannels);
@@ -1037,14 +1561,16 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   line[0]='\0';
   for (int c=0; c<comm->nChannels; c++) {
     struct ncclTree* tree = &comm->channels[c].tree;
-    snprintf(line+strlen(line), 1023-strlen(line), " [%d] %d/%d/%d->%d->%d",
-        c, tree->down[0], tree->down[1], tree->down[2], rank, tree->up);
+    snprintf(line+strlen(line), 1023-strlen(line), " [%d] %d", c, tree->down[0]);
+    for (int i=1; i<comm->treeArity+1 && i<NCCL_MAX_TREE_ARITY; i++) snprintf(line+strlen(line), 1023-strlen(line), "/%d", tree->down[i]);
+    snprintf(line+strlen(line), 1023-strlen(line), "->%d->%d", rank, tree->up);
     INFO(NCCL_GRAPH, "Ring %02d : %d -> %d -> %d", c, comm->channels[c].ring.prev, comm->rank, comm->channels[c].ring.next);
   }
   line[1023] = '\0';
   INFO(NCCL_INIT, "Trees%s", line);
 
-  NCCLCHECKGOTO(computeBuffSizes(comm), ret, fail);
+  NCCLCHECKGOTO(computeBuffSizes(comm, &ringGraph), ret, fail);
+  NCCLCHECKGOTO(memBudgetFit(comm, graphs), ret, fail);
 
   // Compute nChannels per peer for p2p
   NCCLCHECKGOTO(ncclTopoComputeP2pChannels(comm), ret, fail);
@@ -1066,49 +1592,41 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   }
   comm->topParentLocalRanks = topParentLocalRanks;
 
+  ncclInitTimerStop(timers, ncclInitPhaseSetup);
+
   // Launch proxy service thread, after this, the proxy calls can be used.
   NCCLCHECKGOTO(ncclProxyCreate(comm), ret, fail);
+  ncclInitTimerStop(timers, ncclInitPhaseProxy);
 
-  // Connect with prev/next for each ring
-  for (int c=0; c<comm->nChannels; c++) {
-    struct ncclChannel* channel = comm->channels+c;
-    NCCLCHECKGOTO(setupChannel(comm, c, rank, nranks, rings+c*nranks), ret, fail);
-    if (comm->nRanks == 1) continue;
-    NCCLCHECKGOTO(ncclTransportP2pConnect(comm, c, 1, &channel->ring.prev, 1, &channel->ring.next, 0), ret, fail);
-  }
-  NCCLCHECKGOTO(ncclTransportP2pSetup(comm, &ringGraph, 0), ret, fail);
-  INFO(NCCL_INIT, "Connected all rings");
-
-  // Connect Trees
-  for (int c=0; c<comm->nChannels; c++) {
-    struct ncclChannel* channel = comm->channels+c;
-    if (comm->nRanks == 1) continue;
-    NCCLCHECKGOTO(ncclTransportP2pConnect(comm, c, NCCL_MAX_TREE_ARITY, channel->tree.down, 1, &channel->tree.up, 0), ret, fail);
-    NCCLCHECKGOTO(ncclTransportP2pConnect(comm, c, 1, &channel->tree.up, NCCL_MAX_TREE_ARITY, channel->tree.down, 0), ret, fail);
-  }
-  NCCLCHECKGOTO(ncclTransportP2pSetup(comm, &treeGraph, 0), ret, fail);
-  INFO(NCCL_INIT, "Connected all trees");
+  for (int c=0; c<comm->nChannels; c++) NCCLCHECKGOTO(setupChannel(comm, c, rank, nranks, rings+c*nranks), ret, fail);
+  NCCLCHECKGOTO(treeToRootSetup(comm), ret, fail);
 
   // Setup NVLS
   NCCLCHECKGOTO(ncclNvlsSetup(comm, parent), ret, fail);
-  // And NVLS trees if needed
-  if (comm->nvlsSupport && comm->localRanks > 1) {
-    for (int c=0; c<comm->nvlsChannels; c++) {
-      struct ncclChannel* channel = comm->channels+c;
-      NCCLCHECKGOTO(ncclTransportP2pConnect(comm, c, NCCL_MAX_NVLS_TREE_ARITY, channel->nvls.treeDown, 1, &channel->nvls.treeUp, 0), ret, fail);
-      NCCLCHECKGOTO(ncclTransportP2pConnect(comm, c, 1, &channel->nvls.treeUp, NCCL_MAX_NVLS_TREE_ARITY, channel->nvls.treeDown, 0), ret, fail);
-    }
-    NCCLCHECKGOTO(ncclTransportP2pSetup(comm, &nvlsGraph, 0), ret, fail);
-    INFO(NCCL_INIT, "Connected NVLS tree");
+
+  // Connect rings, trees and NVLS trees now, or leave it to the first collective so that
+  // init returns sooner and p2p operations can start.
+  comm->runtimeConnect = ncclParamRuntimeConnect();
+  if (comm->runtimeConnect) {
+    comm->connectGraphs = ncclMemoryStackAlloc<struct ncclTopoGraph>(&comm->memPermanent, 3);
+    memcpy(comm->connectGraphs+0, &ringGraph, sizeof(struct ncclTopoGraph));
+    memcpy(comm->connectGraphs+1, &treeGraph, sizeof(struct ncclTopoGraph));
+    memcpy(comm->connectGraphs+2, &nvlsGraph, sizeof(struct ncclTopoGraph));
+    INFO(NCCL_INIT, "Rings and trees will be connected by the first collective");
+  } else {
+    NCCLCHECKGOTO(ncclTransportCollConnect(comm, &ringGraph, &treeGraph, &nvlsGraph), ret, fail);
   }
 
   // Check if we can setup CollNet
   if (comm->collNetSupport > 0) collNetTrySetup(comm, parent, &collNetGraph);
 
   TRACE(NCCL_INIT, "rank %d nranks %d - CONNECTED %d RINGS AND TREES", rank, nranks, comm->nChannels);
+  ncclInitTimerStop(timers, ncclInitPhaseConnect);
 
   // Compute time models for algorithm and protocol combinations
   NCCLCHECKGOTO(ncclTopoTuneModel(comm, comm->minCompCap, comm->maxCompCap, graphs), ret, fail);
+  NCCLCHECKGOTO(ncclTunerPluginLoad(comm), ret, fail);
+  NCCLCHECKGOTO(ncclAutotuneInit(comm), ret, fail);
 
   INFO(NCCL_INIT, "%d coll channels, %d nvls channels, %d p2p channels, %d p2p channels per peer", comm->nChannels, comm->nvlsChannels, comm->p2pnChannels, comm->p2pnChannelsPerPeer);
 
@@ -1155,6 +1673,7 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     }
     assert(i == tasks->p2pOrderSteps);
   } while (0);
+  ncclInitTimerStop(timers, ncclInitPhaseTune);
 
   if (ncclParamNvbPreconnect()) {
     // Connect p2p when using NVB path
@@ -1196,6 +1715,8 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     }
   }
 
+  ncclInitTimerStop(timers, ncclInitPhaseProxyConnect);
+
   if (comm->intraRank == 0) { // Load ncclParamLaunchMode
     char* str = getenv("NCCL_LAUNCH_MODE");
     enum ncclLaunchMode mode, modeOld;
@@ -1212,12 +1733,19 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     }
   }
 
+  // Optional collectives which exchange their buffers, on all ranks or none
+  NCCLCHECKGOTO(ncclShotArInit(comm), ret, fail);
+  NCCLCHECKGOTO(ncclCeCollInit(comm), ret, fail);
+  NCCLCHECKGOTO(ncclIbMcastInit(comm), ret, fail);
+  NCCLCHECKGOTO(ncclHostCollInit(comm), ret, fail);
+
   // Call devCommSetup before the last barrier, making sure we don't have a thread running in front and starting to
   // launch NCCL kernels before all cuda mem allocation is complete. That could cause a deadlock.
   NCCLCHECKGOTO(devCommSetup(comm), ret, fail);
 
   /* Local intra-node barrier */
   NCCLCHECKGOTO(bootstrapBarrier(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, comm->localRankToRank[0]), ret, fail);
+  ncclInitTimerStop(timers, ncclInitPhaseDevComm);
 
   // We should have allocated all buffers, collective fifos, ... we can
   // restore the affinity.
@@ -1229,7 +1757,11 @@ exit:
    * attach the proxy ops pool of parent at any time; otherwise, unlink it here to make sure the pool will be
    * properly cleaned up. */
   if (comm->sharedRes->owner == comm && !comm->config.splitShare && ret == ncclSuccess) ncclProxyShmUnlink(comm);
-  free(allTopoRanks);
+  free(allNodeData);
+  free(myTopoRanks);
+  free(nodeTopoRanks);
+  free(allRingPrev);
+  free(allRingNext);
   free(nodesTreePatterns);
   free(nodesFirstRank);
   free(allGather3Data);
@@ -1241,11 +1773,59 @@ fail:
   goto exit;
 }
 
+// 1 : print the time of each init phase on every rank. 2 : also gather them on rank 0
+// and print the min/avg/max of each phase over ranks, with the slowest rank.
+NCCL_PARAM(InitTimers, "INIT_TIMERS", 0);
+
+static const char* initPhaseStr[ncclNumInitPhases] = { "Kernels", "Bootstrap", "AllGather1", "Topo", "Paths",
+  "Search", "AllGather3", "Setup", "Proxy", "Connect", "Tune", "ProxyConnect", "DevComm" };
+
+static ncclResult_t initTimersReport(struct ncclComm* comm, struct ncclInitTimers* timers) {
+  ncclResult_t ret = ncclSuccess;
+  int64_t level = ncclParamInitTimers();
+  double total = 0;
+  char line[1024];
+  int len = 0;
+  double* all = NULL;
+
+  if (level == 0) return ncclSuccess;
+  for (int p=0; p<ncclNumInitPhases; p++) {
+    total += timers->us[p];
+    len += snprintf(line+len, sizeof(line)-len, " %s %.1f", initPhaseStr[p], timers->us[p]/1e3);
+  }
+  INFO(NCCL_INIT, "Init timers (ms) rank %d : total %.1f,%s", comm->rank, total/1e3, line);
+  if (level < 2) return ncclSuccess;
+
+  NCCLCHECKGOTO(ncclCalloc(&all, comm->nRanks*ncclNumInitPhases), ret, exit);
+  memcpy(all+comm->rank*ncclNumInitPhases, timers->us, sizeof(timers->us));
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, all, sizeof(timers->us)), ret, exit);
+  if (comm->rank == 0) {
+    for (int p=0; p<ncclNumInitPhases; p++) {
+      double min = all[p], max = all[p], sum = 0;
+      int maxRank = 0;
+      for (int r=0; r<comm->nRanks; r++) {
+        double us = all[r*ncclNumInitPhases+p];
+        min = std::min(min, us);
+        if (us > max) { max = us; maxRank = r; }
+        sum += us;
+      }
+      INFO(NCCL_INIT, "Init timers (ms) %-12s min %.1f avg %.1f max %.1f (rank %d)", initPhaseStr[p], min/1e3, sum/comm->nRanks/1e3, max/1e3, maxRank);
+    }
+  }
+exit:
+  free(all);
+  return ret;
+}
+
 NCCL_PARAM(SetStackSize, "SET_STACK_SIZE", 0);
 NCCL_PARAM(CGAClusterSize, "CGA_CLUSTER_SIZE", NCCL_CONFIG_UNDEF_INT);
 // Match config max/minCTAs
 NCCL_PARAM(MaxCTAs, "MAX_CTAS", NCCL_CONFIG_UNDEF_INT);
 NCCL_PARAM(MinCTAs, "MIN_CTAS", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(ChannelOffset, "CHANNEL_OFFSET", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(LowShmem, "LOW_SHMEM", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(NetBwLimit, "NET_BW_LIMIT", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(MemBudget, "MEM_BUDGET", NCCL_CONFIG_UNDEF_INT);
 #define NCCL_MAX_CGA_CLUSTER_SIZE 8
 
 struct ncclCommInitRankAsyncJob {
@@ -1259,8 +1839,16 @@ struct ncclCommInitRankAsyncJob {
   // for ncclCommSplit
   struct ncclComm* parent;
   int color, key;
+  // for ncclCommShrink, ranks of the parent which are kept, in order
+  int* shrinkRanks;
 };
 
+static void commInitRankJobFree(void* job_) {
+  struct ncclCommInitRankAsyncJob* job = (struct ncclCommInitRankAsyncJob*)job_;
+  free(job->shrinkRanks);
+  free(job);
+}
+
 struct ncclCommFinalizeAsyncJob {
   struct ncclAsyncJob base;
   ncclComm_t comm;
@@ -1323,7 +1911,9 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
   int cudaDev = job->cudaDev;
   int* parentRanks = NULL;
   int cudaArch;
+  struct ncclInitTimers timers;
 
+  ncclInitTimerStart(&timers);
   CUDACHECKGOTO(cudaSetDevice(cudaDev), res, fail);
   CUDACHECKGOTO(cudaDeviceGetAttribute(&archMajor, cudaDevAttrComputeCapabilityMajor, cudaDev), res, fail);
   CUDACHECKGOTO(cudaDeviceGetAttribute(&archMinor, cudaDevAttrComputeCapabilityMinor, cudaDev), res, fail);
@@ -1336,13 +1926,20 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
     TRACE(NCCL_INIT, "Setting cudaLimitStackSize to %zi", maxLocalSizeBytes);
     CUDACHECKIGNORE(cudaDeviceSetLimit(cudaLimitStackSize, maxLocalSizeBytes));
   }
+  ncclInitTimerStop(&timers, ncclInitPhaseKernels);
 
   if (job->parent) {
     NCCLCHECKGOTO(ncclCalloc(&parentRanks, job->parent->nRanks), res, fail);
-    NCCLCHECKGOTO(commGetSplitInfo(comm, job->parent, job->color, job->key, &job->nranks, &job->myrank, parentRanks), res, fail);
-    // Negative color does not create a new comm object. We needed to take part in the allgather, but we're done now.
-    if (job->color == NCCL_SPLIT_NOCOLOR) goto exit;
-    snprintf((char*)&job->commId, sizeof(job->commId), "%016lx-%d", job->parent->commHash, job->color);
+    if (job->shrinkRanks) {
+      // Every remaining rank knows the new layout already, and excluded ranks must not be contacted.
+      memcpy(parentRanks, job->shrinkRanks, job->nranks*sizeof(int));
+      snprintf((char*)&job->commId, sizeof(job->commId), "%016lx-shrink-%d", job->parent->commHash, job->parent->nRanks-job->nranks);
+    } else {
+      NCCLCHECKGOTO(commGetSplitInfo(comm, job->parent, job->color, job->key, &job->nranks, &job->myrank, parentRanks), res, fail);
+      // Negative color does not create a new comm object. We needed to take part in the allgather, but we're done now.
+      if (job->color == NCCL_SPLIT_NOCOLOR) goto exit;
+      snprintf((char*)&job->commId, sizeof(job->commId), "%016lx-%d", job->parent->commHash, job->color);
+    }
     NCCLCHECKGOTO(commAlloc(comm, job->parent, job->nranks, job->myrank), res, fail);
     NCCLCHECKGOTO(bootstrapSplit((struct ncclBootstrapHandle*)&job->commId, comm, job->parent, job->color, job->key, parentRanks), res, fail);
   } else {
@@ -1352,20 +1949,31 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
 
   comm->cudaArch = cudaArch;
   comm->commHash = getHash(job->commId.internal, NCCL_UNIQUE_ID_BYTES);
+  ncclInitTimerStop(&timers, ncclInitPhaseBootstrap);
 
   INFO(NCCL_INIT,"comm %p rank %d nranks %d cudaDev %d nvmlDev %d busId %lx commId 0x%llx - Init START", comm, comm->rank, comm->nRanks, comm->cudaDev, comm->nvmlDev, comm->busId, (unsigned long long)hashUniqueId(job->commId));
 
-  NCCLCHECKGOTO(initTransportsRank(comm, job->parent), res, fail);
+  NCCLCHECKGOTO(initTransportsRank(comm, job->parent, &timers), res, fail);
+  NCCLCHECKGOTO(initTimersReport(comm, &timers), res, fail);
 
   // update communicator state
   comm->initState = ncclSuccess;
+  // Needs a ready communicator, but still runs before the user gets it
+  NCCLCHECKGOTO(ncclHealthCheck(comm), res, fail);
+  // Splits the communicator, which also needs it ready
+  NCCLCHECKGOTO(ncclHierArInit(comm), res, fail);
 
   // Trace this call for replay tool
   if (job->parent) {
     /* unlink child abort flag. */
     __atomic_store_n(&job->parent->childAbortFlag, NULL, __ATOMIC_RELEASE);
-    TRACE_CALL("ncclCommSplit(%p, %d, %d, %p, %d, %d)",
-                job->parent, job->color, job->key, comm, comm->rank, comm->nRanks);
+    if (job->shrinkRanks) {
+      TRACE_CALL("ncclCommShrink(%p, %d, %p, %d, %d)",
+                  job->parent, job->parent->nRanks-job->nranks, comm, comm->rank, comm->nRanks);
+    } else {
+      TRACE_CALL("ncclCommSplit(%p, %d, %d, %p, %d, %d)",
+                  job->parent, job->color, job->key, comm, comm->rank, comm->nRanks);
+    }
   } else {
     TRACE_CALL("ncclCommInitRank(%p, %d, 0x%llx, %d, %d)",
                 comm, comm->nRanks, (unsigned long long)hashUniqueId(job->commId), comm->rank, comm->cudaDev);
@@ -1400,6 +2008,10 @@ static ncclResult_t envConfigOverride(ncclComm_t comm) {
   int cgaClusterSizeEnv;
   int minCTAsEnv;
   int maxCTAsEnv;
+  int channelOffsetEnv;
+  int lowShmemEnv;
+  int netBwLimitEnv;
+  int memBudgetEnv;
   int splitShareEnv;
 
   /* override configuration from env variable. */
@@ -1425,6 +2037,26 @@ static ncclResult_t envConfigOverride(ncclComm_t comm) {
     comm->config.maxCTAs = maxCTAsEnv;
   }
 
+  channelOffsetEnv = ncclParamChannelOffset();
+  if (channelOffsetEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.channelOffset = channelOffsetEnv;
+  }
+
+  lowShmemEnv = ncclParamLowShmem();
+  if (lowShmemEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.lowShmem = lowShmemEnv;
+  }
+
+  netBwLimitEnv = ncclParamNetBwLimit();
+  if (netBwLimitEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.netBwLimit = netBwLimitEnv;
+  }
+
+  memBudgetEnv = ncclParamMemBudget();
+  if (memBudgetEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.memBudget = memBudgetEnv;
+  }
+
   envNetName = getenv("NCCL_NET");
   if (envNetName)
     tmpNetName = envNetName;
@@ -1462,6 +2094,26 @@ static ncclResult_t envConfigOverride(ncclComm_t comm) {
     comm->config.splitShare = 0;
   }
 
+  if (comm->config.lowShmem != 1 && comm->config.lowShmem != 0) {
+    WARN("lowShmem %d is not a valid value 0/1, set it to 0", comm->config.lowShmem);
+    comm->config.lowShmem = 0;
+  }
+
+  if (comm->config.channelOffset < 0) {
+    WARN("channelOffset %d is negative, set it to 0", comm->config.channelOffset);
+    comm->config.channelOffset = 0;
+  }
+
+  if (comm->config.netBwLimit < 0) {
+    WARN("netBwLimit %d is negative, set it to 0", comm->config.netBwLimit);
+    comm->config.netBwLimit = 0;
+  }
+
+  if (comm->config.memBudget < 0) {
+    WARN("memBudget %d is negative, set it to 0", comm->config.memBudget);
+    comm->config.memBudget = 0;
+  }
+
   return ret;
 }
 
@@ -1532,6 +2184,30 @@ static ncclResult_t parseCommConfig(ncclComm_t comm, ncclConfig_t *config) {
     goto fail;
   }
 
+  if (internalConfigPtr->channelOffset != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->channelOffset < 0) {
+    WARN("Invalid config channelOffset attribute value %d", internalConfigPtr->channelOffset);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->lowShmem != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->lowShmem != 0 && internalConfigPtr->lowShmem != 1) {
+    WARN("Invalid config lowShmem attribute value %d", internalConfigPtr->lowShmem);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->netBwLimit != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->netBwLimit < 0) {
+    WARN("Invalid config netBwLimit attribute value %d", internalConfigPtr->netBwLimit);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->memBudget != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->memBudget < 0) {
+    WARN("Invalid config memBudget attribute value %d", internalConfigPtr->memBudget);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
   /* default config value can be tuned on different platform. */
   NCCL_CONFIG_DEFAULT(internalConfigPtr, blocking, NCCL_CONFIG_UNDEF_INT, 1, "Blocking", "%d");
   NCCL_CONFIG_DEFAULT(internalConfigPtr, cgaClusterSize, NCCL_CONFIG_UNDEF_INT, 4, "CGA cluster size", "%d");
@@ -1539,6 +2215,10 @@ static ncclResult_t parseCommConfig(ncclComm_t comm, ncclConfig_t *config) {
   NCCL_CONFIG_DEFAULT(internalConfigPtr, maxCTAs, NCCL_CONFIG_UNDEF_INT, MAXCHANNELS, "Max CTAs", "%d");
   NCCL_CONFIG_DEFAULT(internalConfigPtr, netName, NCCL_CONFIG_UNDEF_PTR, NULL, "Net name", "%s");
   NCCL_CONFIG_DEFAULT(internalConfigPtr, splitShare, NCCL_CONFIG_UNDEF_INT, 0, "Split share", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, channelOffset, NCCL_CONFIG_UNDEF_INT, 0, "Channel offset", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, lowShmem, NCCL_CONFIG_UNDEF_INT, 0, "Low shmem", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, netBwLimit, NCCL_CONFIG_UNDEF_INT, 0, "Net bw limit", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, memBudget, NCCL_CONFIG_UNDEF_INT, 0, "Memory budget", "%d");
 
   /* assign config to communicator */
   comm->config.blocking = internalConfigPtr->blocking;
@@ -1547,6 +2227,10 @@ static ncclResult_t parseCommConfig(ncclComm_t comm, ncclConfig_t *config) {
   comm->config.maxCTAs = internalConfigPtr->maxCTAs;
   comm->config.netName = internalConfigPtr->netName;
   comm->config.splitShare = internalConfigPtr->splitShare;
+  comm->config.channelOffset = internalConfigPtr->channelOffset;
+  comm->config.lowShmem = internalConfigPtr->lowShmem;
+  comm->config.netBwLimit = internalConfigPtr->netBwLimit;
+  comm->config.memBudget = internalConfigPtr->memBudget;
 
   NCCLCHECKGOTO(envConfigOverride(comm), ret, fail);
 
@@ -1750,7 +2434,9 @@ static ncclResult_t commDestroySync(struct ncclAsyncJob* job_) {
   if (comm->initState == ncclSuccess) {
     NCCLCHECKGOTO(ncclStrongStreamSynchronize(&comm->sharedRes->hostStream), ret, fail);
     NCCLCHECKGOTO(ncclStrongStreamSynchronize(&comm->sharedRes->deviceStream), ret, fail);
+    if (comm->sharedRes->laneState == 1) NCCLCHECKGOTO(ncclStrongStreamSynchronize(&comm->sharedRes->deviceStreamHigh), ret, fail);
   }
+  NCCLCHECKGOTO(ncclResidentKernelStop(comm), ret, fail);
   NCCLCHECKGOTO(ncclCommPollCallbacks(comm, false), ret, fail);
   // And keep polling until all graphs referencing us die.
   while (comm->persistentRefs != 0) {
@@ -1786,6 +2472,42 @@ static ncclResult_t commCleanup(ncclComm_t comm) {
   return ncclSuccess;
 }
 
+// Free the communicators of all GPUs of the process at once, each from its own thread. Most of the
+// time goes into CUDA frees and proxy teardown, which are per GPU and do not depend on each other.
+NCCL_PARAM(ParallelDestroy, "PARALLEL_DESTROY", 1);
+
+static ncclResult_t commCleanupJob(struct ncclAsyncJob* job_) {
+  struct ncclCommFinalizeAsyncJob* job = (struct ncclCommFinalizeAsyncJob*)job_;
+  return commCleanup(job->comm);
+}
+
+static ncclResult_t commCleanupParallel(ncclComm_t intracomm0, int intraRanks) {
+  struct ncclCommFinalizeAsyncJob* jobs;
+  int nJobs = 0;
+  NCCLCHECK(ncclCalloc(&jobs, intraRanks));
+  // Collect the list first, comms are gone once their thread is done.
+  for (ncclComm_t comm = intracomm0; comm && nJobs < intraRanks; comm = comm->intraNext) {
+    jobs[nJobs].comm = comm;
+    jobs[nJobs].base.comm = comm;
+    jobs[nJobs].base.func = commCleanupJob;
+    nJobs++;
+  }
+  for (int j=0; j<nJobs; j++) {
+    if (ncclAsyncJobStart(&jobs[j].base, true) != ncclSuccess) {
+      INFO(NCCL_INIT, "commReclaim: could not start cleanup thread, cleaning up comm %p inline", jobs[j].comm);
+      jobs[j].base.result = commCleanupJob(&jobs[j].base);
+      jobs[j].base.state = ncclGroupJobDone;
+    }
+  }
+  for (int j=0; j<nJobs; j++) {
+    if (ncclAsyncJobWait(&jobs[j].base) != ncclSuccess) {
+      WARN("commReclaim: cleanup comm %p failed in destroy/abort, error %d", jobs[j].comm, jobs[j].base.result);
+    }
+  }
+  free(jobs);
+  return ncclSuccess;
+}
+
 static ncclResult_t commFinalize(ncclComm_t comm, bool userCalled) {
   ncclResult_t ret = ncclSuccess;
   struct ncclCommFinalizeAsyncJob *job = NULL;
@@ -1812,6 +2534,7 @@ ncclResult_t ncclCommFinalize(ncclComm_t comm) {
   NVTX3_FUNC_RANGE_IN(nccl_domain);
   ncclResult_t ret = ncclSuccess;
 
+  if (comm != NULL && comm->coalesceCount != 0) NCCLCHECK(ncclCoalesceFlush(comm));
   NCCLCHECK(ncclGroupStartInternal());
   if (comm == NULL) goto exit;
 
@@ -1902,14 +2625,18 @@ static ncclResult_t commReclaim(ncclComm_t comm) {
       }
 
       /* free local resources. */
-      nextIntraComm = intracomm0;
-      while (nextIntraComm) {
-        curIntraComm = nextIntraComm;
-        curRank = curIntraComm->rank;
-        nextIntraComm = nextIntraComm->intraNext;
-
-        if ((ret = commCleanup(curIntraComm)) != ncclSuccess) {
-          WARN("commReclaim: cleanup comm %p rank %d failed in destroy/abort, error %d", curIntraComm, curRank, ret);
+      if (intraRanks > 1 && ncclParamParallelDestroy()) {
+        NCCLCHECKGOTO(commCleanupParallel(intracomm0, intraRanks), ret, fail);
+      } else {
+        nextIntraComm = intracomm0;
+        while (nextIntraComm) {
+          curIntraComm = nextIntraComm;
+          curRank = curIntraComm->rank;
+          nextIntraComm = nextIntraComm->intraNext;
+
+          if ((ret = commCleanup(curIntraComm)) != ncclSuccess) {
+            WARN("commReclaim: cleanup comm %p rank %d failed in destroy/abort, error %d", curIntraComm, curRank, ret);
+          }
         }
       }
     }
@@ -1943,6 +2670,8 @@ ncclResult_t ncclCommDestroy(ncclComm_t comm) {
 
   /* init thread must be joined before we destroy the comm. */
   NCCLCHECK(ncclCommEnsureReady(comm));
+  NCCLCHECK(ncclCoalesceFlush(comm));
+  NCCLCHECK(ncclHierArFree(comm, false));
 
   NCCLCHECK(commReclaim(comm));
   INFO(NCCL_INIT,"comm %p rank %d nranks %d cudaDev %d busId %lx - Destroy COMPLETE", comm, rank, nranks, cudaDev, busId);
@@ -1975,6 +2704,7 @@ ncclResult_t ncclCommAbort(ncclComm_t comm) {
   /* init thread must be joined before we destroy the comm,
    * and we should ignore the init error here. */
   ncclCommEnsureReady(comm);
+  (void) ncclHierArFree(comm, true);
 
   (void) commReclaim(comm);
   INFO(NCCL_INIT,"comm %p rank %d nranks %d cudaDev %d busId %lx - Abort COMPLETE", comm, rank, nranks, cudaDev, busId);
@@ -2045,6 +2775,97 @@ fail:
   goto exit;
 }
 
+NCCL_API(ncclResult_t, ncclCommShrink, ncclComm_t comm, int* excludeRanks, int excludeCount, ncclComm_t *newcomm, ncclConfig_t *config);
+ncclResult_t ncclCommShrink(ncclComm_t comm, int* excludeRanks, int excludeCount, ncclComm_t *newcomm, ncclConfig_t *config) {
+  struct ncclCommInitRankAsyncJob *job = NULL;
+  struct ncclComm* childComm = NCCL_COMM_NULL;
+  bool* excluded = NULL;
+  ncclResult_t res = ncclSuccess;
+
+  NCCLCHECK(ncclGroupStartInternal());
+  NCCLCHECKGOTO(PtrCheck(comm, "CommShrink", "comm"), res, fail);
+  NCCLCHECKGOTO(PtrCheck(newcomm, "CommShrink", "newcomm"), res, fail);
+  if (excludeCount < 0 || excludeCount >= comm->nRanks || (excludeCount > 0 && excludeRanks == NULL)) {
+    WARN("CommShrink : invalid excludeCount %d for a communicator of %d ranks", excludeCount, comm->nRanks);
+    res = ncclInvalidArgument;
+    goto fail;
+  }
+  *newcomm = NCCL_COMM_NULL;
+
+  NCCLCHECKGOTO(ncclCalloc(&job, 1), res, fail);
+  NCCLCHECKGOTO(ncclCalloc(&excluded, comm->nRanks), res, fail);
+  for (int i = 0; i < excludeCount; i++) {
+    int r = excludeRanks[i];
+    if (r < 0 || r >= comm->nRanks || excluded[r]) {
+      WARN("CommShrink : invalid or duplicate rank %d in excludeRanks", r);
+      res = ncclInvalidArgument;
+      goto fail;
+    }
+    excluded[r] = true;
+  }
+  if (excluded[comm->rank]) {
+    WARN("CommShrink : rank %d is excluded and should not call ncclCommShrink", comm->rank);
+    res = ncclInvalidArgument;
+    goto fail;
+  }
+  NCCLCHECKGOTO(ncclCalloc(&job->shrinkRanks, comm->nRanks-excludeCount), res, fail);
+  for (int r = 0; r < comm->nRanks; r++) {
+    if (excluded[r]) continue;
+    if (r == comm->rank) job->myrank = job->nranks;
+    job->shrinkRanks[job->nranks++] = r;
+  }
+
+  NCCLCHECKGOTO(ncclCalloc(&childComm, 1), res, fail);
+  if (comm->config.splitShare) {
+    childComm->abortFlag = comm->abortFlag;
+    childComm->abortFlagRefCount = comm->abortFlagRefCount;
+    comm->childAbortFlag = NULL;
+    ncclAtomicRefCountIncrement(comm->abortFlagRefCount);
+  } else {
+    NCCLCHECKGOTO(ncclCudaHostCalloc((uint32_t**)&childComm->abortFlag, 1), res, fail);
+    NCCLCHECKGOTO(ncclCalloc((uint32_t**)&childComm->abortFlagRefCount, 1), res, fail);
+    comm->childAbortFlag = childComm->abortFlag;
+    *childComm->abortFlagRefCount = 1;
+  }
+  if (config == NULL) {
+    NCCLCHECKGOTO(copyCommConfig(childComm, comm), res, fail);
+  } else {
+    NCCLCHECKGOTO(parseCommConfig(childComm, config), res, fail);
+  }
+  childComm->initState = ncclInternalError;
+
+  INFO(NCCL_INIT, "CommShrink : comm %p rank %d excluding %d ranks, new rank %d nranks %d", comm, comm->rank, excludeCount, job->myrank, job->nranks);
+  job->comm = childComm;
+  job->newcomm = newcomm;
+  job->parent = comm;
+  job->key = comm->rank;
+  job->cudaDev = comm->cudaDev;
+  {
+    // The job belongs to ncclAsyncLaunch from now on, even if it fails.
+    struct ncclAsyncJob* base = &job->base;
+    job = NULL;
+    childComm = NCCL_COMM_NULL;
+    NCCLCHECKGOTO(ncclAsyncLaunch(base, ncclCommInitRankFunc, NULL, commInitRankJobFree, comm), res, fail);
+  }
+
+exit:
+  free(excluded);
+  ncclGroupErrCheck(res);
+  NCCLCHECK(ncclGroupEndInternal());
+  return res;
+fail:
+  if (childComm) {
+    if (comm && !comm->config.splitShare) {
+      if (childComm->abortFlag) ncclCudaHostFree((void*)childComm->abortFlag);
+      if (childComm->abortFlagRefCount) free(childComm->abortFlagRefCount);
+    }
+    free(childComm);
+  }
+  if (job) commInitRankJobFree(job);
+  if (newcomm) *newcomm = NULL;
+  goto exit;
+}
+
 NCCL_API(const char*, ncclGetErrorString, ncclResult_t code);
 const char* ncclGetErrorString(ncclResult_t code) {
   switch (code) {
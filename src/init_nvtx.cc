@@ -1,5 +1,6 @@
 #include "nccl.h"
 #include "nvtx.h"
+#include "devcomm.h"
 
 static constexpr const nvtxPayloadEnum_t NvtxEnumRedSchema[] = {
   {"Sum", ncclSum},
@@ -9,6 +10,21 @@ static constexpr const nvtxPayloadEnum_t NvtxEnumRedSchema[] = {
   {"Avg", ncclAvg}
 };
 
+static constexpr const nvtxPayloadEnum_t NvtxEnumAlgoSchema[] = {
+  {"Tree", NCCL_ALGO_TREE},
+  {"Ring", NCCL_ALGO_RING},
+  {"CollNetDirect", NCCL_ALGO_COLLNET_DIRECT},
+  {"CollNetChain", NCCL_ALGO_COLLNET_CHAIN},
+  {"NVLS", NCCL_ALGO_NVLS},
+  {"NVLSTree", NCCL_ALGO_NVLS_TREE}
+};
+
+static constexpr const nvtxPayloadEnum_t NvtxEnumProtoSchema[] = {
+  {"LL", NCCL_PROTO_LL},
+  {"LL128", NCCL_PROTO_LL128},
+  {"Simple", NCCL_PROTO_SIMPLE}
+};
+
 // Must be called before the first call to any reduction operation.
 void initNvtxRegisteredEnums() {
   // Register schemas and strings
@@ -23,4 +39,26 @@ void initNvtxRegisteredEnums() {
   };
 
   nvtxPayloadEnumRegister(nvtx3::domain::get<nccl_domain>(), &eAttr);
+
+  constexpr const nvtxPayloadEnumAttr_t algoAttr {
+    .fieldMask = NVTX_PAYLOAD_ENUM_ATTR_ENTRIES | NVTX_PAYLOAD_ENUM_ATTR_NUM_ENTRIES |
+      NVTX_PAYLOAD_ENUM_ATTR_SIZE | NVTX_PAYLOAD_ENUM_ATTR_SCHEMA_ID,
+    .name = NULL,
+    .entries = NvtxEnumAlgoSchema,
+    .numEntries = std::extent<decltype(NvtxEnumAlgoSchema)>::value,
+    .sizeOfEnum = sizeof(int),
+    .schemaId = NVTX_PAYLOAD_ENTRY_NCCL_ALGO
+  };
+  nvtxPayloadEnumRegister(nvtx3::domain::get<nccl_domain>(), &algoAttr);
+
+  constexpr const nvtxPayloadEnumAttr_t protoAttr {
+    .fieldMask = NVTX_PAYLOAD_ENUM_ATTR_ENTRIES | NVTX_PAYLOAD_ENUM_ATTR_NUM_ENTRIES |
+      NVTX_PAYLOAD_ENUM_ATTR_SIZE | NVTX_PAYLOAD_ENUM_ATTR_SCHEMA_ID,
+    .name = NULL,
+    .entries = NvtxEnumProtoSchema,
+    .numEntries = std::extent<decltype(NvtxEnumProtoSchema)>::value,
+    .sizeOfEnum = sizeof(int),
+    .schemaId = NVTX_PAYLOAD_ENTRY_NCCL_PROTO
+  };
+  nvtxPayloadEnumRegister(nvtx3::domain::get<nccl_domain>(), &protoAttr);
 }
@@ -8,8 +8,11 @@
 #include "debug.h"
 #include "param.h"
 #include "cudawrap.h"
+#include "alloc.h"
 
 #include <dlfcn.h>
+#include <pthread.h>
+#include <algorithm>
 
 // This env var (NCCL_CUMEM_ENABLE) toggles cuMem API usage
 NCCL_PARAM(CuMemEnable, "CUMEM_ENABLE", 0);
@@ -42,6 +45,26 @@ error:
 #endif
 }
 
+int ncclCudaStreamMemOpsSupported(int cudaDev) {
+#if CUDA_VERSION < 11070
+  return 0;
+#else
+  if (CUPFN(cuStreamWaitValue32) == NULL || CUPFN(cuStreamWriteValue32) == NULL) return 0;
+#if CUDA_VERSION >= 12000
+  // The v2 memory operations used from CUDA 12 on are always enabled
+  return 1;
+#else
+  CUdevice dev;
+  int flag = 0;
+  ncclResult_t ret = ncclSuccess;
+  CUCHECKGOTO(cuDeviceGet(&dev, cudaDev), ret, error);
+  CUCHECKGOTO(cuDeviceGetAttribute(&flag, CU_DEVICE_ATTRIBUTE_CAN_USE_STREAM_MEM_OPS, dev), ret, error);
+error:
+  return ret == ncclSuccess && flag;
+#endif
+#endif
+}
+
 int ncclCuMemEnable() {
   return ((ncclParamCuMemEnable() == -2 && ncclCuMemSupported) || ncclParamCuMemEnable());
 }
@@ -77,6 +100,11 @@ DECLARE_CUDA_PFN(cuMemUnmap, 10020);
 #if CUDA_VERSION >= 11070
 /* transport/collNet.cc/net.cc*/
 DECLARE_CUDA_PFN(cuMemGetHandleForAddressRange, 11070); // DMA-BUF support
+/* ce_coll.cc, dev_window.cc */
+DECLARE_CUDA_PFN(cuStreamWaitValue32, 11070);
+DECLARE_CUDA_PFN(cuStreamWriteValue32, 11070);
+DECLARE_CUDA_PFN(cuStreamWaitValue64, 11070);
+DECLARE_CUDA_PFN(cuStreamWriteValue64, 11070);
 #endif
 #if CUDA_VERSION >= 12010
 /* NVSwitch Multicast support */
@@ -139,6 +167,10 @@ static ncclResult_t cudaPfnFuncLoader(void) {
   LOAD_SYM(cuMemUnmap, 10020, 1);
 #if CUDA_VERSION >= 11070
   LOAD_SYM(cuMemGetHandleForAddressRange, 11070, 1); // DMA-BUF support
+  LOAD_SYM(cuStreamWaitValue32, 11070, 1);
+  LOAD_SYM(cuStreamWriteValue32, 11070, 1);
+  LOAD_SYM(cuStreamWaitValue64, 11070, 1);
+  LOAD_SYM(cuStreamWriteValue64, 11070, 1);
 #endif
 #if CUDA_VERSION >= 12010
 /* NVSwitch Multicast support */
@@ -245,3 +277,306 @@ ncclResult_t ncclCudaLibraryInit() {
   pthread_once(&initOnceControl, initOnceFunc);
   return initResult;
 }
+
+#if CUDART_VERSION >= 11030
+// cuMem allocations are rounded up to the allocation granularity, typically 2MB, which for the
+// many small buffers NCCL allocates (work FIFOs, flags, LL buffers, ...) is mostly wasted.
+// Allocations which don't export a handle are instead carved out of granularity sized chunks
+// shared by all communicators of the process. Pages are at least 64KB, the GPU page size pinned
+// by the network stack, so that a buffer registered with a NIC does not share pages with another.
+NCCL_PARAM(CuMemPool, "CUMEM_POOL", 1);
+
+#define CUMEM_POOL_MAX_PAGES 64
+#define CUMEM_POOL_MIN_PAGE_SIZE (64<<10)
+
+struct cuMemPoolChunk {
+  CUdeviceptr base;
+  size_t size;
+  size_t pageSize;
+  int nPages;
+  int dev;
+  CUmemGenericAllocationHandle handle;
+  uint64_t used; // One bit per page
+  uint8_t len[CUMEM_POOL_MAX_PAGES]; // Number of pages of the allocation starting at each page
+  struct cuMemPoolChunk* next;
+};
+static struct cuMemPoolChunk* cuMemPool = NULL;
+static pthread_mutex_t cuMemPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static ncclResult_t cuMemPoolChunkCreate(size_t size, size_t pageSize, CUmemAllocationProp* prop, struct cuMemPoolChunk** chunkRet) {
+  ncclResult_t ret = ncclSuccess;
+  struct cuMemPoolChunk* chunk;
+  CUmemAccessDesc accessDesc = {};
+  NCCLCHECK(ncclCalloc(&chunk, 1));
+  chunk->size = size;
+  chunk->pageSize = pageSize;
+  chunk->nPages = size/pageSize;
+  chunk->dev = prop->location.id;
+  CUCHECKGOTO(cuMemCreate(&chunk->handle, size, prop, 0), ret, fail);
+  CUCHECKGOTO(cuMemAddressReserve(&chunk->base, size, 0, 0, 0), ret, release);
+  CUCHECKGOTO(cuMemMap(chunk->base, size, 0, chunk->handle, 0), ret, addressFree);
+  accessDesc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  accessDesc.location.id = chunk->dev;
+  accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  CUCHECKGOTO(cuMemSetAccess(chunk->base, size, &accessDesc, 1), ret, unmap);
+  TRACE(NCCL_ALLOC, "CuMem pool chunk size %zi pointer %llx", size, chunk->base);
+  *chunkRet = chunk;
+  return ncclSuccess;
+unmap:
+  CUCHECKIGNORE(cuMemUnmap(chunk->base, size));
+addressFree:
+  CUCHECKIGNORE(cuMemAddressFree(chunk->base, size));
+release:
+  CUCHECKIGNORE(cuMemRelease(chunk->handle));
+fail:
+  free(chunk);
+  return ret;
+}
+
+ncclResult_t ncclCuMemPoolAlloc(void** ptr, size_t size, size_t granularity, CUmemAllocationProp* prop, int* pooled) {
+  *pooled = 0;
+  size_t pageSize = std::max((size_t)CUMEM_POOL_MIN_PAGE_SIZE, granularity/CUMEM_POOL_MAX_PAGES);
+  if (ncclParamCuMemPool() == 0 || granularity % pageSize) return ncclSuccess;
+  int nPages = granularity/pageSize;
+  int n = DIVUP(size, pageSize);
+  if (n == 0 || n >= nPages) return ncclSuccess; // Nothing to save
+  uint64_t mask = (1ULL<<n)-1;
+  ncclResult_t ret = ncclSuccess;
+  struct cuMemPoolChunk* chunk;
+  int p = 0;
+  pthread_mutex_lock(&cuMemPoolLock);
+  for (chunk = cuMemPool; chunk; chunk = chunk->next) {
+    if (chunk->dev != prop->location.id || chunk->pageSize != pageSize) continue;
+    for (p=0; p+n<=chunk->nPages; p++) {
+      if ((chunk->used & (mask<<p)) == 0) goto found;
+    }
+  }
+  NCCLCHECKGOTO(cuMemPoolChunkCreate(granularity, pageSize, prop, &chunk), ret, exit);
+  chunk->next = cuMemPool;
+  cuMemPool = chunk;
+  p = 0;
+found:
+  chunk->used |= mask<<p;
+  chunk->len[p] = n;
+  *ptr = (void*)(chunk->base + p*pageSize);
+  *pooled = 1;
+  TRACE(NCCL_ALLOC, "CuMem pool alloc size %zi pointer %p", size, *ptr);
+exit:
+  pthread_mutex_unlock(&cuMemPoolLock);
+  return ret;
+}
+
+ncclResult_t ncclCuMemPoolFree(void* ptr, int* pooled) {
+  ncclResult_t ret = ncclSuccess;
+  CUdeviceptr addr = (CUdeviceptr)ptr;
+  *pooled = 0;
+  pthread_mutex_lock(&cuMemPoolLock);
+  for (struct cuMemPoolChunk** chunkPtr = &cuMemPool; *chunkPtr; chunkPtr = &(*chunkPtr)->next) {
+    struct cuMemPoolChunk* chunk = *chunkPtr;
+    if (addr < chunk->base || addr >= chunk->base + chunk->size) continue;
+    int p = (addr - chunk->base)/chunk->pageSize;
+    chunk->used &= ~(((1ULL<<chunk->len[p])-1) << p);
+    chunk->len[p] = 0;
+    *pooled = 1;
+    TRACE(NCCL_ALLOC, "CuMem pool free pointer %p", ptr);
+    if (chunk->used == 0) {
+      *chunkPtr = chunk->next;
+      CUCHECKGOTO(cuMemUnmap(chunk->base, chunk->size), ret, exit);
+      CUCHECKGOTO(cuMemRelease(chunk->handle), ret, exit);
+      CUCHECKGOTO(cuMemAddressFree(chunk->base, chunk->size), ret, exit);
+      free(chunk);
+    }
+    break;
+  }
+exit:
+  pthread_mutex_unlock(&cuMemPoolLock);
+  return ret;
+}
+#endif
+
+// Pinned host buffers of a huge page or more (network and CollNet host buffers without GDR,
+// the work FIFO) are backed by huge pages, from hugetlbfs when pages are reserved, otherwise
+// through transparent huge pages, which cuts TLB misses when staging and the cost of pinning.
+// Freed buffers are kept, up to NCCL_HOST_POOL_SIZE bytes, for the next connection of any
+// communicator of the process asking for the same size.
+NCCL_PARAM(HostHugePages, "HOST_HUGE_PAGES", 1);
+NCCL_PARAM(HostPoolSize, "HOST_POOL_SIZE", 32ULL<<20);
+
+#define HOST_HUGE_PAGE_SIZE (2ULL<<20)
+
+enum hostPoolKind { hostPoolCuda, hostPoolHugetlb, hostPoolThp };
+
+struct hostPoolBuff {
+  void* ptr;
+  size_t size;
+  size_t mapSize; // Length mapped from hugetlbfs, a multiple of its page size
+  enum hostPoolKind kind;
+  int inUse;
+  struct hostPoolBuff* next;
+};
+static struct hostPoolBuff* hostPool = NULL;
+static size_t hostPoolCached = 0;
+static pthread_mutex_t hostPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Default huge page size of hugetlbfs, which MAP_HUGETLB uses, 0 if unknown
+static size_t hostHugetlbPageSize() {
+  static size_t pageSize = (size_t)-1;
+  if (pageSize != (size_t)-1) return pageSize;
+  pageSize = 0;
+  FILE* file = fopen("/proc/meminfo", "r");
+  if (file == NULL) return pageSize;
+  char line[256];
+  unsigned long kb;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+      pageSize = kb << 10;
+      break;
+    }
+  }
+  fclose(file);
+  return pageSize;
+}
+
+// Pool buffers are used through the host pointer on the device, which registered memory
+// only allows where cudaDevAttrCanUseHostPointerForRegisteredMem is set. Buffers may be
+// reused by any device, so all of them must have it. Called with hostPoolLock held.
+static bool hostPoolCanRegister() {
+  static int canRegister = -1;
+  if (canRegister != -1) return canRegister;
+  int nDevs = 0;
+  canRegister = 0;
+  if (cudaGetDeviceCount(&nDevs) != cudaSuccess) {
+    (void)cudaGetLastError();
+    return canRegister;
+  }
+  canRegister = 1;
+  for (int d=0; d<nDevs; d++) {
+    int attr = 0;
+    if (cudaDeviceGetAttribute(&attr, cudaDevAttrCanUseHostPointerForRegisteredMem, d) != cudaSuccess) {
+      (void)cudaGetLastError();
+      attr = 0;
+    }
+    if (!attr) {
+      INFO(NCCL_ALLOC, "GPU %d cannot use host pointers of registered memory, huge page host memory disabled", d);
+      canRegister = 0;
+      break;
+    }
+  }
+  return canRegister;
+}
+
+static ncclResult_t hostPoolUnmap(void* ptr, size_t mapSize) {
+  if (munmap(ptr, mapSize) != 0) {
+    WARN("Failed to unmap %zi bytes of huge page host memory at %p : %s", mapSize, ptr, strerror(errno));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+// Called with hostPoolLock held
+static ncclResult_t hostPoolBuffCreate(size_t size, struct hostPoolBuff** buffRet) {
+  struct hostPoolBuff* buff;
+  void* ptr = NULL;
+  NCCLCHECK(ncclCalloc(&buff, 1));
+  buff->size = size;
+  buff->kind = hostPoolCuda;
+  if (ncclParamHostHugePages() && hostPoolCanRegister()) {
+    // MAP_HUGETLB uses the default huge page size, which may not be 2MB
+    size_t pageSize = hostHugetlbPageSize();
+    if (pageSize && size % pageSize == 0) {
+      ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+      if (ptr == MAP_FAILED) ptr = NULL;
+    }
+    if (ptr) {
+      buff->kind = hostPoolHugetlb;
+      buff->mapSize = size;
+    } else if (posix_memalign(&ptr, HOST_HUGE_PAGE_SIZE, size) == 0) {
+      madvise(ptr, size, MADV_HUGEPAGE); // Best effort, THP may be disabled
+      buff->kind = hostPoolThp;
+    } else {
+      ptr = NULL;
+    }
+    if (ptr && cudaHostRegister(ptr, size, cudaHostRegisterMapped|cudaHostRegisterPortable) != cudaSuccess) {
+      (void)cudaGetLastError();
+      INFO(NCCL_ALLOC, "Could not register %zi bytes of huge page host memory, falling back to cudaHostAlloc", size);
+      if (buff->kind == hostPoolHugetlb) (void)hostPoolUnmap(ptr, buff->mapSize); else free(ptr);
+      buff->kind = hostPoolCuda;
+      ptr = NULL;
+    }
+  }
+  if (ptr == NULL) {
+    cudaError_t err = cudaHostAlloc(&ptr, size, cudaHostAllocMapped|cudaHostAllocPortable);
+    if (err != cudaSuccess) {
+      WARN("Cuda failure '%s'", cudaGetErrorString(err));
+      free(buff);
+      return ncclUnhandledCudaError;
+    }
+  }
+  buff->ptr = ptr;
+  TRACE(NCCL_ALLOC, "Host pool buffer size %zi pointer %p kind %d", size, ptr, buff->kind);
+  *buffRet = buff;
+  return ncclSuccess;
+}
+
+static ncclResult_t hostPoolBuffDestroy(struct hostPoolBuff* buff) {
+  if (buff->kind == hostPoolCuda) {
+    CUDACHECK(cudaFreeHost(buff->ptr));
+  } else {
+    CUDACHECK(cudaHostUnregister(buff->ptr));
+    if (buff->kind == hostPoolHugetlb) {
+      NCCLCHECK(hostPoolUnmap(buff->ptr, buff->mapSize));
+    } else {
+      free(buff->ptr);
+    }
+  }
+  free(buff);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclHostPoolAlloc(void** ptr, size_t size, int* pooled) {
+  *pooled = 0;
+  if (size < HOST_HUGE_PAGE_SIZE) return ncclSuccess;
+  ALIGN_SIZE(size, HOST_HUGE_PAGE_SIZE);
+  ncclResult_t ret = ncclSuccess;
+  struct hostPoolBuff* buff;
+  pthread_mutex_lock(&hostPoolLock);
+  for (buff = hostPool; buff; buff = buff->next) {
+    if (buff->inUse == 0 && buff->size == size) {
+      hostPoolCached -= size;
+      goto found;
+    }
+  }
+  NCCLCHECKGOTO(hostPoolBuffCreate(size, &buff), ret, exit);
+  buff->next = hostPool;
+  hostPool = buff;
+found:
+  buff->inUse = 1;
+  *ptr = buff->ptr;
+  *pooled = 1;
+exit:
+  pthread_mutex_unlock(&hostPoolLock);
+  return ret;
+}
+
+ncclResult_t ncclHostPoolFree(void* ptr, int* pooled) {
+  ncclResult_t ret = ncclSuccess;
+  *pooled = 0;
+  if (ptr == NULL) return ncclSuccess;
+  pthread_mutex_lock(&hostPoolLock);
+  for (struct hostPoolBuff** buffPtr = &hostPool; *buffPtr; buffPtr = &(*buffPtr)->next) {
+    struct hostPoolBuff* buff = *buffPtr;
+    if (buff->ptr != ptr || buff->inUse == 0) continue;
+    *pooled = 1;
+    if (hostPoolCached + buff->size <= (size_t)ncclParamHostPoolSize()) {
+      buff->inUse = 0;
+      hostPoolCached += buff->size;
+    } else {
+      *buffPtr = buff->next;
+      NCCLCHECKGOTO(hostPoolBuffDestroy(buff), ret, exit);
+    }
+    break;
+  }
+exit:
+  pthread_mutex_unlock(&hostPoolLock);
+  return ret;
+}
@@ -48,6 +48,13 @@ ncclResult_t buildIbvSymbols(struct ncclIbvSymbols* ibvSymbols) {
   ASSIGN_SYM(ibvSymbols, ibv_create_qp, ibv_internal_create_qp);
   ASSIGN_SYM(ibvSymbols, ibv_modify_qp, ibv_internal_modify_qp);
   ASSIGN_SYM(ibvSymbols, ibv_destroy_qp, ibv_internal_destroy_qp);
+  ASSIGN_SYM(ibvSymbols, ibv_create_srq, ibv_internal_create_srq);
+  ASSIGN_SYM(ibvSymbols, ibv_destroy_srq, ibv_internal_destroy_srq);
+  ASSIGN_SYM(ibvSymbols, ibv_create_ah, ibv_internal_create_ah);
+  ASSIGN_SYM(ibvSymbols, ibv_destroy_ah, ibv_internal_destroy_ah);
+  ASSIGN_SYM(ibvSymbols, ibv_attach_mcast, ibv_internal_attach_mcast);
+  ASSIGN_SYM(ibvSymbols, ibv_detach_mcast, ibv_internal_detach_mcast);
+  ASSIGN_SYM(ibvSymbols, ibv_qp_to_qp_ex, ibv_internal_qp_to_qp_ex);
   ASSIGN_SYM(ibvSymbols, ibv_fork_init, ibv_internal_fork_init);
   ASSIGN_SYM(ibvSymbols, ibv_event_type_str, ibv_internal_event_type_str);
 
@@ -120,6 +127,14 @@ ncclResult_t buildIbvSymbols(struct ncclIbvSymbols* ibvSymbols) {
   LOAD_SYM(ibvhandle, "ibv_create_qp", ibvSymbols->ibv_internal_create_qp);
   LOAD_SYM(ibvhandle, "ibv_modify_qp", ibvSymbols->ibv_internal_modify_qp);
   LOAD_SYM(ibvhandle, "ibv_destroy_qp", ibvSymbols->ibv_internal_destroy_qp);
+  LOAD_SYM(ibvhandle, "ibv_create_srq", ibvSymbols->ibv_internal_create_srq);
+  LOAD_SYM(ibvhandle, "ibv_destroy_srq", ibvSymbols->ibv_internal_destroy_srq);
+  LOAD_SYM(ibvhandle, "ibv_create_ah", ibvSymbols->ibv_internal_create_ah);
+  LOAD_SYM(ibvhandle, "ibv_destroy_ah", ibvSymbols->ibv_internal_destroy_ah);
+  LOAD_SYM(ibvhandle, "ibv_attach_mcast", ibvSymbols->ibv_internal_attach_mcast);
+  LOAD_SYM(ibvhandle, "ibv_detach_mcast", ibvSymbols->ibv_internal_detach_mcast);
+  // Cherry-pick the ibv_qp_to_qp_ex API from IBVERBS 1.6
+  LOAD_SYM_VERSION(ibvhandle, "ibv_qp_to_qp_ex", ibvSymbols->ibv_internal_qp_to_qp_ex, "IBVERBS_1.6");
   LOAD_SYM(ibvhandle, "ibv_fork_init", ibvSymbols->ibv_internal_fork_init);
   LOAD_SYM(ibvhandle, "ibv_event_type_str", ibvSymbols->ibv_internal_event_type_str);
 
@@ -148,6 +163,13 @@ teardown:
   ibvSymbols->ibv_internal_create_qp = NULL;
   ibvSymbols->ibv_internal_modify_qp = NULL;
   ibvSymbols->ibv_internal_destroy_qp = NULL;
+  ibvSymbols->ibv_internal_create_srq = NULL;
+  ibvSymbols->ibv_internal_destroy_srq = NULL;
+  ibvSymbols->ibv_internal_create_ah = NULL;
+  ibvSymbols->ibv_internal_destroy_ah = NULL;
+  ibvSymbols->ibv_internal_attach_mcast = NULL;
+  ibvSymbols->ibv_internal_detach_mcast = NULL;
+  ibvSymbols->ibv_internal_qp_to_qp_ex = NULL;
   ibvSymbols->ibv_internal_fork_init = NULL;
   ibvSymbols->ibv_internal_event_type_str = NULL;
 
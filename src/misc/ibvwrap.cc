@@ -167,6 +167,60 @@ ncclResult_t wrap_ibv_dereg_mr(struct ibv_mr *mr) { /*returns 0 on success, or t
   IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_dereg_mr, ibv_internal_dereg_mr(mr), 0, "ibv_dereg_mr");
 }
 
+// Device memory and ibv_advise_mr are inline calls into the provider, only
+// reachable when building against rdma-core.
+ncclResult_t wrap_ibv_alloc_dm(struct ibv_dm **ret, struct ibv_context *context, struct ibv_alloc_dm_attr *attr) {
+#ifdef NCCL_BUILD_RDMA_CORE
+  *ret = ibv_alloc_dm(context, attr);
+  if (*ret == NULL) {
+    INFO(NCCL_NET, "Call to ibv_alloc_dm failed with error %s", strerror(errno));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+#else
+  return ncclInvalidUsage;
+#endif
+}
+
+ncclResult_t wrap_ibv_free_dm(struct ibv_dm *dm) {
+#ifdef NCCL_BUILD_RDMA_CORE
+  int ret = ibv_free_dm(dm);
+  if (ret != IBV_SUCCESS) {
+    WARN("Call to ibv_free_dm failed with error %s", strerror(ret));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+#else
+  return ncclInvalidUsage;
+#endif
+}
+
+ncclResult_t wrap_ibv_reg_dm_mr(struct ibv_mr **ret, struct ibv_pd *pd, struct ibv_dm *dm, uint64_t dm_offset, size_t length, unsigned int access) {
+#ifdef NCCL_BUILD_RDMA_CORE
+  *ret = ibv_reg_dm_mr(pd, dm, dm_offset, length, access);
+  if (*ret == NULL) {
+    WARN("Call to ibv_reg_dm_mr failed with error %s", strerror(errno));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+#else
+  return ncclInvalidUsage;
+#endif
+}
+
+ncclResult_t wrap_ibv_advise_mr(struct ibv_pd *pd, enum ibv_advise_mr_advice advice, uint32_t flags, struct ibv_sge *sg_list, uint32_t num_sge) {
+#ifdef NCCL_BUILD_RDMA_CORE
+  int ret = ibv_advise_mr(pd, advice, flags, sg_list, num_sge);
+  if (ret != IBV_SUCCESS) {
+    INFO(NCCL_NET, "Call to ibv_advise_mr failed with error %s", strerror(ret));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+#else
+  return ncclInvalidUsage;
+#endif
+}
+
 ncclResult_t wrap_ibv_create_cq(struct ibv_cq **ret, struct ibv_context *context, int cqe, void *cq_context, struct ibv_comp_channel *channel, int comp_vector) {
   IBV_PTR_CHECK_ERRNO(ibvSymbols, ibv_internal_create_cq, ibv_internal_create_cq(context, cqe, cq_context, channel, comp_vector), *ret, NULL, "ibv_create_cq");
 }
@@ -187,6 +241,34 @@ ncclResult_t wrap_ibv_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int
   IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_modify_qp, ibv_internal_modify_qp(qp, attr, attr_mask), 0, "ibv_modify_qp");
 }
 
+ncclResult_t wrap_ibv_create_srq(struct ibv_srq **ret, struct ibv_pd *pd, struct ibv_srq_init_attr *srq_init_attr) {
+  IBV_PTR_CHECK_ERRNO(ibvSymbols, ibv_internal_create_srq, ibv_internal_create_srq(pd, srq_init_attr), *ret, NULL, "ibv_create_srq");
+}
+
+ncclResult_t wrap_ibv_destroy_srq(struct ibv_srq *srq) {
+  IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_destroy_srq, ibv_internal_destroy_srq(srq), 0, "ibv_destroy_srq");
+}
+
+ncclResult_t wrap_ibv_create_ah(struct ibv_ah **ret, struct ibv_pd *pd, struct ibv_ah_attr *attr) {
+  IBV_PTR_CHECK_ERRNO(ibvSymbols, ibv_internal_create_ah, ibv_internal_create_ah(pd, attr), *ret, NULL, "ibv_create_ah");
+}
+
+ncclResult_t wrap_ibv_destroy_ah(struct ibv_ah *ah) {
+  IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_destroy_ah, ibv_internal_destroy_ah(ah), 0, "ibv_destroy_ah");
+}
+
+ncclResult_t wrap_ibv_attach_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid) {
+  IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_attach_mcast, ibv_internal_attach_mcast(qp, gid, lid), 0, "ibv_attach_mcast");
+}
+
+ncclResult_t wrap_ibv_detach_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid) {
+  IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_detach_mcast, ibv_internal_detach_mcast(qp, gid, lid), 0, "ibv_detach_mcast");
+}
+
+ncclResult_t wrap_ibv_qp_to_qp_ex(struct ibv_qp_ex **ret, struct ibv_qp *qp) {
+  IBV_PTR_CHECK(ibvSymbols, ibv_internal_qp_to_qp_ex, ibv_internal_qp_to_qp_ex(qp), *ret, NULL, "ibv_qp_to_qp_ex");
+}
+
 ncclResult_t wrap_ibv_event_type_str(char **ret, enum ibv_event_type event) {
   *ret = (char *) ibvSymbols.ibv_internal_event_type_str(event);
   return ncclSuccess;
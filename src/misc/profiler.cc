@@ -5,11 +5,19 @@
  ************************************************************************/
 
 #include "profiler.h"
-
-//#define PROFILE_PROXY 1
-#ifdef PROFILE_PROXY
-#include "timer.h"
+#include "comm.h"
+#include "param.h"
 #include "alloc.h"
+#include "utils.h"
+#include <sys/syscall.h>
+
+// The proxy profiler is enabled at runtime by setting NCCL_PROXY_PROFILE to an output file name
+// (%h and %p are expanded to the hostname and pid). Each proxy progress thread records events into
+// its own ring buffer which is only ever touched by that thread, so recording needs no locking.
+// Completed events are periodically flushed to the file in Chrome trace format.
+NCCL_PARAM(ProxyProfileEvents, "PROXY_PROFILE_EVENTS", 65536);    // Ring size per proxy thread
+NCCL_PARAM(ProxyProfileSample, "PROXY_PROFILE_SAMPLE", 1);        // Profile one op every N opCounts
+NCCL_PARAM(ProxyProfileFlushMs, "PROXY_PROFILE_FLUSH_MS", 1000);  // Flush period
 
 static const char* profilingStateSendStr[] = { "BufferWait", "GPUWait", "SendWait", "", "End" };
 static const char* profilingStateRecvStr[] = { "BufferWait", "RecvWait", "FlushWait", "GPUWait", "End" };
@@ -22,94 +30,283 @@ struct ncclProxyProfileEvent {
   uint16_t channel;
   uint8_t type; // send / recv
   uint8_t opIndex;
+  uint8_t complete;
 };
 
-struct ncclProxyProfileEvent* profilingEvents = NULL;
-int profilingIndex = 0;
-double profilingStart = 0;
-#define MAX_EVENTS 200000
+struct ncclProxyProfiler {
+  struct ncclProxyProfileEvent* events;
+  uint64_t size; // power of 2
+  uint64_t head; // next event to record
+  uint64_t tail; // next event to flush
+  uint64_t dropped;
+  uint64_t lastFlush;
+  int tid;
+  // Sleep, Idle and Append events of the thread, which are not tied to an operation
+  struct ncclProxyProfileEvent* threadEvents[3];
+};
 
-ncclResult_t ncclProfilingRecord(struct ncclProxyArgs* args, int sub, int step, int state) {
-  if (profilingEvents == NULL) {
-    NCCLCHECK(ncclCalloc(&profilingEvents, MAX_EVENTS));
-    profilingStart = gettime();
+static int profilingEnabled = -1;
+static pthread_mutex_t profilingLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* profilingFile = NULL;
+static uint64_t profilingStart = 0;
+static uint64_t profilingNextId = 0;
+static __thread struct ncclProxyProfiler* profiler = NULL;
+
+static void profilingClose() {
+  pthread_mutex_lock(&profilingLock);
+  if (profilingFile) {
+    fprintf(profilingFile, "{} ]\n");
+    fclose(profilingFile);
+    profilingFile = NULL;
+  }
+  pthread_mutex_unlock(&profilingLock);
+}
+
+static void profilingOpen() {
+  pthread_mutex_lock(&profilingLock);
+  if (profilingEnabled != -1) goto exit;
+  {
+    const char* env = getenv("NCCL_PROXY_PROFILE");
+    int enabled = 0;
+    if (env && env[0] != '\0') {
+      char hostname[1024];
+      char fileName[PATH_MAX+1] = "";
+      char* fn = fileName;
+      getHostName(hostname, 1024, '.');
+      int c = 0;
+      while (env[c] != '\0' && fn-fileName < PATH_MAX-64) {
+        if (env[c++] != '%') { *fn++ = env[c-1]; continue; }
+        switch (env[c++]) {
+          case '%': *fn++ = '%'; break;
+          case 'h': fn += snprintf(fn, PATH_MAX-(fn-fileName), "%s", hostname); break;
+          case 'p': fn += snprintf(fn, PATH_MAX-(fn-fileName), "%d", getpid()); break;
+          case '\0': c--; break;
+          default: *fn++ = '%'; *fn++ = env[c-1]; break;
+        }
+      }
+      *fn = '\0';
+      profilingFile = fopen(fileName, "w");
+      if (profilingFile == NULL) {
+        WARN("Proxy profiler: unable to open %s : %s", fileName, strerror(errno));
+      } else {
+        fprintf(profilingFile, "[\n");
+        profilingStart = clockNano();
+        atexit(profilingClose);
+        enabled = 1;
+        INFO(NCCL_INIT|NCCL_PROXY, "Proxy profiler enabled, writing to %s (sample 1/%ld, %ld events per thread)",
+            fileName, ncclParamProxyProfileSample(), ncclParamProxyProfileEvents());
+      }
+    }
+    __atomic_store_n(&profilingEnabled, enabled, __ATOMIC_RELEASE);
   }
+exit:
+  pthread_mutex_unlock(&profilingLock);
+}
+
+static void writeEvent(FILE* f, struct ncclProxyProfileEvent* e, uint64_t i, int tid) {
+  const int sendrecv = e->peer >= 0;
+  const char* typeStr = sendrecv ? (e->type == ncclPatternSend ? "Send" : "Recv") :
+    profilingEventStr[-(e->peer/8)];
+
+  if (sendrecv) {
+    int state = ncclProxyProfileBegin;
+    const char** stateStr = e->type == ncclPatternSend ? profilingStateSendStr : profilingStateRecvStr;
+    fprintf(f, "{\"name\": \"%s-%d-%d\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %ld, \"pid\": %d, \"tid\": %d, \"ts\": %f, \"args\": { \"opCount\": %ld, \"proxyOpIndex\":%d } },\n",
+        typeStr, e->peer, e->step, i, e->channel, tid, e->timestamp[state], e->opCount, e->opIndex);
+
+    while (state<ncclProxyProfileEnd) {
+      if (e->timestamp[state]) {
+        const char* name = stateStr[state];
+        fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %ld, \"pid\": %d, \"tid\": %d, \"ts\": %f },\n",
+            name, i, e->channel, tid, e->timestamp[state]);
+        state++;
+        while (e->timestamp[state] == 0) state++;
+        fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"e\", \"id\": %ld, \"pid\": %d, \"tid\": %d, \"ts\": %f },\n",
+            name, i, e->channel, tid, e->timestamp[state]);
+      } else {
+        state++;
+      }
+    }
+
+    fprintf(f, "{\"name\": \"%s-%d-%d\", \"cat\": \"NET\", \"ph\": \"e\", \"id\": %ld, \"pid\": %d, \"tid\": %d, \"ts\": %f },\n",
+        typeStr, e->peer, e->step, i, e->channel, tid, e->timestamp[state]);
+  } else {
+    if (e->peer == -ncclProxyProfileAppend) {
+      fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %ld, \"pid\": -1, \"tid\": %d, \"ts\": %f, \"args\": { \"added\": %ld } },\n",
+          typeStr, i, tid, e->timestamp[0], e->opCount);
+    } else {
+      fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %ld, \"pid\": -1, \"tid\": %d, \"ts\": %f },\n",
+          typeStr, i, tid, e->timestamp[0]);
+    }
+    fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"e\", \"id\": %ld, \"pid\": -1, \"tid\": %d, \"ts\": %f },\n",
+        typeStr, i, tid, e->timestamp[1]);
+  }
+}
+
+// Write out all completed events at the tail of the ring. Events still in flight stop the flush
+// since their slot cannot be reused until they complete. If 'all' is set (thread exit), in-flight
+// events are discarded.
+static void profilingFlush(struct ncclProxyProfiler* p, bool all) {
+  uint64_t end = p->tail;
+  while (end < p->head && (all || p->events[end&(p->size-1)].complete)) end++;
+  if (end != p->tail) {
+    pthread_mutex_lock(&profilingLock);
+    if (profilingFile) {
+      for (uint64_t i=p->tail; i<end; i++) {
+        struct ncclProxyProfileEvent* e = p->events+(i&(p->size-1));
+        if (e->complete) writeEvent(profilingFile, e, profilingNextId++, p->tid);
+      }
+      fflush(profilingFile);
+    }
+    pthread_mutex_unlock(&profilingLock);
+    p->tail = end;
+  }
+  p->lastFlush = clockNano();
+}
+
+static struct ncclProxyProfileEvent* profilingNewEvent(struct ncclProxyProfiler* p) {
+  if (p->head - p->tail == p->size) {
+    p->dropped++;
+    return NULL;
+  }
+  struct ncclProxyProfileEvent* event = p->events+(p->head&(p->size-1));
+  memset(event, 0, sizeof(struct ncclProxyProfileEvent));
+  p->head++;
+  return event;
+}
+
+static ncclResult_t profilingThreadInit() {
+  uint64_t size = 1;
+  while (size < ncclParamProxyProfileEvents()) size <<= 1;
+  struct ncclProxyProfiler* p;
+  NCCLCHECK(ncclCalloc(&p, 1));
+  NCCLCHECK(ncclCalloc(&p->events, size));
+  p->size = size;
+  p->tid = syscall(SYS_gettid);
+  p->lastFlush = clockNano();
+  profiler = p;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclProfilingRecord(struct ncclProxyArgs* args, int sub, int step, int state) {
+  if (__builtin_expect(__atomic_load_n(&profilingEnabled, __ATOMIC_ACQUIRE) == -1, false)) profilingOpen();
+  if (profilingEnabled == 0) return ncclSuccess;
+  if (profiler == NULL) NCCLCHECK(profilingThreadInit());
+  struct ncclProxyProfiler* p = profiler;
+  struct ncclProxySubArgs* s = args->subs+sub;
+  double now = (clockNano()-profilingStart)/1e3;
+  void** slot = state >= ncclProxyProfileSleep ? (void**)(p->threadEvents+state/8-1) : s->profilingEvents+step%s->nSteps;
+
   struct ncclProxyProfileEvent* event = NULL;
-  if (state%8 == 0) {
-    if (profilingIndex == MAX_EVENTS) return ncclSuccess;
-    args->subs[sub].profilingEvents[step%NCCL_STEPS] = event = profilingEvents+profilingIndex++;
-    if (state == ncclProxyProfileBegin) {
-      // Proxy operation information
-      event->opCount = args->opCount;
-      event->channel = args->subs[sub].channelId;
-      event->peer = args->subs[sub].peer;
-      event->type = args->pattern;
-      event->step = step;
-      event->opIndex = (((uint64_t)args)/sizeof(struct ncclProxyArgs))%256;
-    } else event->peer = -state;
+  bool flush = state == ncclProxyProfileSleep; // Flush before the thread goes to sleep
+  if (state == ncclProxyProfileBegin) {
+    // Only remember when the op started ; per-step events are created when the step is posted so
+    // that ops with more steps than the connection's pipeline don't overwrite each other's in-flight events.
+    bool sampled = ncclParamProxyProfileSample() <= 1 || args->opCount % ncclParamProxyProfileSample() == 0;
+    s->profilingBegin = sampled ? now : 0;
+    for (int i=0; i<s->nSteps; i++) s->profilingEvents[i] = NULL;
+    return ncclSuccess;
+  } else if (state < ncclProxyProfileEnd && state%8 == 1 && s->profilingBegin != 0 &&
+      *slot == NULL) {
+    // First state after Begin : SendGPUWait or RecvWait
+    if ((event = profilingNewEvent(p)) == NULL) return ncclSuccess;
+    *slot = event;
+    event->opCount = args->opCount;
+    event->channel = s->channelId;
+    event->peer = s->peer;
+    event->type = args->pattern;
+    event->step = step;
+    event->opIndex = (((uint64_t)args)/sizeof(struct ncclProxyArgs))%256;
+    event->timestamp[ncclProxyProfileBegin] = s->profilingBegin;
+  } else if (state >= ncclProxyProfileSleep && state%8 == 0) {
+    if ((event = profilingNewEvent(p)) == NULL) {
+      *slot = NULL;
+      return ncclSuccess;
+    }
+    *slot = event;
+    event->peer = -state;
+    state = 0;
   } else {
-    event = (struct ncclProxyProfileEvent*)args->subs[sub].profilingEvents[step%NCCL_STEPS];
-    if (state == ncclProxyProfileEnd) args->subs[sub].profilingEvents[step%NCCL_STEPS] = NULL;
+    event = (struct ncclProxyProfileEvent*)*slot;
+    if (event == NULL) return ncclSuccess;
+    if (state >= ncclProxyProfileEnd) {
+      *slot = NULL;
+      event->complete = 1;
+    }
     if (state == ncclProxyProfileAppendEnd) event->opCount = args->opCount;
   }
   // Timestamp
-  event->timestamp[state%8] = gettime()-profilingStart;
+  event->timestamp[state%8] = now;
+
+  if (flush || p->head - p->tail >= p->size/2 ||
+      clockNano() - p->lastFlush > ncclParamProxyProfileFlushMs()*1000000) {
+    profilingFlush(p, false);
+  }
   return ncclSuccess;
 }
 
 void ncclProfilingDump() {
-  static int dumpDone = 0;
-  if (dumpDone) return;
-  dumpDone = 1;
-  const char* str = getenv("NCCL_PROXY_PROFILE");
-  if (!str) { free(profilingEvents); return; }
-  FILE* f = fopen(str, "w");
-  fprintf(f, "[\n");
-
-  for (int i=0; i<profilingIndex; i++) {
-    struct ncclProxyProfileEvent* e = profilingEvents+i;
-    const int sendrecv = e->peer >= 0;
-    const char* typeStr = sendrecv ? (e->type == ncclPatternSend ? "Send" : "Recv") :
-      profilingEventStr[-(e->peer/8)];
-
-
-    if (sendrecv) {
-      int state = ncclProxyProfileBegin;
-      const char** stateStr = e->type == ncclPatternSend ? profilingStateSendStr : profilingStateRecvStr;
-      fprintf(f, "{\"name\": \"%s-%d-%d\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %d, \"pid\": %d, \"tid\": 1, \"ts\": %f, \"args\": { \"opCount\": %ld, \"proxyOpIndex\":%d } },\n",
-          typeStr, e->peer, e->step, i, e->channel, e->timestamp[state], e->opCount, e->opIndex);
-
-      while (state<ncclProxyProfileEnd) {
-        if (e->timestamp[state]) {
-          const char* name = stateStr[state];
-          fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %d, \"pid\": %d, \"tid\": 1, \"ts\": %f },\n",
-              name, i, e->channel, e->timestamp[state]);
-          state++;
-          while (e->timestamp[state] == 0) state++;
-          fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"e\", \"id\": %d, \"pid\": %d, \"tid\": 1, \"ts\": %f },\n",
-              name, i, e->channel, e->timestamp[state]);
-        }
-      }
+  struct ncclProxyProfiler* p = profiler;
+  if (p == NULL) return;
+  profilingFlush(p, true);
+  if (p->dropped) INFO(NCCL_PROXY, "Proxy profiler: dropped %ld events, consider increasing NCCL_PROXY_PROFILE_EVENTS", p->dropped);
+  profiler = NULL;
+  free(p->events);
+  free(p);
+}
 
-      fprintf(f, "{\"name\": \"%s-%d-%d\", \"cat\": \"NET\", \"ph\": \"e\", \"id\": %d, \"pid\": %d, \"tid\": 1, \"ts\": %f },\n",
-          typeStr, e->peer, e->step, i, e->channel, e->timestamp[state]);
-    } else {
-      if (e->peer == -ncclProxyProfileAppend) {
-      fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %d, \"pid\": -1, \"tid\": 1, \"ts\": %f, \"args\": { \"added\": %ld } },\n",
-          typeStr, i, e->timestamp[0], e->opCount);
+bool ncclProfilingEnabled() {
+  if (__atomic_load_n(&profilingEnabled, __ATOMIC_ACQUIRE) == -1) profilingOpen();
+  return profilingEnabled == 1;
+}
+
+static const char* deviceTimelineStr[] = { "Work", "Wait", "LLWait", "Copy" };
+
+// The GPU stamps events with %globaltimer, which tracks CLOCK_REALTIME, while the proxy events are
+// relative to CLOCK_MONOTONIC. The offset between the two clocks is sampled on each harvest, which
+// is good enough to line up GPU and proxy activity to within a few microseconds.
+void ncclProfilingDeviceTimeline(struct ncclComm* comm) {
+  if (comm->timeline == NULL || !ncclProfilingEnabled()) return;
+  struct timespec rt;
+  clock_gettime(CLOCK_REALTIME, &rt);
+  int64_t offset = (rt.tv_sec*1000000000LL + rt.tv_nsec) - (int64_t)clockNano();
+  uint64_t overwritten = 0;
+
+  pthread_mutex_lock(&profilingLock);
+  for (int c=0; c<MAXCHANNELS && profilingFile; c++) {
+    struct ncclDevTimelineEvent* events = comm->timeline + c*NCCL_DEV_TIMELINE_EVENTS;
+    uint32_t seen = comm->timelineHarvested[c];
+    while (1) {
+      volatile struct ncclDevTimelineEvent* e = events + seen%NCCL_DEV_TIMELINE_EVENTS;
+      uint32_t seq = e->seq;
+      if ((int32_t)(seq - (seen+1)) < 0) break; // Not written yet
+      if (seq != seen+1) {
+        // The GPU lapped us, skip what was lost.
+        overwritten += seq - (seen+1);
+        seen = seq-1;
+        continue;
+      }
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      uint64_t timestamp = e->timestamp;
+      int type = e->type, info = e->info;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (e->seq != seq) continue; // Overwritten while we were reading it
+      seen++;
+      if (type >= ncclDevTimelineNumTypes) continue;
+      double ts = ((int64_t)timestamp - offset - (int64_t)profilingStart)/1e3;
+      int cat = type/2;
+      int tid = -(1 + comm->cudaDev*1024 + cat*256 + info);
+      if (cat == 0) {
+        fprintf(profilingFile, "{\"name\": \"%s\", \"cat\": \"GPU\", \"ph\": \"%s\", \"pid\": %d, \"tid\": %d, \"ts\": %f, \"args\": { \"rank\": %d, \"funcIndex\": %d } },\n",
+            deviceTimelineStr[cat], type%2 ? "E" : "B", c, tid, ts, comm->rank, info);
       } else {
-        fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"b\", \"id\": %d, \"pid\": -1, \"tid\": 1, \"ts\": %f },\n",
-          typeStr, i, e->timestamp[0]);
+        fprintf(profilingFile, "{\"name\": \"%s-%d\", \"cat\": \"GPU\", \"ph\": \"%s\", \"pid\": %d, \"tid\": %d, \"ts\": %f },\n",
+            deviceTimelineStr[cat], info, type%2 ? "E" : "B", c, tid, ts);
       }
-      fprintf(f, "{\"name\": \"%s\", \"cat\": \"NET\", \"ph\": \"e\", \"id\": %d, \"pid\": -1, \"tid\": 1, \"ts\": %f },\n",
-          typeStr, i, e->timestamp[1]);
     }
+    comm->timelineHarvested[c] = seen;
   }
-  fprintf(f, "{} ]\n");
-  fclose(f);
-  free(profilingEvents);
+  if (profilingFile) fflush(profilingFile);
+  pthread_mutex_unlock(&profilingLock);
+  if (overwritten) INFO(NCCL_PROXY, "Device timeline: %ld events were overwritten before being written out", overwritten);
 }
-#else
-ncclResult_t ncclProfilingRecord(struct ncclProxyArgs* args, int sub, int step, int state) { return ncclSuccess; }
-void ncclProfilingDump() {}
-#endif
@@ -6,6 +6,7 @@
 
 #include "shm.h"
 #include "checks.h"
+#include "param.h"
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -16,6 +17,13 @@
 #include <unistd.h>
 #include <utils.h>
 
+// Segments of a huge page or more are sized to a multiple of it and advised to use transparent
+// huge pages, so that the SHM transport buffers staged through them take fewer TLB misses and
+// pin faster. Creator and peers round the same way, the refcount stays right after shmSize.
+NCCL_PARAM(ShmHugePages, "SHM_HUGE_PAGES", 1);
+
+#define SHM_HUGE_PAGE_SIZE (2ULL<<20)
+
 struct shmHandleInternal {
   int fd;
   char* shmPath;
@@ -52,7 +60,9 @@ ncclResult_t ncclShmOpen(char* shmPath, size_t shmSize, void** shmPtr, void** de
   struct shmHandleInternal* tmphandle;
   bool create = refcount > 0 ? true : false;
   const size_t refSize = sizeof(int); /* extra sizeof(int) bytes for reference count */
-  const size_t realShmSize = shmSize + refSize;
+  size_t realShmSize = shmSize + refSize;
+  bool huge = ncclParamShmHugePages() && realShmSize >= SHM_HUGE_PAGE_SIZE;
+  if (huge) realShmSize = ROUNDUP(realShmSize, SHM_HUGE_PAGE_SIZE);
 
   *handle = *shmPtr = NULL; /* assume shmPtr and handle always set correctly by users. */
   EQCHECKGOTO(tmphandle = (struct shmHandleInternal*)calloc(1, sizeof(struct shmHandleInternal)), NULL, ret, fail);
@@ -84,6 +94,7 @@ ncclResult_t ncclShmOpen(char* shmPath, size_t shmSize, void** shmPtr, void** de
     hptr = NULL;
     goto fail;
   }
+  if (huge) madvise(hptr, realShmSize, MADV_HUGEPAGE); // Best effort, needs shmem_enabled=advise
 
   if (create) {
     *(int*)(hptr + shmSize) = refcount;
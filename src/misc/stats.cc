@@ -0,0 +1,144 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "stats.h"
+#include "comm.h"
+#include "argcheck.h"
+
+static_assert(NCCL_STATS_MAX_CHANNELS == MAXCHANNELS, "NCCL_STATS_MAX_CHANNELS must match MAXCHANNELS");
+static_assert(NCCL_STATS_NUM_PROTOCOLS == NCCL_NUM_PROTOCOLS, "NCCL_STATS_NUM_PROTOCOLS must match NCCL_NUM_PROTOCOLS");
+static_assert(NCCL_STATS_NUM_TRANSPORTS == NTRANSPORTS, "NCCL_STATS_NUM_TRANSPORTS must match NTRANSPORTS");
+static_assert(NCCL_STATS_MAX_NETDEVS == NCCL_MAX_NETDEVS, "NCCL_STATS_MAX_NETDEVS must match NCCL_MAX_NETDEVS");
+
+ncclResult_t ncclProxyStatsInit(struct ncclProxyState* proxyState, int nPeers) {
+  struct ncclProxyStats* stats;
+  NCCLCHECK(ncclCalloc(&stats, 1));
+  NCCLCHECK(ncclCalloc(&stats->peers, 2*nPeers));
+  stats->nPeers = nPeers;
+  proxyState->stats = stats;
+  return ncclSuccess;
+}
+
+void ncclProxyStatsFree(struct ncclProxyState* proxyState) {
+  if (proxyState->stats == NULL) return;
+  free(proxyState->stats->peers);
+  free(proxyState->stats);
+  proxyState->stats = NULL;
+}
+
+NCCL_PARAM(NetRebalancePct, "NET_REBALANCE_PCT", 50);
+NCCL_PARAM(NetRebalanceMinBytes, "NET_REBALANCE_MIN_BYTES", 64LL<<20);
+
+// Refresh the bandwidth of NICs which completed enough bytes since the last evaluation, then
+// compare dev against the fastest one. NICs without traffic keep their last bandwidth.
+int ncclProxyStatsNetDegraded(struct ncclProxyState* proxyState, int dev) {
+  struct ncclProxyStats* stats = proxyState ? proxyState->stats : NULL;
+  if (stats == NULL || dev < 0 || dev >= NCCL_MAX_NETDEVS) return 0;
+  uint64_t minBytes = ncclParamNetRebalanceMinBytes();
+  double maxBw = 0;
+  for (int d=0; d<NCCL_MAX_NETDEVS; d++) {
+    struct ncclNetDevStats* n = stats->netDevs+d;
+    uint64_t bytes = ncclStatsLoad(&n->bytes);
+    uint64_t busyNs = ncclStatsLoad(&n->busyNs);
+    if (bytes - n->lastBytes >= minBytes && busyNs > n->lastBusyNs) {
+      n->bw = (bytes - n->lastBytes) / (double)(busyNs - n->lastBusyNs);
+      n->lastBytes = bytes;
+      n->lastBusyNs = busyNs;
+    }
+    if (n->bw > maxBw) maxBw = n->bw;
+  }
+  struct ncclNetDevStats* n = stats->netDevs+dev;
+  int degraded = n->bw > 0 && n->bw*100 < maxBw*ncclParamNetRebalancePct();
+  if (degraded != n->degraded) {
+    if (degraded) WARN("NET/%d is degraded : %.2f GB/s per connection vs %.2f GB/s on the fastest NIC", dev, n->bw, maxBw);
+    else INFO(NCCL_NET, "NET/%d recovered : %.2f GB/s per connection vs %.2f GB/s on the fastest NIC", dev, n->bw, maxBw);
+    n->degraded = degraded;
+  }
+  return degraded;
+}
+
+static void statsCopy(ncclStatsBytes_t* dst, const struct ncclStatsCounter* src, int n) {
+  for (int i=0; i<n; i++) {
+    dst[i].posted = ncclStatsLoad(&src[i].posted);
+    dst[i].completed = ncclStatsLoad(&src[i].completed);
+  }
+}
+
+NCCL_API(ncclResult_t, ncclCommGetStats, const ncclComm_t comm, ncclCommStats_t* stats);
+ncclResult_t ncclCommGetStats(const ncclComm_t comm, ncclCommStats_t* stats) {
+  NCCLCHECK(PtrCheck(comm, "CommGetStats", "comm"));
+  NCCLCHECK(PtrCheck(stats, "CommGetStats", "stats"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+
+  memset(stats, 0, sizeof(ncclCommStats_t));
+  stats->plans = ncclStatsLoad(&comm->statsPlans);
+  stats->workFifoFullWaits = ncclStatsLoad(&comm->statsWorkFifoFullWaits);
+  stats->workFifoOverflows = ncclStatsLoad(&comm->statsWorkFifoOverflows);
+  stats->collCacheHits = ncclStatsLoad(&comm->statsCollCacheHits);
+#if CUDART_VERSION >= 12010
+  if (comm->nvlsResources && comm->nvlsResources->inited) stats->nvlsBufferBytes = comm->nvlsResources->size;
+#endif
+  struct ncclProxyStats* proxyStats = comm->proxyState ? comm->proxyState->stats : NULL;
+  if (proxyStats) {
+    statsCopy(&stats->channels[0][0], &proxyStats->channels[0][0], MAXCHANNELS*2);
+    statsCopy(&stats->protocols[0][0], &proxyStats->protocols[0][0], NCCL_NUM_PROTOCOLS*2);
+    statsCopy(&stats->transports[0][0], &proxyStats->transports[0][0], NTRANSPORTS*2);
+    stats->netTestPending = ncclStatsLoad(&proxyStats->netTestPending);
+    for (int d=0; d<NCCL_MAX_NETDEVS; d++) {
+      stats->netSendBytes[d] = ncclStatsLoad(&proxyStats->netDevs[d].bytes);
+      stats->netSendBusyNs[d] = ncclStatsLoad(&proxyStats->netDevs[d].busyNs);
+    }
+    for (int t=0; t<NTRANSPORTS; t++) stats->proxyProgressCalls[t] = ncclStatsLoad(&proxyStats->progressCalls[t]);
+    stats->proxyStalls = ncclStatsLoad(&proxyStats->stalls);
+  }
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommGetPeerStats, const ncclComm_t comm, int peer, ncclStatsBytes_t* send, ncclStatsBytes_t* recv);
+ncclResult_t ncclCommGetPeerStats(const ncclComm_t comm, int peer, ncclStatsBytes_t* send, ncclStatsBytes_t* recv) {
+  NCCLCHECK(PtrCheck(comm, "CommGetPeerStats", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (peer < 0 || peer >= comm->nRanks) {
+    WARN("CommGetPeerStats : invalid peer %d, nranks %d", peer, comm->nRanks);
+    return ncclInvalidArgument;
+  }
+  struct ncclProxyStats* proxyStats = comm->proxyState ? comm->proxyState->stats : NULL;
+  ncclStatsBytes_t bytes[2];
+  memset(bytes, 0, sizeof(bytes));
+  if (proxyStats && peer < proxyStats->nPeers) statsCopy(bytes, proxyStats->peers+2*peer, 2);
+  if (send) *send = bytes[1];
+  if (recv) *recv = bytes[0];
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommGetMemUsage, const ncclComm_t comm, ncclMemUsage_t* usage);
+ncclResult_t ncclCommGetMemUsage(const ncclComm_t comm, ncclMemUsage_t* usage) {
+  NCCLCHECK(PtrCheck(comm, "CommGetMemUsage", "comm"));
+  NCCLCHECK(PtrCheck(usage, "CommGetMemUsage", "usage"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+
+  memset(usage, 0, sizeof(ncclMemUsage_t));
+  // Connection and shared buffers belong to the proxy, so they are shared with split communicators
+  struct ncclProxyStats* proxyStats = comm->proxyState ? comm->proxyState->stats : NULL;
+  if (proxyStats) {
+    for (int k=NCCL_MEM_CONNECTIONS; k<=NCCL_MEM_PROXY_SHARED; k++) {
+      usage->device[k] = ncclStatsLoad(&proxyStats->memDevice[k]);
+      usage->host[k] = ncclStatsLoad(&proxyStats->memHost[k]);
+    }
+  }
+#if CUDART_VERSION >= 12010
+  if (comm->nvlsResources && comm->nvlsResources->inited) usage->device[NCCL_MEM_NVLS] = comm->nvlsResources->size;
+#endif
+  size_t fifoBytes = (size_t)comm->workFifoDepth*sizeof(struct ncclWork);
+  if (comm->workFifoHeapGdrHandle) usage->device[NCCL_MEM_WORK_FIFO] = fifoBytes;
+  else usage->host[NCCL_MEM_WORK_FIFO] = fifoBytes;
+  for (int k=0; k<NCCL_MEM_NUM_KINDS; k++) {
+    usage->totalDevice += usage->device[k];
+    usage->totalHost += usage->host[k];
+  }
+  usage->budget = (size_t)comm->config.memBudget << 20;
+  return ncclSuccess;
+}
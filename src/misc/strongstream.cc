@@ -85,8 +85,8 @@ ncclResult_t ncclCudaGraphAddDestructor(struct ncclCudaGraph graph, cudaHostFn_t
 
 ////////////////////////////////////////////////////////////////////////////////
 
-ncclResult_t ncclStrongStreamConstruct(struct ncclStrongStream* ss) {
-  CUDACHECK(cudaStreamCreateWithFlags(&ss->cudaStream, cudaStreamNonBlocking));
+ncclResult_t ncclStrongStreamConstruct(struct ncclStrongStream* ss, int priority) {
+  CUDACHECK(cudaStreamCreateWithPriority(&ss->cudaStream, cudaStreamNonBlocking, priority));
   #if CUDART_VERSION >= 11030
     CUDACHECK(cudaEventCreateWithFlags(&ss->serialEvent, cudaEventDisableTiming));
     ss->everCaptured = false;
@@ -0,0 +1,87 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include <dlfcn.h>
+#include <errno.h>
+#include "comm.h"
+#include "tuner.h"
+
+static_assert(NCCL_TUNER_NUM_ALGORITHMS == NCCL_NUM_ALGORITHMS, "Tuner algorithms must match NCCL_NUM_ALGORITHMS");
+static_assert(NCCL_TUNER_NUM_PROTOCOLS == NCCL_NUM_PROTOCOLS, "Tuner protocols must match NCCL_NUM_PROTOCOLS");
+static_assert(NCCL_TUNER_COLL_ALLREDUCE == ncclFuncAllReduce, "Tuner collective types must match ncclFunc_t");
+
+static pthread_mutex_t tunerPluginLock = PTHREAD_MUTEX_INITIALIZER;
+static int tunerPluginRefCount = -1; // -1 : not loaded yet
+static void* tunerPluginLib = nullptr;
+static ncclTuner_t* tunerSymbol = nullptr;
+
+static void tunerPluginOpen() {
+  char tunerPluginName[128];
+  const char* envPluginName = getenv("NCCL_TUNER_PLUGIN");
+  if (envPluginName && strlen(envPluginName)) {
+    snprintf(tunerPluginName, 128, "libnccl-tuner-%s.so", envPluginName);
+    INFO(NCCL_INIT|NCCL_TUNING, "Tuner plugin name set by env to %s", tunerPluginName);
+  } else {
+    sprintf(tunerPluginName, "libnccl-tuner.so");
+  }
+  tunerPluginLib = dlopen(tunerPluginName, RTLD_NOW | RTLD_LOCAL);
+  if (tunerPluginLib == nullptr) {
+    INFO(NCCL_INIT|NCCL_TUNING, "TUNER/Plugin : Plugin load (%s) returned %d : %s", tunerPluginName, errno, dlerror());
+    INFO(NCCL_INIT|NCCL_TUNING, "TUNER/Plugin : No plugin found, using internal tuning model");
+    return;
+  }
+  tunerSymbol = (ncclTuner_t*)dlsym(tunerPluginLib, NCCL_TUNER_PLUGIN_SYMBOL);
+  if (tunerSymbol == nullptr) {
+    INFO(NCCL_INIT|NCCL_TUNING, "TUNER/Plugin : Failed to find %s symbol.", NCCL_TUNER_PLUGIN_SYMBOL);
+    dlclose(tunerPluginLib);
+    tunerPluginLib = nullptr;
+    return;
+  }
+  INFO(NCCL_INIT|NCCL_TUNING, "TUNER/Plugin : Loaded tuner plugin %s", tunerSymbol->name);
+}
+
+static void tunerPluginRelease() {
+  pthread_mutex_lock(&tunerPluginLock);
+  // Keep the library loaded until the last communicator using it goes away.
+  if (--tunerPluginRefCount == 0) {
+    dlclose(tunerPluginLib);
+    tunerPluginLib = nullptr;
+    tunerSymbol = nullptr;
+    tunerPluginRefCount = -1;
+  }
+  pthread_mutex_unlock(&tunerPluginLock);
+}
+
+ncclResult_t ncclTunerPluginLoad(struct ncclComm* comm) {
+  comm->tuner = nullptr;
+  comm->tunerContext = nullptr;
+  pthread_mutex_lock(&tunerPluginLock);
+  if (tunerPluginRefCount == -1) {
+    tunerPluginOpen();
+    tunerPluginRefCount = 0;
+  }
+  if (tunerSymbol) tunerPluginRefCount++;
+  ncclTuner_t* tuner = tunerSymbol;
+  pthread_mutex_unlock(&tunerPluginLock);
+  if (tuner == nullptr) return ncclSuccess;
+
+  if (tuner->init(comm->nRanks, comm->nNodes, ncclDebugLog, &comm->tunerContext) != ncclSuccess) {
+    WARN("TUNER/Plugin : %s init failed, using internal tuning model", tuner->name);
+    comm->tunerContext = nullptr;
+    tunerPluginRelease();
+    return ncclSuccess;
+  }
+  comm->tuner = tuner;
+  return ncclSuccess;
+}
+
+void ncclTunerPluginUnload(struct ncclComm* comm) {
+  if (comm->tuner == nullptr) return;
+  comm->tuner->destroy(comm->tunerContext);
+  comm->tuner = nullptr;
+  comm->tunerContext = nullptr;
+  tunerPluginRelease();
+}
@@ -0,0 +1,119 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "uringwrap.h"
+#include "core.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+static int sysUringSetup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+static int sysUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+static int sysUringRegister(int fd, unsigned opcode, void* arg, unsigned nargs) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+#else
+static int sysUringSetup(unsigned entries, struct io_uring_params* params) { errno = ENOSYS; return -1; }
+static int sysUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) { errno = ENOSYS; return -1; }
+static int sysUringRegister(int fd, unsigned opcode, void* arg, unsigned nargs) { errno = ENOSYS; return -1; }
+#endif
+
+ncclResult_t ncclUringInit(struct ncclUring* ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(struct ncclUring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = sysUringSetup(entries, &params);
+  if (ring->fd < 0) {
+    INFO(NCCL_NET, "io_uring_setup failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  ring->entries = params.sq_entries;
+  ring->sqSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  ring->cqSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  int singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMmap) ring->sqSize = ring->cqSize = std::max(ring->sqSize, ring->cqSize);
+
+  ring->sqPtr = mmap(NULL, ring->sqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqPtr == MAP_FAILED) goto fail;
+  if (singleMmap) {
+    ring->cqPtr = ring->sqPtr;
+  } else {
+    ring->cqPtr = mmap(NULL, ring->cqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqPtr == MAP_FAILED) goto fail;
+  }
+  ring->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto fail;
+
+  ring->sqHead = (unsigned*)((char*)ring->sqPtr + params.sq_off.head);
+  ring->sqTail = (unsigned*)((char*)ring->sqPtr + params.sq_off.tail);
+  ring->sqMask = (unsigned*)((char*)ring->sqPtr + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)((char*)ring->sqPtr + params.sq_off.array);
+  ring->cqHead = (unsigned*)((char*)ring->cqPtr + params.cq_off.head);
+  ring->cqTail = (unsigned*)((char*)ring->cqPtr + params.cq_off.tail);
+  ring->cqMask = (unsigned*)((char*)ring->cqPtr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cqPtr + params.cq_off.cqes);
+  return ncclSuccess;
+fail:
+  WARN("io_uring mmap failed : %s", strerror(errno));
+  if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+  if (ring->cqPtr == MAP_FAILED) ring->cqPtr = NULL;
+  if (ring->sqPtr == MAP_FAILED) ring->sqPtr = NULL;
+  ncclUringFini(ring);
+  return ncclSystemError;
+}
+
+ncclResult_t ncclUringFini(struct ncclUring* ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqPtr && ring->cqPtr != ring->sqPtr) munmap(ring->cqPtr, ring->cqSize);
+  if (ring->sqPtr) munmap(ring->sqPtr, ring->sqSize);
+  if (ring->fd >= 0) close(ring->fd);
+  memset(ring, 0, sizeof(struct ncclUring));
+  ring->fd = -1;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclUringRegisterFiles(struct ncclUring* ring, int* fds, int nfds) {
+  if (sysUringRegister(ring->fd, IORING_REGISTER_FILES, fds, nfds) < 0) {
+    INFO(NCCL_NET, "io_uring_register of %d files failed : %s", nfds, strerror(errno));
+    return ncclSystemError;
+  }
+  ring->fixedFiles = 1;
+  return ncclSuccess;
+}
+
+struct io_uring_sqe* ncclUringGetSqe(struct ncclUring* ring) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqeTail - head >= ring->entries) return NULL;
+  struct io_uring_sqe* sqe = ring->sqes + (ring->sqeTail & *ring->sqMask);
+  ring->sqeTail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+ncclResult_t ncclUringSubmit(struct ncclUring* ring) {
+  unsigned tail = *ring->sqTail;
+  while (ring->sqeHead != ring->sqeTail) {
+    ring->sqArray[tail & *ring->sqMask] = ring->sqeHead & *ring->sqMask;
+    tail++;
+    ring->sqeHead++;
+  }
+  __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+  // Entries the kernel did not consume in a previous call are submitted again
+  unsigned toSubmit = tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (toSubmit == 0) return ncclSuccess;
+  if (sysUringEnter(ring->fd, toSubmit, 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    WARN("io_uring_enter failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
@@ -5,20 +5,27 @@
 #include <string.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <limits.h>
 //#include <sys/types.h>
 //#include <sys/stat.h>
 //#include <unistd.h>
 
-static ncclNet_v6_t ncclNet_v4_as_v6;
-static ncclNet_v6_t ncclNet_v5_as_v6;
+static ncclNet_sochin_v2_t ncclNet_v4_as_sochin_v2;
+static ncclNet_sochin_v2_t ncclNet_v5_as_sochin_v2;
 static ncclNet_v4_t *ncclNet_v4;
+static ncclNet_sochin_v2_t ncclNet_v6_as_sochin_v2;
 static ncclNet_v5_t *ncclNet_v5;
-static ncclCollNet_v6_t ncclCollNet_v4_as_v6;
-static ncclCollNet_v6_t ncclCollNet_v5_as_v6;
+static ncclNet_v6_t *ncclNet_v6;
+static ncclNet_sochin_v2_t ncclNet_sochin_v1_as_sochin_v2;
+static ncclNet_sochin_v1_t *ncclNet_sochin_v1;
+static ncclCollNet_sochin_v1_t ncclCollNet_v4_as_sochin_v1;
+static ncclCollNet_sochin_v1_t ncclCollNet_v5_as_sochin_v1;
+static ncclCollNet_sochin_v1_t ncclCollNet_v6_as_sochin_v1;
 static ncclCollNet_v4_t *ncclCollNet_v4;
 static ncclCollNet_v5_t *ncclCollNet_v5;
+static ncclCollNet_v6_t *ncclCollNet_v6;
 
-static ncclResult_t ncclNet_v4_as_v6_getProperties(int dev, ncclNetProperties_v6_t* props) {
+static ncclResult_t ncclNet_v4_as_sochin_v2_getProperties(int dev, ncclNetProperties_v6_t* props) {
   ncclNetProperties_v4_t p4;
   ncclResult_t ans = ncclNet_v4->getProperties(dev, &p4);
   if (ans != ncclSuccess) return ans;
@@ -34,69 +41,147 @@ static ncclResult_t ncclNet_v4_as_v6_getProperties(int dev, ncclNetProperties_v6
   return ncclSuccess;
 }
 
-static ncclResult_t ncclNet_v4_as_v6_isend(void* sendComm, void* data, int size, int tag, void* mhandle, void** request) {
+static ncclResult_t ncclNet_v4_as_sochin_v2_isend(void* sendComm, void* data, int size, int tag, void* mhandle, void** request) {
   return ncclNet_v4->isend(sendComm, data, size, mhandle, request);
 }
 
-static ncclResult_t ncclNet_v4_as_v6_irecv(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** request) {
+static ncclResult_t ncclNet_v4_as_sochin_v2_irecv(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** request) {
   if (n == 0) return ncclSuccess;
   if (n != 1) return ncclInvalidArgument;
   return ncclNet_v4->irecv(recvComm, data[0], sizes[0], mhandles[0], request);
 }
 
-static ncclResult_t ncclNet_v4_as_v6_iflush(void* recvComm, int n, void** data, int* sizes, void** mhandles, void** request) {
+static ncclResult_t ncclNet_v4_as_sochin_v2_iflush(void* recvComm, int n, void** data, int* sizes, void** mhandles, void** request) {
   if (n == 0) return ncclSuccess;
   if (n != 1) return ncclInvalidArgument;
   return ncclNet_v4->iflush(recvComm, data[0], sizes[0], mhandles[0], request);
 }
 
+// Plugins older than sochin v2 register at most 2GB at once. Failing to register a
+// larger user buffer is not fatal, it then goes through the connection buffers.
+#define NCCL_NET_REGMR_INT(v) \
+static ncclResult_t ncclNet_##v##_as_sochin_v2_regMr(void* comm, void* data, size_t size, int type, void** mhandle) { \
+  if (size > INT_MAX) { \
+    INFO(NCCL_NET, "NET/Plugin : cannot register %zi bytes with a " #v " plugin", size); \
+    return ncclInvalidUsage; \
+  } \
+  return ncclNet_##v->regMr(comm, data, (int)size, type, mhandle); \
+}
+NCCL_NET_REGMR_INT(v4)
+NCCL_NET_REGMR_INT(v5)
+NCCL_NET_REGMR_INT(v6)
+NCCL_NET_REGMR_INT(sochin_v1)
+#undef NCCL_NET_REGMR_INT
+
 // We use a wrapper around the v4 init to copy over the struct contents
 // post-init since they may not be initialized before hand.
-static ncclResult_t ncclNet_v4_as_v6_init(ncclDebugLogger_t logfn) {
+static ncclResult_t ncclNet_v4_as_sochin_v2_init(ncclDebugLogger_t logfn) {
   NCCLCHECK(ncclNet_v4->init(logfn));
-  ncclNet_v4_as_v6.name = ncclNet_v4->name;
-  ncclNet_v4_as_v6.devices = ncclNet_v4->devices;
-  ncclNet_v4_as_v6.getProperties = ncclNet_v4_as_v6_getProperties;
-  ncclNet_v4_as_v6.listen = ncclNet_v4->listen;
-  ncclNet_v4_as_v6.connect = ncclNet_v4->connect;
-  ncclNet_v4_as_v6.accept = ncclNet_v4->accept;
-  ncclNet_v4_as_v6.regMr = ncclNet_v4->regMr;
-  ncclNet_v4_as_v6.regMrDmaBuf = NULL;
-  ncclNet_v4_as_v6.deregMr = ncclNet_v4->deregMr;
-  ncclNet_v4_as_v6.isend = ncclNet_v4_as_v6_isend;
-  ncclNet_v4_as_v6.irecv = ncclNet_v4_as_v6_irecv;
-  ncclNet_v4_as_v6.iflush = ncclNet_v4_as_v6_iflush;
-  ncclNet_v4_as_v6.test = ncclNet_v4->test;
-  ncclNet_v4_as_v6.closeSend = ncclNet_v4->closeSend;
-  ncclNet_v4_as_v6.closeRecv = ncclNet_v4->closeRecv;
-  ncclNet_v4_as_v6.closeListen = ncclNet_v4->closeListen;
+  ncclNet_v4_as_sochin_v2.name = ncclNet_v4->name;
+  ncclNet_v4_as_sochin_v2.devices = ncclNet_v4->devices;
+  ncclNet_v4_as_sochin_v2.getProperties = ncclNet_v4_as_sochin_v2_getProperties;
+  ncclNet_v4_as_sochin_v2.listen = ncclNet_v4->listen;
+  ncclNet_v4_as_sochin_v2.connect = ncclNet_v4->connect;
+  ncclNet_v4_as_sochin_v2.accept = ncclNet_v4->accept;
+  ncclNet_v4_as_sochin_v2.regMr = ncclNet_v4_as_sochin_v2_regMr;
+  ncclNet_v4_as_sochin_v2.regMrDmaBuf = NULL;
+  ncclNet_v4_as_sochin_v2.deregMr = ncclNet_v4->deregMr;
+  ncclNet_v4_as_sochin_v2.isend = ncclNet_v4_as_sochin_v2_isend;
+  ncclNet_v4_as_sochin_v2.irecv = ncclNet_v4_as_sochin_v2_irecv;
+  ncclNet_v4_as_sochin_v2.iflush = ncclNet_v4_as_sochin_v2_iflush;
+  ncclNet_v4_as_sochin_v2.test = ncclNet_v4->test;
+  ncclNet_v4_as_sochin_v2.closeSend = ncclNet_v4->closeSend;
+  ncclNet_v4_as_sochin_v2.closeRecv = ncclNet_v4->closeRecv;
+  ncclNet_v4_as_sochin_v2.closeListen = ncclNet_v4->closeListen;
+  ncclNet_v4_as_sochin_v2.isendv = NULL;
+  ncclNet_v4_as_sochin_v2.testBatch = NULL;
+  ncclNet_v4_as_sochin_v2.irecvSignal = NULL;
+  ncclNet_v4_as_sochin_v2.irecvv = NULL;
   return ncclSuccess;
 }
 
 // We use a wrapper around the v5 init to copy over the struct contents
 // post-init since they may not be initialized before hand.
-static ncclResult_t ncclNet_v5_as_v6_init(ncclDebugLogger_t logfn) {
+static ncclResult_t ncclNet_v5_as_sochin_v2_init(ncclDebugLogger_t logfn) {
   NCCLCHECK(ncclNet_v5->init(logfn));
-  ncclNet_v5_as_v6.name = ncclNet_v5->name;
-  ncclNet_v5_as_v6.devices = ncclNet_v5->devices;
-  ncclNet_v5_as_v6.getProperties = ncclNet_v5->getProperties;
-  ncclNet_v5_as_v6.listen = ncclNet_v5->listen;
-  ncclNet_v5_as_v6.connect = ncclNet_v5->connect;
-  ncclNet_v5_as_v6.accept = ncclNet_v5->accept;
-  ncclNet_v5_as_v6.regMr = ncclNet_v5->regMr;
-  ncclNet_v5_as_v6.regMrDmaBuf = NULL;
-  ncclNet_v5_as_v6.deregMr = ncclNet_v5->deregMr;
-  ncclNet_v5_as_v6.isend = ncclNet_v5->isend;
-  ncclNet_v5_as_v6.irecv = ncclNet_v5->irecv;
-  ncclNet_v5_as_v6.iflush = ncclNet_v5->iflush;
-  ncclNet_v5_as_v6.test = ncclNet_v5->test;
-  ncclNet_v5_as_v6.closeSend = ncclNet_v5->closeSend;
-  ncclNet_v5_as_v6.closeRecv = ncclNet_v5->closeRecv;
-  ncclNet_v5_as_v6.closeListen = ncclNet_v5->closeListen;
+  ncclNet_v5_as_sochin_v2.name = ncclNet_v5->name;
+  ncclNet_v5_as_sochin_v2.devices = ncclNet_v5->devices;
+  ncclNet_v5_as_sochin_v2.getProperties = ncclNet_v5->getProperties;
+  ncclNet_v5_as_sochin_v2.listen = ncclNet_v5->listen;
+  ncclNet_v5_as_sochin_v2.connect = ncclNet_v5->connect;
+  ncclNet_v5_as_sochin_v2.accept = ncclNet_v5->accept;
+  ncclNet_v5_as_sochin_v2.regMr = ncclNet_v5_as_sochin_v2_regMr;
+  ncclNet_v5_as_sochin_v2.regMrDmaBuf = NULL;
+  ncclNet_v5_as_sochin_v2.deregMr = ncclNet_v5->deregMr;
+  ncclNet_v5_as_sochin_v2.isend = ncclNet_v5->isend;
+  ncclNet_v5_as_sochin_v2.irecv = ncclNet_v5->irecv;
+  ncclNet_v5_as_sochin_v2.iflush = ncclNet_v5->iflush;
+  ncclNet_v5_as_sochin_v2.test = ncclNet_v5->test;
+  ncclNet_v5_as_sochin_v2.closeSend = ncclNet_v5->closeSend;
+  ncclNet_v5_as_sochin_v2.closeRecv = ncclNet_v5->closeRecv;
+  ncclNet_v5_as_sochin_v2.closeListen = ncclNet_v5->closeListen;
+  ncclNet_v5_as_sochin_v2.isendv = NULL;
+  ncclNet_v5_as_sochin_v2.testBatch = NULL;
+  ncclNet_v5_as_sochin_v2.irecvSignal = NULL;
+  ncclNet_v5_as_sochin_v2.irecvv = NULL;
+  return ncclSuccess;
+}
+
+// We use a wrapper around the v6 init to copy over the struct contents
+// post-init since they may not be initialized before hand.
+static ncclResult_t ncclNet_v6_as_sochin_v2_init(ncclDebugLogger_t logfn) {
+  NCCLCHECK(ncclNet_v6->init(logfn));
+  ncclNet_v6_as_sochin_v2.name = ncclNet_v6->name;
+  ncclNet_v6_as_sochin_v2.devices = ncclNet_v6->devices;
+  ncclNet_v6_as_sochin_v2.getProperties = ncclNet_v6->getProperties;
+  ncclNet_v6_as_sochin_v2.listen = ncclNet_v6->listen;
+  ncclNet_v6_as_sochin_v2.connect = ncclNet_v6->connect;
+  ncclNet_v6_as_sochin_v2.accept = ncclNet_v6->accept;
+  ncclNet_v6_as_sochin_v2.regMr = ncclNet_v6_as_sochin_v2_regMr;
+  ncclNet_v6_as_sochin_v2.regMrDmaBuf = ncclNet_v6->regMrDmaBuf;
+  ncclNet_v6_as_sochin_v2.deregMr = ncclNet_v6->deregMr;
+  ncclNet_v6_as_sochin_v2.isend = ncclNet_v6->isend;
+  ncclNet_v6_as_sochin_v2.irecv = ncclNet_v6->irecv;
+  ncclNet_v6_as_sochin_v2.iflush = ncclNet_v6->iflush;
+  ncclNet_v6_as_sochin_v2.test = ncclNet_v6->test;
+  ncclNet_v6_as_sochin_v2.closeSend = ncclNet_v6->closeSend;
+  ncclNet_v6_as_sochin_v2.closeRecv = ncclNet_v6->closeRecv;
+  ncclNet_v6_as_sochin_v2.closeListen = ncclNet_v6->closeListen;
+  ncclNet_v6_as_sochin_v2.isendv = NULL;
+  ncclNet_v6_as_sochin_v2.testBatch = NULL;
+  ncclNet_v6_as_sochin_v2.irecvSignal = NULL;
+  ncclNet_v6_as_sochin_v2.irecvv = NULL;
+  return ncclSuccess;
+}
+
+// We use a wrapper around the sochin v1 init to copy over the struct contents
+// post-init since they may not be initialized before hand.
+static ncclResult_t ncclNet_sochin_v1_as_sochin_v2_init(ncclDebugLogger_t logfn) {
+  NCCLCHECK(ncclNet_sochin_v1->init(logfn));
+  ncclNet_sochin_v1_as_sochin_v2.name = ncclNet_sochin_v1->name;
+  ncclNet_sochin_v1_as_sochin_v2.devices = ncclNet_sochin_v1->devices;
+  ncclNet_sochin_v1_as_sochin_v2.getProperties = ncclNet_sochin_v1->getProperties;
+  ncclNet_sochin_v1_as_sochin_v2.listen = ncclNet_sochin_v1->listen;
+  ncclNet_sochin_v1_as_sochin_v2.connect = ncclNet_sochin_v1->connect;
+  ncclNet_sochin_v1_as_sochin_v2.accept = ncclNet_sochin_v1->accept;
+  ncclNet_sochin_v1_as_sochin_v2.regMr = ncclNet_sochin_v1_as_sochin_v2_regMr;
+  ncclNet_sochin_v1_as_sochin_v2.regMrDmaBuf = ncclNet_sochin_v1->regMrDmaBuf;
+  ncclNet_sochin_v1_as_sochin_v2.deregMr = ncclNet_sochin_v1->deregMr;
+  ncclNet_sochin_v1_as_sochin_v2.isend = ncclNet_sochin_v1->isend;
+  ncclNet_sochin_v1_as_sochin_v2.irecv = ncclNet_sochin_v1->irecv;
+  ncclNet_sochin_v1_as_sochin_v2.iflush = ncclNet_sochin_v1->iflush;
+  ncclNet_sochin_v1_as_sochin_v2.test = ncclNet_sochin_v1->test;
+  ncclNet_sochin_v1_as_sochin_v2.closeSend = ncclNet_sochin_v1->closeSend;
+  ncclNet_sochin_v1_as_sochin_v2.closeRecv = ncclNet_sochin_v1->closeRecv;
+  ncclNet_sochin_v1_as_sochin_v2.closeListen = ncclNet_sochin_v1->closeListen;
+  ncclNet_sochin_v1_as_sochin_v2.isendv = ncclNet_sochin_v1->isendv;
+  ncclNet_sochin_v1_as_sochin_v2.testBatch = ncclNet_sochin_v1->testBatch;
+  ncclNet_sochin_v1_as_sochin_v2.irecvSignal = NULL;
+  ncclNet_sochin_v1_as_sochin_v2.irecvv = NULL;
   return ncclSuccess;
 }
 
-static ncclResult_t ncclCollNet_v4_as_v6_getProperties(int dev, ncclNetProperties_v6_t* props) {
+static ncclResult_t ncclCollNet_v4_as_sochin_v1_getProperties(int dev, ncclNetProperties_v6_t* props) {
   ncclNetProperties_v4_t p4;
   ncclResult_t ans = ncclCollNet_v4->getProperties(dev, &p4);
   if (ans != ncclSuccess) return ans;
@@ -114,43 +199,70 @@ static ncclResult_t ncclCollNet_v4_as_v6_getProperties(int dev, ncclNetPropertie
 
 // We use a wrapper around the v4 init to copy over the struct contents
 // post-init since they may not be initialized before hand.
-static ncclResult_t ncclCollNet_v4_as_v6_init(ncclDebugLogger_t logfn) {
+static ncclResult_t ncclCollNet_v4_as_sochin_v1_init(ncclDebugLogger_t logfn) {
   NCCLCHECK(ncclCollNet_v4->init(logfn));
-  ncclCollNet_v4_as_v6.name = ncclCollNet_v4->name;
-  ncclCollNet_v4_as_v6.devices = ncclCollNet_v4->devices;
-  ncclCollNet_v4_as_v6.getProperties = ncclCollNet_v4_as_v6_getProperties;
-  ncclCollNet_v4_as_v6.listen = ncclCollNet_v4->listen;
-  ncclCollNet_v4_as_v6.connect = ncclCollNet_v4->connect;
-  ncclCollNet_v4_as_v6.reduceSupport = ncclCollNet_v4->reduceSupport;
-  ncclCollNet_v4_as_v6.regMr = ncclCollNet_v4->regMr;
-  ncclCollNet_v4_as_v6.regMrDmaBuf = NULL;
-  ncclCollNet_v4_as_v6.deregMr = ncclCollNet_v4->deregMr;
-  ncclCollNet_v4_as_v6.iallreduce = ncclCollNet_v4->iallreduce;
-  ncclCollNet_v4_as_v6.iflush = ncclCollNet_v4->iflush;
-  ncclCollNet_v4_as_v6.test = ncclCollNet_v4->test;
-  ncclCollNet_v4_as_v6.closeColl = ncclCollNet_v4->closeColl;
-  ncclCollNet_v4_as_v6.closeListen = ncclCollNet_v4->closeListen;
+  ncclCollNet_v4_as_sochin_v1.name = ncclCollNet_v4->name;
+  ncclCollNet_v4_as_sochin_v1.devices = ncclCollNet_v4->devices;
+  ncclCollNet_v4_as_sochin_v1.getProperties = ncclCollNet_v4_as_sochin_v1_getProperties;
+  ncclCollNet_v4_as_sochin_v1.listen = ncclCollNet_v4->listen;
+  ncclCollNet_v4_as_sochin_v1.connect = ncclCollNet_v4->connect;
+  ncclCollNet_v4_as_sochin_v1.reduceSupport = ncclCollNet_v4->reduceSupport;
+  ncclCollNet_v4_as_sochin_v1.regMr = ncclCollNet_v4->regMr;
+  ncclCollNet_v4_as_sochin_v1.regMrDmaBuf = NULL;
+  ncclCollNet_v4_as_sochin_v1.deregMr = ncclCollNet_v4->deregMr;
+  ncclCollNet_v4_as_sochin_v1.iallreduce = ncclCollNet_v4->iallreduce;
+  ncclCollNet_v4_as_sochin_v1.iallgather = NULL;
+  ncclCollNet_v4_as_sochin_v1.ireducescatter = NULL;
+  ncclCollNet_v4_as_sochin_v1.iflush = ncclCollNet_v4->iflush;
+  ncclCollNet_v4_as_sochin_v1.test = ncclCollNet_v4->test;
+  ncclCollNet_v4_as_sochin_v1.closeColl = ncclCollNet_v4->closeColl;
+  ncclCollNet_v4_as_sochin_v1.closeListen = ncclCollNet_v4->closeListen;
   return ncclSuccess;
 }
 
 // We use a wrapper around the v5 init to copy over the struct contents
 // post-init since they may not be initialized before hand.
-static ncclResult_t ncclCollNet_v5_as_v6_init(ncclDebugLogger_t logfn) {
+static ncclResult_t ncclCollNet_v5_as_sochin_v1_init(ncclDebugLogger_t logfn) {
   NCCLCHECK(ncclCollNet_v5->init(logfn));
-  ncclCollNet_v5_as_v6.name = ncclCollNet_v5->name;
-  ncclCollNet_v5_as_v6.devices = ncclCollNet_v5->devices;
-  ncclCollNet_v5_as_v6.getProperties = ncclCollNet_v5->getProperties;
-  ncclCollNet_v5_as_v6.listen = ncclCollNet_v5->listen;
-  ncclCollNet_v5_as_v6.connect = ncclCollNet_v5->connect;
-  ncclCollNet_v5_as_v6.reduceSupport = ncclCollNet_v5->reduceSupport;
-  ncclCollNet_v5_as_v6.regMr = ncclCollNet_v5->regMr;
-  ncclCollNet_v5_as_v6.regMrDmaBuf = NULL;
-  ncclCollNet_v5_as_v6.deregMr = ncclCollNet_v5->deregMr;
-  ncclCollNet_v5_as_v6.iallreduce = ncclCollNet_v5->iallreduce;
-  ncclCollNet_v5_as_v6.iflush = ncclCollNet_v5->iflush;
-  ncclCollNet_v5_as_v6.test = ncclCollNet_v5->test;
-  ncclCollNet_v5_as_v6.closeColl = ncclCollNet_v5->closeColl;
-  ncclCollNet_v5_as_v6.closeListen = ncclCollNet_v5->closeListen;
+  ncclCollNet_v5_as_sochin_v1.name = ncclCollNet_v5->name;
+  ncclCollNet_v5_as_sochin_v1.devices = ncclCollNet_v5->devices;
+  ncclCollNet_v5_as_sochin_v1.getProperties = ncclCollNet_v5->getProperties;
+  ncclCollNet_v5_as_sochin_v1.listen = ncclCollNet_v5->listen;
+  ncclCollNet_v5_as_sochin_v1.connect = ncclCollNet_v5->connect;
+  ncclCollNet_v5_as_sochin_v1.reduceSupport = ncclCollNet_v5->reduceSupport;
+  ncclCollNet_v5_as_sochin_v1.regMr = ncclCollNet_v5->regMr;
+  ncclCollNet_v5_as_sochin_v1.regMrDmaBuf = NULL;
+  ncclCollNet_v5_as_sochin_v1.deregMr = ncclCollNet_v5->deregMr;
+  ncclCollNet_v5_as_sochin_v1.iallreduce = ncclCollNet_v5->iallreduce;
+  ncclCollNet_v5_as_sochin_v1.iallgather = NULL;
+  ncclCollNet_v5_as_sochin_v1.ireducescatter = NULL;
+  ncclCollNet_v5_as_sochin_v1.iflush = ncclCollNet_v5->iflush;
+  ncclCollNet_v5_as_sochin_v1.test = ncclCollNet_v5->test;
+  ncclCollNet_v5_as_sochin_v1.closeColl = ncclCollNet_v5->closeColl;
+  ncclCollNet_v5_as_sochin_v1.closeListen = ncclCollNet_v5->closeListen;
+  return ncclSuccess;
+}
+
+// We use a wrapper around the v6 init to copy over the struct contents
+// post-init since they may not be initialized before hand.
+static ncclResult_t ncclCollNet_v6_as_sochin_v1_init(ncclDebugLogger_t logfn) {
+  NCCLCHECK(ncclCollNet_v6->init(logfn));
+  ncclCollNet_v6_as_sochin_v1.name = ncclCollNet_v6->name;
+  ncclCollNet_v6_as_sochin_v1.devices = ncclCollNet_v6->devices;
+  ncclCollNet_v6_as_sochin_v1.getProperties = ncclCollNet_v6->getProperties;
+  ncclCollNet_v6_as_sochin_v1.listen = ncclCollNet_v6->listen;
+  ncclCollNet_v6_as_sochin_v1.connect = ncclCollNet_v6->connect;
+  ncclCollNet_v6_as_sochin_v1.reduceSupport = ncclCollNet_v6->reduceSupport;
+  ncclCollNet_v6_as_sochin_v1.regMr = ncclCollNet_v6->regMr;
+  ncclCollNet_v6_as_sochin_v1.regMrDmaBuf = ncclCollNet_v6->regMrDmaBuf;
+  ncclCollNet_v6_as_sochin_v1.deregMr = ncclCollNet_v6->deregMr;
+  ncclCollNet_v6_as_sochin_v1.iallreduce = ncclCollNet_v6->iallreduce;
+  ncclCollNet_v6_as_sochin_v1.iallgather = NULL;
+  ncclCollNet_v6_as_sochin_v1.ireducescatter = NULL;
+  ncclCollNet_v6_as_sochin_v1.iflush = ncclCollNet_v6->iflush;
+  ncclCollNet_v6_as_sochin_v1.test = ncclCollNet_v6->test;
+  ncclCollNet_v6_as_sochin_v1.closeColl = ncclCollNet_v6->closeColl;
+  ncclCollNet_v6_as_sochin_v1.closeListen = ncclCollNet_v6->closeListen;
   return ncclSuccess;
 }
 
@@ -181,52 +293,74 @@ ncclResult_t ncclNetPluginInit() {
     return ncclSuccess;
   }
 
-  ncclNets[0] = (ncclNet_v6_t*)dlsym(netPluginLib, "ncclNetPlugin_v6");
+  ncclNets[0] = (ncclNet_sochin_v2_t*)dlsym(netPluginLib, "ncclNetPlugin_sochin_v2");
   if (ncclNets[0] == nullptr) {
-    INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclNetPlugin_v6 symbol.");
-    // Try v5 plugin
-    ncclNet_v5 = (ncclNet_v5_t*)dlsym(netPluginLib, "ncclNetPlugin_v5");
-    if (ncclNet_v5 == nullptr) {
+    INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclNetPlugin_sochin_v2 symbol.");
+    // Try sochin v1 plugin, then v6, then v5
+    ncclNet_sochin_v1 = (ncclNet_sochin_v1_t*)dlsym(netPluginLib, "ncclNetPlugin_sochin_v1");
+    ncclNet_v6 = ncclNet_sochin_v1 ? nullptr : (ncclNet_v6_t*)dlsym(netPluginLib, "ncclNetPlugin_v6");
+    ncclNet_v5 = (ncclNet_sochin_v1 || ncclNet_v6) ? nullptr : (ncclNet_v5_t*)dlsym(netPluginLib, "ncclNetPlugin_v5");
+    if (ncclNet_sochin_v1 != nullptr) {
+      ncclNets[0] = &ncclNet_sochin_v1_as_sochin_v2;
+      ncclNet_sochin_v1_as_sochin_v2.init = ncclNet_sochin_v1_as_sochin_v2_init;
+      // Set the name right away to allow for NCCL_NET=... to work
+      ncclNet_sochin_v1_as_sochin_v2.name = ncclNet_sochin_v1->name;
+      INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded net plugin %s (sochin v1)", ncclNets[0]->name);
+    } else if (ncclNet_v6 != nullptr) {
+      ncclNets[0] = &ncclNet_v6_as_sochin_v2;
+      ncclNet_v6_as_sochin_v2.init = ncclNet_v6_as_sochin_v2_init;
+      // Set the name right away to allow for NCCL_NET=... to work
+      ncclNet_v6_as_sochin_v2.name = ncclNet_v6->name;
+      INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded net plugin %s (v6)", ncclNets[0]->name);
+    } else if (ncclNet_v5 == nullptr) {
       ncclNet_v4 = (ncclNet_v4_t*)dlsym(netPluginLib, "ncclNetPlugin_v4");
       if (ncclNet_v4 == nullptr) {
-        INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclNetPlugin symbol (v4 or v5).");
+        INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclNetPlugin symbol (v4 to v6, sochin v1).");
         if (netPluginLib != nullptr) dlclose(netPluginLib);
         return ncclSuccess;
       }
-      ncclNets[0] = &ncclNet_v4_as_v6;
-      ncclNet_v4_as_v6.init = ncclNet_v4_as_v6_init;
+      ncclNets[0] = &ncclNet_v4_as_sochin_v2;
+      ncclNet_v4_as_sochin_v2.init = ncclNet_v4_as_sochin_v2_init;
       // Set the name right away to allow for NCCL_NET=... to work
-      ncclNet_v4_as_v6.name = ncclNet_v4->name;
+      ncclNet_v4_as_sochin_v2.name = ncclNet_v4->name;
       INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded net plugin %s (v4)", ncclNets[0]->name);
     } else {
-      ncclNets[0] = &ncclNet_v5_as_v6;
-      ncclNet_v5_as_v6.init = ncclNet_v5_as_v6_init;
+      ncclNets[0] = &ncclNet_v5_as_sochin_v2;
+      ncclNet_v5_as_sochin_v2.init = ncclNet_v5_as_sochin_v2_init;
       // Set the name right away to allow for NCCL_NET=... to work
-      ncclNet_v5_as_v6.name = ncclNet_v5->name;
+      ncclNet_v5_as_sochin_v2.name = ncclNet_v5->name;
       INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded net plugin %s (v5)", ncclNets[0]->name);
     }
   }
 
   // Check for CollNet
-  ncclCollNets[0] = (ncclCollNet_v6_t*)dlsym(netPluginLib, "ncclCollNetPlugin_v6");
+  ncclCollNets[0] = (ncclCollNet_sochin_v1_t*)dlsym(netPluginLib, "ncclCollNetPlugin_sochin_v1");
   if (ncclCollNets[0] == nullptr) {
-    INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclCollNetPlugin_v6 symbol.");
-    ncclCollNet_v5 = (ncclCollNet_v5_t*)dlsym(netPluginLib, "ncclCollNetPlugin_v5");
-    if (ncclCollNet_v5 == nullptr) {
-      ncclCollNet_v4 = (ncclCollNet_v4_t*)dlsym(netPluginLib, "ncclCollNetPlugin_v4");
-      if (ncclCollNet_v4 == nullptr) {
-        INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclCollNetPlugin symbol (v4 or v5).");
+    INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclCollNetPlugin_sochin_v1 symbol.");
+    ncclCollNet_v6 = (ncclCollNet_v6_t*)dlsym(netPluginLib, "ncclCollNetPlugin_v6");
+    if (ncclCollNet_v6 != nullptr) {
+      ncclCollNets[0] = &ncclCollNet_v6_as_sochin_v1;
+      ncclCollNet_v6_as_sochin_v1.init = ncclCollNet_v6_as_sochin_v1_init;
+      ncclCollNet_v6_as_sochin_v1.name = ncclCollNet_v6->name;
+      INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded coll plugin %s (v6)", ncclCollNets[0]->name);
+    } else {
+      ncclCollNet_v5 = (ncclCollNet_v5_t*)dlsym(netPluginLib, "ncclCollNetPlugin_v5");
+      if (ncclCollNet_v5 == nullptr) {
+        ncclCollNet_v4 = (ncclCollNet_v4_t*)dlsym(netPluginLib, "ncclCollNetPlugin_v4");
+        if (ncclCollNet_v4 == nullptr) {
+          INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find ncclCollNetPlugin symbol (v4, v5 or v6).");
+        } else {
+          ncclCollNets[0] = &ncclCollNet_v4_as_sochin_v1;
+          ncclCollNet_v4_as_sochin_v1.init = ncclCollNet_v4_as_sochin_v1_init;
+          ncclCollNet_v4_as_sochin_v1.name = ncclCollNet_v4->name;
+          INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded coll plugin %s (v4)", ncclCollNets[0]->name);
+        }
       } else {
-        ncclCollNets[0] = &ncclCollNet_v4_as_v6;
-        ncclCollNet_v4_as_v6.init = ncclCollNet_v4_as_v6_init;
-        ncclCollNet_v4_as_v6.name = ncclCollNet_v4->name;
-        INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded coll plugin %s (v4)", ncclCollNets[0]->name);
+        ncclCollNets[0] = &ncclCollNet_v5_as_sochin_v1;
+        ncclCollNet_v5_as_sochin_v1.init = ncclCollNet_v5_as_sochin_v1_init;
+        ncclCollNet_v5_as_sochin_v1.name = ncclCollNet_v5->name;
+        INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded coll plugin %s (v5)", ncclCollNets[0]->name);
       }
-    } else {
-      ncclCollNets[0] = &ncclCollNet_v5_as_v6;
-      ncclCollNet_v5_as_v6.init = ncclCollNet_v5_as_v6_init;
-      ncclCollNet_v5_as_v6.name = ncclCollNet_v5->name;
-      INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Loaded coll plugin %s (v5)", ncclCollNets[0]->name);
     }
   }
   return ncclSuccess;
@@ -366,5 +500,6 @@ cleanup1:
 }
 
 int ncclNetVersion(struct ncclComm* comm) {
-  return (comm->ncclNet == &ncclNet_v4_as_v6) ? 4 : ((comm->ncclNet == &ncclNet_v5_as_v6) ? 5 : 6);
+  return (comm->ncclNet == &ncclNet_v4_as_sochin_v2) ? 4 : (comm->ncclNet == &ncclNet_v5_as_sochin_v2) ? 5 :
+         (comm->ncclNet == &ncclNet_v6_as_sochin_v2) ? 6 : (comm->ncclNet == &ncclNet_sochin_v1_as_sochin_v2) ? 7 : 8;
 }
@@ -10,6 +10,7 @@
 #include "socket.h"
 #include "shm.h"
 #include "profiler.h"
+#include "stats.h"
 #define ENABLE_TIMER 0
 #include "timer.h"
 
@@ -244,14 +245,14 @@ ncclResult_t printProxyOp(struct ncclProxyArgs* op, int poolIndex, int opIndex)
     if (op->state == ncclProxyOpProgress) {
       char status = ' ';
       if (op->pattern == ncclPatternRecv) {
-        if (sub->posted < sub->nsteps && sub->posted < sub->done + NCCL_STEPS) status = 'I'; // Init
+        if (sub->posted < sub->nsteps && sub->posted < sub->done + sub->nSteps) status = 'I'; // Init
         else if (sub->received < sub->posted) status = 'R'; // Receiving
         else if (sub->received < sub->transmitted) status = 'R'; // Receiving
         else if (sub->transmitted < sub->received) status = 'F'; // Flushing
         else if (sub->done < sub->transmitted) status = 'G'; // Waiting on GPU
         else status = 'D'; // Done
       } else if (op->pattern == ncclPatternSend) {
-        if (sub->posted < sub->nsteps && sub->posted < sub->done + NCCL_STEPS) status = 'I'; // Init
+        if (sub->posted < sub->nsteps && sub->posted < sub->done + sub->nSteps) status = 'I'; // Init
         else if (sub->transmitted < sub->posted) status = 'G'; // Waiting on GPU
         else if (sub->done < sub->transmitted) status = 'S'; // Sending
         else status = 'D'; // Done
@@ -265,10 +266,11 @@ ncclResult_t printProxyOp(struct ncclProxyArgs* op, int poolIndex, int opIndex)
   return ncclSuccess;
 }
 ncclResult_t dumpProxyState(struct ncclProxyProgressState* state) {
-  struct ncclProxyArgs* op = state->active;
+  struct ncclProxyArgs* op;
   int poolIndex, opIndex;
   printf("ACTIVE OPS\n");
-  while (op) {
+  for (int g=0; g<state->nActiveFuncs; g++) for (int i=0; i<state->activeOps[g].count; i++) {
+    op = state->activeOps[g].ops[i];
     NCCLCHECK(getOpIndex(op, state, &poolIndex, &opIndex));
     if (op->state & OP_SEEN) {
       WARN("List loop at element %d-%d", poolIndex, opIndex);
@@ -292,7 +294,6 @@ ncclResult_t dumpProxyState(struct ncclProxyProgressState* state) {
       nextOp = nextOp->nextPeer;
     }
     if (op->nextPeer == NULL) printf("|\n");
-    op = op->next;
     printf("v\n");
   }
   printf("[X]\n");
@@ -342,12 +343,43 @@ ncclResult_t dumpProxyState(struct ncclProxyProgressState* state) {
   return ncclSuccess;
 }
 
+static ncclResult_t proxySubSteps(struct ncclProxySubArgs* sub, int nSteps) {
+  if (nSteps > sub->maxSteps) {
+    free(sub->requests);
+    free(sub->profilingEvents);
+    free(sub->stepBytes);
+    free(sub->stepNs);
+    sub->maxSteps = 0;
+    NCCLCHECK(ncclCalloc(&sub->requests, nSteps));
+    NCCLCHECK(ncclCalloc(&sub->profilingEvents, nSteps));
+    NCCLCHECK(ncclCalloc(&sub->stepBytes, nSteps));
+    NCCLCHECK(ncclCalloc(&sub->stepNs, nSteps));
+    sub->maxSteps = nSteps;
+  }
+  sub->nSteps = nSteps;
+  return ncclSuccess;
+}
+
+static void proxyPoolFree(struct ncclProxyPool* pool) {
+  for (int e=0; e<PROXYARGS_ALLOCATE_SIZE; e++) {
+    for (int s=0; s<NCCL_PROXY_MAX_SUBS; s++) {
+      struct ncclProxySubArgs* sub = pool->elems[e].subs+s;
+      free(sub->requests);
+      free(sub->profilingEvents);
+      free(sub->stepBytes);
+      free(sub->stepNs);
+    }
+  }
+  free(pool);
+}
+
 static ncclResult_t ncclProxyOpToArgs(struct ncclProxyOp* op, struct ncclProxyArgs* args, int subIndex) {
   struct ncclProxySubArgs* sub = args->subs+subIndex;
   if (subIndex >= NCCL_PROXY_MAX_SUBS) {
     WARN("Proxy append out of bounds");
     return ncclInternalError;
   }
+  NCCLCHECK(proxySubSteps(sub, op->connection->nSteps));
 
   //memset(sub, 0, sizeof(struct ncclProxySubArgs));
   sub->connection = op->connection;
@@ -355,6 +387,9 @@ static ncclResult_t ncclProxyOpToArgs(struct ncclProxyOp* op, struct ncclProxyAr
   sub->nsteps = op->nsteps;
   sub->nbytes = op->nbytes;
   sub->peer = op->root;
+  sub->reg = op->reg;
+  sub->chunkSize = op->chunkSize;
+  sub->buffer = op->buffer;
   args->nsubs = subIndex+1;
   if (subIndex) {
     if ((args->sliceSteps != op->sliceSteps) ||
@@ -382,11 +417,46 @@ static ncclResult_t ncclProxyOpToArgs(struct ncclProxyOp* op, struct ncclProxyAr
   args->pattern = op->pattern;
   args->protocol = op->protocol;
   args->state = ncclProxyOpReady;
+  args->watchdogNs = 0;
+  args->watchdogReported = 0;
   args->progress = op->connection->tcomm->proxyProgress;
   args->proxyAppendPtr = op->connection->proxyAppendPtr;
   return ncclSuccess;
 }
 
+static ncclResult_t activeOpsAdd(struct ncclProxyProgressState* state, struct ncclProxyArgs* args) {
+  int g = 0;
+  while (g < state->nActiveFuncs && state->activeOps[g].progress != args->progress) g++;
+  if (g == state->nActiveFuncs) {
+    if (g == NCCL_PROXY_MAX_PROGRESS_FUNCS) {
+      WARN("Proxy has more than %d progress functions", NCCL_PROXY_MAX_PROGRESS_FUNCS);
+      return ncclInternalError;
+    }
+    state->activeOps[g].progress = args->progress;
+    state->nActiveFuncs++;
+  }
+  struct ncclProxyActiveOps* active = state->activeOps+g;
+  if (active->count == active->size) {
+    int size = active->size ? 2*active->size : 64;
+    NCCLCHECK(ncclRealloc(&active->ops, active->size, size));
+    active->size = size;
+  }
+  args->activeGroup = g;
+  args->activeIndex = active->count;
+  active->ops[active->count++] = args;
+  state->nActive++;
+  return ncclSuccess;
+}
+
+// Moves the last op of the group in the slot of args
+static void activeOpsRemove(struct ncclProxyProgressState* state, struct ncclProxyArgs* args) {
+  struct ncclProxyActiveOps* active = state->activeOps+args->activeGroup;
+  struct ncclProxyArgs* last = active->ops[--active->count];
+  active->ops[args->activeIndex] = last;
+  last->activeIndex = args->activeIndex;
+  state->nActive--;
+}
+
 static ncclResult_t ProxyAppend(struct ncclProxyProgressState* state, struct ncclProxyOp* op) {
   struct ncclProxyConnection* connection = op->connection;
   int shared = connection->shared;
@@ -405,36 +475,122 @@ static ncclResult_t ProxyAppend(struct ncclProxyProgressState* state, struct ncc
       *(args->proxyAppendPtr) = args;
     }
   } else {
-    // Nothing running for that peer. Add to the list
+    // Nothing running for that peer. Add to the active ops
     NCCLCHECK(allocateArgs(state, &args));
     NCCLCHECK(ncclProxyOpToArgs(op, args, 0));
-    if (state->active == NULL) {
-      // Create the list
-      DEBUG_PROXY_PRINT("Insert  %5ld (%d/%5ld) as first element\n", OP_INDEX(args), shared, args->opCount);
-      state->active = args;
-    } else {
-      // Append element at the end of the list
-      struct ncclProxyArgs* last = state->active;
-      while (last->next) last = last->next;
-      last->next = args;
-      DEBUG_PROXY_PRINT("Insert  %5ld (%d/%5ld) as last element\n", OP_INDEX(args), shared, args->opCount);
-    }
+    NCCLCHECK(activeOpsAdd(state, args));
+    DEBUG_PROXY_PRINT("Insert  %5ld (%d/%5ld) as active element\n", OP_INDEX(args), shared, args->opCount);
     *(args->proxyAppendPtr) = args;
   }
   return ncclSuccess;
 }
 
-ncclResult_t ncclProxyPost(struct ncclProxyOpsPool* pool, int nextOps, int nextOpsEnd) {
-  pthread_mutex_lock(&pool->mutex);
-  if (pool->nextOps == -1) {
-    pool->nextOps = nextOps;
+static void proxyTimedWait(pthread_cond_t* cond, pthread_mutex_t* mutex, uint64_t ns) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += (ts.tv_nsec + ns) / 1000000000;
+  ts.tv_nsec = (ts.tv_nsec + ns) % 1000000000;
+  pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+// Posting does not take the pool lock: each rank pushes its chains to its own
+// ring, and only wakes up the progress thread when it sleeps.
+ncclResult_t ncclProxyPost(struct ncclProxyOpsPool* pool, int tpLocalRank, int nextOps, int nextOpsEnd) {
+  struct ncclProxyPostRing* ring = pool->posted+tpLocalRank;
+  uint64_t tail = ring->tail;
+  while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == MAX_OPS_PER_PEER) sched_yield();
+  ring->chains[tail%MAX_OPS_PER_PEER][0] = nextOps;
+  ring->chains[tail%MAX_OPS_PER_PEER][1] = nextOpsEnd;
+  __atomic_store_n(&ring->tail, tail+1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&pool->mutex);
     pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return ncclSuccess;
+}
+
+// With NCCL_PROXY_SHARED_PROGRESS, one thread progresses the proxy ops of all the
+// communicators of the process on a GPU, instead of one thread per communicator.
+NCCL_PARAM(ProxySharedProgress, "PROXY_SHARED_PROGRESS", 0);
+// Ops which other processes post (PXN) do not wake a sleeping shared thread up, it
+// polls for them this often.
+#define PROXY_GROUP_POLL_NS 200000
+
+struct ncclProxyGroupMember {
+  struct ncclProxyState* proxyState;
+  uint64_t watchdogCheck;
+  bool removed; // In the copy, to be taken out of the group
+};
+
+struct ncclProxyProgressGroup {
+  int cudaDev;
+  int refs; // Guarded by proxyGroupsLock
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Guarded by mutex
+  struct ncclProxyGroupMember* members;
+  int nMembers, maxMembers;
+  bool stop;
+  int sleeping;
+  struct ncclProxyProgressGroup* next;
+};
+static struct ncclProxyProgressGroup* proxyGroups = NULL;
+static pthread_mutex_t proxyGroupsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called after posting ops to our own proxy
+static void proxyGroupWake(struct ncclProxyState* proxyState) {
+  struct ncclProxyProgressGroup* group = proxyState->progressGroup;
+  if (group == NULL || __atomic_load_n(&group->sleeping, __ATOMIC_SEQ_CST) == 0) return;
+  pthread_mutex_lock(&group->mutex);
+  pthread_cond_broadcast(&group->cond);
+  pthread_mutex_unlock(&group->mutex);
+}
+
+static bool proxyOpsPosted(struct ncclProxyOpsPool* pool, int nRanks) {
+  for (int r = 0; r < nRanks; r++) {
+    if (__atomic_load_n(&pool->posted[r].tail, __ATOMIC_SEQ_CST) != pool->posted[r].head) return true;
+  }
+  return false;
+}
+
+// Takes all posted chains and links them, returns -1 if there are none.
+static int proxyOpsTake(struct ncclProxyOpsPool* pool, int nRanks) {
+  int first = -1, last = -1;
+  for (int r = 0; r < nRanks; r++) {
+    struct ncclProxyPostRing* ring = pool->posted+r;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) continue;
+    for (; head != tail; head++) {
+      int* chain = ring->chains[head%MAX_OPS_PER_PEER];
+      if (first == -1) first = chain[0];
+      else pool->ops[last].next = chain[0];
+      last = chain[1];
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+  return first;
+}
+
+// Sleeps until ops are posted, the thread is stopped or timeoutNs (if not 0) expires.
+static void proxyOpsWait(struct ncclProxyProgressState* state, int nRanks, uint64_t timeoutNs) {
+  struct ncclProxyOpsPool* pool = state->opsPool;
+  pthread_mutex_lock(&pool->mutex);
+  __atomic_store_n(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+  if (timeoutNs) {
+    if (!proxyOpsPosted(pool, nRanks) && !state->stop) proxyTimedWait(&pool->cond, &pool->mutex, timeoutNs);
   } else {
-    pool->ops[pool->nextOpsEnd].next = nextOps;
+    while (!proxyOpsPosted(pool, nRanks) && !state->stop) {
+      struct ncclProxyArgs profArgs; // Only used for profiling purposes
+      ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileSleep);
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+      ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileWakeup);
+    }
   }
-  pool->nextOpsEnd = nextOpsEnd;
+  __atomic_store_n(&pool->sleeping, 0, __ATOMIC_RELAXED);
   pthread_mutex_unlock(&pool->mutex);
-  return ncclSuccess;
 }
 
 static ncclResult_t ncclLocalOpAppend(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, struct ncclProxyOp* proxyOp) {
@@ -492,7 +648,8 @@ static ncclResult_t ncclLocalOpAppend(struct ncclComm* comm, struct ncclProxyCon
     int nextOps = proxyOps->nextOps;
     proxyOps->nextOps = pool->ops[lastOp].next;
     pool->ops[lastOp].next = -1;
-    NCCLCHECK(ncclProxyPost(proxyOps->pool, nextOps, lastOp));
+    NCCLCHECK(ncclProxyPost(proxyOps->pool, tpLocalRank, nextOps, lastOp));
+    if (proxyConn->tpLocalRank == tpLocalRank) proxyGroupWake(comm->proxyState);
     proxyOps->count -= toSend;
   }
   TIME_STOP(0);
@@ -537,7 +694,19 @@ ncclResult_t ncclProxySaveOp(struct ncclComm* comm, struct ncclProxyOp* op, bool
       }
     } break;
   case ncclPatternTreeUp:
-  case ncclPatternTreeDown:
+  case ncclPatternTreeDown: {
+      // Reduce and Broadcast run on the tree re-rooted at op->root
+      struct ncclTree* tree = &channel->tree;
+      int neighbors[1+NCCL_MAX_TREE_ARITY];
+      neighbors[0] = tree->up;
+      for (int i=0; i<NCCL_MAX_TREE_ARITY; i++) neighbors[1+i] = tree->down[i];
+      int toRoot = channel->treeToRoot[op->root];
+      for (int i=0; i<1+NCCL_MAX_TREE_ARITY; i++) {
+        bool parent = i == toRoot;
+        int type = (op->pattern == ncclPatternTreeUp) == parent ? proxySend : proxyRecv;
+        NCCLCHECK(SaveProxy(comm, channel, type, neighbors[i], op, 0, justInquire));
+      }
+    } break;
   case ncclPatternTreeUpDown: {
       if (op->pattern != ncclPatternTreeDown) { // Tree up
         struct ncclTree* tree = &channel->tree;
@@ -554,7 +723,9 @@ ncclResult_t ncclProxySaveOp(struct ncclComm* comm, struct ncclProxyOp* op, bool
         NCCLCHECK(SaveProxy(comm, channel, proxyRecv, tree->up, op, 0, justInquire));
       }
     } break;
-  case ncclPatternCollnetChain: {
+  case ncclPatternCollnetChain:
+  case ncclPatternCollnetAllGather:
+  case ncclPatternCollnetReduceScatter: {
       NCCLCHECK(SaveProxy(comm, channel, proxySend, channel->collnetChain.up, op, 1, justInquire));
       NCCLCHECK(SaveProxy(comm, channel, proxyRecv, channel->collnetChain.up, op, 0, justInquire));
     } break;
@@ -638,27 +809,25 @@ ncclResult_t ncclProxyComputeP2p(struct ncclInfo* info, struct ncclProxyOp* op)
   return ncclSuccess;
 }
 
-static ncclResult_t removeOp(struct ncclProxyProgressState* state, struct ncclProxyArgs** opPtr, struct ncclProxyArgs** prevOpPtr) {
-  struct ncclProxyArgs* freeOp = *opPtr;
-  struct ncclProxyArgs* next = freeOp->next;
-  DEBUG_PROXY_PRINT("Remove %ld -> %ld -> %ld\n", OP_INDEX(*prevOpPtr), OP_INDEX(freeOp), OP_INDEX(next));
-  *opPtr = next;
-  if (freeOp->nextPeer) {
+// Returns in *inPlace whether the slot of freeOp now holds its nextPeer, which
+// should wait for the next round, rather than another op yet to be progressed.
+static ncclResult_t removeOp(struct ncclProxyProgressState* state, struct ncclProxyArgs* freeOp, bool* inPlace) {
+  struct ncclProxyArgs* nextPeer = freeOp->nextPeer;
+  DEBUG_PROXY_PRINT("Remove %ld -> %ld\n", OP_INDEX(freeOp), OP_INDEX(nextPeer));
+  *inPlace = false;
+  if (nextPeer && nextPeer->progress == freeOp->progress) {
     // replace op by nextPeer
-    struct ncclProxyArgs* nextPeer = freeOp->nextPeer;
-    if (*prevOpPtr) {
-      (*prevOpPtr)->next = nextPeer;
-    } else {
-      state->active = nextPeer;
-    }
-    nextPeer->next = next;
-    *(prevOpPtr) = nextPeer;
+    struct ncclProxyActiveOps* active = state->activeOps+freeOp->activeGroup;
+    nextPeer->activeGroup = freeOp->activeGroup;
+    nextPeer->activeIndex = freeOp->activeIndex;
+    active->ops[freeOp->activeIndex] = nextPeer;
+    *inPlace = true;
   } else {
-    *(freeOp->proxyAppendPtr) = NULL;
-    if (*prevOpPtr) {
-      (*prevOpPtr)->next = next;
+    activeOpsRemove(state, freeOp);
+    if (nextPeer) {
+      NCCLCHECK(activeOpsAdd(state, nextPeer));
     } else {
-      state->active = next;
+      *(freeOp->proxyAppendPtr) = NULL;
     }
   }
   freeOp->next = state->pool;
@@ -670,30 +839,170 @@ static ncclResult_t removeOp(struct ncclProxyProgressState* state, struct ncclPr
   return ncclSuccess;
 }
 
-static ncclResult_t progressOps(struct ncclProxyState* proxyState, struct ncclProxyProgressState* state, struct ncclProxyArgs* opStart, int* idle) {
-  struct ncclProxyArgs* prevOp = NULL;
-  struct ncclProxyArgs* op = opStart;
-  while (op) {
-    if (op->state == ncclProxyOpNone) return ncclInternalError;
-    TIME_START(0); TIME_START(1);
-    NCCLCHECK(op->progress(proxyState, op));
-    if (op->idle) { TIME_STOP(1); TIME_CANCEL(0); } else { TIME_CANCEL(1); TIME_STOP(0); }
-    *idle &= op->idle;
-    if (op->state == ncclProxyOpNone) {
-      TIME_START(2);
-      NCCLCHECK(removeOp(state, &op, &prevOp));
-      TIME_STOP(2);
-    } else {
-      prevOp = op;
-      op = op->next;
+static ncclResult_t progressOps(struct ncclProxyState* proxyState, struct ncclProxyProgressState* state, int* idle) {
+  for (int g=0; g<state->nActiveFuncs; g++) {
+    struct ncclProxyActiveOps* active = state->activeOps+g;
+    proxyProgressFunc_t progress = active->progress;
+    for (int i=0; i<active->count;) {
+      struct ncclProxyArgs* op = active->ops[i];
+      if (op->state == ncclProxyOpNone) return ncclInternalError;
+      TIME_START(0); TIME_START(1);
+      NCCLCHECK(progress(proxyState, op));
+      ncclProxyStatsProgress(proxyState, op);
+      if (op->idle) { TIME_STOP(1); TIME_CANCEL(0); } else { TIME_CANCEL(1); TIME_STOP(0); }
+      *idle &= op->idle;
+      if (op->state == ncclProxyOpNone) {
+        bool inPlace;
+        TIME_START(2);
+        NCCLCHECK(removeOp(state, op, &inPlace));
+        TIME_STOP(2);
+        if (inPlace) i++;
+      } else {
+        i++;
+      }
     }
   }
   return ncclSuccess;
 }
 
+// With PROXY_WATCHDOG_TIMEOUT set (in seconds), warn about the ops which made no
+// progress for that long, with their peer and the stage they are stuck at.
+NCCL_PARAM(ProxyWatchdogTimeout, "PROXY_WATCHDOG_TIMEOUT", 0);
+#define PROXY_WATCHDOG_INTERVAL_NS 100000000ULL
+
+// Same stages as printProxyOp
+static const char* proxyOpStage(struct ncclProxySubArgs* sub) {
+  if (sub->connection->send) {
+    if (sub->done < sub->transmitted) return "network send not completed";
+    if (sub->transmitted < sub->posted) return "GPU has not written the data";
+    return "waiting for buffers";
+  }
+  if (sub->received < sub->posted) return "network receive not completed";
+  if (sub->transmitted < sub->received) return "flush pending";
+  if (sub->done < sub->transmitted) return "GPU has not consumed the data";
+  return "waiting for buffers";
+}
+
+// Progress is read from the step counters of the subs, which every transport advances
+// from its progress function. The head/tail of ncclConnInfo live in transport resources
+// the generic proxy code does not see.
+static uint64_t proxyOpProgress(struct ncclProxyArgs* op) {
+  uint64_t progress = op->done;
+  for (int s=0; s<op->nsubs; s++) {
+    struct ncclProxySubArgs* sub = op->subs+s;
+    progress += sub->posted + sub->received + sub->flushed + sub->transmitted + sub->done;
+  }
+  return progress;
+}
+
+static void proxyWatchdog(struct ncclProxyState* proxyState, struct ncclProxyProgressState* state, uint64_t* lastCheck) {
+  uint64_t timeout = ncclParamProxyWatchdogTimeout()*1000000000ULL;
+  if (timeout == 0) return;
+  uint64_t now = clockNano();
+  if (now - *lastCheck < PROXY_WATCHDOG_INTERVAL_NS) return;
+  *lastCheck = now;
+  for (int g=0; g<state->nActiveFuncs; g++) {
+    struct ncclProxyActiveOps* active = state->activeOps+g;
+    for (int i=0; i<active->count; i++) {
+      struct ncclProxyArgs* op = active->ops[i];
+      uint64_t progress = proxyOpProgress(op);
+      if (op->watchdogNs == 0 || progress != op->watchdogProgress) {
+        if (op->watchdogReported) {
+          INFO(NCCL_PROXY, "Proxy watchdog : op %ld resumed after %.1f s", op->opCount, (now-op->watchdogNs)/1e9);
+        }
+        op->watchdogProgress = progress;
+        op->watchdogNs = now;
+        op->watchdogReported = 0;
+        continue;
+      }
+      if (op->watchdogReported || now - op->watchdogNs < timeout) continue;
+      op->watchdogReported = 1;
+      ncclProxyStatsStall(proxyState);
+      for (int s=0; s<op->nsubs; s++) {
+        struct ncclProxySubArgs* sub = op->subs+s;
+        if (sub->done == sub->nsteps) continue;
+        WARN("Proxy watchdog : %s op %ld channel %d peer %d made no progress for %.1f s, %s (posted %ld received %ld transmitted %ld done %ld of %d steps)",
+            sub->connection->send ? "send" : "recv", op->opCount, sub->channelId, sub->peer, (now-op->watchdogNs)/1e9,
+            proxyOpStage(sub), sub->posted, sub->received, sub->transmitted, sub->done, sub->nsteps);
+      }
+    }
+  }
+}
+
+// Sends are paced by keeping the time at which the bytes posted so far are due at
+// netBwLimit in paceNs, and only posting when it is less than that far ahead of now.
+// The progress threads of a proxy share it.
+#define PROXY_PACE_BURST_NS 50000
+
+bool ncclProxyPaceReady(struct ncclProxyState* proxyState) {
+  if (proxyState->netBwLimit == 0) return true;
+  return __atomic_load_n(&proxyState->paceNs, __ATOMIC_RELAXED) <= clockNano() + PROXY_PACE_BURST_NS;
+}
+
+void ncclProxyPaceCharge(struct ncclProxyState* proxyState, size_t bytes) {
+  if (proxyState->netBwLimit == 0 || bytes == 0) return;
+  uint64_t cost = bytes*1000/proxyState->netBwLimit; // MB/s is 1e-3 byte per ns
+  uint64_t now = clockNano();
+  uint64_t due = __atomic_load_n(&proxyState->paceNs, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&proxyState->paceNs, &due, std::max(due, now) + cost, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
 NCCL_PARAM(ProxyAppendBatchSize, "PROXY_APPEND_BATCH_SIZE", 16);
 
-static ncclResult_t ncclProxyGetPostedOps(struct ncclProxyState* proxyState, int* added) {
+// Ops sharing a proxyAppendPtr must all be appended by the same thread. Net shared
+// buffers and comms are per channel, so channels are spread over the shards while
+// CollNet, whose shared state is per NIC, stays on the main progress thread.
+static int proxyShardIndex(struct ncclProxyProgressState* state, struct ncclProxyOp* op) {
+  if (state->nShards == 0 || op->connection->transport == TRANSPORT_COLLNET) return -1;
+  return op->channelId % (state->nShards+1) - 1;
+}
+
+static ncclResult_t proxyShardQueue(struct ncclProxyProgressState* state, struct ncclProxyOp* op,
+    struct ncclProxyShardOp** head, struct ncclProxyShardOp** tail) {
+  struct ncclProxyShardOp* sop = state->shardFreeOps;
+  if (sop) {
+    state->shardFreeOps = sop->next;
+  } else {
+    NCCLCHECK(ncclCalloc(&sop, 1));
+  }
+  memcpy(&sop->op, op, sizeof(struct ncclProxyOp));
+  sop->next = NULL;
+  if (*head == NULL) *head = sop;
+  else (*tail)->next = sop;
+  *tail = sop;
+  return ncclSuccess;
+}
+
+// Hands a batch of ops to a shard and takes back the ones it consumed.
+static void proxyShardPost(struct ncclProxyProgressState* state, struct ncclProxyShard* shard,
+    struct ncclProxyShardOp* head, struct ncclProxyShardOp* tail) {
+  pthread_mutex_lock(&shard->mutex);
+  if (head) {
+    if (shard->posted == NULL) shard->posted = head;
+    else shard->postedEnd->next = head;
+    shard->postedEnd = tail;
+    __atomic_store_n(&shard->active, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&shard->cond);
+  }
+  struct ncclProxyShardOp* freeOps = shard->freeOps;
+  shard->freeOps = NULL;
+  pthread_mutex_unlock(&shard->mutex);
+  while (freeOps) {
+    struct ncclProxyShardOp* next = freeOps->next;
+    freeOps->next = state->shardFreeOps;
+    state->shardFreeOps = freeOps;
+    freeOps = next;
+  }
+}
+
+static bool proxyShardsIdle(struct ncclProxyProgressState* state) {
+  for (int s=0; s<state->nShards; s++) {
+    if (__atomic_load_n(&state->shards[s].active, __ATOMIC_RELAXED)) return false;
+  }
+  return true;
+}
+
+static ncclResult_t ncclProxyGetPostedOps(struct ncclProxyState* proxyState, int* added, bool wait) {
   struct ncclProxyProgressState* state = &proxyState->progressState;
   if (state->opsPool == NULL) return ncclInternalError;
   struct ncclProxyOpsPool* pool = state->opsPool;
@@ -701,28 +1010,15 @@ static ncclResult_t ncclProxyGetPostedOps(struct ncclProxyState* proxyState, int
   struct ncclProxyArgs profArgs; // Only used for profiling purposes
   if (state->nextOps != -1) goto process_nextops;
 
-  // If we have ops to progress, no need to block waiting for something to arrive or even wait for the lock
-  // to be available. Exit, continue progress, and come back later.
-  if (state->active != NULL && (pool->nextOps == -1 || pthread_mutex_trylock(&pool->mutex) != 0)) return ncclSuccess;
-
-  if (state->active == NULL) {
-    pthread_mutex_lock(&pool->mutex);
-    while (pool->nextOps == -1 && !state->stop) {
-      struct ncclProxyArgs profArgs; // Only used for profiling purposes
-      ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileSleep);
-      pthread_cond_wait(&pool->cond, &pool->mutex);
-      ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileWakeup);
-    }
-    if (state->stop) { // We might have been woken up to stop.
-      pthread_mutex_unlock(&pool->mutex);
-      return ncclSuccess;
-    }
+  // If we have ops to progress, no need to block waiting for something to arrive. Exit, continue progress,
+  // and come back later.
+  if (state->nActive == 0 && wait) {
+    proxyOpsWait(state, proxyState->tpLocalnRanks, 0);
+    if (state->stop) return ncclSuccess; // We might have been woken up to stop.
   }
 
-  state->nextOps = pool->nextOps;
-  pool->nextOps = pool->nextOpsEnd = -1;
-  pthread_mutex_unlock(&pool->mutex);
-  if (state->nextOps == -1) return ncclInternalError;
+  state->nextOps = proxyOpsTake(pool, proxyState->tpLocalnRanks);
+  if (state->nextOps == -1) return ncclSuccess;
 
 process_nextops:
   ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileAppend);
@@ -734,6 +1030,9 @@ process_nextops:
   uint64_t lastOpCount = 0;
   int lastPeer = -1;
   int count = 0;
+  struct ncclProxyShardOp* shardHead[MAXCHANNELS];
+  struct ncclProxyShardOp* shardTail[MAXCHANNELS];
+  for (int s = 0; s < state->nShards; s++) shardHead[s] = NULL;
   for (int opIndex = state->nextOps; opIndex != -1;) {
     struct ncclProxyOp* peerOp = pool->ops+opIndex;
     int peer = opIndex / MAX_OPS_PER_PEER;
@@ -743,7 +1042,12 @@ process_nextops:
     lastPeer = peer;
     if (peerOp->connection == NULL) return ncclInternalError;
     if (peerOp->next != -1) __builtin_prefetch(pool->ops+peerOp->next);
-    NCCLCHECK(ProxyAppend(state, peerOp));
+    int shard = proxyShardIndex(state, peerOp);
+    if (shard == -1) {
+      NCCLCHECK(ProxyAppend(state, peerOp));
+    } else {
+      NCCLCHECK(proxyShardQueue(state, peerOp, shardHead+shard, shardTail+shard));
+    }
     (*added)++;
     int lastOpIndex = opIndex;
     opIndex = peerOp->next;
@@ -776,6 +1080,9 @@ process_nextops:
       }
     }
   }
+  for (int s = 0; s < state->nShards; s++) {
+    if (shardHead[s]) proxyShardPost(state, state->shards+s, shardHead[s], shardTail[s]);
+  }
   profArgs.opCount = *added;
   ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileAppendEnd);
   TIME_STOP(2);
@@ -824,6 +1131,31 @@ static int setProxyThreadContext(struct ncclProxyState* proxyState) {
 // Set to SIGUSR1 or SIGUSR2 to help debug proxy state during hangs
 NCCL_PARAM(ProxyDumpSignal, "PROXY_DUMP_SIGNAL", -1);
 NCCL_PARAM(ProgressAppendOpFreq, "PROGRESS_APPENDOP_FREQ", 8);
+// When ops are in flight but none progressed for PROXY_SPIN_TIME us, sleep with
+// an exponential backoff of up to PROXY_SLEEP_MAX us instead of spinning on
+// sched_yield. New ops wake the thread up, progress on in-flight ones does not.
+NCCL_PARAM(ProxySpinTime, "PROXY_SPIN_TIME", 100);
+NCCL_PARAM(ProxySleepMax, "PROXY_SLEEP_MAX", 0);
+
+struct proxyBackoff {
+  uint64_t lastActive; // 0 until the first idle loop after some progress
+  uint64_t sleepNs;
+};
+
+static void proxyBackoffReset(struct proxyBackoff* b) {
+  b->lastActive = b->sleepNs = 0;
+}
+
+// Returns how long to sleep after an idle loop, 0 to keep spinning.
+static uint64_t proxyBackoffNs(struct proxyBackoff* b) {
+  int64_t sleepMax = ncclParamProxySleepMax();
+  if (sleepMax <= 0) return 0;
+  uint64_t now = clockNano();
+  if (b->lastActive == 0) b->lastActive = now;
+  if (now - b->lastActive < ncclParamProxySpinTime()*1000) return 0;
+  b->sleepNs = std::min<uint64_t>(b->sleepNs ? 2*b->sleepNs : 1000, sleepMax*1000);
+  return b->sleepNs;
+}
 
 void* ncclProxyProgress(void *proxyState_) {
   struct ncclProxyState* proxyState = (struct ncclProxyState*)proxyState_;
@@ -832,7 +1164,7 @@ void* ncclProxyProgress(void *proxyState_) {
   } else if (cudaSetDevice(proxyState->cudaDev) != cudaSuccess) {
     WARN("[Proxy Progress] Failed to set CUDA device %d", proxyState->cudaDev);
   }
-  // if (CPU_COUNT(&comm->cpuAffinity)) sched_setaffinity(0, sizeof(cpu_set_t), &comm->cpuAffinity);
+  if (CPU_COUNT(&proxyState->affinity)) sched_setaffinity(0, sizeof(cpu_set_t), &proxyState->affinity);
 
   struct ncclProxyProgressState* state = &proxyState->progressState;
   state->nextOps = -1;
@@ -850,14 +1182,20 @@ void* ncclProxyProgress(void *proxyState_) {
    * ncclParamProgressAppendOpFreq(). If they are equal, we will append proxy ops. This will decrease the
    * frequency of calling ncclProxyGetPostedOps() and reduce the perf impact. */
   int proxyOpAppendCounter = 0;
+  struct proxyBackoff backoff;
+  proxyBackoffReset(&backoff);
   struct ncclProxyArgs profArgs; // Only used for profiling purposes
-  while ((state->stop == false || (state->stop == true && state->active)) && *proxyState->abortFlag == 0) {
+  uint64_t watchdogCheck = 0;
+  while ((state->stop == false || (state->stop == true && state->nActive)) && *proxyState->abortFlag == 0) {
     int idle = 1;
-    ncclResult_t ret = progressOps(proxyState, state, state->active, &idle);
+    ncclResult_t ret = progressOps(proxyState, state, &idle);
     if (ret != ncclSuccess) {
       INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
+      ncclProfilingDump();
       return NULL;
     }
+    proxyWatchdog(proxyState, state, &watchdogCheck);
+    if (idle == 0) proxyBackoffReset(&backoff);
     if (lastIdle == 0 && idle == 1) ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileIdle);
     if (lastIdle == 1 && idle == 0) ncclProfilingRecord(&profArgs, 0, 0, ncclProxyProfileActive);
     if (idle || (++proxyOpAppendCounter == ncclParamProgressAppendOpFreq())) {
@@ -865,20 +1203,288 @@ void* ncclProxyProgress(void *proxyState_) {
       proxyOpAppendCounter = 0;
       TIME_START(3);
       if (state->stop == false)
-        ret = ncclProxyGetPostedOps(proxyState, &added);
+        ret = ncclProxyGetPostedOps(proxyState, &added, true);
       if (added) { TIME_STOP(3); } else { TIME_CANCEL(3); }
       if (ret != ncclSuccess) {
         INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
       }
       if (added == 0) {
-        sched_yield(); // No request progressed. Let others run.
+        if (state->nActive == 0 && proxyShardsIdle(state)) __atomic_store_n(&state->idleLoops, state->idleLoops+1, __ATOMIC_RELEASE);
+        uint64_t sleepNs = state->nActive ? proxyBackoffNs(&backoff) : 0;
+        if (sleepNs) {
+          proxyOpsWait(state, proxyState->tpLocalnRanks, sleepNs);
+        } else {
+          sched_yield(); // No request progressed. Let others run.
+        }
+      } else {
+        proxyBackoffReset(&backoff);
       }
     }
     lastIdle = idle;
   }
+  ncclProfilingDump();
+  return NULL;
+}
+
+// Appends the ops the main progress thread handed to this shard.
+static ncclResult_t proxyShardGetPostedOps(struct ncclProxyShard* shard, int* added) {
+  struct ncclProxyProgressState* state = &shard->state;
+  if (state->nActive != 0 && (shard->posted == NULL || pthread_mutex_trylock(&shard->mutex) != 0)) return ncclSuccess;
+  if (state->nActive == 0) {
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->posted == NULL && !state->stop) {
+      __atomic_store_n(&shard->active, false, __ATOMIC_RELAXED);
+      pthread_cond_wait(&shard->cond, &shard->mutex);
+    }
+    if (state->stop) {
+      pthread_mutex_unlock(&shard->mutex);
+      return ncclSuccess;
+    }
+  }
+  struct ncclProxyShardOp* head = shard->posted;
+  shard->posted = shard->postedEnd = NULL;
+  pthread_mutex_unlock(&shard->mutex);
+
+  struct ncclProxyShardOp* last = NULL;
+  for (struct ncclProxyShardOp* sop = head; sop != NULL; sop = sop->next) {
+    NCCLCHECK(ProxyAppend(state, &sop->op));
+    (*added)++;
+    last = sop;
+  }
+  if (last) {
+    pthread_mutex_lock(&shard->mutex);
+    last->next = shard->freeOps;
+    shard->freeOps = head;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+  return ncclSuccess;
+}
+
+static void* ncclProxyShardProgress(void* shard_) {
+  struct ncclProxyShard* shard = (struct ncclProxyShard*)shard_;
+  struct ncclProxyState* proxyState = shard->proxyState;
+  if (setProxyThreadContext(proxyState) == 0 && cudaSetDevice(proxyState->cudaDev) != cudaSuccess) {
+    WARN("[Proxy Progress] Failed to set CUDA device %d", proxyState->cudaDev);
+  }
+  // Spread the shards over the proxy CPUs, when there are enough of them.
+  if (CPU_COUNT(&proxyState->affinity)) sched_setaffinity(0, sizeof(cpu_set_t), &proxyState->affinity);
+  cpu_set_t mask;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &mask) == 0 && CPU_COUNT(&mask) > shard->index+1) {
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &mask)) continue;
+      if (n++ == shard->index+1) {
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+        sched_setaffinity(0, sizeof(cpu_set_t), &mask);
+        break;
+      }
+    }
+  }
+  char threadName[NCCL_THREAD_NAMELEN];
+  snprintf(threadName, NCCL_THREAD_NAMELEN, "NCCL Progress%2d.%d", proxyState->cudaDev, shard->index+1);
+  nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
+
+  struct ncclProxyProgressState* state = &shard->state;
+  int proxyOpAppendCounter = 0;
+  struct proxyBackoff backoff;
+  proxyBackoffReset(&backoff);
+  uint64_t watchdogCheck = 0;
+  while ((state->stop == false || (state->stop == true && state->nActive)) && *proxyState->abortFlag == 0) {
+    int idle = 1;
+    ncclResult_t ret = progressOps(proxyState, state, &idle);
+    if (ret != ncclSuccess) {
+      INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread %d]", __FILE__, __LINE__, ret, shard->index+1);
+      return NULL;
+    }
+    proxyWatchdog(proxyState, state, &watchdogCheck);
+    if (idle == 0) proxyBackoffReset(&backoff);
+    if (idle || (++proxyOpAppendCounter == ncclParamProgressAppendOpFreq())) {
+      int added = 0;
+      proxyOpAppendCounter = 0;
+      if (state->stop == false) ret = proxyShardGetPostedOps(shard, &added);
+      if (ret != ncclSuccess) {
+        INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread %d]", __FILE__, __LINE__, ret, shard->index+1);
+      }
+      if (added == 0) {
+        uint64_t sleepNs = state->nActive ? proxyBackoffNs(&backoff) : 0;
+        if (sleepNs) {
+          pthread_mutex_lock(&shard->mutex);
+          if (shard->posted == NULL && !state->stop) proxyTimedWait(&shard->cond, &shard->mutex, sleepNs);
+          pthread_mutex_unlock(&shard->mutex);
+        } else {
+          sched_yield();
+        }
+      } else {
+        proxyBackoffReset(&backoff);
+      }
+    }
+  }
   return NULL;
 }
 
+static void proxyGroupRemove(struct ncclProxyProgressGroup* group, int m) {
+  group->members[m] = group->members[--group->nMembers];
+  pthread_cond_broadcast(&group->cond);
+}
+
+static void* ncclProxyGroupProgress(void* group_) {
+  struct ncclProxyProgressGroup* group = (struct ncclProxyProgressGroup*)group_;
+  if (cudaSetDevice(group->cudaDev) != cudaSuccess) {
+    WARN("[Proxy Progress] Failed to set CUDA device %d", group->cudaDev);
+  }
+  char threadName[NCCL_THREAD_NAMELEN];
+  snprintf(threadName, NCCL_THREAD_NAMELEN, "NCCL Progress%2d", group->cudaDev);
+  nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
+
+  int proxyOpAppendCounter = 0;
+  struct proxyBackoff backoff;
+  proxyBackoffReset(&backoff);
+  // Members are progressed from a copy, without the mutex, so that joining, leaving and waking up
+  // the thread do not wait for a whole round. Members only leave through this thread, so their
+  // state outlives the copy.
+  struct ncclProxyGroupMember* members = NULL;
+  int maxMembers = 0;
+  pthread_mutex_lock(&group->mutex);
+  while (!group->stop) {
+    // Should this fail, the members which fit keep being progressed
+    if (group->nMembers > maxMembers && ncclRealloc(&members, maxMembers, group->maxMembers) == ncclSuccess) maxMembers = group->maxMembers;
+    int nMembers = std::min(group->nMembers, maxMembers);
+    memcpy(members, group->members, nMembers*sizeof(struct ncclProxyGroupMember));
+    pthread_mutex_unlock(&group->mutex);
+
+    bool progressed = false;
+    int nActive = 0;
+    bool append = ++proxyOpAppendCounter >= ncclParamProgressAppendOpFreq();
+    for (int m=0; m<nMembers; m++) {
+      struct ncclProxyState* proxyState = members[m].proxyState;
+      struct ncclProxyProgressState* state = &proxyState->progressState;
+      members[m].removed = true;
+      if (*proxyState->abortFlag || (state->stop && state->nActive == 0)) continue;
+      int idle = 1;
+      ncclResult_t ret = progressOps(proxyState, state, &idle);
+      if (ret != ncclSuccess) {
+        INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
+        continue;
+      }
+      members[m].removed = false;
+      proxyWatchdog(proxyState, state, &members[m].watchdogCheck);
+      int added = 0;
+      if ((idle || append) && state->stop == false) {
+        ret = ncclProxyGetPostedOps(proxyState, &added, false);
+        if (ret != ncclSuccess) {
+          INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
+        }
+      }
+      if (idle == 0 || added) progressed = true;
+      if (idle && added == 0 && state->nActive == 0) __atomic_store_n(&state->idleLoops, state->idleLoops+1, __ATOMIC_RELEASE);
+      nActive += state->nActive;
+    }
+    if (append) proxyOpAppendCounter = 0;
+
+    pthread_mutex_lock(&group->mutex);
+    // Others only append members, those of the copy are still there
+    for (int m=0; m<nMembers; m++) {
+      int g = 0;
+      while (group->members[g].proxyState != members[m].proxyState) g++;
+      if (members[m].removed) proxyGroupRemove(group, g);
+      else group->members[g].watchdogCheck = members[m].watchdogCheck;
+    }
+    if (progressed) {
+      proxyBackoffReset(&backoff);
+      continue;
+    }
+    uint64_t sleepNs = nActive ? proxyBackoffNs(&backoff) : PROXY_GROUP_POLL_NS;
+    if (sleepNs == 0) {
+      pthread_mutex_unlock(&group->mutex);
+      sched_yield();
+      pthread_mutex_lock(&group->mutex);
+      continue;
+    }
+    // Posting checks the flag after adding ops, check for ops after setting it
+    __atomic_store_n(&group->sleeping, 1, __ATOMIC_SEQ_CST);
+    bool posted = false;
+    for (int m=0; m<group->nMembers && !posted; m++) {
+      struct ncclProxyState* proxyState = group->members[m].proxyState;
+      posted = proxyState->progressState.stop || proxyOpsPosted(proxyState->progressState.opsPool, proxyState->tpLocalnRanks);
+    }
+    if (!posted) proxyTimedWait(&group->cond, &group->mutex, sleepNs);
+    __atomic_store_n(&group->sleeping, 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&group->mutex);
+  free(members);
+  return NULL;
+}
+
+static ncclResult_t proxyGroupJoin(struct ncclProxyState* proxyState) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclProxyProgressGroup* group;
+  pthread_mutex_lock(&proxyGroupsLock);
+  for (group = proxyGroups; group; group = group->next) if (group->cudaDev == proxyState->cudaDev) break;
+  if (group == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&group, 1), ret, exit);
+    group->cudaDev = proxyState->cudaDev;
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->cond, NULL);
+    pthread_create(&group->thread, NULL, ncclProxyGroupProgress, group);
+    ncclSetThreadName(group->thread, "NCCL Progress%2d", group->cudaDev);
+    group->next = proxyGroups;
+    proxyGroups = group;
+    INFO(NCCL_INIT, "Proxy ops of device %d progressed by a thread shared by the communicators of the process", group->cudaDev);
+  }
+  pthread_mutex_lock(&group->mutex);
+  if (group->nMembers == group->maxMembers) {
+    ret = ncclRealloc(&group->members, group->maxMembers, std::max(2*group->maxMembers, 4));
+    if (ret == ncclSuccess) group->maxMembers = std::max(2*group->maxMembers, 4);
+  }
+  if (ret == ncclSuccess) {
+    group->members[group->nMembers].proxyState = proxyState;
+    group->members[group->nMembers].watchdogCheck = 0;
+    group->nMembers++;
+    group->refs++;
+    proxyState->progressGroup = group;
+    proxyState->progressState.thread = group->thread;
+    pthread_cond_broadcast(&group->cond);
+  }
+  pthread_mutex_unlock(&group->mutex);
+exit:
+  pthread_mutex_unlock(&proxyGroupsLock);
+  return ret;
+}
+
+// Waits for the group thread to have progressed all the ops of proxyState
+static void proxyGroupLeave(struct ncclProxyState* proxyState) {
+  struct ncclProxyProgressGroup* group = proxyState->progressGroup;
+  pthread_mutex_lock(&group->mutex);
+  proxyState->progressState.stop = true;
+  pthread_cond_broadcast(&group->cond);
+  while (1) {
+    int m = 0;
+    while (m < group->nMembers && group->members[m].proxyState != proxyState) m++;
+    if (m == group->nMembers) break;
+    pthread_cond_wait(&group->cond, &group->mutex);
+  }
+  pthread_mutex_unlock(&group->mutex);
+
+  pthread_mutex_lock(&proxyGroupsLock);
+  if (--group->refs == 0) {
+    struct ncclProxyProgressGroup** prev = &proxyGroups;
+    while (*prev != group) prev = &(*prev)->next;
+    *prev = group->next;
+    pthread_mutex_lock(&group->mutex);
+    group->stop = true;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->mutex);
+    pthread_join(group->thread, NULL);
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->cond);
+    free(group->members);
+    free(group);
+  }
+  pthread_mutex_unlock(&proxyGroupsLock);
+  proxyState->progressGroup = NULL;
+}
+
 ncclResult_t ncclProxyStart(struct ncclComm* comm) {
   struct ncclProxyOps* proxyOps = comm->proxyState->proxyOps;
   if (proxyOps == NULL) return ncclSuccess;
@@ -886,7 +1492,8 @@ ncclResult_t ncclProxyStart(struct ncclComm* comm) {
   for (int r = 0; r < comm->sharedRes->tpNLocalRanks; r++) {
     struct ncclProxyOps* ops = proxyOps + r;
     if (ops->pool == NULL || ops->nextOps == -1) continue;
-    NCCLCHECK(ncclProxyPost(ops->pool, ops->nextOps, ops->nextOpsEnd));
+    NCCLCHECK(ncclProxyPost(ops->pool, comm->topParentLocalRanks[comm->localRank], ops->nextOps, ops->nextOpsEnd));
+    if (r == comm->topParentLocalRanks[comm->localRank]) proxyGroupWake(comm->proxyState);
     ops->nextOps = ops->nextOpsEnd = -1;
     ops->count = 0;
   }
@@ -895,9 +1502,31 @@ ncclResult_t ncclProxyStart(struct ncclComm* comm) {
   return ncclSuccess;
 }
 
+// Number of threads progressing the proxy ops of a GPU, the main one included.
+NCCL_PARAM(ProxyProgressThreads, "PROXY_PROGRESS_THREADS", 1);
+
 static ncclResult_t ncclProxyProgressCreate(struct ncclProxyState* proxyState) {
   struct ncclProxyProgressState* state = &proxyState->progressState;
-  if (!state->thread) {
+  if (!state->thread && ncclParamProxySharedProgress()) {
+    state->nextOps = -1;
+    NCCLCHECK(proxyGroupJoin(proxyState));
+  } else if (!state->thread) {
+    // Shards must exist before the main progress thread routes ops to them.
+    int nShards = std::min<int64_t>(std::max<int64_t>(ncclParamProxyProgressThreads()-1, 0), MAXCHANNELS-1);
+    if (nShards > 0) {
+      NCCLCHECK(ncclCalloc(&state->shards, nShards));
+      for (int s = 0; s < nShards; s++) {
+        struct ncclProxyShard* shard = state->shards+s;
+        shard->proxyState = proxyState;
+        shard->index = s;
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->cond, NULL);
+        pthread_create(&shard->state.thread, NULL, ncclProxyShardProgress, shard);
+        ncclSetThreadName(shard->state.thread, "NCCL Progress%2d.%d", proxyState->tpLocalnRanks, s+1);
+      }
+      state->nShards = nShards;
+      INFO(NCCL_INIT, "Proxy ops progressed by %d threads", nShards+1);
+    }
     pthread_create(&state->thread, NULL, ncclProxyProgress, proxyState);
     ncclSetThreadName(state->thread, "NCCL Progress%2d", proxyState->tpLocalnRanks);
   }
@@ -908,7 +1537,9 @@ ncclResult_t ncclProxyProgressDestroy(struct ncclProxyState* proxyState) {
   struct ncclProxyProgressState* state = &proxyState->progressState;
 
   // Request the proxy to stop and then wake it
-  if (state->opsPool) {
+  if (proxyState->progressGroup) {
+    proxyGroupLeave(proxyState);
+  } else if (state->opsPool) {
     pthread_mutex_lock(&state->opsPool->mutex);
     state->stop = true;
     pthread_cond_signal(&state->opsPool->cond);
@@ -916,14 +1547,47 @@ ncclResult_t ncclProxyProgressDestroy(struct ncclProxyState* proxyState) {
     pthread_join(state->thread, NULL);
   }
 
+  // Then the shards, which the main progress thread no longer posts to
+  for (int s = 0; s < state->nShards; s++) {
+    struct ncclProxyShard* shard = state->shards+s;
+    pthread_mutex_lock(&shard->mutex);
+    shard->state.stop = true;
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->mutex);
+    pthread_join(shard->state.thread, NULL);
+    for (int g = 0; g < shard->state.nActiveFuncs; g++) free(shard->state.activeOps[g].ops);
+    while (shard->state.pools != NULL) {
+      struct ncclProxyPool *next = shard->state.pools->next;
+      proxyPoolFree(shard->state.pools);
+      shard->state.pools = next;
+    }
+    proxyShardPost(state, shard, NULL, NULL); // Take back consumed ops to free them below
+    while (shard->posted) {
+      struct ncclProxyShardOp* next = shard->posted->next;
+      free(shard->posted);
+      shard->posted = next;
+    }
+    pthread_mutex_destroy(&shard->mutex);
+    pthread_cond_destroy(&shard->cond);
+  }
+  free(state->shards);
+  state->shards = NULL;
+  state->nShards = 0;
+  while (state->shardFreeOps) {
+    struct ncclProxyShardOp* next = state->shardFreeOps->next;
+    free(state->shardFreeOps);
+    state->shardFreeOps = next;
+  }
+
   // Free off any memory allocated for the proxy arg pools
+  for (int g = 0; g < state->nActiveFuncs; g++) free(state->activeOps[g].ops);
+  state->nActiveFuncs = 0;
   while (state->pools != NULL) {
     struct ncclProxyPool *next = state->pools->next;
-    free(state->pools);
+    proxyPoolFree(state->pools);
     state->pools = next;
   }
 
-  ncclProfilingDump();
   TIME_PRINT("Proxy");
   return ncclSuccess;
 }
@@ -967,6 +1631,7 @@ static ncclResult_t proxyFree(struct ncclProxyConnection* connection, struct ncc
       NCCLCHECK(ncclTransports[connection->transport]->recv.proxyFree(connection, proxyState));
     }
   }
+  ncclProxyConnectionMem(proxyState, connection, -connection->memDevice, -connection->memHost);
   return ncclSuccess;
 }
 
@@ -1093,7 +1758,7 @@ error:
   return ret;
 }
 
-const char* ncclProxyMsgTypeStr[] = { "Unknown", "Init", "SharedInit", "Setup", "Connect", "Start", "Close", "Abort", "Stop", "ConvertFd" };
+const char* ncclProxyMsgTypeStr[] = { "Unknown", "Init", "SharedInit", "Setup", "Connect", "Start", "Close", "Abort", "Stop", "ConvertFd", "Free" };
 ncclResult_t ncclProxyCallAsync(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int type, void* reqBuff, int reqSize, int respSize, void* opId) {
   struct ncclSocket* sock;
   ncclResult_t ret = ncclSuccess;
@@ -1104,20 +1769,23 @@ ncclResult_t ncclProxyCallAsync(struct ncclComm* comm, struct ncclProxyConnector
   sock = sharedProxyState->peerSocks + proxyConn->tpLocalRank;
   if (sock == NULL) return ncclInternalError;
 
-  NCCLCHECKGOTO(ncclSocketSend(sock, &type, sizeof(int)), ret, error);
-  NCCLCHECKGOTO(ncclSocketSend(sock, &proxyConn->connection, sizeof(void*)), ret, error);
-  NCCLCHECKGOTO(ncclSocketSend(sock, &reqSize, sizeof(int)), ret, error);
-  NCCLCHECKGOTO(ncclSocketSend(sock, &respSize, sizeof(int)), ret, error);
-  if (reqSize) NCCLCHECKGOTO(ncclSocketSend(sock, reqBuff, reqSize), ret, error);
-
-  // Send opId to proxy
-  NCCLCHECKGOTO(ncclSocketSend(sock, &opId, sizeof(opId)), ret, error);
+  // Pack the whole request, including the opId the proxy sends back, in a single send.
+  char* msg;
+  int size = 0;
+  NCCLCHECK(ncclCalloc(&msg, 3*sizeof(int) + 2*sizeof(void*) + reqSize));
+  memcpy(msg+size, &type, sizeof(int)); size += sizeof(int);
+  memcpy(msg+size, &proxyConn->connection, sizeof(void*)); size += sizeof(void*);
+  memcpy(msg+size, &reqSize, sizeof(int)); size += sizeof(int);
+  memcpy(msg+size, &respSize, sizeof(int)); size += sizeof(int);
+  if (reqSize) { memcpy(msg+size, reqBuff, reqSize); size += reqSize; }
+  memcpy(msg+size, &opId, sizeof(opId)); size += sizeof(opId);
+  NCCLCHECKGOTO(ncclSocketSend(sock, msg, size), ret, exit);
 
   // Add proxyOp to expected response queue
-  NCCLCHECK(expectedProxyResponseEnqueue(sharedProxyState, opId, respSize));
+  NCCLCHECKGOTO(expectedProxyResponseEnqueue(sharedProxyState, opId, respSize), ret, exit);
 
-  return ncclSuccess;
-error:
+exit:
+  free(msg);
   return ret;
 }
 
@@ -1203,6 +1871,60 @@ fail:
   goto exit;
 }
 
+ncclResult_t ncclProxyCallDeferred(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int type, void* reqBuff, int reqSize, void* respBuff, int respSize) {
+  struct ncclProxyDeferredCall* call;
+  NCCLCHECK(ncclCalloc(&call, 1));
+  call->proxyConn = proxyConn;
+  call->respBuff = respBuff;
+  call->type = type;
+  call->opId = call; // Unique as long as the call is pending
+  ncclResult_t ret = ncclProxyCallAsync(comm, proxyConn, type, reqBuff, reqSize, respSize, call->opId);
+  if (ret != ncclSuccess) {
+    free(call);
+    return ret;
+  }
+  if (comm->proxyDeferred == NULL) comm->proxyDeferred = call;
+  else comm->proxyDeferredLast->next = call;
+  comm->proxyDeferredLast = call;
+  return ncclSuccess;
+}
+
+// The proxy answers requests of a socket in order, so polling the calls in the
+// order they were sent mostly finds the response we are looking for.
+ncclResult_t ncclProxyCallDeferredWait(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  while (comm->proxyDeferred) {
+    struct ncclProxyDeferredCall** callPtr = &comm->proxyDeferred;
+    struct ncclProxyDeferredCall* last = NULL;
+    while (*callPtr) {
+      struct ncclProxyDeferredCall* call = *callPtr;
+      ncclResult_t res = ncclPollProxyResponse(comm, call->proxyConn, call->respBuff, call->opId);
+      if (res == ncclInProgress) {
+        last = call;
+        callPtr = &call->next;
+        continue;
+      }
+      if (res != ncclSuccess) {
+        WARN("Deferred proxy call %s to rank %d failed", ncclProxyMsgTypeStr[call->type], call->proxyConn->tpRank);
+        ret = res;
+        goto fail;
+      }
+      *callPtr = call->next;
+      free(call);
+    }
+    comm->proxyDeferredLast = last;
+  }
+  return ncclSuccess;
+fail:
+  while (comm->proxyDeferred) {
+    struct ncclProxyDeferredCall* next = comm->proxyDeferred->next;
+    free(comm->proxyDeferred);
+    comm->proxyDeferred = next;
+  }
+  comm->proxyDeferredLast = NULL;
+  return ret;
+}
+
 static ncclResult_t proxyProgressInit(struct ncclProxyState* proxyState) {
   struct ncclProxyProgressState* state = &proxyState->progressState;
   if (state->opsPool == NULL) {
@@ -1212,8 +1934,7 @@ static ncclResult_t proxyProgressInit(struct ncclProxyState* proxyState) {
     char shmPath[sizeof("/dev/shm/nccl-XXXXXX")];
     shmPath[0] = '\0';
     NCCLCHECK(ncclShmOpen(shmPath, size, (void**)&pool, NULL, proxyState->tpLocalnRanks + 1, &state->handle));
-    // Init pool
-    pool->nextOps = -1;
+    // Init pool. The post rings start empty from the zeroed segment.
 
     for (int r = 0; r < proxyState->tpLocalnRanks; r++) {
       pool->freeOps[r] = r*MAX_OPS_PER_PEER;
@@ -1266,6 +1987,7 @@ static ncclResult_t proxyConnInit(struct ncclProxyLocalPeer* peer, struct ncclPr
   (*connection)->send = req->send;
   (*connection)->tpLocalRank = req->tpLocalRank;
   (*connection)->sameProcess = req->sameProcess;
+  (*connection)->nSteps = NCCL_STEPS;
   peer->tpLocalRank = req->tpLocalRank;
   peer->tpRank = req->tpRank;
 
@@ -1316,6 +2038,22 @@ static ncclResult_t proxyProgressAsync(struct ncclProxyAsyncOp* op, struct ncclP
   } else if (op->type == ncclProxyMsgInit) {
     TRACE(NCCL_PROXY, "proxyProgressAsync::ncclProxyMsgInit opId=%p op.reqBuff=%p", op->opId, op->reqBuff);
     NCCLCHECK(proxyConnInit(peer, connectionPool, proxyState, (ncclProxyInitReq*) op->reqBuff, (ncclProxyInitResp*) op->respBuff, &op->connection));
+  } else if (op->type == ncclProxyMsgFree) {
+    TRACE(NCCL_PROXY, "proxyProgressAsync::ncclProxyMsgFree opId=%p connection=%p", op->opId, op->connection);
+    if (op->connection->state != connUninitialized) NCCLCHECK(proxyFree(op->connection, proxyState));
+    __atomic_store_n(&op->connection->state, connUninitialized, __ATOMIC_RELEASE);
+  } else if (op->type == ncclProxyMsgRegister) {
+    TRACE(NCCL_PROXY, "proxyProgressAsync::ncclProxyMsgRegister opId=%p connection=%p", op->opId, op->connection);
+    if (op->connection->tcomm->proxyRegister) {
+      NCCLCHECK(op->connection->tcomm->proxyRegister(op->connection, proxyState, op->reqBuff, op->reqSize, op->respBuff, op->respSize));
+    } else if (op->respSize == sizeof(int)) {
+      *(int*)op->respBuff = -1;
+    }
+  } else if (op->type == ncclProxyMsgDeregister) {
+    TRACE(NCCL_PROXY, "proxyProgressAsync::ncclProxyMsgDeregister opId=%p connection=%p", op->opId, op->connection);
+    if (op->connection->tcomm->proxyDeregister) {
+      NCCLCHECK(op->connection->tcomm->proxyDeregister(op->connection, proxyState, op->reqBuff, op->reqSize));
+    }
   } else return ncclInternalError;
 
   if (done) {
@@ -1378,7 +2116,18 @@ static ncclResult_t proxyServiceInitOp(int type, struct ncclProxyLocalPeer* peer
   return ncclSuccess;
 }
 
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define NCCL_PROXY_SERVICE_BATCH 64
+#define NCCL_PROXY_SERVICE_MAX_EVENTS 64
+// epoll data of the listening socket and of the retry timer, peers use their slot
+#define PROXY_SERVICE_LISTEN UINT32_MAX
+#define PROXY_SERVICE_TIMER (UINT32_MAX-1)
+
+// Async ops which could not complete (e.g. a network connect still waiting on its peer) are
+// retried on a timer instead of spinning the service thread.
+NCCL_PARAM(ProxyServiceRetryUs, "PROXY_SERVICE_RETRY_US", 20);
 
 static bool proxyMatchOpType(int type) {
   switch (type) {
@@ -1387,160 +2136,247 @@ static bool proxyMatchOpType(int type) {
     case ncclProxyMsgSetup:
     case ncclProxyMsgConnect:
     case ncclProxyMsgConvertFd:
+    case ncclProxyMsgFree:
+    case ncclProxyMsgRegister:
+    case ncclProxyMsgDeregister:
       return true;
     default:
       return false;
   }
 }
 
+// Peers are allocated one by one, connections keep a pointer to their socket. Like the slots
+// of the fixed array this replaces, a closed peer is reused by the next one to connect.
+struct proxyServicePeers {
+  struct ncclProxyLocalPeer** peers;
+  int size;
+  int npeers;
+};
+
+static ncclResult_t proxyServicePeerAdd(struct proxyServicePeers* table, int epfd, struct ncclProxyState* proxyState) {
+  int s = 0;
+  while (s < table->size && table->peers[s] != NULL && table->peers[s]->sock.fd != -1) s++;
+  if (s == table->size) {
+    int size = std::max(2*table->size, NCCL_MAX_LOCAL_RANKS);
+    NCCLCHECK(ncclRealloc(&table->peers, table->size, size));
+    table->size = size;
+  }
+  if (table->peers[s] == NULL) NCCLCHECK(ncclCalloc(table->peers+s, 1));
+  struct ncclProxyLocalPeer* peer = table->peers[s];
+  struct epoll_event ev = {};
+  int fd;
+  NCCLCHECK(ncclSocketInit(&peer->sock));
+  if (ncclSocketAccept(&peer->sock, proxyState->listenSock) != ncclSuccess) {
+    WARN("[Service thread] Accept failed %s", strerror(errno));
+    ncclSocketClose(&peer->sock);
+    return ncclSuccess;
+  }
+  NCCLCHECK(ncclSocketGetFd(&peer->sock, &fd));
+  ev.events = EPOLLIN;
+  ev.data.u32 = s;
+  SYSCHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev), "epoll_ctl");
+  peer->tpLocalRank = -1;
+  table->npeers++;
+  return ncclSuccess;
+}
+
+static void proxyServicePeerClose(struct proxyServicePeers* table, int s, int epfd) {
+  struct ncclProxyLocalPeer* peer = table->peers[s];
+  epoll_ctl(epfd, EPOLL_CTL_DEL, peer->sock.fd, NULL);
+  ncclSocketClose(&peer->sock);
+  table->npeers--;
+}
+
+// Returns 1 when the peer's connection should be closed
+static int proxyServiceProgressPeer(struct ncclProxyLocalPeer* peer, uint32_t events, struct ncclProxyState* proxyState,
+    struct ncclProxyConnectionPool* connectionPool, int* asyncOpCount, int* stop) {
+  struct ncclSocket* sock = &peer->sock;
+  int closeConn = 0;
+  int type = 0;
+  ncclResult_t res = ncclSuccess;
+
+  // Progress all ops for this ncclProxyLocalPeer
+  ncclProxyAsyncOp* op = peer->asyncOps;
+  while (op != nullptr) {
+    ncclProxyAsyncOp* opnext = op->next; /* in case op is freed in proxyProgressAsync */
+    type = op->type;
+    res = proxyProgressAsync(op, proxyState, asyncOpCount, peer, connectionPool);
+    if (res == ncclSuccess || res == ncclInProgress) {
+      op = opnext;
+    } else {
+      // Res is a bad result
+      closeConn = 1;
+      WARN("[Service thread] Error encountered progressing operation=%s, res=%d, closing connection", ncclProxyMsgTypeStr[type], res);
+      break;
+    }
+  }
+
+  // Check for additional ops coming in. Take all the requests a peer pipelined (up to
+  // NCCL_PROXY_SERVICE_BATCH), rather than one per wakeup.
+  if (events & EPOLLIN) {
+    for (int n = 0; n < NCCL_PROXY_SERVICE_BATCH && closeConn == 0; n++) {
+      int closed;
+      res = ncclSocketTryRecv(sock, &type, sizeof(int), &closed, false /*blocking*/);
+      if (res != ncclSuccess && res != ncclInProgress) {
+        WARN("[Service thread] Could not receive type from localRank %d, res=%u, closed=%d", peer->tpLocalRank, res, closed);
+        closeConn = 1;
+      } else if (closed) {
+        INFO(NCCL_INIT|NCCL_NET|NCCL_PROXY, "[Service thread] Connection closed by localRank %d", peer->tpLocalRank);
+        closeConn = 1;
+      } else if (res == ncclSuccess) { // We received something from the sock
+        if (type == ncclProxyMsgStop) {
+          *stop = 1;
+          closeConn = 1;
+        } else if (type == ncclProxyMsgClose) {
+          closeConn = 1;
+        } else if (proxyMatchOpType(type)) {
+          res = proxyServiceInitOp(type, peer, connectionPool, proxyState, asyncOpCount);
+        } else {
+          WARN("[Service thread] Unknown command %d from localRank %d", type, peer->tpLocalRank);
+          closeConn = 1;
+        }
+
+        INFO(NCCL_PROXY, "Received and initiated operation=%s res=%d", ncclProxyMsgTypeStr[type], res);
+      }
+      if (res != ncclSuccess) break; // Nothing more to read, or failure handled below
+    }
+  } else if (events & (EPOLLHUP|EPOLLERR)) {
+    closeConn = 1;
+  }
+  if (res != ncclSuccess && res != ncclInProgress) {
+    WARN("[Proxy Service %d] Failed to execute operation %s from rank %d, retcode %d", proxyState->tpRank, ncclProxyMsgTypeStr[type], peer->tpRank, res);
+    closeConn = 1;
+  }
+
+  if (closeConn && op != nullptr) {
+    asyncProxyOpDequeue(peer, op);
+    (*asyncOpCount)--;
+  }
+  return closeConn;
+}
+
+// Arms the retry timer while async ops are pending, disarms it otherwise
+static void proxyServiceTimerSet(int timerfd, bool armed) {
+  struct itimerspec spec = {};
+  if (armed) {
+    int64_t ns = std::max(1LL, (long long)ncclParamProxyServiceRetryUs()) * 1000;
+    spec.it_value.tv_sec = spec.it_interval.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = spec.it_interval.tv_nsec = ns % 1000000000;
+  }
+  timerfd_settime(timerfd, 0, &spec, NULL);
+}
+
 void* ncclProxyService(void* _args) {
   struct ncclProxyState* proxyState =  (struct ncclProxyState*) _args;
-  // if (CPU_COUNT(&comm->cpuAffinity)) sched_setaffinity(0, sizeof(cpu_set_t), &comm->cpuAffinity);
+  // Set affinity before creating the context, so that host memory the service
+  // thread allocates and touches first lands on the node of these CPUs.
+  if (CPU_COUNT(&proxyState->affinity)) sched_setaffinity(0, sizeof(cpu_set_t), &proxyState->affinity);
   if (setProxyThreadContext(proxyState)) {
     INFO(NCCL_INIT, "[Proxy Service] Created CUDA context on device %d", proxyState->cudaDev);
   } else if (cudaSetDevice(proxyState->cudaDev) != cudaSuccess) {
     WARN("[Proxy Service] Failed to set CUDA device %d", proxyState->cudaDev);
   }
-  // if (CPU_COUNT(&comm->cpuAffinity)) sched_setaffinity(0, sizeof(cpu_set_t), &comm->cpuAffinity);
 
-  // Prepare poll descriptor
   struct ncclProxyConnectionPool connectionPool;
   connectionPool.pools = NULL;
   connectionPool.banks = 0;
   connectionPool.offset = NCCL_PROXY_CONN_POOL_SIZE;
 
-  struct pollfd pollfds[NCCL_MAX_LOCAL_RANKS+1];
-  struct ncclProxyLocalPeer peers[NCCL_MAX_LOCAL_RANKS];
-  memset(&peers, 0, sizeof(struct ncclProxyLocalPeer)*NCCL_MAX_LOCAL_RANKS);
-  for (int s=0; s<NCCL_MAX_LOCAL_RANKS; s++) {
-    pollfds[s].fd = -1;
-    pollfds[s].events = POLLHUP|POLLIN;
+  // Prepare the event loop: the listening socket, the retry timer, then one entry per peer
+  struct proxyServicePeers table = { NULL, 0, 0 };
+  struct epoll_event events[NCCL_PROXY_SERVICE_MAX_EVENTS];
+  struct epoll_event ev = {};
+  int listenFd;
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (epfd < 0 || timerfd < 0) {
+    WARN("[Proxy Service] Could not create event loop: %s", strerror(errno));
+    return NULL;
   }
-  if (ncclSocketGetFd(proxyState->listenSock, &pollfds[NCCL_MAX_LOCAL_RANKS].fd) != ncclSuccess) {
+  if (ncclSocketGetFd(proxyState->listenSock, &listenFd) != ncclSuccess) {
     WARN("[Proxy Service] Get listenSock fd fails");
     return NULL;
   };
-  pollfds[NCCL_MAX_LOCAL_RANKS].events = POLLIN;
+  ev.events = EPOLLIN;
+  ev.data.u32 = PROXY_SERVICE_LISTEN;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenFd, &ev) != 0) {
+    WARN("[Proxy Service] Could not add listenSock to event loop: %s", strerror(errno));
+    return NULL;
+  }
+  ev.data.u32 = PROXY_SERVICE_TIMER;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev) != 0) {
+    WARN("[Proxy Service] Could not add retry timer to event loop: %s", strerror(errno));
+    return NULL;
+  }
 
-  int maxnpeers = 0;
-  int npeers = 0;
   int stop = 0;
   int asyncOpCount = 0;
-  while (stop == 0 || (stop == 1 && npeers > 0)) {
+  bool timerArmed = false;
+  while (stop == 0 || (stop == 1 && table.npeers > 0)) {
     /* Even if local comm aborts, we cannot let proxy thread exit if we still have peer
      * connections. Need to wait until all other related comms call abort and safely exit
      * together, or we could face segmentation fault. */
     if (*proxyState->abortFlag != 0) stop = 1;
-    /* never let proxy service thread blocks in poll, or it cannot receive abortFlag. */
-    int ret;
-    do {
-      ret = poll(pollfds, NCCL_MAX_LOCAL_RANKS+1, asyncOpCount ? 0 : 500);
-    } while (ret < 0 && errno == EINTR);
-    if (ret < 0) {
-      WARN("[Proxy Service] Poll failed: %s", strerror(errno));
-      return NULL;
+    if (timerArmed != (asyncOpCount > 0)) {
+      timerArmed = asyncOpCount > 0;
+      proxyServiceTimerSet(timerfd, timerArmed);
     }
-    if (pollfds[NCCL_MAX_LOCAL_RANKS].revents) {
-      int s = 0;
-      while (s < NCCL_MAX_LOCAL_RANKS && pollfds[s].fd >= 0) s++;
-      if (s == NCCL_MAX_LOCAL_RANKS) {
-        WARN("[Proxy service] Too many connections (%d max)", NCCL_MAX_LOCAL_RANKS);
-        return NULL;
-      }
-      if (maxnpeers < s+1) maxnpeers = s+1;
-      if (ncclSocketInit(&peers[s].sock) != ncclSuccess) {
-        WARN("[Service thread] Initialize peers[%d].sock fails", s);
-        return NULL;
-      }
-      if (ncclSocketAccept(&peers[s].sock, proxyState->listenSock) != ncclSuccess) {
-        WARN("[Service thread] Accept failed %s", strerror(errno));
-      } else {
-        if (ncclSocketGetFd(&peers[s].sock, &pollfds[s].fd) != ncclSuccess) {
-          WARN("[Service thread] Get peers[%d].sock fd fails", s);
-          return NULL;
-        }
-        npeers++;
-        peers[s].tpLocalRank = -1;
-      }
+    /* never let proxy service thread block for long, or it cannot receive abortFlag. */
+    int nEvents;
+    do {
+      nEvents = epoll_wait(epfd, events, NCCL_PROXY_SERVICE_MAX_EVENTS, 500);
+    } while (nEvents < 0 && errno == EINTR);
+    if (nEvents < 0) {
+      WARN("[Proxy Service] epoll_wait failed: %s", strerror(errno));
+      break;
     }
-    for (int s=0; s<maxnpeers; s++) {
-      struct ncclProxyLocalPeer* peer = peers+s;
-      struct ncclSocket* sock = &peer->sock;
-      int closeConn = 0;
-      int type = 0;
-      ncclResult_t res = ncclSuccess;
-      if (pollfds[s].fd == -1) continue;
-
-      // Progress all ops for this ncclProxyLocalPeer
-      ncclProxyAsyncOp* op = peer->asyncOps;
-      while (op != nullptr) {
-        ncclProxyAsyncOp* opnext = op->next; /* in case op is freed in proxyProgressAsync */
-        type = op->type;
-        res = proxyProgressAsync(op, proxyState, &asyncOpCount, peer, &connectionPool);
-        if (res == ncclSuccess || res == ncclInProgress) {
-          op = opnext;
-        } else {
-          // Res is a bad result
-          closeConn = 1;
-          WARN("[Service thread] Error encountered progressing operation=%s, res=%d, closing connection", ncclProxyMsgTypeStr[type], res);
-          break;
+    bool retry = false;
+    for (int e=0; e<nEvents; e++) {
+      uint32_t id = events[e].data.u32;
+      if (id == PROXY_SERVICE_LISTEN) {
+        if (proxyServicePeerAdd(&table, epfd, proxyState) != ncclSuccess) {
+          WARN("[Service thread] Could not add a new peer");
+          stop = 2;
         }
+        continue;
       }
-
-      // Check for additional ops coming in
-      if (pollfds[s].revents & POLLIN) {
-        int closed;
-        res = ncclSocketTryRecv(sock, &type, sizeof(int), &closed, false /*blocking*/);
-        if (res != ncclSuccess && res != ncclInProgress) {
-          WARN("[Service thread] Could not receive type from localRank %d, res=%u, closed=%d", peer->tpLocalRank, res, closed);
-          closeConn = 1;
-        } else if (closed) {
-          INFO(NCCL_INIT|NCCL_NET|NCCL_PROXY, "[Service thread] Connection closed by localRank %d", peer->tpLocalRank);
-          closeConn = 1;
-        } else if (res == ncclSuccess) { // We received something from the sock
-          if (type == ncclProxyMsgStop) {
-            stop = 1;
-            closeConn = 1;
-          } else if (type == ncclProxyMsgClose) {
-            closeConn = 1;
-          } else if (proxyMatchOpType(type)) {
-            res = proxyServiceInitOp(type, peers+s, &connectionPool, proxyState, &asyncOpCount);
-          } else {
-            WARN("[Service thread] Unknown command %d from localRank %d", type, peer->tpLocalRank);
-            closeConn = 1;
-          }
-
-          INFO(NCCL_PROXY, "Received and initiated operation=%s res=%d", ncclProxyMsgTypeStr[type], res);
-        }
-      } else if (pollfds[s].revents & POLLHUP) {
-        closeConn = 1;
+      if (id == PROXY_SERVICE_TIMER) {
+        uint64_t expirations;
+        while (read(timerfd, &expirations, sizeof(expirations)) > 0);
+        retry = true;
+        continue;
       }
-      if (res != ncclSuccess && res != ncclInProgress) {
-        WARN("[Proxy Service %d] Failed to execute operation %s from rank %d, retcode %d", proxyState->tpRank, ncclProxyMsgTypeStr[type], peer->tpRank, res);
-        closeConn = 1;
+      struct ncclProxyLocalPeer* peer = table.peers[id];
+      if (peer == NULL || peer->sock.fd == -1) continue;
+      if (proxyServiceProgressPeer(peer, events[e].events, proxyState, &connectionPool, &asyncOpCount, &stop)) {
+        proxyServicePeerClose(&table, id, epfd);
       }
-
-      if (closeConn) {
-        ncclSocketClose(sock);
-
-        if (op != nullptr) {
-          asyncProxyOpDequeue(peer, op);
-          asyncOpCount--;
+    }
+    // Only peers with pending ops are retried, others wait for their socket
+    if (retry) {
+      for (int s=0; s<table.size; s++) {
+        struct ncclProxyLocalPeer* peer = table.peers[s];
+        if (peer == NULL || peer->sock.fd == -1 || peer->asyncOps == NULL) continue;
+        if (proxyServiceProgressPeer(peer, 0, proxyState, &connectionPool, &asyncOpCount, &stop)) {
+          proxyServicePeerClose(&table, s, epfd);
         }
-        pollfds[s].fd = -1;
-        npeers--;
       }
     }
+    if (stop == 2) break;
   }
 
   // Wait for all operations to complete and stop progress thread before freeing any resource
   if (ncclProxyProgressDestroy(proxyState) != ncclSuccess) {
     WARN("[Proxy Service] proxyDestroy failed");
   }
-  for (int s=0; s<maxnpeers; s++) {
-    ncclSocketClose(&peers[s].sock);
+  for (int s=0; s<table.size; s++) {
+    if (table.peers[s]) ncclSocketClose(&table.peers[s]->sock);
   }
   ncclProxyFreeConnections(&connectionPool, proxyState);
+  for (int s=0; s<table.size; s++) free(table.peers[s]);
+  free(table.peers);
+  close(timerfd);
+  close(epfd);
   ncclSocketClose(proxyState->listenSock);
   free(proxyState->listenSock);
   proxyOpsFree(proxyState);
@@ -1573,9 +2409,13 @@ ncclResult_t ncclProxyCreate(struct ncclComm* comm) {
     proxyState->nChannels = comm->nChannels;
     proxyState->allocP2pNetLLBuffers = comm->allocP2pNetLLBuffers;
     proxyState->dmaBufSupport = comm->dmaBufSupport;
+    // Children sharing the proxy are paced with their parent
+    proxyState->netBwLimit = comm->config.netBwLimit;
     proxyState->ncclNet = comm->ncclNet;
     proxyState->ncclCollNet = comm->ncclCollNet;
+    memcpy(&proxyState->affinity, &comm->proxyAffinity, sizeof(cpu_set_t));
     memcpy(proxyState->buffSizes, comm->buffSizes, sizeof(comm->buffSizes));
+    NCCLCHECK(ncclProxyStatsInit(proxyState, comm->nRanks));
 
     pthread_create(&comm->proxyState->thread, NULL, ncclProxyService, comm->proxyState);
     ncclSetThreadName(comm->proxyState->thread, "NCCL Service %2d", comm->cudaDev);
@@ -1634,6 +2474,7 @@ ncclResult_t ncclProxyDestroy(struct ncclComm* comm) {
   free(sharedProxyState->proxyOps);
   free(sharedProxyState->sharedDevMems);
   expectedProxyResponseFree(sharedProxyState);
+  ncclProxyStatsFree(sharedProxyState);
   free(sharedProxyState);
   return ncclSuccess;
 }
@@ -0,0 +1,388 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "register.h"
+#include "comm.h"
+#include "transport.h"
+#include "argcheck.h"
+#include "p2p.h"
+#include <unistd.h>
+
+// Releases the registrations of reg, already unlinked from comm->regs, and frees it
+static ncclResult_t regFree(struct ncclComm* comm, struct ncclReg* reg) {
+  ncclResult_t ret = ncclSuccess;
+  for (int c=0; c<reg->nConns; c++) {
+    struct ncclRegConn* conn = reg->conns+c;
+    if (conn->slot < 0) continue;
+    NCCLCHECKGOTO(ncclProxyCallBlocking(comm, &conn->proxyConn, ncclProxyMsgDeregister, &conn->slot, sizeof(int), NULL, 0), ret, exit);
+  }
+  for (int p=0; p<reg->nPeers; p++) {
+    struct ncclRegPeer* peer = reg->peers+p;
+    if (peer->peerBase == NULL) continue;
+    NCCLCHECKGOTO(ncclProxyCallBlocking(comm, comm->p2pRegConns+peer->peer, ncclProxyMsgDeregister, &peer->peerBase, sizeof(void*), NULL, 0), ret, exit);
+  }
+exit:
+  ncclResult_t res = ncclNvlsDeregisterBuffer(comm, reg);
+  if (ret == ncclSuccess) ret = res;
+  free(reg->conns);
+  free(reg->peers);
+  free(reg);
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclCommRegister, const ncclComm_t comm, void* buff, size_t size, void** handle);
+ncclResult_t ncclCommRegister(const ncclComm_t comm, void* buff, size_t size, void** handle) {
+  NCCLCHECK(PtrCheck(comm, "CommRegister", "comm"));
+  NCCLCHECK(PtrCheck(buff, "CommRegister", "buff"));
+  NCCLCHECK(PtrCheck(handle, "CommRegister", "handle"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (size == 0) {
+    WARN("CommRegister : size must be positive");
+    return ncclInvalidArgument;
+  }
+  cudaPointerAttributes attr;
+  CUDACHECK(cudaPointerGetAttributes(&attr, buff));
+  if (attr.type != cudaMemoryTypeDevice) {
+    WARN("CommRegister : buffer %p is not device memory", buff);
+    return ncclInvalidArgument;
+  }
+
+  uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+  uintptr_t addr = (uintptr_t)buff & -pageSize;
+  struct ncclReg* reg;
+  NCCLCHECK(ncclCalloc(&reg, 1));
+  reg->addr = addr;
+  reg->size = ROUNDUP((uintptr_t)buff + size - addr, pageSize);
+  reg->next = comm->regs;
+  comm->regs = reg;
+  *handle = reg;
+  INFO(NCCL_NET, "Registered buffer %p size %zi", buff, size);
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommDeregister, const ncclComm_t comm, void* handle);
+ncclResult_t ncclCommDeregister(const ncclComm_t comm, void* handle) {
+  NCCLCHECK(PtrCheck(comm, "CommDeregister", "comm"));
+  struct ncclReg** prev = &comm->regs;
+  while (*prev && *prev != handle) prev = &(*prev)->next;
+  if (*prev == NULL) {
+    WARN("CommDeregister : handle %p unknown to this communicator", handle);
+    return ncclInvalidArgument;
+  }
+  struct ncclReg* reg = *prev;
+  *prev = reg->next;
+  return regFree(comm, reg);
+}
+
+// Allocations of ncclMemAlloc, shared by all communicators of the process
+struct ncclMemAllocation {
+  struct ncclMemAllocation* next;
+  uintptr_t addr;
+  size_t size;
+  uint64_t id;
+  bool cuMem; // Otherwise from cudaMalloc
+};
+static pthread_mutex_t memAllocLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ncclMemAllocation* memAllocations = NULL;
+static uint64_t memAllocNextId = 1;
+int ncclMemAllocCount = 0;
+
+// Finds the allocation holding [begin, begin+size) if id is 0, or checks that allocation id is still live
+static bool memAllocFind(uintptr_t begin, size_t size, uint64_t id, struct ncclMemAllocation* out) {
+  bool found = false;
+  pthread_mutex_lock(&memAllocLock);
+  for (struct ncclMemAllocation* m = memAllocations; m; m = m->next) {
+    if (id ? m->id == id : (m->addr <= begin && begin+size <= m->addr+m->size)) {
+      if (out) *out = *m;
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&memAllocLock);
+  return found;
+}
+
+bool ncclRegAny(struct ncclComm* comm) {
+  return comm->regs != NULL || __atomic_load_n(&ncclMemAllocCount, __ATOMIC_RELAXED) > 0;
+}
+
+ncclResult_t ncclRegLookup(struct ncclComm* comm, const void* data, size_t size, struct ncclReg** outReg) {
+  uintptr_t begin = (uintptr_t)data;
+  struct ncclReg** prev = &comm->regs;
+  *outReg = NULL;
+  while (*prev) {
+    struct ncclReg* reg = *prev;
+    // The allocation was freed, its address range may have been reused since
+    if (reg->memId && !memAllocFind(0, 0, reg->memId, NULL)) {
+      *prev = reg->next;
+      NCCLCHECK(regFree(comm, reg));
+      continue;
+    }
+    if (reg->addr <= begin && begin+size <= reg->addr+reg->size) {
+      *outReg = reg;
+      return ncclSuccess;
+    }
+    prev = &reg->next;
+  }
+  struct ncclMemAllocation m;
+  if (__atomic_load_n(&ncclMemAllocCount, __ATOMIC_RELAXED) == 0 || !memAllocFind(begin, size, 0, &m)) return ncclSuccess;
+  struct ncclReg* reg;
+  NCCLCHECK(ncclCalloc(&reg, 1));
+  reg->addr = m.addr;
+  reg->size = m.size;
+  reg->memId = m.id;
+  reg->next = comm->regs;
+  comm->regs = reg;
+  *outReg = reg;
+  INFO(NCCL_NET, "Registered buffer %lx size %zi from ncclMemAlloc", m.addr, m.size);
+  return ncclSuccess;
+}
+
+#if CUDART_VERSION >= 11030
+// Memory any transport can use in place: exportable as a file descriptor (and fabric
+// handle where supported) for other processes, RDMA capable, and aligned for binding
+// to NVLS multicast objects.
+static ncclResult_t memAllocCuMem(void** ptr, size_t* size) {
+  ncclResult_t ret = ncclSuccess;
+  CUmemAllocationProp prop = {};
+  CUmemAccessDesc* accessDescs = NULL;
+  CUmemGenericAllocationHandle handle;
+  CUdevice currentDev;
+  size_t granularity = 0;
+  int cudaDev, nDevs, nAccess = 0, flag = 0;
+  CUDACHECK(cudaGetDevice(&cudaDev));
+  CUDACHECK(cudaGetDeviceCount(&nDevs));
+  CUCHECK(cuDeviceGet(&currentDev, cudaDev));
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.location.id = currentDev;
+  prop.requestedHandleTypes = NCCL_P2P_HANDLE_TYPE;
+#if CUDART_VERSION >= 12030
+  CUCHECK(cuDeviceGetAttribute(&flag, CU_DEVICE_ATTRIBUTE_HANDLE_TYPE_FABRIC_SUPPORTED, currentDev));
+  if (flag) prop.requestedHandleTypes = (CUmemAllocationHandleType)(prop.requestedHandleTypes | CU_MEM_HANDLE_TYPE_FABRIC);
+#endif
+  CUCHECK(cuDeviceGetAttribute(&flag, CU_DEVICE_ATTRIBUTE_GPU_DIRECT_RDMA_SUPPORTED, currentDev));
+  if (flag) prop.allocFlags.gpuDirectRDMACapable = 1;
+  CUCHECK(cuMemGetAllocationGranularity(&granularity, &prop, CU_MEM_ALLOC_GRANULARITY_RECOMMENDED));
+#if CUDART_VERSION >= 12010
+  CUCHECK(cuDeviceGetAttribute(&flag, CU_DEVICE_ATTRIBUTE_MULTICAST_SUPPORTED, currentDev));
+  if (flag && CUPFN(cuMulticastGetGranularity)) {
+    CUmulticastObjectProp mcProp = {};
+    size_t mcGranularity = 0;
+    mcProp.numDevices = 1;
+    mcProp.size = *size;
+    mcProp.handleTypes = NCCL_P2P_HANDLE_TYPE;
+    CUCHECK(cuMulticastGetGranularity(&mcGranularity, &mcProp, CU_MULTICAST_GRANULARITY_RECOMMENDED));
+    granularity = std::max(granularity, mcGranularity);
+  }
+#endif
+  ALIGN_SIZE(*size, granularity);
+  if (CUPFN(cuMemCreate(&handle, *size, &prop, 0)) != CUDA_SUCCESS) {
+    // Fabric handles also need the fabric manager to be running
+    prop.requestedHandleTypes = NCCL_P2P_HANDLE_TYPE;
+    CUCHECK(cuMemCreate(&handle, *size, &prop, 0));
+  }
+  CUCHECKGOTO(cuMemAddressReserve((CUdeviceptr*)ptr, *size, granularity, 0, 0), ret, release);
+  CUCHECKGOTO(cuMemMap((CUdeviceptr)*ptr, *size, 0, handle, 0), ret, unreserve);
+  // Local peers may access it directly as well
+  NCCLCHECKGOTO(ncclCalloc(&accessDescs, nDevs), ret, unmap);
+  for (int d=0; d<nDevs; d++) {
+    int canAccess = d == cudaDev;
+    if (!canAccess && cudaDeviceCanAccessPeer(&canAccess, d, cudaDev) != cudaSuccess) canAccess = 0;
+    if (!canAccess) continue;
+    accessDescs[nAccess].location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    accessDescs[nAccess].location.id = d;
+    accessDescs[nAccess].flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+    nAccess++;
+  }
+  CUCHECKGOTO(cuMemSetAccess((CUdeviceptr)*ptr, *size, accessDescs, nAccess), ret, unmap);
+  free(accessDescs);
+  TRACE(NCCL_ALLOC, "MemAlloc size %zi pointer %p granularity %zi handle types %x", *size, *ptr, granularity, prop.requestedHandleTypes);
+  return ncclSuccess;
+unmap:
+  free(accessDescs);
+  (void)CUPFN(cuMemUnmap((CUdeviceptr)*ptr, *size));
+unreserve:
+  (void)CUPFN(cuMemAddressFree((CUdeviceptr)*ptr, *size));
+release:
+  (void)CUPFN(cuMemRelease(handle));
+  *ptr = NULL;
+  return ret;
+}
+#endif
+
+NCCL_API(ncclResult_t, ncclMemAlloc, void** ptr, size_t size);
+ncclResult_t ncclMemAlloc(void** ptr, size_t size) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  struct ncclMemAllocation* m;
+  NCCLCHECK(PtrCheck(ptr, "MemAlloc", "ptr"));
+  if (size == 0) {
+    WARN("MemAlloc : size must be positive");
+    return ncclInvalidArgument;
+  }
+  NCCLCHECK(ncclCudaLibraryInit());
+  NCCLCHECK(ncclCalloc(&m, 1));
+#if CUDART_VERSION >= 11030
+  if (ncclIsCuMemSupported()) {
+    ncclResult_t ret = memAllocCuMem(ptr, &size);
+    if (ret != ncclSuccess) {
+      free(m);
+      return ret;
+    }
+    m->cuMem = true;
+  } else
+#endif
+  {
+    cudaError_t err = cudaMalloc(ptr, size);
+    if (err != cudaSuccess) {
+      free(m);
+      WARN("MemAlloc : cudaMalloc of %zi bytes failed: %s", size, cudaGetErrorString(err));
+      return ncclUnhandledCudaError;
+    }
+  }
+  m->addr = (uintptr_t)*ptr;
+  m->size = size;
+  pthread_mutex_lock(&memAllocLock);
+  m->id = memAllocNextId++;
+  m->next = memAllocations;
+  memAllocations = m;
+  __atomic_add_fetch(&ncclMemAllocCount, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&memAllocLock);
+  INFO(NCCL_ALLOC, "MemAlloc %p size %zi%s", *ptr, size, m->cuMem ? "" : " (cudaMalloc, cuMem unsupported)");
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclMemFree, void* ptr);
+ncclResult_t ncclMemFree(void* ptr) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  struct ncclMemAllocation* m = NULL;
+  if (ptr == NULL) return ncclSuccess;
+  pthread_mutex_lock(&memAllocLock);
+  for (struct ncclMemAllocation** prev = &memAllocations; *prev; prev = &(*prev)->next) {
+    if ((*prev)->addr != (uintptr_t)ptr) continue;
+    m = *prev;
+    *prev = m->next;
+    __atomic_sub_fetch(&ncclMemAllocCount, 1, __ATOMIC_RELAXED);
+    break;
+  }
+  pthread_mutex_unlock(&memAllocLock);
+  if (m == NULL) {
+    WARN("MemFree : %p was not allocated by ncclMemAlloc", ptr);
+    return ncclInvalidArgument;
+  }
+  // Communicators may be in use by other threads, so they drop their registration of it
+  // themselves, the next time they look one up (see ncclRegLookup) or in ncclRegFreeAll.
+  bool cuMem = m->cuMem;
+  free(m);
+  if (cuMem) {
+    NCCLCHECK(ncclCuMemFree(ptr));
+  } else {
+    CUDACHECK(cudaFree(ptr));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclRegFindNet(struct ncclComm* comm, struct ncclConnector* connector, const void* data, size_t size, int* slot) {
+  *slot = -1;
+  struct ncclReg* reg;
+  NCCLCHECK(ncclRegLookup(comm, data, size, &reg));
+  if (reg == NULL) return ncclSuccess;
+
+  for (int c=0; c<reg->nConns; c++) {
+    if (reg->conns[c].proxyConn.connection == connector->proxyConn.connection) {
+      *slot = reg->conns[c].slot;
+      return ncclSuccess;
+    }
+  }
+  if (reg->nConns == reg->maxConns) {
+    int maxConns = std::max(2*reg->maxConns, 8);
+    NCCLCHECK(ncclRealloc(&reg->conns, reg->maxConns, maxConns));
+    reg->maxConns = maxConns;
+  }
+  struct ncclProxyRegisterReq req = { (void*)reg->addr, reg->size };
+  NCCLCHECK(ncclProxyCallBlocking(comm, &connector->proxyConn, ncclProxyMsgRegister, &req, sizeof(req), slot, sizeof(int)));
+  // Remember failures too, so that we don't ask again on every operation
+  struct ncclRegConn* conn = reg->conns+reg->nConns++;
+  conn->proxyConn = connector->proxyConn;
+  conn->slot = *slot;
+  TRACE(NCCL_NET, "Buffer %lx size %zi registered on connection %p slot %d", reg->addr, reg->size, connector->proxyConn.connection, *slot);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclRegFindP2p(struct ncclComm* comm, int peer, const void* data, size_t size, void** peerPtr) {
+  *peerPtr = NULL;
+  struct ncclReg* reg;
+  uintptr_t begin = (uintptr_t)data;
+  NCCLCHECK(ncclRegLookup(comm, data, size, &reg));
+  if (reg == NULL) return ncclSuccess;
+
+  struct ncclRegPeer* regPeer = NULL;
+  for (int p=0; p<reg->nPeers; p++) {
+    if (reg->peers[p].peer == peer) regPeer = reg->peers+p;
+  }
+  if (regPeer == NULL) {
+    if (reg->nPeers == reg->maxPeers) {
+      int maxPeers = std::max(2*reg->maxPeers, 8);
+      NCCLCHECK(ncclRealloc(&reg->peers, reg->maxPeers, maxPeers));
+      reg->maxPeers = maxPeers;
+    }
+    // Remember failures too, so that we don't ask again on every operation
+    regPeer = reg->peers+reg->nPeers++;
+    regPeer->peer = peer;
+    regPeer->base = 0;
+    regPeer->size = 0;
+    regPeer->peerBase = NULL;
+    struct ncclP2pRegisterReq req;
+    CUdeviceptr base;
+    size_t baseSize;
+    if (CUPFN(cuMemGetAddressRange) == NULL ||
+        CUPFN(cuMemGetAddressRange(&base, &baseSize, (CUdeviceptr)begin)) != CUDA_SUCCESS ||
+        cudaIpcGetMemHandle(&req.ipc, (void*)base) != cudaSuccess) {
+      // e.g. cuMem allocations, which have no legacy IPC handle
+      cudaGetLastError();
+      INFO(NCCL_P2P, "Buffer %lx size %zi cannot be shared with peer %d", reg->addr, reg->size, peer);
+      return ncclSuccess;
+    }
+    if (comm->p2pRegConns == NULL) NCCLCHECK(ncclCalloc(&comm->p2pRegConns, comm->nRanks));
+    struct ncclProxyConnector* proxyConn = comm->p2pRegConns+peer;
+    if (proxyConn->connection == NULL) NCCLCHECK(ncclProxyConnect(comm, TRANSPORT_P2P, 1, comm->topParentRanks[peer], proxyConn));
+    NCCLCHECK(ncclProxyCallBlocking(comm, proxyConn, ncclProxyMsgRegister, &req, sizeof(req), &regPeer->peerBase, sizeof(void*)));
+    regPeer->base = base;
+    regPeer->size = baseSize;
+    TRACE(NCCL_P2P, "Buffer %lx size %zi mapped by peer %d at %p", reg->addr, reg->size, peer, regPeer->peerBase);
+  }
+  // Registrations may span several allocations, only one is mapped
+  if (regPeer->peerBase == NULL || begin < regPeer->base || begin+size > regPeer->base+regPeer->size) return ncclSuccess;
+  *peerPtr = (char*)regPeer->peerBase + (begin - regPeer->base);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclRegConnFree(struct ncclComm* comm, struct ncclConnector* connector) {
+  for (struct ncclReg* reg = comm->regs; reg; reg = reg->next) {
+    for (int c=0; c<reg->nConns; c++) {
+      if (reg->conns[c].proxyConn.connection == connector->proxyConn.connection) {
+        reg->conns[c] = reg->conns[--reg->nConns];
+        break;
+      }
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclRegFreeAll(struct ncclComm* comm) {
+  // Connections release their registrations when they are freed
+  while (comm->regs) {
+    struct ncclReg* reg = comm->regs;
+    comm->regs = reg->next;
+    NCCLCHECK(ncclNvlsDeregisterBuffer(comm, reg));
+    free(reg->conns);
+    free(reg->peers);
+    free(reg);
+  }
+  free(comm->p2pRegConns);
+  comm->p2pRegConns = NULL;
+  return ncclSuccess;
+}
@@ -0,0 +1,207 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "request.h"
+#include "comm.h"
+#include "group.h"
+#include "argcheck.h"
+#include "enqueue.h"
+#include "cudawrap.h"
+#include <sched.h>
+
+// Each request owns a flag in host-mapped memory, which the stream sets to the
+// request's sequence number once the work before it is done. Flags are never
+// shared, and a sequence number is not reused before the counter wraps, so a late
+// write meant for a previous user of the flag does not complete the next one.
+// Requests come from one pool per device which lives as long as the process, so
+// that a request recorded on a communicator remains valid once it is destroyed.
+#define NCCL_REQUESTS_PER_CHUNK 64
+
+struct ncclRequest {
+  struct ncclRequest* next;
+  struct ncclRequestPool* pool;
+  struct ncclComm* comm; // NULL while free, or once comm is destroyed
+  uint32_t* flag;    // Host address of the flag
+  CUdeviceptr dflag; // Its address for the stream
+  uint32_t seq;
+};
+
+struct ncclRequestChunk {
+  struct ncclRequestChunk* next;
+  uint32_t* flags;
+  struct ncclRequest requests[NCCL_REQUESTS_PER_CHUNK];
+};
+
+struct ncclRequestPool {
+  struct ncclRequestPool* next;
+  int cudaDev;
+  struct ncclRequest* free;
+  struct ncclRequestChunk* chunks;
+  uint32_t seq;
+};
+
+static pthread_mutex_t requestLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ncclRequestPool* requestPools = NULL;
+
+// Called with requestLock held
+static ncclResult_t requestPoolGrow(struct ncclRequestPool* pool) {
+  struct ncclRequestChunk* chunk;
+  void* dflags;
+  NCCLCHECK(ncclCalloc(&chunk, 1));
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECKGOTO(ncclCudaHostCalloc(&chunk->flags, NCCL_REQUESTS_PER_CHUNK), ret, fail);
+  CUDACHECKGOTO(cudaHostGetDevicePointer(&dflags, chunk->flags, 0), ret, fail);
+  for (int i=0; i<NCCL_REQUESTS_PER_CHUNK; i++) {
+    struct ncclRequest* req = chunk->requests+i;
+    req->pool = pool;
+    req->flag = chunk->flags+i;
+    req->dflag = (CUdeviceptr)((uint32_t*)dflags+i);
+    req->next = pool->free;
+    pool->free = req;
+  }
+  chunk->next = pool->chunks;
+  pool->chunks = chunk;
+  return ncclSuccess;
+fail:
+  if (chunk->flags) ncclCudaHostFree(chunk->flags);
+  free(chunk);
+  return ret;
+}
+
+static ncclResult_t requestAlloc(struct ncclComm* comm, struct ncclRequest** req) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclRequestPool* pool;
+  pthread_mutex_lock(&requestLock);
+  for (pool = requestPools; pool != NULL && pool->cudaDev != comm->cudaDev; pool = pool->next);
+  if (pool == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&pool, 1), ret, exit);
+    pool->cudaDev = comm->cudaDev;
+    pool->next = requestPools;
+    requestPools = pool;
+  }
+  if (pool->free == NULL) NCCLCHECKGOTO(requestPoolGrow(pool), ret, exit);
+  *req = pool->free;
+  pool->free = (*req)->next;
+  // Flags start at 0, which therefore never marks a request done
+  if (++pool->seq == 0) pool->seq = 1;
+  (*req)->seq = pool->seq;
+  (*req)->comm = comm;
+exit:
+  pthread_mutex_unlock(&requestLock);
+  return ret;
+}
+
+static void requestRelease(struct ncclRequest* req) {
+  pthread_mutex_lock(&requestLock);
+  req->comm = NULL;
+  req->next = req->pool->free;
+  req->pool->free = req;
+  pthread_mutex_unlock(&requestLock);
+}
+
+static bool requestDone(struct ncclRequest* req) {
+  return __atomic_load_n(req->flag, __ATOMIC_ACQUIRE) == req->seq;
+}
+
+ncclResult_t ncclRequestCommDetach(struct ncclComm* comm) {
+  pthread_mutex_lock(&requestLock);
+  for (struct ncclRequestPool* pool = requestPools; pool != NULL; pool = pool->next) {
+    if (pool->cudaDev != comm->cudaDev) continue;
+    for (struct ncclRequestChunk* chunk = pool->chunks; chunk != NULL; chunk = chunk->next) {
+      for (int i=0; i<NCCL_REQUESTS_PER_CHUNK; i++) {
+        if (chunk->requests[i].comm == comm) chunk->requests[i].comm = NULL;
+      }
+    }
+  }
+  pthread_mutex_unlock(&requestLock);
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommRequestRecord, ncclComm_t comm, cudaStream_t stream, ncclRequest_t* request);
+ncclResult_t ncclCommRequestRecord(ncclComm_t comm, cudaStream_t stream, ncclRequest_t* request) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(comm, "CommRequestRecord", "comm"));
+  NCCLCHECK(PtrCheck(request, "CommRequestRecord", "request"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  *request = NULL;
+#if CUDA_VERSION >= 11070
+  // Operations of a group are only on the stream once the group ends
+  if (ncclGroupDepth != 0) {
+    WARN("CommRequestRecord : cannot be called within a group");
+    return ncclInvalidUsage;
+  }
+  // The sequence number is chosen now, so a graph would replay it unchanged
+  cudaStreamCaptureStatus status;
+  CUDACHECK(cudaStreamIsCapturing(stream, &status));
+  if (status != cudaStreamCaptureStatusNone) {
+    WARN("CommRequestRecord : cannot be captured in a CUDA graph");
+    return ncclInvalidUsage;
+  }
+  if (CUPFN(cuStreamWriteValue32) == NULL || !ncclCudaStreamMemOpsSupported(comm->cudaDev)) {
+    WARN("CommRequestRecord : stream memory operations are not supported");
+    return ncclInvalidUsage;
+  }
+  // Collectives held back for coalescing or still queued by other threads are not
+  // on their streams yet
+  NCCLCHECK(ncclCoalesceFlush(comm));
+  NCCLCHECK(ncclSubmitFlush(comm));
+  struct ncclRequest* req;
+  ncclResult_t ret;
+  NCCLCHECK(requestAlloc(comm, &req));
+  CUCHECKGOTO(cuStreamWriteValue32(stream, req->dflag, req->seq, CU_STREAM_WRITE_VALUE_DEFAULT), ret, release);
+  *request = req;
+  return ncclSuccess;
+release:
+  requestRelease(req);
+  return ret;
+#else
+  WARN("CommRequestRecord : requires CUDA 11.7 or later");
+  return ncclInvalidUsage;
+#endif
+}
+
+NCCL_API(ncclResult_t, ncclTest, ncclRequest_t request, int* done);
+ncclResult_t ncclTest(ncclRequest_t request, int* done) {
+  NCCLCHECK(PtrCheck(request, "Test", "request"));
+  NCCLCHECK(PtrCheck(done, "Test", "done"));
+  *done = requestDone(request);
+  if (*done) requestRelease(request);
+  return ncclSuccess;
+}
+
+// Whether the communicator of req was aborted or failed, in which case the request
+// will never complete. req->comm is read, and comm used, under requestLock, which
+// ncclRequestCommDetach takes before comm is freed.
+static ncclResult_t requestCommError(struct ncclRequest* req) {
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&requestLock);
+  struct ncclComm* comm = req->comm;
+  if (comm != NULL) {
+    if (__atomic_load_n(comm->abortFlag, __ATOMIC_RELAXED)) {
+      ret = ncclInternalError;
+    } else {
+      ret = __atomic_load_n(&comm->asyncResult, __ATOMIC_ACQUIRE);
+      if (ret == ncclInProgress) ret = ncclSuccess;
+    }
+  }
+  pthread_mutex_unlock(&requestLock);
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclWait, ncclRequest_t request);
+ncclResult_t ncclWait(ncclRequest_t request) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  NCCLCHECK(PtrCheck(request, "Wait", "request"));
+  // Once the communicator is destroyed, only the stream can complete the request
+  ncclResult_t ret = ncclSuccess;
+  while (!requestDone(request)) {
+    ret = requestCommError(request);
+    if (ret != ncclSuccess) break;
+    sched_yield();
+  }
+  requestRelease(request);
+  return ret;
+}
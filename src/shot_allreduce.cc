@@ -0,0 +1,217 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "shot_allreduce.h"
+#include "comm.h"
+#include "info.h"
+#include "group.h"
+#include "bootstrap.h"
+#include "graph.h"
+#include "p2p.h"
+#include "enqueue.h"
+
+// 0: disabled, 1: when the tuning model prefers it, 2: always one-shot, 3: always two-shot.
+// Off by default, since AllReduces it picks cannot be grouped, see ncclShotArEligible.
+NCCL_PARAM(ShotAllReduce, "SHOT_ALLREDUCE", 0);
+NCCL_PARAM(ShotAllReduceMaxBytes, "SHOT_ALLREDUCE_MAX_BYTES", 1 << 18);
+
+struct ncclShotAr {
+  char* buff;
+  ncclIpcDesc ipcDesc;
+  size_t size;
+  size_t maxBytes;
+  char* peerBuffs[NCCL_SHOT_AR_MAX_RANKS];
+  int peerImported[NCCL_SHOT_AR_MAX_RANKS];
+  int oneShot; // All pairs of GPUs read from each other efficiently
+  int twoShot; // Variant picked for the next launch
+};
+
+struct ncclShotArExchange {
+  ncclIpcDesc ipcDesc;
+  void* ptr;
+  int ok;
+};
+
+// Whether the communicator can run one-shot or two-shot AllReduce, and whether all GPUs can
+// read from each other (one-shot reads all of its inputs). This must come out the same on
+// all ranks, so it only depends on the parameters and the topology.
+static bool shotArPossible(struct ncclComm* comm, int* allRead) {
+  *allRead = 1;
+  if (comm->nNodes != 1 || comm->nRanks < 2 || comm->nRanks > NCCL_SHOT_AR_MAX_RANKS) return false;
+  for (int i=0; i<comm->nRanks; i++) {
+    for (int j=i+1; j<comm->nRanks; j++) {
+      int p2p, read, intermediateRank;
+      if (ncclTopoCheckP2p(comm->topo, comm->peerInfo[i].busId, comm->peerInfo[j].busId, &p2p, &read, &intermediateRank) != ncclSuccess) return false;
+      if (!p2p || intermediateRank != -1) return false;
+      if (!read) *allRead = 0;
+    }
+  }
+  return true;
+}
+
+ncclResult_t ncclShotArInit(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclShotAr* sa = NULL;
+  struct ncclShotArExchange* all = NULL;
+  int rank = comm->rank;
+  int nRanks = comm->nRanks;
+  int allRead;
+  bool allOk = true;
+
+  comm->shotArState = -1;
+  if (!ncclParamShotAllReduce()) return ncclSuccess;
+  // The kernel is launched before ncclAllReduce returns, which nonblocking communicators
+  // don't allow. Every rank must take the same path through the allgather below.
+  if (!comm->allBlocking) {
+    INFO(NCCL_INIT, "One-shot/two-shot AllReduce unavailable : not supported with nonblocking communicators");
+    return ncclSuccess;
+  }
+  if (!shotArPossible(comm, &allRead)) {
+    INFO(NCCL_INIT, "One-shot/two-shot AllReduce unavailable : need a single node with at most %d GPUs and P2P between all of them", NCCL_SHOT_AR_MAX_RANKS);
+    return ncclSuccess;
+  }
+
+  NCCLCHECK(ncclCalloc(&sa, 1));
+  NCCLCHECKGOTO(ncclCalloc(&all, nRanks), ret, fail);
+  sa->oneShot = allRead;
+  sa->maxBytes = ROUNDUP(std::max<int64_t>(ncclParamShotAllReduceMaxBytes(), 4096), 4096);
+  sa->size = NCCL_SHOT_AR_HEADER_SIZE + NCCL_SHOT_AR_SLOTS*2*sa->maxBytes;
+
+  all[rank].ok = 0;
+  if (ncclP2pAllocateShareableBuffer(sa->size, &sa->ipcDesc, (void**)&sa->buff) == ncclSuccess) {
+    all[rank].ok = 1;
+    CUDACHECKGOTO(cudaMemset(sa->buff, 0, NCCL_SHOT_AR_HEADER_SIZE), ret, fail);
+  }
+  all[rank].ipcDesc = sa->ipcDesc;
+  all[rank].ptr = sa->buff;
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, all, sizeof(struct ncclShotArExchange)), ret, fail);
+
+  for (int r=0; r<nRanks; r++) allOk &= all[r].ok != 0;
+  if (!allOk) {
+    INFO(NCCL_INIT, "One-shot/two-shot AllReduce unavailable : staging buffer not supported on all ranks");
+    if (sa->buff) {
+      ncclP2pFreeShareableBuffer(&sa->ipcDesc);
+      ncclCudaFree(sa->buff);
+    }
+    goto exit;
+  }
+  for (int p=0; p<nRanks; p++) {
+    if (p == rank) {
+      sa->peerBuffs[p] = sa->buff;
+    } else {
+      NCCLCHECKGOTO(ncclP2pMapPeerBuffer(comm, p, sa->size, &all[p].ipcDesc, all[p].ptr, (void**)sa->peerBuffs+p, sa->peerImported+p), ret, fail);
+    }
+  }
+  INFO(NCCL_INIT, "%s AllReduce enabled up to %zu bytes", sa->oneShot ? "One-shot and two-shot" : "Two-shot", sa->maxBytes);
+  comm->shotAr = sa;
+  comm->shotArState = 1;
+  sa = NULL;
+
+exit:
+  free(all);
+  free(sa);
+  return ret;
+fail:
+  goto exit;
+}
+
+// Picks one-shot (0), two-shot (1) or the regular algorithms (-1) from the tuning model.
+static ncclResult_t shotArChoose(struct ncclInfo* info, int oneShot, int* twoShot) {
+  struct ncclComm* comm = info->comm;
+  struct ncclInfo model = *info;
+  float regTime = -1, shotTime = -1;
+  model.nBytes = info->count*ncclTypeSize(info->datatype);
+  model.nChannels = 0;
+  *twoShot = -1;
+  if (ncclParamShotAllReduce() == 2) *twoShot = oneShot ? 0 : 1;
+  if (ncclParamShotAllReduce() == 3) *twoShot = 1;
+  if (*twoShot != -1) return ncclSuccess;
+
+  for (int s=oneShot ? 0 : 1; s<2; s++) {
+    float time;
+    NCCLCHECK(ncclTopoGetShotArTime(&model, s, &time));
+    if (time >= 0 && (shotTime < 0 || time < shotTime)) { shotTime = time; *twoShot = s; }
+  }
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    if (a == NCCL_ALGO_COLLNET_DIRECT || a == NCCL_ALGO_COLLNET_CHAIN) continue;
+    if ((a == NCCL_ALGO_NVLS || a == NCCL_ALGO_NVLS_TREE) && !NCCL_NVLS_SUPPORTS(info->datatype, info->op)) continue;
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      float time;
+      NCCLCHECK(ncclTopoGetAlgoTime(&model, a, p, 1, &time));
+      if (time >= 0 && (regTime < 0 || time < regTime)) regTime = time;
+    }
+  }
+  if (regTime >= 0 && regTime <= shotTime) *twoShot = -1;
+  if (*twoShot != -1 && comm->rank == 0) {
+    TRACE(NCCL_TUNING, "%ld Bytes -> %s AllReduce time %f (regular %f)", model.nBytes, *twoShot ? "two-shot" : "one-shot", shotTime, regTime);
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclShotArEligible(struct ncclInfo* info, bool* eligible) {
+  struct ncclComm* comm = info->comm;
+  size_t nBytes = info->count*ncclTypeSize(info->datatype);
+  *eligible = false;
+  // Only arguments and state shared by all ranks, so that they all pick the same path
+  if (comm->shotArState != 1 || info->coll != ncclFuncAllReduce) return ncclSuccess;
+  if (int(info->op) >= int(ncclNumOps) || !ncclShotArTypeSupported(info->datatype)) return ncclSuccess;
+  if (nBytes == 0 || nBytes > comm->shotAr->maxBytes) return ncclSuccess;
+  NCCLCHECK(shotArChoose(info, comm->shotAr->oneShot, &comm->shotAr->twoShot));
+  if (comm->shotAr->twoShot == -1) return ncclSuccess;
+  // The kernel is launched before returning, out of order with the rest of a group. Only
+  // this rank knows whether it is in one, so the others cannot be told to fall back.
+  if (ncclGroupDepth != 1) {
+    WARN("%s : one-shot/two-shot AllReduce (NCCL_SHOT_ALLREDUCE) cannot be called within a group", info->opName);
+    return ncclInvalidUsage;
+  }
+  *eligible = true;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclShotArLaunch(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  struct ncclShotAr* sa = comm->shotAr;
+  struct ncclStrongStream* deviceStream = &comm->sharedRes->deviceStream;
+  struct ncclShotArArgs args;
+  struct ncclCudaGraph graph;
+
+  memset(&args, 0, sizeof(args));
+  for (int p=0; p<comm->nRanks; p++) args.buffs[p] = sa->peerBuffs[p];
+  args.sendbuff = info->sendbuff;
+  args.recvbuff = info->recvbuff;
+  args.count = info->count;
+  args.maxBytes = sa->maxBytes;
+  args.abortFlag = comm->abortFlag;
+  args.rank = comm->rank;
+  args.nRanks = comm->nRanks;
+  args.twoShot = sa->twoShot;
+
+  // Order against kernels of this communicator launched on other streams, which also
+  // keeps launches from running concurrently with each other's sequence number
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, info->stream));
+  size_t nBytes = info->count*ncclTypeSize(info->datatype);
+  NCCLCHECK(ncclGraphUserBuffRecord(comm, info->stream, info->sendbuff, nBytes, info->recvbuff, nBytes));
+  NCCLCHECK(ncclStrongStreamAcquire(graph, deviceStream));
+  NCCLCHECK(ncclStrongStreamWaitStream(graph, info->stream, deviceStream));
+  NCCLCHECK(ncclShotArKernelLaunch(&args, info->datatype, info->op, info->stream));
+  NCCLCHECK(ncclStrongStreamWaitStream(graph, deviceStream, info->stream));
+  NCCLCHECK(ncclStrongStreamRelease(graph, deviceStream));
+  comm->opCount++;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclShotArFree(struct ncclComm* comm) {
+  struct ncclShotAr* sa = comm->shotAr;
+  if (sa == NULL) return ncclSuccess;
+  for (int p=0; p<comm->nRanks; p++) {
+    if (sa->peerImported[p]) NCCLCHECK(ncclP2pUnmapPeerBuffer(sa->peerBuffs[p]));
+  }
+  ncclP2pFreeShareableBuffer(&sa->ipcDesc);
+  NCCLCHECK(ncclCudaFree(sa->buff));
+  free(sa);
+  comm->shotAr = NULL;
+  return ncclSuccess;
+}
@@ -0,0 +1,270 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// Host-side microbenchmarks : communicator init/connect/destroy time, enqueue
+// latency of tiny collectives, work fifo throughput, proxy progress iterations
+// per transport, and topology search time on topology XMLs. Each measurement is
+// printed as one JSON object per line, so runs can be compared by scripts.
+//
+// Usage : nccl_bench [-g nGpus] [-i iters] [-t topo.xml]...
+//
+// GPU benchmarks run on a single process communicator over the local GPUs
+// (ncclCommInitAll). With -g 0, or without GPU, only the topology benchmarks run.
+
+#include "core.h"
+#include "comm.h"
+#include "graph.h"
+#include "topo.h"
+#include "xml.h"
+#include <getopt.h>
+
+#define MAX_TOPO_FILES 16
+
+static void usage(const char* name) {
+  fprintf(stderr, "Usage : %s [-g nGpus] [-i iters] [-t topo.xml]...\n", name);
+}
+
+static double usSince(uint64_t t0) {
+  return (clockNano()-t0)/1e3;
+}
+
+// Same numbering as nccl_topo : GPUs without a rank in the dump are numbered in order.
+static ncclResult_t setXmlRanks(struct ncclXml* xml) {
+  int rank = 0;
+  for (int n=0; n<xml->maxIndex; n++) {
+    struct ncclXmlNode* node = xml->nodes+n;
+    if (strcmp(node->name, "gpu") != 0) continue;
+    int index;
+    NCCLCHECK(xmlGetAttrIndex(node, "rank", &index));
+    if (index == -1) NCCLCHECK(xmlSetAttrInt(node, "rank", rank));
+    rank++;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t benchTopo(const char* topoFile, int iters) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclXml* xml = NULL;
+  struct ncclTopoSystem* system = NULL;
+  struct ncclTopoGraph ringGraph, treeGraph, nvlsGraph;
+  double loadUs = 0, pathsUs = 0, ringUs = 0, treeUs = 0, nvlsUs = 0;
+
+  NCCLCHECKGOTO(ncclCalloc(&xml, 1), ret, exit);
+  for (int i=0; i<iters; i++) {
+    uint64_t t0 = clockNano();
+    memset(xml, 0, sizeof(*xml));
+    NCCLCHECKGOTO(ncclTopoGetXmlFromFile(topoFile, xml, 1), ret, exit);
+    if (xml->maxIndex == 0) {
+      WARN("No topology found in %s", topoFile);
+      ret = ncclInvalidArgument;
+      goto exit;
+    }
+    NCCLCHECKGOTO(setXmlRanks(xml), ret, exit);
+    NCCLCHECKGOTO(ncclTopoGetSystemFromXml(xml, &system), ret, exit);
+    loadUs += usSince(t0);
+
+    t0 = clockNano();
+    NCCLCHECKGOTO(ncclTopoComputePaths(system, NULL), ret, exit);
+    NCCLCHECKGOTO(ncclTopoSearchInit(system), ret, exit);
+    pathsUs += usSince(t0);
+
+    // Same setup as initTransportsRank
+    memset(&ringGraph, 0, sizeof(ringGraph));
+    ringGraph.id = 0;
+    ringGraph.pattern = NCCL_TOPO_PATTERN_RING;
+    ringGraph.minChannels = 1;
+    ringGraph.maxChannels = MAXCHANNELS/2;
+    t0 = clockNano();
+    NCCLCHECKGOTO(ncclTopoCompute(system, &ringGraph), ret, exit);
+    ringUs += usSince(t0);
+
+    memset(&treeGraph, 0, sizeof(treeGraph));
+    treeGraph.id = 1;
+    treeGraph.pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
+    treeGraph.minChannels = treeGraph.maxChannels = ringGraph.nChannels;
+    t0 = clockNano();
+    NCCLCHECKGOTO(ncclTopoCompute(system, &treeGraph), ret, exit);
+    treeUs += usSince(t0);
+
+    memset(&nvlsGraph, 0, sizeof(nvlsGraph));
+    nvlsGraph.id = 3;
+    nvlsGraph.pattern = NCCL_TOPO_PATTERN_NVLS;
+    nvlsGraph.minChannels = 1;
+    nvlsGraph.maxChannels = MAXCHANNELS;
+    t0 = clockNano();
+    NCCLCHECKGOTO(ncclTopoCompute(system, &nvlsGraph), ret, exit);
+    nvlsUs += usSince(t0);
+
+    ncclTopoFree(system);
+    system = NULL;
+  }
+  printf("{\"bench\":\"topo\",\"file\":\"%s\",\"iters\":%d,\"loadUs\":%.1f,\"pathsUs\":%.1f,"
+      "\"ringSearchUs\":%.1f,\"ringChannels\":%d,\"treeSearchUs\":%.1f,\"treeChannels\":%d,\"nvlsSearchUs\":%.1f,\"nvlsChannels\":%d}\n",
+      topoFile, iters, loadUs/iters, pathsUs/iters, ringUs/iters, ringGraph.nChannels,
+      treeUs/iters, treeGraph.nChannels, nvlsUs/iters, nvlsGraph.nChannels);
+
+exit:
+  if (system) ncclTopoFree(system);
+  free(xml);
+  return ret;
+}
+
+struct benchGpus {
+  int nGpus;
+  ncclComm_t* comms;
+  cudaStream_t* streams;
+  float** buffs;
+};
+
+// One tiny AllReduce on every GPU. Avg rather than Sum so that single rank
+// communicators still launch a kernel instead of a plain copy.
+static ncclResult_t launchTiny(struct benchGpus* g) {
+  NCCLCHECK(ncclGroupStart());
+  for (int i=0; i<g->nGpus; i++) {
+    NCCLCHECK(ncclAllReduce(g->buffs[i], g->buffs[i], 1, ncclFloat, ncclAvg, g->comms[i], g->streams[i]));
+  }
+  NCCLCHECK(ncclGroupEnd());
+  return ncclSuccess;
+}
+
+static ncclResult_t syncGpus(struct benchGpus* g) {
+  for (int i=0; i<g->nGpus; i++) {
+    CUDACHECK(cudaSetDevice(i));
+    CUDACHECK(cudaStreamSynchronize(g->streams[i]));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t benchGpu(int nGpus, int iters) {
+  ncclResult_t ret = ncclSuccess;
+  struct benchGpus g = { nGpus, NULL, NULL, NULL };
+  ncclCommStats_t* before = NULL, *after = NULL;
+  static const char* transportNames[NCCL_STATS_NUM_TRANSPORTS] = { "p2p", "shm", "net", "collnet" };
+  double initUs, connectUs, enqueueUs, syncUs, fifoUs, destroyUs;
+  uint64_t t0;
+
+  NCCLCHECKGOTO(ncclCalloc(&g.comms, nGpus), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&g.streams, nGpus), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&g.buffs, nGpus), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&before, 1), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&after, 1), ret, exit);
+  for (int i=0; i<nGpus; i++) {
+    CUDACHECKGOTO(cudaSetDevice(i), ret, exit);
+    CUDACHECKGOTO(cudaStreamCreateWithFlags(g.streams+i, cudaStreamNonBlocking), ret, exit);
+    CUDACHECKGOTO(cudaMalloc(g.buffs+i, sizeof(float)), ret, exit);
+    CUDACHECKGOTO(cudaMemset(g.buffs[i], 0, sizeof(float)), ret, exit);
+  }
+
+  // Init breakdown : communicator creation, then connection setup on the first collective.
+  t0 = clockNano();
+  NCCLCHECKGOTO(ncclCommInitAll(g.comms, nGpus, NULL), ret, exit);
+  initUs = usSince(t0);
+  t0 = clockNano();
+  NCCLCHECKGOTO(launchTiny(&g), ret, exit);
+  NCCLCHECKGOTO(syncGpus(&g), ret, exit);
+  connectUs = usSince(t0);
+  printf("{\"bench\":\"init\",\"nGpus\":%d,\"initUs\":%.1f,\"firstCollUs\":%.1f}\n", nGpus, initUs, connectUs);
+
+  // Enqueue latency : host time per call, without waiting, then including the wait.
+  t0 = clockNano();
+  for (int it=0; it<iters; it++) NCCLCHECKGOTO(launchTiny(&g), ret, exit);
+  enqueueUs = usSince(t0);
+  NCCLCHECKGOTO(syncGpus(&g), ret, exit);
+  t0 = clockNano();
+  for (int it=0; it<iters; it++) {
+    NCCLCHECKGOTO(launchTiny(&g), ret, exit);
+    NCCLCHECKGOTO(syncGpus(&g), ret, exit);
+  }
+  syncUs = usSince(t0);
+  printf("{\"bench\":\"enqueue\",\"nGpus\":%d,\"iters\":%d,\"enqueueUs\":%.2f,\"roundTripUs\":%.2f}\n",
+      nGpus, iters, enqueueUs/iters, syncUs/iters);
+
+  // Work fifo throughput : back to back tiny operations, one wait at the end.
+  // The proxy counters cover the same window.
+  NCCLCHECKGOTO(ncclCommGetStats(g.comms[0], before), ret, exit);
+  t0 = clockNano();
+  for (int it=0; it<iters*10; it++) NCCLCHECKGOTO(launchTiny(&g), ret, exit);
+  NCCLCHECKGOTO(syncGpus(&g), ret, exit);
+  fifoUs = usSince(t0);
+  NCCLCHECKGOTO(ncclCommGetStats(g.comms[0], after), ret, exit);
+  printf("{\"bench\":\"fifo\",\"nGpus\":%d,\"ops\":%d,\"opsPerSec\":%.0f,\"plans\":%llu,\"fifoFullWaits\":%llu,\"fifoOverflows\":%llu}\n",
+      nGpus, iters*10, iters*10/(fifoUs/1e6), after->plans-before->plans,
+      after->workFifoFullWaits-before->workFifoFullWaits, after->workFifoOverflows-before->workFifoOverflows);
+  printf("{\"bench\":\"proxy\",\"nGpus\":%d", nGpus);
+  for (int t=0; t<NCCL_STATS_NUM_TRANSPORTS; t++) {
+    printf(",\"%sProgressPerSec\":%.0f", transportNames[t],
+        (after->proxyProgressCalls[t]-before->proxyProgressCalls[t])/(fifoUs/1e6));
+  }
+  printf("}\n");
+
+  t0 = clockNano();
+  for (int i=0; i<nGpus; i++) {
+    NCCLCHECKGOTO(ncclCommDestroy(g.comms[i]), ret, exit);
+    g.comms[i] = NULL;
+  }
+  destroyUs = usSince(t0);
+  printf("{\"bench\":\"destroy\",\"nGpus\":%d,\"destroyUs\":%.1f}\n", nGpus, destroyUs);
+
+exit:
+  for (int i=0; i<nGpus; i++) {
+    if (g.comms && g.comms[i]) ncclCommDestroy(g.comms[i]);
+    if (g.streams && g.streams[i]) cudaStreamDestroy(g.streams[i]);
+    if (g.buffs && g.buffs[i]) cudaFree(g.buffs[i]);
+  }
+  free(g.comms);
+  free(g.streams);
+  free(g.buffs);
+  free(before);
+  free(after);
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  int nGpus = -1;
+  int iters = 1000;
+  const char* topoFiles[MAX_TOPO_FILES];
+  int nTopoFiles = 0;
+  int c;
+  while ((c = getopt(argc, argv, "g:i:t:h")) != -1) {
+    switch (c) {
+    case 'g':
+      nGpus = atoi(optarg);
+      break;
+    case 'i':
+      iters = atoi(optarg);
+      break;
+    case 't':
+      if (nTopoFiles == MAX_TOPO_FILES) {
+        fprintf(stderr, "%s : at most %d topology files\n", argv[0], MAX_TOPO_FILES);
+        return 1;
+      }
+      topoFiles[nTopoFiles++] = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || iters < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (int f=0; f<nTopoFiles; f++) {
+    // Searches are much slower than calls, a few iterations are enough
+    if (benchTopo(topoFiles[f], std::min(iters, 10)) != ncclSuccess) {
+      fprintf(stderr, "%s : failed to process %s, set NCCL_DEBUG=WARN for details\n", argv[0], topoFiles[f]);
+      return 1;
+    }
+  }
+
+  if (nGpus == -1 && cudaGetDeviceCount(&nGpus) != cudaSuccess) nGpus = 0;
+  if (nGpus > 0 && benchGpu(nGpus, iters) != ncclSuccess) {
+    fprintf(stderr, "%s : GPU benchmarks failed, set NCCL_DEBUG=WARN for details\n", argv[0]);
+    return 1;
+  }
+  return 0;
+}
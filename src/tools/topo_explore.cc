@@ -0,0 +1,209 @@
+/*************************************************************************
+ * Copyright (c) 2023, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// Offline topology explorer : loads a topology XML (e.g. from NCCL_TOPO_DUMP_FILE),
+// runs the graph search and the tuning model on it, and prints the resulting
+// channels and predicted bandwidth/latency per algorithm and protocol. No GPU is
+// needed, so this can be used to look at hardware we don't have.
+//
+// Usage : nccl_topo [-n nNodes] [-d graph.dot] topo.xml
+
+#include "core.h"
+#include "comm.h"
+#include "graph.h"
+#include "topo.h"
+#include "xml.h"
+#include <getopt.h>
+
+static void usage(const char* name) {
+  fprintf(stderr, "Usage : %s [-n nNodes] [-d graph.dot] topo.xml\n", name);
+}
+
+// GPUs in a dumped topology carry the rank they had. Number the others in order.
+static ncclResult_t setXmlRanks(struct ncclXml* xml) {
+  int rank = 0;
+  for (int n=0; n<xml->maxIndex; n++) {
+    struct ncclXmlNode* node = xml->nodes+n;
+    if (strcmp(node->name, "gpu") != 0) continue;
+    int index;
+    NCCLCHECK(xmlGetAttrIndex(node, "rank", &index));
+    if (index == -1) NCCLCHECK(xmlSetAttrInt(node, "rank", rank));
+    rank++;
+  }
+  return ncclSuccess;
+}
+
+static const char* dotColors[] = { "red", "blue", "darkgreen", "orange", "purple", "brown", "magenta", "cyan" };
+#define NDOTCOLORS (sizeof(dotColors)/sizeof(dotColors[0]))
+
+static void dotGraph(FILE* f, struct ncclTopoSystem* system, struct ncclTopoGraph* graph, const char* name) {
+  int ngpus = system->nodes[GPU].count;
+  fprintf(f, "  subgraph cluster_%s {\n    label=\"%s\";\n", name, name);
+  for (int g=0; g<ngpus; g++) fprintf(f, "    %s_gpu%d [label=\"GPU %d\"];\n", name, system->nodes[GPU].nodes[g].gpu.rank, system->nodes[GPU].nodes[g].gpu.rank);
+  for (int n=0; n<system->nodes[NET].count; n++) fprintf(f, "    %s_net%ld [label=\"NET %ld\", shape=box];\n", name, system->nodes[NET].nodes[n].id, system->nodes[NET].nodes[n].id);
+  for (int c=0; c<graph->nChannels; c++) {
+    const char* color = dotColors[c%NDOTCOLORS];
+    int* intra = graph->intra+c*ngpus;
+    int* inter = graph->inter+c*2;
+    for (int i=0; i<ngpus-1; i++) {
+      fprintf(f, "    %s_gpu%d -> %s_gpu%d [color=%s, label=\"%d\"];\n", name, intra[i], name, intra[i+1], color, c);
+    }
+    if (system->nodes[NET].count) {
+      // Rings go back to the NET from the last GPU, split and balanced trees from the second one.
+      int last = graph->pattern == NCCL_TOPO_PATTERN_RING ? intra[ngpus-1] :
+                 graph->pattern == NCCL_TOPO_PATTERN_TREE ? intra[0] : intra[std::min(1, ngpus-1)];
+      fprintf(f, "    %s_net%d -> %s_gpu%d [color=%s, label=\"%d\"];\n", name, inter[0], name, intra[0], color, c);
+      fprintf(f, "    %s_gpu%d -> %s_net%d [color=%s, label=\"%d\"];\n", name, last, name, inter[1], color, c);
+    } else if (graph->pattern == NCCL_TOPO_PATTERN_RING && ngpus > 1) {
+      fprintf(f, "    %s_gpu%d -> %s_gpu%d [color=%s, label=\"%d\"];\n", name, intra[ngpus-1], name, intra[0], color, c);
+    }
+  }
+  fprintf(f, "  }\n");
+}
+
+static ncclResult_t dumpDot(const char* file, struct ncclTopoSystem* system, struct ncclTopoGraph** graphs, const char** names, int ngraphs) {
+  FILE* f = fopen(file, "w");
+  if (f == NULL) {
+    WARN("Could not open %s for writing : %s", file, strerror(errno));
+    return ncclSystemError;
+  }
+  fprintf(f, "digraph nccl {\n");
+  for (int i=0; i<ngraphs; i++) if (graphs[i]->nChannels) dotGraph(f, system, graphs[i], names[i]);
+  fprintf(f, "}\n");
+  fclose(f);
+  return ncclSuccess;
+}
+
+static void printGraph(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, const char* name) {
+  int ngpus = system->nodes[GPU].count;
+  printf("%s : %d channels, bw %.1f/%.1f GB/s, type %s/%s, sameChannels %d\n", name, graph->nChannels,
+      graph->bwIntra, graph->bwInter, topoPathTypeStr[graph->typeIntra], topoPathTypeStr[graph->typeInter], graph->sameChannels);
+  for (int c=0; c<graph->nChannels; c++) {
+    printf("  %2d :", c);
+    if (system->nodes[NET].count) printf(" NET/%d", graph->inter[c*2]);
+    // NVLS channels only have their head GPU
+    int n = graph->pattern == NCCL_TOPO_PATTERN_NVLS ? 1 : ngpus;
+    for (int g=0; g<n; g++) printf(" GPU/%d", graph->intra[c*ngpus+g]);
+    if (system->nodes[NET].count) printf(" NET/%d", graph->inter[c*2+1]);
+    printf("\n");
+  }
+}
+
+static ncclResult_t explore(const char* topoFile, int nNodes, const char* dotFile) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclXml* xml;
+  struct ncclComm* comm = NULL;
+  struct ncclTopoSystem* system = NULL;
+  struct ncclTopoGraph ringGraph, treeGraph, collNetGraph, nvlsGraph;
+  struct ncclTopoGraph* graphs[] = { &treeGraph, &ringGraph, &collNetGraph, &collNetGraph, &nvlsGraph, &nvlsGraph };
+  int ccMin, ccMax;
+
+  NCCLCHECK(ncclCalloc(&xml, 1));
+  NCCLCHECKGOTO(ncclTopoGetXmlFromFile(topoFile, xml, 1), ret, exit);
+  if (xml->maxIndex == 0) {
+    WARN("No topology found in %s", topoFile);
+    ret = ncclInvalidArgument;
+    goto exit;
+  }
+  NCCLCHECKGOTO(setXmlRanks(xml), ret, exit);
+  NCCLCHECKGOTO(ncclTopoGetSystemFromXml(xml, &system), ret, exit);
+  NCCLCHECKGOTO(ncclTopoComputePaths(system, NULL), ret, exit);
+  NCCLCHECKGOTO(ncclTopoSearchInit(system), ret, exit);
+  NCCLCHECKGOTO(ncclTopoPrint(system), ret, exit);
+  NCCLCHECKGOTO(ncclTopoGetCompCap(system, &ccMin, &ccMax), ret, exit);
+
+  memset(&ringGraph, 0, sizeof(ringGraph));
+  memset(&treeGraph, 0, sizeof(treeGraph));
+  memset(&collNetGraph, 0, sizeof(collNetGraph));
+  memset(&nvlsGraph, 0, sizeof(nvlsGraph));
+  // Same setup as initTransportsRank
+  ringGraph.id = 0;
+  ringGraph.pattern = NCCL_TOPO_PATTERN_RING;
+  ringGraph.minChannels = 1;
+  ringGraph.maxChannels = MAXCHANNELS/2;
+  NCCLCHECKGOTO(ncclTopoCompute(system, &ringGraph), ret, exit);
+  treeGraph.id = 1;
+  treeGraph.pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
+  treeGraph.minChannels = treeGraph.maxChannels = ringGraph.nChannels;
+  NCCLCHECKGOTO(ncclTopoCompute(system, &treeGraph), ret, exit);
+  nvlsGraph.id = 3;
+  nvlsGraph.pattern = NCCL_TOPO_PATTERN_NVLS;
+  nvlsGraph.minChannels = 1;
+  nvlsGraph.maxChannels = MAXCHANNELS;
+  NCCLCHECKGOTO(ncclTopoCompute(system, &nvlsGraph), ret, exit);
+
+  printGraph(system, &ringGraph, "Ring");
+  printGraph(system, &treeGraph, "Tree");
+  if (nvlsGraph.nChannels) printGraph(system, &nvlsGraph, "NVLS");
+
+  // Only the fields the tuning model looks at
+  NCCLCHECKGOTO(ncclCalloc(&comm, 1), ret, exit);
+  comm->topo = system;
+  comm->nNodes = nNodes;
+  comm->nRanks = nNodes*system->nodes[GPU].count;
+  comm->nChannels = std::min(treeGraph.nChannels, ringGraph.nChannels);
+  comm->minCompCap = ccMin;
+  comm->maxCompCap = ccMax;
+  comm->nvlsSupport = nvlsGraph.nChannels > 0 ? 1 : 0;
+  comm->collNetSupport = 0;
+  NCCLCHECKGOTO(ncclTopoTuneModel(comm, ccMin, ccMax, graphs), ret, exit);
+
+  printf("\nPredicted latency (us) / bandwidth (GB/s) for %d ranks on %d nodes\n", comm->nRanks, nNodes);
+  printf("%-14s %-14s", "Function", "Algorithm");
+  for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) printf(" %18s", ncclProtoStr[p]);
+  printf("\n");
+  for (int f=0; f<NCCL_NUM_FUNCTIONS; f++) {
+    for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+      int valid = 0;
+      for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) if (comm->bandwidths[f][a][p] > 0) valid = 1;
+      if (!valid) continue;
+      printf("%-14s %-14s", ncclFuncStr[f], ncclAlgoStr[a]);
+      for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) printf(" %8.1f/%9.1f", comm->latencies[f][a][p], comm->bandwidths[f][a][p]);
+      printf("\n");
+    }
+  }
+
+  if (dotFile) {
+    struct ncclTopoGraph* dotGraphs[] = { &ringGraph, &treeGraph };
+    const char* names[] = { "ring", "tree" };
+    NCCLCHECKGOTO(dumpDot(dotFile, system, dotGraphs, names, 2), ret, exit);
+    printf("\nGraph written to %s\n", dotFile);
+  }
+
+exit:
+  free(comm);
+  if (system) ncclTopoFree(system);
+  free(xml);
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  int nNodes = 1;
+  const char* dotFile = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "n:d:h")) != -1) {
+    switch (c) {
+    case 'n':
+      nNodes = atoi(optarg);
+      break;
+    case 'd':
+      dotFile = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc-1 || nNodes < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (explore(argv[optind], nNodes, dotFile) != ncclSuccess) {
+    fprintf(stderr, "%s : failed to process %s, set NCCL_DEBUG=WARN for details\n", argv[0], argv[optind]);
+    return 1;
+  }
+  return 0;
+}
@@ -7,8 +7,10 @@
 #include "comm.h"
 #include "info.h"
 #include "bootstrap.h"
+#include "enqueue.h"
 #define ENABLE_TIMER 0
 #include "timer.h"
+#include "register.h"
 
 struct ncclTransport* ncclTransports[NTRANSPORTS] = {
   &p2pTransport,
@@ -65,6 +67,8 @@ void dumpData(struct ncclConnect* data, int ndata) {
   }
 }
 
+NCCL_PARAM(ConnectPipelineDepth, "CONNECT_PIPELINE_DEPTH", 16);
+
 ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, int connIndex, int* highestTransportType/*=NULL*/) {
   // Stream used during transport setup; need for P2P pre-connect + CUDA Graph
   ncclResult_t ret = ncclSuccess;
@@ -76,7 +80,6 @@ ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph*
   NCCLCHECKGOTO(ncclStrongStreamAcquireUncaptured(&comm->sharedRes->hostStream), ret, fail);
   // First time initialization
   for (int i=1; i<comm->nRanks; i++) {
-    int bootstrapTag = (i<<8) + (graph ? graph->id+1 : 0);
     int recvPeer = (comm->rank - i + comm->nRanks) % comm->nRanks;
     int sendPeer = (comm->rank + i) % comm->nRanks;
     uint64_t recvMask = comm->connectRecv[recvPeer];
@@ -108,18 +111,46 @@ ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph*
       }
     }
     TIME_STOP(1);
+  }
 
+  // Setups may leave their proxy calls in flight, so that the proxy handles them back to back. Gather
+  // the responses, part of the connect information, before exchanging it.
+  NCCLCHECKGOTO(ncclProxyCallDeferredWait(comm), ret, fail);
+
+  // Sends are posted up to NCCL_CONNECT_PIPELINE_DEPTH peers ahead of the receives. A send only waits
+  // for the connection to be queued on the peer, which stores it until it gets to our message, so
+  // the exchanges overlap instead of costing a round trip each.
+  int depth;
+  depth = std::max(1, (int)ncclParamConnectPipelineDepth());
+  int sent;
+  sent = 1;
+  for (int i=1; i<comm->nRanks; i++) {
     TIME_START(2);
+    for (; sent<comm->nRanks && sent<i+depth; sent++) {
+      int bootstrapTag = (sent<<8) + (graph ? graph->id+1 : 0);
+      int recvPeer = (comm->rank - sent + comm->nRanks) % comm->nRanks;
+      int sendPeer = (comm->rank + sent) % comm->nRanks;
+      int recvChannels = __builtin_popcountll(comm->connectRecv[recvPeer]);
+      int sendChannels = __builtin_popcountll(comm->connectSend[sendPeer]);
+      if (sendPeer == recvPeer) {
+        if (recvChannels+sendChannels) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, recvPeer, bootstrapTag, data[sent], sizeof(struct ncclConnect)*(recvChannels+sendChannels)), ret, fail);
+      } else {
+        if (recvChannels) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, recvPeer, bootstrapTag, recvData[sent], sizeof(struct ncclConnect)*recvChannels), ret, fail);
+        if (sendChannels) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, sendPeer, bootstrapTag, sendData[sent], sizeof(struct ncclConnect)*sendChannels), ret, fail);
+      }
+    }
+    int bootstrapTag = (i<<8) + (graph ? graph->id+1 : 0);
+    int recvPeer = (comm->rank - i + comm->nRanks) % comm->nRanks;
+    int sendPeer = (comm->rank + i) % comm->nRanks;
+    int recvChannels = __builtin_popcountll(comm->connectRecv[recvPeer]);
+    int sendChannels = __builtin_popcountll(comm->connectSend[sendPeer]);
     if (sendPeer == recvPeer) {
       if (recvChannels+sendChannels) {
-        NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, recvPeer, bootstrapTag, data[i], sizeof(struct ncclConnect)*(recvChannels+sendChannels)), ret, fail);
         NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, recvPeer, bootstrapTag, data[i], sizeof(struct ncclConnect)*(recvChannels+sendChannels)), ret, fail);
         sendData[i] = data[i];
         recvData[i] = data[i]+sendChannels;
       }
     } else {
-      if (recvChannels) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, recvPeer, bootstrapTag, recvData[i], sizeof(struct ncclConnect)*recvChannels), ret, fail);
-      if (sendChannels) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, sendPeer, bootstrapTag, sendData[i], sizeof(struct ncclConnect)*sendChannels), ret, fail);
       if (sendChannels) NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, sendPeer, bootstrapTag, sendData[i], sizeof(struct ncclConnect)*sendChannels), ret, fail);
       if (recvChannels) NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, recvPeer, bootstrapTag, recvData[i], sizeof(struct ncclConnect)*recvChannels), ret, fail);
     }
@@ -204,6 +235,265 @@ fail:
   goto exit;
 }
 
+// Connect rings, trees and NVLS trees. Called by init, or by the first collective with
+// NCCL_RUNTIME_CONNECT=1.
+ncclResult_t ncclTransportCollConnect(struct ncclComm* comm, struct ncclTopoGraph* ringGraph, struct ncclTopoGraph* treeGraph, struct ncclTopoGraph* nvlsGraph) {
+  if (comm->nRanks > 1) {
+    for (int c=0; c<comm->nChannels; c++) {
+      struct ncclChannel* channel = comm->channels+c;
+      NCCLCHECK(ncclTransportP2pConnect(comm, c, 1, &channel->ring.prev, 1, &channel->ring.next, 0));
+    }
+    NCCLCHECK(ncclTransportP2pSetup(comm, ringGraph, 0));
+    INFO(NCCL_INIT, "Connected all rings");
+
+    for (int c=0; c<comm->nChannels; c++) {
+      struct ncclChannel* channel = comm->channels+c;
+      NCCLCHECK(ncclTransportP2pConnect(comm, c, NCCL_MAX_TREE_ARITY, channel->tree.down, 1, &channel->tree.up, 0));
+      NCCLCHECK(ncclTransportP2pConnect(comm, c, 1, &channel->tree.up, NCCL_MAX_TREE_ARITY, channel->tree.down, 0));
+    }
+    NCCLCHECK(ncclTransportP2pSetup(comm, treeGraph, 0));
+    INFO(NCCL_INIT, "Connected all trees");
+  }
+
+  if (comm->nvlsSupport && comm->localRanks > 1) {
+    for (int c=0; c<comm->nvlsChannels; c++) {
+      struct ncclChannel* channel = comm->channels+c;
+      NCCLCHECK(ncclTransportP2pConnect(comm, c, NCCL_MAX_NVLS_TREE_ARITY, channel->nvls.treeDown, 1, &channel->nvls.treeUp, 0));
+      NCCLCHECK(ncclTransportP2pConnect(comm, c, 1, &channel->nvls.treeUp, NCCL_MAX_NVLS_TREE_ARITY, channel->nvls.treeDown, 0));
+    }
+    NCCLCHECK(ncclTransportP2pSetup(comm, nvlsGraph, 0));
+    INFO(NCCL_INIT, "Connected NVLS tree");
+  }
+  comm->collConnected = true;
+  return ncclSuccess;
+}
+
+// Idle p2p connection reclamation.
+//
+// Connections built for send/recv (connIndex 1) can be torn down once a peer has not been used for
+// NCCL_P2P_IDLE_TIMEOUT seconds, or when the buffers held for p2p exceed NCCL_P2P_MEM_BUDGET bytes
+// (by default what the communicator's memory budget, ncclConfig_t memBudget, leaves for p2p),
+// least recently used peers first. Both ends must agree before anything is freed: a rank sends a
+// request to the peer through the bootstrap, the peer accepts or refuses it the next time it
+// launches work, and each side then frees its own connectors once all work it launched before has
+// completed. The next send/recv with that peer reconnects it like on first use. All ranks need
+// the same settings since requests are only answered by ranks which have reclamation enabled.
+NCCL_PARAM(P2pIdleTimeout, "P2P_IDLE_TIMEOUT", 0);
+NCCL_PARAM(P2pMemBudget, "P2P_MEM_BUDGET", 0);
+
+#define RECLAIM_TAG -4 // -2 is used by bootstrapSplit, -3 by the bootstrap AllGather
+
+enum ncclP2pReclaimMsg { ncclP2pReclaimRequest = 0, ncclP2pReclaimAccept = 1, ncclP2pReclaimRefuse = 2 };
+
+static int p2pPeerConnectors(struct ncclComm* comm, int peer, int* nRecv) {
+  int n = 0;
+  *nRecv = 0;
+  for (int c=0; c<comm->p2pnChannels; c++) {
+    struct ncclChannelPeer* channelPeer = comm->channels[c].peers[peer];
+    if (channelPeer == NULL) continue;
+    if (channelPeer->send[1].connected) n++;
+    if (channelPeer->recv[1].connected) { n++; (*nRecv)++; }
+  }
+  return n;
+}
+
+// We can only drain connections whose proxy runs in our own process, and none of them may be used
+// by a CUDA graph which could be replayed later.
+static bool p2pPeerReclaimable(struct ncclComm* comm, int peer) {
+  if (comm->persistentRefs != 0) return false;
+  int tpRank = comm->topParentRanks[comm->rank];
+  for (int c=0; c<comm->p2pnChannels; c++) {
+    struct ncclChannelPeer* channelPeer = comm->channels[c].peers[peer];
+    if (channelPeer == NULL) continue;
+    struct ncclConnector* conns[2] = { channelPeer->send+1, channelPeer->recv+1 };
+    for (int i=0; i<2; i++) {
+      if (conns[i]->connected && conns[i]->proxyConn.connection && conns[i]->proxyConn.tpRank != tpRank) return false;
+    }
+  }
+  return true;
+}
+
+// Check whether nothing references the connections of that peer anymore: the device consumed all
+// work we launched, and the proxy then went through an idle loop. Blocking waits for it.
+static ncclResult_t p2pDrain(struct ncclComm* comm, int peer, bool block, bool* drained) {
+  struct ncclProxyProgressState* state = &comm->proxyState->progressState;
+  struct ncclP2pPeerState* peerState = comm->p2pPeerState+peer;
+  *drained = false;
+  while (1) {
+    if (*comm->abortFlag) return ncclInternalError;
+    if (ncclWorkFifoIdle(comm)) {
+      if (state->thread == 0) break;
+      // The loop being counted may have checked for posted operations before we looked, so
+      // require a second one.
+      uint64_t loops = __atomic_load_n(&state->idleLoops, __ATOMIC_ACQUIRE);
+      if (peerState->drainLoops == 0) peerState->drainLoops = loops+2;
+      else if (loops >= peerState->drainLoops) break;
+    }
+    if (!block) return ncclSuccess;
+    sched_yield();
+  }
+  peerState->drainLoops = 0;
+  *drained = true;
+  return ncclSuccess;
+}
+
+static ncclResult_t p2pFreePeer(struct ncclComm* comm, int peer) {
+  for (int c=0; c<comm->p2pnChannels; c++) {
+    struct ncclChannelPeer* channelPeer = comm->channels[c].peers[peer];
+    if (channelPeer == NULL) continue;
+    struct ncclConnector* conns[2] = { channelPeer->send+1, channelPeer->recv+1 };
+    for (int i=0; i<2; i++) {
+      struct ncclConnector* conn = conns[i];
+      if (conn->transportComm == NULL) continue;
+      NCCLCHECK(ncclRegConnFree(comm, conn));
+      NCCLCHECK(conn->transportComm->free(conn));
+      if (conn->proxyConn.connection) {
+        NCCLCHECK(ncclProxyCallBlocking(comm, &conn->proxyConn, ncclProxyMsgFree, NULL, 0, NULL, 0));
+      }
+      memset(conn, 0, sizeof(struct ncclConnector));
+    }
+  }
+  INFO(NCCL_INIT|NCCL_P2P, "Reclaimed p2p connections of rank %d with peer %d", comm->rank, peer);
+  return ncclSuccess;
+}
+
+static ncclResult_t p2pReclaimSend(struct ncclComm* comm, int peer, int msg) {
+  return bootstrapSend(comm->bootstrap, peer, RECLAIM_TAG, &msg, sizeof(int));
+}
+
+static bool p2pPeerUsed(struct ncclComm* comm, int peer) {
+  struct ncclTasks::Peer* p = comm->tasks.peers+peer;
+  return !ncclIntruQueueEmpty(&p->sendQueue) || !ncclIntruQueueEmpty(&p->recvQueue);
+}
+
+static ncclResult_t p2pReclaimHandle(struct ncclComm* comm, int peer, int msg) {
+  struct ncclP2pPeerState* state = comm->p2pPeerState+peer;
+  if (msg == ncclP2pReclaimRequest) {
+    if (state->reclaim == ncclP2pReclaimRequested) {
+      // Both sides asked at the same time, each takes the other's request as an accept.
+      state->reclaim = ncclP2pReclaimAgreed;
+    } else if (state->reclaim == ncclP2pReclaimNone && !p2pPeerUsed(comm, peer) && p2pPeerReclaimable(comm, peer)) {
+      NCCLCHECK(p2pReclaimSend(comm, peer, ncclP2pReclaimAccept));
+      state->reclaim = ncclP2pReclaimAgreed;
+    } else {
+      NCCLCHECK(p2pReclaimSend(comm, peer, ncclP2pReclaimRefuse));
+    }
+  } else if (state->reclaim == ncclP2pReclaimRequested) {
+    state->reclaim = msg == ncclP2pReclaimAccept ? ncclP2pReclaimAgreed : ncclP2pReclaimNone;
+    state->lastUse = clockNano(); // Don't retry a refused peer right away
+  } else {
+    WARN("Unexpected p2p reclaim message %d from rank %d", msg, peer);
+    return ncclInternalError;
+  }
+  return ncclSuccess;
+}
+
+// Handle all reclaim messages which arrived so far.
+static ncclResult_t p2pReclaimProgress(struct ncclComm* comm) {
+  int peer, found, msg;
+  while (1) {
+    NCCLCHECK(bootstrapProbe(comm->bootstrap, RECLAIM_TAG, &peer, &found));
+    if (!found) break;
+    NCCLCHECK(bootstrapRecv(comm->bootstrap, peer, RECLAIM_TAG, &msg, sizeof(int)));
+    NCCLCHECK(p2pReclaimHandle(comm, peer, msg));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t p2pPeerFree(struct ncclComm* comm, int peer, bool block, bool* freed) {
+  bool drained;
+  *freed = false;
+  NCCLCHECK(p2pDrain(comm, peer, block, &drained));
+  if (!drained) return ncclSuccess;
+  NCCLCHECK(p2pFreePeer(comm, peer));
+  comm->p2pPeerState[peer].reclaim = ncclP2pReclaimNone;
+  *freed = true;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTransportP2pReclaim(struct ncclComm* comm, bool* needConnect) {
+  uint64_t timeout = ncclParamP2pIdleTimeout()*1000000000ULL;
+  int64_t budget = ncclParamP2pMemBudget();
+  if (budget <= 0) budget = comm->memBudgetP2p;
+  struct ncclTasks* tasks = &comm->tasks;
+  int nRanks = comm->nRanks;
+  uint64_t now = clockNano();
+  *needConnect = false;
+  if (timeout == 0 && budget <= 0) return ncclSuccess;
+
+  if (comm->p2pPeerState == NULL) {
+    NCCLCHECK(ncclCalloc(&comm->p2pPeerState, nRanks));
+    for (int r=0; r<nRanks; r++) comm->p2pPeerState[r].lastUse = now;
+  }
+  struct ncclP2pPeerState* peerState = comm->p2pPeerState;
+
+  // Answer requests from peers and collect their answers to ours. Peers this group uses are
+  // refused, so only requests we sent can end up releasing them.
+  NCCLCHECK(p2pReclaimProgress(comm));
+
+  for (int r=0; r<nRanks; r++) {
+    if (r == comm->rank) continue;
+    struct ncclTasks::Peer* p = tasks->peers+r;
+    bool used = p2pPeerUsed(comm, r);
+    if (used) {
+      peerState[r].lastUse = now;
+      // Connections we are about to use must be either kept or fully released. Keep answering
+      // everyone while waiting so that ranks waiting on each other can not deadlock.
+      while (peerState[r].reclaim == ncclP2pReclaimRequested) {
+        if (*comm->abortFlag) return ncclInternalError;
+        NCCLCHECK(p2pReclaimProgress(comm));
+        if (peerState[r].reclaim == ncclP2pReclaimRequested) sched_yield();
+      }
+    }
+    if (peerState[r].reclaim != ncclP2pReclaimAgreed) continue;
+    bool freed;
+    NCCLCHECK(p2pPeerFree(comm, r, used, &freed));
+    if (freed && used) {
+      // Tasks were enqueued while still connected; mark them again.
+      p->sendSeen = p->recvSeen = false;
+      for (struct ncclTaskP2p* t = ncclIntruQueueHead(&p->sendQueue); t; t = t->next) {
+        bool need;
+        NCCLCHECK(ncclP2pMarkConnect(comm, r, true, t->bytes, &need));
+        *needConnect |= need;
+      }
+      for (struct ncclTaskP2p* t = ncclIntruQueueHead(&p->recvQueue); t; t = t->next) {
+        bool need;
+        NCCLCHECK(ncclP2pMarkConnect(comm, r, false, t->bytes, &need));
+        *needConnect |= need;
+      }
+    }
+  }
+
+  // Request reclamation of idle peers, then of least recently used ones while over budget.
+  int64_t resident = 0;
+  int nRecv;
+  size_t connBytes = 0;
+  for (int proto=0; proto<NCCL_NUM_PROTOCOLS; proto++) connBytes += comm->buffSizes[proto];
+  for (int r=0; r<nRanks; r++) {
+    if (r == comm->rank || p2pPeerConnectors(comm, r, &nRecv) == 0) continue;
+    if (peerState[r].reclaim == ncclP2pReclaimNone && timeout && now-peerState[r].lastUse > timeout &&
+        p2pPeerReclaimable(comm, r)) {
+      NCCLCHECK(p2pReclaimSend(comm, r, ncclP2pReclaimRequest));
+      peerState[r].reclaim = ncclP2pReclaimRequested;
+    }
+    if (peerState[r].reclaim == ncclP2pReclaimNone) resident += nRecv*connBytes;
+  }
+  while (budget > 0 && resident > budget) {
+    int lru = -1;
+    for (int r=0; r<nRanks; r++) {
+      if (r == comm->rank || peerState[r].reclaim != ncclP2pReclaimNone || peerState[r].lastUse == now) continue;
+      if (p2pPeerConnectors(comm, r, &nRecv) == 0 || !p2pPeerReclaimable(comm, r)) continue;
+      if (lru == -1 || peerState[r].lastUse < peerState[lru].lastUse) lru = r;
+    }
+    if (lru == -1) break;
+    NCCLCHECK(p2pReclaimSend(comm, lru, ncclP2pReclaimRequest));
+    peerState[lru].reclaim = ncclP2pReclaimRequested;
+    p2pPeerConnectors(comm, lru, &nRecv);
+    resident -= nRecv*connBytes;
+  }
+  return ncclSuccess;
+}
+
 extern struct ncclTransport collNetTransport;
 
 // All ranks must participate in collNetSetup call
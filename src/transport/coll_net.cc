@@ -13,6 +13,12 @@
 int64_t ncclParamGdrCopySyncEnable();
 int64_t ncclParamGdrCopyFlushEnable();
 
+// With NCCL_COLLNET_PROXY_REDUCE=1, fp32 and bf16 sums which the collective network
+// cannot reduce itself run as an iallgather into host memory, reduced by the proxy
+// thread. CollNet stays usable for them instead of falling back to algorithms which
+// reduce on the GPU at every step.
+NCCL_PARAM(CollNetProxyReduce, "COLLNET_PROXY_REDUCE", 0);
+
 struct collNetRecvConnectInfo {
   int rank;
   int nranks;
@@ -108,6 +114,13 @@ struct sendResources {
   uint64_t step;
   struct reqSlot (*reqFifo)[NCCL_STEPS];
   int collNetRank;
+  // NCCL_COLLNET_PROXY_REDUCE: types reduced by the proxy, and its host buffer holding
+  // the nranks gathered blocks of one group, then the reduced block. One in flight.
+  uint8_t proxyReduce[ncclNumTypes];
+  char* gatherBuff;
+  int gatherSize; // Bytes per block
+  void* gatherMhandle;
+  int gatherBusy;
 };
 
 struct recvResources {
@@ -425,6 +438,7 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
 
   // Get info from recv side
   resources->collNetRank = args->rank;
+  resources->nranks = args->nranks;
   resources->reqFifo = (struct reqSlot (*)[NCCL_STEPS])(info->reqFifo);
 
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++)
@@ -486,6 +500,15 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
                                             &resources->sendMhandles[NCCL_PROTO_SIMPLE]));
   }
 
+  if (ncclParamCollNetProxyReduce() && proxyState->ncclCollNet->iallgather) {
+    const ncclDataType_t types[] = {ncclFloat32, ncclBfloat16};
+    for (int t=0; t<2; t++) {
+      int supported = 0;
+      NCCLCHECK(proxyState->ncclCollNet->reduceSupport(types[t], ncclSum, &supported));
+      resources->proxyReduce[types[t]] = !supported;
+    }
+  }
+
   *((struct connectMap**)respBuff) = &resources->map;
   return ncclSuccess;
 }
@@ -574,6 +597,8 @@ static ncclResult_t sendProxyFree(struct ncclProxyConnection* connection, struct
         NCCLCHECK(proxyState->ncclCollNet->deregMr(resources->collNetComm, resources->sendMhandles[p]));
       }
     }
+    if (resources->gatherMhandle) NCCLCHECK(proxyState->ncclCollNet->deregMr(resources->collNetComm, resources->gatherMhandle));
+    if (resources->gatherBuff) NCCLCHECK(ncclCudaHostFree(resources->gatherBuff));
     struct connectMapMem* mems = resources->map.mems;
     NCCLCHECK(ncclCudaHostFree(mems[NCCL_NET_MAP_HOSTMEM].cpuPtr));
     NCCLCHECK(ncclCudaFree(mems[NCCL_NET_MAP_DEVMEM].cpuPtr));
@@ -611,6 +636,84 @@ static ncclResult_t recvProxyFree(struct ncclProxyConnection* connection, struct
 #define LAST_OF_GROUP(s) \
   (s % COLLNET_GROUP_NSUBS == COLLNET_GROUP_NSUBS-1 || s == args->nsubs-1)
 
+// dst = sum of the nBlocks blocks of count elements at src, in block order so that
+// every rank gets the same bits. bf16 is summed in fp32 and rounded once at the end.
+NCCL_HOST_SIMD static void proxySumF32(float* __restrict__ dst, const float* __restrict__ src, int nBlocks, size_t count) {
+  for (size_t i=0; i<count; i++) dst[i] = src[i];
+  for (int b=1; b<nBlocks; b++) {
+    const float* __restrict__ block = src+b*count;
+    for (size_t i=0; i<count; i++) dst[i] += block[i];
+  }
+}
+
+#define PROXY_SUM_BF16_TILE 256
+NCCL_HOST_SIMD static void proxySumBF16(uint16_t* __restrict__ dst, const uint16_t* __restrict__ src, int nBlocks, size_t count) {
+  float acc[PROXY_SUM_BF16_TILE];
+  for (size_t t=0; t<count; t+=PROXY_SUM_BF16_TILE) {
+    size_t n = std::min<size_t>(PROXY_SUM_BF16_TILE, count-t);
+    for (size_t i=0; i<n; i++) acc[i] = 0.0f;
+    for (int b=0; b<nBlocks; b++) {
+      const uint16_t* __restrict__ block = src+b*count+t;
+      for (size_t i=0; i<n; i++) {
+        uint32_t bits = uint32_t(block[i]) << 16;
+        float f;
+        memcpy(&f, &bits, sizeof(float));
+        acc[i] += f;
+      }
+    }
+    for (size_t i=0; i<n; i++) {
+      uint32_t bits;
+      memcpy(&bits, acc+i, sizeof(float));
+      // Round to nearest even, keeping NaNs quiet
+      bits = acc[i] != acc[i] ? (bits | 0x00400000) : bits + 0x7fff + ((bits >> 16) & 1);
+      dst[t+i] = bits >> 16;
+    }
+  }
+}
+
+static bool proxyReduceOp(struct ncclProxyArgs* args, struct sendResources* resources) {
+  return args->redOp == ncclSum && resources->proxyReduce[args->dtype] &&
+    args->pattern != ncclPatternCollnetAllGather && args->pattern != ncclPatternCollnetReduceScatter;
+}
+
+// Gathers the group's block of every rank into gatherBuff
+static ncclResult_t proxyReduceGather(struct ncclProxyState* proxyState, struct sendResources* resources, struct ncclCollNetSharedRes* collNet,
+    void* sendAddress, void* sendMhandle, int totalSize, void** request) {
+  if (resources->gatherBuff == NULL) {
+    // Groups never hold more than COLLNET_GROUP_NSUBS steps of the shared buffer
+    int64_t blockSize = COLLNET_GROUP_NSUBS*(int64_t)(collNet->buffSize/NCCL_STEPS);
+    int64_t size = (resources->nranks+1)*blockSize;
+    if (size > INT_MAX) {
+      WARN("NET/CollNet : NCCL_COLLNET_PROXY_REDUCE needs %ld bytes of host memory for %d ranks, more than a registration can hold", size, resources->nranks);
+      return ncclInvalidUsage;
+    }
+    NCCLCHECK(ncclCudaHostCalloc(&resources->gatherBuff, size));
+    NCCLCHECK(proxyState->ncclCollNet->regMr(resources->collNetComm, resources->gatherBuff, size, NCCL_PTR_HOST, &resources->gatherMhandle));
+    resources->gatherSize = blockSize;
+    INFO(NCCL_NET, "NET/CollNet : sums reduced by the proxy through %ld bytes of host memory", size);
+  }
+  if (totalSize > resources->gatherSize) {
+    WARN("NET/CollNet : group of %d bytes larger than the proxy reduction block of %d bytes", totalSize, resources->gatherSize);
+    return ncclInternalError;
+  }
+  size_t gathered = (size_t)resources->nranks*totalSize;
+  ncclNetSGE_sochin_v1_t recvPart = { resources->gatherMhandle, resources->gatherBuff, (uint32_t)gathered };
+  NCCLCHECK(proxyState->ncclCollNet->iallgather(resources->collNetComm, sendAddress, 1, &recvPart,
+        totalSize, 0, gathered, sendMhandle, request));
+  return ncclSuccess;
+}
+
+// Reduces the gathered blocks into recvAddress, which is in device memory with GDR
+static ncclResult_t proxyReduceFinish(struct sendResources* resources, struct ncclCollNetSharedRes* collNet, ncclDataType_t dtype, char* recvAddress, int totalSize) {
+  size_t count = totalSize/ncclTypeSize(dtype);
+  bool device = collNet->cudaBuff && recvAddress >= collNet->cudaBuff && recvAddress < collNet->cudaBuff+collNet->size;
+  char* dst = device ? resources->gatherBuff+(size_t)resources->nranks*totalSize : recvAddress;
+  if (dtype == ncclFloat32) proxySumF32((float*)dst, (const float*)resources->gatherBuff, resources->nranks, count);
+  else proxySumBF16((uint16_t*)dst, (const uint16_t*)resources->gatherBuff, resources->nranks, count);
+  if (device) NCCLCHECK(ncclCudaMemcpy(recvAddress, dst, totalSize));
+  return ncclSuccess;
+}
+
 static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct ncclProxyArgs* args) {
   if (args->state == ncclProxyOpReady) {
     for (int s=0; s<args->nsubs; s++) {
@@ -646,73 +749,93 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
         *sendHead = sub->base + sub->posted - NCCL_STEPS;
         if (resources->gdcSync) wc_store_fence(); // Flush out WC write
       }
-      // Enforce sync between operations of the same group.
-      bool groupSync = (((s == 0) && ((sub+args->nsubs-1)->received == sub->received)) || (s && (sub-1)->received > sub->received));
-      if (groupSync && sub->received < sub->posted && sub->received < sub->done + perGroupSteps) {
+      // Each sub receives its chunks independently, within the steps of its group.
+      if (sub->received < sub->posted && sub->received < sub->done + perGroupSteps) {
         int buffSlot = (sub->base+sub->received)%NCCL_STEPS;
-        int sharedBuffSlot = sub->received%NCCL_STEPS;
         volatile int* sizesFifo = resources->recvMem->sizesFifo;
         volatile uint64_t* recvTail = &resources->recvMem->tail;
-        char* localBuff = NCCL_NET_MAP_GET_POINTER(&resources->map, gpu, buffs[p]);
         if (sizesFifo[buffSlot] != -1 && ((*recvTail > (sub->base+sub->received)))) {
-          // We have something to receive, let's check whether data is ready.
-          int ready = 1;
-          if (s == 0) {
-            int offset;
-            NCCLCHECK(sharedBuffersGet(sub->connection->collNet, 0, sharedBuffSlot, 0, &offset));
-            args->sharedBuff[sharedBuffSlot] = localBuff + offset;
-            args->sharedSize[sharedBuffSlot] = args->chunkSize;
-          }
-          if (ready) {
-            sizesFifo[buffSlot] = -1;
-            sub->received += args->sliceSteps;
-            args->idle = 0;
-            //continue;
-          }
+          sizesFifo[buffSlot] = -1;
+          sub->received += args->sliceSteps;
+          args->idle = 0;
         }
       }
-      if (LAST_OF_GROUP(s) && (sub->transmitted < sub->received)) {
+      // Submit a step of the group as soon as all its subs have their chunk. Several steps can
+      // be in flight; they are issued in (step, group) order so that all ranks post the same
+      // sequence of collective operations.
+      while (LAST_OF_GROUP(s)) {
         int group = s / COLLNET_GROUP_NSUBS;
+        struct ncclProxySubArgs* first = args->subs+group*COLLNET_GROUP_NSUBS;
+        uint64_t groupReceived = sub->received;
+        for (struct ncclProxySubArgs* g = first; g < sub; g++) groupReceived = std::min(groupReceived, g->received);
+        if (sub->transmitted >= groupReceived) break;
+        struct ncclProxySubArgs* prev = group > 0 ? first-1 : args->subs+args->nsubs-1;
+        if (prev->transmitted < prev->nsteps &&
+            (group > 0 ? prev->transmitted <= sub->transmitted : prev->transmitted < sub->transmitted)) break;
         int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
         int sharedBuffSlot = sub->transmitted%NCCL_STEPS;
-        if (reqFifo[group][buffSlot].recvBuff != NULL) {
-          int totalSize = (s-group*COLLNET_GROUP_NSUBS+1) * args->sharedSize[sharedBuffSlot];
-          int count = totalSize / ncclTypeSize((ncclDataType_t)args->dtype);
-          reqFifo[group][buffSlot].size = args->sharedSize[sharedBuffSlot];
-          char* sendAddress = (char*)args->sharedBuff[sharedBuffSlot] + group*COLLNET_GROUP_NSUBS*args->sharedSize[sharedBuffSlot];
-          NCCLCHECK(proxyState->ncclCollNet->iallreduce(resources->collNetComm, sendAddress, (void*)(reqFifo[group][buffSlot].recvBuff), count, (ncclDataType_t)args->dtype, (ncclRedOp_t)args->redOp, sendMhandle, recvMhandle, sub->requests+buffSlot));
-          if (sub->requests[buffSlot] == NULL) continue;
-
-          TRACE(NCCL_NET, "sendProxy [%d/%d/%d] Iallreduce posted, size %d req %p", sub->transmitted, group, buffSlot, totalSize, sub->requests[buffSlot]);
-          // Make sure size is reset to zero before we update the head.
-          __sync_synchronize();
-          sub->transmitted += args->sliceSteps;
-          args->idle = 0;
-          continue;
+        if (reqFifo[group][buffSlot].recvBuff == NULL) break;
+        int totalSize = (s-group*COLLNET_GROUP_NSUBS+1) * args->chunkSize;
+        int count = totalSize / ncclTypeSize((ncclDataType_t)args->dtype);
+        int offset;
+        NCCLCHECK(sharedBuffersGet(sub->connection->collNet, 0, sharedBuffSlot, 0, &offset));
+        reqFifo[group][buffSlot].size = args->chunkSize;
+        char* sendAddress = NCCL_NET_MAP_GET_POINTER(&resources->map, gpu, buffs[p]) + offset + group*COLLNET_GROUP_NSUBS*args->chunkSize;
+        void* recvAddress = (void*)(reqFifo[group][buffSlot].recvBuff);
+        if (args->pattern == ncclPatternCollnetAllGather || args->pattern == ncclPatternCollnetReduceScatter) {
+          // Each step is one window of the virtual nranks*totalSize buffer, owned by rank r.
+          int r = (sub->transmitted / args->sliceSteps) % resources->nranks;
+          if (args->pattern == ncclPatternCollnetAllGather) {
+            ncclNetSGE_sochin_v1_t recvPart = { recvMhandle, recvAddress, (uint32_t)totalSize };
+            NCCLCHECK(proxyState->ncclCollNet->iallgather(resources->collNetComm, sendAddress, 1, &recvPart,
+                  totalSize, (size_t)r*totalSize, totalSize, sendMhandle, sub->requests+buffSlot));
+          } else {
+            ncclNetSGE_sochin_v1_t sendPart = { sendMhandle, sendAddress, (uint32_t)totalSize };
+            NCCLCHECK(proxyState->ncclCollNet->ireducescatter(resources->collNetComm, 1, &sendPart,
+                  r == resources->collNetRank ? recvAddress : NULL, totalSize, (size_t)r*totalSize, totalSize,
+                  (ncclDataType_t)args->dtype, (ncclRedOp_t)args->redOp, recvMhandle, sub->requests+buffSlot));
+          }
+        } else if (proxyReduceOp(args, resources)) {
+          if (resources->gatherBusy) break;
+          NCCLCHECK(proxyReduceGather(proxyState, resources, sub->connection->collNet, sendAddress, sendMhandle, totalSize, sub->requests+buffSlot));
+          if (sub->requests[buffSlot]) resources->gatherBusy = 1;
+        } else {
+          NCCLCHECK(proxyState->ncclCollNet->iallreduce(resources->collNetComm, sendAddress, recvAddress, count, (ncclDataType_t)args->dtype, (ncclRedOp_t)args->redOp, sendMhandle, recvMhandle, sub->requests+buffSlot));
         }
+        if (sub->requests[buffSlot] == NULL) break;
+
+        TRACE(NCCL_NET, "sendProxy [%d/%d/%d] Collective posted, size %d req %p", sub->transmitted, group, buffSlot, totalSize, sub->requests[buffSlot]);
+        // Make sure size is reset to zero before we update the head.
+        __sync_synchronize();
+        sub->transmitted += args->sliceSteps;
+        args->idle = 0;
       }
-      // Check whether the network has completed some send operations.
-      if (LAST_OF_GROUP(s) && sub->done < sub->transmitted) {
+      // Retire all the requests which completed, in order.
+      while (LAST_OF_GROUP(s) && sub->done < sub->transmitted) {
         int done, size;
         int group = s / COLLNET_GROUP_NSUBS;
         int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
         NCCLCHECK(proxyState->ncclCollNet->test((void*)(sub->requests[buffSlot]), &done, &size));
-        if (done) {
-          TRACE(NCCL_NET, "sendProxy [%d/%d/%d] request %p done, size %d", sub->done, group, buffSlot, sub->requests[buffSlot], size);
-          // Make sure size is updated before we set recvBuff to NULL (from the view of recv proxy, concerning the flush)
-          // (reordered store after store is possible on POWER, though not on x86)
-          __sync_synchronize();
-          reqFifo[group][buffSlot].recvBuff = NULL; // Notify recvProxy
-          for (int i=group*COLLNET_GROUP_NSUBS; i<=s; i++) args->subs[i].done += args->sliceSteps;
-          args->idle = 0;
-          int allDone = 1;
-          for (int i=0; i<args->nsubs; i++) {
-            if (args->subs[i].done < args->subs[i].nsteps) { allDone = 0; break; }
-          }
-          if (allDone) {
-            args->state = ncclProxyOpNone;
-            TRACE(NCCL_NET, "sendProxy [%d/%d] stopped", sub->done, s);
-          }
+        if (!done) break;
+        TRACE(NCCL_NET, "sendProxy [%d/%d/%d] request %p done, size %d", sub->done, group, buffSlot, sub->requests[buffSlot], size);
+        if (proxyReduceOp(args, resources)) {
+          int totalSize = (s-group*COLLNET_GROUP_NSUBS+1) * args->chunkSize;
+          NCCLCHECK(proxyReduceFinish(resources, sub->connection->collNet, (ncclDataType_t)args->dtype, (char*)reqFifo[group][buffSlot].recvBuff, totalSize));
+          resources->gatherBusy = 0;
+        }
+        // Make sure size is updated before we set recvBuff to NULL (from the view of recv proxy, concerning the flush)
+        // (reordered store after store is possible on POWER, though not on x86)
+        __sync_synchronize();
+        reqFifo[group][buffSlot].recvBuff = NULL; // Notify recvProxy
+        for (int i=group*COLLNET_GROUP_NSUBS; i<=s; i++) args->subs[i].done += args->sliceSteps;
+        args->idle = 0;
+        int allDone = 1;
+        for (int i=0; i<args->nsubs; i++) {
+          if (args->subs[i].done < args->subs[i].nsteps) { allDone = 0; break; }
+        }
+        if (allDone) {
+          args->state = ncclProxyOpNone;
+          TRACE(NCCL_NET, "sendProxy [%d/%d] stopped", sub->done, s);
         }
       }
     }
@@ -13,6 +13,7 @@
 #include "shm.h"
 #include "p2p.h"
 #include "profiler.h"
+#include "stats.h"
 
 static_assert(sizeof(ncclNetHandle_t) <= CONNECT_SIZE, "NET Connect info is too large");
 
@@ -80,6 +81,9 @@ struct connectMap {
   } offsets;
 };
 
+// User buffers registered on a connection, see ncclCommRegister
+#define NCCL_NET_MAX_REGS 64
+
 struct sendResources {
   struct connectMap map;
   void* netSendComm;
@@ -98,9 +102,11 @@ struct sendResources {
   int shared;
   int channelId;
   int connIndex;
+  int stepsShift; // See ncclConnInfo::stepsShift
   char* buffers[NCCL_NUM_PROTOCOLS];
   int buffSizes[NCCL_NUM_PROTOCOLS];
   void* mhandles[NCCL_NUM_PROTOCOLS];
+  void* regMhandles[NCCL_NET_MAX_REGS];
   uint64_t step;
   uint64_t llLastCleaning;
 };
@@ -127,9 +133,12 @@ struct recvResources {
   int shared;
   int channelId;
   int connIndex;
+  int stepsShift; // See ncclConnInfo::stepsShift
   char* buffers[NCCL_NUM_PROTOCOLS];
   int buffSizes[NCCL_NUM_PROTOCOLS];
   void* mhandles[NCCL_NUM_PROTOCOLS];
+  void* regMhandles[NCCL_NET_MAX_REGS];
+  void* recvMemMhandle; // Set when the NIC updates recvMem->tail itself, see irecvSignal
   uint64_t step;
   uint64_t llLastCleaning;
 };
@@ -145,6 +154,10 @@ static ncclResult_t canConnect(int* ret, struct ncclTopoSystem* topo, struct ncc
 }
 
 NCCL_PARAM(NetSharedBuffers, "NET_SHARED_BUFFERS", -2);
+// Hand out shared buffer slots on demand rather than splitting them evenly between peers
+NCCL_PARAM(NetSharedBuffersDynamic, "NET_SHARED_BUFFERS_DYNAMIC", 0);
+// Use irecvSignal when the network plugin provides it
+NCCL_PARAM(NetRecvSignal, "NET_RECV_SIGNAL", 1);
 NCCL_PARAM(NetSharedComms, "NET_SHARED_COMMS", 1);
 
 struct setupReq {
@@ -157,8 +170,14 @@ struct setupReq {
   int needFlush;
   int channelId;
   int connIndex;
+  int stepsShift;
 };
 
+// Steps of a connection for protocol p, the LL protocols always run NCCL_STEPS
+static inline int netSteps(int stepsShift, int p) {
+  return p == NCCL_PROTO_SIMPLE ? NCCL_STEPS << stepsShift : NCCL_STEPS;
+}
+
 /* Determine if we will use this transport for this peer and return connect
  * information for this peer */
 static ncclResult_t sendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* send, int channelId, int connIndex) {
@@ -166,6 +185,8 @@ static ncclResult_t sendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   int localRank, tpProxyRank;
 
   send->conn.shared = req.shared = graph ? 0 : ncclParamNetSharedBuffers() != -2 ? ncclParamNetSharedBuffers() : 1;
+  // Shared buffers are carved in NCCL_STEPS slots
+  send->conn.stepsShift = req.stepsShift = req.shared ? 0 : comm->netStepsShift;
   req.channelId = channelId;
   req.connIndex = connIndex;
 
@@ -180,7 +201,8 @@ static ncclResult_t sendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   req.tpLocalRank = comm->topParentLocalRanks[localRank];
   req.tpRank = comm->topParentRanks[myInfo->rank];
   req.tpRemoteRank = comm->topParentRanks[peerInfo->rank];
-  NCCLCHECK(ncclProxyCallBlocking(comm, &send->proxyConn, ncclProxyMsgSetup, &req, sizeof(req), NULL, 0));
+  // The response comes with the other setups of ncclTransportP2pSetup, see ncclProxyCallDeferredWait
+  NCCLCHECK(ncclProxyCallDeferred(comm, &send->proxyConn, ncclProxyMsgSetup, &req, sizeof(req), NULL, 0));
 
   if (proxyRank == myInfo->rank) {
     INFO(NCCL_INIT|NCCL_NET,"Channel %02d/%d : %d[%d] -> %d[%d] [send] via NET/%s/%d%s%s", channelId, connIndex, myInfo->rank, myInfo->nvmlDev, peerInfo->rank, peerInfo->nvmlDev, comm->ncclNet->name, req.netDev,
@@ -197,6 +219,9 @@ static ncclResult_t sendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
 NCCL_PARAM(GdrCopySyncEnable, "GDRCOPY_SYNC_ENABLE", 1);
 // GDRCOPY support: FLUSH_ENABLE When enabled uses a PCI-E read to flush GDRDMA buffers
 NCCL_PARAM(GdrCopyFlushEnable, "GDRCOPY_FLUSH_ENABLE", 0);
+// Drain all completed receives of a step group before issuing one flush for
+// the last of them, instead of flushing after each receive.
+NCCL_PARAM(NetFlushBatch, "NET_FLUSH_BATCH", 0);
 
 /* Setup recv connector */
 static ncclResult_t recvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* recv, int channelId, int connIndex) {
@@ -204,6 +229,7 @@ static ncclResult_t recvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   int localRank;
 
   recv->conn.shared = req.shared = graph ? 0 : ncclParamNetSharedBuffers() != -2 ? ncclParamNetSharedBuffers() : 1;
+  recv->conn.stepsShift = req.stepsShift = req.shared ? 0 : comm->netStepsShift;
   req.channelId = channelId;
   req.connIndex = connIndex;
 
@@ -223,7 +249,7 @@ static ncclResult_t recvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   req.tpLocalRank = comm->topParentLocalRanks[localRank];
   req.tpRank = comm->topParentRanks[myInfo->rank];
   req.tpRemoteRank = comm->topParentRanks[peerInfo->rank];
-  NCCLCHECK(ncclProxyCallBlocking(comm, &recv->proxyConn, ncclProxyMsgSetup, &req, sizeof(req), connectInfo, sizeof(ncclNetHandle_t)));
+  NCCLCHECK(ncclProxyCallDeferred(comm, &recv->proxyConn, ncclProxyMsgSetup, &req, sizeof(req), connectInfo, sizeof(ncclNetHandle_t)));
   INFO(NCCL_INIT|NCCL_NET,"Channel %02d/%d : %d[%d] -> %d[%d] [receive] via NET/%s/%d%s%s", channelId, connIndex, peerInfo->rank, peerInfo->nvmlDev, myInfo->rank, myInfo->nvmlDev, comm->ncclNet->name, req.netDev,
       req.useGdr ? "/GDRDMA" : "", req.shared ? "/Shared" : "");
   return ncclSuccess;
@@ -330,6 +356,7 @@ static ncclResult_t sendConnect(struct ncclComm* comm, struct ncclConnect* conne
   struct ncclSendMem *sendMem = (struct ncclSendMem*) NCCL_NET_MAP_GET_POINTER(map, gpu, sendMem);
   void* gdcMem = map->mems[NCCL_NET_MAP_GDCMEM].gpuPtr;
   send->conn.head = gdcMem ? (uint64_t*)gdcMem : &sendMem->head;
+  send->conn.regDone = &sendMem->regDone;
 
   struct ncclRecvMem *recvMem = (struct ncclRecvMem*) NCCL_NET_MAP_GET_POINTER(map, gpu, recvMem);
   send->conn.tail = &recvMem->tail;
@@ -415,7 +442,7 @@ static ncclResult_t recvFree(struct ncclConnector* recv) {
   return ncclSuccess;
 }
 
-#define NCCL_SHARED_STEPS 16
+static_assert(NCCL_SHARED_STEPS <= 32, "Shared slots must fit in the slot mask");
 static ncclResult_t sharedBuffersInit(struct ncclProxyState* proxyState, int cuda, int tpLocalRank, int type, int sameProcess,
     int nChannels, char** gpuPtr, char** cpuPtr, int* size, ncclIpcDesc *ipcDesc) {
   if (cuda == 0 && sameProcess == 0) {
@@ -436,6 +463,9 @@ static ncclResult_t sharedBuffersInit(struct ncclProxyState* proxyState, int cud
   if (state->size == 0) {
     state->size = nChannels * NCCL_SHARED_STEPS * proxyState->p2pChunkSize;
   }
+  if (state->slotMask == NULL && ncclParamNetSharedBuffersDynamic()) {
+    NCCLCHECK(ncclCalloc(&state->slotMask, MAXCHANNELS));
+  }
 
   if (size) *size = state->size;
 
@@ -445,9 +475,11 @@ static ncclResult_t sharedBuffersInit(struct ncclProxyState* proxyState, int cud
     } else {
       NCCLCHECK(ncclCudaCalloc(&state->cudaBuff, state->size));
     }
+    ncclProxyStatsMem(proxyState, NCCL_MEM_PROXY_SHARED, state->size, 0);
   }
   if (!cuda && state->hostBuff == NULL) {
     NCCLCHECK(ncclCudaHostCalloc(&state->hostBuff, state->size));
+    ncclProxyStatsMem(proxyState, NCCL_MEM_PROXY_SHARED, 0, state->size);
   }
   if (cpuPtr) *cpuPtr = cuda ? state->cudaBuff : state->hostBuff;
   if (gpuPtr) *gpuPtr = sameProcess ? *cpuPtr : NULL;
@@ -462,6 +494,43 @@ static ncclResult_t sharedBuffersGet(struct ncclProxyState* proxyState, int chan
   return ncclSuccess;
 }
 
+// Dynamic mode: a sub takes a free slot of its channel for each step it posts and
+// gives it back once the step is done, so the pipeline of each peer is as deep as
+// the number of peers currently active and the size of their messages allow.
+// A sub which already holds slots leaves 'reserve' free ones to the subs holding
+// none, so that every peer of the op can always make progress.
+// Returns an offset of -1 when no slot can be taken.
+static ncclResult_t sharedBuffersAlloc(struct ncclProxyState* proxyState, int tpLocalRank, int type, int channel, int reserve, int* offset) {
+  struct ncclProxyPeer* peer = proxyState->progressState.localPeers[tpLocalRank];
+  struct ncclProxySharedP2p* state = type == 0 ? &peer->send : &peer->recv;
+  if (state->slotMask == NULL) NCCLCHECK(ncclInternalError);
+  uint32_t mask = state->slotMask[channel];
+  *offset = -1;
+  if (NCCL_SHARED_STEPS - __builtin_popcount(mask) <= reserve) return ncclSuccess;
+  int slot = __builtin_ctz(~mask);
+  state->slotMask[channel] = mask | (1U << slot);
+  return sharedBuffersGet(proxyState, channel, slot, offset);
+}
+
+static ncclResult_t sharedBuffersRelease(struct ncclProxyState* proxyState, int tpLocalRank, int type, int channel, int offset) {
+  struct ncclProxyPeer* peer = proxyState->progressState.localPeers[tpLocalRank];
+  struct ncclProxySharedP2p* state = type == 0 ? &peer->send : &peer->recv;
+  int slot = offset / proxyState->p2pChunkSize - channel*NCCL_SHARED_STEPS;
+  if (state->slotMask == NULL || slot < 0 || slot >= NCCL_SHARED_STEPS || (state->slotMask[channel] & (1U << slot)) == 0) {
+    WARN("NET: releasing shared buffer slot %d of channel %d which is not in use", slot, channel);
+    return ncclInternalError;
+  }
+  state->slotMask[channel] &= ~(1U << slot);
+  return ncclSuccess;
+}
+
+static ncclResult_t sharedBuffersReleaseAll(struct ncclProxyState* proxyState, int tpLocalRank, int type, int channel, int* offsets, int n) {
+  for (int i=0; i<n; i++) {
+    if (offsets[i] >= 0) NCCLCHECK(sharedBuffersRelease(proxyState, tpLocalRank, type, channel, offsets[i]));
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t sharedBuffersDestroy(struct ncclProxyState* proxyState, int tpLocalRank, int type, struct ncclProxyConnection* connection) {
   if (proxyState->progressState.localPeers == NULL) NCCLCHECK(ncclInternalError);
   struct ncclProxyPeer* peer = proxyState->progressState.localPeers[tpLocalRank];
@@ -474,8 +543,14 @@ static ncclResult_t sharedBuffersDestroy(struct ncclProxyState* proxyState, int
         NCCLCHECK(ncclP2pFreeShareableBuffer(&state->ipcDesc));
       }
       NCCLCHECK(ncclCudaFree(state->cudaBuff));
+      ncclProxyStatsMem(proxyState, NCCL_MEM_PROXY_SHARED, -(int64_t)state->size, 0);
+    }
+    if (state->hostBuff) {
+      NCCLCHECK(ncclCudaHostFree(state->hostBuff));
+      ncclProxyStatsMem(proxyState, NCCL_MEM_PROXY_SHARED, 0, -(int64_t)state->size);
     }
-    if (state->hostBuff) NCCLCHECK(ncclCudaHostFree(state->hostBuff));
+    free(state->slotMask);
+    state->slotMask = NULL;
   }
 
   if (peer->send.refcount || peer->recv.refcount) return ncclSuccess;
@@ -512,6 +587,8 @@ static ncclResult_t sendProxySetup(struct ncclProxyConnection* connection, struc
   resources->useGdr = req->useGdr;
   resources->channelId = req->channelId;
   resources->connIndex = req->connIndex;
+  resources->stepsShift = req->stepsShift;
+  connection->nSteps = NCCL_STEPS << req->stepsShift;
   ncclNetProperties_t props;
   NCCLCHECK(proxyState->ncclNet->getProperties(req->netDev, &props));
   /* DMA-BUF support */
@@ -541,6 +618,8 @@ static ncclResult_t recvProxySetup(struct ncclProxyConnection* connection, struc
   resources->needFlush = req->needFlush;
   resources->channelId = req->channelId;
   resources->connIndex = req->connIndex;
+  resources->stepsShift = req->stepsShift;
+  connection->nSteps = NCCL_STEPS << req->stepsShift;
   ncclNetProperties_t props;
   NCCLCHECK(proxyState->ncclNet->getProperties(req->netDev, &props));
   /* DMA-BUF support */
@@ -604,8 +683,8 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
 
   if (resources->shared == 0) { // Only allocate dedicated buffers for ring/tree, not for p2p
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
-      NCCL_NET_MAP_ADD_POINTER(map, 0, p!= NCCL_PROTO_LL && resources->useGdr, proxyState->buffSizes[p], buffs[p]);
-      resources->buffSizes[p] = proxyState->buffSizes[p];
+      resources->buffSizes[p] = proxyState->buffSizes[p] / NCCL_STEPS * netSteps(resources->stepsShift, p);
+      NCCL_NET_MAP_ADD_POINTER(map, 0, p!= NCCL_PROTO_LL && resources->useGdr, resources->buffSizes[p], buffs[p]);
     }
   } else {
     // Get shared buffers
@@ -645,6 +724,8 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
   } else {
     NCCLCHECK(netCreateShm(map->mems+NCCL_NET_MAP_HOSTMEM));
   }
+  // Shared buffers are accounted by sharedBuffersInit
+  ncclProxyConnectionMem(proxyState, connection, resources->shared ? 0 : map->mems[NCCL_NET_MAP_DEVMEM].size, map->mems[NCCL_NET_MAP_HOSTMEM].size);
   if (ncclGdrCopy && map->sameProcess && ncclParamGdrCopySyncEnable()) {
     uint64_t *cpuPtr, *gpuPtr;
     NCCLCHECK(ncclGdrCudaCalloc(&cpuPtr, &gpuPtr, 1, &resources->gdrDesc));
@@ -661,11 +742,12 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
 
   // Don't give credits yet in shared mode.
   resources->sendMem->head = map->shared ? -NCCL_STEPS : 0;
-  for (int i=0; i<NCCL_STEPS; i++) resources->recvMem->sizesFifo[i] = -1;
+  for (int i=0; i<NCCL_MAX_STEPS; i++) resources->recvMem->sizesFifo[i] = -1;
 
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
     resources->buffers[p] = NCCL_NET_MAP_GET_POINTER(map, cpu, buffs[p]);
-    if (resources->buffers[p]) {
+    // Protocols left without buffers by the memory budget have nothing to register
+    if (resources->buffers[p] && resources->buffSizes[p]) {
 #if CUDA_VERSION >= 11070
       /* DMA-BUF support */
       int type = NCCL_NET_MAP_DEV_MEM(map, buffs[p]) ? NCCL_PTR_CUDA : NCCL_PTR_HOST;
@@ -742,8 +824,8 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
 
   if (resources->shared == 0) { // Only allocate dedicated buffers for ring/tree, not for p2p
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
-      NCCL_NET_MAP_ADD_POINTER(map, 0, resources->useGdr, proxyState->buffSizes[p], buffs[p]);
-      resources->buffSizes[p] = proxyState->buffSizes[p];
+      resources->buffSizes[p] = proxyState->buffSizes[p] / NCCL_STEPS * netSteps(resources->stepsShift, p);
+      NCCL_NET_MAP_ADD_POINTER(map, 0, resources->useGdr, resources->buffSizes[p], buffs[p]);
     }
   } else {
     // Get shared buffers
@@ -777,6 +859,7 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
   }
   NCCLCHECK(ncclCudaHostCalloc(&map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr, map->mems[NCCL_NET_MAP_HOSTMEM].size));
   map->mems[NCCL_NET_MAP_HOSTMEM].gpuPtr = map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr;
+  ncclProxyConnectionMem(proxyState, connection, resources->shared ? 0 : map->mems[NCCL_NET_MAP_DEVMEM].size, map->mems[NCCL_NET_MAP_HOSTMEM].size);
   if (ncclGdrCopy && map->sameProcess) {
     uint64_t *cpuPtr, *gpuPtr;
     NCCLCHECK(ncclGdrCudaCalloc(&cpuPtr, &gpuPtr, 2, &resources->gdrDesc));
@@ -795,7 +878,8 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
   resources->recvMem = (struct ncclRecvMem*) NCCL_NET_MAP_GET_POINTER(map, cpu, recvMem);
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
     resources->buffers[p] = NCCL_NET_MAP_GET_POINTER(map, cpu, buffs[p]);
-    if (resources->buffers[p]) {
+    // Protocols left without buffers by the memory budget have nothing to register
+    if (resources->buffers[p] && resources->buffSizes[p]) {
 #if CUDA_VERSION >= 11070
       /* DMA-BUF support */
       int type = NCCL_NET_MAP_DEV_MEM(map, buffs[p]) ? NCCL_PTR_CUDA : NCCL_PTR_HOST;
@@ -812,6 +896,16 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
     }
   }
 
+  // Let the NIC update the tail counter itself when nothing has to happen between
+  // the data landing and the GPU reading it: no flush, and the tail in host memory.
+  if (proxyState->ncclNet->irecvSignal && ncclParamNetRecvSignal() && resources->gdcSync == NULL &&
+      !(resources->useGdr && resources->needFlush)) {
+    if (proxyState->ncclNet->regMr(resources->netRecvComm, resources->recvMem, sizeof(struct ncclRecvMem), NCCL_PTR_HOST, &resources->recvMemMhandle) != ncclSuccess) {
+      INFO(NCCL_NET, "NET/%s : could not register the tail counter, the proxy will update it", proxyState->ncclNet->name);
+      resources->recvMemMhandle = NULL;
+    }
+  }
+
   //NCCLCHECK(netDumpMap(map));
   if (respSize != sizeof(struct connectMap)) return ncclInternalError;
   memcpy(respBuff, map, sizeof(struct connectMap));
@@ -831,6 +925,9 @@ static ncclResult_t sendProxyFree(struct ncclProxyConnection* connection, struct
         NCCLCHECK(proxyState->ncclNet->deregMr(resources->netSendComm, resources->mhandles[p]));
       }
     }
+    for (int r=0; r<NCCL_NET_MAX_REGS; r++) {
+      if (resources->regMhandles[r]) NCCLCHECK(proxyState->ncclNet->deregMr(resources->netSendComm, resources->regMhandles[r]));
+    }
     struct connectMapMem* mems = resources->map.mems;
     if (resources->map.sameProcess) {
       NCCLCHECK(ncclCudaHostFree(mems[NCCL_NET_MAP_HOSTMEM].cpuPtr));
@@ -876,6 +973,10 @@ static ncclResult_t recvProxyFree(struct ncclProxyConnection* connection, struct
         NCCLCHECK(proxyState->ncclNet->deregMr(resources->netRecvComm, resources->mhandles[p]));
       }
     }
+    for (int r=0; r<NCCL_NET_MAX_REGS; r++) {
+      if (resources->regMhandles[r]) NCCLCHECK(proxyState->ncclNet->deregMr(resources->netRecvComm, resources->regMhandles[r]));
+    }
+    if (resources->recvMemMhandle) NCCLCHECK(proxyState->ncclNet->deregMr(resources->netRecvComm, resources->recvMemMhandle));
     struct connectMapMem* mems = resources->map.mems;
     NCCLCHECK(ncclCudaHostFree(mems[NCCL_NET_MAP_HOSTMEM].cpuPtr));
     NCCLCHECK(ncclCudaFree(mems[NCCL_NET_MAP_DEVMEM].cpuPtr));
@@ -906,6 +1007,149 @@ static ncclResult_t recvProxyFree(struct ncclProxyConnection* connection, struct
 
 static_assert(NCCL_STEPS <= NCCL_NET_MAX_REQUESTS, "Not enough net requests to cover for steps");
 
+static ncclResult_t netRegister(struct ncclProxyState* proxyState, void* netComm, int useGdr, int useDmaBuf, void** regMhandles,
+    void* reqBuff, int reqSize, void* respBuff, int respSize) {
+  if (reqSize != sizeof(struct ncclProxyRegisterReq) || respSize != sizeof(int)) return ncclInternalError;
+  struct ncclProxyRegisterReq* req = (struct ncclProxyRegisterReq*)reqBuff;
+  int* slot = (int*)respBuff;
+  *slot = -1;
+  // The NIC can only access user buffers, which live in GPU memory, through GDR.
+  if (useGdr == 0 || netComm == NULL) return ncclSuccess;
+  int r;
+  for (r=0; r<NCCL_NET_MAX_REGS && regMhandles[r]; r++);
+  if (r == NCCL_NET_MAX_REGS) return ncclSuccess;
+
+  ncclResult_t ret;
+#if CUDA_VERSION >= 11070
+  if (useDmaBuf) {
+    int dmabuf_fd;
+    CUCHECK(cuMemGetHandleForAddressRange((void *)&dmabuf_fd, (CUdeviceptr)req->buff, req->size, CU_MEM_RANGE_HANDLE_TYPE_DMA_BUF_FD, 0));
+    ret = proxyState->ncclNet->regMrDmaBuf(netComm, req->buff, req->size, NCCL_PTR_CUDA, 0ULL, dmabuf_fd, regMhandles+r);
+    (void)close(dmabuf_fd);
+  } else // FALL-THROUGH to nv_peermem GDR path
+#endif
+  {
+    ret = proxyState->ncclNet->regMr(netComm, req->buff, req->size, NCCL_PTR_CUDA, regMhandles+r);
+  }
+  if (ret != ncclSuccess) {
+    // Not fatal, operations on this buffer keep going through the connection buffers
+    INFO(NCCL_NET, "NET/%s : failed to register user buffer %p size %zi", proxyState->ncclNet->name, req->buff, req->size);
+    regMhandles[r] = NULL;
+    return ncclSuccess;
+  }
+  *slot = r;
+  return ncclSuccess;
+}
+
+static ncclResult_t netDeregister(struct ncclProxyState* proxyState, void* netComm, void** regMhandles, void* reqBuff, int reqSize) {
+  if (reqSize != sizeof(int)) return ncclInternalError;
+  int r = *(int*)reqBuff;
+  if (r < 0 || r >= NCCL_NET_MAX_REGS || regMhandles[r] == NULL) return ncclInternalError;
+  NCCLCHECK(proxyState->ncclNet->deregMr(netComm, regMhandles[r]));
+  regMhandles[r] = NULL;
+  return ncclSuccess;
+}
+
+static ncclResult_t sendProxyRegister(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize, void* respBuff, int respSize) {
+  struct sendResources* resources = (struct sendResources*)(connection->transportResources);
+  return netRegister(proxyState, resources->netSendComm, resources->useGdr, resources->useDmaBuf, resources->regMhandles, reqBuff, reqSize, respBuff, respSize);
+}
+
+static ncclResult_t sendProxyDeregister(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize) {
+  struct sendResources* resources = (struct sendResources*)(connection->transportResources);
+  return netDeregister(proxyState, resources->netSendComm, resources->regMhandles, reqBuff, reqSize);
+}
+
+static ncclResult_t recvProxyRegister(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize, void* respBuff, int respSize) {
+  struct recvResources* resources = (struct recvResources*)(connection->transportResources);
+  return netRegister(proxyState, resources->netRecvComm, resources->useGdr, resources->useDmaBuf, resources->regMhandles, reqBuff, reqSize, respBuff, respSize);
+}
+
+static ncclResult_t recvProxyDeregister(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize) {
+  struct recvResources* resources = (struct recvResources*)(connection->transportResources);
+  return netDeregister(proxyState, resources->netRecvComm, resources->regMhandles, reqBuff, reqSize);
+}
+
+// Whether the GPU is done writing the data of a step, which can then be sent.
+// Returns the buffer to send from and its size.
+static int sendStepReady(struct sendResources* resources, struct ncclProxySubArgs* sub, int p, uint64_t transmitted,
+    char* localBuff, int stepSize, int sliceSteps, char** buffOut, int* sizeOut) {
+  int buffSlot = (sub->base+transmitted)%netSteps(resources->stepsShift, p);
+  volatile int* sizesFifo = resources->recvMem->sizesFifo;
+  volatile uint64_t* recvTail = &resources->recvMem->tail;
+  if (sizesFifo[buffSlot] == -1 || ((*recvTail <= (sub->base+transmitted)) && p != NCCL_PROTO_LL)) return 0;
+  // We have something to receive, let's check if it's completely ready.
+  int size = sizesFifo[buffSlot];
+  bool shared = (p == NCCL_PROTO_SIMPLE) && resources->shared;
+  char* buff = shared ? localBuff+resources->recvMem->offsFifo[buffSlot] : localBuff+buffSlot*stepSize;
+  // The GPU only tells us the size, data is sent straight from the user buffer
+  if (sub->reg) buff = (char*)sub->buffer + (transmitted/sliceSteps)*sub->chunkSize;
+  int ready = 1;
+  if (p == NCCL_PROTO_LL128) {
+    ready = resources->useGdr;
+    if (!ready) {
+      // When data is in sysmem, we need to wait until all flags are correct since the GPU only
+      // called threadfence()
+      uint64_t flag = sub->base+transmitted+1;
+      int nFifoLines = DIVUP(sizesFifo[buffSlot], sizeof(uint64_t)*NCCL_LL128_LINEELEMS);
+      volatile uint64_t* lines = (volatile uint64_t*)buff;
+      ready = 1;
+      for (int i=0; i<nFifoLines; i++) {
+        if (lines[i*NCCL_LL128_LINEELEMS+NCCL_LL128_DATAELEMS] != flag) { ready = 0; break; }
+      }
+    }
+  } else if (p == NCCL_PROTO_LL) {
+    uint32_t flag = NCCL_LL_FLAG(sub->base+transmitted+1);
+    int nFifoLines = DIVUP(size, sizeof(union ncclLLFifoLine));
+    union ncclLLFifoLine* lines = (union ncclLLFifoLine*)buff;
+    for (int i=0; i<nFifoLines; i++) {
+      volatile uint32_t *f1 = &lines[i].flag1;
+      volatile uint32_t *f2 = &lines[i].flag2;
+      if (f1[0] != flag || f2[0] != flag) { ready = 0; break; }
+    }
+  }
+  *buffOut = buff;
+  *sizeOut = size;
+  return ready;
+}
+
+// NVTX ranges : one per sub operation, from its start to its last step done, and
+// one around each post of sends or receives to the network.
+struct NvtxParamsProxyOp {
+  int channel;
+  int peer;
+  size_t bytes;
+  int protocol;
+  int nsteps;
+  int send;
+};
+static constexpr nvtxPayloadSchemaEntry_t ProxyOpSchema[] = {
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Channel"},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Peer rank", nullptr, 0, offsetof(NvtxParamsProxyOp, peer)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_SIZE, "Bytes", nullptr, 0, offsetof(NvtxParamsProxyOp, bytes)},
+  {0, NVTX_PAYLOAD_ENTRY_NCCL_PROTO, "Protocol", nullptr, 0, offsetof(NvtxParamsProxyOp, protocol)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Steps", nullptr, 0, offsetof(NvtxParamsProxyOp, nsteps)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Send", nullptr, 0, offsetof(NvtxParamsProxyOp, send)}
+};
+
+static void nvtxProxyOpStart(struct ncclProxyArgs* args, struct ncclProxySubArgs* sub, int send) {
+  NvtxParamsProxyOp payload{sub->channelId, sub->peer, (size_t)sub->nbytes, args->protocol, sub->nsteps, send};
+  NVTX3_RANGE_START_WITH_PARAMS(ProxyOp, ProxyOpSchema, payload, sub->nvtxRange);
+}
+
+struct NvtxParamsNetPost {
+  int channel;
+  int peer;
+  size_t bytes;
+  int steps;
+};
+static constexpr nvtxPayloadSchemaEntry_t NetPostSchema[] = {
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Channel"},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Peer rank", nullptr, 0, offsetof(NvtxParamsNetPost, peer)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_SIZE, "Bytes", nullptr, 0, offsetof(NvtxParamsNetPost, bytes)},
+  {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Steps", nullptr, 0, offsetof(NvtxParamsNetPost, steps)}
+};
+
 static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct ncclProxyArgs* args) {
   if (args->state == ncclProxyOpReady) {
     for (int s=0; s<args->nsubs; s++) {
@@ -914,7 +1158,9 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
       // Round to next multiple of sliceSteps
       sub->base = ROUNDUP(resources->step, args->chunkSteps);
       sub->posted = sub->transmitted = sub->done = 0;
-      for (uint64_t step=0; step<sub->nsteps; step++) ncclProfilingRecord(args, s, step, ncclProxyProfileBegin);
+      sub->mhandle = sub->reg ? resources->regMhandles[sub->reg-1] : NULL;
+      ncclProfilingRecord(args, s, 0, ncclProxyProfileBegin);
+      nvtxProxyOpStart(args, sub, 1);
     }
     args->state = ncclProxyOpProgress;
   }
@@ -922,22 +1168,39 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
   if (args->state == ncclProxyOpProgress) {
     int p = args->protocol;
     int maxDepth = std::min(NCCL_STEPS, NCCL_SHARED_STEPS/args->nsubs);
+    int dynamic = ncclParamNetSharedBuffersDynamic();
+    // Subs waiting for their first shared slot
+    int starving = 0;
+    for (int s=0; dynamic && s<args->nsubs; s++) {
+      struct ncclProxySubArgs* sub = args->subs+s;
+      struct sendResources* resources = (struct sendResources*) (sub->connection->transportResources);
+      if (resources->shared && sub->posted == sub->done && sub->posted < sub->nsteps) starving++;
+    }
     for (int s=0; s<args->nsubs; s++) {
       struct ncclProxySubArgs* sub = args->subs+s;
       if (sub->done == sub->nsteps) continue;
       struct sendResources* resources = (struct sendResources*) (sub->connection->transportResources);
       void* mhandle = resources->mhandles[p];
-      int stepSize = resources->buffSizes[p] / NCCL_STEPS;
+      int nSteps = netSteps(resources->stepsShift, p);
+      int stepSize = resources->buffSizes[p] / nSteps;
       char* localBuff = NCCL_NET_MAP_GET_POINTER(&resources->map, cpu, buffs[p]);
       int buffSize = stepSize*args->sliceSteps;
       if (sub->nbytes < buffSize) buffSize = sub->nbytes;
+      bool dynamicSlots = dynamic && resources->shared;
+      int offset = 0;
       // Post buffers to the GPU
-      if (sub->posted < sub->nsteps && sub->posted < sub->done + maxDepth) {
-        int buffSlot = (sub->base+sub->posted)%NCCL_STEPS;
+      bool post = sub->posted < sub->nsteps && sub->posted < sub->done + (dynamicSlots ? NCCL_STEPS : resources->shared ? maxDepth : nSteps);
+      if (post && dynamicSlots) {
+        NCCLCHECK(sharedBuffersAlloc(proxyState, resources->tpLocalRank, 0, sub->channelId, sub->posted > sub->done ? starving : 0, &offset));
+        post = offset >= 0;
+      }
+      if (post) {
+        int buffSlot = (sub->base+sub->posted)%nSteps;
         if (resources->shared) {
-          int sharedBuffSlot = sub->posted%maxDepth;
-          int offset;
-          NCCLCHECK(sharedBuffersGet(proxyState, sub->channelId, sharedBuffSlot*args->nsubs+s, &offset));
+          if (!dynamicSlots) {
+            int sharedBuffSlot = sub->posted%maxDepth;
+            NCCLCHECK(sharedBuffersGet(proxyState, sub->channelId, sharedBuffSlot*args->nsubs+s, &offset));
+          }
           resources->recvMem->offsFifo[buffSlot] = offset;
           __sync_synchronize();
           volatile uint64_t* sendHead = resources->gdcSync ? resources->gdcSync : &resources->sendMem->head;
@@ -951,76 +1214,86 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
         args->idle = 0;
         continue;
       }
-      // Check whether we received data from the GPU and send it to the network
-      if (sub->transmitted < sub->posted && sub->transmitted < sub->done + NCCL_STEPS) {
-        int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
+      // Check whether we received data from the GPU and send it to the network.
+      // Networks with isendv get all the steps which are ready in one call.
+      int maxBatch = proxyState->ncclNet->isendv ? NCCL_STEPS : 1;
+      void* sendData[NCCL_STEPS];
+      int sendSizes[NCCL_STEPS];
+      int sendTags[NCCL_STEPS];
+      void* sendMhandles[NCCL_STEPS];
+      int nReady = 0;
+      if (!ncclProxyPaceReady(proxyState)) maxBatch = 0;
+      for (uint64_t step = sub->transmitted; nReady < maxBatch && step < sub->posted && step < sub->done + nSteps; step += args->sliceSteps) {
+        if (!sendStepReady(resources, sub, p, step, localBuff, stepSize, args->sliceSteps, (char**)sendData+nReady, sendSizes+nReady)) break;
+        sendTags[nReady] = resources->tpRank;
+        sendMhandles[nReady] = sub->reg ? sub->mhandle : mhandle;
+        nReady++;
+      }
+      if (nReady) {
+        void* requests[NCCL_STEPS];
+        int nPosted;
+        {
+          NvtxParamsNetPost payload{sub->channelId, sub->peer, 0, nReady};
+          for (int i=0; i<nReady; i++) payload.bytes += sendSizes[i];
+          NVTX3_RANGE_WITH_PARAMS(NetSend, NetPostSchema, payload)
+          NCCLCHECK(ncclNetIsendv(proxyState->ncclNet, resources->netSendComm, nReady, sendData, sendSizes, sendTags, sendMhandles, requests, &nPosted));
+        }
         volatile int* sizesFifo = resources->recvMem->sizesFifo;
-        volatile uint64_t* recvTail = &resources->recvMem->tail;
-        if (sizesFifo[buffSlot] != -1 && ((*recvTail > (sub->base+sub->transmitted)) || p == NCCL_PROTO_LL)) {
-          // We have something to receive, let's check if it's completely ready.
-          int size = sizesFifo[buffSlot];
-          bool shared = (p == NCCL_PROTO_SIMPLE) && resources->shared;
-          char* buff = shared ? localBuff+resources->recvMem->offsFifo[buffSlot] : localBuff+buffSlot*stepSize;
-          int ready = 1;
-          if (p == NCCL_PROTO_LL128) {
-            ready = resources->useGdr;
-            if (!ready) {
-              // When data is in sysmem, we need to wait until all flags are correct since the GPU only
-              // called threadfence()
-              uint64_t flag = sub->base+sub->transmitted+1;
-              int nFifoLines = DIVUP(sizesFifo[buffSlot], sizeof(uint64_t)*NCCL_LL128_LINEELEMS);
-              volatile uint64_t* lines = (volatile uint64_t*)buff;
-              ready = 1;
-              for (int i=0; i<nFifoLines; i++) {
-                if (lines[i*NCCL_LL128_LINEELEMS+NCCL_LL128_DATAELEMS] != flag) { ready = 0; break; }
-              }
-            }
-          } else if (p == NCCL_PROTO_LL) {
-            uint32_t flag = NCCL_LL_FLAG(sub->base+sub->transmitted+1);
-            int nFifoLines = DIVUP(size, sizeof(union ncclLLFifoLine));
-            union ncclLLFifoLine* lines = (union ncclLLFifoLine*)buff;
-            for (int i=0; i<nFifoLines; i++) {
-              volatile uint32_t *f1 = &lines[i].flag1;
-              volatile uint32_t *f2 = &lines[i].flag2;
-              if (f1[0] != flag || f2[0] != flag) { ready = 0; break; }
-            }
-          }
-          if (ready) {
-            // Data is ready, try to send.
-            NCCLCHECK(proxyState->ncclNet->isend(resources->netSendComm, buff, size, resources->tpRank, mhandle, sub->requests+buffSlot));
-            if (sub->requests[buffSlot] != NULL) {
-              TRACE(NCCL_NET, "sendProxy [%ld/%d] Isend posted, req %p", sub->transmitted, buffSlot, sub->requests[buffSlot]);
-              sizesFifo[buffSlot] = -1;
-              // Make sure size is reset to zero before we update the head.
-              __sync_synchronize();
-              sub->transmitted += args->sliceSteps;
-              for (uint64_t step=sub->transmitted-args->sliceSteps; step<sub->transmitted; step++) ncclProfilingRecord(args, s, step, ncclProxyProfileSendWait);
-              args->idle = 0;
-              continue;
-            }
-          }
+        for (int i=0; i<nPosted; i++) {
+          int buffSlot = (sub->base+sub->transmitted)%nSteps;
+          sub->requests[buffSlot] = requests[i];
+          TRACE(NCCL_NET, "sendProxy [%ld/%d] Isend posted, req %p", sub->transmitted, buffSlot, sub->requests[buffSlot]);
+          sizesFifo[buffSlot] = -1;
+          sub->stepBytes[buffSlot] = sendSizes[i];
+          sub->stepNs[buffSlot] = clockNano();
+          ncclProxyStatsRecord(proxyState, args, sub, 1, 0, sendSizes[i]);
+          ncclProxyPaceCharge(proxyState, sendSizes[i]);
+          sub->transmitted += args->sliceSteps;
+          for (uint64_t step=sub->transmitted-args->sliceSteps; step<sub->transmitted; step++) ncclProfilingRecord(args, s, step, ncclProxyProfileSendWait);
+        }
+        if (nPosted) {
+          // Make sure size is reset to zero before we update the head.
+          __sync_synchronize();
+          args->idle = 0;
+          continue;
         }
       }
       // Check whether the network has completed some send operations.
+      // Networks with testBatch test all the outstanding ones in one call.
       if (sub->done < sub->transmitted) {
-        int done;
-        int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
-        NCCLCHECK(proxyState->ncclNet->test(sub->requests[buffSlot], &done, NULL));
-        if (done) {
+        int nPending = proxyState->ncclNet->testBatch ? (sub->transmitted-sub->done)/args->sliceSteps : 1;
+        void* requests[NCCL_MAX_STEPS];
+        for (int i=0; i<nPending; i++) requests[i] = sub->requests[(sub->base+sub->done+i*args->sliceSteps)%nSteps];
+        int nDone;
+        NCCLCHECK(ncclNetTestBatch(proxyState->ncclNet, nPending, requests, &nDone, NULL));
+        for (int i=0; i<nDone; i++) {
+          int buffSlot = (sub->base+sub->done)%nSteps;
           TRACE(NCCL_NET, "sendProxy [%ld/%d] request %p done", sub->done, buffSlot, sub->requests[buffSlot]);
+          if (dynamicSlots) NCCLCHECK(sharedBuffersRelease(proxyState, resources->tpLocalRank, 0, sub->channelId, resources->recvMem->offsFifo[buffSlot]));
+          ncclProxyStatsRecord(proxyState, args, sub, 1, 1, sub->stepBytes[buffSlot]);
+          ncclProxyStatsNetDev(proxyState, sub, resources->netDev, sub->stepBytes[buffSlot], sub->stepNs[buffSlot]);
           sub->done += args->sliceSteps;
           for (uint64_t step=sub->done-args->sliceSteps; step<sub->done; step++) ncclProfilingRecord(args, s, step, ncclProxyProfileEnd);
-
+        }
+        if (nDone) {
           if (resources->shared == 0) {
             volatile uint64_t* sendHead = resources->gdcSync ? resources->gdcSync : &resources->sendMem->head;
             *sendHead = sub->base + sub->done;
             if (resources->gdcSync) wc_store_fence(); // Flush out WC write
           }
+          if (sub->reg) {
+            // The GPU waits for this before handing the user buffer back
+            volatile uint64_t* regDone = &resources->sendMem->regDone;
+            *regDone = sub->base + sub->done;
+          }
           args->idle = 0;
           if (sub->done == sub->nsteps) {
             resources->step = sub->base + sub->nsteps;
             args->done++;
+            NVTX3_RANGE_END(sub->nvtxRange);
           }
+        } else {
+          ncclProxyStatsTestPending(proxyState);
         }
       }
     }
@@ -1031,6 +1304,16 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
   return ncclSuccess;
 }
 
+// Whether the receives of a group are posted with irecvSignal, in which case the
+// NIC writes the tail counters and the proxy must not.
+static bool recvGroupSignal(struct ncclProxySubArgs* subGroup) {
+  for (int i=0; i<subGroup->groupSize; i++) {
+    struct recvResources* resources = (struct recvResources*) (subGroup[i].connection->transportResources);
+    if (resources->recvMemMhandle == NULL) return false;
+  }
+  return true;
+}
+
 static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct ncclProxyArgs* args) {
   if (args->state == ncclProxyOpReady) {
     // Initialize subs and group them by same recvComm.
@@ -1063,8 +1346,10 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
       // Round to next multiple of sliceSteps
       sub->base = ROUNDUP(resources->step, args->chunkSteps);
       sub->posted = sub->received = sub->transmitted = sub->done = 0;
+      sub->mhandle = sub->reg ? resources->regMhandles[sub->reg-1] : NULL;
       for (int i=0; i<groupSize; i++) sub[-i].groupSize = groupSize;
-      for (uint64_t step=0; step<sub->nsteps; step++) ncclProfilingRecord(args, s, step, ncclProxyProfileBegin);
+      ncclProfilingRecord(args, s, 0, ncclProxyProfileBegin);
+      nvtxProxyOpStart(args, sub, 0);
     }
     args->state = ncclProxyOpProgress;
   }
@@ -1072,110 +1357,201 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
   if (args->state == ncclProxyOpProgress) {
     int p = args->protocol;
     int maxDepth = std::min(NCCL_STEPS, NCCL_SHARED_STEPS/args->nsubs);
+    int dynamic = ncclParamNetSharedBuffersDynamic() && p == NCCL_PROTO_SIMPLE;
+    // Subs waiting for their first shared slot
+    int starving = 0;
+    for (int s=0; dynamic && s<args->nsubs; s++) {
+      struct ncclProxySubArgs* sub = args->subs+s;
+      struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
+      if (resources->shared && sub->reg == 0 && sub->posted == sub->done && sub->posted < sub->nsteps) starving++;
+    }
     for (int s=0; s<args->nsubs; s+=args->subs[s].groupSize) {
       struct ncclProxySubArgs* subGroup = args->subs+s;
+      struct recvResources* groupResources = (struct recvResources*) (subGroup->connection->transportResources);
+      bool signal = recvGroupSignal(subGroup);
+      // Networks with irecvv get the receives of several steps in one call
+      int maxBatch = (proxyState->ncclNet->irecvv && !signal) ? NCCL_STEPS : 1;
+      int nRecvs = 0;
+      int subCounts[NCCL_STEPS];
       int subCount = 0;
-      void* ptrs[NCCL_PROXY_MAX_SUBS];
-      int sizes[NCCL_PROXY_MAX_SUBS];
-      int tags[NCCL_PROXY_MAX_SUBS];
-      void* mhandles[NCCL_PROXY_MAX_SUBS];
-
-      for (int i=0; i<subGroup->groupSize; i++) {
-        struct ncclProxySubArgs* sub = subGroup + i;
-        if (sub->posted < sub->nsteps) {
-          if (sub->posted >= sub->done + maxDepth) { subCount = 0; break; }
-          struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
-          int stepSize = resources->buffSizes[p] / NCCL_STEPS;
-          char* localBuff = NCCL_NET_MAP_GET_POINTER(&resources->map, cpu, buffs[p]);
-          int buffSlot = (sub->base+sub->posted)%NCCL_STEPS;
-          if (p == NCCL_PROTO_SIMPLE && resources->shared) {
-            int sharedBuffSlot = sub->posted%maxDepth;
-            int offset;
-            NCCLCHECK(sharedBuffersGet(proxyState, sub->channelId, sharedBuffSlot*args->nsubs+s+i, &offset));
-            volatile int* offsFifo = (volatile int*)resources->recvMem->offsFifo;
-            offsFifo[buffSlot] = offset;
-            ptrs[subCount] = localBuff+offset;
-          } else {
-            ptrs[subCount] = localBuff+buffSlot*stepSize;
+      void* ptrs[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+      int sizes[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+      int tags[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+      void* mhandles[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+      uint64_t* signals[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+      uint64_t signalValues[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+      void* signalMhandles[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+      // Dynamic slots taken for each receive, -1 if none
+      int slotOffsets[NCCL_STEPS*NCCL_PROXY_MAX_SUBS];
+
+      for (; nRecvs < maxBatch; nRecvs++) {
+        int first = subCount;
+        for (int i=0; i<subGroup->groupSize; i++) {
+          struct ncclProxySubArgs* sub = subGroup + i;
+          uint64_t posted = sub->posted + nRecvs*args->sliceSteps;
+          if (posted < sub->nsteps) {
+            struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
+            bool dynamicSlots = dynamic && resources->shared && sub->reg == 0;
+            slotOffsets[subCount] = -1;
+            if (dynamicSlots && posted < sub->done + NCCL_STEPS) {
+              NCCLCHECK(sharedBuffersAlloc(proxyState, resources->tpLocalRank, 1, sub->channelId, posted > sub->done ? starving : 0, slotOffsets+subCount));
+            }
+            int nSteps = netSteps(resources->stepsShift, p);
+            if (dynamicSlots ? slotOffsets[subCount] < 0 : posted >= sub->done + (resources->shared ? maxDepth : nSteps)) {
+              // Give back the slots taken for the other receives of this step
+              NCCLCHECK(sharedBuffersReleaseAll(proxyState, groupResources->tpLocalRank, 1, subGroup->channelId, slotOffsets+first, subCount-first));
+              subCount = first;
+              break;
+            }
+            int stepSize = resources->buffSizes[p] / nSteps;
+            char* localBuff = NCCL_NET_MAP_GET_POINTER(&resources->map, cpu, buffs[p]);
+            int buffSlot = (sub->base+posted)%nSteps;
+            if (sub->reg) {
+              // Receive straight into the user buffer, nbytes is its total size
+              ssize_t offset = (posted/args->sliceSteps)*sub->chunkSize;
+              ptrs[subCount] = (char*)sub->buffer+offset;
+              sizes[subCount] = std::min((ssize_t)sub->chunkSize, std::max(sub->nbytes-offset, (ssize_t)0));
+              mhandles[subCount] = sub->mhandle;
+            } else {
+              if (p == NCCL_PROTO_SIMPLE && resources->shared) {
+                int sharedBuffSlot = posted%maxDepth;
+                int offset = slotOffsets[subCount];
+                if (!dynamicSlots) NCCLCHECK(sharedBuffersGet(proxyState, sub->channelId, sharedBuffSlot*args->nsubs+s+i, &offset));
+                volatile int* offsFifo = (volatile int*)resources->recvMem->offsFifo;
+                offsFifo[buffSlot] = offset;
+                ptrs[subCount] = localBuff+offset;
+              } else {
+                ptrs[subCount] = localBuff+buffSlot*stepSize;
+              }
+              sizes[subCount] = stepSize*args->sliceSteps;
+              if (sub->nbytes < sizes[subCount]) sizes[subCount] = sub->nbytes;
+              mhandles[subCount] = resources->mhandles[p];
+            }
+            sub->stepBytes[posted%sub->nSteps] = sizes[subCount];
+            tags[subCount] = resources->tpRemoteRank;
+            signals[subCount] = &resources->recvMem->tail;
+            signalValues[subCount] = sub->base + posted + args->sliceSteps;
+            signalMhandles[subCount] = resources->recvMemMhandle;
+            subCount++;
           }
-          sizes[subCount] = stepSize*args->sliceSteps;
-          if (sub->nbytes < sizes[subCount]) sizes[subCount] = sub->nbytes;
-          tags[subCount] = resources->tpRemoteRank;
-          mhandles[subCount] = resources->mhandles[p];
-          subCount++;
         }
+        if (subCount == first) break;
+        subCounts[nRecvs] = subCount-first;
       }
-      if (subCount) {
+      if (nRecvs) {
         uint64_t step = subGroup->posted;
         struct recvResources* resources = (struct recvResources*) (subGroup->connection->transportResources);
-        void** requestPtr = subGroup->requests+(step%NCCL_STEPS);
-        NCCLCHECK(proxyState->ncclNet->irecv(resources->netRecvComm, subCount, ptrs, sizes, tags, mhandles, requestPtr));
-        if (*requestPtr) {
+        int nPosted = 0;
+        NvtxParamsNetPost payload{subGroup->channelId, subGroup->peer, 0, nRecvs};
+        for (int i=0; i<subCount; i++) payload.bytes += sizes[i];
+        NVTX3_RANGE_WITH_PARAMS(NetRecv, NetPostSchema, payload)
+        if (maxBatch > 1) {
+          void* requests[NCCL_STEPS];
+          NCCLCHECK(proxyState->ncclNet->irecvv(resources->netRecvComm, nRecvs, subCounts, ptrs, sizes, tags, mhandles, requests, &nPosted));
+          for (int r=0; r<nPosted; r++) subGroup->requests[(step+r*args->sliceSteps)%subGroup->nSteps] = requests[r];
+        } else {
+          void** requestPtr = subGroup->requests+(step%subGroup->nSteps);
+          if (signal) {
+            NCCLCHECK(proxyState->ncclNet->irecvSignal(resources->netRecvComm, subCount, ptrs, sizes, tags, mhandles, signals, signalValues, signalMhandles, requestPtr));
+          } else {
+            NCCLCHECK(proxyState->ncclNet->irecv(resources->netRecvComm, subCount, ptrs, sizes, tags, mhandles, requestPtr));
+          }
+          if (*requestPtr) nPosted = 1;
+        }
+        if (dynamic && nPosted < nRecvs) {
+          // The network could not take all receives, free the slots of the others
+          int postedCount = 0;
+          for (int r=0; r<nPosted; r++) postedCount += subCounts[r];
+          NCCLCHECK(sharedBuffersReleaseAll(proxyState, resources->tpLocalRank, 1, subGroup->channelId, slotOffsets+postedCount, subCount-postedCount));
+        }
+        for (int r=0; r<nPosted; r++) {
           for (int i=0; i<subGroup->groupSize; i++) {
             struct ncclProxySubArgs* sub = subGroup+i;
+            if (sub->posted < sub->nsteps) ncclProxyStatsRecord(proxyState, args, sub, 0, 0, sub->stepBytes[sub->posted%sub->nSteps]);
             sub->posted += args->sliceSteps;
             for (uint64_t step=sub->posted-args->sliceSteps; step<sub->posted; step++) ncclProfilingRecord(args, s+i, step, ncclProxyProfileRecvWait);
           }
-          args->idle = 0;
         }
+        if (nPosted) args->idle = 0;
       }
     }
     if (args->idle == 0) return ncclSuccess;
 
+    int flushBatch = ncclParamNetFlushBatch();
     for (int s=0; s<args->nsubs; s+=args->subs[s].groupSize) {
       struct ncclProxySubArgs* subGroup = args->subs+s;
-      if (subGroup->posted > subGroup->received) {
+      int flushPending = 0;
+      uint64_t flushStep = 0;
+      int flushSizes[NCCL_PROXY_MAX_SUBS];
+      while (subGroup->posted > subGroup->received) {
         uint64_t step = subGroup->received;
         int done;
-        void* ptrs[NCCL_PROXY_MAX_SUBS];
         int sizes[NCCL_PROXY_MAX_SUBS];
-        void* mhandles[NCCL_PROXY_MAX_SUBS];
         for (int i=0; i<NCCL_PROXY_MAX_SUBS; i++) sizes[i] = 0;
-        NCCLCHECK(proxyState->ncclNet->test(subGroup->requests[step%NCCL_STEPS], &done, sizes));
-        if (done) {
-          int needFlush = 0;
-          int totalSize = 0;
-          for (int i=0; i<NCCL_PROXY_MAX_SUBS; i++) totalSize += sizes[i];
-          for (int i=0; i<subGroup->groupSize; i++) {
-            struct ncclProxySubArgs* sub = subGroup + i;
-            sub->received += args->sliceSteps;
-            for (uint64_t step=sub->received-args->sliceSteps; step<sub->received; step++) ncclProfilingRecord(args, s+i, step, ncclProxyProfileRecvFlushWait);
-            if (step < sub->nsteps) {
-              struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
-              if (resources->useGdr) needFlush |= resources->needFlush;
-            }
+        NCCLCHECK(proxyState->ncclNet->test(subGroup->requests[step%subGroup->nSteps], &done, sizes));
+        if (!done) {
+          if (flushPending == 0) ncclProxyStatsTestPending(proxyState);
+          break;
+        }
+        int needFlush = 0;
+        int totalSize = 0;
+        int recvIndex = 0;
+        for (int i=0; i<NCCL_PROXY_MAX_SUBS; i++) totalSize += sizes[i];
+        for (int i=0; i<subGroup->groupSize; i++) {
+          struct ncclProxySubArgs* sub = subGroup + i;
+          sub->received += args->sliceSteps;
+          for (uint64_t step=sub->received-args->sliceSteps; step<sub->received; step++) ncclProfilingRecord(args, s+i, step, ncclProxyProfileRecvFlushWait);
+          if (step < sub->nsteps) {
+            struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
+            if (resources->useGdr) needFlush |= resources->needFlush;
+            ncclProxyStatsRecord(proxyState, args, sub, 0, 1, sizes[recvIndex++]);
           }
-          subGroup->requests[step%NCCL_STEPS] = NULL;
-          if (totalSize > 0 && p == NCCL_PROTO_SIMPLE && needFlush) {
-            // GDRCOPY support
-            struct recvResources* resources = (struct recvResources*) (subGroup->connection->transportResources);
-            if (resources->gdcFlush) {
+        }
+        subGroup->requests[step%subGroup->nSteps] = NULL;
+        if (totalSize > 0 && p == NCCL_PROTO_SIMPLE && needFlush) {
+          flushPending = 1;
+          flushStep = step;
+          memcpy(flushSizes, sizes, sizeof(sizes));
+        }
+        args->idle = 0;
+        // With NCCL_NET_FLUSH_BATCH, keep draining receives which have already
+        // completed so that a single flush covers all of them.
+        if (flushBatch == 0) break;
+      }
+      if (flushPending) {
+        // GDRCOPY support
+        struct recvResources* resources = (struct recvResources*) (subGroup->connection->transportResources);
+        if (resources->gdcFlush) {
 #if defined (__x86_64__)
-              // Force a PCI-E read from GPU memory
-              asm volatile ("mov (%0), %%eax" :: "l"(resources->gdcFlush) : "%eax");
+          // Force a PCI-E read from GPU memory
+          asm volatile ("mov (%0), %%eax" :: "l"(resources->gdcFlush) : "%eax");
 #else
-              WARN("NET: GDR Flush only supported on x86_64");
-              return ncclInternalError;
+          WARN("NET: GDR Flush only supported on x86_64");
+          return ncclInternalError;
 #endif
-            } else {
-              int subCount = 0;
-              for (int i=0; i<subGroup->groupSize; i++) {
-                struct ncclProxySubArgs* sub = subGroup + i;
-                if (step < sub->nsteps) {
-                  struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
-                  int stepSize = resources->buffSizes[p] / NCCL_STEPS;
-                  char* localBuff = NCCL_NET_MAP_GET_POINTER(&resources->map, cpu, buffs[p]);
-                  int buffSlot = (sub->base+sub->posted)%NCCL_STEPS;
-                  ptrs[subCount] = resources->shared ? localBuff+resources->recvMem->offsFifo[buffSlot] : localBuff+buffSlot*stepSize;
-                  mhandles[subCount] = resources->mhandles[p];
-                  subCount++;
-                }
+        } else {
+          void* ptrs[NCCL_PROXY_MAX_SUBS];
+          void* mhandles[NCCL_PROXY_MAX_SUBS];
+          int subCount = 0;
+          for (int i=0; i<subGroup->groupSize; i++) {
+            struct ncclProxySubArgs* sub = subGroup + i;
+            if (flushStep < sub->nsteps) {
+              struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
+              int nSteps = netSteps(resources->stepsShift, p);
+              int stepSize = resources->buffSizes[p] / nSteps;
+              char* localBuff = NCCL_NET_MAP_GET_POINTER(&resources->map, cpu, buffs[p]);
+              int buffSlot = (sub->base+flushStep)%nSteps;
+              if (sub->reg) {
+                ptrs[subCount] = (char*)sub->buffer + (flushStep/args->sliceSteps)*sub->chunkSize;
+                mhandles[subCount] = sub->mhandle;
+              } else {
+                ptrs[subCount] = resources->shared ? localBuff+resources->recvMem->offsFifo[buffSlot] : localBuff+buffSlot*stepSize;
+                mhandles[subCount] = resources->mhandles[p];
               }
-              struct recvResources* resources = (struct recvResources*) (subGroup->connection->transportResources);
-              NCCLCHECK(proxyState->ncclNet->iflush(resources->netRecvComm, subCount, ptrs, sizes, mhandles, subGroup->requests+(step%NCCL_STEPS)));
+              subCount++;
             }
           }
-          args->idle = 0;
+          NCCLCHECK(proxyState->ncclNet->iflush(resources->netRecvComm, subCount, ptrs, flushSizes, mhandles, subGroup->requests+(flushStep%subGroup->nSteps)));
         }
       }
     }
@@ -1186,14 +1562,27 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
       if (subGroup->received > subGroup->transmitted) {
         uint64_t step = subGroup->transmitted;
         int done = 1;
-        void* request = subGroup->requests[step%NCCL_STEPS];
-        if (request) NCCLCHECK(proxyState->ncclNet->test(request, &done, NULL));
+        uint64_t reqStep = step;
+        void* request = subGroup->requests[step%subGroup->nSteps];
+        // A batched flush posted on a later step also covers this one
+        if (flushBatch) {
+          while (request == NULL && reqStep+args->sliceSteps < subGroup->received) {
+            reqStep += args->sliceSteps;
+            request = subGroup->requests[reqStep%subGroup->nSteps];
+          }
+        }
+        if (request) {
+          NCCLCHECK(proxyState->ncclNet->test(request, &done, NULL));
+          if (done) subGroup->requests[reqStep%subGroup->nSteps] = NULL;
+        }
         if (done) {
+          bool signaled = recvGroupSignal(subGroup);
           for (int i=0; i<subGroup->groupSize; i++) {
             struct ncclProxySubArgs* sub = subGroup + i;
             sub->transmitted += args->sliceSteps;
             for (uint64_t step=sub->transmitted-args->sliceSteps; step<sub->transmitted; step++) ncclProfilingRecord(args, s+i, step, ncclProxyProfileRecvGPUWait);
-            if (step < sub->nsteps) {
+            // The NIC already wrote the tail, writing it here could make it go backwards
+            if (step < sub->nsteps && !signaled) {
               __sync_synchronize();
               struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
               volatile uint64_t* recvTail = resources->gdcSync ? resources->gdcSync : &resources->recvMem->tail;
@@ -1219,6 +1608,9 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
           while (done > sub->base + sub->done &&
               // LL and LL128 can acknowledge 0-bytes send before they even happen. Don't go past what we transmitted.
               sub->transmitted > sub->done) {
+            if (dynamic && resources->shared && sub->reg == 0) {
+              NCCLCHECK(sharedBuffersRelease(proxyState, resources->tpLocalRank, 1, sub->channelId, resources->recvMem->offsFifo[(sub->base+sub->done)%NCCL_STEPS]));
+            }
             sub->done += args->sliceSteps;
             for (uint64_t step=sub->done-args->sliceSteps; step<sub->done; step++) ncclProfilingRecord(args, s+i, step, ncclProxyProfileEnd);
             args->idle = 0;
@@ -1226,6 +1618,7 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
               struct recvResources* resources = (struct recvResources*) (sub->connection->transportResources);
               resources->step = sub->base + sub->nsteps;
               args->done++;
+              NVTX3_RANGE_END(sub->nvtxRange);
               break;
             }
           }
@@ -1242,6 +1635,6 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
 struct ncclTransport netTransport = {
   "NET",
   canConnect,
-  { sendSetup, sendConnect, sendFree, proxySharedInit, sendProxySetup, sendProxyConnect, sendProxyFree, sendProxyProgress },
-  { recvSetup, recvConnect, recvFree, proxySharedInit, recvProxySetup, recvProxyConnect, recvProxyFree, recvProxyProgress }
+  { sendSetup, sendConnect, sendFree, proxySharedInit, sendProxySetup, sendProxyConnect, sendProxyFree, sendProxyProgress, sendProxyRegister, sendProxyDeregister },
+  { recvSetup, recvConnect, recvFree, proxySharedInit, recvProxySetup, recvProxyConnect, recvProxyFree, recvProxyProgress, recvProxyRegister, recvProxyDeregister }
 };
@@ -24,6 +24,7 @@
 #include "timer.h"
 
 #include "ibvwrap.h"
+#include "mlx5dvwrap.h"
 
 #define MAXNAMESIZE 64
 static char ncclIbIfName[MAX_IF_NAME_SIZE+1];
@@ -34,11 +35,55 @@ struct ncclIbMr {
   int pages;
   int refs;
   ibv_mr *mr;
+  uint64_t lastUse;
+  int odp;
 };
 
+// Registrations of a device, shared by all its connections. Unreferenced
+// entries may stay registered (up to NCCL_IB_MR_CACHE_IDLE) until evicted.
 struct ncclIbMrCache {
   struct ncclIbMr *slots;
   int capacity, population;
+  int idle;
+  uint64_t clock;
+};
+
+// Maps a QP number to the connection owning it, so that completions polled
+// from a per-device shared CQ (or consuming an SRQ entry) can be dispatched.
+struct ncclIbQpMapEntry {
+  uint32_t qpn; // 0 when empty, QP 0 is never an RC QP
+  int devIndex;
+  struct ncclIbVerbs* verbs;
+  struct ncclIbQp* qp; // NULL for the GPU flush QP
+  struct ncclIbDci* dci; // Set for DCIs, which are shared by all connections of the device
+};
+
+// A DC initiator, shared by all DC connections of a device. Signaled send
+// completions come back in the order they were posted, so we keep the
+// connection and wr_id of each of them here. lock serializes posting.
+struct ncclIbDciPost {
+  struct ncclIbVerbs* verbs; // NULL once the connection is closed, or when signaled by the DCI itself
+  int devIndex;
+  uint64_t wrId;
+  uint64_t posted; // WRs posted up to and including this one
+};
+
+struct ncclIbDci {
+  struct ibv_qp* qp;
+  struct ibv_qp_ex* qpx;
+  struct mlx5dv_qp_ex* mqpx;
+  pthread_mutex_t lock;
+  int maxWrs;
+  struct ncclIbDciPost* posts; // maxWrs entries
+  uint64_t head, tail;
+  uint64_t posted, done; // WRs, to keep the send queue from overflowing
+  uint64_t reserved; // WRs about to be posted, see ncclIbDcReserve
+  int unsignaled; // WRs posted since the last signaled one, see ncclIbDcPostSend
+};
+
+struct ncclIbQpMap {
+  struct ncclIbQpMapEntry* entries;
+  int capacity, population;
 };
 
 static int ncclNIbDevs = -1;
@@ -58,6 +103,29 @@ struct alignas(64) ncclIbDev {
   int maxQp;
   struct ncclIbMrCache mrCache;
   int ar; // ADAPTIVE_ROUTING
+  int maxCqe;
+  int maxSrqWr;
+  // Shared CQ and SRQ, refcounted under lock. cqLock protects polling the
+  // shared CQ and the QP map.
+  int sharedCqRefs;
+  struct ibv_cq* sharedCq;
+  int srqRefs;
+  struct ibv_srq* srq;
+  pthread_mutex_t cqLock;
+  struct ncclIbQpMap qpMap;
+  // Dynamically Connected transport (NCCL_IB_DC). The DCIs are created with the
+  // first DC connection, refcounted under lock.
+  int dc; // Requested and supported
+  int maxQpWr;
+  int maxSendSge; // SGEs per send WR, more than one to coalesce the writes of a multi-send
+  int dciRefs;
+  int ndcis;
+  int dciNext;
+  struct ncclIbDci* dcis;
+  // On-Demand Paging (NCCL_IB_ODP): -1 until the first ODP registration tells
+  // whether it works. odpMr is the implicit ODP registration, freed with the PD.
+  int odp;
+  struct ibv_mr* odpMr;
 };
 
 #define MAX_IB_PORT 15
@@ -69,6 +137,19 @@ struct userIbDev {
 #define MAX_IB_DEVS 16
 struct ncclIbDev ncclIbDevs[MAX_IB_DEVS];
 struct userIbDev userIbDevs[MAX_IB_DEVS];
+
+// A merged device groups several ncclIbDevs behind a single net device, so
+// that one connection can stripe its traffic across all of them.
+#define NCCL_IB_MAX_DEVS_PER_NIC 4
+#define MAX_MERGED_DEV_NAME ((MAXNAMESIZE*NCCL_IB_MAX_DEVS_PER_NIC)+NCCL_IB_MAX_DEVS_PER_NIC)
+struct ncclIbMergedDev {
+  int ndevs;
+  int devs[NCCL_IB_MAX_DEVS_PER_NIC]; // Indices into ncclIbDevs
+  int speed;
+  char devName[MAX_MERGED_DEV_NAME]; // Up to NCCL_IB_MAX_DEVS_PER_NIC * name size, and a character for each '+'
+};
+static int ncclNMergedIbDevs = -1;
+struct ncclIbMergedDev ncclIbMergedDevs[MAX_IB_DEVS];
 pthread_mutex_t ncclIbLock = PTHREAD_MUTEX_INITIALIZER;
 static int ncclIbRelaxedOrderingEnabled = 0;
 
@@ -82,6 +163,37 @@ NCCL_PARAM(IbTc, "IB_TC", 0);
 NCCL_PARAM(IbArThreshold, "IB_AR_THRESHOLD", 8192);
 NCCL_PARAM(IbPciRelaxedOrdering, "IB_PCI_RELAXED_ORDERING", 2);
 NCCL_PARAM(IbAdaptiveRouting, "IB_ADAPTIVE_ROUTING", -2);
+NCCL_PARAM(IbDc, "IB_DC", 0);
+NCCL_PARAM(IbDcDcis, "IB_DC_DCIS", 4);
+NCCL_PARAM(IbCoalesceSends, "IB_COALESCE_SENDS", 1);
+
+// Per-QP traffic classes and service levels, given as comma-separated lists in
+// NCCL_IB_TC_LIST and NCCL_IB_SL_LIST. QP q of a connection uses entry q modulo
+// the list length; without a list, all QPs use NCCL_IB_TC / NCCL_IB_SL.
+#define NCCL_IB_MAX_CLASSES 16
+static int ncclIbTcList[NCCL_IB_MAX_CLASSES];
+static int ncclIbNTc = 0;
+static int ncclIbSlList[NCCL_IB_MAX_CLASSES];
+static int ncclIbNSl = 0;
+
+static int ncclIbParseClassList(const char* env, int maxValue, int* list) {
+  const char* str = getenv(env);
+  if (str == NULL) return 0;
+  int n = 0;
+  const char* ptr = str;
+  while (*ptr) {
+    char* end;
+    long value = strtol(ptr, &end, 0);
+    if (end == ptr || value < 0 || value > maxValue || n == NCCL_IB_MAX_CLASSES || (*end != ',' && *end != '\0')) {
+      WARN("NET/IB : Ignoring invalid %s=%s (up to %d values between 0 and %d)", env, str, NCCL_IB_MAX_CLASSES, maxValue);
+      return 0;
+    }
+    list[n++] = value;
+    ptr = *end == ',' ? end+1 : end;
+  }
+  INFO(NCCL_NET|NCCL_ENV, "%s set to %s", env, str);
+  return n;
+}
 
 pthread_t ncclIbAsyncThread;
 static void* ncclIbAsyncThreadMain(void* args) {
@@ -122,6 +234,52 @@ static ncclResult_t ncclIbGetPciPath(char* devName, char** path, int* realPort)
   return ncclSuccess;
 }
 
+NCCL_PARAM(IbMergeNics, "IB_MERGE_NICS", 0);
+
+// Two devices can be merged when they share a PCI switch, i.e. when their PCI
+// paths only differ in the last two components (switch downstream port and
+// device). Ports of the same NIC have the same path and always qualify.
+static int ncclIbSamePciSwitch(const char* path0, const char* path1) {
+  if (path0 == NULL || path1 == NULL) return 0;
+  const char* end0 = path0+strlen(path0);
+  const char* end1 = path1+strlen(path1);
+  for (int c=0; c<2; c++) {
+    while (end0 > path0 && *(end0-1) != '/') end0--;
+    while (end1 > path1 && *(end1-1) != '/') end1--;
+    if (end0 > path0) end0--;
+    if (end1 > path1) end1--;
+  }
+  return (end0-path0 == end1-path1) && end0 > path0 && strncmp(path0, path1, end0-path0) == 0;
+}
+
+// Build the list of net devices exposed to NCCL. Without NCCL_IB_MERGE_NICS,
+// each ncclIbDev is its own net device. With NCCL_IB_MERGE_NICS=N (N>1), up to
+// N devices sharing a PCI switch and a link layer are merged into one virtual
+// device whose connections stripe data across all of them.
+static void ncclIbMergeDevs() {
+  int maxMerge = std::min((int)ncclParamIbMergeNics(), NCCL_IB_MAX_DEVS_PER_NIC);
+  int merged[MAX_IB_DEVS] = { 0 };
+  ncclNMergedIbDevs = 0;
+  for (int d=0; d<ncclNIbDevs; d++) {
+    if (merged[d]) continue;
+    struct ncclIbMergedDev* mDev = ncclIbMergedDevs+ncclNMergedIbDevs++;
+    mDev->ndevs = 0;
+    mDev->speed = 0;
+    mDev->devName[0] = '\0';
+    for (int d2=d; d2<ncclNIbDevs && mDev->ndevs < std::max(maxMerge, 1); d2++) {
+      if (merged[d2]) continue;
+      if (d2 != d && (ncclIbDevs[d2].link != ncclIbDevs[d].link ||
+                      !ncclIbSamePciSwitch(ncclIbDevs[d2].pciPath, ncclIbDevs[d].pciPath))) continue;
+      merged[d2] = 1;
+      mDev->devs[mDev->ndevs++] = d2;
+      mDev->speed += ncclIbDevs[d2].speed;
+      snprintf(mDev->devName+strlen(mDev->devName), MAX_MERGED_DEV_NAME-strlen(mDev->devName), "%s%s",
+          mDev->ndevs > 1 ? "+" : "", ncclIbDevs[d2].devName);
+    }
+    if (mDev->ndevs > 1) INFO(NCCL_INIT|NCCL_NET, "NET/IB : Merged %s into net device %d (speed %d)", mDev->devName, ncclNMergedIbDevs-1, mDev->speed);
+  }
+}
+
 static int ibvWidths[] = { 1, 4, 8, 12, 2 };
 static int ibvSpeeds[] = {
   2500,  /* SDR */
@@ -156,6 +314,8 @@ static int ncclIbRelaxedOrderingCapable(void) {
   return r == ncclInternalError ? 0 : 1;
 }
 
+static ncclResult_t ncclIbQpPoolInit();
+
 ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
   if (ncclParamIbDisable()) return ncclInternalError;
   static int shownIbHcaEnv = 0;
@@ -166,6 +326,7 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
     wrap_ibv_fork_init();
     if (ncclNIbDevs == -1) {
       ncclNIbDevs = 0;
+      ncclNMergedIbDevs = 0;
       if (ncclFindInterfaces(ncclIbIfName, &ncclIbIfAddr, MAX_IF_NAME_SIZE, 1) != 1) {
         WARN("NET/IB : No IP interface found.");
         return ncclInternalError;
@@ -201,6 +362,12 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
           if (ncclSuccess != wrap_ibv_close_device(context)) { return ncclInternalError; }
           continue;
         }
+        // DC needs the mlx5 direct verbs
+        int dc = 0;
+        if (ncclParamIbDc()) {
+          dc = wrap_mlx5dv_symbols() == ncclSuccess && wrap_mlx5dv_is_supported(devices[d]);
+          if (!dc) INFO(NCCL_INIT|NCCL_NET, "NET/IB : NCCL_IB_DC set but %s does not support DC, using RC", devices[d]->name);
+        }
         for (int port = 1; port <= devAttr.phys_port_cnt; port++) {
           struct ibv_port_attr portAttr;
           if (ncclSuccess != wrap_ibv_query_port(context, port, &portAttr)) {
@@ -232,6 +399,25 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
           ncclIbDevs[ncclNIbDevs].mrCache.capacity = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.population = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.slots = NULL;
+          ncclIbDevs[ncclNIbDevs].mrCache.idle = 0;
+          ncclIbDevs[ncclNIbDevs].mrCache.clock = 0;
+          ncclIbDevs[ncclNIbDevs].maxCqe = devAttr.max_cqe;
+          ncclIbDevs[ncclNIbDevs].maxSrqWr = devAttr.max_srq_wr;
+          ncclIbDevs[ncclNIbDevs].sharedCqRefs = 0;
+          ncclIbDevs[ncclNIbDevs].sharedCq = NULL;
+          ncclIbDevs[ncclNIbDevs].srqRefs = 0;
+          ncclIbDevs[ncclNIbDevs].srq = NULL;
+          pthread_mutex_init(&ncclIbDevs[ncclNIbDevs].cqLock, NULL);
+          memset(&ncclIbDevs[ncclNIbDevs].qpMap, 0, sizeof(struct ncclIbQpMap));
+          ncclIbDevs[ncclNIbDevs].dc = dc;
+          ncclIbDevs[ncclNIbDevs].maxQpWr = devAttr.max_qp_wr;
+          ncclIbDevs[ncclNIbDevs].maxSendSge = ncclParamIbCoalesceSends() ? std::max(1, devAttr.max_sge) : 1;
+          ncclIbDevs[ncclNIbDevs].dciRefs = 0;
+          ncclIbDevs[ncclNIbDevs].ndcis = 0;
+          ncclIbDevs[ncclNIbDevs].dciNext = 0;
+          ncclIbDevs[ncclNIbDevs].dcis = NULL;
+          ncclIbDevs[ncclNIbDevs].odp = -1;
+          ncclIbDevs[ncclNIbDevs].odpMr = NULL;
 
           // Enable ADAPTIVE_ROUTING by default on IB networks
           // But allow it to be overloaded by an env parameter
@@ -247,6 +433,9 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
         if (nPorts == 0 && ncclSuccess != wrap_ibv_close_device(context)) { return ncclInternalError; }
       }
       if (nIbDevs && (ncclSuccess != wrap_ibv_free_device_list(devices))) { return ncclInternalError; };
+      ncclIbMergeDevs();
+      ncclIbNTc = ncclIbParseClassList("NCCL_IB_TC_LIST", 255, ncclIbTcList);
+      ncclIbNSl = ncclIbParseClassList("NCCL_IB_SL_LIST", 15, ncclIbSlList);
     }
     if (ncclNIbDevs == 0) {
       INFO(NCCL_INIT|NCCL_NET, "NET/IB : No device found.");
@@ -261,8 +450,11 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
       }
       line[1023] = '\0';
       char addrline[SOCKET_NAME_MAXLEN+1];
-      INFO(NCCL_INIT|NCCL_NET, "NET/IB : Using%s %s; OOB %s:%s", line, ncclIbRelaxedOrderingEnabled ? "[RO]" : "",
-           ncclIbIfName, ncclSocketToString(&ncclIbIfAddr, addrline));
+      int dc = 1;
+      for (int d=0; d<ncclNIbDevs; d++) dc &= ncclIbDevs[d].dc;
+      INFO(NCCL_INIT|NCCL_NET, "NET/IB : Using%s %s%s; OOB %s:%s", line, ncclIbRelaxedOrderingEnabled ? "[RO]" : "",
+           dc ? "[DC]" : "", ncclIbIfName, ncclSocketToString(&ncclIbIfAddr, addrline));
+      if (ncclIbQpPoolInit() != ncclSuccess) { pthread_mutex_unlock(&ncclIbLock); return ncclInternalError; }
     }
     pthread_mutex_unlock(&ncclIbLock);
   }
@@ -270,7 +462,7 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
 }
 
 ncclResult_t ncclIbDevices(int* ndev) {
-  *ndev = ncclNIbDevs;
+  *ndev = ncclNMergedIbDevs;
   return ncclSuccess;
 }
 
@@ -318,20 +510,25 @@ failure:
 #define NCCL_NET_IB_MAX_RECVS 8
 
 ncclResult_t ncclIbGetProperties(int dev, ncclNetProperties_t* props) {
-  props->name = ncclIbDevs[dev].devName;
-  props->pciPath = ncclIbDevs[dev].pciPath;
-  props->guid = ncclIbDevs[dev].guid;
+  // A merged device is described by its first device, except for its speed
+  // which is the aggregate of all of them.
+  struct ncclIbMergedDev* mDev = ncclIbMergedDevs+dev;
+  int ibDev = mDev->devs[0];
+  props->name = mDev->devName;
+  props->pciPath = ncclIbDevs[ibDev].pciPath;
+  props->guid = ncclIbDevs[ibDev].guid;
   props->ptrSupport = NCCL_PTR_HOST;
-  if (ncclIbGdrSupport(dev) == ncclSuccess) {
+  if (ncclIbGdrSupport(ibDev) == ncclSuccess) {
     props->ptrSupport |= NCCL_PTR_CUDA; // GDR support via nv_peermem
   }
-  if (ncclIbDmaBufSupport(dev) == ncclSuccess) {
+  if (ncclIbDmaBufSupport(ibDev) == ncclSuccess) {
     props->ptrSupport |= NCCL_PTR_DMABUF; // GDR support via DMA-BUF
   }
-  props->speed = ncclIbDevs[dev].speed;
+  props->speed = mDev->speed;
   props->latency = 0; // Not set
-  props->port = ncclIbDevs[dev].port + ncclIbDevs[dev].realPort;
-  props->maxComms = ncclIbDevs[dev].maxQp;
+  props->port = ncclIbDevs[ibDev].port + ncclIbDevs[ibDev].realPort;
+  props->maxComms = ncclIbDevs[ibDev].maxQp;
+  for (int i=1; i<mDev->ndevs; i++) props->maxComms = std::min(props->maxComms, ncclIbDevs[mDev->devs[i]].maxQp);
   props->maxRecvs = NCCL_NET_IB_MAX_RECVS;
   return ncclSuccess;
 }
@@ -342,16 +539,25 @@ static_assert(MAX_REQUESTS <= 256, "request id are encoded in wr_id and we need
 
 #define NCCL_IB_MAX_QPS 128
 
-struct ncclIbQpInfo {
+// Per-device part of the connection information
+struct ncclIbDevInfo {
   uint32_t lid;
   uint8_t ib_port;
   uint8_t link_layer;
-  uint32_t qpn[NCCL_IB_MAX_QPS];
 
   // For RoCE
   uint64_t spn;
   uint64_t iid;
   enum ibv_mtu mtu;
+};
+
+struct ncclIbQpInfo {
+  int ndevs;
+  int nqps;
+  int dc; // qpn are DCT numbers, to be reached through DCIs
+  struct ncclIbDevInfo devs[NCCL_IB_MAX_DEVS_PER_NIC];
+  // QP q is created on device q%ndevs
+  uint32_t qpn[NCCL_IB_MAX_QPS];
 
   // FIFO RDMA info
   uint32_t fifoRkey;
@@ -367,6 +573,7 @@ enum ncclIbCommState {
   ncclIbCommStateConnecting = 6,
   ncclIbCommStateConnected = 7,
   ncclIbCommStatePendingReady = 8,
+  ncclIbCommStateTransition = 9,
 };
 
 struct ncclIbCommStage {
@@ -376,6 +583,22 @@ struct ncclIbCommStage {
   void* comm;
 };
 
+// RTR/RTS transitions of the QPs of a connection, run by the setup thread
+struct ncclIbQpTransition {
+  struct ibv_qp* qp;
+  uint32_t qpn;
+  struct ncclIbDevInfo info;
+  int qpIndex;
+};
+
+struct ncclIbSetupJob {
+  struct ncclIbSetupJob* next;
+  int ntrans;
+  struct ncclIbQpTransition trans[NCCL_IB_MAX_QPS];
+  int done; // Set by the setup thread once result is valid
+  ncclResult_t result;
+};
+
 struct ncclIbHandle {
   union ncclSocketAddress connectAddr; // Filled by the target
   uint64_t magic; // random number to help debugging
@@ -398,15 +621,16 @@ const char* reqTypeStr[] = { "Unused", "Send", "Recv", "Flush" };
 struct ncclIbRequest {
   struct ncclIbVerbs* verbs;
   int type;
-  int events;
+  // Completions still expected on each device of the connection
+  int events[NCCL_IB_MAX_DEVS_PER_NIC];
   struct ncclSocket* sock;
-  struct ncclIbGidInfo* gidInfo;
+  struct ncclIbGidInfo* gidInfo; // One per device
   int nreqs;
   union {
     struct {
       int size;
       void* data;
-      uint32_t lkey;
+      uint32_t lkeys[NCCL_IB_MAX_DEVS_PER_NIC];
       int offset;
     } send;
     struct {
@@ -415,24 +639,61 @@ struct ncclIbRequest {
   };
 };
 
+struct ncclIbDevVerbs {
+  int ibDev; // Index into ncclIbDevs
+  struct ibv_pd* pd; // duplicate of ncclIbDevs[ibDev].pd
+  struct ibv_cq* cq; // ncclIbDevs[ibDev].sharedCq when sharedCq is set
+  int sharedCq;
+  struct ibv_srq* srq; // duplicate of ncclIbDevs[ibDev].srq, receive side only (both sides with DC)
+  int dc; // Holds a reference on the DCIs of the device
+  struct ibv_qp* poolQp; // Taken from the QP pool, used by the first QP on this device
+};
+
 struct ncclIbVerbs {
-  int dev;
-  struct ibv_pd* pd; // duplicate of ncclIbDevs[dev].pd
-  struct ibv_cq* cq;
-  uint64_t pad[1];
+  int dev; // Index into ncclIbMergedDevs
+  int ndevs;
+  int dc; // Dynamically Connected, see ncclIbQp
+  struct ncclIbDevVerbs devs[NCCL_IB_MAX_DEVS_PER_NIC];
   struct ncclIbRequest reqs[MAX_REQUESTS];
 };
 
+// Memory handle returned to NCCL: one registration per device
+struct ncclIbMrHandle {
+  struct ibv_mr* mrs[NCCL_IB_MAX_DEVS_PER_NIC];
+  // ODP registrations get their pages prefetched on first use
+  int odp;
+  int prefetched;
+  void* data;
+  size_t size;
+};
+
+struct ncclIbQp {
+  struct ibv_qp* qp;
+  int devIndex;    // Local device, index into verbs.devs
+  int remDevIndex; // Remote device it is connected to
+  // With an SRQ, receive WRs are not tied to a QP. Completions on a QP come in
+  // the order receives were posted for it, so we keep that order here.
+  uint8_t* srqReqs;
+  uint64_t srqHead, srqTail;
+  // With DC, qp is a DCT receiving from the remote DCIs, and we send through a
+  // DCI of the device, addressing the remote DCT with ah and remDctn. This
+  // takes one DCT per QP instead of one RC QP, and a fixed number of DCIs per
+  // device however many peers we talk to.
+  struct ncclIbDci* dci;
+  struct ibv_ah* ah;
+  uint32_t remDctn;
+};
+
 struct ncclIbListenComm {
   int dev;
   struct ncclSocket sock;
   struct ncclIbCommStage stage;
 };
 
-struct ncclIbSendFifo {
+struct alignas(32) ncclIbSendFifo {
   uint64_t addr;
   int      size;
-  uint32_t rkey;
+  uint32_t rkeys[NCCL_IB_MAX_DEVS_PER_NIC];
   uint32_t nreqs;
   uint32_t tag;
   uint64_t idx;
@@ -448,12 +709,14 @@ struct ncclIbSendComm {
   struct ncclSocket sock;
 
   int ready;
-  struct ibv_qp* qps[NCCL_IB_MAX_QPS];
+  struct ncclIbQp qps[NCCL_IB_MAX_QPS];
   int nqps;
   int qpIndex;
-  struct ibv_mr* fifoMr;
+  struct ibv_mr* fifoMr; // Registered on devs[0], which receives the fifo writes
+  struct ibv_dm* fifoDm; // With NCCL_IB_USE_DM, the fifo lives in NIC memory and fifo[] is our copy
   int ar;
-  struct ncclIbGidInfo gidInfo;
+  struct ncclIbGidInfo gidInfo[NCCL_IB_MAX_DEVS_PER_NIC];
+  struct ncclIbSetupJob setup;
 };
 // The SendFifo needs to be 32-byte aligned and each element needs
 // to be a 32-byte multiple, so that an entry does not get split and
@@ -465,8 +728,10 @@ struct ncclIbGpuFlush {
   int enabled;
   int hostMem;
   struct ibv_mr* hostMr;
+  struct ibv_dm* hostDm; // NIC memory taking the flush reads instead of hostMem
   struct ibv_sge sge;
   struct ibv_qp* qp;
+  struct ncclIbQp dcQp; // With DC, reads go through a DCI to our own qps[0]
 };
 
 struct ncclIbRemFifo {
@@ -484,61 +749,451 @@ struct ncclIbRecvComm {
   struct ncclIbRemFifo remFifo;
   struct ncclSocket sock;
   int ready;
-  struct ibv_qp* qps[NCCL_IB_MAX_QPS];
+  struct ncclIbQp qps[NCCL_IB_MAX_QPS];
   int nqps;
   int qpIndex;
-  struct ncclIbGpuFlush gpuFlush;
-  struct ncclIbGidInfo gidInfo;
+  struct ncclIbGpuFlush gpuFlush; // On devs[0]
+  struct ncclIbGidInfo gidInfo[NCCL_IB_MAX_DEVS_PER_NIC];
+  struct ncclIbSetupJob setup;
 };
 static_assert((offsetof(struct ncclIbRecvComm, remFifo) % 32) == 0, "ncclIbSendComm fifo must be 32-byte aligned");
 
 NCCL_PARAM(IbQpsPerConn, "IB_QPS_PER_CONNECTION", 1);
+NCCL_PARAM(IbSharedCq, "IB_SHARED_CQ", 0);
+NCCL_PARAM(IbUseSrq, "IB_USE_SRQ", 0);
+NCCL_PARAM(IbSrqSize, "IB_SRQ_SIZE", 16384);
+
+// Access key of our DCTs, only DCIs using the same key can reach them
+#define NCCL_IB_DC_KEY 0x4E43434CULL
+#define NCCL_IB_DCI_MAX_WRS 8192
+
+static ncclResult_t ncclIbQpMapInsert(struct ncclIbQpMap* map, struct ncclIbQpMapEntry* entry) {
+  if (2*(map->population+1) > map->capacity) {
+    struct ncclIbQpMapEntry* oldEntries = map->entries;
+    int oldCapacity = map->capacity;
+    int capacity = oldCapacity ? 2*oldCapacity : 64;
+    NCCLCHECK(ncclCalloc(&map->entries, capacity));
+    map->capacity = capacity;
+    map->population = 0;
+    for (int i=0; i<oldCapacity; i++) if (oldEntries[i].qpn) NCCLCHECK(ncclIbQpMapInsert(map, oldEntries+i));
+    free(oldEntries);
+  }
+  int i = entry->qpn & (map->capacity-1);
+  while (map->entries[i].qpn) i = (i+1) & (map->capacity-1);
+  map->entries[i] = *entry;
+  map->population++;
+  return ncclSuccess;
+}
 
-ncclResult_t ncclIbInitVerbs(int dev, struct ibv_context* ctx, struct ncclIbVerbs* verbs) {
-  verbs->dev = dev;
+static struct ncclIbQpMapEntry* ncclIbQpMapFind(struct ncclIbQpMap* map, uint32_t qpn) {
+  if (map->capacity == 0) return NULL;
+  for (int i = qpn & (map->capacity-1); map->entries[i].qpn; i = (i+1) & (map->capacity-1)) {
+    if (map->entries[i].qpn == qpn) return map->entries+i;
+  }
+  return NULL;
+}
+
+static void ncclIbQpMapRemove(struct ncclIbQpMap* map, uint32_t qpn) {
+  struct ncclIbQpMapEntry* entry = ncclIbQpMapFind(map, qpn);
+  if (entry == NULL) return;
+  int mask = map->capacity-1;
+  int i = entry-map->entries;
+  map->population--;
+  // Backward shift deletion, so that lookups never stop at a hole too early
+  for (int j=(i+1)&mask; map->entries[j].qpn; j=(j+1)&mask) {
+    int k = map->entries[j].qpn & mask;
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    map->entries[i] = map->entries[j];
+    i = j;
+  }
+  map->entries[i].qpn = 0;
+}
+
+// Make completions of these QPs visible to whoever polls the device CQ
+static ncclResult_t ncclIbRegisterQp(struct ncclIbVerbs* verbs, int devIndex, struct ibv_qp* ibQp, struct ncclIbQp* qp) {
+  struct ncclIbDevVerbs* devVerbs = verbs->devs+devIndex;
+  if (devVerbs->sharedCq == 0 && devVerbs->srq == NULL) return ncclSuccess;
+  struct ncclIbDev* ibDev = ncclIbDevs+devVerbs->ibDev;
+  struct ncclIbQpMapEntry entry = { ibQp->qp_num, devIndex, verbs, qp, NULL };
+  ncclResult_t res;
+  pthread_mutex_lock(&ibDev->cqLock);
+  res = ncclIbQpMapInsert(&ibDev->qpMap, &entry);
+  pthread_mutex_unlock(&ibDev->cqLock);
+  return res;
+}
+
+static void ncclIbDeregisterQp(struct ncclIbVerbs* verbs, int devIndex, struct ibv_qp* ibQp) {
+  struct ncclIbDevVerbs* devVerbs = verbs->devs+devIndex;
+  if (devVerbs->sharedCq == 0 && devVerbs->srq == NULL) return;
+  struct ncclIbDev* ibDev = ncclIbDevs+devVerbs->ibDev;
+  pthread_mutex_lock(&ibDev->cqLock);
+  ncclIbQpMapRemove(&ibDev->qpMap, ibQp->qp_num);
+  pthread_mutex_unlock(&ibDev->cqLock);
+}
+
+ncclResult_t ncclIbDestroyVerbs(struct ncclIbVerbs* verbs);
+static void ncclIbQpPoolTake(struct ncclIbDevVerbs* devVerbs);
+static ncclResult_t ncclIbMrCacheFlush(struct ncclIbMrCache* cache);
+ncclResult_t ncclIbRtsQp(struct ibv_qp* qp);
+
+// Bring a DCI or a DCT to RTR. They have no destination, so the address vector
+// only selects the local port and GID. Both sides use their port MTU.
+static ncclResult_t ncclIbDcRtr(struct ibv_qp* qp, struct ncclIbDev* ibDev, int isDct) {
+  struct ibv_port_attr portAttr;
+  NCCLCHECK(wrap_ibv_query_port(ibDev->context, ibDev->port, &portAttr));
+  struct ibv_qp_attr qpAttr;
+  memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
+  qpAttr.qp_state = IBV_QPS_RTR;
+  qpAttr.path_mtu = portAttr.active_mtu;
+  qpAttr.min_rnr_timer = 12;
+  qpAttr.ah_attr.port_num = ibDev->port;
+  if (portAttr.link_layer == IBV_LINK_LAYER_ETHERNET) {
+    qpAttr.ah_attr.is_global = 1;
+    qpAttr.ah_attr.grh.sgid_index = ncclParamIbGidIndex();
+    qpAttr.ah_attr.grh.hop_limit = 255;
+  }
+  int mask = IBV_QP_STATE | IBV_QP_PATH_MTU | IBV_QP_AV;
+  if (isDct) mask |= IBV_QP_MIN_RNR_TIMER;
+  NCCLCHECK(wrap_ibv_modify_qp(qp, &qpAttr, mask));
+  return ncclSuccess;
+}
 
-  pthread_mutex_lock(&ncclIbDevs[dev].lock);
-  if (0 == ncclIbDevs[dev].pdRefs++) {
+// Called with the device lock held
+static void ncclIbDestroyDcis(struct ncclIbDev* ibDev) {
+  for (int i=0; i<ibDev->ndcis; i++) {
+    struct ncclIbDci* dci = ibDev->dcis+i;
+    if (dci->qp) {
+      pthread_mutex_lock(&ibDev->cqLock);
+      ncclIbQpMapRemove(&ibDev->qpMap, dci->qp->qp_num);
+      pthread_mutex_unlock(&ibDev->cqLock);
+      if (wrap_ibv_destroy_qp(dci->qp) != ncclSuccess) WARN("NET/IB : Failed to destroy DCI on %s", ibDev->devName);
+    }
+    free(dci->posts);
+    pthread_mutex_destroy(&dci->lock);
+  }
+  free(ibDev->dcis);
+  ibDev->dcis = NULL;
+  ibDev->ndcis = 0;
+}
+
+// Called with the device lock held, after the shared CQ has been created
+static ncclResult_t ncclIbCreateDcis(struct ncclIbDev* ibDev) {
+  int ndcis = std::max(1, (int)ncclParamIbDcDcis());
+  NCCLCHECK(ncclCalloc(&ibDev->dcis, ndcis));
+  ibDev->ndcis = 0;
+  for (int i=0; i<ndcis; i++) {
+    struct ncclIbDci* dci = ibDev->dcis+i;
+    pthread_mutex_init(&dci->lock, NULL);
+    ibDev->ndcis++;
+    struct ibv_qp_init_attr_ex qpInitAttr;
+    memset(&qpInitAttr, 0, sizeof(qpInitAttr));
+    qpInitAttr.send_cq = ibDev->sharedCq;
+    qpInitAttr.recv_cq = ibDev->sharedCq;
+    qpInitAttr.qp_type = IBV_QPT_DRIVER;
+    qpInitAttr.cap.max_send_wr = std::min(NCCL_IB_DCI_MAX_WRS, ibDev->maxQpWr);
+    qpInitAttr.cap.max_send_sge = 1;
+    qpInitAttr.cap.max_inline_data = ncclParamIbUseInline() ? sizeof(struct ncclIbSendFifo) : 0;
+    qpInitAttr.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+    qpInitAttr.pd = ibDev->pd;
+    qpInitAttr.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM | IBV_QP_EX_WITH_RDMA_READ;
+    struct mlx5dv_qp_init_attr dvInitAttr;
+    memset(&dvInitAttr, 0, sizeof(dvInitAttr));
+    dvInitAttr.comp_mask = MLX5DV_QP_INIT_ATTR_MASK_DC;
+    dvInitAttr.dc_init_attr.dc_type = MLX5DV_DCTYPE_DCI;
+    NCCLCHECK(wrap_mlx5dv_create_qp(&dci->qp, ibDev->context, &qpInitAttr, &dvInitAttr));
+    dci->maxWrs = qpInitAttr.cap.max_send_wr;
+    NCCLCHECK(ncclCalloc(&dci->posts, dci->maxWrs));
+    NCCLCHECK(wrap_ibv_qp_to_qp_ex(&dci->qpx, dci->qp));
+    NCCLCHECK(wrap_mlx5dv_qp_ex_from_ibv_qp_ex(&dci->mqpx, dci->qpx));
+
+    struct ibv_qp_attr qpAttr;
+    memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
+    qpAttr.qp_state = IBV_QPS_INIT;
+    qpAttr.pkey_index = ncclParamIbPkey();
+    qpAttr.port_num = ibDev->port;
+    NCCLCHECK(wrap_ibv_modify_qp(dci->qp, &qpAttr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT));
+    NCCLCHECK(ncclIbDcRtr(dci->qp, ibDev, 0));
+    NCCLCHECK(ncclIbRtsQp(dci->qp));
+
+    struct ncclIbQpMapEntry entry = { dci->qp->qp_num, -1, NULL, NULL, dci };
     ncclResult_t res;
-    NCCLCHECKGOTO(wrap_ibv_alloc_pd(&ncclIbDevs[dev].pd, ctx), res, failure);
-    if (0) {
-    failure:
-      pthread_mutex_unlock(&ncclIbDevs[dev].lock);
-      return res;
+    pthread_mutex_lock(&ibDev->cqLock);
+    res = ncclIbQpMapInsert(&ibDev->qpMap, &entry);
+    pthread_mutex_unlock(&ibDev->cqLock);
+    NCCLCHECK(res);
+  }
+  INFO(NCCL_NET, "NET/IB : Created %d DCIs of %d WRs on %s", ibDev->ndcis, ibDev->dcis[0].maxWrs, ibDev->devName);
+  return ncclSuccess;
+}
+
+// Forget the posts of a closing connection which are still waiting for their completion
+static void ncclIbDciForget(struct ncclIbDev* ibDev, struct ncclIbVerbs* verbs) {
+  pthread_mutex_lock(&ibDev->cqLock);
+  for (int i=0; i<ibDev->ndcis; i++) {
+    struct ncclIbDci* dci = ibDev->dcis+i;
+    pthread_mutex_lock(&dci->lock);
+    for (uint64_t p=dci->tail; p<dci->head; p++) {
+      if (dci->posts[p%dci->maxWrs].verbs == verbs) dci->posts[p%dci->maxWrs].verbs = NULL;
     }
+    pthread_mutex_unlock(&dci->lock);
+  }
+  pthread_mutex_unlock(&ibDev->cqLock);
+}
+
+// Find who posted the WR a DCI completion is for. Called with the device cqLock held.
+static ncclResult_t ncclIbDciPop(struct ncclIbDci* dci, struct ncclIbDciPost* post) {
+  ncclResult_t res = ncclSuccess;
+  pthread_mutex_lock(&dci->lock);
+  if (dci->tail == dci->head) {
+    WARN("NET/IB : Unexpected completion on DCI %u", dci->qp->qp_num);
+    res = ncclInternalError;
+  } else {
+    *post = dci->posts[dci->tail++ % dci->maxWrs];
+    // Completing a WR also completes the unsignaled ones posted before it
+    dci->done = post->posted;
   }
-  verbs->pd = ncclIbDevs[dev].pd;
-  pthread_mutex_unlock(&ncclIbDevs[dev].lock);
+  pthread_mutex_unlock(&dci->lock);
+  return res;
+}
+
+// DCIs are shared by all connections of a device, so a full send queue is back-pressure:
+// room for nwrs WRs is reserved before an operation has side effects, and the operation
+// is reported as not ready when there is none. Returns 1 on success, always for RC QPs.
+static int ncclIbDcReserve(struct ncclIbQp* qp, int nwrs) {
+  struct ncclIbDci* dci = qp->dci;
+  if (dci == NULL) return 1;
+  pthread_mutex_lock(&dci->lock);
+  int ok = dci->posted + dci->reserved + nwrs - dci->done <= (uint64_t)dci->maxWrs;
+  if (ok) dci->reserved += nwrs;
+  pthread_mutex_unlock(&dci->lock);
+  return ok;
+}
+
+static void ncclIbDcUnreserve(struct ncclIbQp* qp, int nwrs) {
+  struct ncclIbDci* dci = qp->dci;
+  if (dci == NULL) return;
+  pthread_mutex_lock(&dci->lock);
+  dci->reserved -= nwrs;
+  pthread_mutex_unlock(&dci->lock);
+}
 
-  // Recv requests can generate 2 completions (one for the post FIFO, one for the Recv).
-  NCCLCHECK(wrap_ibv_create_cq(&verbs->cq, ctx, 2*MAX_REQUESTS*ncclParamIbQpsPerConn(), NULL, NULL, 0));
+// Post a chain of RDMA WRs through the DCI of qp, to the remote DCT of qp. Room for them
+// was reserved with ncclIbDcReserve.
+static ncclResult_t ncclIbDcPostSend(struct ncclIbVerbs* verbs, struct ncclIbQp* qp, struct ibv_send_wr* wrs) {
+  struct ncclIbDci* dci = qp->dci;
+  struct ibv_qp_ex* qpx = dci->qpx;
+  ncclResult_t res = ncclSuccess;
+  int nwrs = 0, ret, unsignaled;
+  uint64_t head, posted;
+  for (struct ibv_send_wr* wr = wrs; wr; wr = wr->next) nwrs++;
+
+  pthread_mutex_lock(&dci->lock);
+  head = dci->head;
+  posted = dci->posted;
+  unsignaled = dci->unsignaled;
+  if (dci->reserved < (uint64_t)nwrs) {
+    WARN("NET/IB : posting %d WRs on DCI %u without reserving room", nwrs, dci->qp->qp_num);
+    res = ncclInternalError;
+    goto exit;
+  }
+  dci->reserved -= nwrs;
+  qpx->wr_start(qpx);
+  for (struct ibv_send_wr* wr = wrs; wr; wr = wr->next) {
+    // Connections only signal some of their WRs, and unsignaled ones only leave the send
+    // queue with a later signaled one. Sharing the DCI, they could together fill it with
+    // unsignaled WRs, so signal one ourselves every maxWrs/2.
+    unsigned int flags = wr->send_flags;
+    bool own = !(flags & IBV_SEND_SIGNALED) && unsignaled+1 >= dci->maxWrs/2;
+    if (own) flags |= IBV_SEND_SIGNALED;
+    qpx->wr_id = wr->wr_id;
+    qpx->wr_flags = flags;
+    if (wr->opcode == IBV_WR_RDMA_WRITE) {
+      qpx->wr_rdma_write(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+    } else if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+      qpx->wr_rdma_write_imm(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr, wr->imm_data);
+    } else if (wr->opcode == IBV_WR_RDMA_READ) {
+      qpx->wr_rdma_read(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+    } else {
+      WARN("NET/IB : Unsupported opcode %d on DCI", wr->opcode);
+      qpx->wr_abort(qpx);
+      res = ncclInternalError;
+      goto exit;
+    }
+    dci->mqpx->wr_set_dc_addr(dci->mqpx, qp->ah, qp->remDctn, NCCL_IB_DC_KEY);
+    if (wr->num_sge == 0) {
+      qpx->wr_set_sge_list(qpx, 0, NULL);
+    } else if (wr->send_flags & IBV_SEND_INLINE) {
+      qpx->wr_set_inline_data(qpx, (void*)wr->sg_list->addr, wr->sg_list->length);
+    } else {
+      qpx->wr_set_sge(qpx, wr->sg_list->lkey, wr->sg_list->addr, wr->sg_list->length);
+    }
+    posted++;
+    if (flags & IBV_SEND_SIGNALED) {
+      struct ncclIbDciPost* post = dci->posts+(head++ % dci->maxWrs);
+      post->verbs = own ? NULL : verbs;
+      post->devIndex = qp->devIndex;
+      post->wrId = wr->wr_id;
+      post->posted = posted;
+      unsignaled = 0;
+    } else {
+      unsignaled++;
+    }
+  }
+  ret = qpx->wr_complete(qpx);
+  if (ret != 0) {
+    WARN("NET/IB : Posting %d WRs on DCI %u failed with error %s", nwrs, dci->qp->qp_num, strerror(ret));
+    res = ncclSystemError;
+    goto exit;
+  }
+  dci->head = head;
+  dci->posted = posted;
+  dci->unsignaled = unsignaled;
+exit:
+  pthread_mutex_unlock(&dci->lock);
+  return res;
+}
+
+static ncclResult_t ncclIbPostSend(struct ncclIbVerbs* verbs, struct ncclIbQp* qp, struct ibv_send_wr* wrs) {
+  if (qp->dci) return ncclIbDcPostSend(verbs, qp, wrs);
+  struct ibv_send_wr* bad_wr;
+  NCCLCHECK(wrap_ibv_post_send(qp->qp, wrs, &bad_wr));
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbDestroyVerbs(struct ncclIbVerbs* verbs) {
-  ncclResult_t res;
-  NCCLCHECK(wrap_ibv_destroy_cq(verbs->cq));
+// nqpsPerDev is the number of QPs each device will host, used to size its CQ.
+// With NCCL_IB_SHARED_CQ, all connections of a device share one CQ instead, and
+// with NCCL_IB_USE_SRQ receive comms post their receives to a per-device SRQ.
+// DC needs both, on both sides: DCTs only receive through an SRQ, and DCI
+// completions are for any connection of the device.
+// Take a reference on the PD of device ibDevIndex, and on its shared CQ, SRQ
+// and DCIs as requested. On failure, the non-NULL fields of devVerbs tell what
+// has been acquired.
+static ncclResult_t ncclIbAcquireDev(int ibDevIndex, int sharedCq, int srq, int dc, struct ncclIbDevVerbs* devVerbs) {
+  struct ncclIbDev* ibDev = ncclIbDevs+ibDevIndex;
+  ncclResult_t res = ncclSuccess;
+  devVerbs->ibDev = ibDevIndex;
+  devVerbs->pd = NULL;
+  devVerbs->cq = NULL;
+  devVerbs->sharedCq = 0;
+  devVerbs->srq = NULL;
+  devVerbs->dc = 0;
+  devVerbs->poolQp = NULL;
+  pthread_mutex_lock(&ibDev->lock);
+  if (0 == ibDev->pdRefs++) {
+    res = wrap_ibv_alloc_pd(&ibDev->pd, ibDev->context);
+    if (res != ncclSuccess) ibDev->pdRefs--;
+  }
+  if (res == ncclSuccess) devVerbs->pd = ibDev->pd;
+  if (res == ncclSuccess && sharedCq) {
+    if (0 == ibDev->sharedCqRefs++) {
+      res = wrap_ibv_create_cq(&ibDev->sharedCq, ibDev->context, ibDev->maxCqe, NULL, NULL, 0);
+      if (res != ncclSuccess) ibDev->sharedCqRefs--;
+    }
+    if (res == ncclSuccess) {
+      devVerbs->cq = ibDev->sharedCq;
+      devVerbs->sharedCq = 1;
+    }
+  }
+  if (res == ncclSuccess && srq) {
+    if (0 == ibDev->srqRefs++) {
+      struct ibv_srq_init_attr srqAttr;
+      memset(&srqAttr, 0, sizeof(srqAttr));
+      srqAttr.attr.max_wr = std::min((int)ncclParamIbSrqSize(), ibDev->maxSrqWr);
+      srqAttr.attr.max_sge = 1;
+      res = wrap_ibv_create_srq(&ibDev->srq, ibDev->pd, &srqAttr);
+      if (res != ncclSuccess) ibDev->srqRefs--;
+    }
+    if (res == ncclSuccess) devVerbs->srq = ibDev->srq;
+  }
+  if (res == ncclSuccess && dc) {
+    if (0 == ibDev->dciRefs++) {
+      res = ncclIbCreateDcis(ibDev);
+      if (res != ncclSuccess) {
+        ncclIbDestroyDcis(ibDev);
+        ibDev->dciRefs--;
+      }
+    }
+    if (res == ncclSuccess) devVerbs->dc = 1;
+  }
+  pthread_mutex_unlock(&ibDev->lock);
+  return res;
+}
 
-  pthread_mutex_lock(&ncclIbDevs[verbs->dev].lock);
-  if (0 == --ncclIbDevs[verbs->dev].pdRefs) {
-    NCCLCHECKGOTO(wrap_ibv_dealloc_pd(ncclIbDevs[verbs->dev].pd), res, returning);
+ncclResult_t ncclIbInitVerbs(int dev, int nqpsPerDev, int isRecv, int dc, struct ncclIbVerbs* verbs) {
+  struct ncclIbMergedDev* mDev = ncclIbMergedDevs+dev;
+  ncclResult_t res = ncclSuccess;
+  verbs->dev = dev;
+  verbs->ndevs = 0;
+  verbs->dc = dc;
+
+  for (int i=0; i<mDev->ndevs; i++) {
+    struct ncclIbDev* ibDev = ncclIbDevs+mDev->devs[i];
+    struct ncclIbDevVerbs* devVerbs = verbs->devs+i;
+    res = ncclIbAcquireDev(mDev->devs[i], ncclParamIbSharedCq() || dc, (isRecv && ncclParamIbUseSrq()) || dc, dc, devVerbs);
+    // From here on, ncclIbDestroyVerbs releases what this device acquired
+    if (devVerbs->pd) verbs->ndevs++;
+    if (res != ncclSuccess) goto failure;
+
+    // A single QP per device can come from the pool, along with its CQ
+    if (nqpsPerDev == 1 && !dc) ncclIbQpPoolTake(devVerbs);
+    if (devVerbs->cq == NULL) {
+      // Recv requests can generate 2 completions (one for the post FIFO, one for the Recv).
+      NCCLCHECKGOTO(wrap_ibv_create_cq(&devVerbs->cq, ibDev->context, 2*MAX_REQUESTS*nqpsPerDev, NULL, NULL, 0), res, failure);
+    }
   }
-  res = ncclSuccess;
-returning:
-  pthread_mutex_unlock(&ncclIbDevs[verbs->dev].lock);
+  return ncclSuccess;
+failure:
+  ncclIbDestroyVerbs(verbs);
   return res;
 }
 
-ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbVerbs* verbs, int access_flags, struct ibv_qp** qp) {
+ncclResult_t ncclIbDestroyVerbs(struct ncclIbVerbs* verbs) {
+  ncclResult_t res = ncclSuccess;
+  for (int i=0; i<verbs->ndevs; i++) {
+    struct ncclIbDevVerbs* devVerbs = verbs->devs+i;
+    struct ncclIbDev* ibDev = ncclIbDevs+devVerbs->ibDev;
+    if (devVerbs->poolQp) NCCLCHECK(wrap_ibv_destroy_qp(devVerbs->poolQp));
+    devVerbs->poolQp = NULL;
+    if (devVerbs->cq && devVerbs->sharedCq == 0) NCCLCHECK(wrap_ibv_destroy_cq(devVerbs->cq));
+    if (devVerbs->dc) ncclIbDciForget(ibDev, verbs);
+
+    pthread_mutex_lock(&ibDev->lock);
+    // DCIs use the shared CQ, release them first
+    if (devVerbs->dc && 0 == --ibDev->dciRefs) ncclIbDestroyDcis(ibDev);
+    if (devVerbs->sharedCq && 0 == --ibDev->sharedCqRefs) {
+      NCCLCHECKGOTO(wrap_ibv_destroy_cq(ibDev->sharedCq), res, returning);
+      ibDev->sharedCq = NULL;
+    }
+    if (devVerbs->srq && 0 == --ibDev->srqRefs) {
+      NCCLCHECKGOTO(wrap_ibv_destroy_srq(ibDev->srq), res, returning);
+      ibDev->srq = NULL;
+    }
+    if (0 == --ibDev->pdRefs) {
+      // Idle registrations still hold the PD
+      NCCLCHECKGOTO(ncclIbMrCacheFlush(&ibDev->mrCache), res, returning);
+      if (ibDev->odpMr) NCCLCHECKGOTO(wrap_ibv_dereg_mr(ibDev->odpMr), res, returning);
+      ibDev->odpMr = NULL;
+      NCCLCHECKGOTO(wrap_ibv_dealloc_pd(ibDev->pd), res, returning);
+    }
+returning:
+    pthread_mutex_unlock(&ibDev->lock);
+    if (res != ncclSuccess) return res;
+  }
+  verbs->ndevs = 0;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbDevVerbs* verbs, struct ibv_srq* srq, int access_flags, struct ibv_qp** qp) {
   struct ibv_qp_init_attr qpInitAttr;
   memset(&qpInitAttr, 0, sizeof(struct ibv_qp_init_attr));
   qpInitAttr.send_cq = verbs->cq;
   qpInitAttr.recv_cq = verbs->cq;
+  qpInitAttr.srq = srq;
   qpInitAttr.qp_type = IBV_QPT_RC;
   // We might send 2 messages per send (RDMA and RDMA_WITH_IMM)
   qpInitAttr.cap.max_send_wr = 2*MAX_REQUESTS;
-  qpInitAttr.cap.max_recv_wr = MAX_REQUESTS;
-  qpInitAttr.cap.max_send_sge = 1;
+  qpInitAttr.cap.max_recv_wr = srq ? 0 : MAX_REQUESTS;
+  qpInitAttr.cap.max_send_sge = std::min(ncclIbDevs[verbs->ibDev].maxSendSge, NCCL_NET_IB_MAX_RECVS);
   qpInitAttr.cap.max_recv_sge = 1;
   qpInitAttr.cap.max_inline_data = ncclParamIbUseInline() ? sizeof(struct ncclIbSendFifo) : 0;
   NCCLCHECK(wrap_ibv_create_qp(qp, verbs->pd, &qpInitAttr));
@@ -552,7 +1207,96 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbVerbs* verbs, int acce
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, uint32_t qpn, struct ncclIbQpInfo* info) {
+// A DCT is ready to receive as soon as it is created, it does not need to know
+// who will write to it.
+static ncclResult_t ncclIbCreateDct(struct ncclIbDevVerbs* verbs, int access_flags, struct ibv_qp** qp) {
+  struct ncclIbDev* ibDev = ncclIbDevs+verbs->ibDev;
+  struct ibv_qp_init_attr_ex qpInitAttr;
+  memset(&qpInitAttr, 0, sizeof(qpInitAttr));
+  qpInitAttr.send_cq = verbs->cq;
+  qpInitAttr.recv_cq = verbs->cq;
+  qpInitAttr.srq = verbs->srq;
+  qpInitAttr.qp_type = IBV_QPT_DRIVER;
+  qpInitAttr.comp_mask = IBV_QP_INIT_ATTR_PD;
+  qpInitAttr.pd = verbs->pd;
+  struct mlx5dv_qp_init_attr dvInitAttr;
+  memset(&dvInitAttr, 0, sizeof(dvInitAttr));
+  dvInitAttr.comp_mask = MLX5DV_QP_INIT_ATTR_MASK_DC;
+  dvInitAttr.dc_init_attr.dc_type = MLX5DV_DCTYPE_DCT;
+  dvInitAttr.dc_init_attr.dct_access_key = NCCL_IB_DC_KEY;
+  NCCLCHECK(wrap_mlx5dv_create_qp(qp, ibDev->context, &qpInitAttr, &dvInitAttr));
+  struct ibv_qp_attr qpAttr;
+  memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
+  qpAttr.qp_state = IBV_QPS_INIT;
+  qpAttr.pkey_index = ncclParamIbPkey();
+  qpAttr.port_num = ibDev->port;
+  qpAttr.qp_access_flags = access_flags;
+  NCCLCHECK(wrap_ibv_modify_qp(*qp, &qpAttr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS));
+  NCCLCHECK(ncclIbDcRtr(*qp, ibDev, 1));
+  return ncclSuccess;
+}
+
+// Create the QPs of a connection, spreading them round-robin across the devices
+ncclResult_t ncclIbCreateQps(struct ncclIbVerbs* verbs, int nqps, int access_flags, struct ncclIbQp* qps) {
+  for (int q=0; q<nqps; q++) {
+    qps[q].devIndex = q%verbs->ndevs;
+    struct ncclIbDevVerbs* devVerbs = verbs->devs+qps[q].devIndex;
+    if (verbs->dc) {
+      NCCLCHECK(ncclIbCreateDct(devVerbs, access_flags, &qps[q].qp));
+    } else if (devVerbs->poolQp && access_flags == IBV_ACCESS_REMOTE_WRITE) {
+      qps[q].qp = devVerbs->poolQp;
+      devVerbs->poolQp = NULL;
+    } else {
+      NCCLCHECK(ncclIbCreateQp(ncclIbDevs[devVerbs->ibDev].port, devVerbs, devVerbs->srq, access_flags, &qps[q].qp));
+    }
+    if (devVerbs->srq) NCCLCHECK(ncclCalloc(&qps[q].srqReqs, MAX_REQUESTS));
+    NCCLCHECK(ncclIbRegisterQp(verbs, qps[q].devIndex, qps[q].qp, qps+q));
+  }
+  return ncclSuccess;
+}
+
+// Fill the local device information, and the local GID for error logging
+ncclResult_t ncclIbGetDevInfo(struct ncclIbVerbs* verbs, struct ncclIbQpInfo* qpInfo, struct ncclIbGidInfo* gidInfo) {
+  qpInfo->ndevs = verbs->ndevs;
+  for (int i=0; i<verbs->ndevs; i++) {
+    struct ncclIbDev* ibDev = ncclIbDevs+verbs->devs[i].ibDev;
+    struct ncclIbDevInfo* devInfo = qpInfo->devs+i;
+    struct ibv_port_attr portAttr;
+    NCCLCHECK(wrap_ibv_query_port(ibDev->context, ibDev->port, &portAttr));
+    devInfo->ib_port = ibDev->port;
+    devInfo->lid = portAttr.lid;
+    devInfo->mtu = portAttr.active_mtu;
+    devInfo->link_layer = gidInfo[i].link_layer = portAttr.link_layer;
+    devInfo->spn = devInfo->iid = 0;
+    if (devInfo->link_layer == IBV_LINK_LAYER_ETHERNET) { // RoCE
+      NCCLCHECK(wrap_ibv_query_gid(ibDev->context, ibDev->port, ncclParamIbGidIndex(), &gidInfo[i].localGid));
+      devInfo->spn = gidInfo[i].localGid.global.subnet_prefix;
+      devInfo->iid = gidInfo[i].localGid.global.interface_id;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Address of the remote device, with the traffic class and service level of QP qpIndex
+static void ncclIbFillAhAttr(struct ibv_ah_attr* ahAttr, struct ncclIbDevInfo* info, int qpIndex) {
+  if (info->link_layer == IBV_LINK_LAYER_ETHERNET) {
+    ahAttr->is_global = 1;
+    ahAttr->grh.dgid.global.subnet_prefix = info->spn;
+    ahAttr->grh.dgid.global.interface_id = info->iid;
+    ahAttr->grh.flow_label = 0;
+    ahAttr->grh.sgid_index = ncclParamIbGidIndex();
+    ahAttr->grh.hop_limit = 255;
+    ahAttr->grh.traffic_class = ncclIbNTc ? ncclIbTcList[qpIndex%ncclIbNTc] : ncclParamIbTc();
+  } else {
+    ahAttr->is_global = 0;
+    ahAttr->dlid = info->lid;
+  }
+  ahAttr->sl = ncclIbNSl ? ncclIbSlList[qpIndex%ncclIbNSl] : ncclParamIbSl();
+  ahAttr->src_path_bits = 0;
+  ahAttr->port_num = info->ib_port;
+}
+
+ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, uint32_t qpn, struct ncclIbDevInfo* info, int qpIndex) {
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
   qpAttr.qp_state = IBV_QPS_RTR;
@@ -561,21 +1305,7 @@ ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, uint32_t qpn, struct ncclIbQpInfo* i
   qpAttr.rq_psn = 0;
   qpAttr.max_dest_rd_atomic = 1;
   qpAttr.min_rnr_timer = 12;
-  if (info->link_layer == IBV_LINK_LAYER_ETHERNET) {
-    qpAttr.ah_attr.is_global = 1;
-    qpAttr.ah_attr.grh.dgid.global.subnet_prefix = info->spn;
-    qpAttr.ah_attr.grh.dgid.global.interface_id = info->iid;
-    qpAttr.ah_attr.grh.flow_label = 0;
-    qpAttr.ah_attr.grh.sgid_index = ncclParamIbGidIndex();
-    qpAttr.ah_attr.grh.hop_limit = 255;
-    qpAttr.ah_attr.grh.traffic_class = ncclParamIbTc();
-  } else {
-    qpAttr.ah_attr.is_global = 0;
-    qpAttr.ah_attr.dlid = info->lid;
-  }
-  qpAttr.ah_attr.sl = ncclParamIbSl();
-  qpAttr.ah_attr.src_path_bits = 0;
-  qpAttr.ah_attr.port_num = info->ib_port;
+  ncclIbFillAhAttr(&qpAttr.ah_attr, info, qpIndex);
   NCCLCHECK(wrap_ibv_modify_qp(qp, &qpAttr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER));
   return ncclSuccess;
 }
@@ -593,6 +1323,275 @@ ncclResult_t ncclIbRtsQp(struct ibv_qp* qp) {
   return ncclSuccess;
 }
 
+// Connection setup threads, one per device. Each keeps a pool of INIT QPs on its
+// device, so that connections skip QP creation (NCCL_IB_QP_POOL QPs per device, 0 to
+// disable), and runs the RTR/RTS transitions of connections whose first device it is
+// while the proxy thread goes on with the socket handshakes of other peers. Transitions
+// queued while the thread was busy are run back to back.
+NCCL_PARAM(IbQpPool, "IB_QP_POOL", 0);
+NCCL_PARAM(IbAsyncSetup, "IB_ASYNC_SETUP", 1);
+
+#define NCCL_IB_MAX_QP_POOL 256
+struct ncclIbQpPool {
+  int state; // 0: not attached to the device yet, 1: ready, -1: failed
+  struct ncclIbDevVerbs verbs; // References held by the pool, never released
+  // Pooled QPs and their private CQ (NULL with NCCL_IB_SHARED_CQ), without and with the SRQ
+  int count[2];
+  struct ibv_qp* qps[2][NCCL_IB_MAX_QP_POOL];
+  struct ibv_cq* cqs[2][NCCL_IB_MAX_QP_POOL];
+};
+
+struct ncclIbSetupThread {
+  pthread_t thread;
+  pthread_cond_t cond;
+  int started;
+  struct ncclIbSetupJob* jobs;
+  struct ncclIbSetupJob* jobsTail;
+  struct ncclIbQpPool pool;
+};
+
+static struct {
+  pthread_mutex_t lock; // Protects all threads, held for short updates only
+  int poolSize;
+  struct ncclIbSetupThread threads[MAX_IB_DEVS];
+} ncclIbSetup = { PTHREAD_MUTEX_INITIALIZER };
+
+static ncclResult_t ncclIbSetupRun(struct ncclIbSetupJob* job) {
+  for (int t=0; t<job->ntrans; t++) {
+    struct ncclIbQpTransition* trans = job->trans+t;
+    NCCLCHECK(ncclIbRtrQp(trans->qp, trans->qpn, &trans->info, trans->qpIndex));
+    NCCLCHECK(ncclIbRtsQp(trans->qp));
+  }
+  return ncclSuccess;
+}
+
+// Create one pooled QP, in INIT state like the ones of ncclIbCreateQps
+static ncclResult_t ncclIbQpPoolCreate(struct ncclIbQpPool* pool, int srq, struct ibv_qp** qp, struct ibv_cq** cq) {
+  struct ncclIbDev* ibDev = ncclIbDevs+pool->verbs.ibDev;
+  struct ncclIbDevVerbs devVerbs = pool->verbs;
+  *cq = NULL;
+  if (!devVerbs.sharedCq) {
+    NCCLCHECK(wrap_ibv_create_cq(cq, ibDev->context, 2*MAX_REQUESTS, NULL, NULL, 0));
+    devVerbs.cq = *cq;
+  }
+  ncclResult_t res = ncclIbCreateQp(ibDev->port, &devVerbs, srq ? devVerbs.srq : NULL, IBV_ACCESS_REMOTE_WRITE, qp);
+  if (res != ncclSuccess && *cq) wrap_ibv_destroy_cq(*cq);
+  return res;
+}
+
+// Whether the pool of device d is below its target size, attaching it to the device
+// on the first call. Called and returns with the lock held.
+static int ncclIbQpPoolNext(int d, int* srq) {
+  int nsrq = ncclParamIbUseSrq() ? 2 : 1;
+  struct ncclIbQpPool* pool = &ncclIbSetup.threads[d].pool;
+  if (ncclIbSetup.poolSize == 0) return 0;
+  if (pool->state == 0) {
+    pthread_mutex_unlock(&ncclIbSetup.lock);
+    ncclResult_t res = ncclIbAcquireDev(d, ncclParamIbSharedCq(), ncclParamIbUseSrq(), 0, &pool->verbs);
+    pthread_mutex_lock(&ncclIbSetup.lock);
+    if (res != ncclSuccess) WARN("NET/IB : Failed to set up the QP pool of %s", ncclIbDevs[d].devName);
+    pool->state = res == ncclSuccess ? 1 : -1;
+  }
+  if (pool->state != 1) return 0;
+  for (int s=0; s<nsrq; s++) {
+    if (pool->count[s] < ncclIbSetup.poolSize) { *srq = s; return 1; }
+  }
+  return 0;
+}
+
+static void* ncclIbSetupThreadMain(void* args) {
+  int d = (int)(intptr_t)args;
+  struct ncclIbSetupThread* thread = ncclIbSetup.threads+d;
+  struct ncclIbQpPool* pool = &thread->pool;
+  pthread_mutex_lock(&ncclIbSetup.lock);
+  while (1) {
+    if (thread->jobs) {
+      struct ncclIbSetupJob* job = thread->jobs;
+      thread->jobs = thread->jobsTail = NULL;
+      pthread_mutex_unlock(&ncclIbSetup.lock);
+      while (job) {
+        // The connection may go on (and reuse the job) as soon as it is done
+        struct ncclIbSetupJob* next = job->next;
+        job->result = ncclIbSetupRun(job);
+        __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+        job = next;
+      }
+      pthread_mutex_lock(&ncclIbSetup.lock);
+      continue;
+    }
+    // Refill one QP at a time, so that queued transitions do not wait
+    int srq;
+    if (!ncclIbQpPoolNext(d, &srq)) {
+      pthread_cond_wait(&thread->cond, &ncclIbSetup.lock);
+      continue;
+    }
+    pthread_mutex_unlock(&ncclIbSetup.lock);
+    struct ibv_qp* qp;
+    struct ibv_cq* cq;
+    ncclResult_t res = ncclIbQpPoolCreate(pool, srq, &qp, &cq);
+    pthread_mutex_lock(&ncclIbSetup.lock);
+    if (res != ncclSuccess) {
+      WARN("NET/IB : Failed to create a pooled QP on %s, disabling its QP pool", ncclIbDevs[d].devName);
+      pool->state = -1;
+      continue;
+    }
+    pool->qps[srq][pool->count[srq]] = qp;
+    pool->cqs[srq][pool->count[srq]] = cq;
+    pool->count[srq]++;
+  }
+  pthread_mutex_unlock(&ncclIbSetup.lock);
+  return NULL;
+}
+
+// Start the setup thread of device d. Called with the lock held.
+static ncclResult_t ncclIbSetupStart(int d) {
+  struct ncclIbSetupThread* thread = ncclIbSetup.threads+d;
+  if (thread->started) return ncclSuccess;
+  pthread_cond_init(&thread->cond, NULL);
+  if (pthread_create(&thread->thread, NULL, ncclIbSetupThreadMain, (void*)(intptr_t)d) != 0) {
+    WARN("NET/IB : Failed to create the connection setup thread of %s : %s", ncclIbDevs[d].devName, strerror(errno));
+    pthread_cond_destroy(&thread->cond);
+    return ncclSystemError;
+  }
+  ncclSetThreadName(thread->thread, "NCCL IbSetup%2d", d);
+  pthread_detach(thread->thread);
+  thread->started = 1;
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclIbQpPoolInit() {
+  int poolSize = std::min((int)ncclParamIbQpPool(), NCCL_IB_MAX_QP_POOL);
+  if (poolSize <= 0) return ncclSuccess;
+  ncclResult_t res = ncclSuccess;
+  pthread_mutex_lock(&ncclIbSetup.lock);
+  ncclIbSetup.poolSize = poolSize;
+  for (int d=0; d<ncclNIbDevs && res == ncclSuccess; d++) {
+    res = ncclIbSetupStart(d);
+    if (res == ncclSuccess) pthread_cond_signal(&ncclIbSetup.threads[d].cond);
+  }
+  pthread_mutex_unlock(&ncclIbSetup.lock);
+  if (res == ncclSuccess) INFO(NCCL_INIT|NCCL_NET, "NET/IB : Keeping %d pre-created QPs per device", poolSize);
+  return res;
+}
+
+static void ncclIbQpPoolTake(struct ncclIbDevVerbs* devVerbs) {
+  if (ncclIbSetup.poolSize == 0) return;
+  struct ncclIbSetupThread* thread = ncclIbSetup.threads+devVerbs->ibDev;
+  struct ncclIbQpPool* pool = &thread->pool;
+  int srq = devVerbs->srq ? 1 : 0;
+  pthread_mutex_lock(&ncclIbSetup.lock);
+  // Pooled QPs are bound to the shared CQ or to their own one, they must match the connection
+  if (pool->state == 1 && pool->count[srq] > 0 && pool->verbs.sharedCq == devVerbs->sharedCq) {
+    int i = --pool->count[srq];
+    devVerbs->poolQp = pool->qps[srq][i];
+    if (pool->cqs[srq][i]) devVerbs->cq = pool->cqs[srq][i];
+    pthread_cond_signal(&thread->cond);
+  }
+  pthread_mutex_unlock(&ncclIbSetup.lock);
+}
+
+// Queue the transitions of job on the thread of device ibDev, or run them right away
+// without NCCL_IB_ASYNC_SETUP.
+static ncclResult_t ncclIbSetupQueue(int ibDev, struct ncclIbSetupJob* job) {
+  job->next = NULL;
+  job->done = 0;
+  if (job->ntrans == 0 || ncclParamIbAsyncSetup() == 0) {
+    job->result = ncclIbSetupRun(job);
+    job->done = 1;
+    return ncclSuccess;
+  }
+  struct ncclIbSetupThread* thread = ncclIbSetup.threads+ibDev;
+  pthread_mutex_lock(&ncclIbSetup.lock);
+  ncclResult_t res = ncclIbSetupStart(ibDev);
+  if (res == ncclSuccess) {
+    if (thread->jobsTail) thread->jobsTail->next = job;
+    else thread->jobs = job;
+    thread->jobsTail = job;
+    pthread_cond_signal(&thread->cond);
+  }
+  pthread_mutex_unlock(&ncclIbSetup.lock);
+  return res;
+}
+
+static int ncclIbSetupDone(struct ncclIbSetupJob* job) {
+  return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+}
+
+// The DC counterpart of RTR/RTS: pick a DCI of the device and an address for
+// the remote DCT. DCIs are handed out round-robin to spread connections.
+static ncclResult_t ncclIbDcConnectQp(struct ncclIbVerbs* verbs, struct ncclIbQp* qp, uint32_t dctn, struct ncclIbDevInfo* info, int qpIndex) {
+  struct ncclIbDevVerbs* devVerbs = verbs->devs+qp->devIndex;
+  struct ncclIbDev* ibDev = ncclIbDevs+devVerbs->ibDev;
+  struct ibv_ah_attr ahAttr;
+  memset(&ahAttr, 0, sizeof(ahAttr));
+  ncclIbFillAhAttr(&ahAttr, info, qpIndex);
+  ahAttr.port_num = ibDev->port;
+  NCCLCHECK(wrap_ibv_create_ah(&qp->ah, devVerbs->pd, &ahAttr));
+  qp->remDctn = dctn;
+  pthread_mutex_lock(&ibDev->lock);
+  qp->dci = ibDev->dcis+(ibDev->dciNext++ % ibDev->ndcis);
+  pthread_mutex_unlock(&ibDev->lock);
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclIbDcDisconnectQp(struct ncclIbQp* qp) {
+  if (qp->ah) NCCLCHECK(wrap_ibv_destroy_ah(qp->ah));
+  qp->ah = NULL;
+  qp->dci = NULL;
+  return ncclSuccess;
+}
+
+// Whether connections on merged device dev can use DC
+static int ncclIbDcSupported(int dev) {
+  struct ncclIbMergedDev* mDev = ncclIbMergedDevs+dev;
+  int dc = 1;
+  for (int i=0; i<mDev->ndevs; i++) dc &= ncclIbDevs[mDev->devs[i]].dc;
+  return dc;
+}
+
+// Put the fifo and the GPU flush target in NIC memory, saving the PCIe round
+// trips to host memory of RDMA writes and reads on the control path.
+NCCL_PARAM(IbUseDm, "IB_USE_DM", 0);
+
+// Allocate size bytes of NIC memory on a device and register them zero-based,
+// so that addresses are offsets into it. Returns with *dm NULL when the device
+// has no (more) memory to give, the caller then uses host memory.
+static ncclResult_t ncclIbDmAlloc(struct ncclIbDevVerbs* devVerbs, size_t size, unsigned int access, struct ibv_dm** dm, struct ibv_mr** mr) {
+  *dm = NULL;
+  if (ncclParamIbUseDm() == 0) return ncclSuccess;
+  struct ibv_alloc_dm_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.length = size;
+  attr.log_align_req = 5; // Fifo entries must not be split
+  if (wrap_ibv_alloc_dm(dm, ncclIbDevs[devVerbs->ibDev].context, &attr) != ncclSuccess) {
+    static int warned = 0;
+    if (warned++ == 0) INFO(NCCL_NET, "NET/IB : No device memory on %s, using host memory", ncclIbDevs[devVerbs->ibDev].devName);
+    *dm = NULL;
+    return ncclSuccess;
+  }
+  ncclResult_t res = wrap_ibv_reg_dm_mr(mr, devVerbs->pd, *dm, 0, size, access | IBV_ACCESS_ZERO_BASED);
+  if (res != ncclSuccess) {
+    wrap_ibv_free_dm(*dm);
+    *dm = NULL;
+  }
+  return res;
+}
+
+// Copy fifo entry r of slot from device memory, which the receiver's RDMA write may be
+// updating meanwhile. Like a seqlock, the copy only keeps idx once a second read, after a
+// fence, sees the same idx and contents; otherwise idx stays stale and the caller polls again.
+static ncclResult_t ncclIbFifoDmRead(struct ncclIbSendComm* comm, int slot, int r, uint64_t idx) {
+  uint64_t offset = (slot*NCCL_NET_IB_MAX_RECVS+r)*sizeof(struct ncclIbSendFifo);
+  struct ncclIbSendFifo* elem = comm->fifo[slot]+r;
+  struct ncclIbSendFifo check;
+  NCCLCHECK(wrap_ibv_memcpy_from_dm(elem, comm->fifoDm, offset, sizeof(struct ncclIbSendFifo)));
+  if (elem->idx != idx) return ncclSuccess;
+  __sync_synchronize();
+  NCCLCHECK(wrap_ibv_memcpy_from_dm(&check, comm->fifoDm, offset, sizeof(struct ncclIbSendFifo)));
+  if (check.idx != idx || memcmp(&check, elem, sizeof(check)) != 0) elem->idx = 0;
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbListen(int dev, void* opaqueHandle, void** listenComm) {
   struct ncclIbListenComm* comm;
   NCCLCHECK(ncclCalloc(&comm, 1));
@@ -618,6 +1617,7 @@ ncclResult_t ncclIbConnect(int dev, void* opaqueHandle, void** sendComm) {
   if (stage->state == ncclIbCommStateConnect)    goto ib_connect_check;
   if (stage->state == ncclIbCommStateSend)       goto ib_send;
   if (stage->state == ncclIbCommStateConnecting) goto ib_connect;
+  if (stage->state == ncclIbCommStateTransition) goto ib_transition;
   if (stage->state == ncclIbCommStateConnected)  goto ib_send_ready;
   if (stage->state != ncclIbCommStateStart) {
     WARN("Error: trying to connect already connected sendComm");
@@ -636,42 +1636,40 @@ ib_connect_check:
   if (!ready) return ncclSuccess;
 
   // IB Setup
-  struct ibv_context* ctx;
-  ctx = ncclIbDevs[dev].context;
-  NCCLCHECK(ncclIbInitVerbs(dev, ctx, &comm->verbs));
-  uint8_t ib_port;
-  ib_port = ncclIbDevs[dev].port;
-  comm->nqps = ncclParamIbQpsPerConn();
-  for (int q=0; q<comm->nqps; q++) {
-    NCCLCHECK(ncclIbCreateQp(ib_port, &comm->verbs, IBV_ACCESS_REMOTE_WRITE, comm->qps+q));
+  NCCLCHECK(ncclIbInitVerbs(dev, ncclParamIbQpsPerConn(), 0, ncclIbDcSupported(dev), &comm->verbs));
+  comm->nqps = ncclParamIbQpsPerConn()*comm->verbs.ndevs;
+  if (comm->nqps > NCCL_IB_MAX_QPS) {
+    WARN("NET/IB : %d QPs per connection on %d devices exceeds the maximum of %d", (int)ncclParamIbQpsPerConn(), comm->verbs.ndevs, NCCL_IB_MAX_QPS);
+    return ncclInvalidUsage;
   }
-  comm->ar = ncclIbDevs[dev].ar; // ADAPTIVE_ROUTING
+  NCCLCHECK(ncclIbCreateQps(&comm->verbs, comm->nqps, IBV_ACCESS_REMOTE_WRITE, comm->qps));
+  comm->ar = 1; // ADAPTIVE_ROUTING, only if all devices have it
+  for (int i=0; i<comm->verbs.ndevs; i++) comm->ar &= ncclIbDevs[comm->verbs.devs[i].ibDev].ar;
 
   // Send my QP Info to receiver through the socket. Hope this won't block.
-  struct ibv_port_attr portAttr;
-  NCCLCHECK(wrap_ibv_query_port(ctx, ib_port, &portAttr));
   struct ncclIbQpInfo qpInfo;
-  qpInfo.ib_port = ib_port;
-  for (int q=0; q<comm->nqps; q++) qpInfo.qpn[q] = comm->qps[q]->qp_num;
-  qpInfo.mtu = portAttr.active_mtu;
+  memset(&qpInfo, 0, sizeof(qpInfo));
+  NCCLCHECK(ncclIbGetDevInfo(&comm->verbs, &qpInfo, comm->gidInfo));
+  qpInfo.nqps = comm->nqps;
+  qpInfo.dc = comm->verbs.dc;
+  for (int q=0; q<comm->nqps; q++) qpInfo.qpn[q] = comm->qps[q].qp->qp_num;
 
   // Prepare my fifo
-  NCCLCHECK(wrap_ibv_reg_mr(&comm->fifoMr, comm->verbs.pd, comm->fifo, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ));
+  NCCLCHECK(ncclIbDmAlloc(comm->verbs.devs+0, sizeof(comm->fifo), IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ, &comm->fifoDm, &comm->fifoMr));
+  if (comm->fifoDm == NULL) {
+    NCCLCHECK(wrap_ibv_reg_mr(&comm->fifoMr, comm->verbs.devs[0].pd, comm->fifo, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ));
+  }
   qpInfo.fifoRkey = comm->fifoMr->rkey;
-  qpInfo.fifoAddr = (uint64_t)comm->fifo;
-
-  // RoCE support
-  qpInfo.lid = portAttr.lid;
-  qpInfo.link_layer = comm->gidInfo.link_layer = portAttr.link_layer;
-  if (qpInfo.link_layer == IBV_LINK_LAYER_INFINIBAND) { // IB
-    for (int q=0; q<comm->nqps; q++)
-      INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d mtu %d LID %d", dev, ib_port, qpInfo.qpn[q], qpInfo.mtu, qpInfo.lid);
-  } else { // RoCE
-    NCCLCHECK(wrap_ibv_query_gid(ctx, ib_port, ncclParamIbGidIndex(), &comm->gidInfo.localGid));
-    qpInfo.spn = comm->gidInfo.localGid.global.subnet_prefix;
-    qpInfo.iid = comm->gidInfo.localGid.global.interface_id;
-    for (int q=0; q<comm->nqps; q++)
-      INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d mtu %d GID %ld (%lX/%lX)", dev, ib_port, qpInfo.qpn[q], qpInfo.mtu, ncclParamIbGidIndex(), qpInfo.spn, qpInfo.iid);
+  qpInfo.fifoAddr = comm->fifoDm ? 0 : (uint64_t)comm->fifo;
+
+  for (int q=0; q<comm->nqps; q++) {
+    int ibDev = comm->verbs.devs[comm->qps[q].devIndex].ibDev;
+    struct ncclIbDevInfo* devInfo = qpInfo.devs+comm->qps[q].devIndex;
+    if (devInfo->link_layer == IBV_LINK_LAYER_INFINIBAND) { // IB
+      INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d mtu %d LID %d", ibDev, devInfo->ib_port, qpInfo.qpn[q], devInfo->mtu, devInfo->lid);
+    } else { // RoCE
+      INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d mtu %d GID %ld (%lX/%lX)", ibDev, devInfo->ib_port, qpInfo.qpn[q], devInfo->mtu, ncclParamIbGidIndex(), devInfo->spn, devInfo->iid);
+    }
   }
 
   stage->state = ncclIbCommStateSend;
@@ -694,14 +1692,34 @@ ib_connect:
   if (stage->offset != sizeof(remQpInfo)) return ncclSuccess;
 
   memcpy(&remQpInfo, stage->buffer, sizeof(ncclIbQpInfo));
+  if (remQpInfo.nqps != comm->nqps || remQpInfo.ndevs < 1 || remQpInfo.ndevs > NCCL_IB_MAX_DEVS_PER_NIC || remQpInfo.dc != comm->verbs.dc) {
+    WARN("NET/IB : Remote connection info mismatch: %d QPs on %d devices (DC %d), expected %d QPs (DC %d)", remQpInfo.nqps, remQpInfo.ndevs, remQpInfo.dc, comm->nqps, comm->verbs.dc);
+    return ncclInternalError;
+  }
 
-  comm->gidInfo.remoteGid.global.subnet_prefix = remQpInfo.spn;
-  comm->gidInfo.remoteGid.global.interface_id = remQpInfo.iid;
+  for (int i=0; i<comm->verbs.ndevs; i++) {
+    comm->gidInfo[i].remoteGid.global.subnet_prefix = remQpInfo.devs[i%remQpInfo.ndevs].spn;
+    comm->gidInfo[i].remoteGid.global.interface_id = remQpInfo.devs[i%remQpInfo.ndevs].iid;
+  }
+  comm->setup.ntrans = 0;
   for (int q=0; q<comm->nqps; q++) {
-    struct ibv_qp* qp = comm->qps[q];
-    NCCLCHECK(ncclIbRtrQp(qp, remQpInfo.qpn[q], &remQpInfo));
-    NCCLCHECK(ncclIbRtsQp(qp));
+    comm->qps[q].remDevIndex = q%remQpInfo.ndevs;
+    if (comm->verbs.dc) {
+      NCCLCHECK(ncclIbDcConnectQp(&comm->verbs, comm->qps+q, remQpInfo.qpn[q], remQpInfo.devs+comm->qps[q].remDevIndex, q));
+    } else {
+      struct ncclIbQpTransition* trans = comm->setup.trans+comm->setup.ntrans++;
+      trans->qp = comm->qps[q].qp;
+      trans->qpn = remQpInfo.qpn[q];
+      trans->info = remQpInfo.devs[comm->qps[q].remDevIndex];
+      trans->qpIndex = q;
+    }
   }
+  NCCLCHECK(ncclIbSetupQueue(comm->verbs.devs[0].ibDev, &comm->setup));
+  stage->state = ncclIbCommStateTransition;
+
+ib_transition:
+  if (!ncclIbSetupDone(&comm->setup)) return ncclSuccess;
+  NCCLCHECK(comm->setup.result);
 
   comm->ready = 1;
   stage->state = ncclIbCommStateConnected;
@@ -729,6 +1747,7 @@ ncclResult_t ncclIbAccept(void* listenComm, void** recvComm) {
 
   if (stage->state == ncclIbCommStateAccept) goto ib_accept_check;
   if (stage->state == ncclIbCommStateRecv) goto ib_recv;
+  if (stage->state == ncclIbCommStateTransition) goto ib_transition;
   if (stage->state == ncclIbCommStateSend) goto ib_send;
   if (stage->state == ncclIbCommStatePendingReady) goto ib_recv_ready;
   if (stage->state != ncclIbCommStateStart) {
@@ -757,79 +1776,106 @@ ib_recv:
 
   /* copy back the received info */
   memcpy(&remQpInfo, stage->buffer, sizeof(struct ncclIbQpInfo));
+  if (remQpInfo.nqps < 1 || remQpInfo.nqps > NCCL_IB_MAX_QPS || remQpInfo.ndevs < 1 || remQpInfo.ndevs > NCCL_IB_MAX_DEVS_PER_NIC) {
+    WARN("NET/IB : Invalid remote connection info: %d QPs on %d devices", remQpInfo.nqps, remQpInfo.ndevs);
+    return ncclInternalError;
+  }
 
-  rComm->gidInfo.remoteGid.global.subnet_prefix = remQpInfo.spn;
-  rComm->gidInfo.remoteGid.global.interface_id = remQpInfo.iid;
+  // Use DC when the sender does
+  if (remQpInfo.dc && !ncclIbDcSupported(lComm->dev)) {
+    WARN("NET/IB : Remote peer connects with DC but %s does not support it. Set NCCL_IB_DC the same way on all ranks.", ncclIbMergedDevs[lComm->dev].devName);
+    return ncclInternalError;
+  }
 
   // IB setup
-  struct ibv_context* ctx;
-  uint8_t ib_port;
-  ctx = ncclIbDevs[lComm->dev].context;
-  ib_port = ncclIbDevs[lComm->dev].port;
-  struct ibv_port_attr portAttr;
-  NCCLCHECK(wrap_ibv_query_port(ctx, ib_port, &portAttr));
-  NCCLCHECK(wrap_ibv_query_gid(ctx, ib_port, ncclParamIbGidIndex(), &rComm->gidInfo.localGid));
-
-  // QP Creation
-  NCCLCHECK(ncclIbInitVerbs(lComm->dev, ctx, &rComm->verbs));
-  rComm->nqps = ncclParamIbQpsPerConn();
-  for (int q=0; q<rComm->nqps; q++) {
-    NCCLCHECK(ncclIbCreateQp(ib_port, &rComm->verbs, IBV_ACCESS_REMOTE_WRITE, rComm->qps+q));
+  NCCLCHECK(ncclIbInitVerbs(lComm->dev, DIVUP(remQpInfo.nqps, ncclIbMergedDevs[lComm->dev].ndevs), 1, remQpInfo.dc, &rComm->verbs));
+  struct ncclIbQpInfo qpInfo;
+  memset(&qpInfo, 0, sizeof(qpInfo));
+  NCCLCHECK(ncclIbGetDevInfo(&rComm->verbs, &qpInfo, rComm->gidInfo));
+  for (int i=0; i<rComm->verbs.ndevs; i++) {
+    rComm->gidInfo[i].remoteGid.global.subnet_prefix = remQpInfo.devs[i%remQpInfo.ndevs].spn;
+    rComm->gidInfo[i].remoteGid.global.interface_id = remQpInfo.devs[i%remQpInfo.ndevs].iid;
   }
 
-  // Adjust the MTU
-  remQpInfo.mtu = (enum ibv_mtu)std::min(remQpInfo.mtu, portAttr.active_mtu);
+  // QP Creation, matching the number of QPs of the sender
+  rComm->nqps = remQpInfo.nqps;
+  // With DC, the GPU flush reads from our own qps[0]
+  NCCLCHECK(ncclIbCreateQps(&rComm->verbs, rComm->nqps, IBV_ACCESS_REMOTE_WRITE | (rComm->verbs.dc ? IBV_ACCESS_REMOTE_READ : 0), rComm->qps));
 
-  // Setup QP
+  // Adjust the MTU, using the same one on all devices of both sides
+  enum ibv_mtu mtu;
+  mtu = qpInfo.devs[0].mtu;
+  for (int i=0; i<qpInfo.ndevs; i++) mtu = std::min(mtu, qpInfo.devs[i].mtu);
+  for (int i=0; i<remQpInfo.ndevs; i++) mtu = std::min(mtu, remQpInfo.devs[i].mtu);
+  for (int i=0; i<qpInfo.ndevs; i++) qpInfo.devs[i].mtu = mtu;
+  for (int i=0; i<remQpInfo.ndevs; i++) remQpInfo.devs[i].mtu = mtu;
+
+  // Setup QP. The transitions run in the background while we register the
+  // fifo and set up the flush QP, we only wait for them before replying.
+  rComm->setup.ntrans = 0;
   for (int q=0; q<rComm->nqps; q++) {
-    struct ibv_qp* qp = rComm->qps[q];
-    NCCLCHECK(ncclIbRtrQp(qp, remQpInfo.qpn[q], &remQpInfo));
-    NCCLCHECK(ncclIbRtsQp(qp));
+    rComm->qps[q].remDevIndex = q%remQpInfo.ndevs;
+    if (rComm->verbs.dc) {
+      NCCLCHECK(ncclIbDcConnectQp(&rComm->verbs, rComm->qps+q, remQpInfo.qpn[q], remQpInfo.devs+rComm->qps[q].remDevIndex, q));
+    } else {
+      struct ncclIbQpTransition* trans = rComm->setup.trans+rComm->setup.ntrans++;
+      trans->qp = rComm->qps[q].qp;
+      trans->qpn = remQpInfo.qpn[q];
+      trans->info = remQpInfo.devs[rComm->qps[q].remDevIndex];
+      trans->qpIndex = q;
+    }
   }
+  NCCLCHECK(ncclIbSetupQueue(rComm->verbs.devs[0].ibDev, &rComm->setup));
 
-  // Retain remote fifo info and prepare my RDMA ops
+  // Retain remote fifo info and prepare my RDMA ops. The fifo is written
+  // through qps[0], which connects our first device to the sender's first device.
   rComm->remFifo.rkey = remQpInfo.fifoRkey;
   rComm->remFifo.addr = remQpInfo.fifoAddr;
-  NCCLCHECK(wrap_ibv_reg_mr(&rComm->remFifo.mr, rComm->verbs.pd, &rComm->remFifo.elems, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ));
+  NCCLCHECK(wrap_ibv_reg_mr(&rComm->remFifo.mr, rComm->verbs.devs[0].pd, &rComm->remFifo.elems, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ));
   rComm->remFifo.sge.lkey = rComm->remFifo.mr->lkey;
   if (ncclParamIbUseInline()) rComm->remFifo.flags = IBV_SEND_INLINE;
 
   // Allocate Flush dummy buffer for GPU Direct RDMA
-  rComm->gpuFlush.enabled = ((ncclIbGdrSupport(lComm->dev) == ncclSuccess || ncclIbDmaBufSupport(lComm->dev) == ncclSuccess)
+  int flushDev;
+  flushDev = rComm->verbs.devs[0].ibDev;
+  rComm->gpuFlush.enabled = ((ncclIbGdrSupport(flushDev) == ncclSuccess || ncclIbDmaBufSupport(flushDev) == ncclSuccess)
                              && (ncclParamIbGdrFlushDisable() == 0)) ? 1 : 0;
   if (rComm->gpuFlush.enabled) {
-    NCCLCHECK(wrap_ibv_reg_mr(&rComm->gpuFlush.hostMr, rComm->verbs.pd, &rComm->gpuFlush.hostMem, sizeof(int), IBV_ACCESS_LOCAL_WRITE));
-    rComm->gpuFlush.sge.addr = (uint64_t)&rComm->gpuFlush.hostMem;
+    NCCLCHECK(ncclIbDmAlloc(rComm->verbs.devs+0, sizeof(int), IBV_ACCESS_LOCAL_WRITE, &rComm->gpuFlush.hostDm, &rComm->gpuFlush.hostMr));
+    if (rComm->gpuFlush.hostDm == NULL) {
+      NCCLCHECK(wrap_ibv_reg_mr(&rComm->gpuFlush.hostMr, rComm->verbs.devs[0].pd, &rComm->gpuFlush.hostMem, sizeof(int), IBV_ACCESS_LOCAL_WRITE));
+    }
+    rComm->gpuFlush.sge.addr = rComm->gpuFlush.hostDm ? 0 : (uint64_t)&rComm->gpuFlush.hostMem;
     rComm->gpuFlush.sge.length = 1;
     rComm->gpuFlush.sge.lkey = rComm->gpuFlush.hostMr->lkey;
-    NCCLCHECK(ncclIbCreateQp(ib_port, &rComm->verbs, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ, &rComm->gpuFlush.qp));
-    struct ncclIbQpInfo localQpInfo;
-    localQpInfo.lid=portAttr.lid;
-    localQpInfo.link_layer=portAttr.link_layer;
-    localQpInfo.ib_port=ib_port;
-    localQpInfo.spn=rComm->gidInfo.localGid.global.subnet_prefix;
-    localQpInfo.iid=rComm->gidInfo.localGid.global.interface_id;
-    localQpInfo.mtu=portAttr.active_mtu;
-    NCCLCHECK(ncclIbRtrQp(rComm->gpuFlush.qp, rComm->gpuFlush.qp->qp_num, &localQpInfo));
-    NCCLCHECK(ncclIbRtsQp(rComm->gpuFlush.qp));
+    if (rComm->verbs.dc) {
+      rComm->gpuFlush.dcQp.devIndex = 0;
+      NCCLCHECK(ncclIbDcConnectQp(&rComm->verbs, &rComm->gpuFlush.dcQp, rComm->qps[0].qp->qp_num, qpInfo.devs+0, 0));
+    } else {
+      NCCLCHECK(ncclIbCreateQp(ncclIbDevs[flushDev].port, rComm->verbs.devs+0, NULL, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ, &rComm->gpuFlush.qp));
+      NCCLCHECK(ncclIbRegisterQp(&rComm->verbs, 0, rComm->gpuFlush.qp, NULL));
+      NCCLCHECK(ncclIbRtrQp(rComm->gpuFlush.qp, rComm->gpuFlush.qp->qp_num, qpInfo.devs+0, 0));
+      NCCLCHECK(ncclIbRtsQp(rComm->gpuFlush.qp));
+    }
   }
 
   // Fill Handle
-  struct ncclIbQpInfo qpInfo;
-  qpInfo.lid=portAttr.lid;
-  qpInfo.link_layer= rComm->gidInfo.link_layer = portAttr.link_layer;
-  qpInfo.ib_port=ib_port;
-  for (int q=0; q<rComm->nqps; q++) qpInfo.qpn[q]=rComm->qps[q]->qp_num;
-  qpInfo.spn=rComm->gidInfo.localGid.global.subnet_prefix;
-  qpInfo.iid=rComm->gidInfo.localGid.global.interface_id;
-  qpInfo.mtu=remQpInfo.mtu;
+  qpInfo.nqps = rComm->nqps;
+  qpInfo.dc = rComm->verbs.dc;
+  for (int q=0; q<rComm->nqps; q++) qpInfo.qpn[q]=rComm->qps[q].qp->qp_num;
 
-  stage->state = ncclIbCommStateSend;
+  stage->state = ncclIbCommStateTransition;
   stage->offset = 0;
   if (stage->buffer) free(stage->buffer);
   NCCLCHECK(ncclIbMalloc((void**)&stage->buffer, sizeof(struct ncclIbQpInfo)));
   memcpy(stage->buffer, &qpInfo, sizeof(struct ncclIbQpInfo));
 
+ib_transition:
+  // Our QPs must be ready before the sender learns about them
+  if (!ncclIbSetupDone(&rComm->setup)) return ncclSuccess;
+  NCCLCHECK(rComm->setup.result);
+  stage->state = ncclIbCommStateSend;
+
 ib_send:
   NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &rComm->sock, stage->buffer, sizeof(struct ncclIbQpInfo), &stage->offset));
   if (stage->offset < sizeof(struct ncclIbQpInfo)) return ncclSuccess;
@@ -857,7 +1903,7 @@ ncclResult_t ncclIbGetRequest(struct ncclIbVerbs* verbs, struct ncclIbRequest**
     struct ncclIbRequest* r = verbs->reqs+i;
     if (r->type == NCCL_NET_IB_REQ_UNUSED) {
       r->verbs = verbs;
-      r->events = 1;
+      memset(r->events, 0, sizeof(r->events));
       r->sock = NULL;
       r->gidInfo = NULL;
       *req = r;
@@ -875,20 +1921,76 @@ ncclResult_t ncclIbFreeRequest(struct ncclIbRequest* r) {
 
 ncclResult_t ncclIbTest(void* request, int* done, int* size);
 
+NCCL_PARAM(IbMrCacheIdle, "IB_MR_CACHE_IDLE", 0);
+
+// On-Demand Paging for host buffers of at least NCCL_IB_ODP_THRESHOLD bytes:
+// 1 registers them without pinning, 2 uses a single implicit registration of
+// the whole address space per device. Pages are prefetched on first use.
+#define NCCL_IB_ODP_EXPLICIT 1
+#define NCCL_IB_ODP_IMPLICIT 2
+NCCL_PARAM(IbOdp, "IB_ODP", 0);
+NCCL_PARAM(IbOdpThreshold, "IB_ODP_THRESHOLD", 1<<26);
+
+// Register with On-Demand Paging, NULL if the device does not support it (the
+// first attempt tells). Called with the device lock held.
+static struct ibv_mr* ncclIbRegMrOdp(struct ncclIbDev* ibDev, struct ibv_pd* pd, void* addr, size_t length) {
+  struct ibv_mr* mr = wrap_direct_ibv_reg_mr(pd, addr, length, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ|IBV_ACCESS_ON_DEMAND);
+  if (mr == NULL && ibDev->odp == -1) {
+    INFO(NCCL_INIT|NCCL_NET, "NET/IB : %s does not support %s ODP registrations (%s), pinning buffers instead",
+         ibDev->devName, addr ? "explicit" : "implicit", strerror(errno));
+    ibDev->odp = 0;
+  } else if (mr == NULL) {
+    INFO(NCCL_NET, "NET/IB : ODP registration of %p size %lu failed on %s (%s), pinning it instead", addr, length, ibDev->devName, strerror(errno));
+  } else {
+    ibDev->odp = 1;
+  }
+  return mr;
+}
+
+// Remove an entry from the cache and deregister it. Called with the device lock held.
+static ncclResult_t ncclIbMrCacheEvict(struct ncclIbMrCache* cache, int slot) {
+  struct ibv_mr* mr = cache->slots[slot].mr;
+  if (cache->slots[slot].refs == 0) cache->idle--;
+  memmove(&cache->slots[slot], &cache->slots[--cache->population], sizeof(struct ncclIbMr));
+  if (cache->population == 0) {
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->capacity = 0;
+  }
+  NCCLCHECK(wrap_ibv_dereg_mr(mr));
+  return ncclSuccess;
+}
+
+// Deregister all unreferenced entries. Called with the device lock held.
+static ncclResult_t ncclIbMrCacheFlush(struct ncclIbMrCache* cache) {
+  for (int slot=cache->population-1; slot>=0; slot--) {
+    if (cache->slots[slot].refs == 0) NCCLCHECK(ncclIbMrCacheEvict(cache, slot));
+  }
+  return ncclSuccess;
+}
+
 /* DMA-BUF support */
-ncclResult_t ncclIbRegMrDmaBuf(void* comm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle) {
-  static_assert(offsetof(struct ncclIbSendComm, verbs) == offsetof(struct ncclIbRecvComm, verbs), "Send and recv comms must have verbs at the same offset");
-  assert(size > 0);
+static ncclResult_t ncclIbRegMrDmaBufInternal(struct ncclIbDevVerbs* devVerbs, void* data, size_t size, int type, uint64_t offset, int fd, int odp, struct ibv_mr** mhandle, int* isOdp) {
 
   static __thread uintptr_t pageSize = 0;
   if (pageSize == 0) pageSize = sysconf(_SC_PAGESIZE);
 
-  struct ncclIbVerbs* verbs = (struct ncclIbVerbs*)comm;
-  struct ncclIbMrCache* cache = &ncclIbDevs[verbs->dev].mrCache;
+  struct ncclIbMrCache* cache = &ncclIbDevs[devVerbs->ibDev].mrCache;
   uintptr_t addr = (uintptr_t)data & -pageSize;
   size_t pages = ((uintptr_t)data + size - addr + pageSize-1)/pageSize;
   ncclResult_t res;
-  pthread_mutex_lock(&ncclIbDevs[verbs->dev].lock);
+  struct ncclIbDev* ibDev = ncclIbDevs+devVerbs->ibDev;
+  *isOdp = 0;
+  pthread_mutex_lock(&ibDev->lock);
+  if (odp == NCCL_IB_ODP_IMPLICIT && ibDev->odp != 0) {
+    if (ibDev->odpMr == NULL) ibDev->odpMr = ncclIbRegMrOdp(ibDev, devVerbs->pd, NULL, SIZE_MAX);
+    if (ibDev->odpMr) {
+      *mhandle = ibDev->odpMr;
+      *isOdp = 1;
+      res = ncclSuccess;
+      goto returning;
+    }
+  }
   for (int slot=0; /*true*/; slot++) {
     if (slot == cache->population) { // didn't find in cache
       if (cache->population == cache->capacity) { // must grow cache
@@ -896,19 +1998,22 @@ ncclResult_t ncclIbRegMrDmaBuf(void* comm, void* data, size_t size, int type, ui
         NCCLCHECKGOTO(ncclRealloc(&cache->slots, cache->population, cache->capacity), res, returning);
       }
       // Deregister / register
-      struct ibv_mr* mr;
+      struct ibv_mr* mr = NULL;
       unsigned int flags = IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ;
       if (ncclIbRelaxedOrderingEnabled) flags |= IBV_ACCESS_RELAXED_ORDERING;
-      if (fd != -1) {
+      if (odp == NCCL_IB_ODP_EXPLICIT && ibDev->odp != 0) mr = ncclIbRegMrOdp(ibDev, devVerbs->pd, (void*)addr, pages*pageSize);
+      if (mr) {
+        *isOdp = 1;
+      } else if (fd != -1) {
         /* DMA-BUF support */
-        NCCLCHECKGOTO(wrap_ibv_reg_dmabuf_mr(&mr, verbs->pd, offset, pages*pageSize, addr, fd, flags), res, returning);
+        NCCLCHECKGOTO(wrap_ibv_reg_dmabuf_mr(&mr, devVerbs->pd, offset, pages*pageSize, addr, fd, flags), res, returning);
       } else {
         if (ncclIbRelaxedOrderingEnabled) {
           // Use IBVERBS_1.8 API - needed for IBV_ACCESS_RELAXED_ORDERING support
-          NCCLCHECKGOTO(wrap_ibv_reg_mr_iova2(&mr, verbs->pd, (void*)addr, pages*pageSize, addr, flags), res, returning);
+          NCCLCHECKGOTO(wrap_ibv_reg_mr_iova2(&mr, devVerbs->pd, (void*)addr, pages*pageSize, addr, flags), res, returning);
         }
         else {
-          NCCLCHECKGOTO(wrap_ibv_reg_mr(&mr, verbs->pd, (void*)addr, pages*pageSize, flags), res, returning);
+          NCCLCHECKGOTO(wrap_ibv_reg_mr(&mr, devVerbs->pd, (void*)addr, pages*pageSize, flags), res, returning);
         }
       }
       TRACE(NCCL_INIT,"regAddr %llx size %lld rkey %x fd %d", (unsigned long long)addr, (long long)pages*pageSize, mr->rkey, fd);
@@ -917,56 +2022,170 @@ ncclResult_t ncclIbRegMrDmaBuf(void* comm, void* data, size_t size, int type, ui
       cache->slots[slot].pages = pages;
       cache->slots[slot].refs = 1;
       cache->slots[slot].mr = mr;
-      *mhandle = (void*)mr;
+      cache->slots[slot].lastUse = ++cache->clock;
+      cache->slots[slot].odp = *isOdp;
+      *mhandle = mr;
       res = ncclSuccess;
       goto returning;
     }
-    else if (cache->slots[slot].addr == addr && cache->slots[slot].pages == pages) {
-      cache->slots[slot].refs += 1;
-      *mhandle = (void*)cache->slots[slot].mr;
+    // Any registration covering the pages will do
+    else if (cache->slots[slot].addr <= addr &&
+             addr + pages*pageSize <= cache->slots[slot].addr + cache->slots[slot].pages*pageSize) {
+      if (cache->slots[slot].refs++ == 0) cache->idle--;
+      cache->slots[slot].lastUse = ++cache->clock;
+      *mhandle = cache->slots[slot].mr;
+      *isOdp = cache->slots[slot].odp;
       res = ncclSuccess;
       goto returning;
     }
   }
 returning:
-  pthread_mutex_unlock(&ncclIbDevs[verbs->dev].lock);
+  pthread_mutex_unlock(&ibDev->lock);
   return res;
 }
 
-ncclResult_t ncclIbRegMr(void* comm, void* data, int size, int type, void** mhandle) {
-  return ncclIbRegMrDmaBuf(comm, data, (size_t)size, type, 0ULL, -1, mhandle);
-}
+static ncclResult_t ncclIbDeregMrInternal(struct ncclIbDevVerbs* devVerbs, struct ibv_mr* mhandle);
+
+// Register the buffer on every device of the connection
+ncclResult_t ncclIbRegMrDmaBuf(void* comm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle) {
+  static_assert(offsetof(struct ncclIbSendComm, verbs) == offsetof(struct ncclIbRecvComm, verbs), "Send and recv comms must have verbs at the same offset");
+  assert(size > 0);
 
-ncclResult_t ncclIbDeregMr(void* comm, void* mhandle) {
   struct ncclIbVerbs* verbs = (struct ncclIbVerbs*)comm;
-  struct ncclIbMrCache* cache = &ncclIbDevs[verbs->dev].mrCache;
+  struct ncclIbMrHandle* mrHandle;
+  ncclResult_t res = ncclSuccess;
+  int i = 0;
+  int odp = (fd == -1 && type == NCCL_PTR_HOST && size >= ncclParamIbOdpThreshold()) ? ncclParamIbOdp() : 0;
+  NCCLCHECK(ncclCalloc(&mrHandle, 1));
+  for (; i<verbs->ndevs; i++) {
+    int isOdp;
+    NCCLCHECKGOTO(ncclIbRegMrDmaBufInternal(verbs->devs+i, data, size, type, offset, fd, odp, mrHandle->mrs+i, &isOdp), res, fail);
+    mrHandle->odp |= isOdp << i;
+  }
+  mrHandle->data = data;
+  mrHandle->size = size;
+  *mhandle = (void*)mrHandle;
+  return ncclSuccess;
+fail:
+  while (i-- > 0) ncclIbDeregMrInternal(verbs->devs+i, mrHandle->mrs[i]);
+  free(mrHandle);
+  return res;
+}
+
+ncclResult_t ncclIbRegMr(void* comm, void* data, size_t size, int type, void** mhandle) {
+  return ncclIbRegMrDmaBuf(comm, data, size, type, 0ULL, -1, mhandle);
+}
+
+static ncclResult_t ncclIbDeregMrInternal(struct ncclIbDevVerbs* devVerbs, struct ibv_mr* mhandle) {
+  struct ncclIbMrCache* cache = &ncclIbDevs[devVerbs->ibDev].mrCache;
   ncclResult_t res;
-  pthread_mutex_lock(&ncclIbDevs[verbs->dev].lock);
+  pthread_mutex_lock(&ncclIbDevs[devVerbs->ibDev].lock);
+  // The implicit ODP registration stays until the PD goes away
+  if (mhandle == ncclIbDevs[devVerbs->ibDev].odpMr) {
+    res = ncclSuccess;
+    goto returning;
+  }
   for (int i=0; i < cache->population; i++) {
     if (mhandle == cache->slots[i].mr) {
+      res = ncclSuccess;
       if (0 == --cache->slots[i].refs) {
-        memmove(&cache->slots[i], &cache->slots[--cache->population], sizeof(struct ncclIbMr));
-        if (cache->population == 0) {
-          free(cache->slots);
-          cache->slots = NULL;
-          cache->capacity = 0;
+        // Keep the registration around for the next user of these pages, evicting
+        // the least recently used idle entry when there are too many.
+        cache->idle++;
+        cache->slots[i].lastUse = ++cache->clock;
+        if (cache->idle > ncclParamIbMrCacheIdle()) {
+          int lru = -1;
+          for (int j=0; j<cache->population; j++) {
+            if (cache->slots[j].refs == 0 && (lru == -1 || cache->slots[j].lastUse < cache->slots[lru].lastUse)) lru = j;
+          }
+          res = ncclIbMrCacheEvict(cache, lru);
         }
-        NCCLCHECKGOTO(wrap_ibv_dereg_mr((struct ibv_mr*)mhandle), res, returning);
       }
-      res = ncclSuccess;
       goto returning;
     }
   }
   WARN("NET/IB: could not find mr %p inside cache of %d entries", mhandle, cache->population);
   res = ncclInternalError;
 returning:
-  pthread_mutex_unlock(&ncclIbDevs[verbs->dev].lock);
+  pthread_mutex_unlock(&ncclIbDevs[devVerbs->ibDev].lock);
   return res;
 }
 
+ncclResult_t ncclIbDeregMr(void* comm, void* mhandle) {
+  struct ncclIbVerbs* verbs = (struct ncclIbVerbs*)comm;
+  struct ncclIbMrHandle* mrHandle = (struct ncclIbMrHandle*)mhandle;
+  for (int i=0; i<verbs->ndevs; i++) NCCLCHECK(ncclIbDeregMrInternal(verbs->devs+i, mrHandle->mrs[i]));
+  free(mrHandle);
+  return ncclSuccess;
+}
+
+// Ask the HCAs to fault in the pages of an ODP buffer the first time it is
+// used, instead of taking a fault on every page during the first transfers.
+// This is only advice; the prefetch is asynchronous and failures are harmless.
+static void ncclIbOdpPrefetch(struct ncclIbVerbs* verbs, struct ncclIbMrHandle* mrHandle) {
+  if (mrHandle->odp == 0 || mrHandle->prefetched) return;
+  mrHandle->prefetched = 1;
+  static int prefetchUnsupported = 0;
+  if (prefetchUnsupported) return;
+  for (int i=0; i<verbs->ndevs; i++) {
+    if ((mrHandle->odp & (1 << i)) == 0) continue;
+    // SGE lengths are 32 bits
+    for (size_t offset=0; offset<mrHandle->size; offset += 1UL<<30) {
+      struct ibv_sge sge;
+      sge.addr = (uint64_t)mrHandle->data + offset;
+      sge.length = std::min(mrHandle->size-offset, 1UL<<30);
+      sge.lkey = mrHandle->mrs[i]->lkey;
+      ncclResult_t res = wrap_ibv_advise_mr(verbs->devs[i].pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE, 0, &sge, 1);
+      if (res == ncclInvalidUsage) {
+        INFO(NCCL_NET, "NET/IB : ODP prefetch needs a build against rdma-core, pages will be faulted in on demand");
+        prefetchUnsupported = 1;
+        return;
+      }
+      if (res != ncclSuccess) break;
+    }
+  }
+}
+
 NCCL_PARAM(IbSplitDataOnQps, "IB_SPLIT_DATA_ON_QPS", 1);
+NCCL_PARAM(IbSplitDataThreshold, "IB_SPLIT_DATA_THRESHOLD", 0);
+
+// Number of QPs a message is sent on. Messages below NCCL_IB_SPLIT_DATA_THRESHOLD
+// are pinned to the first QP, and therefore to the first entry of
+// NCCL_IB_TC_LIST/NCCL_IB_SL_LIST. Both sides decide from the sizes posted by the
+// receiver, so that they agree on which QPs carry the completions.
+static int ncclIbSplitQps(int nqps, int maxSize, int* pinned) {
+  *pinned = 0;
+  if (ncclParamIbSplitDataOnQps() == 0) return 1;
+  if (maxSize < ncclParamIbSplitDataThreshold()) {
+    *pinned = 1;
+    return 1;
+  }
+  return nqps;
+}
+
+// The receives of a multi-recv often are consecutive slots of the same remote
+// buffer, e.g. PXN traffic from several GPUs of a node going into the shared
+// buffers of one peer. Merge such writes into a single WR with one SGE per
+// request, so that they go out as one larger RDMA write.
+static void ncclIbCoalesceWrs(struct ncclIbSendComm* comm, int nreqs, int maxSge) {
+  struct ibv_send_wr* prev = NULL;
+  uint64_t prevEnd = 0;
+  for (int r=0; r<nreqs; r++) {
+    struct ibv_send_wr* wr = comm->wrs+r;
+    if (prev && wr->num_sge == 1 && prev->num_sge < maxSge &&
+        prev->wr.rdma.rkey == wr->wr.rdma.rkey && prevEnd == wr->wr.rdma.remote_addr) {
+      prev->num_sge++;
+      prev->next = wr->next;
+      prevEnd += comm->sges[r].length;
+      continue;
+    }
+    prev = wr->num_sge == 1 ? wr : NULL;
+    prevEnd = wr->wr.rdma.remote_addr + comm->sges[r].length;
+  }
+}
 
-ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
+// Sets *posted to 0, without side effects, when a DCI has no room for the WRs.
+ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot, int* posted) {
   struct ncclIbRequest** reqs = comm->fifoReqs[slot];
   volatile struct ncclIbSendFifo* slots = comm->fifo[slot];
   int nreqs = slots[0].nreqs;
@@ -980,12 +2199,10 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
 
     struct ibv_sge* sge = comm->sges+r;
     sge->addr=(uintptr_t)reqs[r]->send.data;
-    sge->lkey=reqs[r]->send.lkey;
 
     wr->opcode = IBV_WR_RDMA_WRITE;
     wr->send_flags = 0;
     wr->wr.rdma.remote_addr = slots[r].addr;
-    wr->wr.rdma.rkey = slots[r].rkey;
     wr->next = wr+1;
     wr_id += (reqs[r] - comm->verbs.reqs) << (r*8);
   }
@@ -1019,11 +2236,26 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
   lastWr->next = NULL;
   lastWr->send_flags = IBV_SEND_SIGNALED;
 
-  // Multi-QP: make sure IB writes are multiples of 128B so that LL and LL128 protocols still work
+  // Multi-QP: make sure IB writes are multiples of 128B so that LL and LL128 protocols still work.
+  // QPs are spread across the devices of the connection, so splitting data on QPs also
+  // stripes it across devices; each device uses its own lkey and the matching remote rkey.
   const int align = 128;
-  const int nqps = ncclParamIbSplitDataOnQps() ? comm->nqps : 1;
+  int maxSize = 0, pinned;
+  for (int r=0; r<nreqs; r++) maxSize = std::max(maxSize, (int)slots[r].size);
+  const int nqps = ncclIbSplitQps(comm->nqps, maxSize, &pinned);
+  const int nwrs = lastWr-comm->wrs+1;
+  *posted = 1;
+  for (int q=0; q<nqps; q++) {
+    if (ncclIbDcReserve(comm->qps+(pinned ? 0 : (comm->qpIndex+q)%comm->nqps), nwrs)) continue;
+    while (q-- > 0) ncclIbDcUnreserve(comm->qps+(pinned ? 0 : (comm->qpIndex+q)%comm->nqps), nwrs);
+    *posted = 0;
+    return ncclSuccess;
+  }
   for (int q=0; q<nqps; q++) {
+    struct ncclIbQp* qp = comm->qps+(pinned ? 0 : comm->qpIndex);
     for (int r=0; r<nreqs; r++) {
+      comm->sges[r].lkey = reqs[r]->send.lkeys[qp->devIndex];
+      comm->wrs[r].wr.rdma.rkey = slots[r].rkeys[qp->remDevIndex];
       int chunkSize = DIVUP(DIVUP(reqs[r]->send.size, nqps), align) * align;
       int length = std::min(reqs[r]->send.size-reqs[r]->send.offset, chunkSize);
       if (length <= 0) {
@@ -1035,9 +2267,11 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
         comm->wrs[r].num_sge = 1;
       }
     }
-    struct ibv_send_wr* bad_wr;
-    NCCLCHECK(wrap_ibv_post_send(comm->qps[comm->qpIndex], comm->wrs, &bad_wr));
-    comm->qpIndex = (comm->qpIndex+1)%comm->nqps;
+    // Only unsplit writes are contiguous on the remote side
+    int maxSge = std::min(ncclIbDevs[comm->verbs.devs[qp->devIndex].ibDev].maxSendSge, NCCL_NET_IB_MAX_RECVS);
+    if (nqps == 1 && nreqs > 1 && maxSge > 1 && qp->dci == NULL) ncclIbCoalesceWrs(comm, nreqs, maxSge);
+    NCCLCHECK(ncclIbPostSend(&comm->verbs, qp, comm->wrs));
+    if (!pinned) comm->qpIndex = (comm->qpIndex+1)%comm->nqps;
 
     for (int r=0; r<nreqs; r++) {
       int chunkSize = DIVUP(DIVUP(reqs[r]->send.size, nqps), align) * align;
@@ -1055,7 +2289,8 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
   if (comm->ready == 0) { WARN("NET/IB: ncclIbIsend() called when comm->ready == 0"); return ncclInternalError; }
   if (comm->ready == 0) { *request = NULL; return ncclSuccess; }
 
-  struct ibv_mr* mr = (struct ibv_mr*)mhandle;
+  struct ncclIbMrHandle* mrHandle = (struct ncclIbMrHandle*)mhandle;
+  ncclIbOdpPrefetch(&comm->verbs, mrHandle);
 
   // Wait for the receiver to have posted the corresponding receive
   int nreqs = 0;
@@ -1065,10 +2300,18 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
   struct ncclIbRequest** reqs = comm->fifoReqs[slot];
   slots = comm->fifo[slot];
   int idx = comm->fifoHead+1;
-  if (slots[0].idx != idx) { *request = NULL; return ncclSuccess; }
+  if (comm->fifoDm) NCCLCHECK(ncclIbFifoDmRead(comm, slot, 0, idx));
+  if (slots[0].idx != idx) {
+    *request = NULL;
+    return ncclSuccess;
+  }
   nreqs = slots[0].nreqs;
   // Wait until all data has arrived
-  for (int r=1; r<nreqs; r++) while(slots[r].idx != idx);
+  for (int r=1; r<nreqs; r++) {
+    while (slots[r].idx != idx) {
+      if (comm->fifoDm) NCCLCHECK(ncclIbFifoDmRead(comm, slot, r, idx));
+    }
+  }
   __sync_synchronize(); // order the nreqsPtr load against tag/rkey/addr loads below
   for (int r=0; r<nreqs; r++) {
     if (reqs[r] != NULL || slots[r].tag != tag) continue;
@@ -1082,12 +2325,12 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
         r, nreqs, tag, ncclSocketToString(&addr, line), size, slots[r].size);
       return ncclInvalidUsage;
     } // plus any potential programming errors
-    else if (slots[r].size < 0 || slots[r].addr == 0 || slots[r].rkey == 0) {
+    else if (slots[r].size < 0 || slots[r].addr == 0 || slots[r].rkeys[0] == 0) {
       char line[SOCKET_NAME_MAXLEN + 1];
       union ncclSocketAddress addr;
       ncclSocketGetAddr(&comm->sock, &addr);
       WARN("NET/IB : req %d/%d tag %x peer %s posted incorrect receive info: size %d addr %lx rkey %x",
-        r, nreqs, tag, ncclSocketToString(&addr, line), slots[r].size, slots[r].addr, slots[r].rkey);
+        r, nreqs, tag, ncclSocketToString(&addr, line), slots[r].size, slots[r].addr, slots[r].rkeys[0]);
       return ncclInternalError;
     }
     struct ncclIbRequest* req;
@@ -1098,10 +2341,14 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
     req->nreqs = nreqs;
     req->send.size = size;
     req->send.data = data;
-    req->send.lkey = mr->lkey;
+    for (int i=0; i<comm->verbs.ndevs; i++) req->send.lkeys[i] = mrHandle->mrs[i]->lkey;
     req->send.offset = 0;
-    req->events = ncclParamIbSplitDataOnQps() ? comm->nqps : 1;
-    if (comm->gidInfo.link_layer == IBV_LINK_LAYER_ETHERNET) req->gidInfo = &comm->gidInfo;
+    // One completion per QP used by ncclIbMultiSend, on the CQ of that QP's device
+    int maxSize = 0, pinned;
+    for (int i=0; i<nreqs; i++) maxSize = std::max(maxSize, (int)slots[i].size);
+    const int nqps = ncclIbSplitQps(comm->nqps, maxSize, &pinned);
+    for (int q=0; q<nqps; q++) req->events[comm->qps[pinned ? 0 : (comm->qpIndex+q)%comm->nqps].devIndex]++;
+    if (comm->gidInfo[0].link_layer == IBV_LINK_LAYER_ETHERNET) req->gidInfo = comm->gidInfo;
     *request = reqs[r] = req;
 
     // If this is a multi-recv, send only when all requests have matched.
@@ -1110,7 +2357,15 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
     }
 
     TIME_START(0);
-    NCCLCHECK(ncclIbMultiSend(comm, slot));
+    int posted;
+    NCCLCHECK(ncclIbMultiSend(comm, slot, &posted));
+    if (!posted) {
+      // Out of DCI room, retry the whole set later
+      reqs[r] = NULL;
+      NCCLCHECK(ncclIbFreeRequest(req));
+      *request = NULL;
+      return ncclSuccess;
+    }
 
     // Clear slots[0]->nreqs, as well as other fields to help debugging and sanity checks
     memset((void*)slots, 0, sizeof(struct ncclIbSendFifo));
@@ -1133,8 +2388,8 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, int
 
   for (int i=0; i<n; i++) {
     localElem[i].addr = (uint64_t)data[i];
-    struct ibv_mr* mr = (struct ibv_mr*)mhandles[i];
-    localElem[i].rkey = mr->rkey;
+    struct ncclIbMrHandle* mrHandle = (struct ncclIbMrHandle*)mhandles[i];
+    for (int d=0; d<comm->verbs.ndevs; d++) localElem[i].rkeys[d] = mrHandle->mrs[d]->rkey;
     localElem[i].nreqs = n;
     localElem[i].size = sizes[i]; // Sanity/Debugging
     localElem[i].tag = tags[i];
@@ -1174,11 +2429,10 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, int
   if (slot == 0) {
     wr.send_flags |= IBV_SEND_SIGNALED;
     wr.wr_id = req - comm->verbs.reqs;
-    req->events++;
+    req->events[comm->qps[0].devIndex]++;
   }
 
-  struct ibv_send_wr* bad_wr;
-  NCCLCHECK(wrap_ibv_post_send(comm->qps[0], &wr, &bad_wr));
+  NCCLCHECK(ncclIbPostSend(&comm->verbs, comm->qps+0, &wr));
   comm->remFifo.fifoTail++;
 
   return ncclSuccess;
@@ -1189,13 +2443,16 @@ ncclResult_t ncclIbIrecv(void* recvComm, int n, void** data, int* sizes, int* ta
   if (comm->ready == 0) { WARN("NET/IB: ncclIbIrecv() called when comm->ready == 0"); return ncclInternalError; }
   if (comm->ready == 0) { *request = NULL; return ncclSuccess; }
   if (n > NCCL_NET_IB_MAX_RECVS) return ncclInternalError;
+  for (int i=0; i<n; i++) ncclIbOdpPrefetch(&comm->verbs, (struct ncclIbMrHandle*)mhandles[i]);
+  // Room for the fifo write, see ncclIbPostFifo
+  if (!ncclIbDcReserve(comm->qps+0, 1)) { *request = NULL; return ncclSuccess; }
 
   struct ncclIbRequest* req;
   NCCLCHECK(ncclIbGetRequest(&comm->verbs, &req));
   req->type = NCCL_NET_IB_REQ_RECV;
   req->sock = &comm->sock;
   req->nreqs = n;
-  if (comm->gidInfo.link_layer == IBV_LINK_LAYER_ETHERNET) req->gidInfo = &comm->gidInfo;
+  if (comm->gidInfo[0].link_layer == IBV_LINK_LAYER_ETHERNET) req->gidInfo = comm->gidInfo;
   for (int i=0; i<n; i++) req->recv.sizes[i] = 0;
 
   struct ibv_recv_wr wr;
@@ -1206,15 +2463,26 @@ ncclResult_t ncclIbIrecv(void* recvComm, int n, void** data, int* sizes, int* ta
   wr.num_sge = 0;
 
   TIME_START(1);
-  const int nqps = ncclParamIbSplitDataOnQps() ? comm->nqps : 1;
+  int maxSize = 0, pinned;
+  for (int i=0; i<n; i++) maxSize = std::max(maxSize, sizes[i]);
+  const int nqps = ncclIbSplitQps(comm->nqps, maxSize, &pinned);
   for (int q=0; q<nqps; q++) {
-    struct ibv_qp* qp = comm->qps[comm->qpIndex];
+    struct ncclIbQp* qp = comm->qps+(pinned ? 0 : comm->qpIndex);
+    struct ncclIbDevVerbs* devVerbs = comm->verbs.devs+qp->devIndex;
     struct ibv_recv_wr* bad_wr;
-    NCCLCHECK(wrap_ibv_post_recv(qp, &wr, &bad_wr));
-    comm->qpIndex = (comm->qpIndex+1)%comm->nqps;
+    if (devVerbs->srq) {
+      // The completion will come on this QP, whichever SRQ entry it consumes
+      pthread_mutex_lock(&ncclIbDevs[devVerbs->ibDev].cqLock);
+      qp->srqReqs[qp->srqHead++ % MAX_REQUESTS] = req - comm->verbs.reqs;
+      pthread_mutex_unlock(&ncclIbDevs[devVerbs->ibDev].cqLock);
+      NCCLCHECK(wrap_ibv_post_srq_recv(devVerbs->srq, &wr, &bad_wr));
+    } else {
+      NCCLCHECK(wrap_ibv_post_recv(qp->qp, &wr, &bad_wr));
+    }
+    req->events[qp->devIndex]++;
+    if (!pinned) comm->qpIndex = (comm->qpIndex+1)%comm->nqps;
   }
   TIME_STOP(1);
-  req->events = nqps;
 
   *request = req;
 
@@ -1230,13 +2498,19 @@ ncclResult_t ncclIbIflush(void* recvComm, int n, void** data, int* sizes, void**
   int last = -1;
   for (int i=0; i<n; i++) if (sizes[i]) last = i;
   if (comm->gpuFlush.enabled == 0 || last == -1) return ncclSuccess;
+  // A NULL request means no flush is needed, so a flush can't wait for DCI room like sends and receives do
+  if (comm->verbs.dc && !ncclIbDcReserve(&comm->gpuFlush.dcQp, 1)) {
+    WARN("NET/IB : no room on DCI %u for a flush, increase NCCL_IB_DC_DCIS", comm->gpuFlush.dcQp.dci->qp->qp_num);
+    return ncclInternalError;
+  }
 
   // Only flush once using the last non-zero receive
   struct ncclIbRequest* req;
   NCCLCHECK(ncclIbGetRequest(&comm->verbs, &req));
   req->type = NCCL_NET_IB_REQ_FLUSH;
   req->sock = &comm->sock;
-  struct ibv_mr* mr = (struct ibv_mr*)mhandles[last];
+  req->events[0] = 1; // The flush QP is on the first device
+  struct ibv_mr* mr = ((struct ncclIbMrHandle*)mhandles[last])->mrs[0];
 
   struct ibv_send_wr wr;
   memset(&wr, 0, sizeof(wr));
@@ -1250,20 +2524,131 @@ ncclResult_t ncclIbIflush(void* recvComm, int n, void** data, int* sizes, void**
   wr.send_flags = IBV_SEND_SIGNALED;
 
   TIME_START(4);
-  struct ibv_send_wr* bad_wr;
-  NCCLCHECK(wrap_ibv_post_send(comm->gpuFlush.qp, &wr, &bad_wr));
+  if (comm->verbs.dc) {
+    NCCLCHECK(ncclIbPostSend(&comm->verbs, &comm->gpuFlush.dcQp, &wr));
+  } else {
+    struct ibv_send_wr* bad_wr;
+    NCCLCHECK(wrap_ibv_post_send(comm->gpuFlush.qp, &wr, &bad_wr));
+  }
   TIME_STOP(4);
 
   *request = req;
   return ncclSuccess;
 }
 
+// Account for one successful completion. Without a shared CQ or an SRQ, it
+// belongs to the polling comm. Otherwise the QP number tells which comm and QP
+// it is for, or for a DCI, the order of the WRs it posted. Events may be
+// consumed by the thread owning that comm.
+static ncclResult_t ncclIbProcessWc(struct ncclIbVerbs* verbs, int devIndex, struct ibv_wc* wc) {
+  struct ncclIbDevVerbs* devVerbs = verbs->devs+devIndex;
+  struct ncclIbQp* qp = NULL;
+  uint64_t wrId = wc->wr_id;
+  if (devVerbs->sharedCq || devVerbs->srq) {
+    struct ncclIbQpMapEntry* entry = ncclIbQpMapFind(&ncclIbDevs[devVerbs->ibDev].qpMap, wc->qp_num);
+    if (entry == NULL) {
+      // Left behind by a connection which has been closed since
+      TRACE(NCCL_NET, "NET/IB : Ignoring completion for closed QP %u on dev %s", wc->qp_num, ncclIbDevs[devVerbs->ibDev].devName);
+      return ncclSuccess;
+    }
+    if (entry->dci) {
+      struct ncclIbDciPost post;
+      NCCLCHECK(ncclIbDciPop(entry->dci, &post));
+      if (post.verbs == NULL) {
+        // The DCI signaled the WR itself, or the connection has been closed since
+        TRACE(NCCL_NET, "NET/IB : Ignoring completion on DCI %u of dev %s", wc->qp_num, ncclIbDevs[devVerbs->ibDev].devName);
+        return ncclSuccess;
+      }
+      verbs = post.verbs;
+      devIndex = post.devIndex;
+      wrId = post.wrId;
+    } else {
+      verbs = entry->verbs;
+      devIndex = entry->devIndex;
+      qp = entry->qp;
+    }
+  }
+
+  struct ncclIbRequest* req = verbs->reqs+(wrId & 0xff);
+  if (qp && qp->srqReqs && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+    // SRQ receives are not tied to a request, use the order they were posted for this QP
+    req = verbs->reqs+qp->srqReqs[qp->srqTail++ % MAX_REQUESTS];
+  }
+  if (req->type == NCCL_NET_IB_REQ_SEND) {
+    for (int i=0; i<req->nreqs; i++) {
+      struct ncclIbRequest* sendReq = verbs->reqs+((wrId >> (i*8)) & 0xff);
+      if ((sendReq->events[devIndex] <= 0)) return ncclInternalError;
+      __atomic_fetch_sub(sendReq->events+devIndex, 1, __ATOMIC_RELEASE);
+    }
+  } else {
+    if (req && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+      if (req->type != NCCL_NET_IB_REQ_RECV) return ncclInternalError;
+      if (req->nreqs > 1) {
+        // In the case of a multi recv, we only set sizes to 0 or 1.
+        for (int i=0; i<req->nreqs; i++) {
+          req->recv.sizes[i] = (wc->imm_data >> i) & 0x1;
+        }
+      } else {
+        // Every QP carries the full size, don't accumulate it
+        req->recv.sizes[0] = wc->imm_data;
+      }
+    }
+    __atomic_fetch_sub(req->events+devIndex, 1, __ATOMIC_RELEASE);
+  }
+  return ncclSuccess;
+}
+
+// Completions are retrieved in batches and dispatched to whichever requests
+// they belong to, so that testing the other outstanding requests of the comm
+// (one per sub in the proxy progress) does not need more verbs calls.
+#define NCCL_IB_MAX_POLL_BATCH 64
+NCCL_PARAM(IbPollBatch, "IB_POLL_BATCH", 16);
+
+static int ncclIbPollBatch() {
+  static int pollBatch = -1;
+  if (pollBatch == -1) pollBatch = std::max(1, std::min((int)ncclParamIbPollBatch(), NCCL_IB_MAX_POLL_BATCH));
+  return pollBatch;
+}
+
+static ncclResult_t ncclIbPollCq(struct ncclIbRequest* r, int devIndex, int* wrDone) {
+  struct ibv_wc wcs[NCCL_IB_MAX_POLL_BATCH];
+  TIME_START(3);
+  NCCLCHECK(wrap_ibv_poll_cq(r->verbs->devs[devIndex].cq, ncclIbPollBatch(), wcs, wrDone));
+  if (*wrDone == 0) { TIME_CANCEL(3); } else { TIME_STOP(3); }
+
+  for (int w=0; w<*wrDone; w++) {
+    struct ibv_wc *wc = wcs+w;
+    if (wc->status != IBV_WC_SUCCESS) {
+      char line[SOCKET_NAME_MAXLEN+1];
+      union ncclSocketAddress addr;
+      ncclSocketGetAddr(r->sock, &addr);
+      char localGidString[INET6_ADDRSTRLEN] = "";
+      char remoteGidString[INET6_ADDRSTRLEN] = "";
+      const char* localGidStr = NULL, *remoteGidStr = NULL;
+      if (r->gidInfo) {
+          localGidStr = inet_ntop(AF_INET6, &r->gidInfo[devIndex].localGid, localGidString, sizeof(localGidString));
+          remoteGidStr = inet_ntop(AF_INET6, &r->gidInfo[devIndex].remoteGid, remoteGidString, sizeof(remoteGidString));
+      }
+      WARN("NET/IB : Got completion from peer %s with error %d, opcode %d, len %d, vendor err %d (%s) on dev %s qpn %u%s%s%s%s",
+          ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err, reqTypeStr[r->type],
+          ncclIbDevs[r->verbs->devs[devIndex].ibDev].devName, wc->qp_num,
+          localGidStr ?  " localGid ":"", localGidString, remoteGidStr ? " remoteGid ":"", remoteGidString);
+      return ncclRemoteError;
+    }
+    NCCLCHECK(ncclIbProcessWc(r->verbs, devIndex, wc));
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
   struct ncclIbRequest *r = (struct ncclIbRequest*)request;
   *done = 0;
 
   while (1) {
-    if (r->events == 0) {
+    int events = 0;
+    // With a shared CQ, our completions may have been processed by another thread
+    for (int i=0; i<r->verbs->ndevs; i++) events += __atomic_load_n(r->events+i, __ATOMIC_ACQUIRE);
+    if (events == 0) {
       *done = 1;
       if (sizes && r->type == NCCL_NET_IB_REQ_RECV) {
         for (int i=0; i<r->nreqs; i++) sizes[i] = r->recv.sizes[i];
@@ -1272,53 +2657,28 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
       return ncclSuccess;
     }
 
-    int wrDone = 0;
-    struct ibv_wc wcs[4];
-    TIME_START(3);
-    NCCLCHECK(wrap_ibv_poll_cq(r->verbs->cq, 4, wcs, &wrDone));
-    if (wrDone == 0) { TIME_CANCEL(3); } else { TIME_STOP(3); }
-    if (wrDone == 0) return ncclSuccess;
-
-    for (int w=0; w<wrDone; w++) {
-      struct ibv_wc *wc = wcs+w;
-      if (wc->status != IBV_WC_SUCCESS) {
-        char line[SOCKET_NAME_MAXLEN+1];
-        union ncclSocketAddress addr;
-        ncclSocketGetAddr(r->sock, &addr);
-        char localGidString[INET6_ADDRSTRLEN] = "";
-        char remoteGidString[INET6_ADDRSTRLEN] = "";
-        const char* localGidStr = NULL, *remoteGidStr = NULL;
-        if (r->gidInfo) {
-            localGidStr = inet_ntop(AF_INET6, &r->gidInfo->localGid, localGidString, sizeof(localGidString));
-            remoteGidStr = inet_ntop(AF_INET6, &r->gidInfo->remoteGid, remoteGidString, sizeof(remoteGidString));
-        }
-        WARN("NET/IB : Got completion from peer %s with error %d, opcode %d, len %d, vendor err %d (%s)%s%s%s%s",
-            ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err, reqTypeStr[r->type],
-            localGidStr ?  " localGid ":"", localGidString, remoteGidStr ? " remoteGid ":"", remoteGidString);
-        return ncclRemoteError;
-      }
-
-      struct ncclIbRequest* req = r->verbs->reqs+(wc->wr_id & 0xff);
-      if (req->type == NCCL_NET_IB_REQ_SEND) {
-        for (int i=0; i<req->nreqs; i++) {
-          struct ncclIbRequest* sendReq = r->verbs->reqs+((wc->wr_id >> (i*8)) & 0xff);
-          if ((sendReq->events <= 0)) return ncclInternalError;
-          sendReq->events--;
-        }
-      } else {
-        if (req && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-          if (req->type != NCCL_NET_IB_REQ_RECV) return ncclInternalError;
-          if (req->nreqs > 1) {
-            // In the case of a multi recv, we only set sizes to 0 or 1.
-            for (int i=0; i<req->nreqs; i++) {
-              req->recv.sizes[i] = (wc->imm_data >> i) & 0x1;
-            }
-          } else {
-            req->recv.sizes[0] += wc->imm_data;
-          }
-        }
-        req->events--;
-      }
+    // Only poll the CQs of the devices we still expect completions from. A
+    // shared CQ returns completions of all connections on the device, so other
+    // requests tested in the same progress iteration usually find theirs
+    // already processed and skip polling.
+    int totalWrDone = 0, drained = 1;
+    for (int i=0; i<r->verbs->ndevs; i++) {
+      if (__atomic_load_n(r->events+i, __ATOMIC_ACQUIRE) == 0) continue;
+      struct ncclIbDevVerbs* devVerbs = r->verbs->devs+i;
+      int locked = devVerbs->sharedCq || devVerbs->srq;
+      int wrDone = 0;
+      if (locked) pthread_mutex_lock(&ncclIbDevs[devVerbs->ibDev].cqLock);
+      ncclResult_t res = ncclIbPollCq(r, i, &wrDone);
+      if (locked) pthread_mutex_unlock(&ncclIbDevs[devVerbs->ibDev].cqLock);
+      NCCLCHECK(res);
+      totalWrDone += wrDone;
+      if (wrDone == ncclIbPollBatch()) drained = 0;
+    }
+    if (totalWrDone == 0) return ncclSuccess;
+    // A partial batch means the CQs were empty; check our events once more,
+    // but don't poll again until the next call.
+    if (drained) {
+      for (int i=0; i<r->verbs->ndevs; i++) if (__atomic_load_n(r->events+i, __ATOMIC_ACQUIRE)) return ncclSuccess;
     }
   }
 }
@@ -1327,9 +2687,15 @@ ncclResult_t ncclIbCloseSend(void* sendComm) {
   struct ncclIbSendComm* comm = (struct ncclIbSendComm*)sendComm;
   if (comm) {
     NCCLCHECK(ncclSocketClose(&comm->sock));
-    for (int q=0; q<comm->nqps; q++)
-      if (comm->qps[q] != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->qps[q]));
+    for (int q=0; q<comm->nqps; q++) {
+      NCCLCHECK(ncclIbDcDisconnectQp(comm->qps+q));
+      if (comm->qps[q].qp == NULL) continue;
+      ncclIbDeregisterQp(&comm->verbs, comm->qps[q].devIndex, comm->qps[q].qp);
+      NCCLCHECK(wrap_ibv_destroy_qp(comm->qps[q].qp));
+      free(comm->qps[q].srqReqs);
+    }
     if (comm->fifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(comm->fifoMr));
+    if (comm->fifoDm != NULL) NCCLCHECK(wrap_ibv_free_dm(comm->fifoDm));
     NCCLCHECK(ncclIbDestroyVerbs(&comm->verbs));
     free(comm);
   }
@@ -1341,11 +2707,21 @@ ncclResult_t ncclIbCloseRecv(void* recvComm) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
   if (comm) {
     NCCLCHECK(ncclSocketClose(&comm->sock));
-    for (int q=0; q<comm->nqps; q++)
-      if (comm->qps[q] != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->qps[q]));
+    for (int q=0; q<comm->nqps; q++) {
+      NCCLCHECK(ncclIbDcDisconnectQp(comm->qps+q));
+      if (comm->qps[q].qp == NULL) continue;
+      ncclIbDeregisterQp(&comm->verbs, comm->qps[q].devIndex, comm->qps[q].qp);
+      NCCLCHECK(wrap_ibv_destroy_qp(comm->qps[q].qp));
+      free(comm->qps[q].srqReqs);
+    }
     if (comm->gpuFlush.enabled) {
-      if (comm->gpuFlush.qp != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->gpuFlush.qp));
+      NCCLCHECK(ncclIbDcDisconnectQp(&comm->gpuFlush.dcQp));
+      if (comm->gpuFlush.qp != NULL) {
+        ncclIbDeregisterQp(&comm->verbs, 0, comm->gpuFlush.qp);
+        NCCLCHECK(wrap_ibv_destroy_qp(comm->gpuFlush.qp));
+      }
       if (comm->gpuFlush.hostMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(comm->gpuFlush.hostMr));
+      if (comm->gpuFlush.hostDm != NULL) NCCLCHECK(wrap_ibv_free_dm(comm->gpuFlush.hostDm));
     }
     if (comm->remFifo.mr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(comm->remFifo.mr));
     NCCLCHECK(ncclIbDestroyVerbs(&comm->verbs));
@@ -1380,6 +2756,10 @@ ncclNet_t ncclNetIb = {
   ncclIbTest,
   ncclIbCloseSend,
   ncclIbCloseRecv,
-  ncclIbCloseListen
+  ncclIbCloseListen,
+  NULL, // No batched isend
+  NULL, // No batched test
+  NULL, // No receive signals
+  NULL  // No batched irecv
 };
 
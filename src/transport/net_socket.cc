@@ -9,12 +9,15 @@
 #include "socket.h"
 #include "net.h"
 #include "param.h"
+#include "uringwrap.h"
 
 #include <pthread.h>
 #include <stdlib.h>
 #include <poll.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
 
 /* Init functions */
 static int ncclNetIfs = -1;
@@ -25,6 +28,13 @@ struct ncclNetSocketDev {
 };
 static struct ncclNetSocketDev ncclNetSocketDevs[MAX_IFS];
 
+// With NCCL_SOCKET_MERGE_IFS, all interfaces form a single device. Its data
+// sockets are spread across the interfaces in proportion to their speed, so
+// that the chunks of a message, dealt round-robin to the sockets, are too.
+NCCL_PARAM(SocketMergeIfs, "SOCKET_MERGE_IFS", 0);
+static int ncclNetSocketMerged = 0;
+static char ncclNetSocketMergedName[(MAX_IF_NAME_SIZE+1)*MAX_IFS];
+
 pthread_mutex_t ncclNetSocketLock = PTHREAD_MUTEX_INITIALIZER;
 
 static ncclResult_t ncclNetSocketGetPciPath(char* devName, char** pciPath) {
@@ -60,6 +70,15 @@ ncclResult_t ncclNetSocketInit(ncclDebugLogger_t logFunction) {
         }
         line[MAX_LINE_LEN] = '\0';
         INFO(NCCL_INIT|NCCL_NET,"NET/Socket : Using%s", line);
+        if (ncclParamSocketMergeIfs() && ncclNetIfs > 1) {
+          ncclNetSocketMerged = 1;
+          ncclNetSocketMergedName[0] = '\0';
+          for (int i=0; i<ncclNetIfs; i++) {
+            if (i) strcat(ncclNetSocketMergedName, "+");
+            strcat(ncclNetSocketMergedName, ncclNetSocketDevs[i].devName);
+          }
+          INFO(NCCL_INIT|NCCL_NET, "NET/Socket : Merging interfaces into a single device %s", ncclNetSocketMergedName);
+        }
       }
     }
     pthread_mutex_unlock(&ncclNetSocketLock);
@@ -68,7 +87,7 @@ ncclResult_t ncclNetSocketInit(ncclDebugLogger_t logFunction) {
 }
 
 ncclResult_t ncclNetSocketDevices(int* ndev) {
-  *ndev = ncclNetIfs;
+  *ndev = ncclNetSocketMerged ? 1 : ncclNetIfs;
   return ncclSuccess;
 }
 
@@ -92,11 +111,20 @@ static ncclResult_t ncclNetSocketGetSpeed(char* devName, int* speed) {
 }
 
 ncclResult_t ncclNetSocketGetProperties(int dev, ncclNetProperties_t* props) {
-  props->name = ncclNetSocketDevs[dev].devName;
+  props->name = ncclNetSocketMerged ? ncclNetSocketMergedName : ncclNetSocketDevs[dev].devName;
   props->pciPath = ncclNetSocketDevs[dev].pciPath;
   props->guid = dev;
   props->ptrSupport = NCCL_PTR_HOST;
-  NCCLCHECK(ncclNetSocketGetSpeed(props->name, &props->speed));
+  if (ncclNetSocketMerged) {
+    props->speed = 0;
+    for (int i=0; i<ncclNetIfs; i++) {
+      int speed;
+      NCCLCHECK(ncclNetSocketGetSpeed(ncclNetSocketDevs[i].devName, &speed));
+      props->speed += speed;
+    }
+  } else {
+    NCCLCHECK(ncclNetSocketGetSpeed(props->name, &props->speed));
+  }
   props->latency = 0; // Not set
   props->port = 0;
   props->maxComms = 65536;
@@ -113,6 +141,19 @@ ncclResult_t ncclNetSocketGetProperties(int dev, ncclNetProperties_t* props) {
 
 NCCL_PARAM(SocketNsocksPerThread, "NSOCKS_PERTHREAD", -2);
 NCCL_PARAM(SocketNthreads, "SOCKET_NTHREADS", -2);
+// Progress the data sockets with io_uring from the calling thread instead of helper threads
+NCCL_PARAM(SocketUseUring, "SOCKET_USE_URING", 0);
+// Send large messages with MSG_ZEROCOPY, completing them once the kernel releases the pages
+NCCL_PARAM(SocketZeroCopy, "SOCKET_ZEROCOPY", 0);
+// SO_BUSY_POLL value (in usec) for receive sockets, 0 to disable
+NCCL_PARAM(SocketBusyPoll, "SOCKET_BUSY_POLL", 0);
+// Pinning pages costs more than copying small messages
+#define MIN_ZEROCOPY_SIZE (16*1024)
+// Messages below this size are sent on the control socket by the calling thread
+NCCL_PARAM(SocketInlineSize, "SOCKET_INLINE_SIZE", 0);
+// When set, chunks are sized so that each takes about this many usec on one
+// socket at the throughput measured so far
+NCCL_PARAM(SocketChunkTime, "SOCKET_CHUNK_TIME", 0);
 
 enum ncclNetSocketCommState {
   ncclNetSocketCommStateStart = 0,
@@ -120,6 +161,7 @@ enum ncclNetSocketCommState {
   ncclNetSocketCommStateAccept = 3,
   ncclNetSocketCommStateSend = 4,
   ncclNetSocketCommStateRecv = 5,
+  ncclNetSocketCommStateRecvIfs = 6,
 };
 
 struct ncclNetSocketCommStage {
@@ -134,14 +176,34 @@ struct ncclNetSocketHandle {
   uint64_t magic; // random number to help debugging
   int nSocks;
   int nThreads;
+  int nIfs; // More than 1 on a merged device, see ncclNetSocketIfs
   struct ncclNetSocketCommStage stage;
 };
 
+// On a merged device, the receiver listens on every interface. It sends this
+// on the control socket, which is then connected first, and the sender connects
+// data socket s to addrs[sockIf[s]].
+struct ncclNetSocketIfs {
+  int nIfs;
+  union ncclSocketAddress addrs[MAX_IFS];
+  uint8_t sockIf[MAX_SOCKETS];
+};
+
+// Zero-copy sends on a socket are numbered in order by the kernel; the error
+// queue then reports ranges of them as completed.
+struct ncclNetSocketZc {
+  uint32_t next; // Number of the next zero-copy send
+  uint32_t done; // All sends before this one have completed
+};
+
 struct ncclNetSocketTask {
   int op;
   void* data;
   int size;
   struct ncclSocket* sock;
+  struct ncclNetSocketZc* zc; // Non-NULL for zero-copy sends
+  uint32_t zcLast;
+  int zcPending;
   int offset;
   int used;
   ncclResult_t result;
@@ -157,6 +219,17 @@ struct ncclNetSocketRequest {
   struct ncclNetSocketComm* comm;
   struct ncclNetSocketTask* tasks[MAX_SOCKETS];
   int nSubs;
+  // Zero-copy state when sending on the control socket
+  int zcPending;
+  uint32_t zcLast;
+  uint64_t start; // When the subtasks were posted
+};
+
+// Sent on the control socket ahead of each message. The sender picks how the
+// message is split, so that both sides cut it the same way.
+struct ncclNetSocketHeader {
+  int size;
+  int chunkSize; // 0 when the data follows on the control socket
 };
 
 struct ncclNetSocketTaskQueue {
@@ -179,6 +252,9 @@ struct ncclNetSocketListenComm {
   int nSocks;
   int nThreads;
   int dev;
+  // Merged device: listening sockets of interfaces 1 and up, sock being interface 0
+  struct ncclNetSocketIfs ifs;
+  struct ncclSocket ifSocks[MAX_IFS];
 };
 
 struct ncclNetSocketComm {
@@ -192,8 +268,72 @@ struct ncclNetSocketComm {
   struct ncclNetSocketRequest requests[MAX_REQUESTS];
   pthread_t helperThread[MAX_THREADS];
   struct ncclNetSocketThreadResources threadResources[MAX_THREADS];
+  int zeroCopy;
+  double sockRate; // Bytes per ns on one socket, averaged over completed sends
+  struct ncclNetSocketZc ctrlZc;
+  struct ncclNetSocketZc zcs[MAX_SOCKETS];
+  // io_uring backend, replacing the helper threads
+  int useUring;
+  struct ncclUring uring;
+  struct ncclNetSocketTask* uringTasks;
+  int nUringTasks;
+  int nextUringTask;
+  struct ncclNetSocketIfs ifs; // Received while connecting to a merged device
 };
 
+// Send as much as possible without blocking, with MSG_ZEROCOPY. The data must
+// not be modified until ncclNetSocketZcPoll reports send number *last done.
+static ncclResult_t ncclNetSocketZcSend(struct ncclSocket* sock, struct ncclNetSocketZc* zc, void* data, int size, int* offset, uint32_t* last) {
+  while (*offset < size) {
+    int bytes = send(sock->fd, (char*)data+*offset, size-*offset, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (bytes == -1) {
+      if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) return ncclSuccess;
+      // ENOBUFS: the locked memory limit is reached; retry once earlier sends completed
+      if (errno == ENOBUFS) return ncclSuccess;
+      char line[SOCKET_NAME_MAXLEN+1];
+      WARN("NET/Socket : zero-copy send to %s failed : %s", ncclSocketToString(&sock->addr, line), strerror(errno));
+      return ncclRemoteError;
+    }
+    *last = zc->next++;
+    *offset += bytes;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclNetSocketZcPoll(struct ncclSocket* sock, struct ncclNetSocketZc* zc) {
+  while (1) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) return ncclSuccess;
+      WARN("NET/Socket : reading zero-copy completions failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      if (err->ee_errno != 0) {
+        WARN("NET/Socket : zero-copy send failed : %s", strerror(err->ee_errno));
+        return ncclRemoteError;
+      }
+      // err->ee_info..err->ee_data is the range of completed sends. TCP completes them in order.
+      if ((int32_t)(err->ee_data+1 - zc->done) > 0) zc->done = err->ee_data+1;
+    }
+  }
+}
+
+// Progress a send or receive; zero-copy sends also wait for their completion
+static ncclResult_t ncclNetSocketProgressZc(int op, struct ncclSocket* sock, struct ncclNetSocketZc* zc, void* data, int size, int* offset, uint32_t* zcLast, int* zcPending) {
+  if (zc == NULL) return ncclSocketProgress(op, sock, data, size, offset);
+  if (*offset < size) NCCLCHECK(ncclNetSocketZcSend(sock, zc, data, size, offset, zcLast));
+  NCCLCHECK(ncclNetSocketZcPoll(sock, zc));
+  if (*offset == size && (int32_t)(zc->done - *zcLast) > 0) *zcPending = 0;
+  return ncclSuccess;
+}
+
 void* persistentSocketThread(void *args_) {
   struct ncclNetSocketThreadResources* resource = (struct ncclNetSocketThreadResources*)args_;
   struct ncclNetSocketComm* comm = resource->comm;
@@ -208,8 +348,8 @@ void* persistentSocketThread(void *args_) {
         repeat = 0;
         for (int j=0; j<nSocksPerThread; j++) {
           struct ncclNetSocketTask* r = myQueue->tasks+i+j;
-          if (r != NULL && r->used == 1 && r->offset < r->size) {
-            r->result = ncclSocketProgress(r->op, r->sock, r->data, r->size, &r->offset);
+          if (r != NULL && r->used == 1 && (r->offset < r->size || r->zcPending)) {
+            r->result = ncclNetSocketProgressZc(r->op, r->sock, r->zc, r->data, r->size, &r->offset, &r->zcLast, &r->zcPending);
             if (r->result != ncclSuccess) {
               WARN("NET/Socket : socket progress error");
               return NULL;
@@ -280,8 +420,52 @@ end:
   return ncclSuccess;
 }
 
+// The control socket goes first on a merged device, so that the sender knows
+// the receiver's interfaces before connecting the data sockets.
+static int ncclNetSocketSockIndex(int nIfs, int i, int nSocks) {
+  if (nIfs <= 1) return i;
+  return i == 0 ? nSocks : i-1;
+}
+
+// Listen on every interface and spread the data sockets across them, in
+// proportion to their speed.
+static ncclResult_t ncclNetSocketListenIfs(struct ncclNetSocketListenComm* comm, uint64_t magic) {
+  // Use all interfaces, unless told otherwise
+  if (comm->nSocks < ncclNetIfs && ncclParamSocketNthreads() == -2 && ncclParamSocketNsocksPerThread() == -2) {
+    comm->nThreads = std::min(ncclNetIfs, MAX_THREADS);
+    comm->nSocks = comm->nThreads;
+  }
+  struct ncclNetSocketIfs* ifs = &comm->ifs;
+  ifs->nIfs = ncclNetIfs;
+  NCCLCHECK(ncclSocketGetAddr(&comm->sock, ifs->addrs+0));
+  for (int k=1; k<ncclNetIfs; k++) {
+    NCCLCHECK(ncclSocketInit(comm->ifSocks+k, &ncclNetSocketDevs[k].addr, magic, ncclSocketTypeNetSocket, NULL, 1));
+    NCCLCHECK(ncclSocketListen(comm->ifSocks+k));
+    NCCLCHECK(ncclSocketGetAddr(comm->ifSocks+k, ifs->addrs+k));
+  }
+  int speeds[MAX_IFS], counts[MAX_IFS];
+  for (int k=0; k<ncclNetIfs; k++) {
+    NCCLCHECK(ncclNetSocketGetSpeed(ncclNetSocketDevs[k].devName, speeds+k));
+    counts[k] = 0;
+  }
+  // Give each socket to the interface with the least sockets per unit of speed once it has it
+  for (int s=0; s<comm->nSocks; s++) {
+    int best = 0;
+    for (int k=1; k<ncclNetIfs; k++) {
+      if ((int64_t)(counts[k]+1)*speeds[best] < (int64_t)(counts[best]+1)*speeds[k]) best = k;
+    }
+    ifs->sockIf[s] = best;
+    counts[best]++;
+  }
+  char line[1024];
+  line[0] = '\0';
+  for (int k=0; k<ncclNetIfs; k++) snprintf(line+strlen(line), sizeof(line)-strlen(line), " %s:%d", ncclNetSocketDevs[k].devName, counts[k]);
+  INFO(NCCL_NET, "NET/Socket : Data sockets per interface%s", line);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclNetSocketListen(int dev, void* opaqueHandle, void** listenComm) {
-  if (dev < 0 || dev >= ncclNetIfs) { // data transfer socket is based on specified dev
+  if (dev < 0 || dev >= (ncclNetSocketMerged ? 1 : ncclNetIfs)) { // data transfer socket is based on specified dev
     return ncclInternalError;
   }
   struct ncclNetSocketHandle* handle = (struct ncclNetSocketHandle*) opaqueHandle;
@@ -294,38 +478,66 @@ ncclResult_t ncclNetSocketListen(int dev, void* opaqueHandle, void** listenComm)
   NCCLCHECK(ncclSocketListen(&comm->sock));
   NCCLCHECK(ncclSocketGetAddr(&comm->sock, &handle->connectAddr));
   NCCLCHECK(ncclNetSocketGetNsockNthread(dev, &comm->nSocks, &comm->nThreads));
+  if (ncclNetSocketMerged) NCCLCHECK(ncclNetSocketListenIfs(comm, handle->magic));
   handle->nSocks = comm->nSocks;
   handle->nThreads = comm->nThreads;
+  handle->nIfs = comm->ifs.nIfs;
   comm->dev = dev;
   *listenComm = comm;
   return ncclSuccess;
 }
 
+// Receive the interfaces of a merged device, once they start arriving
+static ncclResult_t ncclNetSocketRecvIfs(struct ncclSocket* sock, struct ncclNetSocketIfs* ifs, int nSocks, int* done) {
+  int offset = 0;
+  *done = 0;
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, sock, ifs, sizeof(*ifs), &offset));
+  if (offset == 0) return ncclSuccess;
+  if (offset < sizeof(*ifs)) NCCLCHECK(ncclSocketWait(NCCL_SOCKET_RECV, sock, ifs, sizeof(*ifs), &offset));
+  if (ifs->nIfs < 1 || ifs->nIfs > MAX_IFS) {
+    WARN("NET/Socket : invalid number of remote interfaces %d", ifs->nIfs);
+    return ncclInternalError;
+  }
+  for (int s=0; s<nSocks; s++) {
+    if (ifs->sockIf[s] >= ifs->nIfs) {
+      WARN("NET/Socket : invalid remote interface %d for socket %d", ifs->sockIf[s], s);
+      return ncclInternalError;
+    }
+  }
+  *done = 1;
+  return ncclSuccess;
+}
+
 ncclResult_t ncclNetSocketConnect(int dev, void* opaqueHandle, void** sendComm) {
-  if (dev < 0 || dev >= ncclNetIfs) { // data transfer socket is based on specified dev
+  if (dev < 0 || dev >= (ncclNetSocketMerged ? 1 : ncclNetIfs)) { // data transfer socket is based on specified dev
     return ncclInternalError;
   }
 
-  int ready;
+  int ready, done;
   struct ncclNetSocketHandle* handle = (struct ncclNetSocketHandle*) opaqueHandle;
   struct ncclNetSocketCommStage* stage = &handle->stage;
   struct ncclNetSocketComm* comm = stage->comm;
   uint8_t i = stage->iteration;
+  uint8_t idx;
   struct ncclSocket* sock = stage->sock;
   *sendComm = NULL;
 
   if (stage->state == ncclNetSocketCommStateConnect) goto socket_connect_check;
   if (stage->state == ncclNetSocketCommStateSend) goto socket_send;
+  if (stage->state == ncclNetSocketCommStateRecvIfs) goto socket_recv_ifs;
 
   NCCLCHECK(ncclCalloc(&comm, 1));
   stage->comm = comm;
   comm->nSocks = handle->nSocks;
   comm->nThreads = handle->nThreads;
   comm->dev = dev;
+  comm->useUring = ncclParamSocketUseUring();
   CUDACHECK(cudaGetDevice(&comm->cudaDev));
   for (; i<comm->nSocks+1; i++) {
-    sock = (i == comm->nSocks) ? &comm->ctrlSock : comm->socks+i;
-    NCCLCHECK(ncclSocketInit(sock, &handle->connectAddr, handle->magic, ncclSocketTypeNetSocket, NULL, 1));
+    idx = ncclNetSocketSockIndex(handle->nIfs, i, comm->nSocks);
+    sock = (idx == comm->nSocks) ? &comm->ctrlSock : comm->socks+idx;
+    NCCLCHECK(ncclSocketInit(sock, (handle->nIfs > 1 && idx < comm->nSocks) ? comm->ifs.addrs+comm->ifs.sockIf[idx] : &handle->connectAddr,
+          handle->magic, ncclSocketTypeNetSocket, NULL, 1));
 
     stage->sock = sock;
     stage->state = ncclNetSocketCommStateConnect;
@@ -338,9 +550,29 @@ socket_connect_check:
     stage->state = ncclNetSocketCommStateSend;
 
 socket_send:
-    int done = 0;
-    NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, sock, &i, sizeof(uint8_t), &done));
+    done = 0;
+    idx = ncclNetSocketSockIndex(handle->nIfs, i, comm->nSocks);
+    NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, sock, &idx, sizeof(uint8_t), &done));
     if (done == 0) return ncclSuccess;
+
+    if (handle->nIfs > 1 && idx == comm->nSocks) {
+      stage->state = ncclNetSocketCommStateRecvIfs;
+socket_recv_ifs:
+      NCCLCHECK(ncclNetSocketRecvIfs(&comm->ctrlSock, &comm->ifs, comm->nSocks, &done));
+      if (done == 0) return ncclSuccess;
+    }
+  }
+  if (ncclParamSocketZeroCopy()) {
+    int one = 1;
+    comm->zeroCopy = 1;
+    for (int s=0; s<comm->nSocks+1; s++) {
+      struct ncclSocket* sock = (s == comm->nSocks) ? &comm->ctrlSock : comm->socks+s;
+      if (setsockopt(sock->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        INFO(NCCL_NET, "NET/Socket : SO_ZEROCOPY not supported (%s), using regular sends", strerror(errno));
+        comm->zeroCopy = 0;
+        break;
+      }
+    }
   }
   *sendComm = comm;
   return ncclSuccess;
@@ -363,16 +595,21 @@ ncclResult_t ncclNetSocketAccept(void* listenComm, void** recvComm) {
   rComm->nSocks = lComm->nSocks;
   rComm->nThreads = lComm->nThreads;
   rComm->dev = lComm->dev;
+  rComm->useUring = ncclParamSocketUseUring();
   CUDACHECK(cudaGetDevice(&rComm->cudaDev));
   for (; i<rComm->nSocks+1; i++) {
     uint8_t sendSockIdx;
+    int idx, k;
+    // On a merged device, data socket idx arrives on the interface we gave it
+    idx = ncclNetSocketSockIndex(lComm->ifs.nIfs, i, rComm->nSocks);
+    k = (lComm->ifs.nIfs > 1 && idx < rComm->nSocks) ? lComm->ifs.sockIf[idx] : 0;
 
     NCCLCHECK(ncclCalloc(&sock, 1));
     NCCLCHECK(ncclSocketInit(sock));
     stage->sock = sock;
     stage->state = ncclNetSocketCommStateAccept;
     stage->iteration = i;
-    NCCLCHECK(ncclSocketAccept(sock, &lComm->sock));
+    NCCLCHECK(ncclSocketAccept(sock, k == 0 ? &lComm->sock : lComm->ifSocks+k));
 
 socket_accept_check:
     NCCLCHECK(ncclSocketReady(sock, &ready));
@@ -389,6 +626,19 @@ socket_recv:
     else
       memcpy(rComm->socks+sendSockIdx, sock, sizeof(struct ncclSocket));
     free(sock);
+    if (lComm->ifs.nIfs > 1 && sendSockIdx == rComm->nSocks) {
+      NCCLCHECK(ncclSocketSend(&rComm->ctrlSock, &lComm->ifs, sizeof(lComm->ifs)));
+    }
+  }
+  if (ncclParamSocketBusyPoll() > 0) {
+    int usecs = ncclParamSocketBusyPoll();
+    for (int s=0; s<rComm->nSocks+1; s++) {
+      struct ncclSocket* sock = (s == rComm->nSocks) ? &rComm->ctrlSock : rComm->socks+s;
+      if (setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0) {
+        INFO(NCCL_NET, "NET/Socket : Setting SO_BUSY_POLL failed : %s", strerror(errno));
+        break;
+      }
+    }
   }
   *recvComm = rComm;
 
@@ -411,6 +661,7 @@ ncclResult_t ncclNetSocketGetRequest(struct ncclNetSocketComm* comm, int op, voi
       r->used = 1;
       r->comm = comm;
       r->nSubs = 0;
+      r->zcPending = 0;
       *req = r;
       return ncclSuccess;
     }
@@ -419,7 +670,98 @@ ncclResult_t ncclNetSocketGetRequest(struct ncclNetSocketComm* comm, int op, voi
   return ncclInternalError;
 }
 
+// Set up the io_uring backend. Each task has at most one operation in flight, so
+// sizing the ring for all tasks means the SQ and CQ can never overflow.
+static ncclResult_t ncclNetSocketUringInit(struct ncclNetSocketComm* comm) {
+  comm->nUringTasks = MAX_REQUESTS * comm->nSocks;
+  if (ncclUringInit(&comm->uring, comm->nUringTasks) != ncclSuccess) {
+    INFO(NCCL_NET, "NET/Socket : io_uring not available, using helper threads");
+    comm->useUring = 0;
+    return ncclSuccess;
+  }
+  int fds[MAX_SOCKETS];
+  for (int i=0; i<comm->nSocks; i++) fds[i] = comm->socks[i].fd;
+  // Fixed files save the fd lookup on every operation; plain fds work too
+  ncclUringRegisterFiles(&comm->uring, fds, comm->nSocks);
+  NCCLCHECK(ncclCalloc(&comm->uringTasks, comm->nUringTasks));
+  INFO(NCCL_NET, "NET/Socket : Using io_uring for %d sockets%s", comm->nSocks, comm->uring.fixedFiles ? " (fixed files)" : "");
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclNetSocketUringPost(struct ncclNetSocketComm* comm, struct ncclNetSocketTask* t) {
+  struct io_uring_sqe* sqe = ncclUringGetSqe(&comm->uring);
+  if (sqe == NULL) {
+    WARN("NET/Socket : io_uring submission queue full");
+    return ncclInternalError;
+  }
+  sqe->opcode = t->op == NCCL_SOCKET_SEND ? IORING_OP_SEND : IORING_OP_RECV;
+  if (comm->uring.fixedFiles) {
+    sqe->fd = t->sock - comm->socks;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = t->sock->fd;
+  }
+  sqe->addr = (uint64_t)((char*)t->data + t->offset);
+  sqe->len = t->size - t->offset;
+  sqe->msg_flags = t->op == NCCL_SOCKET_SEND ? MSG_NOSIGNAL : 0;
+  sqe->user_data = (uint64_t)t;
+  return ncclSuccess;
+}
+
+// Reap completions, resubmit partial transfers, and submit everything queued in one call
+static ncclResult_t ncclNetSocketUringProgress(struct ncclNetSocketComm* comm) {
+  struct io_uring_cqe* cqe;
+  while ((cqe = ncclUringPeekCqe(&comm->uring)) != NULL) {
+    struct ncclNetSocketTask* t = (struct ncclNetSocketTask*)cqe->user_data;
+    int res = cqe->res;
+    ncclUringCqeSeen(&comm->uring);
+    if (res == -EAGAIN || res == -EINTR) {
+      res = 0;
+    } else if (res < 0 || (res == 0 && t->op == NCCL_SOCKET_RECV)) {
+      char line[SOCKET_NAME_MAXLEN+1];
+      if (res < 0) {
+        WARN("NET/Socket : io_uring %s to %s failed : %s", t->op == NCCL_SOCKET_SEND ? "send" : "recv", ncclSocketToString(&t->sock->addr, line), strerror(-res));
+      } else {
+        WARN("NET/Socket : Connection closed by remote peer %s", ncclSocketToString(&t->sock->addr, line, 0));
+      }
+      t->result = ncclRemoteError;
+      continue;
+    }
+    t->offset += res;
+    if (t->offset < t->size) NCCLCHECK(ncclNetSocketUringPost(comm, t));
+  }
+  NCCLCHECK(ncclUringSubmit(&comm->uring));
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclNetSocketGetUringTask(struct ncclNetSocketComm* comm, int op, void* data, int size, struct ncclNetSocketTask** req) {
+  for (int i=0; i<comm->nUringTasks; i++) {
+    struct ncclNetSocketTask* r = comm->uringTasks+comm->nextUringTask;
+    comm->nextUringTask = (comm->nextUringTask+1)%comm->nUringTasks;
+    if (r->used == 0) {
+      r->op = op;
+      r->data = data;
+      r->size = size;
+      r->sock = comm->socks + comm->nextSock;
+      r->zc = NULL; // Zero-copy is only implemented for the helper threads
+      r->zcPending = 0;
+      r->offset = 0;
+      r->result = ncclSuccess;
+      comm->nextSock = (comm->nextSock + 1) % comm->nSocks;
+      r->used = 1;
+      *req = r;
+      // Submitted with the next ncclNetSocketUringProgress call
+      NCCLCHECK(ncclNetSocketUringPost(comm, r));
+      return ncclSuccess;
+    }
+  }
+  WARN("NET/Socket : unable to allocate subtasks");
+  return ncclInternalError;
+}
+
 ncclResult_t ncclNetSocketGetTask(struct ncclNetSocketComm* comm, int op, void* data, int size, struct ncclNetSocketTask** req) {
+  if (comm->useUring && comm->uringTasks == NULL) NCCLCHECK(ncclNetSocketUringInit(comm));
+  if (comm->useUring) return ncclNetSocketGetUringTask(comm, op, data, size, req);
   int tid = comm->nextSock % comm->nThreads;
   struct ncclNetSocketThreadResources* res = comm->threadResources+tid;
   struct ncclNetSocketTaskQueue* queue = &res->threadTaskQueue;
@@ -443,6 +785,8 @@ ncclResult_t ncclNetSocketGetTask(struct ncclNetSocketComm* comm, int op, void*
     r->data = data;
     r->size = size;
     r->sock = comm->socks + comm->nextSock;
+    r->zc = (op == NCCL_SOCKET_SEND && comm->zeroCopy && size >= MIN_ZEROCOPY_SIZE) ? comm->zcs + comm->nextSock : NULL;
+    r->zcPending = r->zc ? 1 : 0;
     r->offset = 0;
     r->result = ncclSuccess;
     comm->nextSock = (comm->nextSock + 1) % comm->nSocks;
@@ -458,6 +802,17 @@ ncclResult_t ncclNetSocketGetTask(struct ncclNetSocketComm* comm, int op, void*
   return ncclInternalError;
 }
 
+static int ncclNetSocketChunkSize(struct ncclNetSocketComm* comm, int size) {
+  if (comm->nSocks == 0 || size == 0 || size < ncclParamSocketInlineSize()) return 0;
+  int chunkSize = MIN_CHUNKSIZE;
+  if (ncclParamSocketChunkTime() > 0 && comm->sockRate > 0) {
+    double rateChunk = comm->sockRate * 1000.0 * ncclParamSocketChunkTime();
+    if (rateChunk > chunkSize) chunkSize = rateChunk < INT_MAX ? (int)rateChunk : INT_MAX;
+  }
+  // Each request can be divided up to nSocks tasks
+  return std::max(chunkSize, DIVUP(size, comm->nSocks));
+}
+
 ncclResult_t ncclNetSocketTest(void* request, int* done, int* size) {
   *done = 0;
   struct ncclNetSocketRequest *r = (struct ncclNetSocketRequest*)request;
@@ -466,14 +821,17 @@ ncclResult_t ncclNetSocketTest(void* request, int* done, int* size) {
     return ncclInternalError;
   }
   if (r->used == 1) { /* try to send/recv size */
-    int data = r->size;
+    struct ncclNetSocketHeader header;
+    header.size = r->size;
+    header.chunkSize = r->op == NCCL_SOCKET_SEND ? ncclNetSocketChunkSize(r->comm, r->size) : 0;
     int offset = 0;
-    NCCLCHECK(ncclSocketProgress(r->op, r->ctrlSock, &data, sizeof(int), &offset));
+    NCCLCHECK(ncclSocketProgress(r->op, r->ctrlSock, &header, sizeof(header), &offset));
 
     if (offset == 0) return ncclSuccess; /* Not ready -- retry later */
 
-    // Not sure we could ever receive less than 4 bytes, but just in case ...
-    if (offset < sizeof(int)) NCCLCHECK(ncclSocketWait(r->op, r->ctrlSock, &data, sizeof(int), &offset));
+    // Not sure we could ever receive less than the header, but just in case ...
+    if (offset < sizeof(header)) NCCLCHECK(ncclSocketWait(r->op, r->ctrlSock, &header, sizeof(header), &offset));
+    int data = header.size;
 
     // Check size is less or equal to the size provided by the user
     if (r->op == NCCL_SOCKET_RECV && data > r->size) {
@@ -490,26 +848,35 @@ ncclResult_t ncclNetSocketTest(void* request, int* done, int* size) {
     r->used = 2; // done exchanging size
     // divide into subtasks
     int chunkOffset = 0, i = 0;
-    if (r->comm->nSocks > 0) {
-      // each request can be divided up to nSocks tasks
-      int taskSize = std::max(MIN_CHUNKSIZE, DIVUP(r->size, r->comm->nSocks));
+    if (header.chunkSize > 0) {
+      if (r->comm->nSocks == 0 || DIVUP(r->size, header.chunkSize) > r->comm->nSocks) {
+        WARN("NET/Socket : invalid chunk size %d for %d bytes on %d sockets", header.chunkSize, r->size, r->comm->nSocks);
+        return ncclInternalError;
+      }
       while (chunkOffset < r->size) {
-        int chunkSize = std::min(taskSize, r->size-chunkOffset);
+        int chunkSize = std::min(header.chunkSize, r->size-chunkOffset);
         NCCLCHECK(ncclNetSocketGetTask(r->comm, r->op, (char*)(r->data)+chunkOffset, chunkSize, r->tasks+i++));
         chunkOffset += chunkSize;
       }
     }
     r->nSubs = i;
+    r->start = clockNano();
   }
   if (r->used == 2) { // already exchanged size
     if (r->nSubs > 0) {
+      if (r->comm->useUring) NCCLCHECK(ncclNetSocketUringProgress(r->comm));
       int nCompleted = 0;
       for (int i=0; i<r->nSubs; i++) {
         struct ncclNetSocketTask* sub = r->tasks[i];
         if (sub->result != ncclSuccess) return sub->result;
-        if (sub->offset == sub->size) nCompleted++;
+        if (sub->offset == sub->size && sub->zcPending == 0) nCompleted++;
       }
       if (nCompleted == r->nSubs) {
+        if (r->op == NCCL_SOCKET_SEND && ncclParamSocketChunkTime() > 0) {
+          uint64_t elapsed = clockNano() - r->start;
+          double rate = (double)r->size / r->nSubs / std::max(elapsed, (uint64_t)1);
+          r->comm->sockRate = r->comm->sockRate == 0 ? rate : 0.9*r->comm->sockRate + 0.1*rate;
+        }
         if (size) *size = r->size;
         *done = 1;
         r->used = 0;
@@ -519,10 +886,12 @@ ncclResult_t ncclNetSocketTest(void* request, int* done, int* size) {
         }
       }
     } else { // progress request using main thread
-      if (r->offset < r->size) {
-        NCCLCHECK(ncclSocketProgress(r->op, r->ctrlSock, r->data, r->size, &r->offset));
+      struct ncclNetSocketZc* zc = (r->op == NCCL_SOCKET_SEND && r->comm->zeroCopy && r->size >= MIN_ZEROCOPY_SIZE) ? &r->comm->ctrlZc : NULL;
+      if (r->offset == 0 && zc) r->zcPending = 1;
+      if (r->offset < r->size || r->zcPending) {
+        NCCLCHECK(ncclNetSocketProgressZc(r->op, r->ctrlSock, zc, r->data, r->size, &r->offset, &r->zcLast, &r->zcPending));
       }
-      if (r->offset == r->size) {
+      if (r->offset == r->size && r->zcPending == 0) {
         if (size) *size = r->size;
         *done = 1;
         r->used = 0;
@@ -532,7 +901,7 @@ ncclResult_t ncclNetSocketTest(void* request, int* done, int* size) {
   return ncclSuccess;
 }
 
-ncclResult_t ncclNetSocketRegMr(void* comm, void* data, int size, int type, void** mhandle) {
+ncclResult_t ncclNetSocketRegMr(void* comm, void* data, size_t size, int type, void** mhandle) {
   return (type != NCCL_PTR_HOST) ? ncclInternalError : ncclSuccess;
 }
 ncclResult_t ncclNetSocketDeregMr(void* comm, void* mhandle) { return ncclSuccess; }
@@ -561,6 +930,10 @@ ncclResult_t ncclNetSocketCloseListen(void* opaqueComm) {
     int ready;
     NCCLCHECK(ncclSocketReady(&comm->sock, &ready));
     if (ready) NCCLCHECK(ncclSocketClose(&comm->sock));
+    for (int k=1; k<comm->ifs.nIfs; k++) {
+      NCCLCHECK(ncclSocketReady(comm->ifSocks+k, &ready));
+      if (ready) NCCLCHECK(ncclSocketClose(comm->ifSocks+k));
+    }
     free(comm);
   }
   return ncclSuccess;
@@ -580,6 +953,10 @@ ncclResult_t ncclNetSocketClose(void* opaqueComm) {
       }
       free(res->threadTaskQueue.tasks);
     }
+    if (comm->uringTasks) {
+      NCCLCHECK(ncclUringFini(&comm->uring));
+      free(comm->uringTasks);
+    }
     int ready;
     NCCLCHECK(ncclSocketReady(&comm->ctrlSock, &ready));
     if (ready) NCCLCHECK(ncclSocketClose(&comm->ctrlSock));
@@ -609,5 +986,9 @@ ncclNet_t ncclNetSocket = {
   ncclNetSocketTest,
   ncclNetSocketClose,
   ncclNetSocketClose,
-  ncclNetSocketCloseListen
+  ncclNetSocketCloseListen,
+  NULL, // No batched isend
+  NULL, // No batched test
+  NULL, // No receive signals
+  NULL  // No batched irecv
 };
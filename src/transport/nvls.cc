@@ -10,6 +10,7 @@
 #include "graph.h"
 #include "utils.h"
 #include "proxy.h"
+#include "register.h"
 
 #if CUDART_VERSION >= 12010
 
@@ -225,10 +226,12 @@ ncclResult_t nvlsGroupUnmapMem(struct ncclComm *comm, struct ncclNvlsSharedRes*
 #include "bootstrap.h"
 #include "channel.h"
 
-#define NVLS_MEM_ALIGN_SIZE (1 << 21)
+// Head and tail of a connection, each on its own 128B line
+#define NVLS_CREDIT_SIZE 256
 
 NCCL_PARAM(NvlsEnable, "NVLS_ENABLE", 2);
 NCCL_PARAM(NvlsChannels, "NVLS_NCHANNELS", 16);
+NCCL_PARAM(NvlsLazySetup, "NVLS_LAZY_SETUP", 1);
 
 ncclResult_t ncclNvlsInit(struct ncclComm* comm) {
   comm->nvlsSupport = 0;
@@ -237,6 +240,8 @@ ncclResult_t ncclNvlsInit(struct ncclComm* comm) {
   int gpuCount;
   NCCLCHECK(ncclTopoGetGpuCount(comm->topo, &gpuCount));
   if (!ncclParamNvlsEnable() || gpuCount <= 2) return ncclSuccess;
+  // A multicast object binds each GPU once
+  if (comm->sharedGpus) return ncclSuccess;
 
   CUdevice dev;
   int driverVersion;
@@ -261,12 +266,6 @@ ncclResult_t ncclNvlsInit(struct ncclComm* comm) {
 ncclResult_t ncclNvlsSetup(struct ncclComm* comm, struct ncclComm* parent) {
   if (comm->nvlsSupport == 0 || comm->nvlsChannels == 0) return ncclSuccess;
 
-  int nHeads = comm->channels[0].nvls.nHeads;
-  int headRank = comm->channels[0].nvls.headRank;
-
-  CUdevice dev;
-  CUCHECK(cuCtxGetDevice(&dev));
-
   ncclResult_t res = ncclSuccess;
   bool nvlsShare = true;
   if (parent && parent->nvlsSupport && parent->config.splitShare && parent->localRanks == comm->localRanks)
@@ -302,77 +301,10 @@ ncclResult_t ncclNvlsSetup(struct ncclComm* comm, struct ncclComm* parent) {
       NCCLCHECK(initNvlsChannel(comm, c, parent, false));
     }
 
-    size_t buffSize = comm->buffSizes[NCCL_PROTO_SIMPLE];
-    size_t memSize = NVLS_MEM_ALIGN_SIZE;
-    size_t nvlsPerRankSize = nChannels * 2 * (buffSize + memSize);
-    size_t nvlsTotalSize = nvlsPerRankSize * nHeads;
-
-    INFO(NCCL_INIT | NCCL_NVLS, "NVLS comm %p headRank %d nHeads %d buffSize %zi memSize %zi nvlsPerRankSize %zi nvlsTotalSize %zi",
-      comm, headRank, nHeads, buffSize, memSize, nvlsPerRankSize, nvlsTotalSize);
-
-    char* shareableHandle = resources->shareableHandle;
-    NCCLCHECKGOTO(nvlsGetProperties(comm, resources, dev, comm->localRanks, nvlsTotalSize), res, cleanup);
-    if (comm->localRank == 0) {
-      NCCLCHECKGOTO(nvlsGroupCreate(comm, resources, comm->localRank, comm->localRanks, shareableHandle), res, cleanup);
-      NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), res, cleanup);
-    } else {
-      NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), res, cleanup);
-      NCCLCHECKGOTO(nvlsGroupConnect(comm, resources, comm->localRankToRank[0], shareableHandle), res, cleanup);
-    }
-
-    NCCLCHECKGOTO(nvlsGroupAddDevice(comm, resources), res, cleanup);
-    NCCLCHECKGOTO(nvlsGroupBindMem(comm, resources), res, cleanup);
-    // Local intra-node barrier to ensure everyone has bound their memory to the group
-    NCCLCHECKGOTO(bootstrapBarrier(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, comm->localRankToRank[0]), res, cleanup);
-    NCCLCHECKGOTO(nvlsGroupMapMem(comm, resources), res, cleanup);
-
-    for (int h = 0; h < nHeads; h++) {
-      int nvlsPeer = comm->nRanks + 1 + h;
-      for (int c = 0; c < nChannels; c++) {
-        struct ncclChannel* channel = comm->channels + c;
-        char* mem = NULL;
-        struct ncclChannelPeer* peer = channel->peers[nvlsPeer];
-
-        // Reduce UC -> MC
-        mem = resources->ucBuff + (h * 2 * nChannels + c) * (buffSize + memSize);
-        peer->send[1].transportComm = &nvlsTransport.send;
-        peer->send[1].conn.buffs[NCCL_PROTO_SIMPLE] = mem;
-        peer->send[1].conn.head = (uint64_t*)(mem + buffSize);
-        peer->send[1].conn.tail = (uint64_t*)(mem + buffSize + memSize / 2);
-        mem = resources->mcBuff + (h * 2 * nChannels + c) * (buffSize + memSize);
-        peer->recv[0].transportComm = &nvlsTransport.recv;
-        peer->recv[0].conn.buffs[NCCL_PROTO_SIMPLE] = mem;
-        peer->recv[0].conn.head = (uint64_t*)(mem + buffSize);
-        peer->recv[0].conn.tail = (uint64_t*)(mem + buffSize + memSize / 2);
-        peer->recv[0].conn.flags |= NCCL_NVLS_MIN_POLL;
-
-        // Broadcast MC -> UC
-        mem = resources->ucBuff + ((h * 2 + 1) * nChannels + c) * (buffSize + memSize);
-        peer->recv[1].transportComm = &nvlsTransport.recv;
-        peer->recv[1].conn.buffs[NCCL_PROTO_SIMPLE] = mem;
-        peer->recv[1].conn.head = (uint64_t*)(mem + buffSize);
-        peer->recv[1].conn.tail = (uint64_t*)(mem + buffSize + memSize / 2);
-        mem = resources->mcBuff + ((h * 2 + 1) * nChannels + c) * (buffSize + memSize);
-        peer->send[0].transportComm = &nvlsTransport.send;
-        peer->send[0].conn.buffs[NCCL_PROTO_SIMPLE] = mem;
-        peer->send[0].conn.head = (uint64_t*)(mem + buffSize);
-        peer->send[0].conn.tail = (uint64_t*)(mem + buffSize + memSize / 2);
-        peer->send[0].conn.flags |= NCCL_NVLS_MIN_POLL;
-
-        struct ncclDevChannelPeer* addr;
-        CUDACHECKGOTO(cudaMemcpyAsync(&addr, comm->channels[c].devPeers + nvlsPeer, sizeof(struct ncclDevChannelPeer*), cudaMemcpyDeviceToHost, comm->sharedRes->hostStream.cudaStream), res, cleanup);
-        CUDACHECKGOTO(cudaMemcpyAsync(&addr->send[0], &peer->send[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, cleanup);
-        CUDACHECKGOTO(cudaMemcpyAsync(&addr->recv[0], &peer->recv[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, cleanup);
-        CUDACHECKGOTO(cudaMemcpyAsync(&addr->send[1], &peer->send[1].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, cleanup);
-        CUDACHECKGOTO(cudaMemcpyAsync(&addr->recv[1], &peer->recv[1].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, cleanup);
-
-        /*INFO(NCCL_INIT|NCCL_NVLS, "Peer %d Channel %d MC buff %p/%p UC Buff %p/%p",
-            nvlsPeer, c,
-            resources->mcBuff + (h*2*nChannels+c)*(buffSize+memSize),
-            resources->mcBuff + ((h*2+1)*nChannels+c)*(buffSize+memSize),
-            resources->ucBuff + (h*2*nChannels+c)*(buffSize+memSize),
-            resources->ucBuff + ((h*2+1)*nChannels+c)*(buffSize+memSize));*/
-      }
+    // Buffers are only allocated by the first NVLS operation, unless children may share them:
+    // the setup is collective and they could not agree on which communicator runs it.
+    if (!ncclParamNvlsLazySetup() || comm->config.splitShare) {
+      NCCLCHECKGOTO(ncclNvlsBufferSetup(comm), res, cleanup);
     }
   }
 
@@ -383,19 +315,295 @@ cleanup:
   return res;
 }
 
+ncclResult_t ncclNvlsBufferSetup(struct ncclComm* comm) {
+  struct ncclNvlsSharedRes* resources = comm->nvlsResources;
+  if (resources->inited) return ncclSuccess;
+
+  int nHeads = comm->channels[0].nvls.nHeads;
+  int headRank = comm->channels[0].nvls.headRank;
+  int nChannels = resources->nChannels;
+  bool lazy = comm->devComm != NULL;
+
+  CUdevice dev;
+  CUCHECK(cuCtxGetDevice(&dev));
+
+  // Data buffers first, then the credits of all connections, then the barriers of each channel.
+  size_t buffSize = comm->buffSizes[NCCL_PROTO_SIMPLE];
+  int nConns = nHeads * 2 * nChannels;
+  size_t creditOffset = nConns * buffSize;
+  size_t barrierOffset = creditOffset + nConns * NVLS_CREDIT_SIZE;
+  size_t nvlsTotalSize = barrierOffset + nChannels * NVLS_CREDIT_SIZE;
+
+  INFO(NCCL_INIT | NCCL_NVLS, "NVLS comm %p headRank %d nHeads %d buffSize %zi nvlsTotalSize %zi%s",
+    comm, headRank, nHeads, buffSize, nvlsTotalSize, lazy ? " (on first use)" : "");
+
+  // The first NVLS operation may be captured in a CUDA graph
+  ncclResult_t res = ncclSuccess;
+  cudaStream_t hostStream = comm->sharedRes->hostStream.cudaStream;
+  char* shareableHandle = resources->shareableHandle;
+  cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  NCCLCHECKGOTO(ncclStrongStreamAcquireUncaptured(&comm->sharedRes->hostStream), res, exit);
+
+  NCCLCHECKGOTO(nvlsGetProperties(comm, resources, dev, comm->localRanks, nvlsTotalSize), res, exit);
+  if (comm->localRank == 0) {
+    NCCLCHECKGOTO(nvlsGroupCreate(comm, resources, comm->localRank, comm->localRanks, shareableHandle), res, exit);
+    NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), res, exit);
+  } else {
+    NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), res, exit);
+    NCCLCHECKGOTO(nvlsGroupConnect(comm, resources, comm->localRankToRank[0], shareableHandle), res, exit);
+  }
+
+  NCCLCHECKGOTO(nvlsGroupAddDevice(comm, resources), res, exit);
+  NCCLCHECKGOTO(nvlsGroupBindMem(comm, resources), res, exit);
+  // Local intra-node barrier to ensure everyone has bound their memory to the group
+  NCCLCHECKGOTO(bootstrapBarrier(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, comm->localRankToRank[0]), res, exit);
+  NCCLCHECKGOTO(nvlsGroupMapMem(comm, resources), res, exit);
+
+  for (int h = 0; h < nHeads; h++) {
+    int nvlsPeer = comm->nRanks + 1 + h;
+    for (int c = 0; c < nChannels; c++) {
+      struct ncclChannel* channel = comm->channels + c;
+      struct ncclChannelPeer* peer = channel->peers[nvlsPeer];
+      // Reduce UC -> MC
+      size_t reduce = h * 2 * nChannels + c;
+      // Broadcast MC -> UC
+      size_t bcast = (h * 2 + 1) * nChannels + c;
+
+      peer->send[1].transportComm = &nvlsTransport.send;
+      peer->send[1].conn.buffs[NCCL_PROTO_SIMPLE] = resources->ucBuff + reduce * buffSize;
+      peer->send[1].conn.head = (uint64_t*)(resources->ucBuff + creditOffset + reduce * NVLS_CREDIT_SIZE);
+      peer->send[1].conn.tail = (uint64_t*)(resources->ucBuff + creditOffset + reduce * NVLS_CREDIT_SIZE + NVLS_CREDIT_SIZE / 2);
+      peer->recv[0].transportComm = &nvlsTransport.recv;
+      peer->recv[0].conn.buffs[NCCL_PROTO_SIMPLE] = resources->mcBuff + reduce * buffSize;
+      peer->recv[0].conn.head = (uint64_t*)(resources->mcBuff + creditOffset + reduce * NVLS_CREDIT_SIZE);
+      peer->recv[0].conn.tail = (uint64_t*)(resources->mcBuff + creditOffset + reduce * NVLS_CREDIT_SIZE + NVLS_CREDIT_SIZE / 2);
+      peer->recv[0].conn.flags |= NCCL_NVLS_MIN_POLL;
+
+      peer->recv[1].transportComm = &nvlsTransport.recv;
+      peer->recv[1].conn.buffs[NCCL_PROTO_SIMPLE] = resources->ucBuff + bcast * buffSize;
+      peer->recv[1].conn.head = (uint64_t*)(resources->ucBuff + creditOffset + bcast * NVLS_CREDIT_SIZE);
+      peer->recv[1].conn.tail = (uint64_t*)(resources->ucBuff + creditOffset + bcast * NVLS_CREDIT_SIZE + NVLS_CREDIT_SIZE / 2);
+      peer->send[0].transportComm = &nvlsTransport.send;
+      peer->send[0].conn.buffs[NCCL_PROTO_SIMPLE] = resources->mcBuff + bcast * buffSize;
+      peer->send[0].conn.head = (uint64_t*)(resources->mcBuff + creditOffset + bcast * NVLS_CREDIT_SIZE);
+      peer->send[0].conn.tail = (uint64_t*)(resources->mcBuff + creditOffset + bcast * NVLS_CREDIT_SIZE + NVLS_CREDIT_SIZE / 2);
+      peer->send[0].conn.flags |= NCCL_NVLS_MIN_POLL;
+
+      struct ncclDevChannelPeer* addr;
+      CUDACHECKGOTO(cudaMemcpyAsync(&addr, comm->channels[c].devPeers + nvlsPeer, sizeof(struct ncclDevChannelPeer*), cudaMemcpyDeviceToHost, hostStream), res, exit);
+      // addr is read back from the device
+      CUDACHECKGOTO(cudaStreamSynchronize(hostStream), res, exit);
+      CUDACHECKGOTO(cudaMemcpyAsync(&addr->send[0], &peer->send[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, hostStream), res, exit);
+      CUDACHECKGOTO(cudaMemcpyAsync(&addr->recv[0], &peer->recv[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, hostStream), res, exit);
+      CUDACHECKGOTO(cudaMemcpyAsync(&addr->send[1], &peer->send[1].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, hostStream), res, exit);
+      CUDACHECKGOTO(cudaMemcpyAsync(&addr->recv[1], &peer->recv[1].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, hostStream), res, exit);
+    }
+  }
+
+  // Barriers of operations on registered buffers. Communicators sharing the resources of a
+  // parent keep running their kernels on the same streams, they never need their own.
+  for (int c = 0; c < nChannels; c++) {
+    struct ncclNvls* nvls = &comm->channels[c].nvls;
+    nvls->barrierUc = (uint64_t*)(resources->ucBuff + barrierOffset + c * NVLS_CREDIT_SIZE);
+    nvls->barrierMc = (uint64_t*)(resources->mcBuff + barrierOffset + c * NVLS_CREDIT_SIZE);
+    if (lazy) {
+      // The device communicator was already set up without them
+      struct ncclNvls* devNvls = &((struct ncclDevCommAndChannels*)comm->devComm)->channels[c].nvls;
+      CUDACHECKGOTO(cudaMemcpyAsync(&devNvls->barrierUc, &nvls->barrierUc, 2*sizeof(uint64_t*), cudaMemcpyHostToDevice, hostStream), res, exit);
+    }
+  }
+  if (lazy) CUDACHECKGOTO(cudaStreamSynchronize(hostStream), res, exit);
+  resources->inited = 1;
+
+exit:
+  NCCLCHECK(ncclStrongStreamRelease(ncclCudaGraphNone(), &comm->sharedRes->hostStream));
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  return res;
+}
+
 ncclResult_t ncclNvlsFree(struct ncclComm* comm) {
   struct ncclNvlsSharedRes* resources = (struct ncclNvlsSharedRes*)comm->nvlsResources;
   if (resources == NULL) return ncclSuccess;
 
   if (ncclAtomicRefCountDecrement(&resources->refCount) == 0) {
-    NCCLCHECK(nvlsGroupUnbind(comm, resources));
-    NCCLCHECK(nvlsGroupUnmapMem(comm, resources));
+    if (resources->inited) {
+      NCCLCHECK(nvlsGroupUnbind(comm, resources));
+      NCCLCHECK(nvlsGroupUnmapMem(comm, resources));
+    }
     free(resources);
     comm->nvlsResources = NULL;
   }
   return ncclSuccess;
 }
 
+struct ncclNvlsReg {
+  int id;
+  int dev;
+  CUmemGenericAllocationHandle mcHandle;
+  char* mcBuff;
+  size_t mcSize;
+  uintptr_t ucAddr; // Bound range of the registered buffer
+  size_t ucSize;
+};
+
+// What a rank can do with one buffer of an operation, exchanged between local ranks
+struct nvlsRegInfo {
+  int id;        // Binding the buffer is in, -1 if none
+  int canBind;   // Buffer is not bound yet and can be
+  int sameReg;   // Send and receive buffers are in the same registration
+  uintptr_t addr; // Start of the range to bind
+  size_t size;
+  size_t offset; // Of the buffer in the (to be) bound range
+};
+
+static ncclResult_t nvlsRegGetInfo(struct ncclComm* comm, const void* buff, size_t size, size_t granularity, struct ncclReg** outReg, struct nvlsRegInfo* info) {
+  uintptr_t begin = (uintptr_t)buff;
+  struct ncclReg* reg;
+  NCCLCHECK(ncclRegLookup(comm, buff, size, &reg));
+  *outReg = reg;
+  info->id = -1;
+  if (reg == NULL || reg->nvlsState == -1) return ncclSuccess;
+  if (reg->nvlsState == 1) {
+    info->id = reg->nvls->id;
+    info->offset = begin - reg->nvls->ucAddr;
+    return ncclSuccess;
+  }
+
+  // Only memory from cuMemCreate can be bound to a multicast object
+  CUmemGenericAllocationHandle handle;
+  if (CUPFN(cuMemRetainAllocationHandle)(&handle, (void*)reg->addr) != CUDA_SUCCESS) {
+    INFO(NCCL_NVLS, "NVLS cannot bind registered buffer %lx, it was not allocated with cuMem", reg->addr);
+    reg->nvlsState = -1;
+    return ncclSuccess;
+  }
+  CUCHECK(cuMemRelease(handle));
+  CUdeviceptr base;
+  size_t baseSize;
+  CUCHECK(cuMemGetAddressRange(&base, &baseSize, (CUdeviceptr)reg->addr));
+  info->addr = reg->addr & -granularity;
+  info->size = ROUNDUP(reg->addr+reg->size, granularity) - info->addr;
+  if (info->addr < base || info->addr+info->size > base+baseSize) {
+    INFO(NCCL_NVLS, "NVLS cannot bind registered buffer %lx, it is not aligned to %zi", reg->addr, granularity);
+    reg->nvlsState = -1;
+    return ncclSuccess;
+  }
+  info->canBind = 1;
+  info->offset = begin - info->addr;
+  return ncclSuccess;
+}
+
+// Binds the range described by info on every local rank to a new multicast object of mcSize bytes
+static ncclResult_t nvlsRegBind(struct ncclComm* comm, struct ncclReg* reg, struct nvlsRegInfo* info, size_t mcSize, size_t granularity) {
+  struct ncclNvlsSharedRes resources;
+  memset(&resources, 0, sizeof(resources));
+  CUdevice dev;
+  CUCHECK(cuCtxGetDevice(&dev));
+  resources.properties.size = resources.size = mcSize;
+  resources.properties.numDevices = comm->localRanks;
+  resources.properties.handleTypes = NVLS_CU_MEM_HANDLE_TYPE;
+  resources.granularity = granularity;
+  resources.accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  resources.accessDesc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  resources.accessDesc.location.id = dev;
+  resources.dev = dev;
+
+  char* shareableHandle = resources.shareableHandle;
+  if (comm->localRank == 0) {
+    NCCLCHECK(nvlsGroupCreate(comm, &resources, comm->localRank, comm->localRanks, shareableHandle));
+    NCCLCHECK(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE));
+  } else {
+    NCCLCHECK(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE));
+    NCCLCHECK(nvlsGroupConnect(comm, &resources, comm->localRankToRank[0], shareableHandle));
+  }
+  NCCLCHECK(nvlsGroupAddDevice(comm, &resources));
+  CUCHECK(cuMulticastBindAddr(resources.mcHandle, 0/*mcOffset*/, (CUdeviceptr)info->addr, info->size, 0/*flags*/));
+  NCCLCHECK(bootstrapBarrier(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, comm->localRankToRank[0]));
+  NCCLCHECK(nvlsGroupMapMem(comm, &resources));
+  NCCLCHECK(nvlsGroupDisconnect(comm, &resources));
+
+  struct ncclNvlsReg* nvls;
+  NCCLCHECK(ncclCalloc(&nvls, 1));
+  nvls->id = comm->nvlsRegId++;
+  nvls->dev = dev;
+  nvls->mcHandle = resources.mcHandle;
+  nvls->mcBuff = resources.mcBuff;
+  nvls->mcSize = mcSize;
+  nvls->ucAddr = info->addr;
+  nvls->ucSize = info->size;
+  reg->nvls = nvls;
+  reg->nvlsState = 1;
+  INFO(NCCL_NVLS, "NVLS bound registered buffer %lx size %zi to MC buffer %p id %d", info->addr, info->size, nvls->mcBuff, nvls->id);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclNvlsRegisterBuffers(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t size, bool* regUsed, void** mcSend, void** mcRecv) {
+  *regUsed = false;
+  ncclResult_t ret = ncclSuccess;
+  CUmulticastObjectProp prop;
+  memset(&prop, 0, sizeof(prop));
+  prop.size = size;
+  prop.numDevices = comm->localRanks;
+  prop.handleTypes = NVLS_CU_MEM_HANDLE_TYPE;
+  size_t granularity;
+  CUCHECK(cuMulticastGetGranularity(&granularity, &prop, CU_MULTICAST_GRANULARITY_MINIMUM));
+
+  const void* buffs[2] = { sendbuff, recvbuff };
+  struct ncclReg* regs[2];
+  void* mc[2];
+  struct nvlsRegInfo* infos;
+  NCCLCHECK(ncclCalloc(&infos, 2*comm->localRanks));
+  struct nvlsRegInfo* mine = infos+2*comm->localRank;
+  for (int sr=0; sr<2; sr++) NCCLCHECKGOTO(nvlsRegGetInfo(comm, buffs[sr], size, granularity, regs+sr, mine+sr), ret, exit);
+  // In place operations bind their registration once, with the send buffer
+  mine[1].sameReg = regs[0] != NULL && regs[0] == regs[1];
+  if (mine[1].sameReg) mine[1].canBind = 0;
+  NCCLCHECKGOTO(bootstrapIntraNodeAllGather(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, infos, 2*sizeof(struct nvlsRegInfo)), ret, exit);
+
+  for (int sr=0; sr<2; sr++) {
+    // Each rank needs the same offset in its range, since the multicast address is shared
+    bool sameOffset = true, bound = true, canBind = true, sameReg = true;
+    size_t mcSize = 0;
+    for (int r=0; r<comm->localRanks; r++) {
+      struct nvlsRegInfo* info = infos+2*r+sr;
+      sameOffset &= info->offset == infos[sr].offset;
+      bound &= info->id >= 0 && info->id == infos[sr].id;
+      canBind &= info->canBind == 1;
+      sameReg &= info->sameReg == 1;
+      mcSize = std::max(mcSize, info->size);
+    }
+    if (!sameOffset) goto exit;
+    if (sr == 1 && sameReg) {
+      if (regs[0]->nvlsState != 1) goto exit;
+      mine[1].offset = (uintptr_t)recvbuff - regs[0]->nvls->ucAddr;
+    } else if (!bound) {
+      if (!canBind) goto exit;
+      NCCLCHECKGOTO(nvlsRegBind(comm, regs[sr], mine+sr, mcSize, granularity), ret, exit);
+    }
+    mc[sr] = regs[sr]->nvls->mcBuff + mine[sr].offset;
+  }
+  *mcSend = mc[0];
+  *mcRecv = mc[1];
+  *regUsed = true;
+exit:
+  free(infos);
+  return ret;
+}
+
+ncclResult_t ncclNvlsDeregisterBuffer(struct ncclComm* comm, struct ncclReg* reg) {
+  struct ncclNvlsReg* nvls = reg->nvls;
+  if (nvls == NULL) return ncclSuccess;
+  INFO(NCCL_NVLS, "NVLS unbind registered buffer %lx size %zi id %d", nvls->ucAddr, nvls->ucSize, nvls->id);
+  CUCHECK(cuMulticastUnbind(nvls->mcHandle, nvls->dev, 0/*mcOffset*/, nvls->ucSize));
+  CUCHECK(cuMemUnmap((CUdeviceptr)nvls->mcBuff, nvls->mcSize));
+  CUCHECK(cuMemAddressFree((CUdeviceptr)nvls->mcBuff, nvls->mcSize));
+  CUCHECK(cuMemRelease(nvls->mcHandle));
+  free(nvls);
+  reg->nvls = NULL;
+  reg->nvlsState = 0;
+  return ncclSuccess;
+}
+
 #else
 
 /*
@@ -411,8 +619,21 @@ ncclResult_t ncclNvlsSetup(struct ncclComm* comm, struct ncclComm* parent) {
   return ncclSuccess;
 }
 
+ncclResult_t ncclNvlsBufferSetup(struct ncclComm* comm) {
+  return ncclSuccess;
+}
+
 ncclResult_t ncclNvlsFree(struct ncclComm* comm) {
   return ncclSuccess;
 }
 
+ncclResult_t ncclNvlsRegisterBuffers(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t size, bool* regUsed, void** mcSend, void** mcRecv) {
+  *regUsed = false;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclNvlsDeregisterBuffer(struct ncclComm* comm, struct ncclReg* reg) {
+  return ncclSuccess;
+}
+
 #endif /* CUDA_VERSION >= 12010 */
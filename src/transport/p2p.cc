@@ -9,6 +9,7 @@
 #include "utils.h"
 #include "shm.h"
 #include "p2p.h"
+#include "stats.h"
 
 enum p2pType { P2P_DIRECT, P2P_INTERMEDIATE, P2P_IPC, P2P_CUMEM };
 
@@ -21,6 +22,7 @@ struct ncclP2pBuff {
 struct p2pConnectInfo {
   int rank;
   int read;
+  int write; // Read connection which also has a receiver side SIMPLE buffer
   struct ncclP2pBuff p2pBuff;
   // Used by CE memcpy
   char shmName[7];
@@ -62,6 +64,7 @@ struct p2pResources {
   };
   void* sendMemIpc;
   void* recvMemIpc;
+  int write;
   // CE memcpy support
   struct p2pShmProxyInfo proxyInfo;
   struct p2pShm* shm;
@@ -99,15 +102,35 @@ NCCL_PARAM(P2pUseCudaMemcpy, "P2P_USE_CUDA_MEMCPY", 0);
 static int useMemcpy = 0;
 static void initCeOperation();
 
+// With cuMem, buffers are shared through POSIX fds passed over Unix sockets
+// rather than legacy IPC handles, which works between containers that do not
+// share /dev/shm (or a PID namespace) as long as they share a network namespace.
+NCCL_PARAM(P2pCuMemIsolated, "P2P_CUMEM_ISOLATED", 1);
+
 /* Determine if two peers can communicate through p2p */
 ncclResult_t p2pCanConnect(int* ret, struct ncclTopoSystem* topo, struct ncclTopoGraph* graph, struct ncclPeerInfo* info1, struct ncclPeerInfo* info2) {
   initCeOperation();
 
   // Rule out different nodes / isolated containers
-  if (info1->hostHash != info2->hostHash || info1->shmDev != info2->shmDev) {
+  if (info1->hostHash != info2->hostHash) {
     *ret = 0;
     return ncclSuccess;
   }
+  if (info1->shmDev != info2->shmDev) {
+    // The CE memcpy mode goes through /dev/shm
+    if (!(ncclCuMemEnable() && NCCL_P2P_HANDLE_TYPE == CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR &&
+          ncclParamP2pCuMemIsolated() && !useMemcpy)) {
+      *ret = 0;
+      return ncclSuccess;
+    }
+    TRACE(NCCL_INIT|NCCL_P2P, "Peers %lx and %lx do not share /dev/shm, trying P2P through cuMem fds", info1->busId, info2->busId);
+  }
+
+  // Ranks sharing a GPU (NCCL_SHARED_GPU) use each other's buffers as plain device memory
+  if (info1->busId == info2->busId) {
+    *ret = 1;
+    return ncclSuccess;
+  }
 
   // Check topology / p2p level.
   int intermediateRank;
@@ -279,9 +302,43 @@ ncclResult_t ncclP2pImportShareableBuffer(struct ncclComm *comm, int tpPeer, siz
   return ncclSuccess;
 }
 
+ncclResult_t ncclP2pMapPeerBuffer(struct ncclComm* comm, int peer, size_t size, ncclIpcDesc* ipcDesc, void* peerPtr, void** ptr, int* imported) {
+  struct ncclPeerInfo* myInfo = comm->peerInfo+comm->rank;
+  struct ncclPeerInfo* peerInfo = comm->peerInfo+peer;
+  *imported = 0;
+  if (peerInfo->pidHash == myInfo->pidHash && (!ncclCuMemEnable() || peerInfo->cudaDev == myInfo->cudaDev)) {
+    if (peerInfo->cudaDev != myInfo->cudaDev) {
+      cudaError_t err = cudaDeviceEnablePeerAccess(peerInfo->cudaDev, 0);
+      if (err == cudaErrorPeerAccessAlreadyEnabled) {
+        cudaGetLastError();
+      } else if (err != cudaSuccess) {
+        WARN("failed to peer with device %d(=%lx): %d %s", peerInfo->cudaDev, peerInfo->busId, err, cudaGetErrorString(err));
+        return ncclInternalError;
+      }
+    }
+    *ptr = peerPtr;
+  } else {
+    NCCLCHECK(ncclP2pImportShareableBuffer(comm, comm->topParentRanks[peer], size, ipcDesc, ptr));
+    *imported = 1;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclP2pUnmapPeerBuffer(void* ptr) {
+  if (ncclCuMemEnable()) {
+    NCCLCHECK(ncclCudaFree(ptr));
+  } else {
+    CUDACHECK(cudaIpcCloseMemHandle(ptr));
+  }
+  return ncclSuccess;
+}
+
 // Setting this to non zero causes P2P to use Reads rather than Writes
 NCCL_PARAM(P2pReadEnable, "P2P_READ_ENABLE", -2);
 NCCL_PARAM(P2pDirectDisable, "P2P_DIRECT_DISABLE", 0);
+// Per channel size below which SIMPLE operations on ring/tree connections in read mode
+// go through a receiver side buffer instead (0 disables, costs one more SIMPLE buffer)
+NCCL_PARAM(P2pWriteThreshold, "P2P_WRITE_THRESHOLD", 0);
 
 static ncclResult_t p2pGetInfo(struct ncclTopoSystem* topo, struct ncclPeerInfo* info1, struct ncclPeerInfo* info2, int* read, int* intermediateRank) {
   int p2p;
@@ -340,7 +397,9 @@ ncclResult_t p2pSendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
   info->read = useRead;
   // For CollNet, use write for scatter-reduce (conn 1), read for broadcast-gather (conn 0)
   if (graph && connIndex == 1) info->read = 0;
-  const char* useReadStr = info->read ? "/read" : "";
+  info->write = info->read && graph && intermediateRank == -1 && ncclParamP2pWriteThreshold() > 0;
+  resources->write = info->write;
+  const char* useReadStr = info->write ? "/read+write" : info->read ? "/read" : "";
 
   int sendSize = sizeof(struct ncclSendMem);
   // For P2P Read the SIMPLE buffer is tagged on the end of the ncclSendMem structure
@@ -405,10 +464,14 @@ ncclResult_t p2pRecvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
   info->read = useRead;
   // For CollNet, use write for scatter-reduce (conn 1), read for broadcast-gather (conn 0)
   if (graph && connIndex == 1) info->read = 0;
+  info->write = info->read && graph && intermediateRank == -1 && useMemcpy == 0 && ncclParamP2pWriteThreshold() > 0;
+  resources->write = info->write;
 
   int recvSize = sizeof(struct ncclRecvMem);
   // For P2P Read the SIMPLE buffer is tagged on the end of the ncclSendMem structure
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) if (!(info->read && p == NCCL_PROTO_SIMPLE)) recvSize += comm->buffSizes[p];
+  // Read connections with a write path keep a SIMPLE buffer on both sides
+  if (info->write) recvSize += comm->buffSizes[NCCL_PROTO_SIMPLE];
   ALIGN_SIZE(recvSize, CUDA_IPC_MIN);
 
   if (intermediateRank == -1) {
@@ -460,6 +523,8 @@ static ncclResult_t p2pSendConnect(struct ncclComm* comm, struct ncclConnect* co
       buff += comm->buffSizes[p];
     }
   }
+  // Write path of read connections, after the LL and LL128 buffers of the receiver
+  if (resources->write && info->write) send->conn.buffWrite = buff;
 
   if (useMemcpy) {
     send->conn.tail = &resources->proxyInfo.ceRecvMem->tail;
@@ -515,6 +580,7 @@ ncclResult_t p2pRecvConnect(struct ncclComm* comm, struct ncclConnect* connectIn
       buff += comm->buffSizes[p];
     }
   }
+  if (resources->write && info->write) recv->conn.buffWrite = buff;
   return ncclSuccess;
 }
 
@@ -573,6 +639,7 @@ static ncclResult_t p2pSendProxySetup(struct ncclProxyConnection* connection, st
     memcpy(proxyInfo->shmName, shmPath+sizeof("/dev/shm/nccl-")-1, sizeof(proxyInfo->shmName));
 
     NCCLCHECK(ncclCudaHostCalloc(&proxyInfo->ceRecvMem, 1));
+    ncclProxyConnectionMem(proxyState, connection, proxyState->buffSizes[NCCL_PROTO_SIMPLE], proxyInfo->shmSize + sizeof(struct ncclRecvMem));
 
     if (respSize != sizeof(struct p2pShmProxyInfo)) return ncclInternalError;
     memcpy(respBuff, proxyInfo, sizeof(struct p2pShmProxyInfo));
@@ -583,6 +650,7 @@ static ncclResult_t p2pSendProxySetup(struct ncclProxyConnection* connection, st
     struct ncclP2pBuff* p2pBuff = (struct ncclP2pBuff*)respBuff;
     NCCLCHECK(ncclP2pAllocateShareableBuffer(size, &p2pBuff->ipcDesc, &p2pBuff->directPtr));
     p2pBuff->size = size;
+    ncclProxyConnectionMem(proxyState, connection, size, 0);
     if (ncclCuMemEnable()) {
       // cuMem API support
       struct p2pCuMemProxyInfo* proxyInfo;
@@ -604,6 +672,7 @@ static ncclResult_t p2pRecvProxySetup(struct ncclProxyConnection* connection, st
   struct ncclP2pBuff* p2pBuff = (struct ncclP2pBuff*)respBuff;
   NCCLCHECK(ncclP2pAllocateShareableBuffer(size, &p2pBuff->ipcDesc, &p2pBuff->directPtr));
   p2pBuff->size = size;
+  ncclProxyConnectionMem(proxyState, connection, size, 0);
   if (ncclCuMemEnable()) {
     // cuMem API support
     struct p2pCuMemProxyInfo* proxyInfo;
@@ -631,7 +700,27 @@ static ncclResult_t p2pSendProxyConnect(struct ncclProxyConnection* connection,
   return ncclSuccess;
 }
 
+// Registered buffers of local peers mapped by ncclRegFindP2p. They go through
+// connections which are never set up, and are unmapped when those are freed.
+struct p2pRegImports {
+  int n, max;
+  void** ptrs;
+};
+
+static ncclResult_t p2pRegImportsFree(struct ncclProxyConnection* connection) {
+  struct p2pRegImports* imports = (struct p2pRegImports*)connection->transportResources;
+  if (imports == NULL) return ncclSuccess;
+  // Do not check return code as CUDA may have already shut down
+  for (int i=0; i<imports->n; i++) cudaIpcCloseMemHandle(imports->ptrs[i]);
+  free(imports->ptrs);
+  free(imports);
+  connection->transportResources = NULL;
+  return ncclSuccess;
+}
+
 static ncclResult_t p2pSendProxyFree(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState) {
+  // Connections which were never set up only carry registered buffers of peers
+  if (connection->state == connInitialized) return p2pRegImportsFree(connection);
   // CE memcpy support
   if (useMemcpy) {
     struct p2pShmProxyInfo* proxyInfo = (struct p2pShmProxyInfo*)connection->transportResources;
@@ -679,6 +768,47 @@ static ncclResult_t p2pRecvProxyFree(struct ncclProxyConnection* connection, str
   return ncclSuccess;
 }
 
+static ncclResult_t p2pSendProxyRegister(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize, void* respBuff, int respSize) {
+  if (reqSize != sizeof(struct ncclP2pRegisterReq) || respSize != sizeof(void*)) return ncclInternalError;
+  if (connection->state != connInitialized) return ncclInternalError;
+  struct ncclP2pRegisterReq* req = (struct ncclP2pRegisterReq*)reqBuff;
+  struct p2pRegImports* imports = (struct p2pRegImports*)connection->transportResources;
+  if (imports == NULL) {
+    NCCLCHECK(ncclCalloc(&imports, 1));
+    connection->transportResources = imports;
+  }
+  if (imports->n == imports->max) {
+    int max = std::max(2*imports->max, 8);
+    NCCLCHECK(ncclRealloc(&imports->ptrs, imports->max, max));
+    imports->max = max;
+  }
+  void* ptr = NULL;
+  cudaError_t res = cudaIpcOpenMemHandle(&ptr, req->ipc, cudaIpcMemLazyEnablePeerAccess);
+  if (res != cudaSuccess) {
+    INFO(NCCL_P2P, "Could not map peer buffer : %s", cudaGetErrorString(res));
+    cudaGetLastError();
+    ptr = NULL;
+  } else {
+    imports->ptrs[imports->n++] = ptr;
+  }
+  *(void**)respBuff = ptr;
+  return ncclSuccess;
+}
+
+static ncclResult_t p2pSendProxyDeregister(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize) {
+  if (reqSize != sizeof(void*)) return ncclInternalError;
+  void* ptr = *(void**)reqBuff;
+  struct p2pRegImports* imports = (struct p2pRegImports*)connection->transportResources;
+  for (int i=0; imports && i<imports->n; i++) {
+    if (imports->ptrs[i] != ptr) continue;
+    imports->ptrs[i] = imports->ptrs[--imports->n];
+    CUDACHECK(cudaIpcCloseMemHandle(ptr));
+    return ncclSuccess;
+  }
+  WARN("P2P: deregistering unknown peer buffer %p", ptr);
+  return ncclInternalError;
+}
+
 // CE memcpy support
 static ncclResult_t p2pSendProxyProgress(struct ncclProxyState* proxyState, struct ncclProxyArgs* args) {
   if (args->state == ncclProxyOpReady) {
@@ -712,6 +842,8 @@ static ncclResult_t p2pSendProxyProgress(struct ncclProxyState* proxyState, stru
           int size = sizesFifo[buffSlot];
           CUDACHECK(cudaMemcpyAsync(resources->recvFifo+buffSlot*stepSize, resources->ceDevBuff+buffSlot*stepSize, size, cudaMemcpyDeviceToDevice, resources->stream));
           CUDACHECK(cudaEventRecord(resources->events[buffSlot], resources->stream));
+          sub->stepBytes[buffSlot] = size;
+          ncclProxyStatsRecord(proxyState, args, sub, 1, 0, size);
           sub->transmitted += args->sliceSteps;
         }
       }
@@ -720,6 +852,7 @@ static ncclResult_t p2pSendProxyProgress(struct ncclProxyState* proxyState, stru
         cudaError_t res = cudaEventQuery(resources->events[buffSlot]);
         if (res != cudaErrorNotReady) CUDACHECK(res);
         if (res == cudaSuccess) {
+          ncclProxyStatsRecord(proxyState, args, sub, 1, 1, sub->stepBytes[buffSlot]);
           sub->done += args->sliceSteps;
           // Notify SHM
           resources->shm->recvMem.tail = sub->base + sub->done;
@@ -740,7 +873,7 @@ static ncclResult_t p2pSendProxyProgress(struct ncclProxyState* proxyState, stru
 struct ncclTransport p2pTransport = {
   "P2P",
   p2pCanConnect,
-  { p2pSendSetup, p2pSendConnect, p2pSendFree, NULL, p2pSendProxySetup, NULL, p2pSendProxyFree, NULL },
+  { p2pSendSetup, p2pSendConnect, p2pSendFree, NULL, p2pSendProxySetup, NULL, p2pSendProxyFree, NULL, p2pSendProxyRegister, p2pSendProxyDeregister },
   { p2pRecvSetup, p2pRecvConnect, p2pRecvFree, NULL, p2pRecvProxySetup, NULL, p2pRecvProxyFree, NULL }
 };
 
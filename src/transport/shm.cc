@@ -6,6 +6,7 @@
 
 #include "comm.h"
 #include "shm.h"
+#include "stats.h"
 
 struct shmConnectInfo {
   char shmName[7];
@@ -22,6 +23,7 @@ struct shmSendResources {
   struct ncclSendMem* hostMem;
   struct ncclSendMem* devHostMem;
   ncclShmHandle_t hostHandle;
+  struct ncclProxyState* proxyState; // Where the segment is accounted
 };
 
 struct shmRecvResources {
@@ -33,6 +35,7 @@ struct shmRecvResources {
   struct ncclRecvMem* hostMem;
   struct ncclRecvMem* devHostMem;
   ncclShmHandle_t hostHandle;
+  struct ncclProxyState* proxyState; // Where the segment is accounted
 };
 
 #define SHM_SEND_SIDE 1
@@ -42,6 +45,10 @@ NCCL_PARAM(ShmUseCudaMemcpy, "SHM_USE_CUDA_MEMCPY", 0);
 NCCL_PARAM(ShmMemcpyMode, "SHM_MEMCPY_MODE", SHM_SEND_SIDE); // 1 is sender-side, 2 is receiver-side, 3 is both
 static int useMemcpySend = 0;
 static int useMemcpyRecv = 0;
+// Successive steps of a connection are copied on different streams, so that
+// they can use several copy engines and overlap with each other.
+#define NCCL_SHM_MAX_CE_STREAMS 4
+NCCL_PARAM(ShmCeStreams, "SHM_CE_STREAMS", 2);
 NCCL_PARAM(ShmLocality, "SHM_LOCALITY", SHM_RECV_SIDE); // 1 is sender-size, 2 is receiver-size
 static int shmLocality = 0;
 static void initCeOperation();
@@ -89,6 +96,8 @@ static ncclResult_t shmSendSetup(struct ncclComm* comm, struct ncclTopoGraph* gr
   }
   info->shmSize = resources->shmSize = shmSize;
   NCCLCHECK(ncclShmOpen(shmPath, resources->shmSize, (void**)&resources->hostMem, (void**)&resources->devHostMem, 1, &resources->hostHandle));
+  resources->proxyState = comm->proxyState;
+  ncclProxyStatsMem(resources->proxyState, NCCL_MEM_CONNECTIONS, 0, resources->shmSize);
   TRACE(NCCL_SHM,"Opened shmName %s shmSize %d", shmPath, info->shmSize);
   memcpy(info->shmName, shmPath+sizeof("/dev/shm/nccl-")-1, sizeof(info->shmName));
 
@@ -112,6 +121,8 @@ static ncclResult_t shmRecvSetup(struct ncclComm* comm, struct ncclTopoGraph* gr
   }
   info->shmSize = resources->shmSize = shmSize;
   NCCLCHECK(ncclShmOpen(shmPath, resources->shmSize, (void**)&resources->hostMem, (void**)&resources->devHostMem, 1, &resources->hostHandle));
+  resources->proxyState = comm->proxyState;
+  ncclProxyStatsMem(resources->proxyState, NCCL_MEM_CONNECTIONS, 0, resources->shmSize);
   TRACE(NCCL_SHM,"Opened shmName %s shmSize %d", shmPath, info->shmSize);
   memcpy(info->shmName, shmPath+sizeof("/dev/shm/nccl-")-1, sizeof(info->shmName));
 
@@ -127,7 +138,8 @@ struct shmProxyInfo {
 
   // used by progress only
   uint64_t step;
-  cudaStream_t stream;
+  int nStreams;
+  cudaStream_t streams[NCCL_SHM_MAX_CE_STREAMS];
   cudaEvent_t events[NCCL_STEPS];
 };
 
@@ -201,6 +213,7 @@ static ncclResult_t shmSendFree(struct ncclConnector* send) {
   if (resources) {
     NCCLCHECK(ncclShmClose(resources->hostHandle));
     NCCLCHECK(ncclShmClose(resources->remHandle));
+    ncclProxyStatsMem(resources->proxyState, NCCL_MEM_CONNECTIONS, 0, -(int64_t)resources->shmSize);
     free(resources);
   }
   return ncclSuccess;
@@ -211,11 +224,23 @@ static ncclResult_t shmRecvFree(struct ncclConnector* recv) {
   if (resources) {
     NCCLCHECK(ncclShmClose(resources->hostHandle));
     NCCLCHECK(ncclShmClose(resources->remHandle));
+    ncclProxyStatsMem(resources->proxyState, NCCL_MEM_CONNECTIONS, 0, -(int64_t)resources->shmSize);
     free(resources);
   }
   return ncclSuccess;
 }
 
+static ncclResult_t shmCeStreamsCreate(struct shmProxyInfo* proxyInfo) {
+  proxyInfo->nStreams = std::min(std::max((int)ncclParamShmCeStreams(), 1), NCCL_SHM_MAX_CE_STREAMS);
+  for (int i=0; i<proxyInfo->nStreams; i++) {
+    CUDACHECK(cudaStreamCreateWithFlags(proxyInfo->streams+i, cudaStreamNonBlocking));
+  }
+  for (int i=0; i<NCCL_STEPS; i++) {
+    CUDACHECK(cudaEventCreateWithFlags(proxyInfo->events+i, cudaEventDisableTiming));
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t shmSendProxyConnect(struct ncclProxyConnection* connection, struct ncclProxyState* proxyState, void* reqBuff, int reqSize, void* respBuff, int respSize, int* done) {
   struct shmProxyInfo* proxyInfo;
   NCCLCHECK(ncclCalloc(&proxyInfo, 1));
@@ -223,10 +248,8 @@ static ncclResult_t shmSendProxyConnect(struct ncclProxyConnection* connection,
   memcpy(proxyInfo, reqBuff, reqSize);
   NCCLCHECK(ncclCudaCalloc(&proxyInfo->devFifo, proxyState->buffSizes[NCCL_PROTO_SIMPLE]));
   NCCLCHECK(ncclCudaHostCalloc(&proxyInfo->ceRecvMem, 1));
-  CUDACHECK(cudaStreamCreateWithFlags(&proxyInfo->stream, cudaStreamNonBlocking));
-  for (int i=0; i<NCCL_STEPS; i++) {
-    CUDACHECK(cudaEventCreate(proxyInfo->events+i));
-  }
+  ncclProxyConnectionMem(proxyState, connection, proxyState->buffSizes[NCCL_PROTO_SIMPLE], sizeof(struct ncclRecvMem));
+  NCCLCHECK(shmCeStreamsCreate(proxyInfo));
   connection->proxyAppendPtr = &connection->proxyAppend;
   connection->transportResources = proxyInfo;
   if (respSize != sizeof(struct shmProxyInfo)) return ncclInternalError;
@@ -241,10 +264,8 @@ static ncclResult_t shmRecvProxyConnect(struct ncclProxyConnection* connection,
   memcpy(proxyInfo, reqBuff, reqSize);
   NCCLCHECK(ncclCudaCalloc(&proxyInfo->devFifo, proxyState->buffSizes[NCCL_PROTO_SIMPLE]));
   NCCLCHECK(ncclCudaHostCalloc(&proxyInfo->ceRecvMem, 1));
-  CUDACHECK(cudaStreamCreateWithFlags(&proxyInfo->stream, cudaStreamNonBlocking));
-  for (int i=0; i<NCCL_STEPS; i++) {
-    CUDACHECK(cudaEventCreate(proxyInfo->events+i));
-  }
+  ncclProxyConnectionMem(proxyState, connection, proxyState->buffSizes[NCCL_PROTO_SIMPLE], sizeof(struct ncclRecvMem));
+  NCCLCHECK(shmCeStreamsCreate(proxyInfo));
   connection->proxyAppendPtr = &connection->proxyAppend;
   connection->transportResources = proxyInfo;
   if (respSize != sizeof(struct shmProxyInfo)) return ncclInternalError;
@@ -256,7 +277,9 @@ static ncclResult_t shmSendProxyFree(struct ncclProxyConnection* connection, str
   struct shmProxyInfo* resources = (struct shmProxyInfo*)connection->transportResources;
 
   if (resources) {
-    CUDACHECK(cudaStreamDestroy(resources->stream));
+    for (int i=0; i<resources->nStreams; i++) {
+      CUDACHECK(cudaStreamDestroy(resources->streams[i]));
+    }
     NCCLCHECK(ncclCudaFree(resources->devFifo));
     NCCLCHECK(ncclCudaHostFree(resources->ceRecvMem));
     for (int i=0; i<NCCL_STEPS; i++) {
@@ -271,7 +294,9 @@ static ncclResult_t shmRecvProxyFree(struct ncclProxyConnection* connection, str
   struct shmProxyInfo* resources = (struct shmProxyInfo*)connection->transportResources;
 
   if (resources) {
-    CUDACHECK(cudaStreamDestroy(resources->stream));
+    for (int i=0; i<resources->nStreams; i++) {
+      CUDACHECK(cudaStreamDestroy(resources->streams[i]));
+    }
     NCCLCHECK(ncclCudaFree(resources->devFifo));
     NCCLCHECK(ncclCudaHostFree(resources->ceRecvMem));
     for (int i=0; i<NCCL_STEPS; i++) {
@@ -305,29 +330,36 @@ static ncclResult_t shmSendProxyProgress(struct ncclProxyState* proxyState, stru
           args->done++;
           continue;
       }
-      if (sub->transmitted < sub->done + NCCL_STEPS && sub->transmitted < sub->nsteps) {
+      // Issue the copies of all the steps the GPU has sent
+      volatile int* sizesFifo = resources->ceRecvMem->sizesFifo;
+      volatile uint64_t* recvTail = &resources->ceRecvMem->tail;
+      while (sub->transmitted < sub->done + NCCL_STEPS && sub->transmitted < sub->nsteps &&
+             *recvTail > sub->base+sub->transmitted) {
         int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
-        volatile int* sizesFifo = resources->ceRecvMem->sizesFifo;
-        volatile uint64_t* recvTail = &resources->ceRecvMem->tail;
-        // Check GPU has sent everything
-        if ((*recvTail > sub->base+sub->transmitted)) {
-          int size = sizesFifo[buffSlot];
-          CUDACHECK(cudaMemcpyAsync(resources->shmFifo+buffSlot*stepSize, resources->devFifo+buffSlot*stepSize, size, cudaMemcpyDeviceToHost, resources->stream));
-          CUDACHECK(cudaEventRecord(resources->events[buffSlot], resources->stream));
-          resources->recvMem->sizesFifo[buffSlot] = size;
-          __sync_synchronize(); // make sure sizesFifo is visible
-          sub->transmitted += args->sliceSteps;
-        }
+        cudaStream_t stream = resources->streams[((sub->base+sub->transmitted)/args->sliceSteps)%resources->nStreams];
+        int size = sizesFifo[buffSlot];
+        CUDACHECK(cudaMemcpyAsync(resources->shmFifo+buffSlot*stepSize, resources->devFifo+buffSlot*stepSize, size, cudaMemcpyDeviceToHost, stream));
+        CUDACHECK(cudaEventRecord(resources->events[buffSlot], stream));
+        sub->stepBytes[buffSlot] = size;
+        ncclProxyStatsRecord(proxyState, args, sub, 1, 0, size);
+        resources->recvMem->sizesFifo[buffSlot] = size;
+        __sync_synchronize(); // make sure sizesFifo is visible
+        sub->transmitted += args->sliceSteps;
+        args->idle = 0;
       }
       if (sub->done < sub->transmitted) {
-        int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
-        cudaError_t res = cudaEventQuery(resources->events[buffSlot]);
-        if (res != cudaErrorNotReady) CUDACHECK(res);
-        if (res == cudaSuccess) {
+        // Copies may complete out of order across streams, notify SHM in order
+        while (sub->done < sub->transmitted) {
+          int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
+          cudaError_t res = cudaEventQuery(resources->events[buffSlot]);
+          if (res != cudaErrorNotReady) CUDACHECK(res);
+          if (res != cudaSuccess) break;
+          ncclProxyStatsRecord(proxyState, args, sub, 1, 1, sub->stepBytes[buffSlot]);
           sub->done += args->sliceSteps;
-          // Notify SHM
-          resources->recvMem->tail = sub->base + sub->done;
+          args->idle = 0;
         }
+        // Notify SHM
+        resources->recvMem->tail = sub->base + sub->done;
         if (sub->done == sub->nsteps) {
           resources->step = sub->base + sub->nsteps;
           args->done++;
@@ -364,27 +396,34 @@ static ncclResult_t shmRecvProxyProgress(struct ncclProxyState* proxyState, stru
           args->done++;
           continue;
       }
-      if (sub->transmitted < sub->done + NCCL_STEPS && sub->transmitted < sub->nsteps) {
+      // Issue the copies of all the steps ready in SHM
+      volatile int* sizesFifo = resources->recvMem->sizesFifo;
+      volatile uint64_t* recvTail = &resources->recvMem->tail;
+      while (sub->transmitted < sub->done + NCCL_STEPS && sub->transmitted < sub->nsteps &&
+             *recvTail > sub->base+sub->transmitted) {
         int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
-        volatile int* sizesFifo = resources->recvMem->sizesFifo;
-        volatile uint64_t* recvTail = &resources->recvMem->tail;
-        // Check data is ready in SHM
-        if ((*recvTail > sub->base+sub->transmitted)) {
-          int size = sizesFifo[buffSlot];
-          CUDACHECK(cudaMemcpyAsync(resources->devFifo+buffSlot*stepSize, resources->shmFifo+buffSlot*stepSize, size, cudaMemcpyHostToDevice, resources->stream));
-          CUDACHECK(cudaEventRecord(resources->events[buffSlot], resources->stream));
-          sub->transmitted += args->sliceSteps;
-        }
+        cudaStream_t stream = resources->streams[((sub->base+sub->transmitted)/args->sliceSteps)%resources->nStreams];
+        int size = sizesFifo[buffSlot];
+        CUDACHECK(cudaMemcpyAsync(resources->devFifo+buffSlot*stepSize, resources->shmFifo+buffSlot*stepSize, size, cudaMemcpyHostToDevice, stream));
+        CUDACHECK(cudaEventRecord(resources->events[buffSlot], stream));
+        sub->stepBytes[buffSlot] = size;
+        ncclProxyStatsRecord(proxyState, args, sub, 0, 0, size);
+        sub->transmitted += args->sliceSteps;
+        args->idle = 0;
       }
       if (sub->done < sub->transmitted) {
-        int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
-        cudaError_t res = cudaEventQuery(resources->events[buffSlot]);
-        if (res != cudaErrorNotReady) CUDACHECK(res);
-        if (res == cudaSuccess) {
+        // Copies may complete out of order across streams, notify the GPU in order
+        while (sub->done < sub->transmitted) {
+          int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
+          cudaError_t res = cudaEventQuery(resources->events[buffSlot]);
+          if (res != cudaErrorNotReady) CUDACHECK(res);
+          if (res != cudaSuccess) break;
+          ncclProxyStatsRecord(proxyState, args, sub, 0, 1, sub->stepBytes[buffSlot]);
           sub->done += args->sliceSteps;
-          // Notify GPU
-          resources->ceRecvMem->tail = sub->base + sub->done;
+          args->idle = 0;
         }
+        // Notify GPU
+        resources->ceRecvMem->tail = sub->base + sub->done;
         if (sub->done == sub->nsteps) {
           resources->step = sub->base + sub->nsteps;
           args->done++;